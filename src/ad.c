@@ -7,8 +7,11 @@
 #include <inttypes.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
@@ -25,6 +28,9 @@
 #include "lib/trace_util.h"
 #include "lib/abc.h"
 #include "lib/ai.h"
+#include "lib/sendq.h"
+#include "lib/handoff.h"
+#include "lib/probes.h"
 
 #define PROCESS_PACKET_DROP	0
 #define PROCESS_PACKET_LOCAL	1  /* only forward to alocal */
@@ -40,6 +46,66 @@ struct message_process {
   char * debug_reason;     /* which code decided the packet disposition */
 };
 
+/* per-stage timing, sent to local programs that ask with a
+ * ALLNET_MGMT_STATS_REQ.  The counters are atomic, since with the
+ * forwarding pipeline the stages run in several threads */
+#define STAGE_SOCKET_READ	0	/* time spent waiting for a message */
+#define STAGE_VALIDATE		1	/* is_valid_message */
+#define STAGE_PROCESS		2	/* process_message or process_mgmt */
+#define STAGE_PCACHE_REQUEST	3	/* answering data requests from pcache */
+#define STAGE_SEND_OUT		4	/* send_out */
+#define STAGE_LOCAL_SEND	5	/* local_send from forwarding */
+#define NUM_STAGES		6
+struct stage_stats {
+  const char * name;
+  atomic_ullong count;
+  atomic_ullong max_us;
+  atomic_ullong buckets [ALLNET_STATS_BUCKETS];
+};
+static struct stage_stats stage_stats [NUM_STAGES] =
+  { { .name = "socket_read" }, { .name = "validate" },
+    { .name = "process" }, { .name = "pcache_request" },
+    { .name = "send_out" }, { .name = "local_send" } };
+
+/* record the time since start_us (from allnet_time_us) for this stage */
+static void record_stage (int stage, unsigned long long int start_us)
+{
+  unsigned long long int now = allnet_time_us ();
+  unsigned long long int delta = ((now > start_us) ? (now - start_us) : 0);
+  struct stage_stats * st = stage_stats + stage;
+  int bucket = binary_log (delta);
+  if (bucket >= ALLNET_STATS_BUCKETS)
+    bucket = ALLNET_STATS_BUCKETS - 1;
+  atomic_fetch_add_explicit (st->buckets + bucket, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&(st->count), 1, memory_order_relaxed);
+  unsigned long long int max =
+    atomic_load_explicit (&(st->max_us), memory_order_relaxed);
+  while ((delta > max) &&  /* if it fails, max has the new value */
+         (! atomic_compare_exchange_weak_explicit (&(st->max_us), &max, delta,
+                                                   memory_order_relaxed,
+                                                   memory_order_relaxed)))
+    ;
+}
+
+/* packet counters, sent with the stage timings to local programs that
+ * ask with an ALLNET_MGMT_STATS_REQ (lib/mgmt.h).  Always on, and atomic
+ * for the same reason as the stage timings */
+static atomic_ullong packet_counts [ALLNET_COUNT_TYPES] [ALLNET_COUNT_CLASSES]
+                                   [ALLNET_COUNT_COUNTERS];
+static unsigned long long int counters_start_ms = 0;
+
+static void count_packet (const char * message, int msize, int class,
+                          int counter, unsigned long long int amount)
+{
+  int type = ALLNET_COUNT_TYPES - 1;   /* unknown type */
+  if ((msize >= ALLNET_HEADER_SIZE) &&
+      (((const struct allnet_header *) message)->message_type <
+       ALLNET_COUNT_TYPES - 1))
+    type = ((const struct allnet_header *) message)->message_type;
+  atomic_fetch_add_explicit (&(packet_counts [type] [class] [counter]),
+                             amount, memory_order_relaxed);
+}
+
 /* limit the number of addresses from the routing table to which we send */
 #define ROUTING_ADDRS_MAX	4
 /* the number is higher for DHT packets, only sent once every 1/2 hour */
@@ -52,11 +118,14 @@ static struct socket_set sockets;
 static int sock_v4 = -1;    /* used to send packets to specific addresses */
 static int sock_v6 = -1;    /* used to send packets to specific addresses */
 
+/* when the forwarding pipeline is used, the throttling state and the
+ * send_out counters are shared among the worker and send threads */
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #define THROTTLE_SENDING    /* 2018/10/03: try this */
-#ifdef THROTTLE_SENDING
-/* throttle the number of messages sent by only sending high priority ones */
-static int priority_threshold = ALLNET_PRIORITY_EPSILON;
-#endif /* THROTTLE_SENDING */
+/* with THROTTLE_SENDING, forwarded packets are sent through the output
+ * queues of lib/sendq.h, which limit the rate to each remote address,
+ * and when the rate is exceeded, send the highest priority packets first */
 
 /* set the v4 flag for the given socket */
 static int set_ipv4 (struct socket_address_set * sock, void * ref)
@@ -67,6 +136,152 @@ static int set_ipv4 (struct socket_address_set * sock, void * ref)
   return 1;  /* don't delete */
 }
 
+/* allnetd may run as several processes, or shards, that share ALLNET_PORT
+ * (using SO_REUSEPORT), so the kernel spreads the peers among them, each
+ * with its own main loop (see astart -s).  Shard 0 is the designated
+ * shard: only shard 0 serves local programs, broadcasts, and atcpd.
+ * The other shards each have their own cache, and are linked to shard 0
+ * over the loopback ALLNET_SHARD_PORT, where each sees the other as just
+ * another peer.  So packets received by any shard are forwarded to
+ * shard 0, and through shard 0 to the local programs and other shards */
+static int shard_index = 0;
+static int shard_count = 1;
+static int shard_link_fd = -1;   /* the loopback socket to other shards */
+
+/* the ALLNET_COUNT_CLASS_* of a packet sent or received on this socket,
+ * to or from this address */
+static int count_class (int sockfd, int is_local, int is_broadcast,
+                        const struct sockaddr_storage * addr, socklen_t alen)
+{
+  if (is_local)
+    return ALLNET_COUNT_CLASS_LOCAL;
+  if ((sockfd == shard_link_fd) && (sockfd >= 0))
+    return ALLNET_COUNT_CLASS_SHARD;
+  if (is_broadcast)
+    return ALLNET_COUNT_CLASS_BROADCAST;
+  /* atcpd sends and receives on the loopback interface */
+  if (is_loopback_ip ((const struct sockaddr *) addr, alen))
+    return ALLNET_COUNT_CLASS_TCP;
+  if ((addr->ss_family == AF_INET6) &&
+      (! IN6_IS_ADDR_V4MAPPED
+           (&(((const struct sockaddr_in6 *) addr)->sin6_addr))))
+    return ALLNET_COUNT_CLASS_IPV6;
+  return ALLNET_COUNT_CLASS_IPV4;
+}
+
+static void count_received (const struct socket_read_result * r, int counter)
+{
+  int class = count_class (r->sock->sockfd, r->sock->is_local,
+                           r->sock->is_broadcast, &(r->from), r->alen);
+  count_packet (r->message, r->msize, class, counter, 1);
+}
+
+#ifdef THROTTLE_SENDING
+/* sendq_admit, counting the packets it drops */
+static int counted_admit (int sockfd, const struct sockaddr_storage * addr,
+                          socklen_t alen, const char * message, int msize,
+                          unsigned int priority)
+{
+  int result = sendq_admit (sockfd, addr, alen, message, msize, priority);
+  if (result == SENDQ_DROPPED)
+    count_packet (message, msize, count_class (sockfd, 0, 0, addr, alen),
+                  ALLNET_COUNT_THROTTLED, 1);
+  return result;
+}
+#endif /* THROTTLE_SENDING */
+
+/* set the shard and the number of shards, before calling allnet_daemon_main.
+ * the default is a single shard, index 0 */
+void allnet_daemon_set_shard (int index, int count)
+{
+  if ((count < 1) || (index < 0) || (index >= count))
+    return;
+  shard_index = index;
+  shard_count = count;
+}
+
+/* clear the global flags for the given socket */
+static int clear_global (struct socket_address_set * sock, void * ref)
+{
+  int sockfd = * ((int *) ref);
+  if (sock->sockfd == sockfd) {
+    sock->is_global_v4 = 0;
+    sock->is_global_v6 = 0;
+  }
+  return 1;  /* don't delete */
+}
+
+static void initialize_shard_link ()
+{
+  struct sockaddr_storage sas;
+  memset (&sas, 0, sizeof (sas));
+  struct sockaddr_in * sin = (struct sockaddr_in *) (&sas);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sin->sin_port = htons ((shard_index == 0) ? ALLNET_SHARD_PORT : 0);
+  socklen_t alen = sizeof (struct sockaddr_in);
+  int reuse_port = sockets.reuse_port;
+  sockets.reuse_port = 0;   /* only shard 0 may bind ALLNET_SHARD_PORT */
+  shard_link_fd = socket_create_bind (&sockets, 0, sas, alen, 0);
+  sockets.reuse_port = reuse_port;
+  if (shard_link_fd < 0) {
+    printf ("shard %d: unable to create shard link socket\n", shard_index);
+    return;
+  }
+  /* only send on this socket to the other shards */
+  socket_sock_loop (&sockets, clear_global, &shard_link_fd);
+  if (shard_index > 0) {   /* shard 0 is a permanent peer */
+    sin->sin_port = htons (ALLNET_SHARD_PORT);
+    struct socket_address_validity sav =
+      { .alive_rcvd = 0, .alive_sent = 0, .send_limit = 0,
+        .send_limit_on_recv = 0, .recv_limit = 0, .time_limit = 0,
+        .alen = alen };
+    memset (&(sav.keepalive_auth), 0, sizeof (sav.keepalive_auth));
+    memcpy (&(sav.addr), &sas, sizeof (sas));
+    if (socket_address_add (&sockets, shard_link_fd, sav) == NULL)
+      printf ("shard %d: unable to add shard 0 address\n", shard_index);
+  }
+}
+
+/* sockets handed over by the ad we are replacing (see lib/handoff.h) */
+static struct handoff_socket handed_over [HANDOFF_MAX_SOCKETS];
+static int num_handed_over = 0;
+static int handoff_listen_fd = -1;
+static int handoff_conn = -1;     /* set when a new ad asks for our sockets */
+
+/* give ad the sockets from the ad it replaces, before allnet_daemon_main */
+void allnet_daemon_set_handoff (const struct handoff_socket * sockets, int n)
+{
+  if (n > HANDOFF_MAX_SOCKETS)
+    n = HANDOFF_MAX_SOCKETS;
+  if (n > 0)
+    memcpy (handed_over, sockets, n * sizeof (sockets [0]));
+  num_handed_over = ((n > 0) ? n : 0);
+}
+
+static void add_handed_over_sockets (int * created_local, int * created_out)
+{
+  int i;
+  for (i = 0; i < num_handed_over; i++) {
+    struct handoff_socket * h = handed_over + i;
+    if (! socket_add (&sockets, h->sockfd, h->is_local, h->is_global_v6,
+                      h->is_global_v4, 0)) {
+      close (h->sockfd);
+      continue;
+    }
+    if (h->is_local) {
+      *created_local = 1;
+    } else {
+      *created_out = 1;
+      if (h->is_global_v6)
+        sock_v6 = h->sockfd;
+      else if (h->is_global_v4)
+        sock_v4 = h->sockfd;
+    }
+  }
+  num_handed_over = 0;
+}
+
 static void initialize_sockets ()
 {
   int created_local = 0;
@@ -83,52 +298,65 @@ static void initialize_sockets ()
   memcpy (&(sin6->sin6_addr), &(in6addr_loopback), sizeof (sin6->sin6_addr));
   sin->sin_family = AF_INET;
   sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sockets.reuse_port = (shard_count > 1);
+  if (num_handed_over > 0)   /* from the ad we are replacing */
+    add_handed_over_sockets (&created_local, &created_out);
 #ifdef ALLNET_USE_FORK
-  /* first the local port */
-  sin6->sin6_port = htons (ALLNET_LOCAL_PORT);
-  sin->sin_port = htons (ALLNET_LOCAL_PORT);
-  int local_v6 = socket_create_bind (&sockets, 1, sasv6, alen6, 0);
-  if (local_v6 < 0)
-    printf ("unable to create and bind to IPv6 local socket\n");
-  else
-    created_local = 1;
-  /* now IPv4 */
-  if ((socket_create_bind (&sockets, 1, sasv4, alen4, created_local) < 0) &&
-      (! created_local))
-    printf ("unable to create and bind to IPv4 local socket\n");
-  else                     /* created ipv4 socket, record this */
+  if ((shard_index > 0) ||   /* local programs only use shard 0 */
+      (created_local)) {     /* or the local sockets were handed over */
     created_local = 1;
+  } else {
+    /* first the local port */
+    sin6->sin6_port = htons (ALLNET_LOCAL_PORT);
+    sin->sin_port = htons (ALLNET_LOCAL_PORT);
+    int local_v6 = socket_create_bind (&sockets, 1, sasv6, alen6, 0);
+    if (local_v6 < 0)
+      printf ("unable to create and bind to IPv6 local socket\n");
+    else
+      created_local = 1;
+    /* now IPv4 */
+    if ((socket_create_bind (&sockets, 1, sasv4, alen4, created_local) < 0) &&
+        (! created_local))
+      printf ("unable to create and bind to IPv4 local socket\n");
+    else                     /* created ipv4 socket, record this */
+      created_local = 1;
+  }
 #else /* ALLNET_USE_FORK -- called directly, not through a socket */
   created_local = 1;
 #endif /* ALLNET_USE_FORK */
-  /* now the outside port */
-  memcpy (&(sin6->sin6_addr), &(in6addr_any), sizeof (sin6->sin6_addr));
-  sin6->sin6_port = htons (ALLNET_PORT);
-  sin->sin_addr.s_addr = htonl (INADDR_ANY);
-  sin->sin_port = htons (ALLNET_PORT);
-  sock_v6 = socket_create_bind (&sockets, 0, sasv6, alen6, 0);
-  if (sock_v6 < 0)
-    printf ("unable to create and bind to IPv6 out socket\n");
-  else
-    created_out = 1;
-  /* now IPv4 */
-  sock_v4 = socket_create_bind (&sockets, 0, sasv4, alen4, created_out);
-#ifndef ALLNET_USE_FORK  /* try a few different ports */
-  int loop_count = 0;
-  while ((! created_out) && (sock_v4 < 0) && (loop_count++ < 10)) {
-    int port = (int) random_int (ALLNET_PORT + 16, ALLNET_PORT + 256);
-    sin->sin_port = htons (port);
+  if (! created_out) {   /* now the outside port */
+    memcpy (&(sin6->sin6_addr), &(in6addr_any), sizeof (sin6->sin6_addr));
+    sin6->sin6_port = htons (ALLNET_PORT);
+    sin->sin_addr.s_addr = htonl (INADDR_ANY);
+    sin->sin_port = htons (ALLNET_PORT);
+    sock_v6 = socket_create_bind (&sockets, 0, sasv6, alen6, 0);
+    if (sock_v6 < 0)
+      printf ("unable to create and bind to IPv6 out socket\n");
+    else
+      created_out = 1;
+    /* now IPv4 */
     sock_v4 = socket_create_bind (&sockets, 0, sasv4, alen4, created_out);
-  }
+#ifndef ALLNET_USE_FORK  /* try a few different ports */
+    int loop_count = 0;
+    while ((! created_out) && (sock_v4 < 0) && (loop_count++ < 10)) {
+      int port = (int) random_int (ALLNET_PORT + 16, ALLNET_PORT + 256);
+      sin->sin_port = htons (port);
+      sock_v4 = socket_create_bind (&sockets, 0, sasv4, alen4, created_out);
+    }
 #endif /* ALLNET_USE_FORK */
-  if ((sock_v4 < 0) && (! created_out))
-    printf ("unable to create and bind to IPv4 out socket\n");
-  else if (created_out) {  /* ipv6 socket is valid, use it for ipv4 */
-    socket_sock_loop (&sockets, set_ipv4, &sock_v6);
-    /* sock_v4 = sock_v6; */
-  } else                   /* created ipv4 socket, record this */
-    created_out = 1;
-  int created_bc = add_local_broadcast_sockets (&sockets);
+    if ((sock_v4 < 0) && (! created_out))
+      printf ("unable to create and bind to IPv4 out socket\n");
+    else if (created_out) {  /* ipv6 socket is valid, use it for ipv4 */
+      socket_sock_loop (&sockets, set_ipv4, &sock_v6);
+      /* sock_v4 = sock_v6; */
+    } else                   /* created ipv4 socket, record this */
+      created_out = 1;
+  }
+  int created_bc = ((shard_index == 0) ? add_local_broadcast_sockets (&sockets)
+                                        : 0);
+  abc_schedule_broadcasts (&sockets, ABC_SCHEDULE_BROADCASTS);
+  if (shard_count > 1)
+    initialize_shard_link ();
   if ((! created_local) || ((! created_out) && (! created_bc)))
     exit (1);
   random_bytes (sockets.random_secret, sizeof (sockets.random_secret)); 
@@ -142,6 +370,12 @@ static unsigned char my_address [ADDRESS_SIZE];
 /* send at most 10 packets for every external data request */
 #define SEND_EXTERNAL_MAX	10
 
+/* forwarded data requests carry a summary of the IDs of this many of our
+ * most recently saved messages, so the next hop only sends us the others */
+#ifndef DATA_REQ_SUMMARY_IDS
+#define DATA_REQ_SUMMARY_IDS	512	/* 0 to not send summaries */
+#endif /* DATA_REQ_SUMMARY_IDS */
+
 /* the virtual clock is updated about every 10s. */
 #define VIRTUAL_CLOCK_SECONDS		10
 #define SEND_KEEPALIVES_LOCAL		1   /* send keepalive every 10sec */
@@ -161,14 +395,18 @@ static int keepalive_sent_this_virtual_clock = 0;
 static void update_virtual_clock ()
 {
   static long long int last_update = 0;
-  long long int now = allnet_time ();
+  long long int now = allnet_coarse_monotonic_ms () / 1000;  /* seconds */
   if (last_update + 10 < now) {
     virtual_clock++;
     last_update = now;
     socket_send_keepalives (&sockets, virtual_clock, SEND_KEEPALIVES_LOCAL,
                             SEND_KEEPALIVES_REMOTE);
     socket_update_time (&sockets, virtual_clock);
-    add_local_broadcast_sockets (&sockets);
+    if (shard_index == 0)
+      add_local_broadcast_sockets (&sockets);
+#ifdef THROTTLE_SENDING
+    sendq_init ();   /* in case the rates have changed */
+#endif /* THROTTLE_SENDING */
     keepalive_sent_this_virtual_clock = 0;
   }
 }
@@ -269,39 +507,6 @@ static void local_send (struct socket_set * s, const char * message, int msize,
 #endif /* ALLNET_USE_FORK */
 }
 
-/* sends the ack to the address, given that hp has the packet we are acking */
-static void send_ack (const char * ack, const struct allnet_header * hp,
-                      int sockfd, struct sockaddr_storage addr, socklen_t alen,
-                      int is_local)
-{
-#ifndef ALLNET_USE_FORK  /* sockfd may be -1 to indicate deliver directly */
-  if (sockfd < 0)
-    is_local = 0;        /* do not add priority to the message */
-#endif /* ALLNET_USE_FORK */
-  char message [ALLNET_HEADER_SIZE + MESSAGE_ID_SIZE + 4];
-  int msize = sizeof (message);
-  int expected_allnet_size = msize - 4;  /* the size without priority */
-  if (! is_local)
-    msize -= 4;
-  unsigned int size = 0;
-  init_ack (hp, (const unsigned char *) ack, NULL, ADDRESS_BITS,
-            message, &size);
-  if (size != expected_allnet_size)
-    printf ("send_ack: %d != actual size %d, l %d\n",
-            expected_allnet_size, size, is_local);
-  if (is_local)
-    writeb32 (message + (sizeof (message) - 4), ALLNET_PRIORITY_LOCAL);
-  /* send this ack back to the sender, no need to ack more widely */
-#ifndef ALLNET_USE_FORK  /* sockfd may be -1 to indicate deliver directly */
-  if (sockfd < 0) {
-    struct sockaddr_storage sas = { .ss_family = 0, };   /* ignored */
-    local_send (NULL, message, msize, ALLNET_PRIORITY_LOCAL, 0, sas, 0);
-    return;
-  }
-#endif /* ALLNET_USE_FORK */
-  socket_send_to_ip (sockfd, message, msize, addr, alen, "ad.c/send_ack");
-}
-
 static void send_routing_keepalive (int sockfd, struct sockaddr_storage addr,
                                     socklen_t alen)
 {
@@ -348,7 +553,7 @@ static int check_recent_address (struct sockaddr_storage addr)
   static int my_modulo = 11;  /* prime number < size of bitmap */
   static uint16_t bitmap = 0;
   static unsigned long long int start_time = 0;
-  unsigned long long int now = allnet_time ();
+  unsigned long long int now = allnet_coarse_monotonic_ms () / 1000;
   if (now > start_time + my_modulo) {  /* average at most one per second */
     bitmap = 0;
     start_time = now;
@@ -417,85 +622,14 @@ static void send_auth_response (int sockfd, struct sockaddr_storage addr,
 }
 
 #ifdef THROTTLE_SENDING
-static int new_priority_threshold (int old_priority_threshold,
-                                   long long int send_start,
-                                   long long int bytes_sent)
-{
-  int new_threshold = old_priority_threshold;  /* default */
-  static long long int measurement_start = 0;
-  static long long int measurement_time = 0;
-  static long long int measurement_bytes = 0;
-#define BASIC_MEASUREMENT_INTERVAL	1	/* 60? */
-  static long long int measurement_interval = BASIC_MEASUREMENT_INTERVAL;
-  long long int now = allnet_time_us ();
-  long long int delta = now - send_start;
-  measurement_time += delta;
-  measurement_bytes += bytes_sent;
-  long long int now_s = now / ALLNET_US_PER_S;
-  long long int delta_s = now_s - measurement_start;
-  /* throttle if we are averaging more than 8KB/second, or 
-   * if our send time is more than 1% -- since the measurement_time is
-   * in microseconds, the percentage is multiplied by 10,000, i.e. tenK */
-  const long long int max_rate = 8000;  /* 8KB/s -- later, configurable */
-  const long long int max_percent_tenK = 10000;  /* 1% for now */
-  if (now_s > measurement_start + measurement_interval) {
-    /* new interval, compute */
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-printf ("measured: %lld / %lld = %lldB/s, t%% %lld / %lld = %lld: thresh %08x",
-        measurement_bytes, delta_s, measurement_bytes / delta_s,
-        measurement_time, delta_s, measurement_time / delta_s,
-        old_priority_threshold);
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-    if ((bytes_sent > 0) &&
-        ((measurement_bytes / delta_s > max_rate) ||
-         (measurement_time / delta_s > max_percent_tenK))) {
-      new_threshold += (ALLNET_PRIORITY_MAX - old_priority_threshold) / 8;
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-printf (" -> %08x (slower)\n", new_threshold);
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-    } else if (((new_threshold > ALLNET_PRIORITY_EPSILON) &&
-                (measurement_bytes / delta_s < (max_rate / 2)) &&
-                (measurement_time / delta_s < (max_percent_tenK / 2))) ||
-               (bytes_sent == 0)) {
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-int debug_threshold = new_threshold;
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-      int decrease = ALLNET_PRIORITY_ONE_EIGHT;
-      new_threshold = (new_threshold > decrease) ? (new_threshold - decrease) :
-                      ALLNET_PRIORITY_EPSILON;
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-if (debug_threshold > new_threshold)
-printf (" -> %08x (faster)\n", new_threshold);
-else printf ("\n");
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-    } else {
-#ifdef DEBUG_FOR_DEVELOPER_OFF
-printf ("\n");
-#endif /* DEBUG_FOR_DEVELOPER_OFF */
-    }
-    if (new_threshold <= ALLNET_PRIORITY_EPSILON) { /* start new measurement */
-      measurement_start = now_s;
-      measurement_time = 0;
-      measurement_bytes = 0;
-      measurement_interval = BASIC_MEASUREMENT_INTERVAL;
-    } else {   /* continue to measure, until we get to less than max_rate */
-      measurement_interval = (now_s - measurement_start) +
-                             BASIC_MEASUREMENT_INTERVAL;
-    }
-  }
-  return new_threshold;
-}
-#undef BASIC_MEASUREMENT_INTERVAL
-
-static int skip_this_packet (int priority)
+/* called by socket_send_out_admit for each remote address */
+static int send_admit (struct socket_address_set * sock,
+                       struct socket_address_validity * sav,
+                       const char * message, int msize, void * ref)
 {
-  static int skipped = 0;
-  int skipping = 10;  /* normally, send 1 in 10 lower-priority packets */
-  if (priority_threshold >= ALLNET_ONE_HALF) skipping = 100; /* cut back */
-  if (priority_threshold >= ALLNET_PRIORITY_LOCAL_LOW) skipping = 1000; /* !! */
-  if ((priority < priority_threshold) && (skipped++ % skipping != 0))
-    return 1;
-  return 0;
+  unsigned int priority = * ((unsigned int *) ref);
+  return (counted_admit (sock->sockfd, &(sav->addr), sav->alen, message,
+                         msize, priority) == SENDQ_SEND_NOW);
 }
 #endif /* THROTTLE_SENDING */
 
@@ -509,6 +643,7 @@ static void send_out (const char * message, int msize,
                       struct sockaddr_storage * sent_to,
                       int * sent_num)
 {
+  ALLNET_PROBE4 (send_out, message, msize, priority, max_addrs);
   int sent_available = 0;
   int sent_index = 0;
   if (sent_num != NULL) {
@@ -516,10 +651,7 @@ static void send_out (const char * message, int msize,
     *sent_num = 0;
   }
 #ifdef THROTTLE_SENDING
-  if (throttle_and_count && (skip_this_packet (priority)))
-    return;
-  long long int send_start = allnet_time_us ();
-  long long int bytes_sent = 0;
+  int throttle = throttle_and_count;  /* only forwarded traffic is queued */
 #endif /* THROTTLE_SENDING */
   const struct allnet_header * hp = (const struct allnet_header *) message;
   /* only forward out if max_hops is reasonable and hops < max_hops */
@@ -545,10 +677,19 @@ print_buffer (&addrs [i], alens [i], NULL, alens [i], 1);
   static int sent_count = SEND_KEEPALIVES_EVERY;
   int send_keepalives = 0;
   /* send a keepalive whenever sent_count >= 19 */
+  pthread_mutex_lock (&send_mutex);
   if (sent_count++ >= SEND_KEEPALIVES_EVERY) {
     sent_count = 0;
     send_keepalives = 1;
   }
+  pthread_mutex_unlock (&send_mutex);
+  /* the messages to the routing addresses are all sent together.  If
+   * save_dest_address is not NULL, it points into the message, and
+   * each destination gets its own copy of the message */
+  struct socket_send_batch batch = { .count = 0 };
+  char * copies = NULL;
+  if ((save_dest_address != NULL) && (num_addrs > 0))
+    copies = allnet_packet_alloc (num_addrs * msize, "ad.c send_out copies");
   for (i = 0; i < num_addrs; i++) {
     struct sockaddr_storage dest = addrs [i];
     socklen_t alen = alens [i];
@@ -562,30 +703,36 @@ print_buffer (&addrs [i], alens [i], NULL, alens [i], 1);
 #endif /* __APPLE__ */
     }
     if (sockfd >= 0) {
-      if (send_keepalives) {
+      if (send_keepalives)
         send_routing_keepalive (sockfd, dest, alen);
-#ifdef THROTTLE_SENDING
-        bytes_sent += 48;
-#endif /* THROTTLE_SENDING */
-      }
+      const char * to_send = message;
       if (save_dest_address != NULL) {
         if (! (sockaddr_to_ia ((struct sockaddr *) (&dest), alen,
                                save_dest_address)))
           print_buffer (&dest, alen, "ad/send_out: unable to save", alen, 1);
+        memcpy (copies + i * msize, message, msize);
+        to_send = copies + i * msize;
       }
-      if (! socket_send_to_ip (sockfd, message, msize, dest, alen,
-                               "ad.c/send_out")) {
-        dht_send_error = 1;
 #ifdef THROTTLE_SENDING
-        bytes_sent += msize;
+      if ((throttle) && (counted_admit (sockfd, &dest, alen, to_send, msize,
+                                        priority) != SENDQ_SEND_NOW))
+        continue;   /* queued or dropped */
 #endif /* THROTTLE_SENDING */
-      } else {
-        if ((sent_to != NULL) && (sent_index < sent_available))
-          sent_to [sent_index] = dest;
-        sent_index++;
-      }
+      socket_send_batch_add (&batch, sockfd, to_send, msize, dest, alen);
     }
   }
+  socket_send_batch_flush (&batch, "ad.c/send_out");
+  for (i = 0; i < batch.count; i++) {
+    if (! batch.sent [i]) {
+      dht_send_error = 1;
+    } else {
+      if ((sent_to != NULL) && (sent_index < sent_available))
+        sent_to [sent_index] = batch.addrs [i];
+      sent_index++;
+    }
+  }
+  if (copies != NULL)
+    allnet_packet_free (copies);
   if (send_keepalives)
     socket_send_keepalives (&sockets, virtual_clock, SEND_KEEPALIVES_LOCAL,
                             SEND_KEEPALIVES_REMOTE);
@@ -593,20 +740,203 @@ print_buffer (&addrs [i], alens [i], NULL, alens [i], 1);
   struct sockaddr_storage * my_sent_to = ((sent_to == NULL) ? NULL :
                                           (sent_to + sent_index));
   int my_sent_num = minz (sent_available, sent_index);
-  socket_send_out (&sockets, message, msize, save_dest_address, virtual_clock,
-                   ((except == NULL) ? empty : *except), elen,
-                   my_sent_to, &my_sent_num);
+  unsigned int admit_priority = priority;
+  socket_send_out_admit (&sockets, message, msize, save_dest_address,
+                         virtual_clock, ((except == NULL) ? empty : *except),
+                         elen, my_sent_to, &my_sent_num,
+#ifdef THROTTLE_SENDING
+                         ((throttle) ? send_admit : NULL),
+#else /* THROTTLE_SENDING */
+                         NULL,
+#endif /* THROTTLE_SENDING */
+                         &admit_priority);
+  if (sockets.defer_broadcast)  /* sent in the next abc_send_window */
+    abc_queue_broadcast (&sockets, message, msize, save_dest_address,
+                         virtual_clock);
   if (dht_send_error)
     routing_expire_dht (&sockets);
   int sent_total = sent_index + my_sent_num;
   if (sent_num != NULL)
     *sent_num = sent_total;
-#ifdef THROTTLE_SENDING
-  bytes_sent += (msize + 48) * sent_total;
-  if (throttle_and_count)  /* don't count locally-sent traffic */
-    priority_threshold =
-      new_priority_threshold (priority_threshold, send_start, bytes_sent);
-#endif /* THROTTLE_SENDING */
+}
+
+/* outbound acks are held for up to ACK_AGGREGATE_MS, so that acks with
+ * the same header going the same way can be sent in a single packet.
+ * Acks sent directly to one address (by send_ack) are merged if they
+ * go to the same address, and acks forwarded by send_out are merged
+ * if they came from the same sender and are forwarded the same way.
+ * A packet is sent as soon as it has ALLNET_MAX_ACKS acks */
+#ifndef ACK_AGGREGATE_MS
+#define ACK_AGGREGATE_MS	5	/* 0 to send each ack at once */
+#endif /* ACK_AGGREGATE_MS */
+#define ACK_AGGREGATE_PACKETS	16	/* packets held at any one time */
+
+struct held_acks {
+  int in_use;
+  int direct;           /* 1 if sent to addr by sockfd, 0 for send_out */
+  int sockfd;           /* only used if direct */
+  struct sockaddr_storage addr;  /* except address for send_out */
+  socklen_t alen;
+  int priority;         /* only used for send_out */
+  int throttle;         /* only used for send_out */
+  unsigned long long int deadline;   /* monotonic ms */
+  int hsize;            /* header size, the acks follow */
+  int num_acks;
+  char packet [ALLNET_HEADER_SIZE + ALLNET_MAX_ACKS * MESSAGE_ID_SIZE];
+};
+static struct held_acks held_acks [ACK_AGGREGATE_PACKETS];
+static pthread_mutex_t held_acks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void send_held_acks (struct held_acks * h)
+{
+  int psize = h->hsize + h->num_acks * MESSAGE_ID_SIZE;
+  if (h->direct)
+    socket_send_to_ip (h->sockfd, h->packet, psize, h->addr, h->alen,
+                       "ad.c/send_held_acks");
+  else
+    send_out (h->packet, psize, NULL, ROUTING_ADDRS_MAX,
+              ((h->alen > 0) ? &(h->addr) : NULL), h->alen, h->priority,
+              h->throttle, NULL, NULL);
+}
+
+/* sends the held acks whose deadline has passed (all of them if force) */
+static void flush_held_acks (int force)
+{
+  unsigned long long int now = allnet_coarse_monotonic_ms ();
+  int i;
+  for (i = 0; i < ACK_AGGREGATE_PACKETS; i++) {
+    struct held_acks h;
+    h.in_use = 0;
+    pthread_mutex_lock (&held_acks_mutex);
+    if ((held_acks [i].in_use) && (force || (held_acks [i].deadline <= now))) {
+      h = held_acks [i];
+      held_acks [i].in_use = 0;
+    }
+    pthread_mutex_unlock (&held_acks_mutex);
+    if (h.in_use)   /* send without holding the mutex */
+      send_held_acks (&h);
+  }
+}
+
+/* returns 1 if the acks in the message are held to be sent later,
+ * 0 if the caller should send the message now */
+static int hold_acks (const char * message, int msize, int direct, int sockfd,
+                      const struct sockaddr_storage * addr, socklen_t alen,
+                      int priority, int throttle)
+{
+  if (ACK_AGGREGATE_MS <= 0)
+    return 0;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((msize < ALLNET_HEADER_SIZE) || (hp->message_type != ALLNET_TYPE_ACK))
+    return 0;
+  const char * acks = ALLNET_DATA_START (hp, hp->transport, msize);
+  int hsize = (int) (acks - message);
+  int num_acks = (msize - hsize) / MESSAGE_ID_SIZE;
+  if ((hsize != ALLNET_HEADER_SIZE) || (num_acks <= 0) ||
+      (hsize + num_acks * MESSAGE_ID_SIZE != msize) ||
+      (num_acks >= ALLNET_MAX_ACKS) || (alen > sizeof (struct sockaddr_storage)))
+    return 0;     /* unusual header, or already full: send it now */
+  struct held_acks full;   /* send this one when done, if it fills up */
+  full.in_use = 0;
+  pthread_mutex_lock (&held_acks_mutex);
+  struct held_acks * h = NULL;
+  int oldest = 0;
+  int i;
+  for (i = 0; i < ACK_AGGREGATE_PACKETS; i++) {
+    struct held_acks * p = held_acks + i;
+    if (! p->in_use) {
+      if (h == NULL)
+        h = p;
+      continue;
+    }
+    if (p->deadline < held_acks [oldest].deadline)
+      oldest = i;
+    if ((p->direct == direct) && (p->hsize == hsize) &&
+        ((! direct) || (p->sockfd == sockfd)) &&
+        ((direct) || (p->throttle == throttle)) &&
+        (p->num_acks + num_acks <= ALLNET_MAX_ACKS) &&
+        (same_sockaddr (&(p->addr), p->alen, addr, alen)) &&
+        (memcmp (p->packet, message, hsize) == 0)) {
+      int a;
+      for (a = 0; a < num_acks; a++) {   /* add the acks not yet held */
+        const char * ack = acks + a * MESSAGE_ID_SIZE;
+        int j;
+        for (j = 0; j < p->num_acks; j++)
+          if (memcmp (p->packet + hsize + j * MESSAGE_ID_SIZE, ack,
+                      MESSAGE_ID_SIZE) == 0)
+            break;
+        if (j >= p->num_acks)
+          memcpy (p->packet + hsize + (p->num_acks++) * MESSAGE_ID_SIZE, ack,
+                  MESSAGE_ID_SIZE);
+      }
+      if (priority > p->priority)
+        p->priority = priority;
+      if (p->num_acks >= ALLNET_MAX_ACKS) {   /* full, send it now */
+        full = *p;
+        p->in_use = 0;
+      }
+      pthread_mutex_unlock (&held_acks_mutex);
+      if (full.in_use)
+        send_held_acks (&full);
+      return 1;
+    }
+  }
+  if (h == NULL) {   /* no room, send the oldest to make room */
+    h = held_acks + oldest;
+    full = *h;
+  }
+  h->in_use = 1;
+  h->direct = direct;
+  h->sockfd = sockfd;
+  memset (&(h->addr), 0, sizeof (h->addr));
+  if (alen > 0)
+    memcpy (&(h->addr), addr, alen);
+  h->alen = alen;
+  h->priority = priority;
+  h->throttle = throttle;
+  h->deadline = allnet_coarse_monotonic_ms () + ACK_AGGREGATE_MS;
+  h->hsize = hsize;
+  h->num_acks = num_acks;
+  memcpy (h->packet, message, msize);
+  pthread_mutex_unlock (&held_acks_mutex);
+  if (full.in_use)
+    send_held_acks (&full);
+  return 1;
+}
+
+/* sends the ack to the address, given that hp has the packet we are acking */
+static void send_ack (const char * ack, const struct allnet_header * hp,
+                      int sockfd, struct sockaddr_storage addr, socklen_t alen,
+                      int is_local)
+{
+#ifndef ALLNET_USE_FORK  /* sockfd may be -1 to indicate deliver directly */
+  if (sockfd < 0)
+    is_local = 0;        /* do not add priority to the message */
+#endif /* ALLNET_USE_FORK */
+  char message [ALLNET_HEADER_SIZE + MESSAGE_ID_SIZE + 4];
+  int msize = sizeof (message);
+  int expected_allnet_size = msize - 4;  /* the size without priority */
+  if (! is_local)
+    msize -= 4;
+  unsigned int size = 0;
+  init_ack (hp, (const unsigned char *) ack, NULL, ADDRESS_BITS,
+            message, &size);
+  if (size != expected_allnet_size)
+    printf ("send_ack: %d != actual size %d, l %d\n",
+            expected_allnet_size, size, is_local);
+  if (is_local)
+    writeb32 (message + (sizeof (message) - 4), ALLNET_PRIORITY_LOCAL);
+  /* send this ack back to the sender, no need to ack more widely */
+#ifndef ALLNET_USE_FORK  /* sockfd may be -1 to indicate deliver directly */
+  if (sockfd < 0) {
+    struct sockaddr_storage sas = { .ss_family = 0, };   /* ignored */
+    local_send (NULL, message, msize, ALLNET_PRIORITY_LOCAL, 0, sas, 0);
+    return;
+  }
+#endif /* ALLNET_USE_FORK */
+  if ((! is_local) && (hold_acks (message, msize, 1, sockfd, &addr, alen, 0, 0)))
+    return;   /* sent with other acks to the same address */
+  socket_send_to_ip (sockfd, message, msize, addr, alen, "ad.c/send_ack");
 }
 
 static void update_dht ()
@@ -636,6 +966,11 @@ static struct socket_address_validity *
       .send_limit_on_recv = SEND_LIMIT_DEFAULT,
       .recv_limit = RECV_LIMIT_DEFAULT,
       .time_limit = limit, .alen = r.alen };
+  if (r.sock->sockfd == shard_link_fd) {   /* another shard, do not limit */
+    sav.send_limit = 0;
+    sav.send_limit_on_recv = 0;
+    sav.recv_limit = 0;
+  }
   memset (&(sav.keepalive_auth), 0, sizeof (sav.keepalive_auth));
   /* send a keepalive if: (a) this is a new keepalive, or (b) this is a
    * new (non-routing) address */
@@ -682,10 +1017,14 @@ static int send_message_to_one (const char * message, int msize, int priority,
   }
 #endif /* ALLNET_USE_FORK */
 #ifdef THROTTLE_SENDING
-  if (skip_this_packet (priority))
-    return 0;
-  long long int send_start = allnet_time_us ();
-  long long int bytes_sent = 0;
+  if (! sock->is_local) {
+    int admitted = counted_admit (sock->sockfd, &addr, alen, message, msize,
+                                  priority);
+    if (admitted == SENDQ_QUEUED)
+      return 1;
+    if (admitted == SENDQ_DROPPED)
+      return 0;
+  }
 #endif /* THROTTLE_SENDING */
 #ifdef LOG_PACKETS
   snprintf (alog->b, alog->s, "%s (%d bytes, prio %d, to pipe %d)\n",
@@ -706,41 +1045,56 @@ static int send_message_to_one (const char * message, int msize, int priority,
   }
   int result = socket_send_to_ip (sock->sockfd, message, msize, addr, alen,
                                   "ad.c/send_message_to_one");
-#ifdef THROTTLE_SENDING
-  if (! sock->is_local) {
-    bytes_sent += msize;
-    priority_threshold =
-      new_priority_threshold (priority_threshold, send_start, bytes_sent);
-  }
-#endif /* THROTTLE_SENDING */
   return result;
 }
 
-/* return the number of messages sent (r.n), or 0 if none */
-static int send_messages_to_one (struct pcache_result r,
-                                 struct socket_address_set * sock,
-                                 struct sockaddr_storage addr, socklen_t alen)
+/* where pcache_request_each should send the cached messages.  Messages
+ * to the internet are copied into a batch and sent together, so a train
+ * of messages of the same size can be sent with segmentation offload */
+struct send_cached {
+  struct socket_address_set * sock;
+  struct sockaddr_storage addr;
+  socklen_t alen;
+  struct socket_send_batch batch;
+  char * copies [SOCKET_SEND_BATCH_MAX];
+};
+
+static void send_cached_flush (struct send_cached * sc)
 {
-  if (r.n <= 0)
-    return 0;
-  if ((! sock->is_local) && (r.n > SEND_EXTERNAL_MAX))
-    r.n = SEND_EXTERNAL_MAX;
-  int result = 0;
+  if (sc->batch.count <= 0)
+    return;
+  socket_send_batch_flush (&(sc->batch), "ad.c/send_cached_flush");
   int i;
-  for (i = 0; i < r.n; i++) {
-    char * e = "unknown error";
-    if (is_valid_message (r.messages [i].message, r.messages [i].msize, &e)) {
-      result += send_message_to_one (r.messages [i].message,
-                                     r.messages [i].msize,
-                                     r.messages [i].priority,
-                                     sock, addr, alen);
-    } else if (strcmp ("expired packet", e) != 0) {
-      printf ("error: send_messages_to_one for invalid message (%s)\n", e);
-      print_buffer (r.messages [i].message, r.messages [i].msize, NULL, 100, 1);
-      print_packet (r.messages [i].message, r.messages [i].msize, NULL, 1);
-    }
+  for (i = 0; i < sc->batch.count; i++)
+    allnet_packet_free (sc->copies [i]);
+  sc->batch.count = 0;
+}
+
+/* called by pcache_request_each for each message, which pcache has
+ * already checked is valid */
+static int send_cached_message (const char * message, int msize,
+                                int priority, void * ref)
+{
+  struct send_cached * sc = (struct send_cached *) ref;
+  if ((sc->sock->sockfd < 0) || (sc->sock->is_local)) {
+    send_message_to_one (message, msize, priority, sc->sock,
+                         sc->addr, sc->alen);
+    return 1;
   }
-  return result;
+#ifdef THROTTLE_SENDING
+  if (counted_admit (sc->sock->sockfd, &(sc->addr), sc->alen, message, msize,
+                     priority) != SENDQ_SEND_NOW)
+    return 1;   /* queued or dropped */
+#endif /* THROTTLE_SENDING */
+  if (sc->batch.count >= SOCKET_SEND_BATCH_MAX)
+    send_cached_flush (sc);
+  /* the message is only valid until we return, so send a copy */
+  char * copy = allnet_packet_alloc (msize, "ad.c send_cached_message");
+  memcpy (copy, message, msize);
+  sc->copies [sc->batch.count] = copy;
+  socket_send_batch_add (&(sc->batch), sc->sock->sockfd, copy, msize,
+                         sc->addr, sc->alen);
+  return 1;
 }
 
 /* compute a forwarding priority for non-local messages */
@@ -762,10 +1116,11 @@ static unsigned int message_priority (char * message, struct allnet_header * hp,
        social_connection (social_net, verify, vsize, hp->source, hp->src_nbits,
                           hp->sig_algo, sig, sig_size, &valid);
   } else if (sig_size > 0) {
-    snprintf (alog->b, alog->s,
+    char desc [LOG_SIZE];  /* may run in several workers, so not alog->b */
+    snprintf (desc, sizeof (desc),
               "invalid sigsize: %d, %d + %d + 2 = %d <? %d\n",
               hp->sig_algo, hsize, sig_size, (hsize + sig_size + 2), size);
-    log_print (alog);
+    log_print_str (alog, desc);
   }
   /* track_rate is in track.[hc] */
   if (valid)
@@ -773,7 +1128,7 @@ static unsigned int message_priority (char * message, struct allnet_header * hp,
   else
     social_distance = UNKNOWN_SOCIAL_TIER;
   char * expiration = ALLNET_EXPIRATION (hp, hp->transport, size);
-  const unsigned long long int now = allnet_time ();
+  const unsigned long long int now = allnet_coarse_time ();
   const unsigned long long int evalue =
     ((expiration == NULL) ? 0 : readb64 (expiration));
   const unsigned int exp_delta =
@@ -832,6 +1187,105 @@ static int process_acks (struct allnet_header * hp, int size)
   return size;
 }
 
+/* reply to a local stats request, sending the reply to local programs */
+static void send_stats (const char * request, int rsize)
+{
+  const struct allnet_header * rhp = (const struct allnet_header *) request;
+  const char * rid = request + ALLNET_MGMT_HEADER_SIZE (rhp->transport);
+  if (rsize < (rid - request) + sizeof (struct allnet_mgmt_stats_req))
+    return;
+  int num_counts =
+    ALLNET_COUNT_TYPES * ALLNET_COUNT_CLASSES * ALLNET_COUNT_COUNTERS;
+  unsigned int data_size = sizeof (struct allnet_mgmt_header) +
+                           sizeof (struct allnet_mgmt_stats_reply) +
+                           NUM_STAGES * sizeof (struct allnet_mgmt_stats_stage)
+                           + num_counts * 8;
+  unsigned int total = 0;
+  struct allnet_header * hp =
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, 1, ALLNET_SIGTYPE_NONE,
+                        NULL, 0, NULL, 0, NULL, NULL, &total);
+  if (hp == NULL)
+    return;
+  hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+  char * buffer = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_STATS_REPLY;
+  struct allnet_mgmt_stats_reply * reply =
+    (struct allnet_mgmt_stats_reply *)
+      (buffer + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  memcpy (reply->request_id, rid, sizeof (reply->request_id));
+  reply->num_stages = NUM_STAGES;
+  reply->num_types = ALLNET_COUNT_TYPES;
+  reply->num_classes = ALLNET_COUNT_CLASSES;
+  reply->num_counters = ALLNET_COUNT_COUNTERS;
+  writeb64u (reply->uptime_ms, allnet_time_ms () - counters_start_ms);
+  int i, b;
+  for (i = 0; i < NUM_STAGES; i++) {
+    struct allnet_mgmt_stats_stage * sp = reply->stages + i;
+    struct stage_stats * st = stage_stats + i;
+    snprintf (sp->name, sizeof (sp->name), "%s", st->name);
+    writeb64u (sp->count, atomic_load (&(st->count)));
+    writeb64u (sp->max_us, atomic_load (&(st->max_us)));
+    for (b = 0; b < ALLNET_STATS_BUCKETS; b++)
+      writeb64u (sp->buckets [b], atomic_load (st->buckets + b));
+  }
+  unsigned char * counts = (unsigned char *) (reply->stages + NUM_STAGES);
+  atomic_ullong * packets = &(packet_counts [0] [0] [0]);
+  for (i = 0; i < num_counts; i++)
+    writeb64u (counts + 8 * i, atomic_load (packets + i));
+  struct sockaddr_storage empty;
+  memset (&empty, 0, sizeof (empty));
+  local_send (&sockets, buffer, total, ALLNET_PRIORITY_LOCAL,
+              virtual_clock, empty, 0);
+  allnet_packet_free (buffer);
+}
+
+/* reply to a local memory request, sending the reply to local programs */
+static void send_memory (const char * request, int rsize)
+{
+  const struct allnet_header * rhp = (const struct allnet_header *) request;
+  const char * rid = request + ALLNET_MGMT_HEADER_SIZE (rhp->transport);
+  if (rsize < (rid - request) + sizeof (struct allnet_mgmt_memory_req))
+    return;
+  unsigned int data_size = sizeof (struct allnet_mgmt_header) +
+                           sizeof (struct allnet_mgmt_memory_reply) +
+                           ALLNET_MEMORY_SUBSYSTEMS *
+                             sizeof (struct allnet_mgmt_memory_subsystem);
+  unsigned int total = 0;
+  struct allnet_header * hp =
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, 1, ALLNET_SIGTYPE_NONE,
+                        NULL, 0, NULL, 0, NULL, NULL, &total);
+  if (hp == NULL)
+    return;
+  hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+  char * buffer = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_MEMORY_REPLY;
+  struct allnet_mgmt_memory_reply * reply =
+    (struct allnet_mgmt_memory_reply *)
+      (buffer + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  memcpy (reply->request_id, rid, sizeof (reply->request_id));
+  writeb64u (reply->budget, allnet_memory_budget ());
+  reply->num_subsystems = ALLNET_MEMORY_SUBSYSTEMS;
+  int i;
+  for (i = 0; i < ALLNET_MEMORY_SUBSYSTEMS; i++) {
+    struct allnet_mgmt_memory_subsystem * sp = reply->subsystems + i;
+    long long int used = 0;
+    long long int peak = 0;
+    const char * name = allnet_memory_used (i, &used, &peak);
+    snprintf (sp->name, sizeof (sp->name), "%s", name);
+    writeb64u (sp->bytes, ((used > 0) ? used : 0));
+    writeb64u (sp->peak, ((peak > 0) ? peak : 0));
+  }
+  struct sockaddr_storage empty;
+  memset (&empty, 0, sizeof (empty));
+  local_send (&sockets, buffer, total, ALLNET_PRIORITY_LOCAL,
+              virtual_clock, empty, 0);
+  allnet_packet_free (buffer);
+}
+
 static struct message_process process_mgmt (struct socket_read_result *r)
 {
   /* if sent from local, use the priority they gave us */
@@ -876,6 +1330,22 @@ static struct message_process process_mgmt (struct socket_read_result *r)
     if (ahm->mgmt_type == ALLNET_MGMT_KEEPALIVE)
       drop.debug_reason = "keepalive";
     return drop;   /* do not forward beacons or keepalives */
+  case ALLNET_MGMT_STATS_REQ:
+    drop.debug_reason = "stats request";
+    if (r->sock->is_local)
+      send_stats (r->message, r->msize);
+    return drop;           /* only answered locally, never forwarded */
+  case ALLNET_MGMT_STATS_REPLY:
+    drop.debug_reason = "stats reply";
+    return drop;
+  case ALLNET_MGMT_MEMORY_REQ:
+    drop.debug_reason = "memory request";
+    if (r->sock->is_local)
+      send_memory (r->message, r->msize);
+    return drop;           /* only answered locally, never forwarded */
+  case ALLNET_MGMT_MEMORY_REPLY:
+    drop.debug_reason = "memory reply";
+    return drop;
   case ALLNET_MGMT_DHT:
     dht_process (r->message, r->msize, (struct sockaddr *) &(r->from), r->alen);
     all.debug_reason = "dht";
@@ -886,8 +1356,10 @@ static struct message_process process_mgmt (struct socket_read_result *r)
     return all;
   case ALLNET_MGMT_TRACE_REQ:
     drop.debug_reason = "trace request seen before";
-    if (pcache_trace_request ((char *) (in_trace_req->trace_id)))
+    if (pcache_trace_request ((char *) (in_trace_req->trace_id))) {
+      count_received (r, ALLNET_COUNT_DUPLICATE);
       return drop;     /* seen before */
+    }
     trace_forward (r->message, r->msize, my_address, 16,
                    &new_trace_request, &new_trace_request_size,
                    &trace_reply, &trace_reply_size);
@@ -917,6 +1389,7 @@ static struct message_process process_mgmt (struct socket_read_result *r)
         all.allocated = 1;
       } /* else forward the original request */
       save_or_record (all.message, all.msize, ALLNET_PRIORITY_TRACE);
+      count_received (r, ALLNET_COUNT_CACHED);
       all.debug_reason = "trace request forward";
       return all;
     }
@@ -927,20 +1400,26 @@ static struct message_process process_mgmt (struct socket_read_result *r)
     if (mgmt_payload_size <= 0)
       drop.debug_reason = "trace_reply payload too small";
     if ((mgmt_payload_size <= 0) ||
-        (pcache_trace_reply (mgmt_payload, mgmt_payload_size)))
+        (pcache_trace_reply (mgmt_payload, mgmt_payload_size))) {
+      if (mgmt_payload_size > 0)
+        count_received (r, ALLNET_COUNT_DUPLICATE);
       return drop;  /* invalid, or seen before */
+    }
     all.priority = ALLNET_PRIORITY_TRACE;
     save_or_record (r->message, r->msize, ALLNET_PRIORITY_TRACE);
+    count_received (r, ALLNET_COUNT_CACHED);
     all.debug_reason = "trace_reply";
     return all;
-  default:
-    snprintf (alog->b, alog->s, "unknown management message type %d\n",
+  default: {
+    char desc [LOG_SIZE];  /* the main thread may be using alog->b */
+    snprintf (desc, sizeof (desc), "unknown management message type %d\n",
               ahm->mgmt_type);
-    log_print (alog);   /* forward unknown management messages */
+    log_print_str (alog, desc);   /* forward unknown management messages */
     all.priority = ALLNET_PRIORITY_TRACE;
     all.debug_reason = "unknown management packet";
     return all;
   }
+  }
 }
 
 /* return the action to take with the message */
@@ -955,12 +1434,17 @@ static struct message_process process_message (struct socket_read_result *r)
   struct allnet_header * hp = (struct allnet_header *) r->message;
   int seen_before = 0;
   int save_message = 1;
+  char * rewritten = NULL;      /* a rewritten data request, if any */
+  int rewritten_size = 0;
   if (hp->message_type == ALLNET_TYPE_ACK) {
     r->msize = process_acks (hp, r->msize);
     drop.debug_reason = "message size 0 or less";
-    if (r->msize <= 0)
+    if (r->msize <= 0) {
+      count_received (r, ALLNET_COUNT_DUPLICATE);
       return drop;                   /* no new acks, drop the message */
+    }
     save_message = 0;                /* already saved the new acks */
+    count_received (r, ALLNET_COUNT_CACHED);
   } else {
     char id [MESSAGE_ID_SIZE];
     drop.debug_reason = "message does not have an ID";
@@ -973,6 +1457,8 @@ static struct message_process process_message (struct socket_read_result *r)
     } else {
       seen_before = pcache_id_found (id);
     }
+    if (seen_before)
+      count_received (r, ALLNET_COUNT_DUPLICATE);
     if ((! r->sock->is_local) && (seen_before)) {  /* we have seen it before */
       struct message_process local_forward =
         { .process = PROCESS_PACKET_LOCAL,
@@ -983,13 +1469,20 @@ static struct message_process process_message (struct socket_read_result *r)
     }
     if (hp->message_type == ALLNET_TYPE_DATA_REQ) {
       static unsigned long long int none_until = 0;
-      if ((! r->sock->is_local) &&
-          (none_until != 0) && (allnet_time () < none_until)) {
+      static pthread_mutex_t none_until_mutex = PTHREAD_MUTEX_INITIALIZER;
+      if (! r->sock->is_local) {
+        pthread_mutex_lock (&none_until_mutex);
+        unsigned long long int now = allnet_coarse_monotonic_ms ();
+        int too_soon = ((none_until != 0) && (now < none_until));
+        if (! too_soon)
+          none_until = now + 10 * 1000;
+        pthread_mutex_unlock (&none_until_mutex);
         drop.debug_reason = "data request within 10s of the last data request";
-        return drop;
+        if (too_soon) {
+          count_received (r, ALLNET_COUNT_THROTTLED);
+          return drop;
+        }
       }
-      if (! r->sock->is_local)
-        none_until = allnet_time () + 10;
       char * data = ALLNET_DATA_START (hp, hp->transport, r->msize);
       struct allnet_data_request * req = (struct allnet_data_request *) data;
       struct sockaddr_storage saddr = ((r->sav != NULL) ? r->sav->addr
@@ -1001,13 +1494,24 @@ static struct message_process process_message (struct socket_read_result *r)
 print_packet (r->message, r->msize, "received data request", 1);
 #endif /* DEBUG_PRINT */
 #endif /* DEBUG_FOR_DEVELOPER */
-      char request_buffer [50000];
-      struct pcache_result cached_messages =
-        pcache_request (req, (int) (data - r->message),
-                        hp->src_nbits, hp->source, max_messages,
-                        request_buffer, sizeof (request_buffer));
-      send_messages_to_one (cached_messages, r->sock, saddr, salen);
-      /* replace the token in the message with our own token */
+      /* send the messages straight from the cache, at most max_messages */
+      struct send_cached sc = { .sock = r->sock, .addr = saddr,
+                                .alen = salen, .batch = { .count = 0 } };
+      unsigned long long int request_start = allnet_time_us ();
+      int rlen = r->msize - (int) (data - r->message);
+      pcache_request_each (req, rlen, hp->src_nbits, hp->source, max_messages,
+                           send_cached_message, &sc);
+      send_cached_flush (&sc);
+      record_stage (STAGE_PCACHE_REQUEST, request_start);
+      /* forward a copy with our own token, and with a summary of what we
+       * have, so the next hop need only send us what we do not have */
+      rewritten = malloc_or_fail (ALLNET_MTU, "ad.c data request");
+      memcpy (rewritten, r->message, r->msize);
+      int hsize = (int) (data - r->message);
+      req = (struct allnet_data_request *) (rewritten + hsize);
+      rewritten_size = hsize +
+        pcache_request_summary (req, rlen, ALLNET_MTU - hsize,
+                                DATA_REQ_SUMMARY_IDS);
       routing_local_token (req->token);
       /* and then do normal packet processing (forward) this data request */
     }
@@ -1015,94 +1519,482 @@ print_packet (r->message, r->msize, "received data request", 1);
   if (! r->sock->is_local)
     r->priority = message_priority (r->message, hp, r->msize);
   /* below here the message should be valid, forward it */
-#define DEBUG_MESSAGE_FORMAT "process_message success, save %d, seen %d      "
-  static char debug_message [] = DEBUG_MESSAGE_FORMAT;
-  snprintf (debug_message, sizeof (debug_message), DEBUG_MESSAGE_FORMAT,
-            save_message, seen_before);
+  /* constant strings, since this may run in several threads at once */
+  static const char * debug_messages [2] [2] =
+    { { "process_message success, save 0, seen 0",
+        "process_message success, save 0, seen 1" },
+      { "process_message success, save 1, seen 0",
+        "process_message success, save 1, seen 1" } };
   struct message_process result =
         { .process = PROCESS_PACKET_ALL, .message = r->message,
           .msize = r->msize, .priority = r->priority, .allocated = 0,
-          .debug_reason = debug_message };
-  if (save_message && (! seen_before))
-    save_or_record (r->message, r->msize, r->priority);
+          .debug_reason =
+            (char *) debug_messages [save_message != 0] [seen_before != 0] };
+  if (rewritten != NULL) {
+    result.message = rewritten;
+    result.msize = rewritten_size;
+    result.allocated = 1;
+  }
+  if (save_message && (! seen_before)) {
+    save_or_record (result.message, result.msize, r->priority);
+    count_received (r, ALLNET_COUNT_CACHED);
+  }
   return result;
 }
 
-#ifndef ALLNET_USE_FORK  /* try a few different ports */
-static pthread_mutex_t next_message_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct socket_read_result next_message_result = { .success = 0 };
-static char next_message_data [ALLNET_MTU];
+#ifndef ALLNET_USE_FORK  /* local messages are handed over by other threads */
+/* local messages from other threads (atcpd, apps) are queued in a bounded
+ * multi-producer, single-consumer ring.  Each slot has a sequence number
+ * that tells producers and the consumer whether the slot is free or full,
+ * so producers only compete for the enqueue position, and never block.
+ * The sequence numbers are stored relative to the slot index, so that
+ * the all-zeros static initialization is a valid empty queue. */
+#define NEXT_MESSAGE_QUEUE_SIZE		32   /* must be a power of two */
+#define NEXT_MESSAGE_QUEUE_MASK		(NEXT_MESSAGE_QUEUE_SIZE - 1)
+struct next_message_slot {
+  atomic_size_t sequence;   /* minus the slot index */
+  int msize;
+  unsigned int priority;
+  char data [SOCKET_READ_MIN_BUFFER];
+};
+static struct next_message_slot next_message_queue [NEXT_MESSAGE_QUEUE_SIZE];
+static atomic_size_t next_message_enqueue_pos = 0;
+static size_t next_message_dequeue_pos = 0;  /* only used by ad's thread */
+/* the slot whose data was last returned by next_queued_message, released
+ * to the producers on the next call, once ad is done with the message */
+static int next_message_holding = 0;         /* only used by ad's thread */
 static struct socket_address_set fake_socket_address_set =
   { .sockfd = -1, .is_local = 1, .is_global_v6 = 0, .is_global_v4 = 0,
     .is_broadcast = 0, .num_addrs = 0, .send_addrs = NULL };
-static struct sockaddr_in fake_socket_address =
-  { .sin_family = AF_INET, .sin_port = 0, .sin_addr = 0 };
 static struct socket_address_validity fake_sav =
   { .alen = sizeof (struct sockaddr_in), .alive_rcvd = 0,
     .alive_sent = 0, .time_limit = 0, .recv_limit = 0, .send_limit = 0,
     .send_limit_on_recv = 0 };
 
+/* returns 1 if the message was queued, 0 if the queue is full */
 int set_next_local_message (const char * message, int mlen, int priority)
 {
-  pthread_mutex_lock (&next_message_mutex);
-  if ((next_message_result.success) &&
-      ((next_message_result.msize != mlen) ||
-       (memcmp (next_message_result.message, message, mlen) != 0))) {
-    printf ("warning: new %d-byte local message overwrites %d-byte message\n",
-            mlen, next_message_result.msize);
+  if ((mlen <= 0) || (mlen > ALLNET_MTU)) {
+    printf ("set_next_local_message: illegal message size %d\n", mlen);
+    return 0;
+  }
+  size_t pos = atomic_load_explicit (&next_message_enqueue_pos,
+                                     memory_order_relaxed);
+  struct next_message_slot * slot = NULL;
+  while (1) {
+    slot = next_message_queue + (pos & NEXT_MESSAGE_QUEUE_MASK);
+    size_t seq = atomic_load_explicit (&(slot->sequence),
+                                       memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos & ~NEXT_MESSAGE_QUEUE_MASK);
+    if (diff == 0) {   /* slot is free, try to claim it */
+      if (atomic_compare_exchange_weak_explicit (&next_message_enqueue_pos,
+                                                 &pos, pos + 1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+        break;         /* claimed, otherwise pos has the new value */
+    } else if (diff < 0) {  /* the consumer has not yet emptied this slot */
+      static atomic_int full_count = 0;  /* any producer may get here */
+      if (atomic_fetch_add_explicit (&full_count, 1,
+                                     memory_order_relaxed) < 10)
+        printf ("warning: local message queue full, dropping %d bytes\n",
+                mlen);
+      return 0;
+    } else {           /* another producer claimed this slot, catch up */
+      pos = atomic_load_explicit (&next_message_enqueue_pos,
+                                  memory_order_relaxed);
+    }
   }
-  memcpy (next_message_data, message, mlen);
-  next_message_result.message = next_message_data;
-  next_message_result.msize = mlen;
-  next_message_result.priority = priority;
-  next_message_result.sock = &fake_socket_address_set;
-  fake_socket_address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  memcpy (slot->data, message, mlen);
+  slot->msize = mlen;
+  slot->priority = priority;
+  /* publish: the slot is now full */
+  atomic_store_explicit (&(slot->sequence),
+                         (pos & ~NEXT_MESSAGE_QUEUE_MASK) + 1,
+                         memory_order_release);
+  return 1;
+}
+
+/* gives the slot held since the last call back to the producers */
+static void next_message_release (void)
+{
+  if (! next_message_holding)
+    return;
+  size_t pos = next_message_dequeue_pos - 1;
+  struct next_message_slot * slot =
+    next_message_queue + (pos & NEXT_MESSAGE_QUEUE_MASK);
+  next_message_holding = 0;
+  /* release the slot to the producers, for the next round */
+  atomic_store_explicit (&(slot->sequence),
+                         (pos & ~NEXT_MESSAGE_QUEUE_MASK) +
+                         NEXT_MESSAGE_QUEUE_SIZE, memory_order_release);
+}
+
+/* returns 1 and fills in r if there was a message in the queue, and
+ * 0 otherwise.  Only called from ad's thread.  r->message points into
+ * the queue slot, which is not copied, and stays valid (and writable)
+ * until the next call to next_queued_message. */
+static int next_queued_message (struct socket_read_result * r)
+{
+  next_message_release ();
+  size_t pos = next_message_dequeue_pos;
+  struct next_message_slot * slot =
+    next_message_queue + (pos & NEXT_MESSAGE_QUEUE_MASK);
+  size_t seq = atomic_load_explicit (&(slot->sequence), memory_order_acquire);
+  if (seq != (pos & ~NEXT_MESSAGE_QUEUE_MASK) + 1)
+    return 0;          /* empty, or the producer is not done copying */
+  r->success = 1;
+  r->message = slot->data;
+  r->msize = slot->msize;
+  r->priority = slot->priority;
+  next_message_dequeue_pos = pos + 1;
+  next_message_holding = 1;
+  r->sock = &fake_socket_address_set;
   struct sockaddr_storage sas;
   memset (&sas, 0, sizeof (sas));
-  *((struct sockaddr_in *) (&sas)) = fake_socket_address;
-  next_message_result.from = sas;
-  next_message_result.alen = sizeof (struct sockaddr_in);
-  next_message_result.socket_address_is_new = 0;
+  struct sockaddr_in * sin = (struct sockaddr_in *) (&sas);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  r->from = sas;
+  r->alen = sizeof (struct sockaddr_in);
+  r->socket_address_is_new = 0;
   fake_sav.addr = sas;
-  next_message_result.sav = &fake_sav;
-  next_message_result.recv_limit_reached = 0;
-  next_message_result.success = 1;
-  pthread_mutex_unlock (&next_message_mutex);
+  r->sav = &fake_sav;
+  r->recv_limit_reached = 0;
   return 1;
 }
+#undef NEXT_MESSAGE_QUEUE_MASK
+#undef NEXT_MESSAGE_QUEUE_SIZE
 #endif /* ALLNET_USE_FORK */
 
 static struct socket_read_result next_message (char * message_buffer)
 {
   int timeout = 10;      /* when all the data comes from sockets */
 #ifndef ALLNET_USE_FORK  /* see if we have been given a local message */
-  pthread_mutex_lock (&next_message_mutex);
-  struct socket_read_result r = next_message_result;  /* identical copy */
-  if (r.success) {
-    memcpy (message_buffer, r.message, r.msize);      /* copy the data */
-    r.message = message_buffer;        /* have r.message refer to the copy */
-    next_message_result.success = 0;   /* clear the cache */
-    pthread_mutex_unlock (&next_message_mutex);
+  struct socket_read_result r;
+  /* the queue is drained before we look at the sockets */
+  if (next_queued_message (&r))
     return r;
-  }
-  pthread_mutex_unlock (&next_message_mutex);
   timeout = 1;      /* quickly check again for a next_message */
 #endif /* ALLNET_USE_FORK */  /* no local message, or from sockets only */
   return socket_read (&sockets, message_buffer, timeout, virtual_clock);
 }
 
-void allnet_daemon_loop (void)
+/* send a processed message to the local processes and/or out */
+static void forward_message (struct message_process * m,
+                             struct sockaddr_storage from, socklen_t alen,
+                             int is_local)
+{
+  unsigned long long int start = allnet_time_us ();
+  if (m->process & PROCESS_PACKET_LOCAL) {
+    local_send (&sockets, m->message, m->msize, m->priority,
+                virtual_clock, from, alen);
+    record_stage (STAGE_LOCAL_SEND, start);
+    start = allnet_time_us ();
+  }
+#define MAX_SENT_ADDRS	1000
+  int num_sent_addrs = MAX_SENT_ADDRS;
+  struct sockaddr_storage sent_addrs [MAX_SENT_ADDRS];
+#undef MAX_SENT_ADDRS
+  if ((m->process & PROCESS_PACKET_OUT) &&
+      (hold_acks (m->message, m->msize, 0, -1, &from, alen, m->priority,
+                  (! is_local)))) {
+    num_sent_addrs = -1;   /* sent later with other acks */
+  } else if (m->process & PROCESS_PACKET_OUT) {
+    send_out (m->message, m->msize, NULL, ROUTING_ADDRS_MAX,
+              &from, alen, m->priority, (! is_local),
+              sent_addrs, &num_sent_addrs);
+    record_stage (STAGE_SEND_OUT, start);
+  } else {
+    num_sent_addrs = -1;
+  }
+  sockets_log_addresses ("ad.c after sending", &sockets,
+                         (num_sent_addrs >= 0 ? sent_addrs : NULL),
+                         num_sent_addrs, 0);
+}
+
+static void process_and_forward (struct socket_read_result * r)
+{
+  struct allnet_header * hp = (struct allnet_header *) r->message;
+  unsigned long long int start = allnet_time_us ();
+  struct message_process m =
+       ((hp->message_type == ALLNET_TYPE_MGMT) ? process_mgmt (r)
+                                               : process_message (r));
+  record_stage (STAGE_PROCESS, start);
+  ALLNET_PROBE4 (packet_process, r->message, r->msize, m.process,
+                 m.debug_reason);
+  log_packet_trace (m.process, r->message, r->msize);
+  if (m.process != PROCESS_PACKET_DROP) {
+    count_received (r, ALLNET_COUNT_FORWARDED);
+    forward_message (&m, r->from, r->alen, r->sock->is_local);
+  }
+  if ((m.allocated) && (m.message != NULL))
+    free (m.message);
+}
+
+/* the optional forwarding pipeline (see allnet_daemon_set_workers):
+ * the main thread receives messages and maintains the socket set,
+ * worker threads do the per-message processing (dedup, acks, caching,
+ * signature checks, priorities), and a single send thread forwards
+ * the results.  The stages are connected by bounded queues, so a slow
+ * stage slows down the stages before it rather than using more memory.
+ * Messages are copied into the queues, together with copies of the
+ * socket information, since the socket set may change once the main
+ * thread goes on to the next message. */
+#define PIPELINE_MAX_WORKERS	64
+#define PIPELINE_QUEUE_SIZE	128
+struct pipeline_item {
+  int process;                /* only used in the send queue */
+  int msize;
+  unsigned int priority;
+  struct sockaddr_storage from;
+  socklen_t alen;
+  struct socket_address_set sock;  /* send_addrs, addr_index always NULL */
+  struct socket_address_validity sav;
+  int has_sav;
+  char message [ALLNET_MTU];
+};
+
+struct pipeline_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int first;
+  int count;
+  int stopping;              /* no more items will be added */
+  struct pipeline_item * items;
+};
+
+static int pipeline_workers = 0;   /* 0 means no pipeline */
+static int pipeline_running = 0;
+static struct pipeline_queue work_queue;
+static struct pipeline_queue send_queue;
+static pthread_t worker_threads [PIPELINE_MAX_WORKERS];
+static pthread_t send_thread;
+
+/* set the number of worker threads, before calling allnet_daemon_main.
+ * 0 (the default) does all the processing in the main thread */
+void allnet_daemon_set_workers (int workers)
+{
+  if (workers < 0)
+    workers = 0;
+  if (workers > PIPELINE_MAX_WORKERS)
+    workers = PIPELINE_MAX_WORKERS;
+  pipeline_workers = workers;
+}
+
+static void pipeline_queue_init (struct pipeline_queue * q, const char * desc)
+{
+  pthread_mutex_init (&(q->mutex), NULL);
+  pthread_cond_init (&(q->not_empty), NULL);
+  pthread_cond_init (&(q->not_full), NULL);
+  q->first = 0;
+  q->count = 0;
+  q->stopping = 0;
+  q->items = malloc_or_fail (PIPELINE_QUEUE_SIZE * sizeof (q->items [0]), desc);
+}
+
+/* blocks while the queue is full */
+static void pipeline_put (struct pipeline_queue * q,
+                          const struct pipeline_item * item)
+{
+  pthread_mutex_lock (&(q->mutex));
+  while (q->count >= PIPELINE_QUEUE_SIZE)
+    pthread_cond_wait (&(q->not_full), &(q->mutex));
+  struct pipeline_item * dest =
+    q->items + ((q->first + q->count) % PIPELINE_QUEUE_SIZE);
+  /* only copy the part of the message that is used */
+  memcpy (dest, item, sizeof (*item) - sizeof (item->message));
+  memcpy (dest->message, item->message, item->msize);
+  q->count++;
+  pthread_cond_signal (&(q->not_empty));
+  pthread_mutex_unlock (&(q->mutex));
+}
+
+/* blocks while the queue is empty.  Returns 0 once the queue is
+ * empty and stopping, and 1 otherwise */
+static int pipeline_get (struct pipeline_queue * q, struct pipeline_item * item)
+{
+  pthread_mutex_lock (&(q->mutex));
+  while ((q->count <= 0) && (! q->stopping))
+    pthread_cond_wait (&(q->not_empty), &(q->mutex));
+  if (q->count <= 0) {
+    pthread_mutex_unlock (&(q->mutex));
+    return 0;
+  }
+  struct pipeline_item * src = q->items + q->first;
+  memcpy (item, src, sizeof (*item) - sizeof (item->message));
+  memcpy (item->message, src->message, src->msize);
+  q->first = (q->first + 1) % PIPELINE_QUEUE_SIZE;
+  q->count--;
+  pthread_cond_signal (&(q->not_full));
+  pthread_mutex_unlock (&(q->mutex));
+  return 1;
+}
+
+static void pipeline_queue_stop (struct pipeline_queue * q)
+{
+  pthread_mutex_lock (&(q->mutex));
+  q->stopping = 1;
+  pthread_cond_broadcast (&(q->not_empty));
+  pthread_mutex_unlock (&(q->mutex));
+}
+
+static void pipeline_queue_free (struct pipeline_queue * q)
+{
+  free (q->items);
+  q->items = NULL;
+  pthread_cond_destroy (&(q->not_full));
+  pthread_cond_destroy (&(q->not_empty));
+  pthread_mutex_destroy (&(q->mutex));
+}
+
+/* called in the main thread, hands the message to the workers */
+static void pipeline_receive (struct socket_read_result * r)
+{
+  static struct pipeline_item item;   /* only used by the main thread */
+  if ((r->msize <= 0) || (r->msize > ALLNET_MTU))
+    return;
+  item.process = PROCESS_PACKET_DROP;
+  item.msize = r->msize;
+  item.priority = r->priority;
+  item.from = r->from;
+  item.alen = r->alen;
+  item.sock = *(r->sock);
+  item.sock.num_addrs = 0;
+  item.sock.send_addrs = NULL;
+  item.sock.addr_index = NULL;
+  item.sock.addr_index_size = 0;
+  item.has_sav = (r->sav != NULL);
+  if (item.has_sav)
+    item.sav = *(r->sav);
+  memcpy (item.message, r->message, r->msize);
+  pipeline_put (&work_queue, &item);
+}
+
+/* process_mgmt uses alog->b and calls dht_process and trace_forward, whose
+ * state is not locked, so only one worker at a time processes management
+ * messages.  These are few compared to data messages */
+static pthread_mutex_t pipeline_mgmt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void * pipeline_worker (void * arg)
+{
+  struct pipeline_item * item =
+    malloc_or_fail (sizeof (struct pipeline_item), "ad.c pipeline_worker");
+  while (pipeline_get (&work_queue, item)) {
+    struct socket_read_result r =
+      { .success = 1, .message = item->message, .msize = item->msize,
+        .priority = item->priority, .from = item->from, .alen = item->alen,
+        .sock = &(item->sock), .sav = ((item->has_sav) ? &(item->sav) : NULL),
+        .socket_address_is_new = 0, .recv_limit_reached = 0 };
+    struct allnet_header * hp = (struct allnet_header *) item->message;
+    unsigned long long int start = allnet_time_us ();
+    struct message_process m;
+    if (hp->message_type == ALLNET_TYPE_MGMT) {
+      pthread_mutex_lock (&pipeline_mgmt_mutex);
+      m = process_mgmt (&r);
+      pthread_mutex_unlock (&pipeline_mgmt_mutex);
+    } else {
+      m = process_message (&r);
+    }
+    record_stage (STAGE_PROCESS, start);
+    ALLNET_PROBE4 (packet_process, r.message, r.msize, m.process,
+                   m.debug_reason);
+    log_packet_trace (m.process, r.message, r.msize);
+    if ((m.process != PROCESS_PACKET_DROP) && (m.message != NULL) &&
+        (m.msize > 0) && (m.msize <= ALLNET_MTU)) {
+      count_received (&r, ALLNET_COUNT_FORWARDED);
+      if (m.message != item->message)   /* rewritten trace request */
+        memcpy (item->message, m.message, m.msize);
+      item->process = m.process;
+      item->msize = m.msize;
+      item->priority = m.priority;
+      pipeline_put (&send_queue, item);
+    }
+    if ((m.allocated) && (m.message != NULL))
+      free (m.message);
+  }
+  free (item);
+  return NULL;
+}
+
+static void * pipeline_sender (void * arg)
+{
+  struct pipeline_item * item =
+    malloc_or_fail (sizeof (struct pipeline_item), "ad.c pipeline_sender");
+  while (pipeline_get (&send_queue, item)) {
+    struct message_process m =
+      { .process = item->process, .message = item->message,
+        .msize = item->msize, .priority = item->priority, .allocated = 0,
+        .debug_reason = "pipeline" };
+    forward_message (&m, item->from, item->alen, item->sock.is_local);
+  }
+  free (item);
+  return NULL;
+}
+
+static void pipeline_start ()
+{
+  if (pipeline_workers <= 0)
+    return;
+  pipeline_queue_init (&work_queue, "ad.c work queue");
+  pipeline_queue_init (&send_queue, "ad.c send queue");
+  pthread_create (&send_thread, NULL, pipeline_sender, NULL);
+  int i;
+  for (i = 0; i < pipeline_workers; i++)
+    pthread_create (worker_threads + i, NULL, pipeline_worker, NULL);
+  pipeline_running = 1;
+  snprintf (alog->b, alog->s, "forwarding pipeline with %d workers\n",
+            pipeline_workers);
+  log_print (alog);
+}
+
+/* finish processing and sending the messages already received */
+static void pipeline_stop ()
+{
+  if (! pipeline_running)
+    return;
+  pipeline_running = 0;
+  pipeline_queue_stop (&work_queue);
+  int i;
+  for (i = 0; i < pipeline_workers; i++)
+    pthread_join (worker_threads [i], NULL);
+  pipeline_queue_stop (&send_queue);
+  pthread_join (send_thread, NULL);
+  pipeline_queue_free (&work_queue);
+  pipeline_queue_free (&send_queue);
+}
+#undef PIPELINE_QUEUE_SIZE
+#undef PIPELINE_MAX_WORKERS
+
+/* validate, dedupe, and forward one received message */
+static void handle_message (struct socket_read_result r)
 {
-  char message [SOCKET_READ_MIN_BUFFER];
-  struct socket_read_result r = next_message (message);
 #ifdef TEST_TCP_ONLY /* ignore non-local IPs to force everything over tcp */
   if ((r.success) &&
-      (! ((is_loopback_ip ((struct sockaddr *) &(r.from), r.alen))))) continue;
+      (! ((is_loopback_ip ((struct sockaddr *) &(r.from), r.alen))))) return;
 #endif /* TEST_TCP_ONLY */
   char * reason_not_valid = "size less than 24";
-  if ((! r.success) || (r.message == NULL) ||
-      (r.msize < ALLNET_HEADER_SIZE) ||
-      (! is_valid_message (r.message, r.msize, &reason_not_valid))) {
+  unsigned long long int validate_start = allnet_time_us ();
+  int valid = ((r.success) && (r.message != NULL) &&
+               (r.msize >= ALLNET_HEADER_SIZE) &&
+               (is_valid_message (r.message, r.msize, &reason_not_valid)));
+  if (r.success) {
+    record_stage (STAGE_VALIDATE, validate_start);
+    ALLNET_PROBE4 (packet_validate, r.message, r.msize, valid,
+                   (valid ? "" : reason_not_valid));
+  }
+  if ((r.success) && (r.message != NULL)) {
+    count_received (&r, ALLNET_COUNT_RECEIVED);
+    count_packet (r.message, r.msize,
+                  count_class (r.sock->sockfd, r.sock->is_local,
+                               r.sock->is_broadcast, &(r.from), r.alen),
+                  ALLNET_COUNT_BYTES, r.msize);
+    if (! valid)
+      count_received (&r, ALLNET_COUNT_INVALID);
+  }
+  if (! valid) {
+    if ((r.success) && (r.message != NULL))
+      log_packet_trace (LOG_TRACE_INVALID, r.message, r.msize);
 #ifdef LOG_PACKETS
 if ((r.success) && (r.message != NULL) &&
     (strcmp (reason_not_valid, "hops > max_hops") != 0) &&
@@ -1168,34 +2060,14 @@ printf ("\n");
   else if ((r.sav != NULL) && (r.sav->time_limit != 0))
     r.sav->time_limit = virtual_clock + ((r.sock->is_local) ? 6 : 180);
   struct allnet_header * hp = (struct allnet_header *) r.message;
-  if ((hp->hops < 255) && (! r.sock->is_local))  /* for non-local messages */
+  if ((hp->hops < 255) && (! r.sock->is_local) &&   /* for non-local */
+      (r.sock->sockfd != shard_link_fd))   /* messages not from a shard */
     hp->hops++;            /* before processing, increment number of hops */
   if (hp->hops <= hp->max_hops) {
-    struct message_process m =
-         ((hp->message_type == ALLNET_TYPE_MGMT) ? process_mgmt (&r)
-                                                 : process_message (&r));
-    if (m.process & PROCESS_PACKET_LOCAL)
-      local_send (&sockets, m.message, m.msize, m.priority,
-                  virtual_clock, r.from, r.alen);
-#define MAX_SENT_ADDRS	1000
-    int num_sent_addrs = MAX_SENT_ADDRS;
-    struct sockaddr_storage sent_addrs [MAX_SENT_ADDRS];
-#undef MAX_SENT_ADDRS
-    if (m.process & PROCESS_PACKET_OUT)
-      send_out (m.message, m.msize, NULL, ROUTING_ADDRS_MAX,
-                &(r.from), r.alen, m.priority, (! r.sock->is_local),
-                sent_addrs, &num_sent_addrs);
+    if (pipeline_running)
+      pipeline_receive (&r);
     else
-      num_sent_addrs = -1;
-    if ((m.allocated) && (m.message != NULL))
-      free (m.message);
-    int debug_priority = 0;
-#ifdef THROTTLE_SENDING
-    debug_priority = priority_threshold;
-#endif /* THROTTLE_SENDING */
-    sockets_log_addresses ("ad.c after sending", &sockets,
-                           (num_sent_addrs >= 0 ? sent_addrs : NULL),
-                           num_sent_addrs, debug_priority);
+      process_and_forward (&r);
   }
   if (r.recv_limit_reached) {  /* time to send a keepalive */
     socket_update_recv_limit (RECV_LIMIT_DEFAULT, &sockets, r.from, r.alen);
@@ -1204,12 +2076,80 @@ printf ("\n");
                           sockets.random_secret,
                           sizeof (sockets.random_secret), sockets.counter);
   }
+}
+
+void allnet_daemon_loop (void)
+{
+  char message [SOCKET_READ_MIN_BUFFER];
+  /* handle all the messages socket_read has already received, before
+   * doing the periodic tasks.  The limit keeps a steady stream of local
+   * messages from delaying the periodic tasks indefinitely */
+  int count = 0;
+  do {
+    unsigned long long int start = allnet_time_us ();
+    struct socket_read_result r = next_message (message);
+    allnet_clock_update ();   /* once for each wait */
+    if (r.success)
+      record_stage (STAGE_SOCKET_READ, start);
+    if ((r.success) && (r.sock != NULL) && (r.sock->is_broadcast))
+      abc_received (&(r.from), r.alen, r.msize);
+    handle_message (r);
+  } while ((socket_read_pending (&sockets) > 0) &&
+           (++count < 2 * SOCKETS_RECV_BATCH));
+  abc_send_window (&sockets);
+  flush_held_acks (0);
+#ifdef THROTTLE_SENDING
+  sendq_run ();
+#endif /* THROTTLE_SENDING */
   update_virtual_clock ();
   update_dht ();
 }
 
 /* if start == 1, this thread runs until another thread calls this with
  * start == 0. */
+#ifdef ALLNET_USE_FORK  /* only a separate allnetd process is restarted */
+/* waits for a new ad to ask for our sockets, then stops the main loop */
+static void * handoff_thread (void * arg)
+{
+  extern void allnet_daemon_main (int start);
+  while (1) {
+    int conn = accept (handoff_listen_fd, NULL, NULL);
+    if (conn >= 0) {
+      handoff_conn = conn;
+      allnet_daemon_main (0);   /* the main loop hands over the sockets */
+      return NULL;
+    }
+    if (errno != EINTR) {
+      perror ("handoff_thread accept");
+      return NULL;
+    }
+  }
+}
+#endif /* ALLNET_USE_FORK */
+
+/* save our state, and give the new ad our sockets.  Broadcast sockets
+ * are recreated by the new ad, and the shard link is not handed over */
+static void hand_over_sockets ()
+{
+  routing_save_peers ();
+  pcache_write ();
+  struct handoff_socket h [HANDOFF_MAX_SOCKETS];
+  int n = 0;
+  int i;
+  for (i = 0; (i < sockets.num_sockets) && (n < HANDOFF_MAX_SOCKETS); i++) {
+    struct socket_address_set * sock = sockets.sockets + i;
+    if ((sock->is_broadcast) || (sock->sockfd == shard_link_fd))
+      continue;
+    h [n].sockfd = sock->sockfd;
+    h [n].is_local = sock->is_local;
+    h [n].is_global_v6 = sock->is_global_v6;
+    h [n].is_global_v4 = sock->is_global_v4;
+    n++;
+  }
+  if (! handoff_send (handoff_conn, h, n))
+    printf ("unable to hand over %d sockets\n", n);
+}
+
 void allnet_daemon_main (int start)
 {
   static int run_state = 0;   /* stopped */
@@ -1219,7 +2159,13 @@ void allnet_daemon_main (int start)
     return;                   /* let main thread finish */
   }
   run_state = 1;              /* running */
+  static char shard_cache [100];
+  if (shard_index > 0) {     /* each shard has its own cache */
+    snprintf (shard_cache, sizeof (shard_cache), "acache-%d", shard_index);
+    pcache_set_directory (shard_cache);
+  }
   alog = init_log ("ad");
+  counters_start_ms = allnet_time_ms ();
   sockets.num_sockets = 0;
   sockets.sockets = NULL;
   social_net = init_social (30000, 5, alog);
@@ -1229,11 +2175,26 @@ void allnet_daemon_main (int start)
   extern void * atcpd_main (void *);
   pthread_t atcpd_thread;
   int ignored_arg = 99;
-  pthread_create (&atcpd_thread, NULL, atcpd_main, (void *) &ignored_arg);
+  if (shard_index == 0) /* atcpd connects to local programs, only in shard 0 */
+    pthread_create (&atcpd_thread, NULL, atcpd_main, (void *) &ignored_arg);
+  pipeline_start ();
+#ifdef ALLNET_USE_FORK  /* a new allnetd may ask for our sockets */
+  pthread_t handoff_thread_id;
+  if ((shard_index == 0) && ((handoff_listen_fd = handoff_listen ()) >= 0))
+    pthread_create (&handoff_thread_id, NULL, handoff_thread, NULL);
+#endif /* ALLNET_USE_FORK */
   while (run_state == 1)
     allnet_daemon_loop (); /* main loop */
   /* run_state is no longer 1, shut everything down */
-  atcpd_main (NULL);       /* ask atcpd_main to stop */
+  flush_held_acks (1);     /* so peers do not wait for these acks */
+  pipeline_stop ();
+  flush_held_acks (1);     /* any held while the pipeline finished */
+  if (handoff_conn >= 0)   /* a new ad is taking over */
+    hand_over_sockets ();
+  if (shard_index == 0)
+    atcpd_main (NULL);     /* ask atcpd_main to stop */
   close_socket_set (&sockets);
+  if (handoff_conn >= 0)   /* tell the new ad we have closed the sockets */
+    close (handoff_conn);
   run_state = 0;
 }
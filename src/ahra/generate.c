@@ -2,6 +2,8 @@
 /* parameters: a personal phrase (in quotes)
      optional: a minimum number of pairs of words (default is 2)
      optional: a language for the encoding (default is en)
+     optional: -t followed by the number of threads to search with
+               (default is one per processor)
  */
 
 #include <stdio.h>
@@ -34,6 +36,8 @@ static void usage (char * pname, char * reason)
   printf ("             more is better, default is 2\n");
   printf ("     option: the language for encoding the word pairs\n");
   printf ("             default is en (English)\n");
+  printf ("     option: -t n to search using n threads\n");
+  printf ("             default is one per processor\n");
   printf ("your command %s\n", reason);
   exit (1);
 }
@@ -49,6 +53,12 @@ int main (int argc, char ** argv)
   int i;
   for (i = 2; i < argc; i++) {
     char * check;
+    if (strcmp (argv [i], "-t") == 0) {   /* number of threads */
+      if ((i + 1 >= argc) || (atoi (argv [i + 1]) <= 0))
+        usage (argv [0], "did not give a positive number of threads after -t");
+      generate_key_threads (atoi (argv [++i]));
+      continue;
+    }
     int n = strtol (argv [i], &check, 10);
     if (check != argv [i])     /* number of word pairs */
       numpairs = n;
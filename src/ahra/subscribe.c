@@ -32,9 +32,9 @@ static int send_key_request (int sock, char * phrase, char * source, int slen,
   unsigned int dsize = EMPTY_FINGERPRINT_SIZE + KEY_RANDOM_PAD_SIZE;
   unsigned int psize;
   struct allnet_header * hp =
-    create_packet (dsize, ALLNET_TYPE_KEY_REQ, 10, ALLNET_SIGTYPE_NONE,
-                   (unsigned char *) source, slen * 8, destination, 8,
-                   NULL, NULL, &psize);
+    create_pool_packet (dsize, ALLNET_TYPE_KEY_REQ, 10, ALLNET_SIGTYPE_NONE,
+                        (unsigned char *) source, slen * 8, destination, 8,
+                        NULL, NULL, &psize);
   
   if (hp == NULL)
     return 0;
@@ -42,6 +42,7 @@ static int send_key_request (int sock, char * phrase, char * source, int slen,
   if (psize != hsize + dsize) {
     printf ("send_key_request error: psize %d != %d = %d + %d\n", psize,
             hsize + dsize, hsize, dsize);
+    allnet_packet_free (hp);
     return 0;
   }
   char * packet = (char *) hp;
@@ -54,6 +55,7 @@ static int send_key_request (int sock, char * phrase, char * source, int slen,
 
 /* printf ("sending %d-byte key request\n", psize); */
   int ret = (local_send (packet, psize, ALLNET_PRIORITY_LOCAL));
+  allnet_packet_free (packet);
   if (! ret)
     printf ("unable to send key request message\n");
   return ret;
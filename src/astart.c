@@ -2,6 +2,9 @@
 /* compiles to the executable now called "allnetd" */
 /* takes no arguments, I usually run it as bin/allnetd */
 /* with -D, runs ad in the main process rather returning immediately */
+/* with -w n, ad uses n forwarding threads */
+/* with -s n, runs n ad processes sharing the allnet port (see ad.c) */
+/* with -R, takes over the sockets of the running allnetd (see handoff.h) */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,8 +31,14 @@
 #include "lib/ai.h"
 #include "lib/pcache.h"
 #include "lib/routing.h"
+#include "lib/crypt_sel.h"
+#include "lib/handoff.h"
 
 extern void allnet_daemon_main (int start);
+extern void allnet_daemon_set_workers (int workers);
+extern void allnet_daemon_set_shard (int index, int count);
+extern void allnet_daemon_set_handoff (const struct handoff_socket * sockets,
+                                       int n);
 #ifdef ALLNET_USE_FORK  /* start a keyd process */
 extern void keyd_main (char * pname);
 #endif /* ALLNET_USE_FORK */
@@ -275,40 +284,53 @@ static int read_pid (int fd)
   return -1;
 }
 
-/* may be used as a signal handler, but really just used by astop to
- * kill all the allnet processes listed in /tmp/allnet-pids. */
-static void stop_all_on_signal (int signal)
+#define MAX_STOP_PROCS	1000
+/* reads the pids in the pid file (except our own) and deletes the file.
+ * returns the number of pids, or -1 if there is no pid file */
+static int read_pids (pid_t * pids, int max)
 {
-  if (signal != SIGINT)
-    printf ("process ID is %d, program %s, signal %d\n", getpid (),
-            process_name, signal);
   char * fname = pid_file_name ();
   int fd = -1;
   if (fname != NULL)
     fd = open (fname, O_RDONLY, 0);
-  if (fd >= 0) {   /* kill all the pids in the file (except ourselves) */
-#define MAX_STOP_PROCS	1000
-    static pid_t pids [MAX_STOP_PROCS];
-    pid_t pid;
-    pid_t my_pid = getpid ();
-    int count = 0;
-    while ((count < MAX_STOP_PROCS) && ((pid = read_pid (fd)) > 0)) {
-      if (pid != my_pid)       /* do not kill myself */
-        pids [count++] = pid;
-    }
-    /* deleting the pid file keeps others from doing what we are doing */
-    debug_close (fd, "stop_all_on_signal");
-    unlink (fname);
-    /* now stop all the other processes */
-    int i;
-    for (i = count - 1; i >= 0; i--) {
+  if (fd < 0)
+    return -1;
+  pid_t pid;
+  pid_t my_pid = getpid ();
+  int count = 0;
+  while ((count < max) && ((pid = read_pid (fd)) > 0)) {
+    if (pid != my_pid)       /* do not kill myself */
+      pids [count++] = pid;
+  }
+  /* deleting the pid file keeps others from doing what we are doing */
+  debug_close (fd, "read_pids");
+  unlink (fname);
+  return count;
+}
+
+static void stop_pids (pid_t * pids, int count)
+{
+  int i;
+  for (i = count - 1; i >= 0; i--) {
 #ifdef DEBUG_PRINT
-      printf ("%d killing %d\n", getpid (), pids [i]);
+    printf ("%d killing %d\n", getpid (), pids [i]);
 #endif /* DEBUG_PRINT */
-      kill (pids [i], SIGINT);
-      waitpid (pids [i], NULL, 0);
-    }
+    kill (pids [i], SIGINT);
+    waitpid (pids [i], NULL, 0);
   }
+}
+
+/* may be used as a signal handler, but really just used by astop to
+ * kill all the allnet processes listed in /tmp/allnet-pids. */
+static void stop_all_on_signal (int signal)
+{
+  if (signal != SIGINT)
+    printf ("process ID is %d, program %s, signal %d\n", getpid (),
+            process_name, signal);
+  static pid_t pids [MAX_STOP_PROCS];
+  int count = read_pids (pids, MAX_STOP_PROCS);
+  if (count > 0)   /* kill all the pids in the file (except ourselves) */
+    stop_pids (pids, count);
   exit (0);      /* finally, suicide */
 }
 
@@ -494,9 +516,25 @@ static void call_ad (char * ignored)
   allnet_daemon_main (1);
 }
 
+#ifdef ALLNET_USE_FORK  /* shards are separate processes */
+static int num_shards = 1;
+static int shard_to_start = 0;   /* set before forking each shard */
+
+static void call_ad_shard (char * ignored)
+{
+  allnet_daemon_set_shard (shard_to_start, num_shards);
+  allnet_daemon_main (1);
+}
+#endif /* ALLNET_USE_FORK */
+
 int astart_main (int argc, char ** argv)
 {
   int ix, jx;
+  if ((argc >= 2) && (strcmp (argv [1], "--crypto-bench") == 0)) {
+    /* time the crypto providers, optionally with a number of iterations */
+    int iterations = (argc >= 3) ? atoi (argv [2]) : 0;
+    return (allnet_crypto_bench (iterations) == 0) ? 0 : 1;
+  }
   for (ix = 1; ix + 1 < argc; ix++) {
     if (strcmp (argv [ix], "-d") == 0) {  /* set home directory (configfiles) */
       set_home_directory (argv [ix + 1]);
@@ -505,6 +543,43 @@ int astart_main (int argc, char ** argv)
       argc -= 2;   /* and delete */
     }
   }
+  for (ix = 1; ix + 1 < argc; ix++) {
+    if (strcmp (argv [ix], "-w") == 0) {  /* number of forwarding threads */
+      allnet_daemon_set_workers (atoi (argv [ix + 1]));
+      for (jx = ix; jx + 1 < argc; jx++) /* replace lower with higher args */
+        argv [jx] = argv [jx + 2];
+      argc -= 2;   /* and delete */
+    }
+  }
+  for (ix = 1; ix + 1 < argc; ix++) {
+    if (strcmp (argv [ix], "-s") == 0) {  /* number of ad processes */
+#ifdef ALLNET_USE_FORK  /* shards are separate processes */
+      num_shards = atoi (argv [ix + 1]);
+      if (num_shards < 1)
+        num_shards = 1;
+#else /* ! ALLNET_USE_FORK */
+      printf ("-s is only supported when ad runs as a separate process\n");
+#endif /* ALLNET_USE_FORK */
+      for (jx = ix; jx + 1 < argc; jx++) /* replace lower with higher args */
+        argv [jx] = argv [jx + 2];
+      argc -= 2;   /* and delete */
+    }
+  }
+#ifdef ALLNET_USE_FORK  /* only a separate allnetd process is restarted */
+  if (get_option ('R', &argc, argv)) {  /* take over from a running allnetd */
+    static struct handoff_socket sockets [HANDOFF_MAX_SOCKETS];
+    int n = handoff_receive (sockets, HANDOFF_MAX_SOCKETS);
+    if (n > 0)
+      allnet_daemon_set_handoff (sockets, n);
+    else
+      printf ("no running allnetd to take over from, starting normally\n");
+    /* the old ad has stopped, now stop the other old processes */
+    static pid_t pids [MAX_STOP_PROCS];
+    int count = read_pids (pids, MAX_STOP_PROCS);
+    if (count > 0)
+      stop_pids (pids, count);
+  }
+#endif /* ALLNET_USE_FORK */
   log_to_output (get_option ('v', &argc, argv));
   int alen = (int)strlen (argv [0]);
   char * path;
@@ -553,6 +628,12 @@ int astart_main (int argc, char ** argv)
   shutdown_function = allnet_daemon_main;
   setup_signal_handler (1);
   /* print_pid (pid_fd, getpid ()); terminating, so do not save own pid */
+  /* start the other shards, if any.  The designated shard 0 is started
+   * last, below, so it can have the main process with -D */
+  for (shard_to_start = 1; shard_to_start < num_shards; shard_to_start++)
+    my_call1 (argv [0], alen, "allnetd-shard", call_ad_shard, pid_fd,
+              astart_pid, 1, 0);
+  allnet_daemon_set_shard (0, num_shards);
 #endif /* ALLNET_USE_FORK */
   if ((argc > 1) && (strcmp (argv [1], "-D") == 0)) {
     /* with -D, call ad in the foreground rather than as a separate process */
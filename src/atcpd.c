@@ -1,7 +1,14 @@
 /* atcpd.c: allnet TCP daemon, to maintain TCP connections */
-/* 2019/10/01 note: args->running and run_state are doing the
- * same thing -- stopping the processes.  Perhaps args->running could
- * be removed and only run_state used */
+/* all the work is done by a single event loop in atcpd_main: the loop
+ * waits (with poll) for any of the non-blocking sockets to be ready, or
+ * for the next timer to be due, then accepts new connections, completes
+ * connections, reads and writes as needed, and runs the timers.
+ * Since only that one thread uses the connections, there is no lock.
+ * Each connection has its own input and output buffers, so a slow peer
+ * only delays the packets sent to that peer.
+ * Received bytes go into a ring buffer for each connection, and are
+ * parsed in place.  All the complete messages from one read are then
+ * sent to ad together, with as few system calls as possible. */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,9 +19,11 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
 
 #include "lib/packet.h"
 #include "lib/media.h"
@@ -27,6 +36,8 @@
 #include "lib/keys.h"
 #include "lib/routing.h"
 #include "lib/ai.h"
+#include "lib/sockets.h"
+#include "lib/probes.h"
 
 static struct allnet_log * alog = NULL;
 
@@ -41,76 +52,195 @@ static struct allnet_log * alog = NULL;
 #define LENGHT_SIZE		4
 #define HEADER_FOR_TCP_SIZE    (MAGIC_STRING_SIZE + PRIORITY_SIZE + LENGHT_SIZE)
 
+/* after version 3.3, each side may also send a hello when the connection
+ * opens, which older versions skip as bytes that are not a magic string:
+ * magic string, "MAGICPIH"  (8 bytes)
+ * features                  (4 bytes) -- big-endian bitmap
+ * length                    (4 bytes) -- always 0
+ * Once both sides have sent a hello with ATCP_FEATURE_COMPRESS, each may
+ * send messages with a compressed header instead of the format above:
+ * COMPRESSED_MARK           (1 byte)
+ * length                    (2 bytes) -- big-endian, of the rest of the frame
+ * changed                   (1 byte)  -- bitmap of changed header fields
+ * the changed fields        (COMPRESS_FIELD_SIZE bytes each)
+ * the message after its first ALLNET_HEADER_SIZE bytes
+ * The first ALLNET_HEADER_SIZE bytes of a message are taken as 8 fields
+ * of 3 bytes each.  Bit i of changed is set if field i differs from the
+ * same field of the previous message on this connection (initially all
+ * zeros), and in that case the new field value is sent.  Every message
+ * sent, compressed or not, becomes the previous message for the next */
+#define MAGIC_HELLO		"MAGICPIH"
+#define ATCP_FEATURE_COMPRESS	1
+#define COMPRESSED_MARK		0xc5
+#define COMPRESSED_MIN_SIZE	4
+#define COMPRESS_FIELD_SIZE	3
+#define COMPRESS_FIELDS		(ALLNET_HEADER_SIZE / COMPRESS_FIELD_SIZE)
+#define COMPRESSED_MAX_SIZE	(COMPRESSED_MIN_SIZE + ALLNET_HEADER_SIZE)
+/* atcpd offers to compress headers unless this is defined to be 0 */
+#ifndef ATCP_COMPRESS_HEADERS
+#define ATCP_COMPRESS_HEADERS	1
+#endif /* ATCP_COMPRESS_HEADERS */
+
 /* the first MAX_CONNECTIONS / 2 are ones that we open, i.e. connect.
  * The next  MAX_CONNECTIONS / 2 are ones that we accept. */
 #define MAX_CONNECTIONS		64
+#define NUM_CONNECT		(MAX_CONNECTIONS / 2)
 #define BUFSIZE			(ALLNET_MTU + HEADER_FOR_TCP_SIZE)
-static int tcp_fds [MAX_CONNECTIONS];
-static char tcp_buffers [MAX_CONNECTIONS] [BUFSIZE];
-static size_t tcp_bytes [MAX_CONNECTIONS];
-static struct sockaddr_storage tcp_addrs [MAX_CONNECTIONS];
-/* addresses and fds on which connect has been called but not yet completed */
-static struct sockaddr_storage tcp_connecting [MAX_CONNECTIONS];
-static int tcp_connecting_fds [MAX_CONNECTIONS];
+/* the input ring holds at least one full packet */
+#define IN_RINGSIZE		(2 * BUFSIZE)
+/* packets for a peer that is not keeping up are queued, up to this size.
+ * Beyond that, new packets for the peer are dropped */
+#define OUT_BUFSIZE		(8 * BUFSIZE)
+/* messages with compressed headers are rebuilt here until atcp_flush */
+#define DECODED_SIZE		IN_RINGSIZE
+
+/* atcpd keeps ATCP_POOL_TARGET connections to peers open, so that when
+ * one is dropped, the others are still available.  While there are
+ * fewer, it starts a connect every ATCP_CONNECT_STAGGER_MS, with up to
+ * ATCP_MAX_CONNECTING in progress at once, alternating IPv6 and IPv4
+ * addresses (as in RFC 8305, Happy Eyeballs).  A connect that has not
+ * completed in ATCP_CONNECT_TIMEOUT_MS fails.  After each failure, the
+ * address is not tried again for ATCP_BACKOFF_MIN_MS, doubling with
+ * each further failure up to ATCP_BACKOFF_MAX_MS */
+#ifndef ATCP_POOL_TARGET
+#define ATCP_POOL_TARGET	8
+#endif /* ATCP_POOL_TARGET */
+#ifndef ATCP_MAX_CONNECTING
+#define ATCP_MAX_CONNECTING	4
+#endif /* ATCP_MAX_CONNECTING */
+#ifndef ATCP_CONNECT_STAGGER_MS
+#define ATCP_CONNECT_STAGGER_MS	250
+#endif /* ATCP_CONNECT_STAGGER_MS */
+#ifndef ATCP_CONNECT_TIMEOUT_MS
+#define ATCP_CONNECT_TIMEOUT_MS	5000
+#endif /* ATCP_CONNECT_TIMEOUT_MS */
+#ifndef ATCP_BACKOFF_MIN_MS
+#define ATCP_BACKOFF_MIN_MS	5000
+#endif /* ATCP_BACKOFF_MIN_MS */
+#ifndef ATCP_BACKOFF_MAX_MS
+#define ATCP_BACKOFF_MAX_MS	(10 * 60 * 1000)
+#endif /* ATCP_BACKOFF_MAX_MS */
+
+struct atcp_connection {
+  int fd;                        /* -1 if this connection is not in use */
+  int connecting;                /* 1 until a non-blocking connect completes */
+  unsigned long long int connect_start;   /* in ms, if connecting */
+  struct sockaddr_storage addr;
+  char in [IN_RINGSIZE];         /* ring of bytes received, not yet sent */
+  size_t in_start;               /* first byte in the ring */
+  size_t in_bytes;               /* number of bytes in the ring */
+  char wrapped [ALLNET_MTU];     /* a message that wraps around the ring */
+  char * out;                    /* bytes not yet sent, allocated as needed */
+  size_t out_bytes;
+  int compress;                  /* both sides offered compressed headers */
+  char last_in [ALLNET_HEADER_SIZE];   /* header of the last message read */
+  char last_out [ALLNET_HEADER_SIZE];  /* header of the last message sent */
+  char * decoded;                /* rebuilt messages, allocated as needed */
+};
+static struct atcp_connection connections [MAX_CONNECTIONS];
+
+/* one listener each for IPv6 and IPv4 */
+#define NUM_LISTENERS		2
+struct atcp_listener {
+  int fd;                        /* -1 if not (yet) listening */
+  int af;
+  int bind_attempts;
+  unsigned long long int next_attempt;   /* in ms, 0 once done trying */
+};
+static struct atcp_listener listeners [NUM_LISTENERS];
+static int listen_success = 0;  /* any listener has been bound */
+
+/* addresses whose connects failed recently.  When full, the entry that
+ * may be retried soonest is replaced */
+#define NUM_BACKOFF		(2 * NUM_CONNECT)
+struct atcp_backoff {
+  struct sockaddr_storage addr;  /* ss_family is 0 if not in use */
+  int failures;
+  unsigned long long int next_attempt;   /* in ms */
+};
+static struct atcp_backoff backoffs [NUM_BACKOFF];
 
 /* used to terminate the program if the keepalives stop */
 static unsigned long long int last_udp_received_time = 0;
 
 /* allow a separate thread to kill this thread */
 static int run_state = 0;      /* stopped */
-static int accept_count = 0;   /* the accept code does IPv6 (0) and IPv4 (1) */
 
 static int debug_keepalive = 0;
 
-struct atcp_thread_args {
-  int running;   /* set to zero when the main thread terminates */
+struct atcp_state {
+  int running;   /* set to zero to stop the event loop */
   int local_sock;
-  pthread_mutex_t lock;
   unsigned long long int last_keepalive_sent_time;
   char * authenticating_keepalive;
   unsigned int aksize;
+  /* messages from TCP, to be sent to ad */
+  struct socket_send_batch batch;
+  struct sockaddr_storage local_addr;
+  socklen_t local_alen;
+  /* timers, all in ms */
+  unsigned long long int next_keepalive;
+  unsigned long long int next_connect;
+  unsigned long long int next_udp_check;
+  int connect_interval;          /* in seconds */
+  int connect_count;
+  int last_connect_family;       /* of the last connect started */
+  int missed_count;              /* checks without UDP from ad */
 };
 
-/* memmem is standard if _GNU_SOURCE is defined, but not otherwise */
-/* invariant: returned value >= buffer, or is NULL */
-static void * find_magic (char * buffer, size_t blen)
+/* poll doesn't wait more than this long, so atcpd_main (NULL) is noticed */
+#define MAX_WAIT_MS		200
+
+/* copies n bytes starting at offset from the start of the ring */
+static void ring_copy (struct atcp_connection * c, size_t offset,
+                       char * to, size_t n)
 {
-  while (blen >= MAGIC_STRING_SIZE) {
-    if (memcmp (buffer, MAGIC_STRING, MAGIC_STRING_SIZE) == 0)
-      return buffer;
-    buffer++;
-    blen--;
+  size_t pos = (c->in_start + offset) % IN_RINGSIZE;
+  size_t first = IN_RINGSIZE - pos;
+  if (first >= n) {
+    memcpy (to, c->in + pos, n);
+  } else {
+    memcpy (to, c->in + pos, first);
+    memcpy (to + first, c->in, n - first);
   }
-  return NULL;
 }
 
-static void acquire (pthread_mutex_t * mutex, const char * message)
+static void ring_remove (struct atcp_connection * c, size_t n)
 {
-#ifdef DEBUG_PRINT
-  printf ("~%s\n", message);
-#endif /* DEBUG_PRINT */
-  pthread_mutex_lock (mutex);
-#ifdef DEBUG_PRINT
-  printf ("+%s\n", message);
-#endif /* DEBUG_PRINT */
+  c->in_start = (c->in_start + n) % IN_RINGSIZE;
+  c->in_bytes -= n;
+  if (c->in_bytes == 0)
+    c->in_start = 0;   /* so the next read is contiguous */
 }
-static void release (pthread_mutex_t * mutex, const char * message)
+
+/* returns 1 if the magic string is at the start of the ring */
+static int ring_has_magic (struct atcp_connection * c)
 {
-  pthread_mutex_unlock (mutex);
-#ifdef DEBUG_PRINT
-  printf ("-%s\n", message);
-#endif /* DEBUG_PRINT */
+  if (c->in [c->in_start] != MAGIC_STRING [0])   /* quick check */
+    return 0;
+  char magic [MAGIC_STRING_SIZE];
+  ring_copy (c, 0, magic, MAGIC_STRING_SIZE);
+  return (memcmp (magic, MAGIC_STRING, MAGIC_STRING_SIZE) == 0);
 }
 
-/* if running becomes false, exit immediately, otherwise sleep */
-static void sleep_while_running (struct atcp_thread_args * args, int ms)
+/* returns 1 if the hello magic string is at the start of the ring */
+static int ring_has_hello (struct atcp_connection * c)
 {
-  while ((run_state == 1) && (args->running) && (ms > 0)) {
-    usleep (10000);
-    ms -= 10;
-  }
-  if (run_state != 1)
-    args->running = 0;
+  if (c->in [c->in_start] != MAGIC_HELLO [0])   /* quick check */
+    return 0;
+  char magic [MAGIC_STRING_SIZE];
+  ring_copy (c, 0, magic, MAGIC_STRING_SIZE);
+  return (memcmp (magic, MAGIC_HELLO, MAGIC_STRING_SIZE) == 0);
+}
+
+/* returns 1 if the ring may start with a frame, which is only checked
+ * when at least MAGIC_STRING_SIZE bytes are in the ring */
+static int ring_has_frame (struct atcp_connection * c)
+{
+  if ((c->compress) && (((unsigned char) (c->in [c->in_start])) ==
+                        COMPRESSED_MARK))
+    return 1;
+  return (ring_has_magic (c) || ring_has_hello (c));
 }
 
 static socklen_t sockaddr_len (struct sockaddr_storage * addr)
@@ -124,170 +254,400 @@ static socklen_t sockaddr_len (struct sockaddr_storage * addr)
   return 0;
 }
 
-/* returns 1 if an open connection to the new address is in tcp_addrs
- * if connecting is true, also checks the connecting list (for connect)
- * if connecting is false, also removes it from the connecting list (accept) */
+/* returns 1 if a connection to the new address is open
+ * if connecting is true, also checks the connections in progress */
 static int addr_in_list (struct sockaddr_storage * new_addr, int connecting)
 {
-  socklen_t new_len = sizeof (struct sockaddr_in);
-  if (new_addr->ss_family == AF_INET6)
-    new_len = sizeof (struct sockaddr_in6);
-  int pending_index = -1;
+  socklen_t new_len = sockaddr_len (new_addr);
   int i;
   for (i = 0; i < MAX_CONNECTIONS; i++) {
-    if ((tcp_connecting_fds [i] != -1) &&
-        (same_sockaddr (new_addr, new_len,
-                        tcp_connecting + i, sockaddr_len (tcp_connecting + i))))
-      pending_index = i;
-  }
-  if (connecting && (pending_index >= 0))  /* found */
-    return 1;
-  for (i = 0; i < MAX_CONNECTIONS; i++) {
-    if ((tcp_fds [i] != -1) &&
-        (same_sockaddr (new_addr, new_len,
-                        tcp_addrs + i, sockaddr_len (tcp_addrs + i)))) {
-      if ((! connecting) && (pending_index >= 0)) {  /* remove */
-        tcp_connecting [pending_index].ss_family = 0;
-        close (tcp_connecting_fds [pending_index]);
-      }
+    struct atcp_connection * c = connections + i;
+    if ((c->fd != -1) && (connecting || (! c->connecting)) &&
+        (same_sockaddr (new_addr, new_len, &(c->addr),
+                        sockaddr_len (&(c->addr)))))
       return 1;
-    }
   }
   return 0;
 }
 
-static struct sockaddr_storage tcp_addrs [MAX_CONNECTIONS];
+static void connection_close (struct atcp_connection * c)
+{
+  if (c->fd != -1)
+    close (c->fd);
+  c->fd = -1;
+  c->connecting = 0;
+  memset (&(c->addr), 0, sizeof (c->addr));
+  c->in_start = 0;
+  c->in_bytes = 0;
+  if (c->out != NULL)
+    free_tagged (c->out);
+  c->out = NULL;
+  c->out_bytes = 0;
+  c->compress = 0;
+  memset (c->last_in, 0, sizeof (c->last_in));
+  memset (c->last_out, 0, sizeof (c->last_out));
+  if (c->decoded != NULL)
+    free_tagged (c->decoded);
+  c->decoded = NULL;
+}
+
+/* sends to ad all the messages collected by atcp_process */
+static void atcp_flush (struct atcp_state * state)
+{
+  if (state->batch.count > 0)
+    socket_send_batch_flush (&(state->batch), "atcpd");
+  state->batch.count = 0;
+}
+
+/* handles the hello at the start of the ring, which has at least
+ * HEADER_FOR_TCP_SIZE bytes */
+static void atcp_process_hello (struct atcp_connection * c)
+{
+  char header [HEADER_FOR_TCP_SIZE];
+  ring_copy (c, 0, header, HEADER_FOR_TCP_SIZE);
+  unsigned long int features = readb32 (header + MAGIC_STRING_SIZE);
+  if (ATCP_COMPRESS_HEADERS && (features & ATCP_FEATURE_COMPRESS))
+    c->compress = 1;
+  ring_remove (c, HEADER_FOR_TCP_SIZE);
+}
 
-/* returns the number of bytes left in the buffer after processing */
-/* if the buffer is full, removes at least 16 bytes from the buffer */
-static size_t atcp_process (int fd, char * buffer, size_t bsize, int dbg)
+/* rebuilds the message in the compressed frame at the start of the ring,
+ * and adds it to the batch if it is valid.
+ * returns 0 if more data is needed, 1 otherwise */
+static int atcp_process_compressed (struct atcp_state * state,
+                                    struct atcp_connection * c,
+                                    size_t * decoded_used)
 {
-  if (bsize > ALLNET_MTU + HEADER_FOR_TCP_SIZE) {  /* sanity check */
-    printf ("error in atcp_process: bsize %zd\n", bsize);
+  if (c->in_bytes < COMPRESSED_MIN_SIZE)
     return 0;
+  char header [COMPRESSED_MIN_SIZE];
+  ring_copy (c, 0, header, COMPRESSED_MIN_SIZE);
+  unsigned int length = readb16 (header + 1);
+  unsigned int changed = ((unsigned char) (header [3]));
+  size_t fields_size = 0;
+  int i;
+  for (i = 0; i < COMPRESS_FIELDS; i++)
+    if (changed & (1 << i))
+      fields_size += COMPRESS_FIELD_SIZE;
+  size_t hsize = COMPRESSED_MIN_SIZE + fields_size;
+  unsigned long int total = length + (COMPRESSED_MIN_SIZE - 1);
+  if ((total <= hsize) ||
+      (total - hsize + ALLNET_HEADER_SIZE > ALLNET_MTU)) {
+    ring_remove (c, 1);  /* insane length, try again */
+    return 1;
   }
-  while (bsize > HEADER_FOR_TCP_SIZE) {
-    if (memcmp (buffer, MAGIC_STRING, MAGIC_STRING_SIZE) == 0) {
-      /* buffer starts with a valid magic string.  Check the length */
-      unsigned long int length = readb32 (buffer + MAGIC_STRING_SIZE +
-                                          PRIORITY_SIZE);
-      if ((length > ALLNET_HEADER_SIZE) && (length <= ALLNET_MTU)) {
-        unsigned long int total = length + HEADER_FOR_TCP_SIZE;
-        if (total > bsize)     /* we don't have all the data yet, */
-          return bsize;        /* continue to receive new data */
-        const char * message = buffer + HEADER_FOR_TCP_SIZE;
-        char * errs = "unknown error";
-        if (is_valid_message (buffer + HEADER_FOR_TCP_SIZE,
-                              (unsigned int) length, &errs)) {
-          /* valid length and valid message, send to ad */
-          send (fd, message, length, 0);
-          if (total == bsize)  /* consumed everything */
-            return 0;
-          /* else: move remaining bytes to front of the array */
-          bsize -= total;
-          memmove (buffer, buffer + total, bsize);
-        } else {
-          if (strcmp (errs, "expired packet") != 0) {
+  if (total > c->in_bytes)   /* we don't have all the data yet, */
+    return 0;                /* continue to receive new data */
+  size_t msize = total - hsize + ALLNET_HEADER_SIZE;
+  if (c->decoded == NULL)
+    c->decoded = malloc_tagged (DECODED_SIZE, ALLNET_MEMORY_ATCPD,
+                                "atcp_process_compressed");
+  if (*decoded_used + msize > DECODED_SIZE) {
+    atcp_flush (state);
+    *decoded_used = 0;
+  }
+  char * message = c->decoded + *decoded_used;
+  memcpy (message, c->last_in, ALLNET_HEADER_SIZE);
+  size_t offset = COMPRESSED_MIN_SIZE;
+  for (i = 0; i < COMPRESS_FIELDS; i++) {
+    if (changed & (1 << i)) {
+      ring_copy (c, offset, message + i * COMPRESS_FIELD_SIZE,
+                 COMPRESS_FIELD_SIZE);
+      offset += COMPRESS_FIELD_SIZE;
+    }
+  }
+  ring_copy (c, hsize, message + ALLNET_HEADER_SIZE, total - hsize);
+  /* the sender has the same previous header, whether or not this is valid */
+  memcpy (c->last_in, message, ALLNET_HEADER_SIZE);
+  ring_remove (c, total);
+  char * errs = "unknown error";
+  int valid = is_valid_message (message, (unsigned int) msize, &errs);
+  ALLNET_PROBE4 (atcp_frame_in, c->fd, message, msize, valid);
+  if (valid) {
+    if (state->batch.count >= SOCKET_SEND_BATCH_MAX)
+      atcp_flush (state);
+    socket_send_batch_add (&(state->batch), state->local_sock, message,
+                           (int) msize, state->local_addr, state->local_alen);
+    *decoded_used += msize;
+  }
+  return 1;
+}
+
+/* parses the messages in the ring, removing them and any bytes that
+ * cannot be part of a message, and adding the valid messages to the batch.
+ * The messages stay in the ring (or in c->wrapped or c->decoded) until
+ * atcp_flush. */
+static void atcp_process (struct atcp_state * state, int index)
+{
+  struct atcp_connection * c = connections + index;
+  int wrapped_used = 0;
+  size_t decoded_used = 0;
+  while (c->in_bytes > 0) {
+    if ((c->compress) &&
+        (((unsigned char) (c->in [c->in_start])) == COMPRESSED_MARK)) {
+      if (! atcp_process_compressed (state, c, &decoded_used))
+        return;
+      continue;
+    }
+    if (c->in_bytes < HEADER_FOR_TCP_SIZE)
+      return;
+    if (ring_has_hello (c)) {
+      atcp_process_hello (c);
+      continue;
+    }
+    if (! ring_has_magic (c)) {
+      /* search for a frame.  If none, at most 7 bytes are kept */
+      while ((c->in_bytes >= MAGIC_STRING_SIZE) && (! ring_has_frame (c)))
+        ring_remove (c, 1);
+      continue;
+    }
+    /* the ring starts with a valid magic string.  Check the length */
+    char header [HEADER_FOR_TCP_SIZE];
+    ring_copy (c, 0, header, HEADER_FOR_TCP_SIZE);
+    unsigned long int length = readb32 (header + MAGIC_STRING_SIZE +
+                                        PRIORITY_SIZE);
+    if ((length <= ALLNET_HEADER_SIZE) || (length > ALLNET_MTU)) {
+      ring_remove (c, MAGIC_STRING_SIZE);  /* insane length, try again */
+      continue;
+    }
+    unsigned long int total = length + HEADER_FOR_TCP_SIZE;
+    if (total > c->in_bytes)   /* we don't have all the data yet, */
+      return;                  /* continue to receive new data */
+    size_t pos = (c->in_start + HEADER_FOR_TCP_SIZE) % IN_RINGSIZE;
+    const char * message = c->in + pos;
+    if (pos + length > IN_RINGSIZE) { /* wraps, at most once per batch */
+      if (wrapped_used)
+        atcp_flush (state);
+      ring_copy (c, HEADER_FOR_TCP_SIZE, c->wrapped, length);
+      message = c->wrapped;
+      wrapped_used = 1;
+    }
+    memcpy (c->last_in, message, ALLNET_HEADER_SIZE);
+    char * errs = "unknown error";
+    int valid = is_valid_message (message, (unsigned int) length, &errs);
+    ALLNET_PROBE4 (atcp_frame_in, c->fd, message, length, valid);
+    if (valid) {
+      /* valid length and valid message, send to ad */
+      if (state->batch.count >= SOCKET_SEND_BATCH_MAX)
+        atcp_flush (state);
+      socket_send_batch_add (&(state->batch), state->local_sock, message,
+                             (int) length, state->local_addr,
+                             state->local_alen);
+      ring_remove (c, total);
+    } else {
+      if (strcmp (errs, "expired packet") != 0) {
 #undef DEBUG_FOR_DEVELOPER
 #ifdef DEBUG_FOR_DEVELOPER
-            printf ("atcpd fd %d bad %ld-byte message, %s, ", fd, length, errs);
-            print_buffer (buffer, HEADER_FOR_TCP_SIZE, "header", 32, 0);
-            printf ("  from: ");
-            print_sockaddr ((struct sockaddr *) (tcp_addrs + dbg),
-                            sizeof (struct sockaddr_storage));
-            print_buffer (buffer + HEADER_FOR_TCP_SIZE, length, ", msg", 40, 0);
-            printf ("\r\n");
+        printf ("atcpd fd %d bad %ld-byte message, %s, ", c->fd, length, errs);
+        print_buffer (header, HEADER_FOR_TCP_SIZE, "header", 32, 0);
+        printf ("  from: ");
+        print_sockaddr ((struct sockaddr *) &(c->addr),
+                        sizeof (struct sockaddr_storage));
+        print_buffer (message, length, ", msg", 40, 0);
+        printf ("\r\n");
 #endif /* DEBUG_FOR_DEVELOPER */
-          } /* invalid packet: delete the magic string, then look for another */
-          bsize -= MAGIC_STRING_SIZE; /* remove magic string, try again */
-          memmove (buffer, buffer + MAGIC_STRING_SIZE, bsize);
-        }
-      } else {  /* insane length, ignore: delete the magic string */
-        bsize -= MAGIC_STRING_SIZE; /* remove magic string, try again */
-        memmove (buffer, buffer + MAGIC_STRING_SIZE, bsize);
-      } 
-    } /* else: no magic string at start, search for it in what follows */
-    /* find the first magic string in the buffer, if any */
-    if (bsize >= MAGIC_STRING_SIZE) {
-      char * magic = find_magic (buffer, bsize);
-      if (magic == NULL) {   /* no magic string, keep the last 7 bytes */
-        size_t new_size = MAGIC_STRING_SIZE - 1;
-        size_t offset = bsize - new_size;
-        memmove (buffer, buffer + offset, new_size);
-        return new_size;               /* receive more data */
-      }   /* else: found magic string, loop again */
-      bsize -= (magic - buffer);
-      memmove (buffer, magic, bsize);  /* then loop again */
+      } /* invalid packet: delete the magic string, then look for another.
+         * A compressed header could be found inside the message, so with
+         * compression, delete the whole frame instead */
+      if (c->compress)
+        ring_remove (c, total);
+      else
+        ring_remove (c, MAGIC_STRING_SIZE);
     }
   }
-  /* bsize <= HEADER_FOR_TCP_SIZE, return whatever size is left */
-  return bsize;
 }
 
-/* receive from TCP, adding bytes to buffers until we have complete packets */
-static void * atcp_recv_thread (void * arg)
+/* receive from TCP, adding bytes to the ring until we have complete
+ * packets, and forward those to ad */
+static void atcp_read (struct atcp_state * state, int index)
 {
-  struct atcp_thread_args * args = ((struct atcp_thread_args *) arg);
-  int local_sock = args->local_sock;
-  while (args->running) {   /* loop until main thread goes away */
-    int i;
-    acquire (&(args->lock), "r");
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-      if (tcp_fds [i] != -1) {
-        if (tcp_bytes [i] >= sizeof (tcp_buffers [i])) {
-          /* == should be exceedingly rare, > should never happen */
-          printf ("error: tcp_bytes [%d] is %zd >= %d (%zd)\n",
-                  i, tcp_bytes [i], BUFSIZE, sizeof (tcp_buffers [i]));
-          tcp_bytes [i] = atcp_process (local_sock, tcp_buffers [i],
-                                        sizeof (tcp_buffers [i]), i);
-        } else {
-          char * p = &(tcp_buffers [i] [tcp_bytes [i]]);
-          size_t free = sizeof (tcp_buffers [i]) - tcp_bytes [i];
-unsigned long long int start = allnet_time ();
-          ssize_t r = recv (tcp_fds [i], p, free, 0);
-if (allnet_time () > start + 1)
-printf ("receive took %lld seconds\n", allnet_time () - start);
-          if (r > 0) {
-            tcp_bytes [i] = atcp_process (local_sock, tcp_buffers [i],
-                                          tcp_bytes [i] + r, i);
-          } else if ((r < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
-            if (errno == EBADF) {
+  struct atcp_connection * c = connections + index;
+  if (c->in_bytes >= IN_RINGSIZE) {  /* should never happen */
+    printf ("error: connection %d has %zd >= %d bytes\n",
+            index, c->in_bytes, IN_RINGSIZE);
+    ring_remove (c, c->in_bytes);
+    return;
+  }
+  /* the free space is one or two contiguous pieces */
+  size_t end = (c->in_start + c->in_bytes) % IN_RINGSIZE;
+  struct iovec iov [2];
+  int niov = 1;
+  iov [0].iov_base = c->in + end;
+  if (end >= c->in_start) {     /* free space at the end and at the start */
+    iov [0].iov_len = IN_RINGSIZE - end;
+    if (c->in_start > 0) {
+      iov [1].iov_base = c->in;
+      iov [1].iov_len = c->in_start;
+      niov = 2;
+    }
+  } else {
+    iov [0].iov_len = c->in_start - end;
+  }
+  ssize_t r = readv (c->fd, iov, niov);
+  if (r > 0) {
+    c->in_bytes += r;
+    atcp_process (state, index);
+    atcp_flush (state);
+  } else if ((r == 0) ||
+             ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+              (errno != EINTR))) {   /* closed by the peer, or an error */
 #ifdef TEST_TCP_ONLY
-printf ("receive error badf, closing socket %d to: ", tcp_fds [i]);
-print_sockaddr ((struct sockaddr *) (tcp_addrs + i),
+printf ("receive error, closing socket %d to: ", c->fd);
+print_sockaddr ((struct sockaddr *) &(c->addr),
 sizeof (struct sockaddr_storage)); printf ("\n");
 #endif /* TEST_TCP_ONLY */
-              close (tcp_fds [i]);
-            }
-            tcp_fds [i] = -1;
-            tcp_bytes [i] = 0;
-            memset (tcp_addrs + i, 0, sizeof (tcp_addrs [i]));
-          }
-        }
-      }
-    }
-    release (&(args->lock), "r");
-    sleep_while_running (args, 100);  /* sleep 1/10s */
+    connection_close (c);
   }
-  if (debug_keepalive)
-    printf ("%lld: atcpd_recv_thread ending\n", allnet_time ());
-  return NULL;
 }
 
-/* assumes buffer has length at least ALLNET_MTU + HEADER_FOR_TCP_SIZE */
-static size_t atcp_make (const char * message, int msize, char * buffer)
+/* send as much as possible of the output buffer */
+static void atcp_write (struct atcp_connection * c)
+{
+  if (c->out_bytes <= 0)
+    return;
+  ssize_t sent = send (c->fd, c->out, c->out_bytes, 0);
+  if (sent < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+      connection_close (c);
+    return;
+  }
+  c->out_bytes -= sent;
+  if (c->out_bytes > 0)
+    memmove (c->out, c->out + sent, c->out_bytes);
+}
+
+/* fills in the header that precedes the message on a TCP connection,
+ * the message itself is sent from wherever it is, without copying */
+static size_t atcp_make_header (int msize, char * header)
 {
   if ((msize <= 0) || (msize > ALLNET_MTU))
     return 0;
-  memcpy (buffer, MAGIC_STRING, MAGIC_STRING_SIZE);
-  writeb32 (buffer + MAGIC_STRING_SIZE, 0);  /* priority */
-  writeb32 (buffer + MAGIC_STRING_SIZE + PRIORITY_SIZE, msize);
-  memcpy (buffer + HEADER_FOR_TCP_SIZE, message, msize);
+  memcpy (header, MAGIC_STRING, MAGIC_STRING_SIZE);
+  writeb32 (header + MAGIC_STRING_SIZE, 0);  /* priority */
+  writeb32 (header + MAGIC_STRING_SIZE + PRIORITY_SIZE, msize);
   return (msize + HEADER_FOR_TCP_SIZE);
 }
 
+/* sends header and message on the connection.  If the connection is
+ * not keeping up, saves whatever is not sent in the output buffer, or
+ * if the output buffer is full, drops the packet.
+ * returns 1 if the packet was sent or saved, 0 otherwise */
+static int atcp_send (struct atcp_connection * c, const char * header,
+                      size_t hsize, const char * message, int msize)
+{
+  size_t total = hsize + msize;
+  size_t sent = 0;
+  if (c->out_bytes == 0) {   /* nothing queued, try to send right away */
+    struct iovec iov [2];
+    iov [0].iov_base = (char *) header;
+    iov [0].iov_len = hsize;
+    iov [1].iov_base = (char *) message;
+    iov [1].iov_len = msize;
+    ssize_t w = writev (c->fd, iov, 2);
+    if (w == total)
+      return 1;
+    if ((w < 0) &&
+        (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+#ifdef TEST_TCP_ONLY
+printf ("send error %zd != %zd, closing socket to: ", total, w);
+print_sockaddr ((struct sockaddr *) &(c->addr),
+sizeof (struct sockaddr_storage)); printf ("\n");
+#endif /* TEST_TCP_ONLY */
+      connection_close (c);
+      return 0;
+    }
+    if (w > 0)
+      sent = w;
+  }
+  /* an empty buffer always has room for a whole packet, so the rest of
+   * a partly sent packet is always saved */
+  if (c->out_bytes + (total - sent) > OUT_BUFSIZE)
+    return 0;   /* peer is too slow, drop this packet */
+  if (c->out == NULL)
+    c->out = malloc_tagged (OUT_BUFSIZE, ALLNET_MEMORY_ATCPD, "atcp_send");
+  char * p = c->out + c->out_bytes;
+  if (sent < hsize) {
+    memcpy (p, header + sent, hsize - sent);
+    p += hsize - sent;
+    memcpy (p, message, msize);
+  } else {
+    memcpy (p, message + (sent - hsize), total - sent);
+  }
+  c->out_bytes += total - sent;
+  return 1;
+}
+
+/* offers the features we support, currently only compressed headers */
+static void atcp_send_hello (struct atcp_connection * c)
+{
+  if (! ATCP_COMPRESS_HEADERS)
+    return;
+  char hello [HEADER_FOR_TCP_SIZE];
+  memcpy (hello, MAGIC_HELLO, MAGIC_STRING_SIZE);
+  writeb32 (hello + MAGIC_STRING_SIZE, ATCP_FEATURE_COMPRESS);
+  writeb32 (hello + MAGIC_STRING_SIZE + PRIORITY_SIZE, 0);
+  atcp_send (c, hello, HEADER_FOR_TCP_SIZE, NULL, 0);
+}
+
+static void connection_open (struct atcp_connection * c, int fd,
+                             struct sockaddr_storage * addr, int connecting)
+{
+  connection_close (c);
+  c->fd = fd;
+  c->connecting = connecting;
+  c->connect_start = allnet_coarse_monotonic_ms ();
+  c->addr = *addr;
+  if (! connecting)
+    atcp_send_hello (c);
+}
+
+/* fills in the header of a compressed frame, with the fields of the
+ * message header that differ from those of the last message sent.
+ * header must have COMPRESSED_MAX_SIZE bytes.  Returns the header size */
+static size_t atcp_make_compressed (struct atcp_connection * c,
+                                    const char * message, int msize,
+                                    char * header)
+{
+  size_t hsize = COMPRESSED_MIN_SIZE;
+  unsigned int changed = 0;
+  int i;
+  for (i = 0; i < COMPRESS_FIELDS; i++) {
+    const char * field = message + i * COMPRESS_FIELD_SIZE;
+    if (memcmp (field, c->last_out + i * COMPRESS_FIELD_SIZE,
+                COMPRESS_FIELD_SIZE) != 0) {
+      changed |= (1 << i);
+      memcpy (header + hsize, field, COMPRESS_FIELD_SIZE);
+      hsize += COMPRESS_FIELD_SIZE;
+    }
+  }
+  header [0] = (char) COMPRESSED_MARK;
+  writeb16 (header + 1, (unsigned int) (hsize - (COMPRESSED_MIN_SIZE - 1) +
+                                        msize - ALLNET_HEADER_SIZE));
+  header [3] = (char) changed;
+  return hsize;
+}
+
+/* sends the message with a full or a compressed header, as negotiated */
+static void atcp_send_message (struct atcp_connection * c,
+                               const char * full_header,
+                               const char * message, int msize)
+{
+  int sent = 0;
+  if (c->compress) {
+    char header [COMPRESSED_MAX_SIZE];
+    size_t hsize = atcp_make_compressed (c, message, msize, header);
+    sent = atcp_send (c, header, hsize, message + ALLNET_HEADER_SIZE,
+                      msize - ALLNET_HEADER_SIZE);
+  } else {
+    sent = atcp_send (c, full_header, HEADER_FOR_TCP_SIZE, message, msize);
+  }
+  ALLNET_PROBE4 (atcp_frame_out, c->fd, message, msize, sent);
+  if (sent)
+    memcpy (c->last_out, message, ALLNET_HEADER_SIZE);
+}
+
 /* returns true if this was a packet that we should not forward */
-static int handle_keepalive (struct atcp_thread_args * args,
+static int handle_keepalive (struct atcp_state * state,
                              const char * message, int msize,
                              struct sockaddr_storage addr)
 {
@@ -318,61 +678,46 @@ if (debug_keepalive) printf ("handle_keepalive received valid keepalive\n");
     return 1;
   }
   const char * ad_auth = message + hdr_size;
-  acquire (&(args->lock), "q");
-  if ((args->authenticating_keepalive == NULL) || (args->aksize < min_size)) {
+  if ((state->authenticating_keepalive == NULL) || (state->aksize < min_size)) {
     /* no authenticating keepalive received before */
-    args->last_keepalive_sent_time = allnet_time ();
+    state->last_keepalive_sent_time = allnet_time ();
     static char secret [KEEPALIVE_AUTHENTICATION_SIZE];
     static int initialized = 0;
     if (! initialized)
       random_bytes (secret, sizeof (secret));
     initialized = 1;
-    args->authenticating_keepalive = malloc_or_fail (max_size, "atcpd rtk");
-    args->aksize = keepalive_auth (args->authenticating_keepalive, max_size,
-                                   addr, secret, sizeof (secret), 1,
-                                   ad_auth);
+    state->authenticating_keepalive =
+      malloc_tagged (max_size, ALLNET_MEMORY_ATCPD, "atcpd rtk");
+    state->aksize = keepalive_auth (state->authenticating_keepalive, max_size,
+                                    addr, secret, sizeof (secret), 1,
+                                    ad_auth);
   }
-  char * auth = args->authenticating_keepalive + min_size;
+  char * auth = state->authenticating_keepalive + min_size;
   if (memcmp (ad_auth, auth, KEEPALIVE_AUTHENTICATION_SIZE) != 0) {
     memcpy (auth, ad_auth, KEEPALIVE_AUTHENTICATION_SIZE);
   }
-  release (&(args->lock), "q");
   return 1;
 }
 
 /* send most packets out on all the TCP connections, respond to keepalives */
-static void atcp_handle_local_packet (struct atcp_thread_args * args,
+static void atcp_handle_local_packet (struct atcp_state * state,
                                       const char * message, int msize,
                                       struct sockaddr_storage addr)
 {
   /* do not forward keepalives.  Instead, respond to them */
-  if (handle_keepalive (args, message, msize, addr))
+  if (handle_keepalive (state, message, msize, addr))
     return;
 /* printf ("not a keepalive\n"); */
   /* not a keepalive, forward to all the valid tcp sockets */
-  char buffer [ALLNET_MTU + HEADER_FOR_TCP_SIZE];
-  size_t send_len = atcp_make (message, msize, buffer);
-  acquire (&(args->lock), "h");
-  if (send_len > 0) {
-    int i;
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-      if (tcp_fds [i] != -1) {
-        size_t sent = 0;
-        if ((sent = send (tcp_fds [i], buffer, send_len, 0)) != send_len) {
-#ifdef TEST_TCP_ONLY
-printf ("send error %zd != %zd, closing socket to: ", send_len, sent);
-print_sockaddr ((struct sockaddr *) (tcp_addrs + i),
-sizeof (struct sockaddr_storage)); printf ("\n");
-#endif /* TEST_TCP_ONLY */
-          close (tcp_fds [i]);
-          tcp_fds [i] = -1;
-          tcp_bytes [i] = 0;
-          memset (tcp_addrs + i, 0, sizeof (tcp_addrs [0]));
-        }
-      }
-    }
+  char header [HEADER_FOR_TCP_SIZE];
+  if (atcp_make_header (msize, header) <= 0)
+    return;
+  int i;
+  for (i = 0; i < MAX_CONNECTIONS; i++) {
+    struct atcp_connection * c = connections + i;
+    if ((c->fd != -1) && (! c->connecting))
+      atcp_send_message (c, header, message, msize);
   }
-  release (&(args->lock), "h");
 }
 
 static void make_socket_nonblocking (int fd, const char * desc)
@@ -391,39 +736,6 @@ static void make_socket_nonblocking (int fd, const char * desc)
     perror (err_buf);
 }
 
-/* select IPv4 the first time called, IPv6 the second time.
- * return the address family, or 0 for errors */
-static int atcp_accept_common (struct atcp_thread_args * args,
-                               struct sockaddr_storage * addr,
-                               socklen_t * alen, char ** ipv)
-{
-  int result = 0;
-  memset (addr, 0, sizeof (struct sockaddr_storage));
-  *alen = 0;
-  *ipv = "not IP";
-  acquire (&(args->lock), "x");
-  if (accept_count == 1) {
-    struct sockaddr_in * sin = (struct sockaddr_in *) addr;
-    sin->sin_family = AF_INET;
-    sin->sin_addr.s_addr = allnet_htonl (INADDR_ANY);
-    sin->sin_port = allnet_htons (ALLNET_PORT);
-    *alen = sizeof (struct sockaddr_in);
-    *ipv = "IPv4";
-    result = AF_INET;
-  } else if (accept_count == 0) {
-    struct sockaddr_in6 * sin = (struct sockaddr_in6 *) addr;
-    sin->sin6_family = AF_INET6;
-    sin->sin6_addr = in6addr_any;
-    sin->sin6_port = allnet_htons (ALLNET_PORT);
-    *alen = sizeof (struct sockaddr_in6);
-    *ipv = "IPv6";
-    result = AF_INET6;
-  } /* else: result is 0 */
-  accept_count++;
-  release (&(args->lock), "x");
-  return result;
-}
-
 static void perror2 (const char * first, const char * second)
 {
   char buffer [1000];
@@ -431,112 +743,118 @@ static void perror2 (const char * first, const char * second)
   perror (buffer);
 }
 
-static void * atcp_accept_thread (void * arg)
+/* IPv6 is tried right away, and IPv4 10s later, to give IPv6 a chance
+ * to succeed first.  If bind fails, it is tried again 240s later, long
+ * enough for the port to be released. */
+static void listeners_init (unsigned long long int now)
+{
+  listeners [0].af = AF_INET6;
+  listeners [0].next_attempt = now;
+  listeners [1].af = AF_INET;
+  listeners [1].next_attempt = now + 10000;
+  int i;
+  for (i = 0; i < NUM_LISTENERS; i++) {
+    listeners [i].fd = -1;
+    listeners [i].bind_attempts = 0;
+  }
+}
+
+/* try to bind and listen, if it is time */
+static void listener_start (struct atcp_state * state,
+                            struct atcp_listener * l, unsigned long long int now)
 {
-  static int success = 0;  /* shared among the two accept threads */
-  struct atcp_thread_args * args = ((struct atcp_thread_args *) arg);
+  if ((l->fd != -1) || (l->next_attempt == 0) || (l->next_attempt > now))
+    return;
+  char * ipv = ((l->af == AF_INET) ? "IPv4" : "IPv6");
   struct sockaddr_storage bind_addr;
+  memset (&bind_addr, 0, sizeof (bind_addr));
   socklen_t balen;  /* address length for the binding address */
-  char * ipv = "unknown";
-  int af = atcp_accept_common (args, &bind_addr, &balen, &ipv);
-  if (af <= 0) {
-    printf ("atcp_accept_thread socket, af %d, count %d\n", af, accept_count);
-    return NULL;
-  }
-  struct sockaddr * sap = (struct sockaddr *) &bind_addr;
-  if (af == AF_INET)  /* wait 10s for IPv6 to succeed */
-    sleep_while_running (args, 10000);
-  int listen_socket = socket (af, SOCK_STREAM, IPPROTO_TCP);
-  if (listen_socket < 0) {
-    perror2 ("atcp_accept_thread socket", ipv);
-    return NULL;
-  }
-  if (bind (listen_socket, sap, balen) != 0) {
+  if (l->af == AF_INET) {
+    struct sockaddr_in * sin = (struct sockaddr_in *) &bind_addr;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = allnet_htonl (INADDR_ANY);
+    sin->sin_port = allnet_htons (ALLNET_PORT);
+    balen = sizeof (struct sockaddr_in);
+  } else {
+    struct sockaddr_in6 * sin = (struct sockaddr_in6 *) &bind_addr;
+    sin->sin6_family = AF_INET6;
+    sin->sin6_addr = in6addr_any;
+    sin->sin6_port = allnet_htons (ALLNET_PORT);
+    balen = sizeof (struct sockaddr_in6);
+  }
+  l->next_attempt = 0;     /* unless bind fails the first time */
+  int fd = socket (l->af, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    perror2 ("atcpd listener socket", ipv);
+    return;
+  }
+  if (bind (fd, (struct sockaddr *) &bind_addr, balen) != 0) {
+    close (fd);
+    if (l->bind_attempts++ == 0) {
 #ifdef DEBUG_PRINT
-    if (! success)
-      perror2 ("atcp_accept_thread bind", ipv);
+      if (! listen_success)
+        perror2 ("atcpd listener bind", ipv);
 #endif /* DEBUG_PRINT */
-    /* wait 240s, long enough for the port to be released
-     * ipv4 should be 10s behind ipv6, to give it a chance to succeed first */
-    sleep_while_running (args, 240000);
-    if (bind (listen_socket, sap, balen) != 0) {
-      if (! success)
-        perror2 ("atcp_accept_thread bind (again)", ipv);
-      if ((af == AF_INET) && (! success)) {
-        printf ("another atcpd already running, quitting this one\n");
-        args->running = 0;
-      }
-      close (listen_socket);
-      return NULL;
+      l->next_attempt = now + 240000;
+      return;
     }
-#ifdef DEBUG_PRINT
-    printf ("second bind successful\n");
-#endif /* DEBUG_PRINT */
+    if (! listen_success)
+      perror2 ("atcpd listener bind (again)", ipv);
+    if ((l->af == AF_INET) && (! listen_success)) {
+      printf ("another atcpd already running, quitting this one\n");
+      state->running = 0;
+    }
+    return;
   }
-  success = 1;  /* to be seen by the other thread */
-  if (listen (listen_socket, 5) != 0) {
-    perror2 ("atcp_accept_thread listen", ipv);
-    return NULL;
+  listen_success = 1;
+  if (listen (fd, 5) != 0) {
+    perror2 ("atcpd listener listen", ipv);
+    close (fd);
+    return;
   }
-  make_socket_nonblocking (listen_socket, "accept_thread listen_socket");
+  make_socket_nonblocking (fd, "atcpd listen socket");
+  l->fd = fd;
+}
 
-  while (args->running) {   /* loop until main thread goes away */
-    struct sockaddr_storage sas;
-    socklen_t aalen = sizeof (sas);  /* length of accept address */
-    int new_socket = accept (listen_socket, (struct sockaddr *) &sas, &aalen);
-    if (new_socket >= 0) {
-      if (addr_in_list (&sas, 0)) {  /* address is in the list */
+static void atcp_accept (struct atcp_listener * l)
+{
+  struct sockaddr_storage sas;
+  memset (&sas, 0, sizeof (sas));
+  socklen_t aalen = sizeof (sas);  /* length of accept address */
+  int new_socket = accept (l->fd, (struct sockaddr *) &sas, &aalen);
+  if (new_socket < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) &&
+        (errno != ECONNABORTED))
+      perror2 ("atcpd accept", ((l->af == AF_INET) ? "IPv4" : "IPv6"));
+    return;
+  }
+  if (addr_in_list (&sas, 0)) {  /* address is in the list */
 #ifdef TEST_TCP_ONLY
 printf ("refusing connection, address already in list: ");
 print_sockaddr ((struct sockaddr *) &sas, aalen); printf ("\n");
 #endif /* TEST_TCP_ONLY */
-        close (new_socket);
-        sleep_while_running (args, 1000);
-      } else {    /* save the new socket */
+    close (new_socket);
+    return;
+  }
 #ifdef TEST_TCP_ONLY
 printf ("accepted connection from: ");
 print_sockaddr ((struct sockaddr *) &sas, aalen); printf ("\n");
 #endif /* TEST_TCP_ONLY */
-        make_socket_nonblocking (new_socket, "accept_thread new_socket");
-        int i;
-        int index = -1;
-        acquire (&(args->lock), "a"); /* find a free fd slot, save the socket */
-        for (i = MAX_CONNECTIONS / 2; i < MAX_CONNECTIONS; i++)
-          if (tcp_fds [i] == -1)
-            index = i;
-        if (index < 0) {   /* no free fds, close a random connection */
-          index = (int) (random_int (MAX_CONNECTIONS / 2, MAX_CONNECTIONS - 1));
+  make_socket_nonblocking (new_socket, "atcpd accepted socket");
+  int index = -1;
+  int i;
+  for (i = NUM_CONNECT; i < MAX_CONNECTIONS; i++)
+    if (connections [i].fd == -1)
+      index = i;
+  if (index < 0) {   /* no free connections, close a random one */
+    index = (int) (random_int (NUM_CONNECT, MAX_CONNECTIONS - 1));
 #ifdef TEST_TCP_ONLY
 printf ("accept randomly closing socket to: ");
-print_sockaddr ((struct sockaddr *) (tcp_addrs + index),
+print_sockaddr ((struct sockaddr *) &(connections [index].addr),
 sizeof (struct sockaddr_storage)); printf ("\n");
 #endif /* TEST_TCP_ONLY */
-          close (tcp_fds [index]);
-          tcp_fds [index] = -1;
-        }
-        tcp_fds [index] = new_socket;
-        tcp_bytes [index] = 0;
-        memcpy (tcp_addrs + index, &sas, aalen);
-        release (&(args->lock), "a");
-      }
-    } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-      sleep_while_running (args, 1000);   /* accept timed out, wait 1s */
-    } else {
-      perror2 ("atcpd accept", ipv);
-      args->running = 0;
-    }
-  }
-  if (debug_keepalive)
-    printf ("%lld: atcpd_accept_thread ending\n", allnet_time ());
-  close (listen_socket);
-  int i;
-  for (i = MAX_CONNECTIONS / 2; i < MAX_CONNECTIONS; i++) {
-    if (tcp_fds [i] != -1)
-      close (tcp_fds [i]);
-    tcp_fds [i] = -1;
-    tcp_bytes [i] = 0;
   }
-  return NULL;
+  connection_open (connections + index, new_socket, &sas, 0);
 }
 
 static void log_connect_error (struct sockaddr * sap, int err)
@@ -549,169 +867,404 @@ static void log_connect_error (struct sockaddr * sap, int err)
   log_error (alog, "connect");
 }
 
-static void * atcp_connect_thread (void * arg)
+/* returns the backoff entry for the address, or NULL */
+static struct atcp_backoff * backoff_find (struct sockaddr_storage * addr)
 {
-  struct atcp_thread_args * args = ((struct atcp_thread_args *) arg);
-  int sleep_time = KEEPALIVE_SECONDS / 5 + 1; /* quick initial interval, 3sec */
-  int count = 0;
-  while (args->running) {   /* loop until main thread goes away */
-    acquire (&(args->lock), "c");
-#define NUM_CONNECT	(MAX_CONNECTIONS / 2)
-    struct sockaddr_storage addrs [NUM_CONNECT];
-    socklen_t addr_lengths [NUM_CONNECT];
-    unsigned char dest [ADDRESS_SIZE];
-    memset (dest, 0, ADDRESS_SIZE);
-    int n = routing_top_dht_matches (dest, 0, addrs, addr_lengths, NUM_CONNECT);
-#ifdef TEST_TCP_ONLY
-    printf ("atcp_connect_thread: %d peers\n", n);
-#endif /* TEST_TCP_ONLY */
-    if (n <= 0) {  /* no peers to connect to */
-      printf ("atcp_connect_thread: no peers (%d) to connect to\n", n);
-      sleep_while_running (args, 1000);
-      continue;  /* restart the loop */
-    }
-    unsigned long long int i = random_int (0, n - 1);
-    if ((! addr_in_list (addrs + i, 1)) && (tcp_fds [i] < 0) &&
-        (tcp_connecting_fds [i] < 0)) {
-      /* try to connect this random socket */
-      struct sockaddr * sap = (struct sockaddr *) (addrs + i);
-      int sock = socket (sap->sa_family, SOCK_STREAM, IPPROTO_TCP);
-      if (sock < 0) {
-        perror ("atcpd TCP socket");
-        snprintf (alog->b, alog->s, "atcpd unable to open TCP socket\n");
-        log_print (alog);
-      } else {
-        make_socket_nonblocking (sock, "connect_thread new socket");
-        int connect_res = connect (sock, sap, addr_lengths [i]);
-        if (connect_res != 0) {
-          if (errno == EINPROGRESS) {   /* waiting for connection */
-            tcp_connecting_fds [i] = sock;
-            tcp_connecting [i] = addrs [i];
-          } else {   /* error */
-            log_connect_error (sap, errno);
-            close (sock);
-          }
-        }
-      }
-    }   /* end of trying to connect address i */
-    /* see if any pending connect has completed */
-    int maxfd = -1;
-    fd_set write_fds;
-    FD_ZERO (&write_fds);
-    for (i = 0; i < n; i++) {
-      if (tcp_connecting_fds [i] >= 0) {
-        FD_SET (tcp_connecting_fds [i], &write_fds);
-        if (tcp_connecting_fds [i] > maxfd)
-          maxfd = tcp_connecting_fds [i];
-      }
-    }
-    if (maxfd >= 0) {
-      struct timeval timeout = { .tv_sec = 0, .tv_usec = 200 * 1000 };
-      if (select (maxfd + 1, NULL, &write_fds, NULL, &timeout) > 0) {
-        for (i = 0; i < n; i++) {
-          if ((tcp_connecting_fds [i] >= 0) &&
-              (FD_ISSET (tcp_connecting_fds [i], &write_fds))) {
-            int ov = 0;  /* option value -- 0 for success */
-            socklen_t ovl = sizeof (ov);
-            int still_in_progress = 0;
-            if (getsockopt (tcp_connecting_fds [i], SOL_SOCKET, SO_ERROR,
-                            &ov, &ovl) == 0) {
-              if (ov == 0) {   /* success */
-                still_in_progress = 0;
-                tcp_fds [i] = tcp_connecting_fds [i];
-                tcp_addrs [i] = tcp_connecting [i];
-                tcp_bytes [i] = 0;
-              } else if (ov != EINPROGRESS) {   /* error */
-                still_in_progress = 0;
-                log_connect_error ((struct sockaddr *)(tcp_connecting + i), ov);
-                close (tcp_connecting_fds [i]);
-              }
-            }
-            if (! still_in_progress) {   /* clear the "connecting" variables */
-              tcp_connecting_fds [i] = -1;
-              tcp_connecting [i].ss_family = 0;
-            }
-          }
-        }
+  socklen_t alen = sockaddr_len (addr);
+  int i;
+  for (i = 0; i < NUM_BACKOFF; i++)
+    if ((backoffs [i].addr.ss_family != 0) &&
+        (same_sockaddr (addr, alen, &(backoffs [i].addr),
+                        sockaddr_len (&(backoffs [i].addr)))))
+      return backoffs + i;
+  return NULL;
+}
+
+/* a connect to this address failed, so wait longer before the next */
+static void backoff_failed (struct sockaddr_storage * addr,
+                            unsigned long long int now)
+{
+  struct atcp_backoff * b = backoff_find (addr);
+  if (b == NULL) {
+    b = backoffs;
+    int i;
+    for (i = 0; i < NUM_BACKOFF; i++) {
+      if (backoffs [i].addr.ss_family == 0) {
+        b = backoffs + i;
+        break;
       }
+      if (backoffs [i].next_attempt < b->next_attempt)
+        b = backoffs + i;
     }
-    release (&(args->lock), "c");
-    sleep_while_running (args, sleep_time * 1000);
-    if (count++ > n)
-      sleep_time = sleep_time * 12 / 10 + 1;  /* gradual increase, ~20%/loop */
-#define MAX_SLEEP_TIME (KEEPALIVE_SECONDS * 24) /* try at least every 4min */
-    if (sleep_time > MAX_SLEEP_TIME)
-      sleep_time = MAX_SLEEP_TIME;
-#undef MAX_SLEEP_TIME
-  }
-  if (debug_keepalive)
-    printf ("%lld: atcpd_connect_thread ending\n", allnet_time ());
+    b->addr = *addr;
+    b->failures = 0;
+  }
+  unsigned long long int delay = ATCP_BACKOFF_MIN_MS;
+  int i;
+  for (i = 0; (i < b->failures) && (delay < ATCP_BACKOFF_MAX_MS); i++)
+    delay *= 2;
+  if (delay > ATCP_BACKOFF_MAX_MS)
+    delay = ATCP_BACKOFF_MAX_MS;
+  b->failures++;
+  b->next_attempt = now + delay;
+}
+
+/* a connect to this address succeeded */
+static void backoff_clear (struct sockaddr_storage * addr)
+{
+  struct atcp_backoff * b = backoff_find (addr);
+  if (b != NULL)
+    memset (b, 0, sizeof (struct atcp_backoff));
+}
+
+static int backoff_waiting (struct sockaddr_storage * addr,
+                            unsigned long long int now)
+{
+  struct atcp_backoff * b = backoff_find (addr);
+  return ((b != NULL) && (b->next_attempt > now));
+}
+
+/* counts our outgoing connections that are open, and those connecting */
+static void count_connections (int * open, int * connecting)
+{
+  *open = 0;
+  *connecting = 0;
   int i;
   for (i = 0; i < NUM_CONNECT; i++) {
-    if (tcp_fds [i] != -1)
-      close (tcp_fds [i]);
-    tcp_fds [i] = -1;
-    tcp_bytes [i] = 0;
+    if (connections [i].fd == -1)
+      continue;
+    if (connections [i].connecting)
+      (*connecting)++;
+    else
+      (*open)++;
   }
-  for (i = 0; i < MAX_CONNECTIONS; i++) {
-    if (tcp_connecting_fds [i] != -1)
-      close (tcp_connecting_fds [i]);
-    tcp_connecting_fds [i] = -1;
+}
+
+/* fail the connects that have taken too long */
+static void atcp_connect_timeouts (unsigned long long int now)
+{
+  int i;
+  for (i = 0; i < NUM_CONNECT; i++) {
+    struct atcp_connection * c = connections + i;
+    if ((c->fd != -1) && (c->connecting) &&
+        (c->connect_start + ATCP_CONNECT_TIMEOUT_MS <= now)) {
+      log_connect_error ((struct sockaddr *) &(c->addr), ETIMEDOUT);
+      backoff_failed (&(c->addr), now);
+      connection_close (c);
+    }
   }
-  memset (tcp_addrs, 0, sizeof (tcp_addrs));
-  return NULL;
 }
 
-static void * atcp_keepalive_thread (void * arg)
+/* returns the index of the address to connect to next, or -1 if none.
+ * Prefers a different address family than the last connect, then
+ * picks at random among those not connected and not backed off */
+static int connect_candidate (struct atcp_state * state,
+                              struct sockaddr_storage * addrs, int n,
+                              unsigned long long int now)
 {
-  struct atcp_thread_args * args = ((struct atcp_thread_args *) arg);
-  int local_sock = args->local_sock;
-  unsigned int size_to_send = 0;
-  const char * packet = keepalive_packet (&size_to_send);
-  while (args->running) {   /* loop until main thread goes away */
-    acquire (&(args->lock), "k");
-    unsigned long long int now = allnet_time ();
-    if (args->last_keepalive_sent_time + KEEPALIVE_SECONDS < now) {
-if (debug_keepalive) printf ("sending keepalive %p %d\n", args->authenticating_keepalive, args->aksize);
-      if ((args->authenticating_keepalive != NULL) && (args->aksize > 0))
-        send (local_sock, args->authenticating_keepalive, args->aksize, 0);
-      else
-        send (local_sock, packet, size_to_send, 0);
-      args->last_keepalive_sent_time = now;
+  int other [NUM_CONNECT];   /* of a different family than the last */
+  int same [NUM_CONNECT];
+  int num_other = 0;
+  int num_same = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    if ((addr_in_list (addrs + i, 1)) || (backoff_waiting (addrs + i, now)))
+      continue;
+    if (addrs [i].ss_family != state->last_connect_family)
+      other [num_other++] = i;
+    else
+      same [num_same++] = i;
+  }
+  if (num_other > 0)
+    return other [random_int (0, num_other - 1)];
+  if (num_same > 0)
+    return same [random_int (0, num_same - 1)];
+  return -1;
+}
+
+/* start a non-blocking connect to the address */
+static void connect_start (struct atcp_state * state,
+                           struct sockaddr_storage * addr, socklen_t alen,
+                           unsigned long long int now)
+{
+  int index = -1;
+  int ci;
+  for (ci = 0; ci < NUM_CONNECT; ci++)
+    if (connections [ci].fd == -1)
+      index = ci;
+  if (index < 0)   /* all our outgoing connections are in use */
+    return;
+  struct sockaddr * sap = (struct sockaddr *) addr;
+  int sock = socket (sap->sa_family, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    perror ("atcpd TCP socket");
+    snprintf (alog->b, alog->s, "atcpd unable to open TCP socket\n");
+    log_print (alog);
+    return;
+  }
+  state->last_connect_family = sap->sa_family;
+  make_socket_nonblocking (sock, "atcpd connect socket");
+  if (connect (sock, sap, alen) == 0) {
+    connection_open (connections + index, sock, addr, 0);
+    backoff_clear (addr);
+  } else if (errno == EINPROGRESS) {  /* complete when the socket is writable */
+    connection_open (connections + index, sock, addr, 1);
+  } else {   /* error */
+    log_connect_error (sap, errno);
+    backoff_failed (addr, now);
+    close (sock);
+  }
+}
+
+/* if it is time, start connecting to one of the peers.  While fewer than
+ * ATCP_POOL_TARGET connections are open, that is every
+ * ATCP_CONNECT_STAGGER_MS.  Otherwise, the interval starts short (3s),
+ * and gradually increases */
+static void atcp_connect (struct atcp_state * state, unsigned long long int now)
+{
+  atcp_connect_timeouts (now);
+  int open = 0;
+  int connecting = 0;
+  count_connections (&open, &connecting);
+  int filling = (open + connecting < ATCP_POOL_TARGET);
+  if ((filling) && (state->next_connect > now + ATCP_CONNECT_STAGGER_MS))
+    state->next_connect = now;   /* a connection was dropped, replace it */
+  if (state->next_connect > now)
+    return;
+  struct sockaddr_storage addrs [NUM_CONNECT];
+  socklen_t addr_lengths [NUM_CONNECT];
+  unsigned char dest [ADDRESS_SIZE];
+  memset (dest, 0, ADDRESS_SIZE);
+  int n = routing_top_dht_matches (dest, 0, addrs, addr_lengths, NUM_CONNECT);
+#ifdef TEST_TCP_ONLY
+  printf ("atcp_connect: %d peers\n", n);
+#endif /* TEST_TCP_ONLY */
+  if (n <= 0) {  /* no peers to connect to */
+    printf ("atcp_connect: no peers (%d) to connect to\n", n);
+    state->next_connect = now + 1000;
+    return;
+  }
+  if (filling) {   /* fill the pool quickly */
+    state->next_connect = now + ATCP_CONNECT_STAGGER_MS;
+    if (connecting >= ATCP_MAX_CONNECTING)
+      return;
+  } else {
+    state->next_connect = now + state->connect_interval * 1000;
+    if (state->connect_count++ > n)  /* gradual increase, ~20%/attempt */
+      state->connect_interval = state->connect_interval * 12 / 10 + 1;
+#define MAX_CONNECT_INTERVAL (KEEPALIVE_SECONDS * 24) /* at least every 4min */
+    if (state->connect_interval > MAX_CONNECT_INTERVAL)
+      state->connect_interval = MAX_CONNECT_INTERVAL;
+#undef MAX_CONNECT_INTERVAL
+  }
+  int i = connect_candidate (state, addrs, n, now);
+  if (i >= 0)
+    connect_start (state, addrs + i, addr_lengths [i], now);
+}
+
+/* a connecting socket is writable: see if the connect succeeded */
+static void atcp_connect_done (struct atcp_connection * c)
+{
+  int ov = 0;  /* option value -- 0 for success */
+  socklen_t ovl = sizeof (ov);
+  if (getsockopt (c->fd, SOL_SOCKET, SO_ERROR, &ov, &ovl) != 0)
+    ov = errno;
+  if (ov == 0) {   /* success */
+    c->connecting = 0;
+    backoff_clear (&(c->addr));
+    atcp_send_hello (c);
+  } else if (ov != EINPROGRESS) {   /* error */
+    log_connect_error ((struct sockaddr *) &(c->addr), ov);
+    backoff_failed (&(c->addr), allnet_coarse_monotonic_ms ());
+    connection_close (c);
+  }
+}
+
+static void atcp_keepalive (struct atcp_state * state,
+                            unsigned long long int now)
+{
+  if (state->next_keepalive > now)
+    return;
+  state->next_keepalive = now + 1000;
+  unsigned long long int seconds = allnet_time ();
+  if (state->last_keepalive_sent_time + KEEPALIVE_SECONDS < seconds) {
+if (debug_keepalive) printf ("sending keepalive %p %d\n", state->authenticating_keepalive, state->aksize);
+    if ((state->authenticating_keepalive != NULL) && (state->aksize > 0)) {
+      send (state->local_sock, state->authenticating_keepalive,
+            state->aksize, 0);
+    } else {
+      unsigned int size_to_send = 0;
+      const char * packet = keepalive_packet (&size_to_send);
+      send (state->local_sock, packet, size_to_send, 0);
     }
-    release (&(args->lock), "k");
-    sleep_while_running (args, KEEPALIVE_SECONDS);
+    state->last_keepalive_sent_time = seconds;
   }
-  if (debug_keepalive)
-    printf ("%lld: atcpd_keepalive_thread ending\n", allnet_time ());
-  return NULL;
 }
 
-static void * atcp_timer_thread (void * arg)
+/* stop if ad has not sent anything for a long time */
+static void atcp_check_udp (struct atcp_state * state,
+                            unsigned long long int now)
 {
-  struct atcp_thread_args * args = ((struct atcp_thread_args *) arg);
-  int missed_count = 0;
-  do {
-    sleep_while_running (args, KEEPALIVE_SECONDS * 3 * 1000);
-    while (args->running &&
-           (last_udp_received_time + KEEPALIVE_SECONDS * 50 > allnet_time ())) {
-if (debug_keepalive) printf ("atcp_timer_thread clearing debug_keepalive\n");
+  if (state->next_udp_check > now)
+    return;
+  state->next_udp_check = now + KEEPALIVE_SECONDS * 3 * 1000;
+  if (last_udp_received_time + KEEPALIVE_SECONDS * 50 > allnet_time ()) {
+if (debug_keepalive) printf ("atcp_check_udp clearing debug_keepalive\n");
 debug_keepalive = 0;
-      missed_count = 0;  /* recently received */
-      sleep_while_running (args, KEEPALIVE_SECONDS * 1000);
-    }
+    state->missed_count = 0;  /* recently received */
+    return;
+  }
 #ifdef DEBUG_PRINT
-    printf ("last_udp_received_time %lld, current time %lld (k %d, m %d)\n",
-            last_udp_received_time, allnet_time (),
-            (int) KEEPALIVE_SECONDS, missed_count);
+  printf ("last_udp_received_time %lld, current time %lld (k %d, m %d)\n",
+          last_udp_received_time, allnet_time (),
+          (int) KEEPALIVE_SECONDS, state->missed_count);
 debug_keepalive = 1;
 #endif /* DEBUG_PRINT */
-  } while (args->running && (missed_count++ < 3));
-  if (debug_keepalive)
-    printf ("%lld: atcpd_timer_thread ending %d\n", allnet_time (),
-            args->running);
-  args->running = 0;  /* gracefully stop all the other threads */
-  return NULL;
+  if (state->missed_count++ >= 3) {
+    if (debug_keepalive)
+      printf ("%lld: atcp_check_udp stopping\n", allnet_time ());
+    state->running = 0;
+  }
+}
+
+/* read all the packets available from ad.  Returns 1 if any were received,
+ * 0 if none, and -1 for errors */
+static int atcp_local_read (struct atcp_state * state)
+{
+  int result = 0;
+  while (state->running) {
+    char buffer [ALLNET_MTU];
+    struct sockaddr_storage sas;
+    struct sockaddr * sap = (struct sockaddr *) (&sas);
+    socklen_t addr_len = sizeof (sas);
+    ssize_t r = recvfrom (state->local_sock, buffer, sizeof (buffer),
+                          0, sap, &addr_len);
+    if (r < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        return result;
+      if (errno == ECONNREFUSED)
+        snprintf (alog->b, alog->s, "atcpd socket %d connection refused\n",
+                  state->local_sock);
+      else
+        snprintf (alog->b, alog->s,
+                  "atcpd socket closed, socket %d, errno %d, restarting\n",
+                  state->local_sock, errno);
+      printf ("%s", alog->b);
+      log_print (alog);
+      return -1;
+    }
+    if (r > 0) {           /* got a packet */
+      atcp_handle_local_packet (state, buffer, (int) r, sas);
+      last_udp_received_time = allnet_coarse_time ();
+      result = 1;
+/* printf ("received %d bytes, time %lld\n", (int) r, last_udp_received_time); */
+    }
+  }
+  return result;
+}
+
+static unsigned long long int min_time (unsigned long long int a,
+                                        unsigned long long int b)
+{
+  return ((a < b) ? a : b);
+}
+
+/* returns how long poll can wait until the next timer is due */
+static int wait_time (struct atcp_state * state, unsigned long long int now)
+{
+  unsigned long long int next = min_time (state->next_keepalive,
+                                          state->next_connect);
+  next = min_time (next, state->next_udp_check);
+  int i;
+  for (i = 0; i < NUM_LISTENERS; i++)
+    if ((listeners [i].fd == -1) && (listeners [i].next_attempt != 0))
+      next = min_time (next, listeners [i].next_attempt);
+  if (next <= now)
+    return 0;
+  return (int) min_time (next - now, MAX_WAIT_MS);
+}
+
+/* the event loop.  Returns 1 if any packet was received from ad */
+static int atcp_loop (struct atcp_state * state)
+{
+  int received = 0;
+  /* ad, the listeners, and the connections */
+  struct pollfd fds [1 + NUM_LISTENERS + MAX_CONNECTIONS];
+  int owner [1 + NUM_LISTENERS + MAX_CONNECTIONS];
+  while (state->running && (run_state == 1)) {
+    allnet_clock_update ();   /* timers and received packets use this */
+    unsigned long long int now = allnet_coarse_monotonic_ms ();
+    int i;
+    for (i = 0; i < NUM_LISTENERS; i++)
+      listener_start (state, listeners + i, now);
+    atcp_keepalive (state, now);
+    atcp_connect (state, now);
+    atcp_check_udp (state, now);
+    int nfds = 0;
+    fds [nfds].fd = state->local_sock;
+    fds [nfds].events = POLLIN;
+    owner [nfds++] = -1;
+    for (i = 0; i < NUM_LISTENERS; i++) {
+      if (listeners [i].fd != -1) {
+        fds [nfds].fd = listeners [i].fd;
+        fds [nfds].events = POLLIN;
+        owner [nfds++] = MAX_CONNECTIONS + i;
+      }
+    }
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+      struct atcp_connection * c = connections + i;
+      if (c->fd != -1) {
+        fds [nfds].fd = c->fd;
+        if (c->connecting)
+          fds [nfds].events = POLLOUT;
+        else if (c->out_bytes > 0)
+          fds [nfds].events = POLLIN | POLLOUT;
+        else
+          fds [nfds].events = POLLIN;
+        owner [nfds++] = i;
+      }
+    }
+    int n = poll (fds, nfds, wait_time (state, now));
+    if (n < 0) {
+      if (errno != EINTR) {
+        perror ("atcpd poll");
+        state->running = 0;
+      }
+      continue;
+    }
+    for (i = 0; (n > 0) && (i < nfds); i++) {
+      short ev = fds [i].revents;
+      if (ev == 0)
+        continue;
+      n--;
+      if (owner [i] < 0) {                     /* from ad */
+        int r = atcp_local_read (state);
+        if (r < 0)
+          state->running = 0;
+        else if (r > 0)
+          received = 1;
+      } else if (owner [i] >= MAX_CONNECTIONS) {   /* a listener */
+        atcp_accept (listeners + (owner [i] - MAX_CONNECTIONS));
+      } else {
+        struct atcp_connection * c = connections + owner [i];
+        /* the connection may have been closed while sending ad's packets,
+         * or its slot reused for a new connection */
+        if (c->fd != fds [i].fd)
+          continue;
+        if (c->connecting) {
+          atcp_connect_done (c);
+          continue;
+        }
+        if (ev & POLLOUT)
+          atcp_write (c);
+        if ((c->fd != -1) && (ev & (POLLIN | POLLERR | POLLHUP)))
+          atcp_read (state, owner [i]);
+        if ((c->fd != -1) && (ev & POLLNVAL))
+          connection_close (c);
+      }
+    }
+  }
+  return received;
 }
 
 static int local_socket ()
@@ -750,95 +1303,57 @@ void * atcpd_main (void * arg)
   }
   run_state = 1;              /* running */
   alog = init_log ("atcpd");
+  allnet_thread_config ("atcpd");   /* the event loop runs in this thread */
   int restart_count = 0;
+  int i;
+  for (i = 0; i < MAX_CONNECTIONS; i++) {
+    connections [i].fd = -1;
+    connections [i].out = NULL;
+    connections [i].decoded = NULL;
+  }
   while ((restart_count++ < 3) && (run_state == 1)) {
     int new_sock = local_socket ();
-    make_socket_nonblocking (new_sock, "main thread UDP socket to/from AD");
     last_udp_received_time = allnet_time (); /* start all the timers now */
     if (new_sock < 0) {
       sleep (2);
       continue;  /* start over, after a two-second pause */
     }
-    struct atcp_thread_args * thread_args =
-      malloc_or_fail (sizeof (struct atcp_thread_args), "atcpd_main");
-    thread_args->local_sock = new_sock;
-    int i;
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-      tcp_fds [i] = -1;
-      tcp_connecting_fds [i] = -1;
-      tcp_bytes [i] = 0;
-    }
-    accept_count = 0;           /* do IPv6 first, then IPv4 */
-    memset (tcp_addrs, 0, sizeof (tcp_addrs));
-    pthread_mutex_init (&(thread_args->lock), NULL);
-    thread_args->running = 1;
-    thread_args->last_keepalive_sent_time = 0; /* we have sent no keepalives */
-    thread_args->authenticating_keepalive = NULL;
-    thread_args->aksize = 0;
-    pthread_t thr1, thr2, thr3, thr4, thr5, thr6;
-    pthread_create (&thr1, NULL, atcp_recv_thread, (void *) thread_args);
-    pthread_create (&thr2, NULL, atcp_keepalive_thread, (void *) thread_args);
-    /* two accept threads, one each for IPv4 and IPv6. */
-    pthread_create (&thr3, NULL, atcp_accept_thread, (void *) thread_args);
-    pthread_create (&thr4, NULL, atcp_connect_thread, (void *) thread_args);
-    pthread_create (&thr5, NULL, atcp_accept_thread, (void *) thread_args);
-    pthread_create (&thr6, NULL, atcp_timer_thread, (void *) thread_args);
-    while (thread_args->running) {
-      /* read packets from ad until we are stopped or have an error */
-      char buffer [ALLNET_MTU];
-      struct sockaddr_storage sas;
-      struct sockaddr * sap = (struct sockaddr *) (&sas);
-      socklen_t addr_len = sizeof (sas);
-      ssize_t r = recvfrom (thread_args->local_sock, buffer, sizeof (buffer),
-                            0, sap, &addr_len);
-      if ((r < 0) &&   /* some error, or timeout */
-          (errno != EAGAIN) && (errno != EWOULDBLOCK)) {  /* not a timeout */
-        if (errno == ECONNREFUSED)
-          snprintf (alog->b, alog->s,
-                    "atcpd socket %d connection refused, %p\n",
-                    thread_args->local_sock, thread_args);
-        else
-          snprintf (alog->b, alog->s,
-                    "atcpd socket closed, socket %d, errno %d, restarting %p\n",
-                    thread_args->local_sock, errno, thread_args);
-        printf ("%s", alog->b);
-        log_print (alog);
-        close (thread_args->local_sock);
-        thread_args->running = 0;  /* kill off all the other threads, if any */
-      } else if (r > 0) {           /* got a packet */
-        atcp_handle_local_packet (thread_args, buffer, (int) r, sas);
-        last_udp_received_time = allnet_time ();
-        restart_count = 0; /* successful, doesn't count as a restart any more */
-/* printf ("received %d bytes, time %lld\n", (int) r, last_udp_received_time); */
-      }
-      sleep_while_running (thread_args, 30);  /* sleep 1/30s */
+    make_socket_nonblocking (new_sock, "main thread UDP socket to/from AD");
+    unsigned long long int now = allnet_monotonic_ms ();
+    struct atcp_state state;
+    memset (&state, 0, sizeof (state));
+    state.local_sock = new_sock;
+    state.local_alen = sizeof (state.local_addr);
+    if (getpeername (new_sock, (struct sockaddr *) &(state.local_addr),
+                     &(state.local_alen)) != 0) {
+      perror ("atcpd getpeername");
+      close (new_sock);
+      sleep (2);
+      continue;
     }
-    pthread_join (thr1, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(1) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    pthread_join (thr2, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(2) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    pthread_join (thr3, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(3) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    pthread_join (thr4, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(4) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    pthread_join (thr5, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(5) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    pthread_join (thr6, NULL);
-#ifdef DEBUG_PRINT
-    printf ("pthread_join(6) completed at %lld\n", allnet_time_us ());
-#endif /* DEBUG_PRINT */
-    close (thread_args->local_sock);  /* may already be closed */
-    free (thread_args);
+    state.running = 1;
+    state.last_keepalive_sent_time = 0; /* we have sent no keepalives */
+    state.authenticating_keepalive = NULL;
+    state.aksize = 0;
+    state.next_keepalive = now;
+    state.next_connect = now;
+    state.next_udp_check = now + KEEPALIVE_SECONDS * 3 * 1000;
+    state.connect_interval = KEEPALIVE_SECONDS / 5 + 1;  /* quick, 3sec */
+    for (i = 0; i < MAX_CONNECTIONS; i++)
+      connection_close (connections + i);
+    memset (backoffs, 0, sizeof (backoffs));
+    listen_success = 0;
+    listeners_init (now);
+    if (atcp_loop (&state))
+      restart_count = 0; /* successful, doesn't count as a restart any more */
+    for (i = 0; i < MAX_CONNECTIONS; i++)
+      connection_close (connections + i);
+    for (i = 0; i < NUM_LISTENERS; i++)
+      if (listeners [i].fd != -1)
+        close (listeners [i].fd);
+    close (state.local_sock);
+    if (state.authenticating_keepalive != NULL)
+      free_tagged (state.authenticating_keepalive);
 #ifdef DEBUG_PRINT
     printf ("%lld: atcpd_main restarting %d, run state %d\n",
             allnet_time_us (), restart_count, run_state);
@@ -849,4 +1364,3 @@ void * atcpd_main (void * arg)
   run_state = 0;
   return NULL;
 }
-
@@ -6,6 +6,8 @@ import java.util.ArrayList;
 import java.nio.file.*;
 import javax.swing.*;
 import javax.swing.border.Border;
+import javax.swing.event.ChangeEvent;
+import javax.swing.event.ChangeListener;
 import javax.swing.text.AttributeSet;
 import javax.swing.text.BadLocationException;
 import javax.swing.text.Document;
@@ -82,6 +84,18 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
     private int lastResizingWidth;
     // list of msg bubbles (so we can resize them when indicated
     private ArrayList<MessageBubble<Message>> bubbles;
+    // the rows of the message panel, one per bubble, in order.  Only the
+    // rows in or near the visible part of the scroll pane are laid out
+    // for the current width, the others when they are scrolled into view
+    private ArrayList<BubbleRow> rows;
+    private boolean layoutPending = false;
+    // the bubbles shown before the last clearMsgs, and those shown since,
+    // so showing the same messages again (e.g. to display more messages)
+    // reuses the bubbles and their layouts
+    private java.util.Map<Message, MessageBubble<Message>> oldBubbles =
+        new java.util.IdentityHashMap<>();
+    private java.util.Map<Message, MessageBubble<Message>> shownBubbles =
+        new java.util.IdentityHashMap<>();
     // listener for this panel's events
     private ActionListener theListener;
     // make code flexible about button meaning
@@ -137,6 +151,13 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         // pane contents are resized
         scrollPane.getVerticalScrollBar().addComponentListener(
             new ScrollPaneResizeAdapter(scrollPane, true));
+        // lay out the bubbles as they are scrolled into view
+        scrollPane.getViewport().addChangeListener(new ChangeListener() {
+            @Override
+            public void stateChanged(ChangeEvent e) {
+                scheduleLayoutVisibleBubbles();
+            }
+        });
         //
         unackedBubbles = new ArrayList<>();
         //
@@ -205,6 +226,7 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         }
         // for resize/relayout of message bubbles when panel is resized
         bubbles = new ArrayList<>();
+        rows = new ArrayList<>();
         // for tracking missing msgs
         lastReceived = -1;
     }
@@ -333,6 +355,7 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         // tell scroll panel to scroll to the bottom the next time it adjusts,
         // which will be triggered right now when it validates.  there is 
         // apparently no other way to do this 
+        layoutEndRows(true);
         scrollToBottom = true;
         messagePanel.revalidate();
     }
@@ -341,10 +364,64 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         // tell scroll panel to scroll to the top the next time it adjusts,
         // which will be triggered right now when it validates.  there is 
         // apparently no other way to do this 
+        layoutEndRows(false);
         scrollToTop = true;
         messagePanel.revalidate();
     }
 
+    // the width for laying out the bubbles
+    private int bubbleWidth() {
+        if (lastResizingWidth <= 0) {
+            lastResizingWidth = resizingKey.getWidth();
+        }
+        return lastResizingWidth;
+    }
+
+    // lays out enough rows at the bottom (or top) to fill the view twice
+    private void layoutEndRows(boolean atBottom) {
+        int needed = 2 * Math.max(scrollPane.getViewport().getHeight(),
+                                  resizingKey.getHeight());
+        int height = 0;
+        for (int i = 0; (i < rows.size()) && (height < needed); i++) {
+            BubbleRow row = rows.get(atBottom ? (rows.size() - 1 - i) : i);
+            row.layOut();
+            height += row.getPreferredSize().height;
+        }
+    }
+
+    private void scheduleLayoutVisibleBubbles() {
+        if (layoutPending) {
+            return;
+        }
+        layoutPending = true;
+        // not while the scroll pane is in the middle of its own layout
+        SwingUtilities.invokeLater(new Runnable() {
+            @Override
+            public void run() {
+                layoutPending = false;
+                layoutVisibleBubbles();
+            }
+        });
+    }
+
+    // lays out the rows that are visible, or within one view of visible
+    private void layoutVisibleBubbles() {
+        Rectangle view = scrollPane.getViewport().getViewRect();
+        int top = view.y - view.height;
+        int bottom = view.y + 2 * view.height;
+        boolean changed = false;
+        for (BubbleRow row : rows) {
+            Rectangle r = row.getBounds();
+            // rows not yet placed have no height, layoutEndRows does those
+            if ((r.height > 0) && (r.y + r.height >= top) && (r.y <= bottom)) {
+                changed = row.layOut() || changed;
+            }
+        }
+        if (changed) {
+            messagePanel.revalidate();
+        }
+    }
+
     private void addBubble(MessageBubble<Message> bubble, boolean initial) {
         Message message = bubble.getMessage();
         boolean left = true;
@@ -352,26 +429,35 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
             left = message.to.equals(Message.SELF);
         }
         if (initial) {
-            // make bubble (obviously)
-            bubble.setBorder(new RoundedBorder(borderColor, borderWidth,
-                borderRadius, borderInset));
+            // make bubble (obviously), unless reusing it
+            if (bubble.getBorder() == null) {
+                bubble.setBorder(new RoundedBorder(borderColor, borderWidth,
+                    borderRadius, borderInset));
+            }
             // save for resizing
             bubbles.add(bubble);
         }
         //
-        JPanel inner = new JPanel();
-        inner.setBackground(backgroundColor);
-        inner.setLayout(new BoxLayout(inner, BoxLayout.X_AXIS));
-        if (left) {
-            inner.add(bubble);
-            inner.add(Box.createHorizontalGlue());
+        BubbleRow row = new BubbleRow(bubble, left);
+        rows.add(row);
+        messagePanel.add(row);
+        messagePanel.add(Box.createRigidArea(new Dimension(0, 4)));
+    }
+
+    // returns the bubble for this message shown before the last clearMsgs,
+    // with the new color, or a new bubble if there is none or the text
+    // has changed
+    private MessageBubble<Message> makeBubble(Message msg, boolean isReceived,
+        Color bg, String text, JComponent container) {
+        MessageBubble<Message> bubble = oldBubbles.remove(msg);
+        if ((bubble != null) && bubble.getText().equals(text)) {
+            bubble.setBubbleBackground(bg);
         }
         else {
-            inner.add(Box.createHorizontalGlue());
-            inner.add(bubble);
+            bubble = new MessageBubble<>(msg, isReceived, bg, text, container);
         }
-        messagePanel.add(inner);
-        messagePanel.add(Box.createRigidArea(new Dimension(0, 4)));
+        shownBubbles.put(msg, bubble);
+        return bubble;
     }
 
     public void addMissing(long numMissing) {
@@ -394,7 +480,7 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         Color bg = getMsgColor(msg, false,
                                (unackedPeers.length < peers.length));
         MessageBubble<Message> bubble
-            = new MessageBubble<>(msg, false, bg, text, container);
+            = makeBubble(msg, false, bg, text, container);
         addBubble(bubble, true);
         // update ack tracking, i.e. add as many as are not acked
         for (String u: unackedPeers) {
@@ -407,7 +493,7 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
         boolean acked = msg.acked();
         Color bg = getMsgColor(msg, isReceived, acked);
         MessageBubble<Message> bubble
-            = new MessageBubble<>(msg, isReceived, bg, text, container);
+            = makeBubble(msg, isReceived, bg, text, container);
         addBubble(bubble, true);
         // update ack tracking, i.e. only add if not acked
         if (!acked) {
@@ -423,13 +509,16 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
                 break;
             }
         }
-        messagePanel.revalidate();
+        // only the color changed, setBubbleBackground repaints it
     }
 
     public void clearMsgs() {
         messagePanel.removeAll();
         unackedBubbles.clear();
         bubbles.clear();
+        rows.clear();
+        oldBubbles = shownBubbles;
+        shownBubbles = new java.util.IdentityHashMap<>();
         // must restore the more msgs button at top of panel 
         messagePanel.add(Box.createRigidArea(new Dimension(0, 10)));
         messagePanel.add(morePanel);
@@ -450,15 +539,10 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
                 return;
             }
             lastResizingWidth = width;
-            messagePanel = makeMessagePanel();
             // force it to recalc chars per line
             MessageBubble.setEstimatedCharsPerLine(0);
-            for (MessageBubble<Message> b : bubbles) {
-                b.resizeBubble(width);
-                addBubble(b, false);
-            }
-            scrollPane.setViewportView(messagePanel);
-            messagePanel.addComponentListener(this);
+            // the rows at the bottom are laid out again now, the others
+            // when they are scrolled into view
             validateToBottom();
         }
         else if (e.getComponent() == messagePanel) {
@@ -538,6 +622,63 @@ class ConversationPanel extends JPanel implements ComponentListener, KeyListener
     }
     
     
+    // one row of the message panel, with its bubble on the left or right.
+    // Until the bubble is laid out for the current width, the row keeps
+    // the size of the bubble's last layout, or if it has never been laid
+    // out, an estimate
+    private class BubbleRow extends JPanel {
+
+        // just to avoid a warning
+        private static final long serialVersionUID = 1L;
+        private final MessageBubble<Message> bubble;
+
+        private BubbleRow(MessageBubble<Message> bubble, boolean left) {
+            this.bubble = bubble;
+            setBackground(backgroundColor);
+            setLayout(new BoxLayout(this, BoxLayout.X_AXIS));
+            if (left) {
+                add(bubble);
+                add(Box.createHorizontalGlue());
+            }
+            else {
+                add(Box.createHorizontalGlue());
+                add(bubble);
+            }
+        }
+
+        // @return true if the bubble had to be laid out
+        private boolean layOut() {
+            int width = bubbleWidth();
+            if (bubble.isLaidOut(width)) {
+                return false;
+            }
+            bubble.resizeBubble(width);
+            invalidate();
+            return true;
+        }
+
+        private Dimension estimate() {
+            int width = bubbleWidth();
+            return new Dimension(width / 2, bubble.estimateHeight(width));
+        }
+
+        @Override
+        public Dimension getPreferredSize() {
+            if (bubble.hasLayout()) {
+                return super.getPreferredSize();
+            }
+            return estimate();
+        }
+
+        @Override
+        public Dimension getMinimumSize() {
+            if (bubble.hasLayout()) {
+                return super.getMinimumSize();
+            }
+            return estimate();
+        }
+    }
+
     // used to make scroll pane scroll to the bottom on changes
     private class MyAdjustmentListener implements AdjustmentListener {
 
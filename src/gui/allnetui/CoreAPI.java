@@ -77,6 +77,10 @@ public interface CoreAPI {
     //         a negative value of max requests all messages
     Message[] getMessages(String contact, int max);
 
+    // @return up to max saved messages to/from this contact that are
+    //         older than the given message (or the latest if before is null)
+    Message[] getMessagesPage(String contact, Message before, int max);
+
     // set that the contact was read now
     void setReadTime(String contact);
 
@@ -19,19 +19,26 @@ public class CoreConnect extends Thread implements CoreAPI {
     java.net.Socket sock;
     java.io.DataInputStream sockIn;
     java.io.DataOutputStream sockOut;
-    byte[] bufferedResponse = null;
-    // mutex is used to serialize access to bufferedResponse and sockIn
-    private final Object mutex = new Object();
-    // only deliver callbacks after all contacts have been loaded
-    private boolean readyForCallbacks = false;
-    private java.util.LinkedList<byte []>
-        pendingCallbacks = new java.util.LinkedList<byte []>();
+
+    // every request is sent with a request ID, and the core sends the
+    // reply with the same ID, so any number of requests may be waiting
+    // for replies.  The reader thread reads everything the core sends,
+    // completing the future for each reply and queueing the callbacks.
+    // The callbacks are delivered by the CoreConnect thread once all the
+    // contacts have been loaded, so a callback may itself make RPCs
+    private long nextRequestId = 1;  // synchronized by doRPCAsync
+    private final java.util.Map<Long, RPCFuture> pendingRPCs =
+        new java.util.concurrent.ConcurrentHashMap<Long, RPCFuture>();
+    private final java.util.concurrent.BlockingQueue<byte []> callbacks =
+        new java.util.concurrent.LinkedBlockingQueue<byte []>();
+    private Thread reader = null;
 
     static final byte guiContacts = 1;
     static final byte guiSubscriptions = 2;
     static final byte guiContactExists = 3;
     static final byte guiContactIsGroup = 4;
     static final byte guiHasPeerKey = 5;
+    static final byte guiContactsDelta = 6;
 
     static final byte guiCreateGroup = 10;
     static final byte guiMembers = 11;
@@ -59,6 +66,7 @@ public class CoreConnect extends Thread implements CoreAPI {
     static final byte guiGetMessages = 40;
     static final byte guiSendMessage = 41;
     static final byte guiSendBroadcast = 42;
+    static final byte guiGetMessagesPage = 43;
 
     static final byte guiKeyExchange = 50;
     static final byte guiSubscribe = 51;
@@ -66,12 +74,16 @@ public class CoreConnect extends Thread implements CoreAPI {
 
     static final byte guiBusyWait = 60;
 
+    // followed by a 64-bit request ID and any request
+    static final byte guiRequestId = 80;
+
     // callbacks from the core to the GUI, with no response
     static final byte guiCallbackMessageReceived      = 70;
     static final byte guiCallbackMessageAcked         = 71;
     static final byte guiCallbackContactCreated       = 72;
     static final byte guiCallbackSubscriptionComplete = 73;
     static final byte guiCallbackTraceResponse        = 74;
+    static final byte guiCallbackContactsChanged      = 75;
 
     // to refill these caches when something changes, just set them to null
     java.util.Collection<String> cachedContacts = null;
@@ -79,13 +91,33 @@ public class CoreConnect extends Thread implements CoreAPI {
     java.util.Map<String, Boolean> cachedNotifyContacts = null;
     java.util.Map<String, Boolean> cachedSaveContacts = null;
     java.util.Map<String, Boolean> cachedIsGroup = null;
+    java.util.Map<String, Boolean> cachedHasPeerKey = null;
+    java.util.Map<String, Boolean> cachedComplete = null;
+
+    // the reader thread updates the caches while other threads use them
+    private final Object cacheLock = new Object();
 
     private void clearCaches() {
-        cachedContacts = null;
-        cachedVisibleContacts = null;
-        cachedNotifyContacts = null;
-        cachedSaveContacts = null;
-        cachedIsGroup = null;
+        synchronized (cacheLock) {
+            cachedContacts = null;
+            cachedVisibleContacts = null;
+            cachedNotifyContacts = null;
+            cachedSaveContacts = null;
+            cachedIsGroup = null;
+            cachedHasPeerKey = null;
+            cachedComplete = null;
+        }
+    }
+
+    // the contacts and the delta callbacks have a bitset of the
+    // attributes of each contact
+    private void cacheAttributes(String contact, byte b) {
+        cachedVisibleContacts.put(contact, (b & 1) != 0);
+        cachedNotifyContacts.put(contact, (b & 2) != 0);
+        cachedSaveContacts.put(contact, (b & 4) != 0);
+        cachedIsGroup.put(contact, (b & 8) != 0);
+        cachedHasPeerKey.put(contact, (b & 16) != 0);
+        cachedComplete.put(contact, (b & 32) != 0);
     }
 
     // subscriptions are separate from contacts, no need to put them together
@@ -105,10 +137,62 @@ public class CoreConnect extends Thread implements CoreAPI {
             this.sockIn =
                 new java.io.DataInputStream(this.sock.getInputStream());
             this.sockOut =
-                new java.io.DataOutputStream(this.sock.getOutputStream());
+                new java.io.DataOutputStream(new java.io.BufferedOutputStream(
+                    this.sock.getOutputStream()));
         } catch (java.lang.Exception e) {
             System.out.println("exception " + e + " creating socket");
         }
+        this.reader = new Thread() {
+            @Override
+            public void run() {
+                readFromCore();
+            }
+        };
+        this.reader.setDaemon(true);
+        this.reader.start();
+    }
+
+    // the reply to an RPC, filled in by the reader thread
+    static class RPCFuture implements java.util.concurrent.Future<byte[]> {
+        private byte[] result = null;
+
+        synchronized void complete(byte[] value) {
+            result = value;
+            notifyAll();
+        }
+
+        public boolean cancel(boolean mayInterruptIfRunning) {
+            return false;   // the core will reply anyway
+        }
+
+        public boolean isCancelled() {
+            return false;
+        }
+
+        public synchronized boolean isDone() {
+            return (result != null);
+        }
+
+        public synchronized byte[] get() throws InterruptedException {
+            while (result == null)
+                wait();
+            return result;
+        }
+
+        public synchronized byte[] get(long timeout,
+                                       java.util.concurrent.TimeUnit unit)
+            throws InterruptedException,
+                   java.util.concurrent.TimeoutException {
+            long finish = System.nanoTime() + unit.toNanos(timeout);
+            while (result == null) {
+                long remaining = finish - System.nanoTime();
+                if (remaining <= 0)
+                    throw new java.util.concurrent.TimeoutException();
+                java.util.concurrent.TimeUnit.NANOSECONDS.timedWait(this,
+                                                                    remaining);
+            }
+            return result;
+        }
     }
 
     // calls SocketUtils.bString, but never returns null
@@ -157,6 +241,34 @@ public class CoreConnect extends Thread implements CoreAPI {
         handlers.contactCreated(peer);
     }
 
+    // after asking for guiContactsDelta, the core sends the changes
+    // to the contacts, so we can update the caches instead of asking again
+    private void callbackContactsChanged(byte[] value) {
+        assert(value.length >= 9);
+        long count = SocketUtils.b64(value, 1);
+        String[] changed =
+            SocketUtils.bStringArray(value, 9 + (int)count, count);
+        synchronized (cacheLock) {
+            if (cachedContacts == null)  // will get all the contacts next time
+                return;
+            for (int i = 0; i < count; i++) {
+                byte b = value [i + 9];
+                if ((b & 0x80) != 0) {   // removed
+                    cachedContacts.remove(changed[i]);
+                    cachedVisibleContacts.remove(changed[i]);
+                    cachedNotifyContacts.remove(changed[i]);
+                    cachedSaveContacts.remove(changed[i]);
+                    cachedIsGroup.remove(changed[i]);
+                    cachedHasPeerKey.remove(changed[i]);
+                    cachedComplete.remove(changed[i]);
+                } else {
+                    cachedContacts.add(changed[i]);
+                    cacheAttributes(changed[i], b);
+                }
+            }
+        }
+    }
+
     private void callbackSubscriptionComplete(byte[] value) {
         assert(value.length > 2);
         cachedSubscriptions = null;   // reset the cache
@@ -212,39 +324,19 @@ public class CoreConnect extends Thread implements CoreAPI {
     private boolean dispatch(byte[] value) {
         switch(value[0]) {
         case guiCallbackMessageReceived:
-            if (readyForCallbacks) {
-                callbackMessageReceived(value);
-            } else {
-                pendingCallbacks.add(value);
-            }
+            callbackMessageReceived(value);
             return true;
         case guiCallbackMessageAcked:
-            if (readyForCallbacks) {
-                callbackMessageAcked(value);
-            } else {
-                pendingCallbacks.add(value);
-            }
+            callbackMessageAcked(value);
             return true;
         case guiCallbackContactCreated:
-            if (readyForCallbacks) {
-                callbackContactCreated(value);
-            } else {
-                pendingCallbacks.add(value);
-            }
+            callbackContactCreated(value);
             return true;
         case guiCallbackSubscriptionComplete:
-            if (readyForCallbacks) {
-                callbackSubscriptionComplete(value);
-            } else {
-                pendingCallbacks.add(value);
-            }
+            callbackSubscriptionComplete(value);
             return true;
         case guiCallbackTraceResponse:
-            if (readyForCallbacks) {
-                callbackTraceResponse(value);
-            } else {
-                pendingCallbacks.add(value);
-            }
+            callbackTraceResponse(value);
             return true;
         default:
             return false;
@@ -255,30 +347,48 @@ public class CoreConnect extends Thread implements CoreAPI {
     // https://stackoverflow.com/questions/1176135/java-socket-send-receive-byte-array and
     // http://docs.oracle.com/javase/tutorial/essential/concurrency/syncrgb.html
 
-    // send and receive are synchronized separately for multiple reasons:
-    // 1. it's OK to send while receiving, there is no conflict
-    // 2. if the CoreConnect thread is stuck on receiving, we want it
-    //    to complete the receive and save the buffer
-
+    // sends the request with a new request ID, and returns without
+    // waiting for the reply, which has the same code as the request.
     // synchronized, so nobody else gets to send on the same socket
     // until we are done
-    private synchronized void sendRPC(byte[] arg) {
-        try {
-            this.sockOut.writeLong(arg.length);
-            this.sockOut.write(arg);
-        } catch (java.lang.Exception e) {
-            System.out.println("exception " + e + " writing to socket");
-            System.exit(0);
+    private java.util.concurrent.Future<byte[]> doRPCAsync(byte[] arg) {
+        RPCFuture future = new RPCFuture();
+        synchronized (this) {
+            long id = nextRequestId++;
+            pendingRPCs.put(id, future);
+            try {
+                this.sockOut.writeLong(1 + 8 + arg.length);
+                this.sockOut.writeByte(guiRequestId);
+                this.sockOut.writeLong(id);
+                this.sockOut.write(arg);
+                this.sockOut.flush();
+            } catch (java.lang.Exception e) {
+                System.out.println("exception " + e + " writing to socket");
+                System.exit(0);
+            }
         }
+        return future;
     }
 
-    // synchronized by the caller
-    private byte[] receiveBuffer() {
-        if (this.bufferedResponse != null) {
-            byte[] result = this.bufferedResponse;
-            this.bufferedResponse = null;
-            return result;
+    // waits for the reply to a request sent by doRPCAsync
+    private static byte[] waitRPC(java.util.concurrent.Future<byte[]> reply) {
+        while (true) {
+            try {
+                return reply.get();
+            } catch (InterruptedException e) {
+            } catch (java.util.concurrent.ExecutionException e) {
+                System.out.println("exception " + e + " waiting for reply");
+                System.exit(1);
+            }
         }
+    }
+
+    private byte[] doRPC(byte[] arg) {
+        return waitRPC(doRPCAsync(arg));
+    }
+
+    // only called by the reader thread
+    private byte[] receiveBuffer() {
         try {
             long length = this.sockIn.readLong();
             if (length > 0) {
@@ -297,78 +407,64 @@ public class CoreConnect extends Thread implements CoreAPI {
         return null;
     }
 
-    // synchronized by the caller
-    private boolean saveBuffer(byte[] buffer) {
-        if (this.bufferedResponse == null) {
-            this.bufferedResponse = buffer;
-            return true;
-        } else {
-            System.out.println("saveBuffer discarding " + buffer.length +
-                               "-byte buffer with code " + buffer[0]);
-        }
-        return false;
-    }
-
-    // code is 0 to loop forever, just dispatching and/or saving the buffer
-    // multiple threads may call this at the same time, only one of them
-    // at a time should proceed through the synchronized block
-    private byte[] receiveRPC(byte code) {
-        while(true) {  // repeat until we get our match
-            boolean sleep = false;
-            synchronized (this.mutex) {
-                byte[] result = receiveBuffer();
-                if (result != null) {
-                    // System.out.println ("receiveRPC (" + code + ") got " + result.length + " bytes, code " + result[0]);
-                    if ((code != 0) && (result[0] == code))   // rpc complete
-                        return result;
-                    if (! dispatch(result)) { // not a dispatch, save buffer
-                        saveBuffer(result);
-                        sleep = true;
-                    }
+    // the reader thread: complete the replies, and queue the callbacks
+    private void readFromCore() {
+        while (true) {
+            byte[] value = receiveBuffer();
+            if (value == null)
+                continue;
+            if ((value[0] == guiRequestId) && (value.length > 9)) {
+                long id = SocketUtils.b64(value, 1);
+                RPCFuture future = pendingRPCs.remove(id);
+                if (future != null) {
+                    future.complete(java.util.Arrays.copyOfRange(value, 9,
+                                                                 value.length));
+                } else {
+                    System.out.println("reply with unknown request ID " + id);
                 }
-            }
-            if (sleep) {
-                try {  // let somebody else run
-                    Thread.sleep(1);
-                } catch (Exception e) {} // ignore InterruptedException
+            } else if (value[0] == guiCallbackContactsChanged) {
+                callbackContactsChanged(value);  // only updates caches
+            } else if ((value[0] >= guiCallbackMessageReceived) &&
+                       (value[0] <= guiCallbackTraceResponse)) {
+                callbacks.add(value);
+            } else {
+                System.out.println("discarding " + value.length +
+                                   "-byte reply with code " + value[0]);
             }
         }
     }
 
-    private synchronized byte[] doRPC(byte[] arg) {
-        sendRPC(arg);
-        byte[] result = receiveRPC(arg[0]);
-        return result;
-    }
-
     // from lib/keys.h
 
     // return all the contacts, including all the groups
     public String[] contacts() {
         String[] result = null;
-        if (cachedContacts == null) {
+        java.util.Collection<String> cached = cachedContacts;
+        if (cached == null) {
             byte[] request = new byte[1];
-            request[0] = guiContacts;
+            // same reply as guiContacts, later changes sent as callbacks
+            request[0] = guiContactsDelta;
             byte[] response = doRPC(request);
             long count = SocketUtils.b64(response, 1); 
             result = SocketUtils.bStringArray(response, 9 + (int)count, count);
-            cachedContacts = new java.util.HashSet<String>();
-            for (String contact: result) {
-                cachedContacts.add(contact);
-            }
-            cachedVisibleContacts = new java.util.HashMap<String, Boolean>();
-            cachedNotifyContacts = new java.util.HashMap<String, Boolean>();
-            cachedSaveContacts = new java.util.HashMap<String, Boolean>();
-            cachedIsGroup = new java.util.HashMap<String, Boolean>();
-            for (int i = 0; i < count; i++) {
-              byte b = response [i + 9];
-              cachedVisibleContacts.put(result[i], (b & 1) != 0);
-              cachedNotifyContacts.put(result[i], (b & 2) != 0);
-              cachedSaveContacts.put(result[i], (b & 4) != 0);
-              cachedIsGroup.put(result[i], (b & 8) != 0);
+            synchronized (cacheLock) {
+                cachedContacts = new java.util.HashSet<String>();
+                for (String contact: result) {
+                    cachedContacts.add(contact);
+                }
+                cachedVisibleContacts =
+                    new java.util.HashMap<String, Boolean>();
+                cachedNotifyContacts = new java.util.HashMap<String, Boolean>();
+                cachedSaveContacts = new java.util.HashMap<String, Boolean>();
+                cachedIsGroup = new java.util.HashMap<String, Boolean>();
+                cachedHasPeerKey = new java.util.HashMap<String, Boolean>();
+                cachedComplete = new java.util.HashMap<String, Boolean>();
+                for (int i = 0; i < count; i++) {
+                    cacheAttributes(result[i], response [i + 9]);
+                }
             }
         } else {
-           result = cachedContacts.toArray(new String[0]);
+           result = cached.toArray(new String[0]);
         }
         return result;
     } 
@@ -475,6 +571,11 @@ public class CoreConnect extends Thread implements CoreAPI {
 
     // newly created contacts may not have the peer's key
     public boolean contactHasPeerKey(String contact) {
+        if (cachedHasPeerKey != null) {
+            Boolean v = cachedHasPeerKey.get(contact);
+            if (v != null)
+                return v;
+        }
         return doRPCWithCodeNonZero (guiHasPeerKey, contact);
     }
 
@@ -652,6 +753,11 @@ for (String s: mem) System.out.print(", " + s); System.out.println("");
     // a key exchange is only complete once
     // (a) the user says so, or (b) we receive messages from the contact
     public boolean isComplete(String contact) {
+        if (cachedComplete != null) {
+            Boolean v = cachedComplete.get(contact);
+            if (v != null)
+                return v;
+        }
         return doRPCWithCodeOpNonZero (guiQueryVariable,
                                        guiVariableComplete, contact);
     }
@@ -664,6 +770,8 @@ for (String s: mem) System.out.print(", " + s); System.out.println("");
         } else {
             while (incompletes.remove (contact))
                 ;
+            if (cachedComplete != null)  // before the delta arrives
+                cachedComplete.put(contact, true);
         }
     }
 
@@ -688,21 +796,52 @@ for (String s: mem) System.out.print(", " + s); System.out.println("");
     // @return up to the max latest saved messages to/from this contact
     //         a negative value of max requests all messages
     public Message[] getMessages(String contact, int max) {
-        Message[] result = null;
+        byte[] request = getMessagesRequest(contact, max);
+        if (request == null)
+            return null;
+        return messagesFromResponse(doRPC(request), contact);
+    }
+
+    // @return the request for getMessages, or null if there is no need
+    private byte[] getMessagesRequest(String contact, int max) {
         if (! isValid(contact))
-            return result;
+            return null;
         if (max == 0)
-            return result;
+            return null;
         if (max < 0)
             max = 0;  /* in gui_get_messages, 0 means all */
         byte[] request = new byte[9 + SocketUtils.numBytes(contact) + 1];
         request[0] = guiGetMessages;
         SocketUtils.w64(request, 1, max); 
         SocketUtils.wString(request, 9, contact); 
-        byte[] response = doRPC(request);
+        return request;
+    }
+
+    private static Message[] messagesFromResponse(byte[] response,
+                                                  String contact) {
         long count = SocketUtils.b64(response, 1); 
-        result = SocketUtils.bMessages(response, 9, count, contact, false);
-        return result;
+        return SocketUtils.bMessages(response, 9, count, contact, false);
+    }
+
+    // @return up to max saved messages to/from this contact that are
+    //         older than the given message, most recent first.  If before
+    //         is null, returns the latest messages.  Used to page back
+    //         through a long conversation, a few messages at a time.
+    public Message[] getMessagesPage(String contact, Message before, int max) {
+        Message[] result = null;
+        if ((! isValid(contact)) || (max <= 0))
+            return result;
+        byte[] request = new byte[26 + SocketUtils.numBytes(contact) + 1];
+        request[0] = guiGetMessagesPage;
+        SocketUtils.w64(request, 1, max);
+        if (before != null) {
+            long time = before.sentTime / 1000 - allnetY2kSecondsInUnix;
+            SocketUtils.w64(request, 9, time);
+            SocketUtils.w64(request, 17, before.sequence);
+            request[25] = (byte)(before.isReceivedMessage() ? 3 : 1);
+        }
+        SocketUtils.wString(request, 26, contact);
+        return messagesFromResponse(doRPC(request), contact);
     }
 
     // set that the contact was read now
@@ -842,26 +981,37 @@ for (String s: mem) System.out.print(", " + s); System.out.println("");
         for (String contact: contacts()) {
             this.handlers.contactCreated(contact);
         }
+        // ask for all the conversations at once, rather than one by one
+        java.util.List<String> conversations =
+            new java.util.ArrayList<String>();
+        java.util.List<java.util.concurrent.Future<byte[]>> replies =
+            new java.util.ArrayList<java.util.concurrent.Future<byte[]>>();
         for (String contact: contacts()) {
             if (! contactIsGroup(contact)) {
-                Message[] msgs = getMessages(contact, -1);  // get all
-                this.handlers.savedMessages(msgs);
+                byte[] request = getMessagesRequest(contact, -1);  // get all
+                if (request != null) {
+                    conversations.add(contact);
+                    replies.add(doRPCAsync(request));
+                }
             }
         }
+        for (int i = 0; i < replies.size(); i++) {
+            Message[] msgs = messagesFromResponse(waitRPC(replies.get(i)),
+                                                  conversations.get(i));
+            this.handlers.savedMessages(msgs);
+        }
         for (String sender: subscriptions()) {
             this.handlers.subscriptionComplete(sender);
         }
         this.handlers.initializationComplete();
-        if (! readyForCallbacks) {
-            readyForCallbacks = true;
-	    for (byte [] c: pendingCallbacks) {
-                dispatch (c);
+        while (true) {  // deliver the callbacks, including any saved so far
+            try {
+                byte[] value = callbacks.take();
+                if (! dispatch(value))
+                    System.out.println ("CoreConnect.run: not a callback " +
+                                        value[0]);
+            } catch (InterruptedException e) {
             }
-            pendingCallbacks = null; // remove old links
-        } else {
-            System.out.println ("CoreConnect.run error: ready for callbacks");
-            // throw some exception?
         }
-        receiveRPC((byte)0);  // loop forever
     }
 }
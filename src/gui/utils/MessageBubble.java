@@ -22,6 +22,11 @@ import javax.swing.SwingUtilities;
  *
  * A border can be added externally.
  *
+ * The text pane is only made when the bubble is first laid out with
+ * resizeBubble, so bubbles that are never scrolled into view cost little.
+ * The word wrapping found for each width is kept, so laying out the
+ * bubble again for a width it has had before does not search again.
+ *
  * @author henry
  * @param <MESSAGE>
  */
@@ -36,11 +41,18 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
     private static double wTargetHi = 0.72;
     private static double wTargetLo = 0.62;
 
-    // width of the container the last time this MessageBubble was resized
-    private int lastContainerWidth;
+    // width of the container the last time this MessageBubble was resized,
+    // or -1 if it has not been laid out yet
+    private int lastContainerWidth = -1;
+
+    // the word wrapping for each container width, at most MAX_LAYOUTS
+    private static final int MAX_LAYOUTS = 4;
+    private java.util.Map<Integer, WordWrapper> layouts =
+        new java.util.HashMap<>();
 
     // keep the message pane so we can change background later
-    private JTextPane textPane;
+    // null until the bubble is laid out
+    private JTextPane textPane = null;
     // keep ref to popup since text panes will need to reference it
     private JPopupMenu popup;
     // keep a reference to the message that the Bubble renders, if desired
@@ -50,9 +62,12 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
     private String text, sanitizedText;
     private boolean leftJustified;
     //
-    // utility for word wrapping and selection correction
+    // utility for word wrapping and selection correction, as used
+    // for the current text pane
     private WordWrapper ww = new WordWrapper(true);
 
+    // the bubble is laid out later, by resizeBubble, for the width of
+    // the container at that time
     public MessageBubble(MESSAGE message, boolean leftJustified, Color color,
         String text, JComponent container) {
         super();
@@ -61,11 +76,7 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
         this.text = text;
         sanitizedText = sanitizeForHtml(text);
         setBackground(color);
-        lastContainerWidth = container.getWidth();
-        // int charsPerLine = findCharsPerLine(lastContainerWidth);
-        textPane = makeTextPane(color, leftJustified, lastContainerWidth);
         setLayout(new BoxLayout(this, BoxLayout.X_AXIS));
-        add(textPane);
         // make a context menu
         popup = new JPopupMenu();
         JMenuItem item = new JMenuItem(COPY);
@@ -74,8 +85,6 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
         item = new JMenuItem(COPY_ALL);
         item.addActionListener(this);
         popup.add(item);
-        textPane.setComponentPopupMenu(popup);
-        textPane.addMouseListener(this);
     }
         
     // invariant: htmlReplacements.length == htmlPatterns.length,
@@ -106,13 +115,63 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
         MessageBubble.estimatedCharsPerLine = estimatedCharsPerLine;
     }
 
+    // lays out the bubble for a container of the given width, unless
+    // it is already laid out for that width
     public void resizeBubble(int width) {
-        remove(textPane);
-        textPane = makeTextPane(textPane.getBackground(),
-            leftJustified, width);
+        if ((textPane != null) && (width == lastContainerWidth)) {
+            return;
+        }
+        if (textPane != null) {
+            remove(textPane);
+        }
+        WordWrapper cached = layouts.get(width);
+        if (cached != null) {
+            ww = cached;
+            textPane = makeTextPaneQuick(getBackground(), leftJustified, ww);
+        } else {
+            textPane = makeTextPane(getBackground(), leftJustified, width);
+            if (layouts.size() >= MAX_LAYOUTS) {
+                layouts.clear();
+            }
+            layouts.put(width, ww);
+        }
+        lastContainerWidth = width;
         textPane.setComponentPopupMenu(popup);
         textPane.addMouseListener(this);
         add(textPane);
+        invalidate();
+    }
+
+    // @return true if the bubble is laid out for this container width
+    public boolean isLaidOut(int width) {
+        return ((textPane != null) && (width == lastContainerWidth));
+    }
+
+    // @return true if the bubble has been laid out for any width
+    public boolean hasLayout() {
+        return (textPane != null);
+    }
+
+    // @return a guess of the height of the bubble in a container of
+    //         this width, without laying it out
+    public int estimateHeight(int width) {
+        java.awt.Font font = getFont();
+        java.awt.FontMetrics fm = (font == null) ? null : getFontMetrics(font);
+        int charWidth = (fm == null) ? 7 : Math.max(1, fm.charWidth('n'));
+        int lineHeight = (fm == null) ? 16 : fm.getHeight();
+        int charsPerLine = (estimatedCharsPerLine > 0) ? estimatedCharsPerLine
+                         : Math.max(10, (int) (wTargetLo * width / charWidth));
+        int lines = 0;
+        for (String line : text.split("\n")) {
+            lines += Math.max(1, (line.length() + charsPerLine - 1)
+                                 / charsPerLine);
+        }
+        java.awt.Insets insets = getInsets();
+        return (lines * lineHeight + insets.top + insets.bottom + 8);
+    }
+
+    public String getText() {
+        return (text);
     }
 
     private JTextPane makeTextPane(Color color, boolean leftJustified,
@@ -174,13 +233,21 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
 
     private JTextPane makeTextPaneQuick(Color color, boolean leftJustified,
         int charsPerLine) {
+        // each layout has its own wrapper, so the cached ones stay valid
+        ww = new WordWrapper(true);
+        // 5 pix per char is really small
+        ww.wordWrapText(text, charsPerLine, !leftJustified);
+        return makeTextPaneQuick(color, leftJustified, ww);
+    }
+
+    // makes the pane from text that has already been wrapped
+    private JTextPane makeTextPaneQuick(Color color, boolean leftJustified,
+        WordWrapper wrapped) {
         JTextPane pane = new JTextPane();
         pane.setContentType("text/html");
         pane.setEditable(false);
         pane.setBackground(color);
-        // 5 pix per char is really small
-        ww.wordWrapText(text, charsPerLine, !leftJustified);
-        String[] wordWrappedLines = ww.getWrappedText();
+        String[] wordWrappedLines = wrapped.getWrappedText();
         String htmlPrefix;
         if (leftJustified) {
             htmlPrefix = "<STYLE type=\"text/css\"> BODY {text-align: left} </STYLE> <BODY>";
@@ -212,7 +279,9 @@ public class MessageBubble<MESSAGE> extends JPanel implements ActionListener, Mo
 
     public void setBubbleBackground(Color bg) {
         super.setBackground(bg);
-        textPane.setBackground(bg);
+        if (textPane != null) {
+            textPane.setBackground(bg);
+        }
     }
 
     public MESSAGE getMessage() {
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/wait.h>    /* waitpid */
+#include <pthread.h>
 #include <arpa/inet.h>   /* inet_pton */
 
 #include "abc.h"
@@ -21,9 +22,16 @@
 
 
 #ifdef ALLNET_NETPACKET_SUPPORT
+#include <fcntl.h>
+#include <poll.h>
 #include <ifaddrs.h>
 #include <net/if.h>      /* IFF_ values */
 #include <linux/if_packet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/genetlink.h>
+#include <linux/nl80211.h>
+#include <linux/rfkill.h>
 #endif /* ALLNET_NETPACKET_SUPPORT */
 
 static void add_v4 (struct socket_set * sockets,
@@ -368,6 +376,217 @@ Interface wlan2
 	wiphy 0
 */
 
+/* the same interface setup as the iw, ifconfig and rfkill commands in
+ * start_wireless, but using nl80211 (through generic netlink), rtnetlink,
+ * and /dev/rfkill directly, avoiding a fork and exec for each step.
+ * If nl80211 is not available, start_wireless falls back to the commands */
+
+#define ABC_NL_BUFSIZE	4096
+#define ABC_NL_TIMEOUT_MS	1000
+
+union abc_nl_buffer {
+  struct nlmsghdr hdr;
+  char buffer [ABC_NL_BUFSIZE];
+};
+
+/* starts a netlink message with the given type and, if genl_cmd >= 0,
+ * a generic netlink header, or otherwise with hsize bytes of header */
+static void nl_start (union abc_nl_buffer * m, int type, int genl_cmd,
+                      const void * header, int hsize)
+{
+  memset (m, 0, sizeof (union abc_nl_buffer));
+  m->hdr.nlmsg_len = NLMSG_LENGTH (0);
+  m->hdr.nlmsg_type = type;
+  m->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  char * data = m->buffer + m->hdr.nlmsg_len;
+  if (genl_cmd >= 0) {
+    struct genlmsghdr * g = (struct genlmsghdr *) data;
+    g->cmd = genl_cmd;
+    g->version = 1;
+    m->hdr.nlmsg_len += NLMSG_ALIGN (GENL_HDRLEN);
+  } else {
+    memcpy (data, header, hsize);
+    m->hdr.nlmsg_len += NLMSG_ALIGN (hsize);
+  }
+}
+
+static void nl_attr (union abc_nl_buffer * m, int type, const void * data,
+                     int dlen)
+{
+  struct nlattr * a = (struct nlattr *) (m->buffer + m->hdr.nlmsg_len);
+  a->nla_type = type;
+  a->nla_len = NLA_HDRLEN + dlen;
+  if (dlen > 0)
+    memcpy (((char *) a) + NLA_HDRLEN, data, dlen);
+  m->hdr.nlmsg_len += NLA_ALIGN (a->nla_len);
+}
+
+static void nl_attr_u32 (union abc_nl_buffer * m, int type, uint32_t value)
+{
+  nl_attr (m, type, &value, sizeof (value));
+}
+
+/* sends the message and waits for the acknowledgement.  If reply is not
+ * NULL, it is called for every other message received in response.
+ * returns 0 for success or a negative errno */
+static int nl_talk (int fd, union abc_nl_buffer * m,
+                    void (* reply) (const struct nlmsghdr * hdr, void * ref),
+                    void * ref)
+{
+  static unsigned int seq = 0;
+  m->hdr.nlmsg_seq = ++seq;
+  struct sockaddr_nl kernel;
+  memset (&kernel, 0, sizeof (kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto (fd, m, m->hdr.nlmsg_len, 0, (struct sockaddr *) &kernel,
+              sizeof (kernel)) != (ssize_t) m->hdr.nlmsg_len)
+    return -errno;
+  union abc_nl_buffer r;
+  while (1) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    if (poll (&pfd, 1, ABC_NL_TIMEOUT_MS) <= 0)
+      return -ETIMEDOUT;
+    ssize_t n = recv (fd, &r, sizeof (r), 0);
+    if (n < 0)
+      return -errno;
+    struct nlmsghdr * h;
+    int len = (int) n;
+    for (h = &(r.hdr); NLMSG_OK (h, len); h = NLMSG_NEXT (h, len)) {
+      if (h->nlmsg_seq != seq)
+        continue;       /* not a reply to this request */
+      if (h->nlmsg_type == NLMSG_ERROR) {  /* error 0 is the ack */
+        if (h->nlmsg_len < NLMSG_LENGTH (sizeof (struct nlmsgerr)))
+          return -EINVAL;
+        return ((struct nlmsgerr *) NLMSG_DATA (h))->error;
+      }
+      if (h->nlmsg_type == NLMSG_DONE)
+        return 0;
+      if (reply != NULL)
+        reply (h, ref);
+    }
+  }
+}
+
+static void nl_family_reply (const struct nlmsghdr * h, void * ref)
+{
+  int len = (int) h->nlmsg_len - NLMSG_LENGTH (GENL_HDRLEN);
+  const struct nlattr * a =
+    (const struct nlattr *) (((const char *) NLMSG_DATA (h)) + GENL_HDRLEN);
+  while ((len >= NLA_HDRLEN) && (a->nla_len >= NLA_HDRLEN) &&
+         (a->nla_len <= len)) {
+    if ((a->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+      memcpy (ref, ((const char *) a) + NLA_HDRLEN, sizeof (uint16_t));
+    len -= NLA_ALIGN (a->nla_len);
+    a = (const struct nlattr *) (((const char *) a) + NLA_ALIGN (a->nla_len));
+  }
+}
+
+/* returns the generic netlink family ID for nl80211, or -1 */
+static int nl80211_family (int fd)
+{
+  union abc_nl_buffer m;
+  nl_start (&m, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, NULL, 0);
+  nl_attr (&m, CTRL_ATTR_FAMILY_NAME, NL80211_GENL_NAME,
+           sizeof (NL80211_GENL_NAME));
+  uint16_t id = 0;
+  if ((nl_talk (fd, &m, &nl_family_reply, &id) != 0) || (id == 0))
+    return -1;
+  return id;
+}
+
+/* same as ifconfig up or down, returns 0 or a negative errno */
+static int rtnl_set_up (unsigned int ifindex, int up)
+{
+  int fd = socket (AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd < 0)
+    return -errno;
+  struct ifinfomsg ifi;
+  memset (&ifi, 0, sizeof (ifi));
+  ifi.ifi_family = AF_UNSPEC;
+  ifi.ifi_index = (int) ifindex;
+  ifi.ifi_flags = ((up) ? IFF_UP : 0);
+  ifi.ifi_change = IFF_UP;
+  union abc_nl_buffer m;
+  nl_start (&m, RTM_NEWLINK, -1, &ifi, sizeof (ifi));
+  int result = nl_talk (fd, &m, NULL, NULL);
+  close (fd);
+  return result;
+}
+
+/* same as rfkill unblock wifi */
+static void rfkill_unblock_wifi ()
+{
+  int fd = open ("/dev/rfkill", O_WRONLY);
+  if (fd < 0)
+    return;
+  struct rfkill_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.type = RFKILL_TYPE_WLAN;
+  ev.op = RFKILL_OP_CHANGE_ALL;
+  ev.soft = 0;
+  if (write (fd, &ev, sizeof (ev)) < 0)
+    perror ("abc.c rfkill write");
+  close (fd);
+}
+
+/* returns 0 if nl80211 is not available, so the caller should use the
+ * commands instead, and 1 otherwise, whether or not it succeeded */
+static int start_wireless_netlink (const char * name)
+{
+  unsigned int ifindex = if_nametoindex (name);
+  if (ifindex == 0)
+    return 0;
+  int fd = socket (AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+  if (fd < 0)
+    return 0;
+  int family = nl80211_family (fd);
+  if (family < 0) {
+    close (fd);
+    return 0;
+  }
+  rfkill_unblock_wifi ();
+  union abc_nl_buffer m;
+  nl_start (&m, family, NL80211_CMD_SET_INTERFACE, NULL, 0);
+  nl_attr_u32 (&m, NL80211_ATTR_IFINDEX, ifindex);
+  nl_attr_u32 (&m, NL80211_ATTR_IFTYPE, NL80211_IFTYPE_ADHOC);
+  union abc_nl_buffer set_type = m;   /* nl_talk changes m */
+  int r = nl_talk (fd, &m, NULL, NULL);
+  if (r == -EBUSY) { /* this happens if iface is up and in managed mode */
+    printf ("bringing the interface %s down, then back up\n", name);
+    /* so we bring the interface down and back up */
+    if ((r = rtnl_set_up (ifindex, 0)) == 0) {
+      r = nl_talk (fd, &set_type, NULL, NULL);
+      int up = rtnl_set_up (ifindex, 1);
+      if ((r == 0) && (up != 0))
+        r = up;
+    }
+  }
+  if (r != 0) {
+    printf ("abc.c: unable to set %s to ad-hoc mode: %s\n", name,
+            strerror (-r));
+    close (fd);
+    return 1;
+  }
+/* it is better to leave first, in case it is set incorrectly -- otherwise
+ * sometimes the next command fails but we are not on allnet */
+  nl_start (&m, family, NL80211_CMD_LEAVE_IBSS, NULL, 0);
+  nl_attr_u32 (&m, NL80211_ATTR_IFINDEX, ifindex);
+  nl_talk (fd, &m, NULL, NULL);  /* whether it succeeds or not, we are OK */
+  /* same as iw dev <name> ibss join allnet 2412 fixed-freq */
+  nl_start (&m, family, NL80211_CMD_JOIN_IBSS, NULL, 0);
+  nl_attr_u32 (&m, NL80211_ATTR_IFINDEX, ifindex);
+  nl_attr (&m, NL80211_ATTR_SSID, "allnet", 6);
+  nl_attr_u32 (&m, NL80211_ATTR_WIPHY_FREQ, 2412);
+  nl_attr (&m, NL80211_ATTR_FREQ_FIXED, NULL, 0);
+  r = nl_talk (fd, &m, NULL, NULL);
+  if (r == -EALREADY)
+    printf ("%s: interface already on allnet\n", name);
+  else if (r != 0)
+    printf ("abc.c: unable to join allnet on %s: %s\n", name, strerror (-r));
+  close (fd);
+  return 1;
+}
+
 /* if this is a wireless interface and not already connected, start it */
 static void start_wireless (const char * name, const struct ifaddrs * ifa)
 {
@@ -380,6 +599,8 @@ static void start_wireless (const char * name, const struct ifaddrs * ifa)
 #ifdef DEBUG_PRINT
   printf ("(re)starting wireless for interface %s\n", name);
 #endif /* DEBUG_PRINT */
+  if (start_wireless_netlink (name))
+    return;
   static char * mess = "unknown error";
   if (! if_command ("rfkill unblock wifi", NULL, 1, "", mess))
     printf ("rfkill failed\n");
@@ -502,6 +723,194 @@ int add_local_broadcast_sockets (struct socket_set * sockets)
   return (num_bc > 0);
 }
 
+/* broadcast scheduling.  On a shared wireless channel, each broadcast
+ * costs airtime for every station in range, so rather than sending each
+ * broadcast as soon as ad forwards it, broadcasts are queued and sent
+ * together at the start of each transmit window.  Identical messages
+ * queued in the same window are only sent once.  The windows are
+ * further apart when more peers have been heard on the broadcast
+ * sockets, and when the channel is busier.  Busy time is estimated from
+ * the broadcast bytes sent and received, at the basic rate used for
+ * broadcasts.  When nothing has been sent for a while, the window opens
+ * immediately, so an occasional broadcast is not delayed. */
+#ifndef ABC_WINDOW_MIN_MS
+#define ABC_WINDOW_MIN_MS	20
+#endif /* ABC_WINDOW_MIN_MS */
+#ifndef ABC_WINDOW_MAX_MS
+#define ABC_WINDOW_MAX_MS	500
+#endif /* ABC_WINDOW_MAX_MS */
+#define ABC_WINDOW_PER_PEER_MS	10
+#define ABC_PEER_TIMEOUT_MS	(60 * 1000)
+#define ABC_MAX_PEERS		64
+#define ABC_AIR_KBPS		1000   /* 1Mb/s, the 802.11b basic rate */
+#define ABC_QUEUE_MAX		64
+#define ABC_QUEUE_BYTES		(4 * ALLNET_MTU)
+
+struct abc_queued {
+  char * message;
+  int msize;
+  unsigned long long int sent_time;
+};
+
+struct abc_peer {
+  struct sockaddr_storage addr;
+  socklen_t alen;
+  unsigned long long int last_heard;   /* allnet ms */
+};
+
+static pthread_mutex_t abc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct abc_queued abc_queue [ABC_QUEUE_MAX];
+static int abc_queue_count = 0;
+static int abc_queue_bytes = 0;
+static unsigned long long int abc_next_window = 0;   /* allnet ms */
+static unsigned long long int abc_last_window = 0;   /* allnet ms */
+static unsigned long long int abc_air_bytes = 0;  /* since the last window */
+static int abc_busy_permille = 0;
+static struct abc_peer abc_peers [ABC_MAX_PEERS];
+
+/* must be called with abc_mutex held */
+static unsigned long long int abc_window_ms (unsigned long long int now)
+{
+  int peers = 0;
+  int i;
+  for (i = 0; i < ABC_MAX_PEERS; i++)
+    if ((abc_peers [i].alen > 0) &&
+        (abc_peers [i].last_heard + ABC_PEER_TIMEOUT_MS > now))
+      peers++;
+  unsigned long long int ms = ABC_WINDOW_MIN_MS + peers * ABC_WINDOW_PER_PEER_MS;
+  int idle = 1000 - abc_busy_permille;
+  if (idle < 100)
+    idle = 100;
+  ms = ms * 1000 / idle;
+  if (ms > ABC_WINDOW_MAX_MS)
+    ms = ABC_WINDOW_MAX_MS;
+  /* up to 1/8 earlier or later, so neighbors' windows do not line up */
+  return ms - ms / 8 + random_int (0, ms / 4);
+}
+
+/* must be called with abc_mutex held */
+static void abc_update_busy (unsigned long long int now)
+{
+  if ((abc_last_window > 0) && (now > abc_last_window)) {
+    unsigned long long int air_ms = abc_air_bytes * 8 / ABC_AIR_KBPS;
+    unsigned long long int sample = air_ms * 1000 / (now - abc_last_window);
+    if (sample > 1000)
+      sample = 1000;
+    abc_busy_permille = (int) ((3 * abc_busy_permille + sample) / 4);
+  }
+  abc_air_bytes = 0;
+  abc_last_window = now;
+}
+
+static void abc_send (struct socket_set * sockets, struct abc_queued * q,
+                      int count)
+{
+  int i;
+  for (i = 0; i < count; i++) {
+    socket_send_broadcast (sockets, q [i].message, q [i].msize,
+                           q [i].sent_time);
+    allnet_packet_free (q [i].message);
+  }
+}
+
+void abc_schedule_broadcasts (struct socket_set * sockets, int enable)
+{
+  if ((! enable) && (sockets->defer_broadcast)) {
+    abc_next_window = 0;   /* send anything that is queued */
+    abc_send_window (sockets);
+  }
+  sockets->defer_broadcast = enable;
+}
+
+void abc_queue_broadcast (struct socket_set * sockets, const char * message,
+                          int msize, const struct internet_addr * dest_address,
+                          unsigned long long int sent_time)
+{
+  if ((msize <= 0) || (msize > ALLNET_MTU))
+    return;
+  pthread_mutex_lock (&abc_mutex);
+  int i;
+  for (i = 0; i < abc_queue_count; i++) {
+    if ((abc_queue [i].msize == msize) &&
+        (memcmp (abc_queue [i].message, message, msize) == 0)) {
+      pthread_mutex_unlock (&abc_mutex);
+      return;    /* already queued in this window */
+    }
+  }
+  if ((abc_queue_count >= ABC_QUEUE_MAX) ||
+      (abc_queue_bytes + msize > ABC_QUEUE_BYTES)) {
+    pthread_mutex_unlock (&abc_mutex);
+    /* no room, send it now */
+    socket_send_broadcast (sockets, message, msize, sent_time);
+    return;
+  }
+  struct abc_queued * q = abc_queue + (abc_queue_count++);
+  q->message = allnet_packet_alloc (msize, "abc_queue_broadcast");
+  memcpy (q->message, message, msize);
+  /* as in socket_send_out, broadcasts do not record a destination */
+  if ((dest_address != NULL) &&
+      (((const char *) dest_address) >= message) &&
+      (((const char *) (dest_address + 1)) <= message + msize))
+    memset (q->message + (((const char *) dest_address) - message), 0,
+            sizeof (struct internet_addr));
+  q->msize = msize;
+  q->sent_time = sent_time;
+  abc_queue_bytes += msize;
+  pthread_mutex_unlock (&abc_mutex);
+}
+
+int abc_send_window (struct socket_set * sockets)
+{
+  struct abc_queued to_send [ABC_QUEUE_MAX];
+  unsigned long long int now = allnet_coarse_monotonic_ms ();
+  pthread_mutex_lock (&abc_mutex);
+  if (abc_queue_count <= 0) {
+    pthread_mutex_unlock (&abc_mutex);
+    return -1;
+  }
+  if (now < abc_next_window) {
+    int wait = (int) (abc_next_window - now);
+    pthread_mutex_unlock (&abc_mutex);
+    return wait;
+  }
+  int count = abc_queue_count;
+  memcpy (to_send, abc_queue, count * sizeof (struct abc_queued));
+  abc_air_bytes += abc_queue_bytes;
+  abc_queue_count = 0;
+  abc_queue_bytes = 0;
+  abc_update_busy (now);
+  abc_next_window = now + abc_window_ms (now);
+  pthread_mutex_unlock (&abc_mutex);
+  abc_send (sockets, to_send, count);
+  return -1;
+}
+
+void abc_received (const struct sockaddr_storage * from, socklen_t alen,
+                   int msize)
+{
+  if ((alen <= 0) || (alen > sizeof (struct sockaddr_storage)))
+    return;
+  unsigned long long int now = allnet_coarse_monotonic_ms ();
+  pthread_mutex_lock (&abc_mutex);
+  abc_air_bytes += msize;
+  int oldest = 0;
+  int i;
+  for (i = 0; i < ABC_MAX_PEERS; i++) {
+    struct abc_peer * p = abc_peers + i;
+    if ((p->alen == alen) && (memcmp (&(p->addr), from, alen) == 0)) {
+      p->last_heard = now;
+      pthread_mutex_unlock (&abc_mutex);
+      return;
+    }
+    if (p->last_heard < abc_peers [oldest].last_heard)
+      oldest = i;
+  }
+  abc_peers [oldest].addr = *from;
+  abc_peers [oldest].alen = alen;
+  abc_peers [oldest].last_heard = now;
+  pthread_mutex_unlock (&abc_mutex);
+}
+
 #ifdef TEST_ABC_ADHOC
 /* compile with: gcc -o test_adhoc -DTEST_ABC_ADHOC abc.c sockets.c util.c ai.c sha.c allnet_log.c */
 int main (int argc, char ** argv)
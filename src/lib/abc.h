@@ -11,4 +11,27 @@
 
 extern int add_local_broadcast_sockets (struct socket_set * sockets);
 
+/* broadcast scheduling: if enabled, socket_send_out does not send on
+ * broadcast sockets.  Instead, the caller gives each message sent out to
+ * abc_queue_broadcast, and calls abc_send_window often (e.g. every time
+ * around the main loop) to send the queued messages together when the
+ * next transmit window opens.  The spacing of the windows adapts to the
+ * number of peers heard on broadcast sockets, and to the estimated
+ * channel busy time, both of which are updated by abc_received for
+ * every message received on a broadcast socket. */
+#ifndef ABC_SCHEDULE_BROADCASTS
+#define ABC_SCHEDULE_BROADCASTS	1	/* 0 to send broadcasts at once */
+#endif /* ABC_SCHEDULE_BROADCASTS */
+extern void abc_schedule_broadcasts (struct socket_set * sockets, int enable);
+/* dest_address is as for socket_send_out, and may be NULL */
+extern void abc_queue_broadcast (struct socket_set * sockets,
+                                 const char * message, int msize,
+                                 const struct internet_addr * dest_address,
+                                 unsigned long long int sent_time);
+/* returns -1 if nothing is queued, or the number of ms until the next
+ * window opens */
+extern int abc_send_window (struct socket_set * sockets);
+extern void abc_received (const struct sockaddr_storage * from,
+                          socklen_t alen, int msize);
+
 #endif /* ALLNET_ABC_H */
@@ -83,6 +83,78 @@ static struct ping_all_args
   return result;
 }
 
+/* each call to ping_all_pending is a round.  An address that is still
+ * in the ping list the round after we pinged it did not respond, and is
+ * not pinged again for 2, 4, ... up to PING_BACKOFF_MAX rounds */
+struct ping_backoff {
+  unsigned char destination [ADDRESS_SIZE];
+  struct internet_addr ip;
+  unsigned int failures;              /* rounds we pinged without a reply */
+  unsigned long long int round;       /* when we last pinged, 0 if unused */
+  unsigned long long int next_round;  /* do not ping before this round */
+};
+#define PING_BACKOFF_ENTRIES	256
+#define PING_BACKOFF_MAX	16
+/* only used by ping_all_pending, which only runs in one thread at a time */
+static struct ping_backoff ping_backoffs [PING_BACKOFF_ENTRIES];
+static unsigned long long int ping_round = 0;
+
+/* returns the entry for this address, reusing the least recently
+ * pinged entry if it is not found */
+static struct ping_backoff * find_backoff (struct addr_info * ai)
+{
+  struct ping_backoff * oldest = ping_backoffs;
+  int i;
+  for (i = 0; i < PING_BACKOFF_ENTRIES; i++) {
+    struct ping_backoff * b = ping_backoffs + i;
+    if ((b->round > 0) &&
+        (memcmp (b->destination, ai->destination, ADDRESS_SIZE) == 0) &&
+        (memcmp (&(b->ip), &(ai->ip), sizeof (ai->ip)) == 0)) {
+      /* not seen long after it was due, so it must have responded */
+      if (b->next_round + PING_BACKOFF_MAX < ping_round)
+        b->failures = 0;
+      return b;
+    }
+    if (b->round < oldest->round)
+      oldest = b;
+  }
+  memset (oldest, 0, sizeof (struct ping_backoff));
+  memcpy (oldest->destination, ai->destination, ADDRESS_SIZE);
+  oldest->ip = ai->ip;
+  return oldest;
+}
+
+/* returns 1 if we should ping this address in this round */
+static int ping_this_round (struct addr_info * ai)
+{
+  struct ping_backoff * b = find_backoff (ai);
+  if (b->round > 0) {             /* pinged before, and still pending */
+    if (ping_round < b->next_round)
+      return 0;
+    b->failures++;
+  }
+  unsigned long long int wait = PING_BACKOFF_MAX;
+  if (b->failures < 4)            /* 1 << 4 == PING_BACKOFF_MAX */
+    wait = 1 << b->failures;
+  b->round = ping_round;
+  b->next_round = ping_round + wait;
+  return 1;
+}
+
+/* sleeps as needed to send at most ADHT_PING_RATE pings per second.
+ * *credit is the time at which the most recent ping was allowed */
+static void ping_rate_limit (unsigned long long int * credit)
+{
+  unsigned long long int interval = ALLNET_US_PER_S / ADHT_PING_RATE;
+  unsigned long long int burst = ADHT_PING_BURST * interval;
+  unsigned long long int now = allnet_time_us ();
+  if (*credit + burst < now)     /* idle, allow a burst */
+    *credit = now - burst;
+  *credit += interval;
+  if (*credit > now)
+    usleep ((useconds_t) (*credit - now));
+}
+
 static void * ping_all_pending (void * arg)
 {
   struct ping_all_args * a = (struct ping_all_args *) arg;
@@ -119,10 +191,16 @@ static void * ping_all_pending (void * arg)
   if (n < MAX_MY_ADDRS)
     msize -= (MAX_MY_ADDRS - n) * sizeof (struct addr_info);
 #undef MAX_MY_ADDRS
+  ping_round++;
+  unsigned long long int credit = 0;
   int iter = 0;
   struct addr_info ai;
+  /* replies are handled by dht_process as they arrive */
   while ((iter = routing_ping_iterator (iter, &ai)) >= 0) {
-    sleep (1); /* sleep between messages, that's why we are in a thread */
+    if (! ping_this_round (&ai))
+      continue;
+    /* sleep between messages, that's why we are in a thread */
+    ping_rate_limit (&credit);
     memcpy (hp->destination, ai.destination, ADDRESS_SIZE);
     hp->dst_nbits = ai.nbits;
     if ((hp->dst_nbits > ADDRESS_BITS) || (hp->dst_nbits > 64)) {
@@ -154,6 +232,45 @@ static void * ping_all_pending (void * arg)
   a->finished = 1;
   return NULL;
 }
+
+/* peers listed in DHT updates since the last full update */
+#define ADHT_TABLE_MAX	256   /* at least the size of the routing table */
+static struct addr_info advertised [ADHT_TABLE_MAX];
+static int num_advertised = 0;
+
+static int was_advertised (struct addr_info * ai)
+{
+  int i;
+  for (i = 0; i < num_advertised; i++)
+    if ((memcmp (advertised [i].destination, ai->destination,
+                 ADDRESS_SIZE) == 0) &&
+        (memcmp (&(advertised [i].ip), &(ai->ip), sizeof (ai->ip)) == 0))
+      return 1;
+  return 0;
+}
+
+/* fills in up to max peers from the routing table, in random order.
+ * Every ADHT_FULL_UPDATE calls (starting with the first), any peer may be
+ * listed, otherwise only peers not listed since then.  Returns the
+ * number of entries filled in */
+static int dht_entries (struct addr_info * entries, int max)
+{
+  static int calls = 0;
+  if ((calls++ % ADHT_FULL_UPDATE) == 0)
+    num_advertised = 0;
+  struct addr_info all [ADHT_TABLE_MAX];
+  int n = routing_table (all, ADHT_TABLE_MAX);
+  int count = 0;
+  int i;
+  for (i = 0; (i < n) && (count < max); i++) {
+    if (! was_advertised (all + i)) {
+      entries [count++] = all [i];
+      if (num_advertised < ADHT_TABLE_MAX)
+        advertised [num_advertised++] = all [i];
+    }
+  }
+  return count;
+}
 #endif /* ALLNET_RESOURCE_CONSTRAINED -- actively participate in the DHT */
 
 /* at the right time, create a DHT packet to send out my routing table
@@ -219,7 +336,7 @@ int dht_update (struct socket_set * s,
 #endif /* DEBUG_PRINT */
     return 0;
   }
-  int added = routing_table (entries + self, (int)(possible - self));
+  int added = dht_entries (entries + self, (int)(possible - self));
 #ifdef DEBUG_PRINT
   if (added <= 0)
     printf ("adht: routing table returned %d\n", added);
@@ -38,6 +38,19 @@
 
 #define ADHT_INTERVAL	7200   /* 2 hours -- IPv6 addresses expire every day */
 #define EXPIRATION_MULT	3      /* wait 3 intervals (6 hrs) to expire a route */
+/* most DHT updates only list peers not listed since the last full update.
+ * Receivers keep entries until they expire, so a full update is sent
+ * every ADHT_FULL_UPDATE intervals, often enough to refresh them */
+#define ADHT_FULL_UPDATE	EXPIRATION_MULT
+
+/* pending pings are sent at up to ADHT_PING_RATE per second, with bursts
+ * of up to ADHT_PING_BURST.  Either may be set when compiling */
+#ifndef ADHT_PING_RATE
+#define ADHT_PING_RATE	20
+#endif /* ADHT_PING_RATE */
+#ifndef ADHT_PING_BURST
+#define ADHT_PING_BURST	5
+#endif /* ADHT_PING_BURST */
 
 /* add information from a newly received DHT packet */
 extern void dht_process (char * message, unsigned int msize,
@@ -18,10 +18,13 @@
 #endif /* ANDROID */
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "packet.h"
 #include "ai.h"
 #include "util.h"
+#include "configfiles.h"
 
 /* buffer parameter must have at least size 42 */
 /* returns the number of buffer characters used */
@@ -1109,50 +1112,238 @@ static int get_dns_servers (struct sockaddr_storage * servers, int nservers)
 }
 
 #define DNS_HEADER_SIZE		12
+#define DNS_PACKET_SIZE		512  /* RFC 1035, section 2.3.4, max UDP size */
+#define DNS_NAME_SIZE		256
 
+/* answers are kept in a small cache for their time to live (within
+ * limits), and the cache is saved in ~/.allnet/dns/cache so that after
+ * a restart allnet_dns can call back immediately for recently resolved
+ * names, without waiting for any server */
+#ifndef DNS_CACHE_ENTRIES
+#define DNS_CACHE_ENTRIES	256
+#endif /* DNS_CACHE_ENTRIES */
+#define DNS_CACHE_MIN_TTL	60      /* seconds */
+#define DNS_CACHE_MAX_TTL	86400   /* one day */
+/* at most this many cached addresses are returned for one name and type */
+#define DNS_CACHE_MAX_ANSWERS	8
+
+struct dns_cache_entry {
+  char name [DNS_NAME_SIZE];
+  struct sockaddr_storage addr;
+  unsigned long long int expiration;   /* allnet seconds */
+};
+
+static struct dns_cache_entry dns_cache [DNS_CACHE_ENTRIES];
+static int dns_cache_used = 0;
+static int dns_cache_loaded = 0;
+static int dns_cache_changed = 0;
+static pthread_mutex_t dns_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static socklen_t dns_sockaddr_size (const struct sockaddr_storage * sas)
+{
+  if (sas->ss_family == AF_INET6)
+    return sizeof (struct sockaddr_in6);
+  return sizeof (struct sockaddr_in);
+}
+
+/* must be called with dns_cache_mutex held */
+static void dns_cache_insert (const char * name,
+                              const struct sockaddr_storage * addr,
+                              unsigned long long int expiration)
+{
+  if (strlen (name) >= DNS_NAME_SIZE)
+    return;
+  int oldest = 0;
+  int i;
+  for (i = 0; i < dns_cache_used; i++) {
+    struct dns_cache_entry * e = dns_cache + i;
+    if ((strcmp (e->name, name) == 0) &&
+        (same_sockaddr (&(e->addr), dns_sockaddr_size (&(e->addr)),
+                        addr, dns_sockaddr_size (addr)))) {
+      if (e->expiration < expiration) {
+        e->expiration = expiration;
+        dns_cache_changed = 1;
+      }
+      return;
+    }
+    if (e->expiration < dns_cache [oldest].expiration)
+      oldest = i;
+  }
+  if (dns_cache_used < DNS_CACHE_ENTRIES)
+    i = dns_cache_used++;
+  else          /* replace the entry closest to expiring */
+    i = oldest;
+  snprintf (dns_cache [i].name, sizeof (dns_cache [i].name), "%s", name);
+  dns_cache [i].addr = *addr;
+  dns_cache [i].expiration = expiration;
+  dns_cache_changed = 1;
+}
+
+/* each line of the cache file has the expiration time in allnet
+ * seconds, the name, and the address, e.g.
+ *   845678901 a.allnet.org 1.2.3.4
+ * must be called with dns_cache_mutex held */
+static void dns_cache_load (void)
+{
+  dns_cache_loaded = 1;
+  char * fname = NULL;
+  if (config_file_name ("dns", "cache", &fname, 0) <= 0)
+    return;
+  char * contents = NULL;
+  int size = read_file_malloc (fname, &contents, 0);
+  free (fname);
+  if ((size <= 0) || (contents == NULL)) {
+    if (contents != NULL)
+      free (contents);
+    return;
+  }
+  unsigned long long int now = allnet_time ();
+  char * line = contents;
+  while ((line != NULL) && (*line != '\0')) {
+    char * next = index (line, '\n');
+    if (next != NULL)
+      *(next++) = '\0';
+    unsigned long long int expiration;
+    char name [DNS_NAME_SIZE];      /* scanf widths match these sizes */
+    char ip [INET6_ADDRSTRLEN];
+    if ((sscanf (line, "%llu %255s %45s", &expiration, name, ip) == 3) &&
+        (expiration > now)) {
+      struct sockaddr_storage sas;
+      memset (&sas, 0, sizeof (sas));
+      struct sockaddr_in * sinp = (struct sockaddr_in *) &sas;
+      struct sockaddr_in6 * sin6p = (struct sockaddr_in6 *) &sas;
+      if (inet_pton (AF_INET, ip, &(sinp->sin_addr)) == 1) {
+        sinp->sin_family = AF_INET;
+        sinp->sin_port = htons (ALLNET_PORT);
+        dns_cache_insert (name, &sas, expiration);
+      } else if (inet_pton (AF_INET6, ip, &(sin6p->sin6_addr)) == 1) {
+        sin6p->sin6_family = AF_INET6;
+        sin6p->sin6_port = htons (ALLNET_PORT);
+        dns_cache_insert (name, &sas, expiration);
+      }
+    }
+    line = next;
+  }
+  free (contents);
+  dns_cache_changed = 0;
+}
+
+/* writes dns/cache.tmp and renames it to dns/cache, if anything changed */
+static void dns_cache_save (void)
+{
+  pthread_mutex_lock (&dns_cache_mutex);
+  if (! dns_cache_changed) {
+    pthread_mutex_unlock (&dns_cache_mutex);
+    return;
+  }
+  dns_cache_changed = 0;
+  int fd = open_write_config ("dns", "cache.tmp", 0);
+  int result = (fd >= 0);
+  unsigned long long int now = allnet_time ();
+  int i;
+  for (i = 0; (result) && (i < dns_cache_used); i++) {
+    struct dns_cache_entry * e = dns_cache + i;
+    if (e->expiration <= now)
+      continue;
+    char ip [INET6_ADDRSTRLEN];
+    const void * ap = &(((struct sockaddr_in *) &(e->addr))->sin_addr);
+    if (e->addr.ss_family == AF_INET6)
+      ap = &(((struct sockaddr_in6 *) &(e->addr))->sin6_addr);
+    if (inet_ntop (e->addr.ss_family, ap, ip, sizeof (ip)) == NULL)
+      continue;
+    char line [DNS_NAME_SIZE + INET6_ADDRSTRLEN + 30];
+    int len = snprintf (line, sizeof (line), "%llu %s %s\n", e->expiration,
+                        e->name, ip);
+    if (write (fd, line, len) != len)
+      result = 0;
+  }
+  if (fd >= 0)
+    close (fd);
+  char * tmp_name = NULL;
+  char * name = NULL;
+  if ((result) &&
+      (config_file_name ("dns", "cache.tmp", &tmp_name, 0) > 0) &&
+      (config_file_name ("dns", "cache", &name, 0) > 0) &&
+      (rename (tmp_name, name) != 0))
+    perror ("dns_cache_save rename");
+  if (tmp_name != NULL)
+    free (tmp_name);
+  if (name != NULL)
+    free (name);
+  pthread_mutex_unlock (&dns_cache_mutex);
+}
+
+static void dns_cache_add (const char * name,
+                           const struct sockaddr_storage * addr,
+                           unsigned long int ttl)
+{
+  if (ttl < DNS_CACHE_MIN_TTL)
+    ttl = DNS_CACHE_MIN_TTL;
+  if (ttl > DNS_CACHE_MAX_TTL)
+    ttl = DNS_CACHE_MAX_TTL;
+  pthread_mutex_lock (&dns_cache_mutex);
+  if (! dns_cache_loaded)
+    dns_cache_load ();
+  dns_cache_insert (name, addr, allnet_time () + ttl);
+  pthread_mutex_unlock (&dns_cache_mutex);
+}
+
+/* calls the callback for each unexpired cached address of the given
+ * family for this name, and returns the number of such addresses */
+static int dns_cache_lookup (const char * name, int callback_id, int family,
+                             void (* callback) (const char * name, int id,
+                                                int valid,
+                                                const struct sockaddr * addr))
+{
+  struct sockaddr_storage found [DNS_CACHE_MAX_ANSWERS];
+  int num_found = 0;
+  pthread_mutex_lock (&dns_cache_mutex);
+  if (! dns_cache_loaded)
+    dns_cache_load ();
+  unsigned long long int now = allnet_time ();
+  int i;
+  for (i = 0; (i < dns_cache_used) && (num_found < DNS_CACHE_MAX_ANSWERS);
+       i++) {
+    struct dns_cache_entry * e = dns_cache + i;
+    if ((e->addr.ss_family == family) && (e->expiration > now) &&
+        (strcmp (e->name, name) == 0))
+      found [num_found++] = e->addr;
+  }
+  pthread_mutex_unlock (&dns_cache_mutex);
+  /* the callback is called without holding the mutex */
+  for (i = 0; i < num_found; i++)
+    callback (name, callback_id, 1, (struct sockaddr *) (found + i));
+  return num_found;
+}
+
+/* returns the position just after the DNS name starting at pos, or -1 */
+static int skip_dns_name (const char * response, ssize_t received, int pos)
+{
+  while (pos < received) {
+    int label_len = ((const unsigned char *) response) [pos];
+    if (label_len == 0)
+      return pos + 1;
+    if ((label_len & 0xc0) == 0xc0)  /* a pointer ends the name */
+      return ((pos + 2 <= received) ? pos + 2 : -1);
+    pos += label_len + 1;
+  }
+  return -1;
+}
+
+/* parses a response to a query for name.  Calls the callback for each
+ * address in the answer, or once with valid == 0 if there is no such name.
+ * sets *answered if the server gave a definite answer, even if the
+ * answer has no addresses.  Returns the number of addresses found */
 static int
   dns_callback (const char * response, ssize_t received,
-                const struct sockaddr_storage * from, socklen_t flen,
-                int min_dns_id, int num_dns_ids,
-                const struct sockaddr_storage * servers, int nservers,
+                const char * name, int callback_id,
                 void (* callback) (const char * name, int id, int valid,
                                    const struct sockaddr * addr),
-                const char ** names, const int * callback_ids, int count)
+                int * answered)
 {
 #ifdef DEBUG_PRINT
   print_buffer (response, received, "received response", received, 1);
 #endif /* DEBUG_PRINT */
-  int found_sender = 0;
-  const struct sockaddr * debug_sender = NULL;
-  int debug_alen = sizeof (struct sockaddr_in);
-  int i;
-  for (i = 0; i < nservers; i++) {
-    socklen_t alen = sizeof (struct sockaddr_in);
-    if (servers [i].ss_family == AF_INET6)
-      alen = sizeof (struct sockaddr_in6);
-    debug_alen = alen;
-    if (same_sockaddr (from, flen, servers + i, alen)) {
-      found_sender = 1;
-      debug_sender = (const struct sockaddr *) (servers + i);
-      break;
-    }
-  }
-  if (! found_sender) {
-    printf ("dns received from unknown sender\n");
-    return 0;
-  }
-  if (received <= DNS_HEADER_SIZE) {
-    printf ("dns received only %zd bytes\n", received);
-    unsigned int r = (unsigned int) received;
-    print_buffer (response, r, NULL, r, 1);
-    return 0;
-  }
-  int received_id = readb16 (response);
-  if ((received_id < min_dns_id) || (received_id >= min_dns_id + num_dns_ids)) {
-    printf ("dns received unknown id %x, not in %x..%x\n", received_id,
-            min_dns_id, min_dns_id + num_dns_ids + 1);
-    return 0;
-  }
   /* 0x8000 means response, not truncated, no error */
   int correct_answer = ((readb16 (response + 2) & 0xFA0F) == 0x8000);
   /* 0x8003 means response, not truncated, no such name */
@@ -1164,7 +1355,7 @@ static int
     return 0;
   }
   int num_answers = readb16 (response + 6);
-  if ((readb16 (response + 4) != 1) || (correct_answer && (num_answers < 1))) {
+  if (readb16 (response + 4) != 1) {
 #ifdef DEBUG_PRINT
     printf ("dns received %d questions, %d answers\n",
             readb16 (response + 4), num_answers);
@@ -1203,16 +1394,10 @@ static int
 #ifdef DEBUG_PRINT
   printf ("original name is '%s'\n", original_name);
 #endif /* DEBUG_PRINT */
-  int name_index = -1;
-  for (i = 0; i < count; i++) {
-    if ((strcmp (names [i], original_name) == 0) ||
-        /* original_name is terminated by '.', names [i] may not be */
-        (strncmp (names [i], original_name, strlen (original_name) - 1) == 0)) {
-      name_index = i;
-    }
-  }
-  if (name_index < 0) {
-    printf ("dns response for %s, not found in name list\n", original_name);
+  if ((strcmp (name, original_name) != 0) &&
+      /* original_name is terminated by '.', name may not be */
+      (strncmp (name, original_name, strlen (original_name) - 1) != 0)) {
+    printf ("dns response for %s, not %s\n", original_name, name);
     return 0;
   }
   if (no_such_name) {
@@ -1227,11 +1412,12 @@ static int
         sas.ss_family = AF_INET6;
     }  /* else ss_family is 0 */
 #ifdef DEBUG_PRINT
-    printf ("no such name: calling DNS callback for [%d] %s/%d\n",
-            name_index, names [name_index], callback_ids [name_index]);
+    printf ("no such name: calling DNS callback for %s/%d\n",
+            name, callback_id);
     print_buffer (response, (int)received, "received response", 512, 1);
 #endif /* DEBUG_PRINT */
-    callback (names [name_index], callback_ids [name_index], 0, sap);
+    *answered = 1;
+    callback (name, callback_id, 0, sap);
     return 0;
   }
   if (end_of_name + 4 > received) {
@@ -1240,66 +1426,46 @@ static int
     print_buffer (response, (int)received, "received response", 512, 1);
     return 0;
   }
-  size_t answer_start = end_of_name + 4;  /* after type/class of query */
-  size_t answer_fixed = answer_start + 2;  /* in the common case c00c */
+  *answered = 1;   /* may have no answers, e.g. no AAAA for this name */
+  int answer_start = end_of_name + 4;  /* after type/class of query */
   int num_found = 0;
-  while ((answer_start + 10 <= received) && (num_found < num_answers)) {
-    if (readb16 (response + answer_start) != 0xc00c) {  /* unusual */
-      int query_size = end_of_name - DNS_HEADER_SIZE;
-      if (memcmp (response + answer_start, response + DNS_HEADER_SIZE,
-                  query_size + 4) == 0) {
-        /* server repeated query in answer */
-        answer_fixed = answer_start + query_size;
-      } else {
-        printf ("memcmp (%p, %p, %d) == %d\n",
-                response + answer_start, response + DNS_HEADER_SIZE,
-                query_size,
-                memcmp (response + answer_start, response + DNS_HEADER_SIZE,
-                        query_size));
-        printf ("dns answer at offset %zd is %04x not 0xc00c\n", answer_start,
-                readb16 (response + answer_start));
-        print_buffer (response, (int)received, "received response",
-                      (int)received, 1);
-        printf ("from: ");
-        print_sockaddr ((struct sockaddr *)debug_sender, debug_alen);
-        printf ("\n");
-        return num_found;
-      }
-    }
+  int ia;
+  for (ia = 0; ia < num_answers; ia++) {
+    /* each answer has a name (usually a pointer to the query name),
+     * type, class, 32-bit ttl, data length, and the data */
+    int answer_fixed = skip_dns_name (response, received, answer_start);
+    if ((answer_fixed < 0) || (answer_fixed + 10 > received))
+      break;
     int type = readb16 (response + answer_fixed);
+    unsigned long int ttl = readb32 (response + answer_fixed + 4);
+    int rdlength = readb16 (response + answer_fixed + 8);
+    int rdata = answer_fixed + 10;
+    if (rdata + rdlength > received)
+      break;
+    answer_start = rdata + rdlength;
     struct sockaddr_storage sas;
     memset (&sas, 0, sizeof (sas));
     struct sockaddr * sap = (struct sockaddr *) &sas;
     struct sockaddr_in * sinp = (struct sockaddr_in *) &sas;
     struct sockaddr_in6 * sin6p = (struct sockaddr_in6 *) &sas;
-    if ((type == 28) && (answer_fixed + 20 <= received)) {   /* ipv6 */
+    if ((type == 28) && (rdlength == 16)) {   /* ipv6 */
       sin6p->sin6_family = AF_INET6;
-      memcpy (&(sin6p->sin6_addr), response + answer_fixed + 10, 16);
+      memcpy (&(sin6p->sin6_addr), response + rdata, 16);
       sin6p->sin6_port = htons (ALLNET_PORT);
-#ifdef DEBUG_PRINT
-      printf ("success: calling DNS callback for [%d] %s/%d, IPv6, ",
-              name_index, names [name_index], callback_ids [name_index]);
-      print_sockaddr (sap, sizeof (struct sockaddr_in6)); printf ("\n");
-#endif /* DEBUG_PRINT */
-      callback (names [name_index], callback_ids [name_index], 1, sap);
-      num_found++;
-    } else if (type == 1) {   /* ipv4 */
+    } else if ((type == 1) && (rdlength == 4)) {   /* ipv4 */
       sinp->sin_family = AF_INET;
-      memcpy (&(sinp->sin_addr), response + answer_fixed + 10, 4);
+      memcpy (&(sinp->sin_addr), response + rdata, 4);
       sinp->sin_port = htons (ALLNET_PORT);
-      answer_start = answer_fixed + 8;
+    } else {   /* e.g. CNAME (type 5), the addresses follow */
+      continue;
+    }
 #ifdef DEBUG_PRINT
-      printf ("success: calling DNS callback for [%d] %s/%d, IPv4, ",
-              name_index, names [name_index], callback_ids [name_index]);
-      print_sockaddr (sap, sizeof (struct sockaddr_in)); printf ("\n");
+    printf ("success: calling DNS callback for %s/%d, ttl %lu, ",
+            name, callback_id, ttl);
+    print_sockaddr (sap, dns_sockaddr_size (&sas)); printf ("\n");
 #endif /* DEBUG_PRINT */
-      callback (names [name_index], callback_ids [name_index], 1, sap);
-    } else {
-      printf ("dns invalid type %d, answer_start %zd\n", type, answer_start);
-      print_buffer (response, (int)received, "response", (int)received, 1);
-      break;
-    }
-    answer_start += readb16 (response + answer_fixed + 8) + 12;
+    dns_cache_add (name, &sas, ttl);
+    callback (name, callback_id, 1, sap);
     num_found++;
   }
   return num_found;
@@ -1334,6 +1500,283 @@ static int callback_for_ips (const char * name, int callback_id,
   return 0;
 }
 
+/* each query (one per name and address type) is sent to one server
+ * at a time.  If there is no answer within the timeout, the query is
+ * sent to the next server and the timeout doubles, up to DNS_MAX_SENDS
+ * times in all.  Queries are independent, so one slow name does not
+ * delay the others */
+#define MAX_DNS_SERVERS		100
+#ifndef DNS_RETRY_MS
+#define DNS_RETRY_MS		500
+#endif /* DNS_RETRY_MS */
+#ifndef DNS_MAX_SENDS
+#define DNS_MAX_SENDS		4
+#endif /* DNS_MAX_SENDS */
+
+struct dns_query {
+  int name_index;
+  int type;                         /* 1 for A, 28 for AAAA */
+  int server;                       /* index of the next server to use */
+  int sends;                        /* number of times sent so far */
+  unsigned long long int next_ms;   /* when to send again, allnet ms */
+  int done;
+};
+
+struct allnet_dns_resolver {
+  const char ** names;
+  const int * callback_ids;
+  void (* callback) (const char * name, int id, int valid,
+                     const struct sockaddr * addr);
+  struct sockaddr_storage servers [MAX_DNS_SERVERS];
+  int nservers;
+  int s4;
+  int s6;
+  struct dns_query * queries;
+  int nqueries;
+  int min_dns_id;    /* query i has DNS id min_dns_id + i */
+  int outstanding;   /* queries not yet done */
+  int num_found;
+};
+
+static void dns_query_done (struct allnet_dns_resolver * r,
+                            struct dns_query * q)
+{
+  if (! q->done) {
+    q->done = 1;
+    r->outstanding--;
+  }
+}
+
+static void dns_send_query (struct allnet_dns_resolver * r,
+                            struct dns_query * q, unsigned long long int now)
+{
+  char query_packet [DNS_PACKET_SIZE];
+  memset (query_packet, 0, sizeof (query_packet));
+  writeb16 (query_packet, r->min_dns_id + (int) (q - r->queries));
+  writeb16 (query_packet + 2, 0x0100);   /* query, recursion desired */
+  writeb16 (query_packet + 4, 1);        /* one question, 0 answers etc */
+  /* we send exactly one query per packet */
+  char * query = query_packet + DNS_HEADER_SIZE;
+  int clen = copy_dns_name (query, r->names [q->name_index],
+                            query_packet + DNS_HEADER_SIZE);
+  writeb16 (query + clen, q->type);     /* A or AAAA */
+  writeb16 (query + clen + 2, 1);       /* query class 1, Internet */
+  size_t offset = DNS_HEADER_SIZE + clen + 4;
+  struct sockaddr_storage * this_server = r->servers + q->server;
+  int s = ((this_server->ss_family == AF_INET6) ? r->s6 : r->s4);
+  if (s >= 0) {
+    socklen_t alen = dns_sockaddr_size (this_server);
+    ssize_t send_res = sendto (s, query_packet, offset, 0,
+                               (struct sockaddr *) (this_server), alen);
+    if (send_res != offset) {
+      int e = errno;
+      if (unusual_sendto_error (e)) {
+        perror ("allnet_dns sendto");
+        printf ("allnet_dns sendto %zd returned %zd, errno %d\n",
+                offset, send_res, e);
+      }
+    }
+#ifdef DEBUG_PRINT
+    print_buffer (query_packet, offset, "sent", offset, 0);
+    print_buffer (this_server, alen, " to", alen, 1);
+#endif /* DEBUG_PRINT */
+  }
+  q->server = (q->server + 1) % r->nservers;
+  q->next_ms = now + (((unsigned long long int) DNS_RETRY_MS) << q->sends);
+  q->sends++;
+}
+
+/* handles one packet received from a DNS server */
+static void dns_receive (struct allnet_dns_resolver * r, const char * response,
+                         ssize_t received,
+                         const struct sockaddr_storage * from, socklen_t flen)
+{
+  int found_sender = 0;
+  int i;
+  for (i = 0; i < r->nservers; i++) {
+    if (same_sockaddr (from, flen, r->servers + i,
+                       dns_sockaddr_size (r->servers + i))) {
+      found_sender = 1;
+      break;
+    }
+  }
+  if (! found_sender) {
+    printf ("dns received from unknown sender\n");
+    return;
+  }
+  if (received <= DNS_HEADER_SIZE) {
+    printf ("dns received only %zd bytes\n", received);
+    unsigned int rsize = (unsigned int) received;
+    print_buffer (response, rsize, NULL, rsize, 1);
+    return;
+  }
+  int index = (int) ((readb16 (response) - r->min_dns_id) & 0xffff);
+  if (index >= r->nqueries) {
+    printf ("dns received unknown id %x, not in %x..%x\n", readb16 (response),
+            r->min_dns_id, r->min_dns_id + r->nqueries - 1);
+    return;
+  }
+  struct dns_query * q = r->queries + index;
+  if (q->done)   /* already answered, perhaps by a different server */
+    return;
+  int answered = 0;
+  r->num_found += dns_callback (response, received, r->names [q->name_index],
+                                r->callback_ids [q->name_index], r->callback,
+                                &answered);
+  if (answered)
+    dns_query_done (r, q);
+}
+
+struct allnet_dns_resolver *
+  allnet_dns_start (const char ** names, const int * callback_ids, int count,
+                    void (* callback) (const char * name, int id, int valid,
+                                       const struct sockaddr * addr))
+{
+  if (count <= 0)
+    return NULL;
+  struct allnet_dns_resolver * r =
+    malloc_or_fail (sizeof (struct allnet_dns_resolver), "allnet_dns_start");
+  memset (r, 0, sizeof (struct allnet_dns_resolver));
+  r->names = names;
+  r->callback_ids = callback_ids;
+  r->callback = callback;
+  r->s4 = -1;
+  r->s6 = -1;
+  r->queries = malloc_or_fail (2 * count * sizeof (struct dns_query),
+                               "allnet_dns_start queries");
+  int in;
+  for (in = 0; in < count; in++) {
+    if (callback_for_ips (names [in], callback_ids [in], callback))
+      continue;   /* resolved, go on to the next entry */
+    /* 2 bytes for the root label and the length of the first label,
+     * 4 bytes for query type and class */
+    if (DNS_HEADER_SIZE + strlen (names [in]) + 2 + 4 > DNS_PACKET_SIZE) {
+      printf ("allnet_dns: name %s is too long\n", names [in]);
+      continue;
+    }
+    int iaf;   /* ipv4 and ipv6 */
+    for (iaf = 0; iaf < 2; iaf++) {
+      int family = ((iaf == 0) ? AF_INET : AF_INET6);
+      int cached = dns_cache_lookup (names [in], callback_ids [in], family,
+                                     callback);
+      if (cached > 0) {
+        r->num_found += cached;
+        continue;
+      }
+      struct dns_query * q = r->queries + r->nqueries;
+      memset (q, 0, sizeof (struct dns_query));
+      q->name_index = in;
+      q->type = ((iaf == 0) ? 1 : 28);
+      r->nqueries++;
+    }
+  }
+  if (r->nqueries <= 0)
+    return r;
+  /* find all the servers that this host is using */
+  r->nservers = get_dns_servers (r->servers, MAX_DNS_SERVERS);
+  r->s4 = socket (AF_INET, SOCK_DGRAM, 0);
+  if (r->s4 < 0)   /* don't die, just use the v6 socket */
+    perror ("allnet_dns v4 socket");
+  r->s6 = socket (AF_INET6, SOCK_DGRAM, 0);
+  if (r->s6 < 0)   /* don't die, just use the v4 socket */
+    perror ("allnet_dns v6 socket");
+#ifdef DEBUG_PRINT
+  printf ("s4 %d, s6 %d\n", r->s4, r->s6);
+#endif /* DEBUG_PRINT */
+  if ((r->nservers <= 0) || ((r->s4 < 0) && (r->s6 < 0))) {
+    r->nqueries = 0;
+    return r;
+  }
+  r->min_dns_id = (int) random_int (1, 65535);
+  r->outstanding = r->nqueries;
+  unsigned long long int now = allnet_time_ms ();
+  int iq;
+  for (iq = 0; iq < r->nqueries; iq++) {
+    struct dns_query * q = r->queries + iq;
+    q->server = (int) random_int (0, r->nservers - 1);
+    dns_send_query (r, q, now);
+  }
+  return r;
+}
+
+int allnet_dns_fds (struct allnet_dns_resolver * r, int * fds)
+{
+  int n = 0;
+  if ((r == NULL) || (r->outstanding <= 0))
+    return 0;
+  if (r->s4 >= 0)
+    fds [n++] = r->s4;
+  if (r->s6 >= 0)
+    fds [n++] = r->s6;
+  return n;
+}
+
+int allnet_dns_timeout_ms (struct allnet_dns_resolver * r)
+{
+  if ((r == NULL) || (r->outstanding <= 0))
+    return -1;
+  unsigned long long int now = allnet_time_ms ();
+  unsigned long long int first = 0;
+  int iq;
+  for (iq = 0; iq < r->nqueries; iq++) {
+    struct dns_query * q = r->queries + iq;
+    if ((! q->done) && ((first == 0) || (q->next_ms < first)))
+      first = q->next_ms;
+  }
+  if (first <= now)
+    return 0;
+  return (int) (first - now);
+}
+
+int allnet_dns_process (struct allnet_dns_resolver * r)
+{
+  if (r == NULL)
+    return 0;
+  char response_packet [DNS_PACKET_SIZE];
+  int sockets [2] = { r->s4, r->s6 };
+  int is;
+  for (is = 0; is < 2; is++) {
+    while ((sockets [is] >= 0) && (r->outstanding > 0)) {
+      struct sockaddr_storage sas;
+      socklen_t slen = sizeof (sas);
+      ssize_t received = recvfrom (sockets [is], response_packet,
+                                   sizeof (response_packet), MSG_DONTWAIT,
+                                   (struct sockaddr *) (&sas), &slen);
+      if (received <= 0)
+        break;
+      dns_receive (r, response_packet, received, &sas, slen);
+    }
+  }
+  unsigned long long int now = allnet_time_ms ();
+  int iq;
+  for (iq = 0; iq < r->nqueries; iq++) {
+    struct dns_query * q = r->queries + iq;
+    if ((! q->done) && (q->next_ms <= now)) {
+      if (q->sends >= DNS_MAX_SENDS)
+        dns_query_done (r, q);   /* give up on this one */
+      else
+        dns_send_query (r, q, now);
+    }
+  }
+  return r->outstanding;
+}
+
+int allnet_dns_finish (struct allnet_dns_resolver * r)
+{
+  if (r == NULL)
+    return 0;
+  int result = r->num_found;
+  if (r->s4 >= 0) close (r->s4);
+  if (r->s6 >= 0) close (r->s6);
+  free (r->queries);
+  free (r);
+  dns_cache_save ();
+#ifdef DEBUG_PRINT
+  printf ("allnet_dns done, returning %d\n", result);
+#endif /* DEBUG_PRINT */
+  return result;
+}
+
 /* using getaddrinfo makes it hard or impossible to do static linking,
  * whereas static linking is useful for distributing the software as
  * self-contained binaries.
@@ -1345,135 +1788,28 @@ static int callback_for_ips (const char * name, int callback_id,
  *    callback with the original name, the corresponding id, and the address.
  *    valid is zero if there is no address for the name (RCODE=3)
  *    allnet_dns itself returns after it gets all its responses, or when
- *    it times out, usually after 10-20s.
+ *    it times out, usually after 5-10s.
  *    allnet_dns returns the number of addresses found, or 0 for errors
  */
 int allnet_dns (const char ** names, const int * callback_ids, int count,
                 void (* callback) (const char * name, int id, int valid,
                                    const struct sockaddr * addr))
 {
-  if (count <= 0)
-    return 0;
-  /* find all the servers that this host is using */
-#define MAX_DNS_SERVERS		100
-  struct sockaddr_storage servers [MAX_DNS_SERVERS];
-  int nservers = get_dns_servers (servers, MAX_DNS_SERVERS);
-  if (nservers <= 0)
-    return 0;
-  /* open the two sockets we use */
-  int s4 = socket (AF_INET, SOCK_DGRAM, 0);
-  if (s4 < 0) {
-    perror ("allnet_dns v4 socket");
+  struct allnet_dns_resolver * r =
+    allnet_dns_start (names, callback_ids, count, callback);
+  if (r == NULL)
     return 0;
-  }
-  int s6 = socket (AF_INET6, SOCK_DGRAM, 0);
-  if (s6 < 0) {   /* don't die, just use the v4 socket */
-    perror ("allnet_dns v4 socket");
-  }
-#ifdef DEBUG_PRINT
-  printf ("s4 %d, s6 %d\n", s4, s6);
-#endif /* DEBUG_PRINT */
-  /* build the query packet */
-  char query_packet [512];  /* RFC 1035, section 2.3.4, max UDP packet size */
-  int npackets = 0;
-  /* for each server for each name send up to 2 different query IDs (v4+v6) */
-  int max_actual_servers = ((nservers > 2) ? 2 : nservers);
-  int min_dns_id = (int)random_int (1, 65534 - max_actual_servers * count * 2);
-  int num_dns_ids = 0;
-  int in;
-  for (in = 0; in < count; in++) {
-    if (callback_for_ips (names [in], callback_ids [in], callback))
-      continue;   /* resolved, go on to the next entry */
-    int iaf;   /* ipv4 and ipv6 */
-    for (iaf = 0; iaf < 2; iaf++) {
-      memset (query_packet, 0, sizeof (query_packet));
-      writeb16 (query_packet + 2, 0x0100);   /* query, recursion desired */
-      writeb16 (query_packet + 4, 1);        /* one question, 0 answers etc */
-      size_t offset = DNS_HEADER_SIZE;
-      /* +2 for the root label and the length of the first label */
-      size_t nlen = strlen (names [in]) + 2;
-      size_t qlen = nlen + 4;   /* 4 bytes for query type and class */
-#ifdef DEBUG_PRINT
-      if (offset + qlen >= sizeof (query_packet))
-      printf ("error: %zd + %zd >= %zd\n", offset, qlen, sizeof (query_packet));
-#endif /* DEBUG_PRINT */
-      /* we send exactly one query per packet */
-      char * query = query_packet + offset;
-      int clen = copy_dns_name (query, names [in],
-                                query_packet + DNS_HEADER_SIZE);
-if (nlen != clen) printf ("error: nlen %zd, clen %d for %s\n", nlen, clen, names [in]);
-      writeb16 (query + nlen, (iaf == 0) ? 1 : 28); /* A or AAAA */
-      writeb16 (query + nlen + 2, 1);   /* query class 1, Internet */
-      offset += qlen;
-      /* send the query packet to at most two randomly chosen servers */
-      int server_offset = ((nservers <= 2) ? 0 :
-                           (int)(random_int (0, nservers - 2)));
-      int is = 0;
-      for (is = 0; (is < nservers) && (is < 2); is++) {
-        writeb16 (query_packet, min_dns_id + num_dns_ids);
-        struct sockaddr_storage * this_server = servers + (is + server_offset);
-        int s = s4;
-        socklen_t alen = sizeof (struct sockaddr_in);
-        if (this_server->ss_family == AF_INET6) {
-          s = s6;
-          alen = sizeof (struct sockaddr_in6);
-        }
-        if (s >= 0) {
-          ssize_t send_res = sendto (s, query_packet, offset, 0,
-                                     (struct sockaddr *) (this_server), alen);
-          if (send_res != offset) {
-            int e = errno;
-            if (unusual_sendto_error (e)) {
-              perror ("allnet_dns sendto");
-              printf ("allnet_dns sendto %zd returned %zd, errno %d\n",
-                      offset, send_res, e);
-            }
-          } else {
-            npackets++;
-            num_dns_ids++;
-#ifdef DEBUG_PRINT
-            print_buffer (query_packet, offset, "sent", offset, 0);
-            print_buffer (this_server, alen, " to", alen, 1);
-#endif /* DEBUG_PRINT */
-            sleep_time_random_us (20 * 1000);  /* about 10ms between packets */
-          }
-        }
-      }
+  while (allnet_dns_process (r) > 0) {
+    int fds [2];
+    struct pollfd pfds [2];
+    int nfds = allnet_dns_fds (r, fds);
+    int i;
+    for (i = 0; i < nfds; i++) {
+      pfds [i].fd = fds [i];
+      pfds [i].events = POLLIN;
+      pfds [i].revents = 0;
     }
+    poll (pfds, nfds, allnet_dns_timeout_ms (r));
   }
-  /* wait up to about 4-5 seconds for all the replies */
-  int num_received = 0;
-  unsigned long long int start = allnet_time ();
-  unsigned long long int sleep_time = 1000; /* 1000us = 1ms */
-  char response_packet [512];
-  while (start + 4 > allnet_time ()) {
-    struct sockaddr_storage sas;
-    socklen_t slen = sizeof (sas);
-    struct sockaddr * sap = (struct sockaddr *) (&sas);
-    ssize_t received = recvfrom (s4, response_packet, sizeof (response_packet),
-                                 MSG_DONTWAIT, sap, &slen);
-    if ((received <= 0) && (s6 >= 0)) {
-      slen = sizeof (sas);
-      received = recvfrom (s6, response_packet, sizeof (response_packet),
-                           MSG_DONTWAIT, sap, &slen);
-    }
-#ifdef DEBUG_PRINT
-    printf ("received %zd, num_received %d\n", received, num_received);
-#endif /* DEBUG_PRINT */
-    if (received > 0)
-      num_received += dns_callback (response_packet, received,
-                                    &sas, slen, min_dns_id, num_dns_ids,
-                                    servers, nservers, callback,
-                                    names, callback_ids, count);
-    sleep_time_random_us (sleep_time);
-    sleep_time += sleep_time;   /* double the sleep time */
-  }
-  if (s4 >= 0) close (s4);
-  if (s6 >= 0) close (s6);
-#ifdef DEBUG_PRINT
-  printf ("allnet_dns done, returning %d\n", num_received);
-#endif /* DEBUG_PRINT */
-#undef MAX_DNS_SERVERS
-  return num_received;
+  return allnet_dns_finish (r);
 }
-
@@ -89,13 +89,38 @@ extern int interface_broadcast_addrs (struct sockaddr_storage ** addrs);
  *    callback with the original name, the corresponding id, and the address.
  *    valid is all zeros if there is no address for the name (RCODE=3)
  *    allnet_dns itself returns after it gets all its responses, or when
- *    it times out, usually after 10-20s.
+ *    it times out, usually after 5-10s.
  *    allnet_dns returns the number of addresses found, or 0 for errors
  */
 extern int allnet_dns (const char ** names, const int * callback_ids, int count,
                        void (* callback) (const char * name, int id, int valid,
                                           const struct sockaddr * addr));
 
+/* the same resolver without blocking, for callers with their own poll loop.
+ * allnet_dns_start calls the callback right away for IP addresses and for
+ * names with unexpired cached answers, and sends queries for the others.
+ * names and callback_ids must remain valid until allnet_dns_finish.
+ * allnet_dns_fds fills in (up to 2) sockets to poll for input, and
+ *    returns the number of sockets.
+ * allnet_dns_timeout_ms returns how long to wait before calling
+ *    allnet_dns_process even if there is no input, or -1 when done.
+ * allnet_dns_process reads any responses, calling the callback, and
+ *    resends queries that have timed out (to a different server if
+ *    possible).  Returns the number of queries still outstanding.
+ * allnet_dns_finish frees the resolver, saves the cache of answers
+ *    (kept for their DNS time to live, in ~/.allnet/dns/cache), and
+ *    returns the number of addresses found
+ * allnet_dns_start only returns NULL if count <= 0 */
+struct allnet_dns_resolver;
+extern struct allnet_dns_resolver *
+  allnet_dns_start (const char ** names, const int * callback_ids, int count,
+                    void (* callback) (const char * name, int id, int valid,
+                                       const struct sockaddr * addr));
+extern int allnet_dns_fds (struct allnet_dns_resolver * r, int * fds);
+extern int allnet_dns_timeout_ms (struct allnet_dns_resolver * r);
+extern int allnet_dns_process (struct allnet_dns_resolver * r);
+extern int allnet_dns_finish (struct allnet_dns_resolver * r);
+
 /* test whether this address is syntactically valid address (e.g.
  * not all zeros), returning 1 if valid, -1 if it is an ipv4-in-ipv6
  * address, and 0 otherwise */
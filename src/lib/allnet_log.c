@@ -146,7 +146,7 @@ struct allnet_log * init_log (const char * caller_name)
       snprintf (log_dir, sizeof (log_dir), "/var/log/allnet");
   }
 
-  if (! create_dir (log_dir))
+  if (! create_dir (log_dir, 0))
     printf ("%s: unable to create directory %s\n", caller_name, log_dir);
   time_t now = time (NULL);
   /* only open a new log file if this is the astart or allnet module */
@@ -175,62 +175,264 @@ void close_log (struct allnet_log * log)
   free (log);
 }
 
-static void log_print_buffer (char * buffer, int blen, int out)
+/* log lines are not written by the threads that log them.  Each line is
+ * copied into log_ring, and a writer thread takes all the lines in the
+ * ring at once.  The writer keeps the log file open, writes each batch
+ * with one write while holding the file lock, and also sends each line
+ * to syslog if there is no log file (or always, with LOG_SYSLOG_ALWAYS).
+ * Threads only wait for the writer if the ring is full.
+ * Each line is saved as a 2-byte length followed by the line itself */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE	(64 * 1024)
+#endif /* LOG_RING_SIZE */
+static char log_ring [LOG_RING_SIZE];
+static int ring_start = 0;   /* the oldest byte not yet taken by the writer */
+static int ring_used = 0;
+static int ring_writing = 0; /* 1 while the writer writes lines it took */
+static unsigned long long int ring_added = 0;    /* bytes, ever */
+static unsigned long long int ring_written = 0;  /* bytes, ever */
+static pid_t writer_pid = 0; /* the process running the writer, if any */
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_data = PTHREAD_COND_INITIALIZER;   /* added */
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;  /* written */
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pid_t log_pid = 0;    /* cached, since getpid may be a system call */
+
+#ifdef LOG_TO_FILE
+static int log_fd = -1;
+static char log_fd_name [PATH_MAX] = "";  /* the file log_fd refers to */
+#endif /* LOG_TO_FILE */
+
+/* write the lines to the log file and/or syslog */
+static void write_lines (char * lines, int size)
 {
-#ifdef LOG_TO_FILE 
-  int fd = open (log_file_name, O_WRONLY | O_APPEND);
-  if (fd < 0) {
-    printf ("%s", buffer);
-    return;
+  char * out = lines;    /* the lines without their lengths, for the file */
+  int olen = 0;
+  int use_syslog = 1;
+#ifdef LOG_TO_FILE
+  if ((log_fd < 0) || (strcmp (log_fd_name, log_file_name) != 0)) {
+    if (log_fd >= 0)
+      close (log_fd);   /* init_log started a new file */
+    log_fd = -1;
+    if (log_file_name [0] != '\0')
+      log_fd = open (log_file_name, O_WRONLY | O_APPEND);
+    snprintf (log_fd_name, sizeof (log_fd_name), "%s", log_file_name);
+  }
+#ifndef LOG_SYSLOG_ALWAYS
+  use_syslog = (log_fd < 0);
+#endif /* LOG_SYSLOG_ALWAYS */
+#endif /* LOG_TO_FILE */
+  int pos = 0;
+  while (pos + 2 <= size) {
+    int len = (int) readb16 (lines + pos);
+    char * line = lines + pos + 2;
+    if (use_syslog) {
+      char copy [LOG_SIZE + LOG_SIZE + 100];
+      int clen = (len < (int) sizeof (copy)) ? len : (int) sizeof (copy) - 1;
+      memcpy (copy, line, clen);
+      copy [clen] = '\0';
+      int syslog_option = LOG_DAEMON | LOG_WARNING;
+      /* use copy + 12 to skip over most of the date (04/14 03:13:) */
+      syslog (syslog_option, "%s", (clen > 12) ? (copy + 12) : copy);
+    }
+    memmove (out + olen, line, len);   /* out is never past line */
+    olen += len;
+    pos += 2 + len;
   }
+#ifdef LOG_TO_FILE
+  if (log_fd < 0)
+    return;
   struct flock lock;  /* lock the file, to keep others out while we print */
   lock.l_type = F_WRLCK;
   lock.l_whence = SEEK_END;
   lock.l_start = 0;
-  lock.l_len = blen;
-  if (fcntl (fd, F_SETLKW, &lock) < 0) {
+  lock.l_len = olen;
+  if (fcntl (log_fd, F_SETLKW, &lock) < 0) {
     perror ("unable to lock log file");
-    printf ("(%d) %s", blen, buffer);
-    close (fd);
     return;
   }
-  int w = write (fd, buffer, blen);
-  if (w < blen) {
+  int w = write (log_fd, out, olen);
+  if (w < olen) {
     perror ("write to log file");
     if (w >= 0)
-      printf ("tried to write %d bytes to %s, wrote %d bytes", blen,
+      printf ("tried to write %d bytes to %s, wrote %d bytes\n", olen,
               log_file_name, w);
-    printf ("%s", buffer);
   }
   lock.l_type = F_UNLCK;
-  if (fcntl (fd, F_SETLKW, &lock) < 0)   /* essentially, ignore this error */
+  if (fcntl (log_fd, F_SETLKW, &lock) < 0)   /* essentially, ignore this error */
     perror ("unable to unlock log file");
-  close (fd);
+#else /* LOG_TO_FILE */
+  (void) out;
 #endif /* LOG_TO_FILE  */
-  int syslog_option = LOG_DAEMON | LOG_WARNING;
-  /* use buffer + 12 to skip over most of the date (04/14 03:13:) */
-  syslog (syslog_option, "%s", buffer + 12);
+}
+
+/* copy out everything in the ring.  Must be called with ring_mutex held */
+static int take_lines (char * lines)
+{
+  int size = ring_used;
+  int first = minz (LOG_RING_SIZE, ring_start);  /* bytes before the end */
+  if (first > size)
+    first = size;
+  memcpy (lines, log_ring + ring_start, first);
+  memcpy (lines + first, log_ring, size - first);
+  ring_start = (ring_start + size) % LOG_RING_SIZE;
+  ring_used = 0;
+  return size;
+}
+
+static void * log_writer_thread (void * arg)
+{
+  static char lines [LOG_RING_SIZE];
+  pthread_mutex_lock (&ring_mutex);
+  while (1) {
+    while (ring_used == 0)
+      pthread_cond_wait (&ring_data, &ring_mutex);
+    int size = take_lines (lines);
+    ring_writing = 1;
+    pthread_cond_broadcast (&ring_space);
+    pthread_mutex_unlock (&ring_mutex);
+    write_lines (lines, size);
+    pthread_mutex_lock (&ring_mutex);
+    ring_writing = 0;
+    ring_written += size;
+    pthread_cond_broadcast (&ring_space);
+  }
+  return NULL;
+}
+
+/* called at exit, to wait (at most 1s) until everything logged so far
+ * has been written.  exit may be called from a signal handler that
+ * interrupted a thread holding ring_mutex, so only try to lock it */
+static void flush_log ()
+{
+  if (pthread_mutex_trylock (&ring_mutex) != 0)
+    return;
+  if (writer_pid == getpid ()) {
+    unsigned long long int added = ring_added;
+    struct timespec limit;
+    clock_gettime (CLOCK_REALTIME, &limit);
+    limit.tv_sec += 1;
+    while ((ring_written < added) &&
+           (pthread_cond_timedwait (&ring_space, &ring_mutex, &limit) == 0))
+      ;
+  }
+  pthread_mutex_unlock (&ring_mutex);
+}
+
+/* keep the ring consistent across fork.  The child has no writer thread,
+ * and the parent writes any lines left in the ring */
+static void ring_prepare_fork ()
+{
+  pthread_mutex_lock (&ring_mutex);
+}
+
+static void ring_parent_fork ()
+{
+  pthread_mutex_unlock (&ring_mutex);
+}
+
+static void ring_child_fork ()
+{
+  ring_added = ring_written = 0;
+  ring_used = 0;
+  ring_writing = 0;
+  writer_pid = 0;
+  log_pid = 0;
+  pthread_mutex_unlock (&ring_mutex);
+}
+
+static void ring_init_once ()
+{
+  pthread_atfork (ring_prepare_fork, ring_parent_fork, ring_child_fork);
+  atexit (flush_log);
+}
+
+/* add the line to the ring, or write it directly if there is no writer */
+static void log_enqueue (const char * line, int len)
+{
+  pthread_once (&ring_once, ring_init_once);
+  if (len > LOG_RING_SIZE / 2)
+    len = LOG_RING_SIZE / 2;
+  pthread_mutex_lock (&ring_mutex);
+  pid_t pid = getpid ();
+  if (writer_pid != pid) {   /* start a writer for this process */
+    pthread_t ignored;
+    if (pthread_create (&ignored, NULL, log_writer_thread, NULL) == 0) {
+      pthread_detach (ignored);
+      writer_pid = pid;
+    }
+  }
+  if (writer_pid != pid) {   /* unable to start a writer thread */
+    char lines [LOG_SIZE + LOG_SIZE + 100 + 2];
+    int n = (len + 2 <= (int) sizeof (lines)) ? len : (int) sizeof (lines) - 2;
+    writeb16 (lines, n);
+    memcpy (lines + 2, line, n);
+    write_lines (lines, n + 2);
+    pthread_mutex_unlock (&ring_mutex);
+    return;
+  }
+  while (ring_used + 2 + len > LOG_RING_SIZE)
+    pthread_cond_wait (&ring_space, &ring_mutex);
+  char header [2];
+  writeb16 (header, len);
+  int i;
+  int end = (ring_start + ring_used) % LOG_RING_SIZE;
+  for (i = 0; i < 2; i++)
+    log_ring [(end + i) % LOG_RING_SIZE] = header [i];
+  end = (end + 2) % LOG_RING_SIZE;
+  int first = minz (LOG_RING_SIZE, end);   /* room before the end */
+  if (first > len)
+    first = len;
+  memcpy (log_ring + end, line, first);
+  memcpy (log_ring, line + first, len - first);
+  ring_used += 2 + len;
+  ring_added += 2 + len;
+  pthread_cond_signal (&ring_data);
+  pthread_mutex_unlock (&ring_mutex);
+}
+
+static void log_print_buffer (char * buffer, int blen, int out)
+{
+  log_enqueue (buffer, blen);
   if ((allnet_global_debugging) || (out))
     printf ("%s", buffer);
 }
 
+/* the formatted local time (without microseconds) is only computed
+ * once per second */
+static pthread_mutex_t time_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t cached_second = -1;
+static char cached_time [50] = "";
+
 void log_print_str (struct allnet_log * log, const char * string)
 {
   char header [100];
   char buffer [LOG_SIZE + LOG_SIZE];
   struct timeval now;
   gettimeofday (&now, NULL);
-  struct tm n;
-  int process = (getpid ()) % 100000;
+  if (log_pid == 0)
+    log_pid = getpid ();
+  int process = log_pid % 100000;
   int thread = ((long int)(pthread_self ())) % 100000;
-  if (localtime_r (&now.tv_sec, &n) == NULL)
+  char date [sizeof (cached_time)];
+  pthread_mutex_lock (&time_mutex);
+  if (now.tv_sec != cached_second) {
+    struct tm n;
+    if (localtime_r (&now.tv_sec, &n) == NULL)
+      cached_time [0] = '\0';
+    else
+      snprintf (cached_time, sizeof (cached_time), "%02d/%02d %02d:%02d:%02d",
+                n.tm_mon + 1, n.tm_mday, n.tm_hour, n.tm_min, n.tm_sec);
+    cached_second = now.tv_sec;
+  }
+  memcpy (date, cached_time, sizeof (date));
+  pthread_mutex_unlock (&time_mutex);
+  if (date [0] == '\0')
     snprintf (header, sizeof (header), "bad time %ld p%05d t%05d",
               now.tv_sec, process, thread);
   else
-    snprintf (header, sizeof (header),
-              "%02d/%02d %02d:%02d:%02d.%06ld p%05d t%05d",
-              n.tm_mon + 1, n.tm_mday, n.tm_hour, n.tm_min, n.tm_sec,
-              (long int) (now.tv_usec), process, thread);
+    snprintf (header, sizeof (header), "%s.%06ld p%05d t%05d",
+              date, (long int) (now.tv_usec), process, thread);
   /* add a newline if it is not already at the end of the string */
   char * last_nl = strrchr (string, '\n');
   char * add_nl = "\n";
@@ -238,6 +440,8 @@ void log_print_str (struct allnet_log * log, const char * string)
     add_nl = "";   /* already present */
   int len = snprintf (buffer, sizeof (buffer), "%s %s: %s%s",
                       header, log->debug_info, string, add_nl);
+  if (len >= (int) sizeof (buffer))
+    len = sizeof (buffer) - 1;
   log_print_buffer (buffer, len, log->log_to_output);
 }
 
@@ -295,6 +499,158 @@ void log_packet (struct allnet_log * log, const char * desc,
   log_print_str (log, local_buf);
 }
 
+/* binary packet traces, see allnet_log.h */
+#ifndef LOG_TRACE_BATCH
+#define LOG_TRACE_BATCH		64   /* records written together */
+#endif /* LOG_TRACE_BATCH */
+#define LOG_TRACE_FILE		"packets.trace"
+static int trace_one_in = 0;
+static unsigned int trace_types = 0xffffffff;
+static unsigned int trace_counter = 0;
+static char trace_buffer [LOG_TRACE_BATCH * LOG_TRACE_RECORD_SIZE];
+static int trace_count = 0;                /* records in trace_buffer */
+static unsigned long long int trace_first = 0;  /* time of the first */
+static int trace_fd = -1;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/* must be called with trace_mutex held */
+static void trace_flush ()
+{
+  if (trace_count == 0)
+    return;
+  if (trace_fd < 0) {
+    char dir [PATH_MAX];
+    snprintf (dir, sizeof (dir), "/tmp/.allnet-log");
+    char * home = getenv (HOME_ENV);
+    if (home != NULL)
+      snprintf (dir, sizeof (dir), "%s/.allnet/log", home);
+    create_dir (dir, 0);
+    char path [PATH_MAX + sizeof (LOG_TRACE_FILE) + 1];
+    snprintf (path, sizeof (path), "%s/%s", dir, LOG_TRACE_FILE);
+    trace_fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (trace_fd < 0) {
+      perror ("open packet trace file");
+      printf ("unable to open %s, not tracing packets\n", path);
+      trace_one_in = 0;
+      trace_count = 0;
+      return;
+    }
+  }
+  /* with O_APPEND, each batch is written as a unit, even if several
+   * processes trace to the same file */
+  int size = trace_count * LOG_TRACE_RECORD_SIZE;
+  if (write (trace_fd, trace_buffer, size) != size)
+    perror ("write packet trace");
+  trace_count = 0;
+}
+
+static void trace_prepare_fork ()
+{
+  pthread_mutex_lock (&trace_mutex);
+}
+
+static void trace_parent_fork ()
+{
+  pthread_mutex_unlock (&trace_mutex);
+}
+
+static void trace_child_fork ()
+{
+  trace_count = 0;   /* the parent writes these */
+  pthread_mutex_unlock (&trace_mutex);
+}
+
+static void trace_flush_at_exit ()
+{
+  if (pthread_mutex_trylock (&trace_mutex) != 0)
+    return;   /* see flush_log */
+  trace_flush ();
+  pthread_mutex_unlock (&trace_mutex);
+}
+
+/* ALLNET_PACKET_TRACE is N or N:type,type,... */
+static void trace_init_once ()
+{
+  pthread_atfork (trace_prepare_fork, trace_parent_fork, trace_child_fork);
+  atexit (trace_flush_at_exit);
+  char * env = getenv ("ALLNET_PACKET_TRACE");
+  if (env == NULL)
+    return;
+  char * end = NULL;
+  long int one_in = strtol (env, &end, 10);
+  if ((end == env) || (one_in <= 0))
+    return;
+  unsigned int types = 0xffffffff;
+  if (*end == ':') {
+    types = 0;
+    while ((*end == ':') || (*end == ',')) {
+      char * start = end + 1;
+      long int type = strtol (start, &end, 10);
+      if ((end == start) || (type < 0) || (type >= 32))
+        break;
+      types |= (1U << type);
+    }
+  }
+  trace_one_in = (int) one_in;
+  trace_types = types;
+}
+
+void log_trace_config (int one_in, unsigned int type_mask)
+{
+  pthread_once (&trace_once, trace_init_once);
+  pthread_mutex_lock (&trace_mutex);
+  trace_flush ();
+  trace_one_in = ((one_in > 0) ? one_in : 0);
+  trace_types = type_mask;
+  pthread_mutex_unlock (&trace_mutex);
+}
+
+void log_packet_trace (int decision, const char * packet, int plen)
+{
+  pthread_once (&trace_once, trace_init_once);
+  int one_in = trace_one_in;
+  if ((one_in <= 0) || (packet == NULL) || (plen < (int) ALLNET_HEADER_SIZE))
+    return;
+  const struct allnet_header * hp = (const struct allnet_header *) packet;
+  if ((hp->message_type >= 32) ||
+      ((trace_types & (1U << hp->message_type)) == 0))
+    return;
+  if ((__atomic_fetch_add (&trace_counter, 1, __ATOMIC_RELAXED) %
+       (unsigned int) one_in) != 0)
+    return;
+  char record [LOG_TRACE_RECORD_SIZE];
+  memset (record, 0, sizeof (record));
+  record [0] = LOG_TRACE_FORMAT;
+  record [1] = decision;
+  writeb16 (record + 2, plen);
+  if (log_pid == 0)
+    log_pid = getpid ();
+  writeb32 (record + 4, log_pid);
+  unsigned long long int now = allnet_time_us ();
+  writeb64 (record + 8, now);
+  memcpy (record + 16, packet, 8);   /* the one-byte header fields */
+  memcpy (record + 24, hp->source, ADDRESS_SIZE);
+  memcpy (record + 32, hp->destination, ADDRESS_SIZE);
+  int hsize = ALLNET_SIZE (hp->transport);
+  const char * id = ALLNET_MESSAGE_ID (hp, hp->transport, plen);
+  if (id != NULL)
+    memcpy (record + 40, id, 8);
+  else if ((hp->message_type == ALLNET_TYPE_ACK) &&
+           (plen >= hsize + MESSAGE_ID_SIZE))
+    memcpy (record + 40, packet + hsize, 8);
+  pthread_mutex_lock (&trace_mutex);
+  if (trace_count == 0)
+    trace_first = now;
+  memcpy (trace_buffer + trace_count * LOG_TRACE_RECORD_SIZE, record,
+          LOG_TRACE_RECORD_SIZE);
+  trace_count++;
+  if ((trace_count >= LOG_TRACE_BATCH) ||
+      (now >= trace_first + ALLNET_ONE_SECOND_IN_US))
+    trace_flush ();
+  pthread_mutex_unlock (&trace_mutex);
+}
+
 /* log the error number for the given system call, followed by whatever
    is in the buffer */
 void log_error (struct allnet_log * log, const char * syscall)
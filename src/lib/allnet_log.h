@@ -33,6 +33,39 @@ extern void log_print_str (struct allnet_log * log,
 extern void log_packet (struct allnet_log * log,
                         const char * desc, const char * packet, int plen);
 
+/* binary packet traces, cheap enough to leave on in production.
+ * 1 in every one_in packets (0 to trace none, the default) whose message
+ * type has its bit (1 << message_type) set in type_mask is recorded in a
+ * LOG_TRACE_RECORD_SIZE-byte record, appended in batches to packets.trace
+ * in the log directory (~/.allnet/log/).  Tracing may also be turned on
+ * by setting the environment variable ALLNET_PACKET_TRACE to N (all
+ * types) or N:type,type,... before starting allnet.
+ * allnet-print-trace decodes the records, which have the format
+ *   record format        1 byte     byte  0      LOG_TRACE_FORMAT
+ *   decision             1 byte     byte  1      one of LOG_TRACE_*
+ *   packet size          2 bytes    bytes 2..3
+ *   process ID           4 bytes    bytes 4..7
+ *   time                 8 bytes    bytes 8..15  allnet microseconds
+ *   header fields        8 bytes    bytes 16..23 version, message_type,
+ *                                   hops, max_hops, src_nbits, dst_nbits,
+ *                                   sig_algo, transport
+ *   source               8 bytes    bytes 24..31
+ *   destination          8 bytes    bytes 32..39
+ *   ID prefix            8 bytes    bytes 40..47 message ID, or first ack
+ *                                   for acks, all zeros if neither
+ * All numbers are big-endian. */
+#define LOG_TRACE_RECORD_SIZE	48
+#define LOG_TRACE_FORMAT	1
+#define LOG_TRACE_DROP		0  /* the same as ad's PROCESS_PACKET_* */
+#define LOG_TRACE_LOCAL		1  /* forwarded only to local applications */
+#define LOG_TRACE_OUT		2  /* forwarded only to other allnets */
+#define LOG_TRACE_ALL		3  /* forwarded both locally and out */
+#define LOG_TRACE_INVALID	4  /* not a valid packet */
+#define LOG_TRACE_DECISIONS	5
+extern void log_trace_config (int one_in, unsigned int type_mask);
+/* record the decision on the packet, if it is selected for tracing */
+extern void log_packet_trace (int decision, const char * packet, int plen);
+
 /* log the error number for the given system call, followed by whatever
    is in the buffer */
 extern void log_error (struct allnet_log * log, const char * syscall);
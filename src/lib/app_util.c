@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
@@ -414,13 +415,9 @@ int local_receive (unsigned int timeout,
   *message = NULL;
   *priority = 0;
 #ifdef ALLNET_USE_FORK
-  static int keepalive_count = 0;   /* send a keepalive every 5 rcvd messages */
-  if (keepalive_count <= 0) {
-    local_send_keepalive (1);
-    keepalive_count = 5;
-  } else {               /* keepalive_count > 0 */
-    keepalive_count--;
-  }
+  /* the remaining time is counted down by the time spent in poll, rather
+   * than compared to a deadline, so changes to the clock do not matter */
+  long long int remaining = timeout;
   while (1) {
 /* if the clock changes, it's ok to try again, but only once or twice */
     static int timed_out_before = 0;
@@ -432,12 +429,8 @@ int local_receive (unsigned int timeout,
       return result;
     if (result < 0)           /* error */
       return -1;
-    usleep (1000);
-    if (timeout != SOCKETS_TIMEOUT_FOREVER) {
-      if (timeout == 0)
-        break;   /* timeout, this is normal */
-      timeout--;
-    }
+    if ((timeout != SOCKETS_TIMEOUT_FOREVER) && (remaining <= 0))
+      break;   /* timeout, this is normal */
     if (allnet_time () >= last_rcvd + 10 * KEEPALIVE_SECONDS) {
       if (timed_out_before < 2) {
         timed_out_before++;
@@ -447,6 +440,27 @@ int local_receive (unsigned int timeout,
         return -1;
       }
     }
+    /* wait for a message, the timeout, or the time for the next keepalive */
+    long long int start = (long long int) allnet_time_ms ();
+    long long int wait = (last_sent + (KEEPALIVE_SECONDS / 2)) * 1000 - start;
+    if (wait > KEEPALIVE_SECONDS * 1000)
+      wait = KEEPALIVE_SECONDS * 1000;
+    if (wait < 1)
+      wait = 1;
+    if ((timeout != SOCKETS_TIMEOUT_FOREVER) && (wait > remaining))
+      wait = remaining;
+    struct pollfd pfd;
+    pfd.fd = internal_sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if ((poll (&pfd, 1, (int) wait) < 0) && (errno != EINTR)) {
+      perror ("local_receive poll");
+      return -1;
+    }
+    long long int elapsed = (long long int) allnet_time_ms () - start;
+    if ((elapsed < 0) || (elapsed > wait))  /* the clock changed */
+      elapsed = wait;
+    remaining -= elapsed;
   }
 #endif /* ALLNET_USE_FORK */
   return 0;
@@ -8,6 +8,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define B64_X86
+#include <immintrin.h>
+#endif /* (__x86_64__ || __i386__) && __GNUC__ */
+
+#if defined (__aarch64__) && defined (__GNUC__)   /* NEON is always there */
+#define B64_ARM
+#include <arm_neon.h>
+#endif /* __aarch64__ && __GNUC__ */
 
 #include "wp_rsa.h"
 #include "wp_arith.h"
@@ -476,16 +487,246 @@ static int b64_encode_bits (int bits)
   return '/';
 }
 
+/* the vector code converts a block of 3n bytes to 4n characters, where
+ * n is 4 for SSSE3, and 16 for NEON (so a block is one line).  A block
+ * is only decoded if all its characters are in the base 64 alphabet,
+ * anything else (newlines, padding, errors) is left to the portable code.
+ * The block functions return 1 for success, and 0 if they cannot
+ * decode the block.  Each may read and write a full vector, i.e. up to
+ * 4n, bytes */
+typedef int (* b64_decode_block_fn) (const char * data, char * result);
+typedef void (* b64_encode_block_fn) (const char * data, char * result);
+
+struct b64_implementation {
+  int block_chars;   /* 4n, 0 if there is no vector code */
+  b64_decode_block_fn decode;
+  b64_encode_block_fn encode;
+};
+
+static const struct b64_implementation b64_portable = { 0, NULL, NULL };
+static struct b64_implementation b64_best = { 0, NULL, NULL };
+static int b64_use_vectors = 1;
+static pthread_once_t b64_once = PTHREAD_ONCE_INIT;
+
+#ifdef B64_X86
+__attribute__ ((target ("ssse3")))
+static int decode_block_ssse3 (const char * data, char * result)
+{
+  const __m128i lut_lo = _mm_setr_epi8 (0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                        0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8 (0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                        0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                        0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8 (0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8 (0x2f);
+  __m128i in = _mm_loadu_si128 ((const __m128i *) data);
+  /* each nibble selects the character classes it may be part of, and
+   * a character is valid if its two nibbles have no class in common */
+  __m128i hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (in, 4), mask_2f);
+  __m128i lo_nibbles = _mm_and_si128 (in, mask_2f);
+  __m128i hi = _mm_shuffle_epi8 (lut_hi, hi_nibbles);
+  __m128i lo = _mm_shuffle_epi8 (lut_lo, lo_nibbles);
+  if (_mm_movemask_epi8 (_mm_cmpgt_epi8 (_mm_and_si128 (lo, hi),
+                                         _mm_setzero_si128 ())) != 0)
+    return 0;
+  /* add the offset for the range of each character, to get 0..63 */
+  __m128i eq_2f = _mm_cmpeq_epi8 (in, mask_2f);
+  __m128i roll = _mm_shuffle_epi8 (lut_roll, _mm_add_epi8 (eq_2f, hi_nibbles));
+  __m128i v = _mm_add_epi8 (in, roll);
+  /* pack each 4 6-bit values into 3 bytes */
+  __m128i pairs = _mm_maddubs_epi16 (v, _mm_set1_epi32 (0x01400140));
+  __m128i words = _mm_madd_epi16 (pairs, _mm_set1_epi32 (0x00011000));
+  __m128i out = _mm_shuffle_epi8 (words,
+                                  _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                 14, 13, 12, -1, -1, -1, -1));
+  _mm_storeu_si128 ((__m128i *) result, out);
+  return 1;
+}
+
+__attribute__ ((target ("ssse3")))
+static void encode_block_ssse3 (const char * data, char * result)
+{
+  __m128i in = _mm_loadu_si128 ((const __m128i *) data);
+  /* copy each 3 bytes into a 32-bit word, then shift the 6-bit values
+   * into separate bytes */
+  in = _mm_shuffle_epi8 (in, _mm_set_epi8 (10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0 = _mm_and_si128 (in, _mm_set1_epi32 (0x0fc0fc00));
+  __m128i t1 = _mm_mulhi_epu16 (t0, _mm_set1_epi32 (0x04000040));
+  __m128i t2 = _mm_and_si128 (in, _mm_set1_epi32 (0x003f03f0));
+  __m128i t3 = _mm_mullo_epi16 (t2, _mm_set1_epi32 (0x01000010));
+  __m128i v = _mm_or_si128 (t1, t3);
+  /* add the offset of the range of each value: 0..25 are 'A'.., 26..51
+   * are 'a'.., 52..61 are '0'.., then '+' and '/' */
+  const __m128i offsets = _mm_setr_epi8 ('A', 'a' - 26, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '0' - 52,
+                                         '0' - 52, '0' - 52, '+' - 62,
+                                         '/' - 63, 0, 0);
+  __m128i range = _mm_subs_epu8 (v, _mm_set1_epi8 (51));
+  range = _mm_sub_epi8 (range, _mm_cmpgt_epi8 (v, _mm_set1_epi8 (25)));
+  __m128i out = _mm_add_epi8 (v, _mm_shuffle_epi8 (offsets, range));
+  _mm_storeu_si128 ((__m128i *) result, out);
+}
+#endif /* B64_X86 */
+
+#ifdef B64_ARM
+static const char b64_alphabet [] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static uint8x16x4_t b64_neon_alphabet;
+static uint8x16x4_t b64_neon_decode [2];   /* characters 0..63, 64..127 */
+
+static int decode_block_neon (const char * data, char * result)
+{
+  uint8x16x4_t in = vld4q_u8 ((const uint8_t *) data);
+  uint8x16_t bad = vdupq_n_u8 (0);
+  uint8x16x3_t out;
+  uint8x16_t v [4];
+  int i;
+  for (i = 0; i < 4; i++) {
+    uint8x16_t c = in.val [i];
+    v [i] = vqtbx4q_u8 (vqtbl4q_u8 (b64_neon_decode [0], c),
+                        b64_neon_decode [1], vsubq_u8 (c, vdupq_n_u8 (64)));
+    /* values above 63 are not base 64, nor are characters above 127 */
+    bad = vorrq_u8 (bad, vorrq_u8 (v [i], vandq_u8 (c, vdupq_n_u8 (0x80))));
+  }
+  if (vmaxvq_u8 (bad) > 63)
+    return 0;
+  out.val [0] = vorrq_u8 (vshlq_n_u8 (v [0], 2), vshrq_n_u8 (v [1], 4));
+  out.val [1] = vorrq_u8 (vshlq_n_u8 (v [1], 4), vshrq_n_u8 (v [2], 2));
+  out.val [2] = vorrq_u8 (vshlq_n_u8 (v [2], 6), v [3]);
+  vst3q_u8 ((uint8_t *) result, out);
+  return 1;
+}
+
+static void encode_block_neon (const char * data, char * result)
+{
+  uint8x16x3_t in = vld3q_u8 ((const uint8_t *) data);
+  uint8x16x4_t v;
+  v.val [0] = vshrq_n_u8 (in.val [0], 2);
+  v.val [1] = vorrq_u8 (vandq_u8 (vshlq_n_u8 (in.val [0], 4),
+                                  vdupq_n_u8 (0x30)),
+                        vshrq_n_u8 (in.val [1], 4));
+  v.val [2] = vorrq_u8 (vandq_u8 (vshlq_n_u8 (in.val [1], 2),
+                                  vdupq_n_u8 (0x3c)),
+                        vshrq_n_u8 (in.val [2], 6));
+  v.val [3] = vandq_u8 (in.val [2], vdupq_n_u8 (0x3f));
+  int i;
+  for (i = 0; i < 4; i++)
+    v.val [i] = vqtbl4q_u8 (b64_neon_alphabet, v.val [i]);
+  vst4q_u8 ((uint8_t *) result, v);
+}
+
+static void init_neon_tables ()
+{
+  uint8_t decode [128];
+  int i;
+  for (i = 0; i < 128; i++) {
+    int v = b64_next (i);
+    decode [i] = (v < B64_PADDING) ? v : 0xff;
+  }
+  for (i = 0; i < 4; i++) {
+    b64_neon_alphabet.val [i] =
+      vld1q_u8 ((const uint8_t *) b64_alphabet + 16 * i);
+    b64_neon_decode [0].val [i] = vld1q_u8 (decode + 16 * i);
+    b64_neon_decode [1].val [i] = vld1q_u8 (decode + 64 + 16 * i);
+  }
+}
+#endif /* B64_ARM */
+
+static int b64_decode_with (const struct b64_implementation * impl,
+                            const char * data, int dsize,
+                            char * result, int rsize);
+static int b64_encode_with (const struct b64_implementation * impl,
+                            char * buffer, int dsize, int bsize);
+
+/* returns 1 if impl gives the same results as the portable code */
+static int check_implementation (const struct b64_implementation * impl)
+{
+  /* enough data for several blocks and lines, and every final length */
+  char data [300];
+  char expected [500];
+  char result [500];
+  int i;
+  for (i = 0; i < (int) sizeof (data); i++)
+    data [i] = i * 53 + 7;
+  int n;
+  for (n = sizeof (data) - 3; n <= (int) sizeof (data); n++) {
+    memcpy (expected + sizeof (expected) - n, data, n);
+    memcpy (result + sizeof (result) - n, data, n);
+    int elen = b64_encode_with (&b64_portable, expected, n, sizeof (expected));
+    int rlen = b64_encode_with (impl, result, n, sizeof (result));
+    if ((elen != rlen) || (memcmp (expected, result, elen) != 0))
+      return 0;
+    rlen = b64_decode_with (impl, expected, elen, result, sizeof (result));
+    if ((rlen != n) || (memcmp (data, result, n) != 0))
+      return 0;
+  }
+  return 1;
+}
+
+static void b64_select_once ()
+{
+  struct b64_implementation best = b64_portable;
+#ifdef B64_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("ssse3")) {
+    best.block_chars = 16;
+    best.decode = decode_block_ssse3;
+    best.encode = encode_block_ssse3;
+  }
+#endif /* B64_X86 */
+#ifdef B64_ARM
+  init_neon_tables ();
+  best.block_chars = 64;
+  best.decode = decode_block_neon;
+  best.encode = encode_block_neon;
+#endif /* B64_ARM */
+  if ((best.block_chars > 0) && (check_implementation (&best)))
+    b64_best = best;
+}
+
+static const struct b64_implementation * b64_implementation ()
+{
+  pthread_once (&b64_once, b64_select_once);
+  if (b64_use_vectors)
+    return &b64_best;
+  return &b64_portable;
+}
+
+void b64_vectorized (int use)
+{
+  b64_use_vectors = use;
+}
+
 /* data and result may be the same buffer -- we only write to result
  * after reading from data */
 int b64_decode (const char * data, int dsize, char * result, int rsize)
 {
+  return b64_decode_with (b64_implementation (), data, dsize, result, rsize);
+}
+
+static int b64_decode_with (const struct b64_implementation * impl,
+                            const char * data, int dsize,
+                            char * result, int rsize)
+{
+  int block = impl->block_chars;
   int written = 0;
   int state = 0;
   int old_char = B64_IGNORE;
-  int i;
-  for (i = 0; (i < dsize) && (written < rsize); i++) {
-    int v = b64_next (data [i]);
+  int i = 0;
+  while ((i < dsize) && (written < rsize)) {
+    /* written <= i, so writing a block never overwrites unread data */
+    if ((block > 0) && (state == 0) &&
+        (i + block <= dsize) && (written + block <= rsize) &&
+        (impl->decode (data + i, result + written))) {
+      i += block;
+      written += block / 4 * 3;
+      continue;
+    }
+    int v = b64_next (data [i++]);
     if (v < B64_PADDING) {
       if (state == 0) {
         old_char = (v << 2);
@@ -518,8 +759,16 @@ int b64_decode (const char * data, int dsize, char * result, int rsize)
 }
 
 /* chars to encode are in  buffer [bsize - dsize].. buffer [bsize - 1] */
-static int b64_encode (char * buffer, int dsize, int bsize)
+int b64_encode (char * buffer, int dsize, int bsize)
+{
+  return b64_encode_with (b64_implementation (), buffer, dsize, bsize);
+}
+
+static int b64_encode_with (const struct b64_implementation * impl,
+                            char * buffer, int dsize, int bsize)
 {
+  int block = impl->block_chars;
+  int block_bytes = block / 4 * 3;
   /* 4 chars for every 3 bytes */
   /* a \n, and possibly a \r\n per 64 chars */
   /* up to 5 misc characters at the end: ==\r\n\0 */
@@ -536,6 +785,21 @@ static int b64_encode (char * buffer, int dsize, int bsize)
   int wline = 0;
   int i;
   for (i = 0; (i < dsize) && (written < bsize); i++) {
+    /* a block must fit in the line, and in the space before any unread
+     * data.  The vector code reads 4n bytes, of which 3n are used */
+    while ((block > 0) && (i % 3 == 0) && (wline + block <= 64) &&
+           (i + block <= dsize) && (written + block <= space + i)) {
+      impl->encode (from + i, buffer + written);
+      written += block;
+      wline += block;
+      i += block_bytes;
+      if (wline >= 64) {
+        buffer [written++] = '\n';
+        wline = 0;
+      }
+    }
+    if (i >= dsize)
+      break;
     int bits = -1;
     if (i % 3 == 0) {
       bits = (from [i] >> 2) & 0x3f;
@@ -0,0 +1,147 @@
+/* b64_bench.c: check and time the base 64 encoding and decoding in asn1.c */
+/* command line:
+   b64_bench [-n megabytes]
+     -n the number of megabytes to encode and decode (default 100)
+   the vector code is compared to the portable code for all sizes up to
+   a few hundred bytes, and for random strings with characters that are
+   not base 64.  Any difference is printed, and then the exit status is 1.
+   Then both are timed on the same random data, printing megabytes per
+   second for encoding, and for decoding the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wp_rsa.h"
+#include "util.h"
+
+static unsigned long long int now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* encodes data in a new buffer, returns the encoded size */
+static int encode (const char * data, int dsize, char * buffer, int bsize)
+{
+  memcpy (buffer + bsize - dsize, data, dsize);
+  return b64_encode (buffer, dsize, bsize);
+}
+
+/* returns the number of mismatches */
+static int compare (int count)
+{
+  static const char chars [] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  static const char ignored [] = "\n\r- \x80\xff";
+  int errors = 0;
+  char data [1000];
+  char vector [2000];
+  char portable [2000];
+  int i;
+  for (i = 0; i < (int) sizeof (data); i++)
+    data [i] = (char) random_int (0, 255);
+  int n;
+  for (n = 0; n <= (int) sizeof (data); n++) {
+    b64_vectorized (1);
+    int vsize = encode (data, n, vector, sizeof (vector));
+    b64_vectorized (0);
+    int psize = encode (data, n, portable, sizeof (portable));
+    if ((vsize != psize) || (memcmp (vector, portable, psize) != 0)) {
+      printf ("encoding mismatch for %d bytes: %d, portable %d\n",
+              n, vsize, psize);
+      errors++;
+    }
+    b64_vectorized (1);
+    int vdecoded = b64_decode (portable, psize, vector, sizeof (vector));
+    if ((vdecoded != n) || (memcmp (vector, data, n) != 0)) {
+      printf ("decoding mismatch for %d bytes: %d\n", n, vdecoded);
+      errors++;
+    }
+  }
+  /* the decoders must agree on base 64 with other characters mixed in,
+   * such as newlines at the end of lines of random length */
+  for (i = 0; i < count; i++) {
+    int line = (int) random_int (1, 100);
+    int mixed = (random_int (0, 1) == 0);
+    int size = 0;
+    int nchars = ((int) random_int (1, sizeof (data) / 8)) * 4;
+    int j;
+    for (j = 0; j < nchars; j++) {
+      data [size++] = chars [random_int (0, sizeof (chars) - 2)];
+      if ((mixed && (random_int (0, 9) == 0)) || ((j % line) == line - 1))
+        data [size++] = ignored [random_int (0, sizeof (ignored) - 2)];
+    }
+    b64_vectorized (1);
+    int vsize = b64_decode (data, size, vector, sizeof (vector));
+    b64_vectorized (0);
+    int psize = b64_decode (data, size, portable, sizeof (portable));
+    if ((vsize != psize) || (memcmp (vector, portable, psize) != 0)) {
+      printf ("decoding mismatch for %d characters: %d, portable %d\n",
+              size, vsize, psize);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+/* sets the nanoseconds taken to encode and to decode data rounds times */
+static void time_b64 (int vectorized, const char * data, int dsize,
+                      char * buffer, int bsize, int rounds,
+                      unsigned long long int * encode_ns,
+                      unsigned long long int * decode_ns)
+{
+  b64_vectorized (vectorized);
+  *encode_ns = 0;
+  *decode_ns = 0;
+  int i;
+  for (i = 0; i < rounds; i++) {
+    memcpy (buffer + bsize - dsize, data, dsize);
+    unsigned long long int start = now_ns ();
+    int esize = b64_encode (buffer, dsize, bsize);
+    unsigned long long int middle = now_ns ();
+    int decoded = b64_decode (buffer, esize, buffer, bsize);
+    *encode_ns += middle - start;
+    *decode_ns += now_ns () - middle;
+    if ((decoded != dsize) || (memcmp (buffer, data, dsize) != 0)) {
+      printf ("error: %d bytes decoded to %d\n", dsize, decoded);
+      break;
+    }
+  }
+}
+
+int main (int argc, char ** argv)
+{
+  int megabytes = 100;
+  if ((argc == 3) && (strcmp (argv [1], "-n") == 0) && (atoi (argv [2]) > 0))
+    megabytes = atoi (argv [2]);
+  else if (argc != 1) {
+    printf ("usage: %s [-n megabytes]\n", argv [0]);
+    return 1;
+  }
+  int errors = compare (100000);
+  printf ("%d mismatches\n", errors);
+
+  int dsize = 1024 * 1024;
+  int bsize = dsize * 2;
+  char * data = malloc_or_fail (dsize, "b64_bench data");
+  char * buffer = malloc_or_fail (bsize, "b64_bench buffer");
+  random_bytes (data, dsize);
+  unsigned long long int encode_ns [2];
+  unsigned long long int decode_ns [2];
+  int v;
+  for (v = 0; v <= 1; v++)
+    time_b64 (v, data, dsize, buffer, bsize, megabytes,
+              encode_ns + v, decode_ns + v);
+  double mb = (double) megabytes;
+  printf ("vector   encode %8.1fMB/s, decode %8.1fMB/s\n",
+          mb * 1e9 / encode_ns [1], mb * 1e9 / decode_ns [1]);
+  printf ("portable encode %8.1fMB/s, decode %8.1fMB/s\n",
+          mb * 1e9 / encode_ns [0], mb * 1e9 / decode_ns [0]);
+  free (data);
+  free (buffer);
+  return (errors == 0) ? 0 : 1;
+}
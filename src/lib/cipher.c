@@ -5,25 +5,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "crypt_sel.h"
+#include "wp_aes.h"
 
 #include "packet.h"
 #include "util.h"
 #include "sha.h"
 #include "keys.h"
 #include "cipher.h"
-
-static void inc_ctr (char * ctr)
-{
-  int i;
-  int carry = 1;  /* initially add 1 */
-  for (i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
-    int value = (ctr [i] & 0xff) + carry;
-    ctr [i] = value % 256;
-    carry = value / 256;
-  }
-}
+#include "probes.h"
 
 /* for CTR mode, encryption and decryption are identical */
 static void aes_ctr_crypt (char * key, char * ctr,
@@ -37,18 +30,12 @@ static void aes_ctr_crypt (char * key, char * ctr,
                                ctr [2] & 0xff, ctr [3] & 0xff);
   printf ("data %p, dsize = %d)\n", data, dsize);
 */
-  char in [AES_BLOCK_SIZE];
+  char in [AES_BLOCK_SIZE];   /* the caller's ctr is not modified */
   memcpy (in, ctr, AES_BLOCK_SIZE);
-  char out [AES_BLOCK_SIZE] = { 0, };
-  int i;
-  for (i = 0; i < dsize; i++) {
-    if ((i % AES_BLOCK_SIZE) == 0) {   /* compute the next block */
-      if (! allnet_aes_encrypt_block (key, in, out))
-        exit (1);
-      inc_ctr (in);
-    }
-    result [i] = data [i] ^ out [i % AES_BLOCK_SIZE];
-  }
+  struct wp_aes_key expanded;   /* expand the key once for all the blocks */
+  wp_aes_set_key (AES256_SIZE, key, &expanded);
+  /* encrypts several counter blocks at a time */
+  wp_aes_ctr_crypt (&expanded, in, data, dsize, result);
 #ifdef DEBUG_PRINT
   printf ("AES encryption complete\n");
 #endif /* DEBUG_PRINT */
@@ -245,6 +232,113 @@ int allnet_verify (const char * text, int tsize, const char * sig, int ssize,
   return verifies;
 }
 
+#ifndef ALLNET_VERIFY_THREADS
+#define ALLNET_VERIFY_THREADS	4	/* including the caller's thread */
+#endif /* ALLNET_VERIFY_THREADS */
+/* starting a thread costs about as much as a fraction of a verification,
+ * so fewer requests are verified in the caller's thread only */
+#define ALLNET_VERIFY_THREAD_MIN	2
+
+struct verify_batch {
+  struct allnet_verify_request * requests;
+  int count;
+  char (* hashes) [SHA512_SIZE];
+  int next;                /* the next request to verify */
+  pthread_mutex_t mutex;
+};
+
+static void * verify_batch_thread (void * arg)
+{
+  struct verify_batch * b = (struct verify_batch *) arg;
+  while (1) {
+    pthread_mutex_lock (&(b->mutex));
+    int i = b->next++;
+    pthread_mutex_unlock (&(b->mutex));
+    if (i >= b->count)
+      break;
+    struct allnet_verify_request * r = b->requests + i;
+    if (r->verified < 0)   /* invalid request, not hashed */
+      r->verified = 0;
+    else
+      r->verified = allnet_rsa_verify (r->key, b->hashes [i], r->verified,
+                                       r->sig, r->ssize);
+  }
+  return NULL;
+}
+
+/* verifies each of the requests, setting each request's verified to
+ * 1 if it verifies, 0 otherwise.  The hashes are computed together, and
+ * the public key operations are spread over up to ALLNET_VERIFY_THREADS
+ * threads.  The moduli of the keys are contexts shared by all the
+ * threads (see cached_r_squared in wp_arith.c).
+ * returns the number of requests that verify */
+int allnet_verify_batch (struct allnet_verify_request * requests, int count)
+{
+  if ((requests == NULL) || (count <= 0))
+    return 0;
+  char (* hashes) [SHA512_SIZE] =
+    malloc_or_fail (count * SHA512_SIZE, "allnet_verify_batch hashes");
+  const char ** data = malloc_or_fail (count * sizeof (char *),
+                                       "allnet_verify_batch data");
+  int * dsize = malloc_or_fail (count * sizeof (int),
+                                "allnet_verify_batch dsize");
+  char ** results = malloc_or_fail (count * sizeof (char *),
+                                    "allnet_verify_batch results");
+  int nhash = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    struct allnet_verify_request * r = requests + i;
+    r->verified = -1;   /* until hashed, then holds the hash size */
+    if ((r->text == NULL) || (r->sig == NULL) || (r->tsize < 0) ||
+        (r->ssize <= 0))
+      continue;
+    int rsa_size = allnet_rsa_pubkey_size (r->key);
+    debug_public_key_size (r->text, r->tsize, r->sig, r->ssize, rsa_size);
+    if (rsa_size > r->ssize)
+      continue;
+    int hsize = rsa_size - 42;  /* PKCS #1 v2 requires 42 bytes */
+    if (hsize > SHA512_SIZE)
+      hsize = SHA512_SIZE;
+    r->verified = hsize;
+    data [nhash] = r->text;
+    dsize [nhash] = r->tsize;
+    results [nhash] = hashes [i];
+    nhash++;
+  }
+  /* hsize is at most SHA512_SIZE, and shorter hashes are prefixes */
+  sha512_bytes_batch (nhash, data, dsize, results, SHA512_SIZE);
+  free (data);
+  free (dsize);
+  free (results);
+  struct verify_batch b = { .requests = requests, .count = count,
+                            .hashes = hashes, .next = 0 };
+  pthread_mutex_init (&(b.mutex), NULL);
+  pthread_t threads [ALLNET_VERIFY_THREADS];
+  int nthreads = 0;
+  long int ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (count >= ALLNET_VERIFY_THREAD_MIN) {
+    int wanted = ((count < ALLNET_VERIFY_THREADS) ? count
+                                                  : ALLNET_VERIFY_THREADS);
+    if ((ncpus > 0) && (wanted > ncpus))
+      wanted = (int) ncpus;   /* more threads than processors do not help */
+    while (nthreads + 1 < wanted) {
+      if (pthread_create (threads + nthreads, NULL, verify_batch_thread, &b))
+        break;   /* not fatal, verify in fewer threads */
+      nthreads++;
+    }
+  }
+  verify_batch_thread (&b);
+  for (i = 0; i < nthreads; i++)
+    pthread_join (threads [i], NULL);
+  pthread_mutex_destroy (&(b.mutex));
+  free (hashes);
+  int result = 0;
+  for (i = 0; i < count; i++)
+    if (requests [i].verified)
+      result++;
+  return result;
+}
+
 /* returns the size of the signature and mallocs the signature into result */
 int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
                  char ** result)
@@ -273,41 +367,204 @@ int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
   return rsa_size;
 }
 
-static char ** deep_copy (char ** original, int n)
+/* decrypt_verify would otherwise have to get every keyset of every
+ * contact, with its addresses, for every packet.  Instead it keeps an
+ * index of the keysets of all the individual contacts, rebuilt whenever
+ * keys_generation changes.  Keysets are grouped by the first byte of their
+ * local address, so for packets with at least 8 destination bits, only the
+ * keysets in that group and those with fewer than 8 local address bits
+ * need to be considered, and only those whose addresses match the packet
+ * are tried with the (much slower) public-key or symmetric cryptography */
+#define DV_BUCKETS	256
+
+struct dv_keyset {
+  int contact;                   /* index in dv_contacts */
+  keyset k;
+  int lbits;
+  unsigned char local [ADDRESS_SIZE];
+  int rbits;
+  unsigned char remote [ADDRESS_SIZE];
+};
+
+static int dv_built = 0;
+static unsigned long long int dv_generation = 0;
+static char ** dv_contacts = NULL;
+static int dv_ncontacts = 0;
+static struct dv_keyset * dv_keysets = NULL;  /* in contact order */
+static int dv_nkeysets = 0;
+/* indices in dv_keysets of keysets with lbits >= 8, by their first byte */
+static int * dv_by_bucket = NULL;
+static int dv_bucket_start [DV_BUCKETS + 1];
+/* indices of keysets with lbits < 8, which may match any destination */
+static int * dv_short = NULL;
+static int dv_nshort = 0;
+static pthread_mutex_t dv_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with dv_mutex held */
+static void dv_build_index ()
 {
-  size_t needed = 0;
-  int i;
-  for (i = 0; i < n; i++)
-    needed += strlen (original [i]) + 1 + sizeof (char *);
-  char ** result = malloc_or_fail (needed, "cipher.c deep_copy");
-  char * strings = (char *) (&(result [n]));
-  ssize_t str_size = minzs (needed, (strings - (char *) result));
-  for (i = 0; i < n; i++) {
-    result [i] = strings;
-    strncpy (result [i], original [i], str_size);
-    strings += strlen (original [i]) + 1;
-    str_size = minzs (str_size, strlen (original [i]) + 1);
+  if (dv_contacts != NULL)
+    free (dv_contacts);
+  if (dv_keysets != NULL)
+    free (dv_keysets);
+  if (dv_by_bucket != NULL)
+    free (dv_by_bucket);
+  if (dv_short != NULL)
+    free (dv_short);
+  dv_generation = keys_generation ();
+  dv_contacts = NULL;
+  dv_ncontacts = all_individual_contacts (&dv_contacts);
+  int max_keysets = dv_ncontacts + 1;
+  dv_keysets = malloc_or_fail (sizeof (struct dv_keyset) * max_keysets,
+                               "dv_build_index keysets");
+  dv_nkeysets = 0;
+  int i, j;
+  for (i = 0; i < dv_ncontacts; i++) {
+    keyset * keys = NULL;
+    int nkeys = all_keys (dv_contacts [i], &keys);
+    if (dv_nkeysets + nkeys > max_keysets) {
+      max_keysets = 2 * (dv_nkeysets + nkeys);
+      dv_keysets = realloc (dv_keysets,
+                            sizeof (struct dv_keyset) * max_keysets);
+      if (dv_keysets == NULL) {   /* very unlikely */
+        printf ("dv_build_index: unable to allocate %d keysets\n",
+                max_keysets);
+        exit (1);
+      }
+    }
+    for (j = 0; j < nkeys; j++) {
+      struct dv_keyset * d = dv_keysets + dv_nkeysets;
+      d->contact = i;
+      d->k = keys [j];
+      d->lbits = get_local (keys [j], d->local);
+      d->rbits = get_remote (keys [j], d->remote);
+      dv_nkeysets++;
+    }
+    if ((nkeys > 0) && (keys != NULL))
+      free (keys);
   }
-  return result;
+  /* counting sort by the first byte of the local address, keeping order */
+  dv_by_bucket = malloc_or_fail (sizeof (int) * (dv_nkeysets + 1),
+                                 "dv_build_index buckets");
+  dv_short = malloc_or_fail (sizeof (int) * (dv_nkeysets + 1),
+                             "dv_build_index short");
+  dv_nshort = 0;
+  int count [DV_BUCKETS];
+  memset (count, 0, sizeof (count));
+  for (i = 0; i < dv_nkeysets; i++)
+    if (dv_keysets [i].lbits >= 8)
+      count [dv_keysets [i].local [0]]++;
+  dv_bucket_start [0] = 0;
+  for (i = 0; i < DV_BUCKETS; i++)
+    dv_bucket_start [i + 1] = dv_bucket_start [i] + count [i];
+  memset (count, 0, sizeof (count));
+  for (i = 0; i < dv_nkeysets; i++) {
+    if (dv_keysets [i].lbits >= 8) {
+      int b = dv_keysets [i].local [0];
+      dv_by_bucket [dv_bucket_start [b] + count [b]] = i;
+      count [b]++;
+    } else {
+      dv_short [dv_nshort++] = i;
+    }
+  }
+  dv_built = 1;
 }
 
-/* deep copy everything, then permute so a random subset is at the front */
-static char ** randomize_contacts (char ** original, int n, int max)
+struct dv_candidate {
+  char * contact;                /* malloc'd */
+  int contact_index;
+  keyset k;
+};
+
+/* must be called with dv_mutex held.  Adds keyset i if it matches */
+static void dv_add_candidate (int i, const int * allowed,
+                              const char * sender, int sbits,
+                              const char * dest, int dbits,
+                              struct dv_candidate * result, int * count)
 {
-  char ** result = deep_copy (original, n);
-  int * permutation = random_permute (n);
-  char ** copy = malloc_or_fail (sizeof (char *) * max, "cipher.c randomize");
-  int i;
-  for (i = 0; i < max; i++)  /* save the contact pointers we will try */
-    copy [i] = result [permutation [i]];
-  free (permutation);
-  /* now save the pointers back in result */
-  for (i = 0; i < max; i++)
-    result [i] = copy [i];
-  free (copy);
-  return result;
+  struct dv_keyset * d = dv_keysets + i;
+  if ((allowed != NULL) && (! allowed [d->contact]))
+    return;
+  /* if lbits or dbits is zero, we verify */
+  if ((dest != NULL) && (dbits > 0) && (d->lbits > 0) &&
+      (matches ((unsigned char *) dest, dbits, d->local, d->lbits) <= 0))
+    return;
+  if ((sender != NULL) && (sbits > 0) && (d->rbits > 0) &&
+      (matches ((unsigned char *) sender, sbits, d->remote, d->rbits) <= 0))
+    return;
+  result [*count].contact =
+    strcpy_malloc (dv_contacts [d->contact], "dv_add_candidate");
+  result [*count].contact_index = d->contact;
+  result [*count].k = d->k;
+  (*count)++;
+}
+
+/* returns the number of keysets whose addresses match the packet, in the
+ * order they should be tried, and in that case malloc's *candidates.
+ * If maxcontacts > 0, only considers a random subset of maxcontacts
+ * contacts */
+static int dv_candidates (const char * sender, int sbits,
+                          const char * dest, int dbits, int maxcontacts,
+                          struct dv_candidate ** candidates)
+{
+  *candidates = NULL;
+  pthread_mutex_lock (&dv_mutex);
+  if ((! dv_built) || (dv_generation != keys_generation ()))
+    dv_build_index ();
+  int * allowed = NULL;
+  if ((maxcontacts > 0) && (maxcontacts < dv_ncontacts)) {
+    allowed = malloc_or_fail (sizeof (int) * dv_ncontacts, "dv allowed");
+    int * permutation = random_permute (dv_ncontacts);
+    int i;
+    for (i = 0; i < dv_ncontacts; i++)
+      allowed [permutation [i]] = (i < maxcontacts);
+    free (permutation);
+  }
+  struct dv_candidate * result =
+    malloc_or_fail (sizeof (struct dv_candidate) * (dv_nkeysets + 1),
+                    "dv_candidates");
+  int count = 0;
+  if ((dest != NULL) && (dbits >= 8)) {
+    /* merge the bucket with the short addresses, keeping the order */
+    int b = ((unsigned char *) dest) [0];
+    int bi = dv_bucket_start [b];
+    int si = 0;
+    while ((bi < dv_bucket_start [b + 1]) || (si < dv_nshort)) {
+      int i;
+      if ((si >= dv_nshort) ||
+          ((bi < dv_bucket_start [b + 1]) &&
+           (dv_by_bucket [bi] < dv_short [si])))
+        i = dv_by_bucket [bi++];
+      else
+        i = dv_short [si++];
+      dv_add_candidate (i, allowed, sender, sbits, dest, dbits,
+                        result, &count);
+    }
+  } else {
+    int i;
+    for (i = 0; i < dv_nkeysets; i++)
+      dv_add_candidate (i, allowed, sender, sbits, dest, dbits,
+                        result, &count);
+  }
+  pthread_mutex_unlock (&dv_mutex);
+  if (allowed != NULL)
+    free (allowed);
+  if (count == 0) {
+    free (result);
+    return 0;
+  }
+  *candidates = result;
+  return count;
 }
 
+static void free_candidates (struct dv_candidate * candidates, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    free (candidates [i].contact);
+  if (candidates != NULL)
+    free (candidates);
+}
 
 /* returns the data size > 0, and malloc's and fills in the contact, if able
  * to decrypt and verify the packet.
@@ -320,10 +577,10 @@ static char ** randomize_contacts (char ** original, int n, int max)
  *
  * if maxcontacts > 0, only tries to match up to maxcontacts
  */
-int decrypt_verify (int sig_algo, char * encrypted, int esize,
-                    char ** contact, keyset * kset, char ** text,
-                    char * sender, int sbits, char * dest, int dbits,
-                    int maxcontacts)
+static int decrypt_verify_any (int sig_algo, char * encrypted, int esize,
+                               char ** contact, keyset * kset, char ** text,
+                               char * sender, int sbits, char * dest,
+                               int dbits, int maxcontacts)
 {
 #ifdef DEBUG_PRINT
   unsigned long long int start = allnet_time_us ();
@@ -338,119 +595,94 @@ int decrypt_verify (int sig_algo, char * encrypted, int esize,
     return 0;
   int csize = esize - ssize;  /* size of ciphertext to decrypt */
   char * sig = encrypted + csize;  /* only used if ssize != 0 */
-  int i, j;
   int count = 0;
   int decrypt_count = 0;
-  char ** contacts = NULL;
-  int ncontacts = all_individual_contacts (&contacts);
-  if ((maxcontacts > 0) && (maxcontacts < ncontacts)) {
-    contacts = randomize_contacts (contacts, ncontacts, maxcontacts);
-    ncontacts = maxcontacts;
-  }
-  for (i = 0; ((*contact == NULL) && (i < ncontacts)); i++) {
-    keyset * keys = NULL;
-    int nkeys = all_keys (contacts [i], &keys);
-    for (j = 0; ((*contact == NULL) && (j < nkeys)); j++) {
-      int do_decrypt = 1;  /* for now, try to decrypt unsigned messages */
-      if ((dest != NULL) && (dbits > 0)) {
-        char laddr [ADDRESS_SIZE];
-        int lbits = get_local (keys [j], (unsigned char *)laddr);
-        if ((lbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) dest, dbits,
-                      (unsigned char *) laddr, lbits) <= 0))
-          do_decrypt = 0;
-      }
-      if ((sender != NULL) && (sbits > 0)) {
-        char raddr [ADDRESS_SIZE];
-        int rbits = get_remote (keys [j], (unsigned char *)raddr);
-        if ((rbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) sender, sbits,
-                      (unsigned char *) raddr, rbits) <= 0))
-          do_decrypt = 0;
+  struct dv_candidate * cands = NULL;
+  int ncands = dv_candidates (sender, sbits, dest, dbits, maxcontacts, &cands);
+  int sym_tried = -1;   /* the symmetric key is the same for every keyset */
+  int i;
+  for (i = 0; i < ncands; i++) {
+    const char * cname = cands [i].contact;
+    keyset k = cands [i].k;
+    int do_decrypt = 1;  /* for now, try to decrypt unsigned messages */
+    if (sig_algo != ALLNET_SIGTYPE_NONE) {
+      /* verify signature */
+      do_decrypt = 0;
+      allnet_rsa_pubkey pub_key;
+      if (get_contact_pubkey (k, &pub_key)) {
+        do_decrypt = allnet_verify (encrypted, csize, sig, ssize - 2, pub_key);
+        count++;
       }
-      if (do_decrypt) {
-        if (sig_algo != ALLNET_SIGTYPE_NONE) {
-          /* verify signature */
-          do_decrypt = 0;
-          allnet_rsa_pubkey pub_key;
-          if (get_contact_pubkey (keys [j], &pub_key)) {
-            do_decrypt =
-              allnet_verify (encrypted, csize, sig, ssize - 2, pub_key);
-            count++;
-          }
-        } else {  /* should have a symmetric key */
-          char sym_key [ALLNET_STREAM_KEY_SIZE];
-          int sksize =
-            has_symmetric_key (contacts [i], sym_key, sizeof (sym_key));
-          if (sksize >= ALLNET_STREAM_KEY_SIZE) { /* valid symmetric key */
-            struct allnet_stream_encryption_state sym_state;
-            if (! symmetric_key_state (contacts [i], 0, &sym_state)) {
-              char secret [ALLNET_STREAM_SECRET_SIZE];
-              /* sender must have computed the secret in the same way */
-              sha512_bytes (sym_key, ALLNET_STREAM_KEY_SIZE,
-                            secret, ALLNET_STREAM_SECRET_SIZE);
-              allnet_stream_init (&sym_state, sym_key, 0, secret, 0, 8, 32);
-            }
-            int tsize = esize - sym_state.counter_size - sym_state.hash_size; 
-            char result [ALLNET_MTU];
-            if ((tsize <= sizeof (result)) && 
-                (allnet_stream_decrypt_buffer (&sym_state, encrypted, esize,
-                                               result, tsize))) {
-              *contact = strcpy_malloc (contacts [i], "sym dv contact");
-              *kset = keys [j];
-              free (keys);
-              free (contacts);
-              *text = memcpy_malloc (result, tsize, "sym dv message");
-              return tsize;
-            }
-            /* much faster, do not count as a decryption: decrypt_count++; */
-          }
-          do_decrypt = 0;   /* no signature, and decryption failed */
+    } else if (sym_tried != cands [i].contact_index) {
+      /* should have a symmetric key */
+      sym_tried = cands [i].contact_index;
+      char sym_key [ALLNET_STREAM_KEY_SIZE];
+      int sksize = has_symmetric_key (cname, sym_key, sizeof (sym_key));
+      if (sksize >= ALLNET_STREAM_KEY_SIZE) { /* valid symmetric key */
+        struct allnet_stream_encryption_state sym_state;
+        if (! symmetric_key_state (cname, 0, &sym_state)) {
+          char secret [ALLNET_STREAM_SECRET_SIZE];
+          /* sender must have computed the secret in the same way */
+          sha512_bytes (sym_key, ALLNET_STREAM_KEY_SIZE,
+                        secret, ALLNET_STREAM_SECRET_SIZE);
+          allnet_stream_init (&sym_state, sym_key, 0, secret, 0, 8, 32);
+        }
+        int tsize = esize - sym_state.counter_size - sym_state.hash_size; 
+        char result [ALLNET_MTU];
+        if ((tsize <= sizeof (result)) && 
+            (allnet_stream_decrypt_buffer (&sym_state, encrypted, esize,
+                                           result, tsize))) {
+          *contact = strcpy_malloc (cname, "sym dv contact");
+          *kset = k;
+          free_candidates (cands, ncands);
+          *text = memcpy_malloc (result, tsize, "sym dv message");
+          return tsize;
         }
+        /* much faster, do not count as a decryption: decrypt_count++; */
       }
+      do_decrypt = 0;   /* no signature, and decryption failed */
+    } else {
+      do_decrypt = 0;   /* already failed with this contact's symmetric key */
+    }
 #ifdef DEBUG_PRINT
-      unsigned long long int time_ver = allnet_time_us () - start;
+    unsigned long long int time_ver = allnet_time_us () - start;
 #endif /* DEBUG_PRINT */
-      if (do_decrypt) {
+    if (do_decrypt) {
 #ifdef DEBUG_PRINT
-        printf ("signature match for contact %s, key %d\n", contacts [i], j);
+      printf ("signature match for contact %s, key %d\n", cname, k);
 #endif /* DEBUG_PRINT */
-        allnet_rsa_prvkey prv_key;
-        int priv_ksize = get_my_privkey (keys [j], &prv_key);
-        int res = 0;
-        if (priv_ksize > 0) {
-          res = allnet_decrypt (encrypted, csize, prv_key, text);
-          decrypt_count++;
-        }
-        if (res) {
-          *contact = strcpy_malloc (contacts [i], "verify contact");
-          *kset = keys [j];
+      allnet_rsa_prvkey prv_key;
+      int priv_ksize = get_my_privkey (k, &prv_key);
+      int res = 0;
+      if (priv_ksize > 0) {
+        res = allnet_decrypt (encrypted, csize, prv_key, text);
+        decrypt_count++;
+      }
+      if (res) {
+        *contact = strcpy_malloc (cname, "verify contact");
+        *kset = k;
 #ifdef DEBUG_PRINT
-          unsigned long long int time_delta = allnet_time_us () - start;
-          printf ("%ssuccess: %d ver (%lld.%06lld s) + %d dec ",
-                  (sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ", count,
-                  time_ver / 1000000, time_ver % 1000000, decrypt_count);
-          printf ("%lld.%06lld seconds\n",
-                  time_delta / 1000000, time_delta % 1000000);
+        unsigned long long int time_delta = allnet_time_us () - start;
+        printf ("%ssuccess: %d ver (%lld.%06lld s) + %d dec ",
+                (sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ", count,
+                time_ver / 1000000, time_ver % 1000000, decrypt_count);
+        printf ("%lld.%06lld seconds\n",
+                time_delta / 1000000, time_delta % 1000000);
 #endif /* DEBUG_PRINT */
-          free (keys);
-          free (contacts);
-          if (sig_algo != ALLNET_SIGTYPE_NONE)
-            return res;
-          else
-            return -res;
-        } else if (sig_algo != ALLNET_SIGTYPE_NONE) {
-          printf ("signed (%d) msg from %s key %d/%d"
-                  " verifies but does not decrypt\n",
-                  sig_algo, contacts [i], j, priv_ksize);
-          print_buffer (encrypted, esize, NULL, 16, 1);
-        }
+        free_candidates (cands, ncands);
+        if (sig_algo != ALLNET_SIGTYPE_NONE)
+          return res;
+        else
+          return -res;
+      } else if (sig_algo != ALLNET_SIGTYPE_NONE) {
+        printf ("signed (%d) msg from %s key %d/%d"
+                " verifies but does not decrypt\n",
+                sig_algo, cname, k, priv_ksize);
+        print_buffer (encrypted, esize, NULL, 16, 1);
       }
     }
-    if ((nkeys > 0) && (keys != NULL))
-      free (keys);
   }
-  if (contacts != NULL) free (contacts);
+  free_candidates (cands, ncands);
 #ifdef DEBUG_PRINT
   printf ("unable to decrypt packet, dropping\n");
   unsigned long long int time_delta = allnet_time_us () - start;
@@ -460,3 +692,16 @@ int decrypt_verify (int sig_algo, char * encrypted, int esize,
 #endif /* DEBUG_PRINT */
   return 0;
 }
+
+int decrypt_verify (int sig_algo, char * encrypted, int esize,
+                    char ** contact, keyset * kset, char ** text,
+                    char * sender, int sbits, char * dest, int dbits,
+                    int maxcontacts)
+{
+  ALLNET_PROBE2 (decrypt_verify_start, esize, sig_algo);
+  int result = decrypt_verify_any (sig_algo, encrypted, esize, contact, kset,
+                                   text, sender, sbits, dest, dbits,
+                                   maxcontacts);
+  ALLNET_PROBE2 (decrypt_verify_done, esize, result);
+  return result;
+}
@@ -28,6 +28,23 @@ extern int allnet_decrypt (const char * cipher, int csize,
 extern int allnet_verify (const char * text, int tsize, const char * sig,
                           int ssize, allnet_rsa_pubkey key);
 
+/* for verifying many signatures at once, e.g. one message that may be
+ * signed by any of several keys */
+struct allnet_verify_request {
+  const char * text;
+  int tsize;
+  const char * sig;
+  int ssize;
+  allnet_rsa_pubkey key;
+  int verified;          /* set by allnet_verify_batch */
+};
+
+/* same as setting requests [i].verified = allnet_verify (...) for
+ * 0 <= i < count, but may verify several in parallel.
+ * returns the number of requests that verify */
+extern int allnet_verify_batch (struct allnet_verify_request * requests,
+                                int count);
+
 /* returns the size of the signature and mallocs the signature into result */
 extern int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
                         char ** result);
@@ -0,0 +1,176 @@
+/* compress.c: LZ4-compatible block compression and decompression */
+
+#include <string.h>
+
+#include "compress.h"
+
+/* each sequence is a token, literals, and a match.  The high 4 bits of the
+ * token are the number of literals, the low 4 bits the match length - 4.
+ * A value of 15 in either is followed by bytes to add to it, up to and
+ * including the first byte that is not 255.  The literals follow the
+ * literal length, then a 2-byte little-endian match offset, then the match
+ * length bytes, if any.  The last sequence only has literals.  As required
+ * by the format, the last 5 bytes are always literals, and the last match
+ * starts at least 12 bytes before the end */
+#define LZ_MIN_MATCH		4
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+#define LZ_MAX_OFFSET		65535
+#define LZ_HASH_BITS		12
+
+static unsigned int lz_hash (const unsigned char * p)
+{
+  unsigned int v = p [0] | (p [1] << 8) | (p [2] << 16) |
+                   (((unsigned int) (p [3])) << 24);
+  return ((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/* the number of bytes needed for a length field of value n */
+static size_t lz_length_size (size_t n)
+{
+  if (n < 15)
+    return 0;
+  return ((n - 15) / 255 + 1);
+}
+
+/* writes the bytes of a length field whose value n is at least 15 */
+static unsigned char * lz_write_length (unsigned char * op, size_t n)
+{
+  n -= 15;
+  while (n >= 255) {
+    *(op++) = 255;
+    n -= 255;
+  }
+  *(op++) = (unsigned char) n;
+  return op;
+}
+
+/* writes a sequence of literals and, if mlen > 0, a match, returning the
+ * new output pointer, or NULL if the sequence does not fit */
+static unsigned char * lz_sequence (unsigned char * op, unsigned char * oend,
+                                    const unsigned char * literals,
+                                    size_t lit, size_t offset, size_t mlen)
+{
+  size_t needed = 1 + lz_length_size (lit) + lit;
+  if (mlen > 0)
+    needed += 2 + lz_length_size (mlen - LZ_MIN_MATCH);
+  if (needed > (size_t) (oend - op))
+    return NULL;
+  unsigned char * token = op++;
+  *token = ((lit < 15) ? lit : 15) << 4;
+  if (lit >= 15)
+    op = lz_write_length (op, lit);
+  memcpy (op, literals, lit);
+  op += lit;
+  if (mlen > 0) {
+    *(op++) = offset & 0xff;
+    *(op++) = (offset >> 8) & 0xff;
+    size_t m = mlen - LZ_MIN_MATCH;
+    *token |= ((m < 15) ? m : 15);
+    if (m >= 15)
+      op = lz_write_length (op, m);
+  }
+  return op;
+}
+
+int allnet_compress (const char * in, int isize, char * out, int osize)
+{
+  if ((isize < 0) || (osize <= 0))
+    return 0;
+  const unsigned char * src = (const unsigned char *) in;
+  const unsigned char * ip = src;
+  const unsigned char * anchor = src;
+  const unsigned char * iend = src + isize;
+  unsigned char * op = (unsigned char *) out;
+  unsigned char * oend = op + osize;
+  if (isize > LZ_MATCH_LIMIT) {
+    const unsigned char * mflimit = iend - LZ_MATCH_LIMIT;
+    const unsigned char * matchlimit = iend - LZ_LAST_LITERALS;
+    int table [1 << LZ_HASH_BITS];
+    int i;
+    for (i = 0; i < (1 << LZ_HASH_BITS); i++)
+      table [i] = -1;
+    while (ip < mflimit) {
+      unsigned int h = lz_hash (ip);
+      int ref = table [h];
+      table [h] = (int) (ip - src);
+      if ((ref < 0) || (ip - (src + ref) > LZ_MAX_OFFSET) ||
+          (memcmp (src + ref, ip, LZ_MIN_MATCH) != 0)) {
+        ip++;
+        continue;
+      }
+      const unsigned char * match = src + ref;
+      const unsigned char * mp = ip + LZ_MIN_MATCH;
+      const unsigned char * rp = match + LZ_MIN_MATCH;
+      while ((mp < matchlimit) && (*mp == *rp)) {
+        mp++;
+        rp++;
+      }
+      op = lz_sequence (op, oend, anchor, ip - anchor, ip - match, mp - ip);
+      if (op == NULL)
+        return 0;
+      ip = mp;
+      anchor = ip;
+    }
+  }
+  op = lz_sequence (op, oend, anchor, iend - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return (int) (op - (unsigned char *) out);
+}
+
+/* reads the bytes of a length field that started at 15, adding to *n.
+ * returns the new input pointer, or NULL if the input ends first */
+static const unsigned char * lz_read_length (const unsigned char * ip,
+                                             const unsigned char * iend,
+                                             size_t * n)
+{
+  unsigned char b;
+  do {
+    if (ip >= iend)
+      return NULL;
+    b = *(ip++);
+    *n += b;
+  } while (b == 255);
+  return ip;
+}
+
+int allnet_decompress (const char * in, int isize, char * out, int osize)
+{
+  if ((isize <= 0) || (osize < 0))
+    return -1;
+  const unsigned char * ip = (const unsigned char *) in;
+  const unsigned char * iend = ip + isize;
+  unsigned char * dst = (unsigned char *) out;
+  unsigned char * op = dst;
+  unsigned char * oend = dst + osize;
+  while (ip < iend) {
+    unsigned char token = *(ip++);
+    size_t lit = token >> 4;
+    if ((lit == 15) && ((ip = lz_read_length (ip, iend, &lit)) == NULL))
+      return -1;
+    if ((lit > (size_t) (iend - ip)) || (lit > (size_t) (oend - op)))
+      return -1;
+    memcpy (op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip >= iend)   /* the last sequence has no match */
+      break;
+    if (iend - ip < 2)
+      return -1;
+    size_t offset = ip [0] | (ip [1] << 8);
+    ip += 2;
+    if ((offset == 0) || (offset > (size_t) (op - dst)))
+      return -1;
+    size_t mlen = token & 0xf;
+    if ((mlen == 15) && ((ip = lz_read_length (ip, iend, &mlen)) == NULL))
+      return -1;
+    mlen += LZ_MIN_MATCH;
+    if (mlen > (size_t) (oend - op))
+      return -1;
+    const unsigned char * match = op - offset;
+    while (mlen-- > 0)   /* byte by byte, since the match may overlap */
+      *(op++) = *(match++);
+  }
+  return (int) (op - dst);
+}
@@ -0,0 +1,22 @@
+/* compress.h: simple and fast lossless compression, for data that is
+ * sent often enough that fewer bytes matter more than the best ratio */
+
+#ifndef ALLNET_COMPRESS_H
+#define ALLNET_COMPRESS_H
+
+/* the compressed data is in the LZ4 block format, so it can also be
+ * decompressed by any LZ4 implementation given the original size.
+ * Neither function allocates memory, and both are thread-safe. */
+
+/* compresses isize bytes from in into at most osize bytes of out.
+ * returns the compressed size, or 0 if the result does not fit in osize,
+ * e.g. when osize < isize and the data is not compressible */
+extern int allnet_compress (const char * in, int isize, char * out, int osize);
+
+/* decompresses isize bytes from in into at most osize bytes of out.
+ * returns the decompressed size, or -1 if the input is not valid or
+ * the result does not fit in osize */
+extern int allnet_decompress (const char * in, int isize,
+                              char * out, int osize);
+
+#endif /* ALLNET_COMPRESS_H */
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -116,6 +117,54 @@ static void init_global_root ()
 /* printf ("root is %s of length %d\n", global_root, (int) strlen (global_root)); */
 }
 
+/* config_file_name makes sure the program directory exists.  The names of
+ * the directories known to exist are kept, so that is only checked once
+ * per program (or again if opening a file fails) */
+#define CONFIG_MAX_DIRS	64
+static char * known_dirs [CONFIG_MAX_DIRS];
+static int num_known_dirs = 0;
+static pthread_mutex_t known_dirs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int find_known_dir (const char * path)
+{
+  int i;
+  for (i = 0; i < num_known_dirs; i++)
+    if (strcmp (known_dirs [i], path) == 0)
+      return i;
+  return -1;
+}
+
+static void check_dir (const char * path, int print_errors)
+{
+  pthread_mutex_lock (&known_dirs_mutex);
+  int known = (find_known_dir (path) >= 0);
+  pthread_mutex_unlock (&known_dirs_mutex);
+  if (known)
+    return;
+  char * copy = strcpy_malloc (path, "configfiles.c check_dir");
+  int created = create_dir (copy, print_errors);
+  pthread_mutex_lock (&known_dirs_mutex);
+  if ((created) && (num_known_dirs < CONFIG_MAX_DIRS) &&
+      (find_known_dir (copy) < 0)) {
+    known_dirs [num_known_dirs++] = copy;
+    copy = NULL;
+  }
+  pthread_mutex_unlock (&known_dirs_mutex);
+  if (copy != NULL)
+    free (copy);
+}
+
+/* called if a directory may have been removed */
+static void forget_known_dirs ()
+{
+  pthread_mutex_lock (&known_dirs_mutex);
+  int i;
+  for (i = 0; i < num_known_dirs; i++)
+    free (known_dirs [i]);
+  num_known_dirs = 0;
+  pthread_mutex_unlock (&known_dirs_mutex);
+}
+
 /* returns the number of characters in the full path name of the given file. */
 /* (including the null character at the end) */
 /* if name is not NULL, also malloc's the string and copies the path into it */
@@ -141,7 +190,7 @@ int config_file_name (const char * program, const char * file, char ** name,
   }
   /* check for the existence of the directory, or create it */
   snprintf (*name, total_length, "%s/%s", global_root, program);
-  create_dir (*name, print_errors);
+  check_dir (*name, print_errors);
   snprintf (*name, total_length, "%s/%s/%s", global_root, program, file);
 /* printf ("file path for %s %s is %s\n", program, file, *name); */
   return total_length;
@@ -176,6 +225,16 @@ static int open_config (const char * program, const char * file, int flags,
   if (size < 0)
     return -1;
   int result = open (name, flags, 0600);
+  if ((result < 0) && (errno == ENOENT) && ((flags & O_CREAT) != 0)) {
+    /* the directory may have been removed, check again and retry */
+    forget_known_dirs ();
+    free (name);
+    if (config_file_name (program, file, &name, print_errors) < 0)
+      return -1;
+    result = open (name, flags, 0600);
+  }
+  if ((result >= 0) && ((flags & O_ACCMODE) != O_RDONLY))
+    forget_cached_file (name);
   if (result < 0) {
     if ((print_errors) &&
         (errno != ENOENT)) {   /* ENOENT is file not found, do not print */
@@ -211,6 +270,116 @@ int open_rw_config (const char * program, const char * file, int print_errors)
   return open_config (program, file, flags, print_errors, "open_write_config");
 }
 
+/* the contents of small files that are read often, such as counters.
+ * An entry is only used if the file has the same size, inode, and
+ * modification time, and was last modified before the second in which
+ * it was read (so a later write in that second is not missed) */
+#define CONFIG_CACHE_ENTRIES	64
+
+struct cached_file {
+  char * path;       /* NULL if the entry is not used */
+  off_t size;
+  ino_t inode;
+  time_t mod_time;
+  time_t read_time;
+  char * contents;   /* size bytes and a null character */
+};
+
+static struct cached_file cached_files [CONFIG_CACHE_ENTRIES];
+static int next_cached_file = 0;    /* the next entry to replace */
+static pthread_mutex_t cached_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with the mutex held */
+static struct cached_file * find_cached_file (const char * path)
+{
+  int i;
+  for (i = 0; i < CONFIG_CACHE_ENTRIES; i++)
+    if ((cached_files [i].path != NULL) &&
+        (strcmp (cached_files [i].path, path) == 0))
+      return cached_files + i;
+  return NULL;
+}
+
+/* must be called with the mutex held */
+static void clear_cached_file (struct cached_file * cf)
+{
+  if (cf->path != NULL)
+    free (cf->path);
+  if (cf->contents != NULL)
+    free (cf->contents);
+  cf->path = NULL;
+  cf->contents = NULL;
+}
+
+/* same as read_file_malloc (in util.h) with print_errors 0, but if the
+ * file has at most CONFIG_CACHE_FILE_SIZE bytes, the contents are kept
+ * and returned again (without reading the file) as long as it does not
+ * change */
+int read_file_cached (const char * path, char ** contents)
+{
+  *contents = NULL;
+  struct stat st;
+  if (stat (path, &st) != 0)
+    return -1;
+  if (st.st_size > CONFIG_CACHE_FILE_SIZE)
+    return read_file_malloc (path, contents, 0);
+  pthread_mutex_lock (&cached_files_mutex);
+  struct cached_file * cf = find_cached_file (path);
+  if ((cf != NULL) && (cf->size == st.st_size) &&
+      (cf->inode == st.st_ino) && (cf->mod_time == st.st_mtime) &&
+      (cf->mod_time < cf->read_time)) {
+    *contents = memcpy_malloc (cf->contents, (int) (cf->size + 1),
+                               "read_file_cached");
+    int result = (int) cf->size;
+    pthread_mutex_unlock (&cached_files_mutex);
+    return result;
+  }
+  pthread_mutex_unlock (&cached_files_mutex);
+  time_t read_time = time (NULL);
+  int result = read_file_malloc (path, contents, 0);
+  if ((result < 0) || (*contents == NULL) || (result != st.st_size))
+    return result;   /* changed while we read it, do not save */
+  pthread_mutex_lock (&cached_files_mutex);
+  cf = find_cached_file (path);
+  if (cf == NULL) {
+    cf = cached_files + next_cached_file;
+    next_cached_file = (next_cached_file + 1) % CONFIG_CACHE_ENTRIES;
+  }
+  clear_cached_file (cf);
+  cf->path = strcpy_malloc (path, "read_file_cached path");
+  cf->size = st.st_size;
+  cf->inode = st.st_ino;
+  cf->mod_time = st.st_mtime;
+  cf->read_time = read_time;
+  cf->contents = memcpy_malloc (*contents, result + 1,
+                                "read_file_cached contents");
+  pthread_mutex_unlock (&cached_files_mutex);
+  return result;
+}
+
+/* same as read_file_cached, for the given config file */
+int read_config_cached (const char * program, const char * file,
+                        char ** contents, int print_errors)
+{
+  *contents = NULL;
+  char * name = NULL;
+  if (config_file_name (program, file, &name, print_errors) < 0)
+    return -1;
+  int result = read_file_cached (name, contents);
+  free (name);
+  return result;
+}
+
+/* should be called after writing a file that may be in the cache */
+void forget_cached_file (const char * path)
+{
+  pthread_mutex_lock (&cached_files_mutex);
+  struct cached_file * cf = find_cached_file (path);
+  if (cf != NULL)
+    clear_cached_file (cf);
+  pthread_mutex_unlock (&cached_files_mutex);
+}
+
 /* tell configfiles where the home directory is.  Should be called
  * before calling any other function */
 void set_home_directory (const char * root)
@@ -219,5 +388,6 @@ printf ("setting global home directory to %s\n", root);
   if (global_home_directory != NULL)
     free (global_home_directory);
   global_home_directory = strcpy_malloc (root, "set_home_directory");
+  forget_known_dirs ();
 }
 
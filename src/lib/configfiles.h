@@ -36,6 +36,21 @@ extern int open_write_config (const char * program, const char * file,
 extern int open_rw_config (const char * program, const char * file,
                            int print_errors);
 
+/* files with at most this many bytes may be kept in memory */
+#define CONFIG_CACHE_FILE_SIZE	256
+
+/* same as read_file_malloc (in util.h) without printing errors: returns
+ * the size, or -1 if the file cannot be read, and sets *contents to a
+ * malloc'd null-terminated copy of the contents.  Small files are returned
+ * from memory as long as their size and modification time do not change */
+extern int read_file_cached (const char * path, char ** contents);
+/* same as read_file_cached, for the given config file */
+extern int read_config_cached (const char * program, const char * file,
+                               char ** contents, int print_errors);
+/* should be called after writing a file other than with open_write_config
+ * or open_rw_config, in case it was modified within the same second */
+extern void forget_cached_file (const char * path);
+
 /* attempts to create the directory.  returns 1 for success, 0 for failure */
 extern int create_dir (const char * path, int print_errors);
 
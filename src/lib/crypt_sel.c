@@ -1,8 +1,10 @@
 /* crypt_sel.c: interface to different implementations of crypto primitives */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 /* #include <sys/types.h> */
 /* #include <sys/stat.h> */
 #include <fcntl.h>
@@ -12,6 +14,8 @@
 #include "util.h"
 #include "wp_rsa.h"
 #include "wp_arith.h"
+#include "wp_aes.h"
+#include "sha.h"
 
 allnet_rsa_pubkey allnet_rsa_private_to_public (allnet_rsa_prvkey key)
 {
@@ -297,20 +301,17 @@ int allnet_rsa_write_prvkey (const char * fname, allnet_rsa_prvkey key)
 #endif /* HAVE_OPENSSL */
 }
 
-/* padding should be 0 for no padding, 1 for PKCS1 OAEP
- * rsize should be at least as large as the key size
- * for no padding, dsize should equal the key size
- * for PKCS1 OAEP padding, dsize should be less than the key size - 41
- * returns the key size for success, -1 for failure */
-int allnet_rsa_encrypt (allnet_rsa_pubkey rsa, const char * data, int dsize,
-                        char * result, int rsize, int padding)
-{
-  if ((padding > 1) || (padding < 0))
-    return 0;
-  int bytes;
+/* =======================  provider section  ========================= */
+/* each provider implements the RSA and AES operations on keys of the
+ * types selected at compile time.  The wp provider is always available,
+ * and with openssl, converts the openssl keys on each call.  The callers
+ * below check the arguments before calling the provider */
+
 #ifdef HAVE_OPENSSL
-  if (rsize < RSA_size (rsa))
-    return 0;
+static int openssl_rsa_encrypt (allnet_rsa_pubkey rsa,
+                                const char * data, int dsize,
+                                char * result, int rsize, int padding)
+{
 /*
 printf ("openssl n = %s\n", BN_bn2hex (rsa->n));
 printf ("openssl e = %s\n", BN_bn2hex (rsa->e));
@@ -319,52 +320,20 @@ print_buffer (data, dsize, "openssl data", 1000, 1);
   int rsa_padding = RSA_PKCS1_OAEP_PADDING;
   if (padding == 0)
     rsa_padding = RSA_NO_PADDING;
-  bytes = RSA_public_encrypt (dsize, (const unsigned char *) data,
-                              (unsigned char *) result, rsa, rsa_padding);
+  int bytes = RSA_public_encrypt (dsize, (const unsigned char *) data,
+                                  (unsigned char *) result, rsa, rsa_padding);
   if (bytes <= 0) {
     ERR_load_crypto_strings ();
     ERR_print_errors_fp (stdout);
     bytes = 0;
   }
-#else /* HAVE_OPENSSL */
-  if (rsize * 8 < rsa.nbits)
-    return 0;
-/*
-printf ("wp_rsa n = %s\n", wp_itox (rsa.nbits, rsa.n));
-printf ("wp_rsa e = %llx\n", rsa.e);
-*/
-  int rsa_padding = WP_RSA_PADDING_PKCS1_OAEP;
-  if (padding == 0)
-    rsa_padding = WP_RSA_PADDING_NONE;
-  bytes = wp_rsa_encrypt (&rsa, data, dsize, result, rsize, rsa_padding);
-#endif /* HAVE_OPENSSL */
   return bytes;
 }
 
-/* padding should be 0 for no padding, 1 for PKCS1 OAEP
- * dsize should be exactly as large as the key size (but may be more)
- * for no padding, rsize should equal the key size
- * for PKCS1 OAEP padding, rsize should be at least the key size - 41
- * returns the number of decrypted bytes for success, -1 for failure */
-int allnet_rsa_decrypt (allnet_rsa_prvkey rsa, const char * data, int dsize,
-                        char * result, int rsize, int padding)
+static int openssl_rsa_decrypt (allnet_rsa_prvkey rsa,
+                                const char * data, int dsize,
+                                char * result, int rsize, int padding)
 {
-  if ((padding > 1) || (padding < 0))
-    return -1;
-#ifdef HAVE_OPENSSL
-  int rsa_size = RSA_size (rsa);
-#else /* HAVE_OPENSSL */
-  int rsa_size = rsa.nbits / 8;
-#endif /* HAVE_OPENSSL */
-
-  if (dsize < rsa_size)
-    return -1;
-  if (dsize > rsa_size)
-    dsize = rsa_size;
-  if ((rsize < rsa_size - 41) || ((! padding) && (rsize < rsa_size)))
-    return -1;
-  int bytes;
-#ifdef HAVE_OPENSSL
 /*
 printf ("openssl n = %s\n", BN_bn2hex (rsa->n));
 printf ("openssl e = %s\n", BN_bn2hex (rsa->e));
@@ -372,42 +341,20 @@ printf ("openssl e = %s\n", BN_bn2hex (rsa->e));
   int rsa_padding = RSA_PKCS1_OAEP_PADDING;
   if (padding == 0)
     rsa_padding = RSA_NO_PADDING;
-  bytes = RSA_private_decrypt (rsa_size, (const unsigned char *) data,
-                               (unsigned char *) result, rsa, rsa_padding);
+  int bytes = RSA_private_decrypt (dsize, (const unsigned char *) data,
+                                   (unsigned char *) result, rsa, rsa_padding);
   if (bytes <= 0) {
     ERR_load_crypto_strings ();
     ERR_print_errors_fp (stdout);
     bytes = -1;
   }
-#else /* HAVE_OPENSSL */
-/*
-printf ("wp_rsa n = %s\n", wp_itox (rsa.nbits, rsa.n));
-printf ("wp_rsa e = %llx\n", rsa.e);
-*/
-  int rsa_padding = WP_RSA_PADDING_PKCS1_OAEP;
-  if (padding == 0)
-    rsa_padding = WP_RSA_PADDING_NONE;
-  bytes = wp_rsa_decrypt (&rsa, data, dsize, result, rsize, rsa_padding);
-#endif /* HAVE_OPENSSL */
   return bytes;
 }
 
-/* padding should be zero for no padding, 1 for SHA512 padding
- * hash should be the output of a SHA512 hash, and hsize should be 64 (or more)
- * ssize must be at least as large as the key size (and may be more)
- * returns 1 for success, 0 for failure */
-int allnet_rsa_sign (allnet_rsa_prvkey rsa, const char * hash, int hsize,
-                     char * sig, int ssize)
+static int openssl_rsa_sign (allnet_rsa_prvkey rsa,
+                             const char * hash, int hsize,
+                             char * sig, int ssize)
 {
-#ifdef HAVE_OPENSSL
-  int rsa_size = RSA_size (rsa);
-#else /* HAVE_OPENSSL */
-  int rsa_size = rsa.nbits / 8;
-#endif /* HAVE_OPENSSL */
-  if ((hsize < 64) || (ssize < rsa_size))
-    return 0;
-
-#ifdef HAVE_OPENSSL
 /*
 printf ("sign openssl n = %s\n", BN_bn2hex (rsa->n));
 printf ("sign openssl e = %s, hsize %d\n", BN_bn2hex (rsa->e), hsize);
@@ -418,37 +365,16 @@ print_buffer (hash, hsize, "hash to be signed", 64, 1);
                           (unsigned char *) sig, &siglen, rsa);
   if (! success) {
     unsigned long e = ERR_get_error ();
-    printf ("RSA signature (%d) failed %ld: %s\n", rsa_size, e,
+    printf ("RSA signature (%d) failed %ld: %s\n", RSA_size (rsa), e,
             ERR_error_string (e, NULL));
   }
   return success;
-#else /* HAVE_OPENSSL */
-/*
-printf ("sign wp_rsa n = %s\n", wp_itox (rsa.nbits, rsa.n));
-printf ("sign wp_rsa e = %llx, hsize %d\n", rsa.e, hsize);
-print_buffer (hash, hsize, "hash to be signed", 64, 1);
-*/
-  return wp_rsa_sign (&rsa, hash, hsize, sig, ssize,
-                      WP_RSA_SIG_ENCODING_SHA512);
-#endif /* HAVE_OPENSSL */
 }
 
-/* hash should be the output of a SHA512 hash, and hsize should be 64 (or more)
- * ssize must be at least as large as the key size (and may be more)
- * returns 1 for successful verification, 0 for anything else */
-int allnet_rsa_verify (allnet_rsa_pubkey rsa, 
-                       const char * hash, int hsize,
-                       const char * sig, int ssize)
+static int openssl_rsa_verify (allnet_rsa_pubkey rsa,
+                               const char * hash, int hsize,
+                               const char * sig, int ssize)
 {
-#ifdef HAVE_OPENSSL
-  int rsa_size = RSA_size (rsa);
-#else /* HAVE_OPENSSL */
-  int rsa_size = rsa.nbits / 8;
-#endif /* HAVE_OPENSSL */
-  if ((hsize < 64) || (ssize < rsa_size))
-    return 0;
-
-#ifdef HAVE_OPENSSL
 /*
 printf ("openssl n = %s\n", BN_bn2hex (rsa->n));
 printf ("openssl e = %s, hsize %d\n", BN_bn2hex (rsa->e), hsize);
@@ -469,15 +395,364 @@ print_buffer (hash, hsize, "hash to be verified", 64, 1);
     verifies = 1;
   }
   return verifies;
+}
+
+static int openssl_aes_encrypt_block (char * key, char * in, char * out)
+{
+  AES_KEY aes_key;
+  if (AES_set_encrypt_key ((unsigned char *) key, AES256_SIZE * 8,
+                           &aes_key) < 0) {
+    printf ("unable to set AES encryption key");
+    return 0;
+  }
+  AES_encrypt ((unsigned char *) in, (unsigned char *) out, &aes_key);
+  return 1;
+}
+
+/* copies bn, if any, to the nbits of n */
+static void bn_to_wp (int nbits, uint64_t * n, const BIGNUM * bn)
+{
+  char bytes [WP_RSA_MAX_KEY_BYTES];
+  int size = nbits / 8;
+  memset (bytes, 0, size);
+  if ((bn != NULL) && (BN_num_bytes (bn) <= size))
+    BN_bn2bin (bn, (unsigned char *) (bytes + size - BN_num_bytes (bn)));
+  wp_from_bytes (nbits, n, size, bytes);
+}
+
+/* the keys in this file are RSA *, and reading their parts through an
+ * EVP_PKEY would need a new EVP_PKEY and copies of the BIGNUMs on every
+ * conversion, so keep using the RSA calls, deprecated in OpenSSL 3 */
+#if defined (__GNUC__) && (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif /* __GNUC__ && OPENSSL_VERSION_NUMBER >= 0x30000000L */
+/* fills in key from rsa.  If key_pair is not NULL, also fills in the
+ * private key.  Returns 1 for success, 0 if the key is too large or
+ * not a private key */
+static int wp_from_openssl (RSA * rsa, wp_rsa_key * key,
+                            wp_rsa_key_pair * key_pair)
+{
+  int nbits = RSA_size (rsa) * 8;
+  if ((nbits <= 0) || (nbits > WP_RSA_MAX_KEY_BITS))
+    return 0;
+  const BIGNUM * n = NULL;
+  const BIGNUM * e = NULL;
+  const BIGNUM * d = NULL;
+  const BIGNUM * p = NULL;
+  const BIGNUM * q = NULL;
+  const BIGNUM * dp = NULL;
+  const BIGNUM * dq = NULL;
+  const BIGNUM * qinv = NULL;
+#ifdef HAVE_OPENSSL_ONE_ONE
+  RSA_get0_key (rsa, &n, &e, &d);
+  RSA_get0_factors (rsa, &p, &q);
+  RSA_get0_crt_params (rsa, &dp, &dq, &qinv);
+#else /* HAVE_OPENSSL_ONE_ONE */
+  n = rsa->n; e = rsa->e; d = rsa->d; p = rsa->p; q = rsa->q;
+  dp = rsa->dmp1; dq = rsa->dmq1; qinv = rsa->iqmp;
+#endif /* HAVE_OPENSSL_ONE_ONE */
+  if ((n == NULL) || (e == NULL))
+    return 0;
+  if (key != NULL) {
+    key->nbits = nbits;
+    bn_to_wp (nbits, key->n, n);
+    key->e = BN_get_word (e);
+  }
+  if (key_pair != NULL) {
+    if (d == NULL)
+      return 0;
+    key_pair->nbits = nbits;
+    bn_to_wp (nbits, key_pair->n, n);
+    key_pair->e = BN_get_word (e);
+    bn_to_wp (nbits, key_pair->d, d);
+    bn_to_wp (nbits / 2, key_pair->p, p);
+    bn_to_wp (nbits / 2, key_pair->q, q);
+    bn_to_wp (nbits / 2, key_pair->dp, dp);
+    bn_to_wp (nbits / 2, key_pair->dq, dq);
+    bn_to_wp (nbits / 2, key_pair->qinv, qinv);
+  }
+  return 1;
+}
+#if defined (__GNUC__) && (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__ && OPENSSL_VERSION_NUMBER >= 0x30000000L */
+#endif /* HAVE_OPENSSL */
+
+/* the wp versions of the keys, stored in storage if conversion is needed,
+ * or NULL if the key cannot be converted */
+static wp_rsa_key * wp_pubkey (allnet_rsa_pubkey * rsa, wp_rsa_key * storage)
+{
+#ifdef HAVE_OPENSSL
+  if (wp_from_openssl (*rsa, storage, NULL))
+    return storage;
+  return NULL;
+#else /* HAVE_OPENSSL */
+  return rsa;
+#endif /* HAVE_OPENSSL */
+}
+
+static wp_rsa_key_pair * wp_prvkey (allnet_rsa_prvkey * rsa,
+                                    wp_rsa_key_pair * storage)
+{
+#ifdef HAVE_OPENSSL
+  if (wp_from_openssl (*rsa, NULL, storage))
+    return storage;
+  return NULL;
 #else /* HAVE_OPENSSL */
+  return rsa;
+#endif /* HAVE_OPENSSL */
+}
+
+/* clears any private key copied by wp_prvkey */
+static void wp_clear_prvkey (wp_rsa_key_pair * storage)
+{
+#ifdef HAVE_OPENSSL
+  memset (storage, 0, sizeof (wp_rsa_key_pair));
+#endif /* HAVE_OPENSSL */
+}
+
+static int wp_provider_rsa_encrypt (allnet_rsa_pubkey rsa,
+                                    const char * data, int dsize,
+                                    char * result, int rsize, int padding)
+{
+  wp_rsa_key storage;
+  wp_rsa_key * key = wp_pubkey (&rsa, &storage);
+  if (key == NULL)
+    return 0;
 /*
-printf ("wp_rsa n = %s\n", wp_itox (rsa.nbits, rsa.n));
-printf ("wp_rsa e = %llx, hsize %d\n", rsa.e, hsize);
+printf ("wp_rsa n = %s\n", wp_itox (key->nbits, key->n));
+printf ("wp_rsa e = %llx\n", key->e);
+*/
+  int rsa_padding = WP_RSA_PADDING_PKCS1_OAEP;
+  if (padding == 0)
+    rsa_padding = WP_RSA_PADDING_NONE;
+  int bytes = wp_rsa_encrypt (key, data, dsize, result, rsize, rsa_padding);
+  if (bytes <= 0)
+    bytes = 0;
+  return bytes;
+}
+
+static int wp_provider_rsa_decrypt (allnet_rsa_prvkey rsa,
+                                    const char * data, int dsize,
+                                    char * result, int rsize, int padding)
+{
+  wp_rsa_key_pair storage;
+  wp_rsa_key_pair * key = wp_prvkey (&rsa, &storage);
+  if (key == NULL)
+    return -1;
+/*
+printf ("wp_rsa n = %s\n", wp_itox (key->nbits, key->n));
+printf ("wp_rsa e = %llx\n", key->e);
+*/
+  int rsa_padding = WP_RSA_PADDING_PKCS1_OAEP;
+  if (padding == 0)
+    rsa_padding = WP_RSA_PADDING_NONE;
+  int bytes = wp_rsa_decrypt (key, data, dsize, result, rsize, rsa_padding);
+  wp_clear_prvkey (&storage);
+  return bytes;
+}
+
+static int wp_provider_rsa_sign (allnet_rsa_prvkey rsa,
+                                 const char * hash, int hsize,
+                                 char * sig, int ssize)
+{
+  wp_rsa_key_pair storage;
+  wp_rsa_key_pair * key = wp_prvkey (&rsa, &storage);
+  if (key == NULL)
+    return 0;
+/*
+printf ("sign wp_rsa n = %s\n", wp_itox (key->nbits, key->n));
+printf ("sign wp_rsa e = %llx, hsize %d\n", key->e, hsize);
+print_buffer (hash, hsize, "hash to be signed", 64, 1);
+*/
+  int success = wp_rsa_sign (key, hash, hsize, sig, ssize,
+                             WP_RSA_SIG_ENCODING_SHA512);
+  wp_clear_prvkey (&storage);
+  return success;
+}
+
+static int wp_provider_rsa_verify (allnet_rsa_pubkey rsa,
+                                   const char * hash, int hsize,
+                                   const char * sig, int ssize)
+{
+  wp_rsa_key storage;
+  wp_rsa_key * key = wp_pubkey (&rsa, &storage);
+  if (key == NULL)
+    return 0;
+/*
+printf ("wp_rsa n = %s\n", wp_itox (key->nbits, key->n));
+printf ("wp_rsa e = %llx, hsize %d\n", key->e, hsize);
 print_buffer (hash, hsize, "hash to be verified", 64, 1);
 */
-  return wp_rsa_verify (&rsa, hash, hsize, sig, ssize,
+  return wp_rsa_verify (key, hash, hsize, sig, ssize,
                         WP_RSA_SIG_ENCODING_SHA512);
+}
+
+static int wp_provider_aes_encrypt_block (char * key, char * in, char * out)
+{
+  wp_aes_encrypt_block (AES256_SIZE, key, in, out);
+  return 1;
+}
+
+static const struct allnet_crypto_provider providers [] = {
+#ifdef HAVE_OPENSSL
+  { "openssl", openssl_rsa_encrypt, openssl_rsa_decrypt,
+    openssl_rsa_sign, openssl_rsa_verify, openssl_aes_encrypt_block },
 #endif /* HAVE_OPENSSL */
+  { "wp", wp_provider_rsa_encrypt, wp_provider_rsa_decrypt,
+    wp_provider_rsa_sign, wp_provider_rsa_verify,
+    wp_provider_aes_encrypt_block }
+};
+#define NUM_PROVIDERS	((int) (sizeof (providers) / sizeof (providers [0])))
+
+static const char * operation_names [ALLNET_CRYPTO_OPERATIONS] =
+  { "encrypt", "decrypt", "sign", "verify", "aes" };
+
+/* the default is the first provider for RSA (openssl if available),
+ * and wp for AES, since wp_aes uses AES-NI when the CPU has it */
+static const struct allnet_crypto_provider *
+  selected [ALLNET_CRYPTO_OPERATIONS] =
+  { providers, providers, providers, providers,
+    providers + NUM_PROVIDERS - 1 };
+
+static const struct allnet_crypto_provider * find_provider (const char * name)
+{
+  int i;
+  for (i = 0; i < NUM_PROVIDERS; i++)
+    if (strcmp (providers [i].name, name) == 0)
+      return providers + i;
+  return NULL;
+}
+
+/* ALLNET_CRYPTO may hold a comma-separated list of operation=provider */
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+static void select_from_environment ()
+{
+  const char * env = getenv ("ALLNET_CRYPTO");
+  if (env == NULL)
+    return;
+  char copy [200];
+  snprintf (copy, sizeof (copy), "%s", env);
+  char * saveptr = NULL;
+  char * item;
+  for (item = strtok_r (copy, ",", &saveptr); item != NULL;
+       item = strtok_r (NULL, ",", &saveptr)) {
+    char * equals = strchr (item, '=');
+    if (equals != NULL)
+      *equals = '\0';
+    if ((equals == NULL) || (! allnet_crypto_select (item, equals + 1)))
+      printf ("ALLNET_CRYPTO: unable to select %s\n", item);
+  }
+}
+
+static const struct allnet_crypto_provider * provider (int operation)
+{
+  pthread_once (&select_once, select_from_environment);
+  return selected [operation];
+}
+
+int allnet_crypto_providers (const struct allnet_crypto_provider ** result)
+{
+  if (result != NULL)
+    *result = providers;
+  return NUM_PROVIDERS;
+}
+
+/* operation may be one of the operation names, "rsa" for all the RSA
+ * operations, or "all".  Returns 1 if selected, 0 for unknown names */
+int allnet_crypto_select (const char * operation, const char * name)
+{
+  const struct allnet_crypto_provider * p = find_provider (name);
+  if (p == NULL)
+    return 0;
+  int all = (strcmp (operation, "all") == 0);
+  int rsa = (strcmp (operation, "rsa") == 0);
+  int found = 0;
+  int i;
+  for (i = 0; i < ALLNET_CRYPTO_OPERATIONS; i++) {
+    if ((all) || ((rsa) && (i != ALLNET_CRYPTO_AES)) ||
+        (strcmp (operation, operation_names [i]) == 0)) {
+      selected [i] = p;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+const char * allnet_crypto_selected (int operation)
+{
+  if ((operation < 0) || (operation >= ALLNET_CRYPTO_OPERATIONS))
+    return NULL;
+  return provider (operation)->name;
+}
+
+/* padding should be 0 for no padding, 1 for PKCS1 OAEP
+ * rsize should be at least as large as the key size
+ * for no padding, dsize should equal the key size
+ * for PKCS1 OAEP padding, dsize should be less than the key size - 41
+ * returns the key size for success, -1 for failure */
+int allnet_rsa_encrypt (allnet_rsa_pubkey rsa, const char * data, int dsize,
+                        char * result, int rsize, int padding)
+{
+  if ((padding > 1) || (padding < 0))
+    return 0;
+  int rsa_size = allnet_rsa_pubkey_size (rsa);
+  if ((rsa_size <= 0) || (rsize < rsa_size))
+    return 0;
+  return provider (ALLNET_CRYPTO_ENCRYPT)->rsa_encrypt (rsa, data, dsize,
+                                                        result, rsize,
+                                                        padding);
+}
+
+/* padding should be 0 for no padding, 1 for PKCS1 OAEP
+ * dsize should be exactly as large as the key size (but may be more)
+ * for no padding, rsize should equal the key size
+ * for PKCS1 OAEP padding, rsize should be at least the key size - 41
+ * returns the number of decrypted bytes for success, -1 for failure */
+int allnet_rsa_decrypt (allnet_rsa_prvkey rsa, const char * data, int dsize,
+                        char * result, int rsize, int padding)
+{
+  if ((padding > 1) || (padding < 0))
+    return -1;
+  int rsa_size = allnet_rsa_prvkey_size (rsa);
+  if ((rsa_size <= 0) || (dsize < rsa_size))
+    return -1;
+  if (dsize > rsa_size)
+    dsize = rsa_size;
+  if ((rsize < rsa_size - 41) || ((! padding) && (rsize < rsa_size)))
+    return -1;
+  return provider (ALLNET_CRYPTO_DECRYPT)->rsa_decrypt (rsa, data, dsize,
+                                                        result, rsize,
+                                                        padding);
+}
+
+/* padding should be zero for no padding, 1 for SHA512 padding
+ * hash should be the output of a SHA512 hash, and hsize should be 64 (or more)
+ * ssize must be at least as large as the key size (and may be more)
+ * returns 1 for success, 0 for failure */
+int allnet_rsa_sign (allnet_rsa_prvkey rsa, const char * hash, int hsize,
+                     char * sig, int ssize)
+{
+  int rsa_size = allnet_rsa_prvkey_size (rsa);
+  if ((rsa_size <= 0) || (hsize < 64) || (ssize < rsa_size))
+    return 0;
+  return provider (ALLNET_CRYPTO_SIGN)->rsa_sign (rsa, hash, hsize,
+                                                  sig, ssize);
+}
+
+/* hash should be the output of a SHA512 hash, and hsize should be 64 (or more)
+ * ssize must be at least as large as the key size (and may be more)
+ * returns 1 for successful verification, 0 for anything else */
+int allnet_rsa_verify (allnet_rsa_pubkey rsa, 
+                       const char * hash, int hsize,
+                       const char * sig, int ssize)
+{
+  int rsa_size = allnet_rsa_pubkey_size (rsa);
+  if ((rsa_size <= 0) || (hsize < 64) || (ssize < rsa_size))
+    return 0;
+  return provider (ALLNET_CRYPTO_VERIFY)->rsa_verify (rsa, hash, hsize,
+                                                      sig, ssize);
 }
 
 #ifdef HAVE_OPENSSL
@@ -540,16 +815,127 @@ void allnet_rsa_seed_rng (char * buffer, int bsize)
  * returns 1 for success, 0 for failure */
 int allnet_aes_encrypt_block (char * key, char * in, char * out)
 {
-#ifdef HAVE_OPENSSL
-  AES_KEY aes_key;
-  if (AES_set_encrypt_key ((unsigned char *) key, AES256_SIZE * 8,
-                           &aes_key) < 0) {
-    printf ("unable to set AES encryption key");
-    return 0;
-  }
-  AES_encrypt ((unsigned char *) in, (unsigned char *) out, &aes_key);
-#else /* HAVE_OPENSSL */
-  wp_aes_encrypt_block (32, key, in, out);
-#endif /* HAVE_OPENSSL */
+  return provider (ALLNET_CRYPTO_AES)->aes_encrypt_block (key, in, out);
+}
+
+/* =======================  benchmark section  ========================= */
+
+#define BENCH_KEY_BITS		4096
+#define BENCH_AES_BLOCKS	10000	/* AES blocks per RSA iteration */
+
+static int bench_error (const char * operation, const char * by,
+                        const char * with)
+{
+  if (with == NULL)
+    printf ("error: %s fails with %s\n", operation, by);
+  else
+    printf ("error: %s by %s fails with %s\n", operation, by, with);
   return 1;
 }
+
+/* times each operation of each provider, and checks that each provider
+ * accepts the results of the others.  Prints the times, and returns the
+ * number of errors.  Slow, since it first generates a key */
+int allnet_crypto_bench (int iterations)
+{
+  if (iterations <= 0)
+    iterations = 10;
+  pthread_once (&select_once, select_from_environment);
+  printf ("generating a %d-bit key\n", BENCH_KEY_BITS);
+  allnet_rsa_prvkey key = allnet_rsa_generate_key (BENCH_KEY_BITS, NULL, 0);
+  if (allnet_rsa_prvkey_is_null (key)) {
+    printf ("unable to generate a key\n");
+    return 1;
+  }
+  allnet_rsa_pubkey pub = allnet_rsa_private_to_public (key);
+  int ksize = allnet_rsa_prvkey_size (key);
+  char hash [SHA512_SIZE];
+  random_bytes (hash, sizeof (hash));
+  char plain [WP_RSA_MAX_KEY_BYTES];
+  int psize = ksize - WP_RSA_PADDING_PKCS1_OAEP_SIZE;
+  random_bytes (plain, psize);
+  char aes_key [AES256_SIZE];
+  random_bytes (aes_key, sizeof (aes_key));
+  char aes_in [AES_BLOCK_SIZE];
+  random_bytes (aes_in, sizeof (aes_in));
+  char sigs [NUM_PROVIDERS] [WP_RSA_MAX_KEY_BYTES];
+  char ciphers [NUM_PROVIDERS] [WP_RSA_MAX_KEY_BYTES];
+  char aes_out [NUM_PROVIDERS] [AES_BLOCK_SIZE];
+  char result [WP_RSA_MAX_KEY_BYTES];
+  unsigned long long int us [NUM_PROVIDERS] [ALLNET_CRYPTO_OPERATIONS];
+  int errors = 0;
+  int ip;
+  for (ip = 0; ip < NUM_PROVIDERS; ip++) {
+    const struct allnet_crypto_provider * p = providers + ip;
+    unsigned long long int start = allnet_time_us ();
+    int ok = 1;
+    int i;
+    for (i = 0; i < iterations; i++)
+      ok = p->rsa_sign (key, hash, sizeof (hash), sigs [ip], ksize) && ok;
+    us [ip] [ALLNET_CRYPTO_SIGN] = allnet_time_us () - start;
+    if (! ok)
+      errors += bench_error ("sign", p->name, NULL);
+    start = allnet_time_us ();
+    for (i = 0; i < iterations; i++)
+      ok = p->rsa_verify (pub, hash, sizeof (hash), sigs [ip], ksize) && ok;
+    us [ip] [ALLNET_CRYPTO_VERIFY] = allnet_time_us () - start;
+    if (! ok)
+      errors += bench_error ("verify", p->name, NULL);
+    ok = 1;
+    start = allnet_time_us ();
+    for (i = 0; i < iterations; i++)
+      ok = (p->rsa_encrypt (pub, plain, psize, ciphers [ip], ksize, 1)
+            == ksize) && ok;
+    us [ip] [ALLNET_CRYPTO_ENCRYPT] = allnet_time_us () - start;
+    if (! ok)
+      errors += bench_error ("encrypt", p->name, NULL);
+    ok = 1;
+    start = allnet_time_us ();
+    for (i = 0; i < iterations; i++)
+      ok = (p->rsa_decrypt (key, ciphers [ip], ksize, result, ksize, 1)
+            == psize) && ok;
+    us [ip] [ALLNET_CRYPTO_DECRYPT] = allnet_time_us () - start;
+    if ((! ok) || (memcmp (result, plain, psize) != 0))
+      errors += bench_error ("decrypt", p->name, NULL);
+    ok = 1;
+    memcpy (aes_out [ip], aes_in, AES_BLOCK_SIZE);
+    start = allnet_time_us ();
+    for (i = 0; i < iterations * BENCH_AES_BLOCKS; i++)
+      ok = p->aes_encrypt_block (aes_key, aes_out [ip], aes_out [ip]) && ok;
+    us [ip] [ALLNET_CRYPTO_AES] = allnet_time_us () - start;
+    if (! ok)
+      errors += bench_error ("aes", p->name, NULL);
+  }
+  /* each provider must accept the signatures and ciphertexts of the others */
+  for (ip = 0; ip < NUM_PROVIDERS; ip++) {
+    int iq;
+    for (iq = 0; iq < NUM_PROVIDERS; iq++) {
+      const struct allnet_crypto_provider * p = providers + ip;
+      const struct allnet_crypto_provider * q = providers + iq;
+      if (! q->rsa_verify (pub, hash, sizeof (hash), sigs [ip], ksize))
+        errors += bench_error ("signature", p->name, q->name);
+      if ((q->rsa_decrypt (key, ciphers [ip], ksize, result, ksize, 1)
+           != psize) || (memcmp (result, plain, psize) != 0))
+        errors += bench_error ("encryption", p->name, q->name);
+      if (memcmp (aes_out [ip], aes_out [iq], AES_BLOCK_SIZE) != 0)
+        errors += bench_error ("aes", p->name, q->name);
+    }
+  }
+  allnet_rsa_free_prvkey (key);
+  printf ("%d iterations, %d errors\n", iterations, errors);
+  printf ("provider  sign(us) verify(us) encrypt(us) decrypt(us) aes(ns)\n");
+  for (ip = 0; ip < NUM_PROVIDERS; ip++)
+    printf ("%-8s %9.1f %10.1f %11.1f %11.1f %7.1f\n", providers [ip].name,
+            us [ip] [ALLNET_CRYPTO_SIGN] / (double) iterations,
+            us [ip] [ALLNET_CRYPTO_VERIFY] / (double) iterations,
+            us [ip] [ALLNET_CRYPTO_ENCRYPT] / (double) iterations,
+            us [ip] [ALLNET_CRYPTO_DECRYPT] / (double) iterations,
+            us [ip] [ALLNET_CRYPTO_AES] * 1000.0 /
+              ((double) iterations * BENCH_AES_BLOCKS));
+  printf ("selected:");
+  int op;
+  for (op = 0; op < ALLNET_CRYPTO_OPERATIONS; op++)
+    printf (" %s %s%s", operation_names [op], allnet_crypto_selected (op),
+            (op + 1 < ALLNET_CRYPTO_OPERATIONS) ? "," : "\n");
+  return errors;
+}
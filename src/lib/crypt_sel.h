@@ -116,4 +116,48 @@ extern void allnet_rsa_seed_rng (char * buffer, int bsize);
  * returns 1 for success, 0 for failure */
 extern int allnet_aes_encrypt_block (char * key, char * in, char * out);
 
+/* =======================  provider section  ========================= */
+
+/* the functions above use whichever provider is selected for each
+ * operation.  The providers are "openssl" (only if compiled with openssl)
+ * and "wp", which is always available.  By default RSA uses the first
+ * provider, and AES uses wp.  The environment variable ALLNET_CRYPTO may
+ * select others, e.g. ALLNET_CRYPTO=rsa=wp,aes=openssl */
+#define ALLNET_CRYPTO_ENCRYPT	0
+#define ALLNET_CRYPTO_DECRYPT	1
+#define ALLNET_CRYPTO_SIGN	2
+#define ALLNET_CRYPTO_VERIFY	3
+#define ALLNET_CRYPTO_AES	4
+#define ALLNET_CRYPTO_OPERATIONS	5
+
+/* the key sizes are checked before calling these */
+struct allnet_crypto_provider {
+  const char * name;
+  int (* rsa_encrypt) (allnet_rsa_pubkey rsa, const char * data, int dsize,
+                       char * result, int rsize, int padding);
+  int (* rsa_decrypt) (allnet_rsa_prvkey rsa, const char * data, int dsize,
+                       char * result, int rsize, int padding);
+  int (* rsa_sign) (allnet_rsa_prvkey rsa, const char * hash, int hsize,
+                    char * sig, int ssize);
+  int (* rsa_verify) (allnet_rsa_pubkey rsa, const char * hash, int hsize,
+                      const char * sig, int ssize);
+  int (* aes_encrypt_block) (char * key, char * in, char * out);
+};
+
+/* returns the number of providers, and if result is not NULL, sets it
+ * to point to the (static) array of providers */
+extern int allnet_crypto_providers (const struct allnet_crypto_provider **
+                                    result);
+/* operation is "encrypt", "decrypt", "sign", "verify", "aes", "rsa" (for
+ * the first four) or "all".  Should be called before starting threads.
+ * Returns 1 if selected, 0 if the operation or provider is not known */
+extern int allnet_crypto_select (const char * operation, const char * name);
+/* returns the name of the provider selected for ALLNET_CRYPTO_operation */
+extern const char * allnet_crypto_selected (int operation);
+
+/* times each operation of each provider, and checks that each provider
+ * accepts the results of the others.  Prints the times, and returns the
+ * number of errors.  Slow, since it first generates a key */
+extern int allnet_crypto_bench (int iterations);
+
 #endif /* ALLNET_CRYPT_SELECTOR_H */
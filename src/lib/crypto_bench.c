@@ -0,0 +1,622 @@
+/* crypto_bench.c: check and time the cryptographic primitives */
+/* command line:
+   allnet-crypto-bench [-t milliseconds] [-b bits] [-n]
+     -t the minimum time for each measurement, in milliseconds (default 500)
+     -b only time RSA with keys of this many bits.  May be repeated.
+        By default, times each size wp_rsa supports: 1024, 2048, and 4096
+     -n do not time RSA key generation, which is slow
+   First, the implementations are compared on random data and keys: sha512,
+   sha1, and sha512hmac with and without acceleration (see sha_accelerated)
+   and with openssl, and wp_aes and openssl in counter mode.  Stream
+   encryption and RSA, which are randomized, must decrypt and verify their
+   own results, and both sides of an X448 exchange must get the same key.
+   allnet_x448 does not give the same results as RFC 7748 (see the note in
+   dh.c), so it is not compared to openssl.  Any difference is printed,
+   and then the exit status is 1.
+   Then each implementation is timed.  For the hashes and the ciphers, on
+   64, 1024 (about a packet), and 16384 bytes, printing the nanoseconds
+   per call and the megabytes per second.  For RSA and X448, printing the
+   microseconds per call and the calls per second.
+   openssl is only compared if allnet was compiled with openssl, and X448
+   only if openssl has it (1.1.1 or later).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif /* HAVE_OPENSSL */
+
+#include "sha.h"
+#include "wp_aes.h"
+#include "wp_rsa.h"
+#include "crypt_sel.h"
+#include "stream.h"
+#include "dh.h"
+#include "util.h"
+
+#if defined (HAVE_OPENSSL) && defined (EVP_PKEY_X448)
+#define BENCH_OPENSSL_X448
+#endif /* HAVE_OPENSSL && EVP_PKEY_X448 */
+
+#define BENCH_MAX_SIZE		16384
+#define BENCH_CHECK_SIZE	300	/* compare all sizes up to this */
+#define BENCH_HMAC_KEY_SIZE	64
+#define BENCH_STREAM_OVERHEAD	16	/* 8-byte counter, 8-byte hmac */
+#define BENCH_RSA_E		65537
+#define BENCH_MAX_RSA_SIZES	8
+
+static const int sizes [] = { 64, 1024, BENCH_MAX_SIZE };
+#define NUM_SIZES	((int) (sizeof (sizes) / sizeof (sizes [0])))
+
+static const int rsa_sizes [] = { 1024, 2048, WP_RSA_MAX_KEY_BITS };
+#define NUM_RSA_SIZES	((int) (sizeof (rsa_sizes) / sizeof (rsa_sizes [0])))
+
+static unsigned long long int min_ns = 500000000ULL;
+
+/* the arguments for each of the timed functions */
+static char data [BENCH_MAX_SIZE];
+static char out [BENCH_MAX_SIZE + BENCH_STREAM_OVERHEAD];
+static char hmac_key [BENCH_HMAC_KEY_SIZE];
+static struct wp_aes_key aes_key;
+static char aes_key_bytes [AES_KEY_256_BYTES];
+static char aes_counter [WP_AES_BLOCK_SIZE];
+static struct allnet_stream_encryption_state stream_encrypt;
+static struct allnet_stream_encryption_state stream_decrypt;
+static char stream_packet [BENCH_MAX_SIZE + BENCH_STREAM_OVERHEAD];
+static int stream_psize = 0;
+static wp_rsa_key_pair wp_key;
+static wp_rsa_key wp_pub;
+static char rsa_hash [SHA512_SIZE];
+static char rsa_sig [WP_RSA_MAX_KEY_BYTES];
+static char rsa_cipher [WP_RSA_MAX_KEY_BYTES];
+static char rsa_plain [WP_RSA_MAX_KEY_BYTES];
+static char x448_k [DH448_SIZE];
+static char x448_u [DH448_SIZE];
+static char x448_result [DH448_SIZE];
+#ifdef HAVE_OPENSSL
+static EVP_MD_CTX * md_ctx = NULL;
+static EVP_CIPHER_CTX * aes_ctx = NULL;
+static const struct allnet_crypto_provider * openssl_provider = NULL;
+static allnet_rsa_prvkey openssl_key;
+static allnet_rsa_pubkey openssl_pub;
+#ifndef HAVE_OPENSSL_ONE_ONE
+#define EVP_MD_CTX_new		EVP_MD_CTX_create
+#define EVP_MD_CTX_free		EVP_MD_CTX_destroy
+#endif /* HAVE_OPENSSL_ONE_ONE */
+#endif /* HAVE_OPENSSL */
+#ifdef BENCH_OPENSSL_X448
+static EVP_PKEY_CTX * x448_ctx = NULL;
+#endif /* BENCH_OPENSSL_X448 */
+
+static unsigned long long int now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* calls fn (size) until at least min_ns have passed, and at least once.
+ * Returns the nanoseconds per call */
+static double time_calls (void (* fn) (int), int size)
+{
+  unsigned long long int calls = 0;
+  unsigned long long int batch = 1;
+  unsigned long long int start = now_ns ();
+  unsigned long long int finish = start;
+  while ((calls == 0) || (finish - start < min_ns)) {
+    unsigned long long int i;
+    for (i = 0; i < batch; i++)
+      fn (size);
+    calls += batch;
+    finish = now_ns ();
+    if (batch < 1024)
+      batch *= 2;
+  }
+  return (finish - start) / (double) calls;
+}
+
+static void print_throughput (const char * name, const char * impl,
+                              void (* fn) (int))
+{
+  int i;
+  for (i = 0; i < NUM_SIZES; i++) {
+    double ns = time_calls (fn, sizes [i]);
+    printf ("%-14s %-9s %6d bytes %10.0f ns %9.1f MB/s\n", name, impl,
+            sizes [i], ns, sizes [i] * 1000.0 / ns);
+  }
+}
+
+static void print_latency (const char * name, const char * impl,
+                           int bits, void (* fn) (int))
+{
+  double ns = time_calls (fn, bits);
+  printf ("%-14s %-9s %6d bits  %10.1f us %9.1f/s\n", name, impl,
+          bits, ns / 1000.0, 1e9 / ns);
+}
+
+static void sha512_fn (int size)
+{
+  sha512 (data, size, out);
+}
+
+static void sha1_fn (int size)
+{
+  sha1 (data, size, out);
+}
+
+static void hmac_fn (int size)
+{
+  sha512hmac (data, size, hmac_key, sizeof (hmac_key), out);
+}
+
+static void aes_fn (int size)
+{
+  wp_aes_ctr_crypt (&aes_key, aes_counter, data, size, out);
+}
+
+static void stream_encrypt_fn (int size)
+{
+  allnet_stream_encrypt_buffer (&stream_encrypt, data, size,
+                                out, sizeof (out));
+}
+
+static void stream_decrypt_fn (int size)
+{
+  allnet_stream_decrypt_buffer (&stream_decrypt, stream_packet, stream_psize,
+                                out, sizeof (out));
+}
+
+static void wp_keygen_fn (int bits)
+{
+  wp_rsa_key_pair key;
+  wp_rsa_generate_key_pair_e (bits, &key, BENCH_RSA_E, 1, NULL, 0);
+}
+
+static void wp_sign_fn (int bits)
+{
+  wp_rsa_sign (&wp_key, rsa_hash, sizeof (rsa_hash), out, bits / 8,
+               WP_RSA_SIG_ENCODING_SHA512);
+}
+
+static void wp_verify_fn (int bits)
+{
+  wp_rsa_verify (&wp_pub, rsa_hash, sizeof (rsa_hash), rsa_sig, bits / 8,
+                 WP_RSA_SIG_ENCODING_SHA512);
+}
+
+static void wp_encrypt_fn (int bits)
+{
+  int psize = bits / 8 - WP_RSA_PADDING_PKCS1_OAEP_SIZE;
+  wp_rsa_encrypt (&wp_pub, rsa_plain, psize, out, bits / 8,
+                  WP_RSA_PADDING_PKCS1_OAEP);
+}
+
+static void wp_decrypt_fn (int bits)
+{
+  wp_rsa_decrypt (&wp_key, rsa_cipher, bits / 8, out, bits / 8,
+                  WP_RSA_PADDING_PKCS1_OAEP);
+}
+
+static void x448_fn (int bits)
+{
+  allnet_x448 (x448_k, x448_u, x448_result);
+}
+
+#ifdef HAVE_OPENSSL
+static void openssl_digest (const EVP_MD * md, const char * in, int size,
+                            char * result)
+{
+  EVP_DigestInit_ex (md_ctx, md, NULL);
+  EVP_DigestUpdate (md_ctx, in, size);
+  EVP_DigestFinal_ex (md_ctx, (unsigned char *) result, NULL);
+}
+
+static void openssl_hmac (const char * in, int size, char * result)
+{
+  unsigned int rsize = SHA512_SIZE;
+  HMAC (EVP_sha512 (), hmac_key, sizeof (hmac_key),
+        (const unsigned char *) in, size, (unsigned char *) result, &rsize);
+}
+
+/* as with wp_aes_ctr_crypt, the counter continues from one call to
+ * the next unless counter is not NULL */
+static void openssl_aes (const char * counter, const char * in, int size,
+                         char * result)
+{
+  if (counter != NULL)
+    EVP_EncryptInit_ex (aes_ctx, EVP_aes_256_ctr (), NULL,
+                        (const unsigned char *) aes_key_bytes,
+                        (const unsigned char *) counter);
+  int rsize = 0;
+  EVP_EncryptUpdate (aes_ctx, (unsigned char *) result, &rsize,
+                     (const unsigned char *) in, size);
+}
+
+static void openssl_sha512_fn (int size)
+{
+  openssl_digest (EVP_sha512 (), data, size, out);
+}
+
+static void openssl_sha1_fn (int size)
+{
+  openssl_digest (EVP_sha1 (), data, size, out);
+}
+
+static void openssl_hmac_fn (int size)
+{
+  openssl_hmac (data, size, out);
+}
+
+static void openssl_aes_fn (int size)
+{
+  openssl_aes (NULL, data, size, out);
+}
+
+static void openssl_keygen_fn (int bits)
+{
+  allnet_rsa_prvkey key = allnet_rsa_generate_key (bits, NULL, 0);
+  allnet_rsa_free_prvkey (key);
+}
+
+static void openssl_sign_fn (int bits)
+{
+  openssl_provider->rsa_sign (openssl_key, rsa_hash, sizeof (rsa_hash),
+                              out, bits / 8);
+}
+
+static void openssl_verify_fn (int bits)
+{
+  openssl_provider->rsa_verify (openssl_pub, rsa_hash, sizeof (rsa_hash),
+                                rsa_sig, bits / 8);
+}
+
+static void openssl_encrypt_fn (int bits)
+{
+  openssl_provider->rsa_encrypt (openssl_pub, rsa_plain,
+                                 bits / 8 - WP_RSA_PADDING_PKCS1_OAEP_SIZE,
+                                 out, bits / 8, 1);
+}
+
+static void openssl_decrypt_fn (int bits)
+{
+  openssl_provider->rsa_decrypt (openssl_key, rsa_cipher, bits / 8,
+                                 out, bits / 8, 1);
+}
+#endif /* HAVE_OPENSSL */
+
+#ifdef BENCH_OPENSSL_X448
+/* openssl keys are little-endian, allnet's are big-endian */
+static void reverse_copy (const char * from, char * to, int size)
+{
+  int i;
+  for (i = 0; i < size; i++)
+    to [i] = from [size - 1 - i];
+}
+
+/* sets up x448_ctx to compute X448 of k and u, which are in allnet's
+ * byte order.  Returns 1 for success, 0 for failure */
+static int openssl_x448_init (const char * k, const char * u)
+{
+  unsigned char k_le [DH448_SIZE];
+  unsigned char u_le [DH448_SIZE];
+  reverse_copy (k, (char *) k_le, DH448_SIZE);
+  reverse_copy (u, (char *) u_le, DH448_SIZE);
+  if (x448_ctx != NULL)
+    EVP_PKEY_CTX_free (x448_ctx);
+  x448_ctx = NULL;
+  EVP_PKEY * prv =
+    EVP_PKEY_new_raw_private_key (EVP_PKEY_X448, NULL, k_le, DH448_SIZE);
+  EVP_PKEY * peer =
+    EVP_PKEY_new_raw_public_key (EVP_PKEY_X448, NULL, u_le, DH448_SIZE);
+  if ((prv != NULL) && (peer != NULL))
+    x448_ctx = EVP_PKEY_CTX_new (prv, NULL);
+  int ok = ((x448_ctx != NULL) && (EVP_PKEY_derive_init (x448_ctx) > 0) &&
+            (EVP_PKEY_derive_set_peer (x448_ctx, peer) > 0));
+  EVP_PKEY_free (prv);   /* the context keeps its own references */
+  EVP_PKEY_free (peer);
+  return ok;
+}
+
+/* result in allnet's byte order.  Returns 1 for success, 0 for failure */
+static int openssl_x448 (char * result)
+{
+  unsigned char le [DH448_SIZE];
+  size_t rsize = sizeof (le);
+  if ((EVP_PKEY_derive (x448_ctx, le, &rsize) <= 0) || (rsize != DH448_SIZE))
+    return 0;
+  reverse_copy ((char *) le, result, DH448_SIZE);
+  return 1;
+}
+
+static void openssl_x448_fn (int bits)
+{
+  openssl_x448 (x448_result);
+}
+#endif /* BENCH_OPENSSL_X448 */
+
+static int mismatch (const char * what, const char * impl, int size)
+{
+  printf ("%s mismatch for %s, %d bytes\n", what, impl, size);
+  return 1;
+}
+
+/* compares the hashes, and the ciphers in counter mode, on all sizes
+ * up to BENCH_CHECK_SIZE and on the sizes that are timed */
+static int compare_symmetric ()
+{
+  int errors = 0;
+  int n;
+  for (n = 0; n <= BENCH_CHECK_SIZE + NUM_SIZES; n++) {
+    int size = ((n <= BENCH_CHECK_SIZE) ? n : sizes [n - BENCH_CHECK_SIZE - 1]);
+    char expected [SHA512_SIZE];
+    char result [SHA512_SIZE];
+    sha_accelerated (0);
+    sha512 (data, size, expected);
+    sha_accelerated (1);
+    sha512 (data, size, result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0)
+      errors += mismatch ("sha512", "accelerated", size);
+#ifdef HAVE_OPENSSL
+    openssl_digest (EVP_sha512 (), data, size, result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0)
+      errors += mismatch ("sha512", "openssl", size);
+#endif /* HAVE_OPENSSL */
+    sha_accelerated (0);
+    sha1 (data, size, expected);
+    sha_accelerated (1);
+    sha1 (data, size, result);
+    if (memcmp (expected, result, SHA1_SIZE) != 0)
+      errors += mismatch ("sha1", "accelerated", size);
+#ifdef HAVE_OPENSSL
+    openssl_digest (EVP_sha1 (), data, size, result);
+    if (memcmp (expected, result, SHA1_SIZE) != 0)
+      errors += mismatch ("sha1", "openssl", size);
+#endif /* HAVE_OPENSSL */
+    sha_accelerated (0);
+    sha512hmac (data, size, hmac_key, sizeof (hmac_key), expected);
+    sha_accelerated (1);
+    sha512hmac (data, size, hmac_key, sizeof (hmac_key), result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0)
+      errors += mismatch ("sha512hmac", "accelerated", size);
+#ifdef HAVE_OPENSSL
+    openssl_hmac (data, size, result);
+    if (memcmp (expected, result, SHA512_SIZE) != 0)
+      errors += mismatch ("sha512hmac", "openssl", size);
+#endif /* HAVE_OPENSSL */
+    /* each size continues from the counter of the previous one */
+#ifdef HAVE_OPENSSL
+    char counter [WP_AES_BLOCK_SIZE];
+    memcpy (counter, aes_counter, sizeof (counter));
+    wp_aes_ctr_crypt (&aes_key, aes_counter, data, size, out);
+    char compare [BENCH_MAX_SIZE];
+    openssl_aes (counter, data, size, compare);
+    if (memcmp (out, compare, size) != 0)
+      errors += mismatch ("aes-ctr", "openssl", size);
+#endif /* HAVE_OPENSSL */
+    if (size > 0) {   /* the stream cipher needs at least one byte */
+      int psize = allnet_stream_encrypt_buffer (&stream_encrypt, data, size,
+                                                out, sizeof (out));
+      char text [BENCH_MAX_SIZE];
+      if ((psize != size + BENCH_STREAM_OVERHEAD) ||
+          (! allnet_stream_decrypt_buffer (&stream_decrypt, out, psize,
+                                           text, sizeof (text))) ||
+          (memcmp (text, data, size) != 0))
+        errors += mismatch ("stream", "decryption", size);
+    }
+  }
+  return errors;
+}
+
+/* checks that both sides of a key exchange get the same secret,
+ * for count random keys */
+static int compare_x448 (int count)
+{
+  int errors = 0;
+  char five [DH448_SIZE];
+  allnet_x448_five (five);
+  int i;
+  for (i = 0; i < count; i++) {
+    char k1 [DH448_SIZE];
+    char k2 [DH448_SIZE];
+    random_bytes (k1, sizeof (k1));
+    random_bytes (k2, sizeof (k2));
+    allnet_x448_make_valid (k1);
+    allnet_x448_make_valid (k2);
+    char u1 [DH448_SIZE];
+    char u2 [DH448_SIZE];
+    char s1 [DH448_SIZE];
+    char s2 [DH448_SIZE];
+    if ((! allnet_x448 (k1, five, u1)) || (! allnet_x448 (k2, five, u2)) ||
+        (! allnet_x448 (k1, u2, s1)) || (! allnet_x448 (k2, u1, s2)) ||
+        (memcmp (s1, s2, DH448_SIZE) != 0))
+      errors += mismatch ("x448", "key exchange", DH448_SIZE);
+  }
+  return errors;
+}
+
+/* generates the keys of the given size, checks each implementation,
+ * and if there were no errors, times them.  Returns the number of errors */
+static int bench_rsa (int bits, int keygen)
+{
+  int errors = 0;
+  int ksize = bits / 8;
+  int psize = ksize - WP_RSA_PADDING_PKCS1_OAEP_SIZE;
+  random_bytes (rsa_hash, sizeof (rsa_hash));
+  random_bytes (rsa_plain, psize);
+  char result [WP_RSA_MAX_KEY_BYTES];
+  if (! wp_rsa_generate_key_pair_e (bits, &wp_key, BENCH_RSA_E, 1, NULL, 0)) {
+    printf ("wp_rsa unable to generate a %d-bit key\n", bits);
+    return 1;
+  }
+  wp_pub = wp_rsa_get_public_key (&wp_key);
+  if ((! wp_rsa_sign (&wp_key, rsa_hash, sizeof (rsa_hash), rsa_sig, ksize,
+                      WP_RSA_SIG_ENCODING_SHA512)) ||
+      (! wp_rsa_verify (&wp_pub, rsa_hash, sizeof (rsa_hash), rsa_sig, ksize,
+                        WP_RSA_SIG_ENCODING_SHA512)))
+    errors += mismatch ("rsa signature", "wp", ksize);
+  if ((wp_rsa_encrypt (&wp_pub, rsa_plain, psize, rsa_cipher, ksize,
+                       WP_RSA_PADDING_PKCS1_OAEP) != ksize) ||
+      (wp_rsa_decrypt (&wp_key, rsa_cipher, ksize, result, ksize,
+                       WP_RSA_PADDING_PKCS1_OAEP) != psize) ||
+      (memcmp (result, rsa_plain, psize) != 0))
+    errors += mismatch ("rsa encryption", "wp", ksize);
+  if (errors == 0) {
+    if (keygen)
+      print_latency ("rsa-keygen", "wp", bits, wp_keygen_fn);
+    print_latency ("rsa-sign", "wp", bits, wp_sign_fn);
+    print_latency ("rsa-verify", "wp", bits, wp_verify_fn);
+    print_latency ("rsa-encrypt", "wp", bits, wp_encrypt_fn);
+    print_latency ("rsa-decrypt", "wp", bits, wp_decrypt_fn);
+  }
+#ifdef HAVE_OPENSSL
+  if (openssl_provider == NULL)
+    return errors;
+  openssl_key = allnet_rsa_generate_key (bits, NULL, 0);
+  if (allnet_rsa_prvkey_is_null (openssl_key)) {
+    printf ("openssl unable to generate a %d-bit key\n", bits);
+    return errors + 1;
+  }
+  openssl_pub = allnet_rsa_private_to_public (openssl_key);
+  const struct allnet_crypto_provider * p = openssl_provider;
+  int openssl_errors = 0;
+  if ((! p->rsa_sign (openssl_key, rsa_hash, sizeof (rsa_hash),
+                      rsa_sig, ksize)) ||
+      (! p->rsa_verify (openssl_pub, rsa_hash, sizeof (rsa_hash),
+                        rsa_sig, ksize)))
+    openssl_errors += mismatch ("rsa signature", "openssl", ksize);
+  if ((p->rsa_encrypt (openssl_pub, rsa_plain, psize, rsa_cipher, ksize, 1)
+       != ksize) ||
+      (p->rsa_decrypt (openssl_key, rsa_cipher, ksize, result, ksize, 1)
+       != psize) ||
+      (memcmp (result, rsa_plain, psize) != 0))
+    openssl_errors += mismatch ("rsa encryption", "openssl", ksize);
+  if (openssl_errors == 0) {
+    if (keygen)
+      print_latency ("rsa-keygen", "openssl", bits, openssl_keygen_fn);
+    print_latency ("rsa-sign", "openssl", bits, openssl_sign_fn);
+    print_latency ("rsa-verify", "openssl", bits, openssl_verify_fn);
+    print_latency ("rsa-encrypt", "openssl", bits, openssl_encrypt_fn);
+    print_latency ("rsa-decrypt", "openssl", bits, openssl_decrypt_fn);
+  }
+  allnet_rsa_free_prvkey (openssl_key);
+  errors += openssl_errors;
+#endif /* HAVE_OPENSSL */
+  return errors;
+}
+
+static void usage (const char * program)
+{
+  printf ("usage: %s [-t milliseconds] [-b bits]* [-n]\n", program);
+}
+
+int main (int argc, char ** argv)
+{
+  int bits [BENCH_MAX_RSA_SIZES];
+  int nbits = 0;
+  int keygen = 1;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-t") == 0) && (i + 1 < argc) &&
+        (atoi (argv [i + 1]) > 0)) {
+      min_ns = atoi (argv [++i]) * 1000000ULL;
+    } else if ((strcmp (argv [i], "-b") == 0) && (i + 1 < argc) &&
+               (nbits < BENCH_MAX_RSA_SIZES)) {
+      int b = atoi (argv [++i]);
+      if ((b < rsa_sizes [0]) || (b > WP_RSA_MAX_KEY_BITS) ||
+          ((b & (b - 1)) != 0)) {
+        printf ("%d-bit keys not supported, must be a power of two "
+                "from %d to %d\n", b, rsa_sizes [0], WP_RSA_MAX_KEY_BITS);
+        return 1;
+      }
+      bits [nbits++] = b;
+    } else if (strcmp (argv [i], "-n") == 0) {
+      keygen = 0;
+    } else {
+      usage (argv [0]);
+      return 1;
+    }
+  }
+  if (nbits == 0)
+    for (nbits = 0; nbits < NUM_RSA_SIZES; nbits++)
+      bits [nbits] = rsa_sizes [nbits];
+
+  random_bytes (data, sizeof (data));
+  random_bytes (hmac_key, sizeof (hmac_key));
+  random_bytes (aes_key_bytes, sizeof (aes_key_bytes));
+  random_bytes (aes_counter, sizeof (aes_counter));
+  wp_aes_set_key (AES_KEY_256_BYTES, aes_key_bytes, &aes_key);
+  char stream_key [ALLNET_STREAM_KEY_SIZE];
+  char stream_secret [ALLNET_STREAM_SECRET_SIZE];
+  allnet_stream_init (&stream_encrypt, stream_key, 1, stream_secret, 1, 8, 8);
+  allnet_stream_init (&stream_decrypt, stream_key, 0, stream_secret, 0, 8, 8);
+  random_bytes (x448_k, sizeof (x448_k));
+  allnet_x448_make_valid (x448_k);
+  allnet_x448_five (x448_u);
+  allnet_x448 (x448_k, x448_u, x448_u);   /* a valid public key */
+#ifdef HAVE_OPENSSL
+  md_ctx = EVP_MD_CTX_new ();
+  aes_ctx = EVP_CIPHER_CTX_new ();
+  const struct allnet_crypto_provider * providers = NULL;
+  int np = allnet_crypto_providers (&providers);
+  for (i = 0; i < np; i++)
+    if (strcmp (providers [i].name, "openssl") == 0)
+      openssl_provider = providers + i;
+  if ((md_ctx == NULL) || (aes_ctx == NULL)) {
+    printf ("unable to allocate openssl contexts\n");
+    return 1;
+  }
+#endif /* HAVE_OPENSSL */
+
+  int errors = compare_symmetric () + compare_x448 (100);
+  printf ("%d mismatches\n", errors);
+
+  print_throughput ("sha512", "allnet", sha512_fn);
+  print_throughput ("sha1", "allnet", sha1_fn);
+  print_throughput ("sha512hmac", "allnet", hmac_fn);
+  sha_accelerated (0);
+  print_throughput ("sha512", "portable", sha512_fn);
+  print_throughput ("sha1", "portable", sha1_fn);
+  print_throughput ("sha512hmac", "portable", hmac_fn);
+  sha_accelerated (1);
+#ifdef HAVE_OPENSSL
+  print_throughput ("sha512", "openssl", openssl_sha512_fn);
+  print_throughput ("sha1", "openssl", openssl_sha1_fn);
+  print_throughput ("sha512hmac", "openssl", openssl_hmac_fn);
+#endif /* HAVE_OPENSSL */
+  print_throughput ("aes-256-ctr", "wp", aes_fn);
+#ifdef HAVE_OPENSSL
+  openssl_aes (aes_counter, data, 0, out);
+  print_throughput ("aes-256-ctr", "openssl", openssl_aes_fn);
+#endif /* HAVE_OPENSSL */
+  print_throughput ("stream-encrypt", "allnet", stream_encrypt_fn);
+  for (i = 0; i < NUM_SIZES; i++) {   /* decrypt a packet of each size */
+    stream_psize = allnet_stream_encrypt_buffer (&stream_encrypt, data,
+                                                 sizes [i], stream_packet,
+                                                 sizeof (stream_packet));
+    double ns = time_calls (stream_decrypt_fn, sizes [i]);
+    printf ("%-14s %-9s %6d bytes %10.0f ns %9.1f MB/s\n", "stream-decrypt",
+            "allnet", sizes [i], ns, sizes [i] * 1000.0 / ns);
+  }
+  print_latency ("x448", "allnet", DH448_SIZE * 8, x448_fn);
+#ifdef BENCH_OPENSSL_X448
+  if (openssl_x448_init (x448_k, x448_u))
+    print_latency ("x448", "openssl", DH448_SIZE * 8, openssl_x448_fn);
+#endif /* BENCH_OPENSSL_X448 */
+  for (i = 0; i < nbits; i++)
+    errors += bench_rsa (bits [i], keygen);
+  if (errors > 0)
+    printf ("%d errors\n", errors);
+#ifdef HAVE_OPENSSL
+  EVP_MD_CTX_free (md_ctx);
+  EVP_CIPHER_CTX_free (aes_ctx);
+#endif /* HAVE_OPENSSL */
+#ifdef BENCH_OPENSSL_X448
+  EVP_PKEY_CTX_free (x448_ctx);
+#endif /* BENCH_OPENSSL_X448 */
+  return (errors == 0) ? 0 : 1;
+}
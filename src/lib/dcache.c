@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "util.h"
@@ -16,9 +17,19 @@
 typedef void (* release_function) (void * data);
 */
 
+/* the entries are kept in entries [0..num_entries-1], in no particular
+ * order.  The usage order is kept by a doubly-linked list through the
+ * entries, from cache->mru (most recently used) to cache->lru, so that
+ * recording usage and finding the entry to release are O(1).
+ * Entries are also in hash chains, so that finding an entry is O(1).
+ * The hash is the caller's hash function of the data for a cache created
+ * with cache_init_hashed, and otherwise a hash of the data pointer */
 struct dcache_entry {
   void * data;
-  unsigned char spare;   /* used by cache_all_matches and cache_random */
+  unsigned int hash;
+  int prev;              /* more recently used entry, or -1 */
+  int next;              /* less recently used entry, or -1 */
+  int hash_next;         /* next entry in the same hash chain, or -1 */
 };
 
 struct dcache {
@@ -32,7 +43,11 @@ struct dcache {
    * calls from different threads (the mutex serializes those) */
   int busy;
   char * name;
-/* the entries are kept in order of last usage, most recently used first */
+  hash_function h;       /* NULL if not hashed by key */
+  int mru;               /* most recently used entry, or -1 */
+  int lru;               /* least recently used entry, or -1 */
+  unsigned int hash_mask;   /* number of hash chains - 1 */
+  int * chains;          /* first entry in each hash chain, or -1 */
   struct dcache_entry entries [0];
 };
 
@@ -44,27 +59,121 @@ struct dcache {
 void * cache_init  (int max_entries, release_function f,
                     const char * caller_name)
 {
+  return cache_init_hashed (max_entries, f, NULL, caller_name);
+}
+
+void * cache_init_hashed (int max_entries, release_function f,
+                          hash_function h, const char * caller_name)
+{
+  if (max_entries <= 0)
+    return NULL;
   int size = sizeof (struct dcache)
            + max_entries * sizeof (struct dcache_entry);
-  struct dcache * result = malloc_or_fail (size, "cache_init");
+  struct dcache * result = malloc_tagged (size, ALLNET_MEMORY_DCACHE,
+                                          "cache_init");
 /*
   printf ("allocated %p, %d bytes = %zd + %d * %zd\n", result,
           size, sizeof (struct dcache), max_entries,
           sizeof (struct dcache_entry));
 */
   result->f = f;
+  result->h = h;
   result->max_entries = max_entries;
   result->num_entries = 0;
   result->last_match = 0;
   result->busy = 0;
   result->name = strcpy_malloc (caller_name, "dcache cache_init name");
   pthread_mutex_init (&(result->mutex), NULL);
-  int i;
-  for (i = 0; i < max_entries; i++)
+  result->mru = -1;
+  result->lru = -1;
+  unsigned int num_chains = 1;
+  while (num_chains < (unsigned int) max_entries)
+    num_chains *= 2;
+  result->hash_mask = num_chains - 1;
+  result->chains = malloc_tagged (num_chains * sizeof (int),
+                                  ALLNET_MEMORY_DCACHE, "cache_init");
+  unsigned int i;
+  for (i = 0; i < num_chains; i++)
+    result->chains [i] = -1;
+  for (i = 0; i < (unsigned int) max_entries; i++)
     result->entries [i].data = NULL;
   return result;
 }
 
+static unsigned int data_hash (struct dcache * cache, void * data)
+{
+  if (cache->h != NULL)
+    return cache->h (data);
+  /* mix the pointer bits, since the low bits are usually zero */
+  uint64_t x = (uint64_t) (uintptr_t) data;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (unsigned int) x;
+}
+
+/* the list and hash functions are called with lock held */
+static void list_unlink (struct dcache * cache, int index)
+{
+  struct dcache_entry * e = cache->entries + index;
+  if (e->prev >= 0)
+    cache->entries [e->prev].next = e->next;
+  else
+    cache->mru = e->next;
+  if (e->next >= 0)
+    cache->entries [e->next].prev = e->prev;
+  else
+    cache->lru = e->prev;
+}
+
+static void list_push_front (struct dcache * cache, int index)
+{
+  struct dcache_entry * e = cache->entries + index;
+  e->prev = -1;
+  e->next = cache->mru;
+  if (cache->mru >= 0)
+    cache->entries [cache->mru].prev = index;
+  else
+    cache->lru = index;
+  cache->mru = index;
+}
+
+static void hash_insert (struct dcache * cache, int index)
+{
+  struct dcache_entry * e = cache->entries + index;
+  int * chain = cache->chains + (e->hash & cache->hash_mask);
+  e->hash_next = *chain;
+  *chain = index;
+}
+
+static void hash_unlink (struct dcache * cache, int index)
+{
+  int * p = cache->chains + (cache->entries [index].hash & cache->hash_mask);
+  while ((*p >= 0) && (*p != index))
+    p = &(cache->entries [*p].hash_next);
+  if (*p == index)
+    *p = cache->entries [index].hash_next;
+}
+
+/* move the entry at index from to the unused index to, keeping its
+ * place in the usage list */
+static void move_entry (struct dcache * cache, int from, int to)
+{
+  hash_unlink (cache, from);
+  struct dcache_entry * e = cache->entries + to;
+  *e = cache->entries [from];
+  if (e->prev >= 0)
+    cache->entries [e->prev].next = to;
+  else
+    cache->mru = to;
+  if (e->next >= 0)
+    cache->entries [e->next].prev = to;
+  else
+    cache->lru = to;
+  hash_insert (cache, to);
+  cache->entries [from].data = NULL;
+}
+
 /* called with lock held */
 static void release_entry (struct dcache * cache, int index)
 {
@@ -121,6 +230,29 @@ void * cache_get_match (void * cp, match_function f, void * arg1)
   return NULL;
 }
 
+/* return a matching element whose data has the given hash, or NULL */
+void * cache_get_hashed (void * cp, unsigned int hash, match_function f,
+                         void * arg1)
+{
+  struct dcache * cache = (struct dcache *) cp;
+  if (cache->h == NULL)   /* not hashed by key, look at all the entries */
+    return cache_get_match (cp, f, arg1);
+  if (cache->busy) return NULL;
+  pthread_mutex_lock (&(cache->mutex));
+  int index = cache->chains [hash & cache->hash_mask];
+  while (index >= 0) {
+    struct dcache_entry * cep = cache->entries + index;
+    if ((cep->hash == hash) && (f (arg1, cep->data))) {
+      void * result = cep->data;
+      pthread_mutex_unlock (&(cache->mutex));
+      return result;
+    }
+    index = cep->hash_next;
+  }
+  pthread_mutex_unlock (&(cache->mutex));
+  return NULL;
+}
+
 /* return all matching elements, sorted in order from highest to lowest match.
  * The result is the number of matches. which are returned in array.
  * The caller should free array when done.
@@ -160,8 +292,9 @@ int cache_all_matches (void * cp, match_function f, void * arg, void *** array)
         new_min = matches [i];
     min = new_min;
 /* printf ("in dcache loop, min %d found %d count %d\n", min, found, count); */
-    /* add all the entries with that value into the result array */
-    for (i = 0; i < cache->num_entries; i++) {
+    /* add all the entries with that value into the result array,
+     * most recently used first */
+    for (i = cache->mru; i >= 0; i = cache->entries [i].next) {
       if (matches [i] == min) {
 /* printf ("in dcache if, result [%d] set to cache->entries [%d] (%p)\n",
 count - found - 1, i, cache->entries [i].data); */
@@ -198,7 +331,7 @@ void cache_map (void * cp, map_function f, void * arg1)
   if (cache->busy) return;
   pthread_mutex_lock (&(cache->mutex));
   int index;
-  for (index = 0; index < cache->num_entries; index++)
+  for (index = cache->mru; index >= 0; index = cache->entries [index].next)
     f (arg1, cache->entries [index].data);
   pthread_mutex_unlock (&(cache->mutex));
 }
@@ -209,23 +342,20 @@ static int find_data (struct dcache * cache, void * data)
 {
   if (data == NULL)
     return -1;
-  int i;
-  for (i = 0; i < cache->num_entries; i++)
-    if (cache->entries [i].data == data)
-      return i;
-  return -1;
+  int i = cache->chains [data_hash (cache, data) & cache->hash_mask];
+  while ((i >= 0) && (cache->entries [i].data != data))
+    i = cache->entries [i].hash_next;
+  return i;
 }
 
 /* called with lock held */
 static void record_usage (struct dcache * cache, int index)
 {
-  /* move this record to the front of the entries list, keeping the rest
-   * in order */
-  struct dcache_entry ce = cache->entries [index];
-  int i;
-  for (i = index; i > 0; i--)
-    cache->entries [i] = cache->entries [i - 1];
-  cache->entries [0] = ce;
+  /* move this record to the front of the usage list */
+  if (cache->mru != index) {
+    list_unlink (cache, index);
+    list_push_front (cache, index);
+  }
 }
 
 void cache_record_usage (void * cp, void * data)
@@ -263,17 +393,21 @@ void cache_add (void * cp, void * data)
 /* printf ("not in cache, index %d, max_entries %d\n", index,
           cache->max_entries);
   */
-  if (index == cache->max_entries) {
-    index--;
+  if (index == cache->max_entries) {   /* reuse the least recently used */
+    index = cache->lru;
 #ifdef DEBUG_PRINT
     printf ("calling release_entry (%d)\n", index);
 #endif /* DEBUG_PRINT */
     release_entry (cache, index);   /* release it as needed */
+    list_unlink (cache, index);
+    hash_unlink (cache, index);
   } else {    /* new entry, no need to release */
     cache->num_entries = cache->num_entries + 1;
   }
   cache->entries [index].data = data;
-  record_usage (cache, index);    /* move it to the front */
+  cache->entries [index].hash = data_hash (cache, data);
+  hash_insert (cache, index);
+  list_push_front (cache, index);
 /* printf ("now in cache, num_entries %d, max_entries %d\n",
           cache->num_entries, cache->max_entries); */
   pthread_mutex_unlock (&(cache->mutex));
@@ -291,10 +425,12 @@ static int actual_remove (struct dcache * cache, int index)
   printf ("remove calling release_entry (%d)\n", index);
 #endif /* DEBUG_PRINT */
   release_entry (cache, index);
+  list_unlink (cache, index);
+  hash_unlink (cache, index);
   cache->num_entries--;
-  int i;
-  for (i = index; i < cache->num_entries; i++)
-    cache->entries [i] = cache->entries [i + 1];
+  /* keep the entries contiguous, for cache_get_match and cache_random */
+  if (index < cache->num_entries)
+    move_entry (cache, cache->num_entries, index);
   return 1;
 }
 
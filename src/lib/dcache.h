@@ -20,6 +20,14 @@ typedef void (* release_function) (void * data);
 extern void * cache_init  (int max_entries, release_function f,
                            const char * caller_name);
 
+/* a cache whose entries may be looked up by key in constant time with
+ * cache_get_hashed.  The hash function computes the hash of an entry's
+ * key from its data, and must give the same value for the same data as
+ * long as the data is in the cache */
+typedef unsigned int (* hash_function) (void * data);
+extern void * cache_init_hashed (int max_entries, release_function f,
+                                 hash_function h, const char * caller_name);
+
 extern void cache_close (void * cache);
 
 /* function to determine whether to return a given entry */
@@ -39,6 +47,11 @@ extern void * cache_get_match (void * cache, match_function f, void * arg1);
  * if there is no match, returns 0 and array is set to NULL */
 extern int cache_all_matches (void * cache, match_function f, void * arg1,
                               void *** array);
+/* return a matching element among those whose data hashes to the given
+ * value, or NULL if there is none.  If the cache was not created by
+ * cache_init_hashed, the same as cache_get_match */
+extern void * cache_get_hashed (void * cache, unsigned int hash,
+                                match_function f, void * arg1);
 
 /* function to call on every element */
 typedef void (* map_function) (void * arg1, void * data);
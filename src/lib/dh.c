@@ -15,6 +15,13 @@
 #define DH448_BITS	(DH448_SIZE * 8)  /* 448 */
 #define DH448_WORDS	(DH448_SIZE / 8)  /* 7 */
 
+/* with 128-bit products, field elements are kept as 8 limbs of 56 bits,
+ * least significant first, with lazy reduction.  Otherwise the
+ * (much slower) generic wp_arith functions are used */
+#ifdef __SIZEOF_INT128__
+#define DH448_RADIX_56
+#endif /* __SIZEOF_INT128__ */
+
 static int zero_if_all_zeros (const char * data)
 {
   int i;
@@ -24,6 +31,7 @@ static int zero_if_all_zeros (const char * data)
   return ((r == 0) ? 0 : 1);
 }
 
+#if (! defined (DH448_RADIX_56)) || defined (TEST_ALLNET_DH)
 /* sets a to 2^448 - 2^224 - 1 */
 static void prime_p (uint64_t * a)
 {
@@ -51,14 +59,9 @@ static void cswap(int do_swap, uint64_t * a, uint64_t * b)
   }
 }
 
-/* all arrays must have size DH448_SIZE.
- * k is the scalar, u is the u-coordinate.
- * given a u5 (the last byte is 5 and the rest are 0) and a random secret r,
- * each party sends to the other side allnet_x448(r, u5).
- * upon receiving from the other side an authenticated s, each side
- * computes the shared secret key as k = allnet_x448(r, s).
- * the call returns 0 if the result is 0, and 1 otherwise */
-int allnet_x448 (const char * k_bytes, const char * u_bytes, char * result)
+/* the original implementation, using the generic wp_arith functions */
+static int x448_generic (const char * k_bytes, const char * u_bytes,
+                         char * result)
 {
   uint64_t k [DH448_WORDS];
   wp_from_bytes (DH448_BITS, k, DH448_SIZE, k_bytes);
@@ -156,6 +159,327 @@ int allnet_x448 (const char * k_bytes, const char * u_bytes, char * result)
 
   return zero_if_all_zeros (result);
 }
+#endif /* ! DH448_RADIX_56 || TEST_ALLNET_DH */
+
+#ifdef DH448_RADIX_56
+#define FE_LIMBS	8
+#define FE_BITS		56
+#define FE_MASK		((((uint64_t) 1) << FE_BITS) - 1)
+
+typedef uint64_t fe448 [FE_LIMBS];
+typedef unsigned __int128 fe_wide;
+
+/* p = 2^448 - 2^224 - 1, so 2^448 = 2^224 + 1 (mod p), that is, a carry
+ * out of limb 7 is added to limbs 0 and 4.
+ * fe_mul, fe_sq, fe_mul_small and fe_sub return limbs < 2^57.
+ * fe_add does not reduce, so its results (< 2^58) may only be used
+ * as inputs to fe_mul and fe_sq, which accept limbs up to 2^59 */
+
+/* p's limbs are all 2^56 - 1, except limb 4, which is 2^56 - 2 */
+static uint64_t fe_p_limb (int i)
+{
+  return (i == 4) ? (FE_MASK - 1) : FE_MASK;
+}
+
+/* c has 15 wide limbs, with products of limbs < 2^59.  The result has
+ * limbs < 2^57 */
+static void fe_reduce_wide (uint64_t * r, fe_wide * c)
+{
+  int i;
+  for (i = 6; i >= 0; i--) {   /* c [8 + i] * 2^448 = c [8 + i] * 2^224 + 1 */
+    c [i] += c [8 + i];
+    c [i + 4] += c [8 + i];
+  }
+  for (i = 0; i < FE_LIMBS - 1; i++) {
+    c [i + 1] += c [i] >> FE_BITS;
+    c [i] &= FE_MASK;
+  }
+  fe_wide top = c [7] >> FE_BITS;
+  c [7] &= FE_MASK;
+  c [0] += top;
+  c [4] += top;
+  c [1] += c [0] >> FE_BITS;
+  c [0] &= FE_MASK;
+  c [5] += c [4] >> FE_BITS;
+  c [4] &= FE_MASK;
+  for (i = 0; i < FE_LIMBS; i++)
+    r [i] = (uint64_t) c [i];
+}
+
+/* the products are written out, since compilers generally do not unroll
+ * the equivalent loops, and keeping the limbs in registers is roughly
+ * twice as fast */
+#define FE_M(x, y)	(((fe_wide) (x)) * (y))
+
+static void fe_mul (uint64_t * r, const uint64_t * a, const uint64_t * b)
+{
+  uint64_t a0 = a [0], a1 = a [1], a2 = a [2], a3 = a [3],
+           a4 = a [4], a5 = a [5], a6 = a [6], a7 = a [7];
+  uint64_t b0 = b [0], b1 = b [1], b2 = b [2], b3 = b [3],
+           b4 = b [4], b5 = b [5], b6 = b [6], b7 = b [7];
+  fe_wide c [2 * FE_LIMBS - 1];
+  c [0] = FE_M (a0, b0);
+  c [1] = FE_M (a0, b1) + FE_M (a1, b0);
+  c [2] = FE_M (a0, b2) + FE_M (a1, b1) + FE_M (a2, b0);
+  c [3] = FE_M (a0, b3) + FE_M (a1, b2) + FE_M (a2, b1) + FE_M (a3, b0);
+  c [4] = FE_M (a0, b4) + FE_M (a1, b3) + FE_M (a2, b2) + FE_M (a3, b1) +
+          FE_M (a4, b0);
+  c [5] = FE_M (a0, b5) + FE_M (a1, b4) + FE_M (a2, b3) + FE_M (a3, b2) +
+          FE_M (a4, b1) + FE_M (a5, b0);
+  c [6] = FE_M (a0, b6) + FE_M (a1, b5) + FE_M (a2, b4) + FE_M (a3, b3) +
+          FE_M (a4, b2) + FE_M (a5, b1) + FE_M (a6, b0);
+  c [7] = FE_M (a0, b7) + FE_M (a1, b6) + FE_M (a2, b5) + FE_M (a3, b4) +
+          FE_M (a4, b3) + FE_M (a5, b2) + FE_M (a6, b1) + FE_M (a7, b0);
+  c [8] = FE_M (a1, b7) + FE_M (a2, b6) + FE_M (a3, b5) + FE_M (a4, b4) +
+          FE_M (a5, b3) + FE_M (a6, b2) + FE_M (a7, b1);
+  c [9] = FE_M (a2, b7) + FE_M (a3, b6) + FE_M (a4, b5) + FE_M (a5, b4) +
+          FE_M (a6, b3) + FE_M (a7, b2);
+  c [10] = FE_M (a3, b7) + FE_M (a4, b6) + FE_M (a5, b5) + FE_M (a6, b4) +
+           FE_M (a7, b3);
+  c [11] = FE_M (a4, b7) + FE_M (a5, b6) + FE_M (a6, b5) + FE_M (a7, b4);
+  c [12] = FE_M (a5, b7) + FE_M (a6, b6) + FE_M (a7, b5);
+  c [13] = FE_M (a6, b7) + FE_M (a7, b6);
+  c [14] = FE_M (a7, b7);
+  fe_reduce_wide (r, c);
+}
+
+/* same as fe_mul (r, a, a), computing each cross product only once */
+static void fe_sq (uint64_t * r, const uint64_t * a)
+{
+  uint64_t a0 = a [0], a1 = a [1], a2 = a [2], a3 = a [3],
+           a4 = a [4], a5 = a [5], a6 = a [6], a7 = a [7];
+  /* twice the limbs, < 2^60 */
+  uint64_t d0 = 2 * a0, d1 = 2 * a1, d2 = 2 * a2, d3 = 2 * a3,
+           d4 = 2 * a4, d5 = 2 * a5, d6 = 2 * a6;
+  fe_wide c [2 * FE_LIMBS - 1];
+  c [0] = FE_M (a0, a0);
+  c [1] = FE_M (d0, a1);
+  c [2] = FE_M (d0, a2) + FE_M (a1, a1);
+  c [3] = FE_M (d0, a3) + FE_M (d1, a2);
+  c [4] = FE_M (d0, a4) + FE_M (d1, a3) + FE_M (a2, a2);
+  c [5] = FE_M (d0, a5) + FE_M (d1, a4) + FE_M (d2, a3);
+  c [6] = FE_M (d0, a6) + FE_M (d1, a5) + FE_M (d2, a4) + FE_M (a3, a3);
+  c [7] = FE_M (d0, a7) + FE_M (d1, a6) + FE_M (d2, a5) + FE_M (d3, a4);
+  c [8] = FE_M (d1, a7) + FE_M (d2, a6) + FE_M (d3, a5) + FE_M (a4, a4);
+  c [9] = FE_M (d2, a7) + FE_M (d3, a6) + FE_M (d4, a5);
+  c [10] = FE_M (d3, a7) + FE_M (d4, a6) + FE_M (a5, a5);
+  c [11] = FE_M (d4, a7) + FE_M (d5, a6);
+  c [12] = FE_M (d5, a7) + FE_M (a6, a6);
+  c [13] = FE_M (d6, a7);
+  c [14] = FE_M (a7, a7);
+  fe_reduce_wide (r, c);
+}
+#undef FE_M
+
+/* r = a^(2^n), n > 0 */
+static void fe_sq_n (uint64_t * r, const uint64_t * a, int n)
+{
+  fe_sq (r, a);
+  while (--n > 0)
+    fe_sq (r, r);
+}
+
+static void fe_mul_small (uint64_t * r, const uint64_t * a, uint64_t s)
+{
+  fe_wide c [2 * FE_LIMBS - 1];
+  int i;
+  for (i = 0; i < 2 * FE_LIMBS - 1; i++)
+    c [i] = 0;
+  for (i = 0; i < FE_LIMBS; i++)
+    c [i] = ((fe_wide) a [i]) * s;
+  fe_reduce_wide (r, c);
+}
+
+static void fe_add (uint64_t * r, const uint64_t * a, const uint64_t * b)
+{
+  int i;
+  for (i = 0; i < FE_LIMBS; i++)
+    r [i] = a [i] + b [i];
+}
+
+/* b must have limbs < 2^58 - 8, which is true of any result except
+ * that of fe_add.  Adding 4p keeps every limb positive */
+static void fe_sub (uint64_t * r, const uint64_t * a, const uint64_t * b)
+{
+  int i;
+  for (i = 0; i < FE_LIMBS; i++)
+    r [i] = a [i] + 4 * fe_p_limb (i) - b [i];
+  for (i = 0; i < FE_LIMBS - 1; i++) {
+    r [i + 1] += r [i] >> FE_BITS;
+    r [i] &= FE_MASK;
+  }
+  uint64_t top = r [7] >> FE_BITS;
+  r [7] &= FE_MASK;
+  r [0] += top;
+  r [4] += top;
+}
+
+static void fe_cswap (int do_swap, uint64_t * a, uint64_t * b)
+{
+  uint64_t swap_mask = (((uint64_t) 0) - ((uint64_t) do_swap));
+  int i;
+  for (i = 0; i < FE_LIMBS; i++) {
+    uint64_t dummy = swap_mask & (a [i] ^ b [i]);
+    a [i] ^= dummy;
+    b [i] ^= dummy;
+  }
+}
+
+/* r = a^(p-2) = 1/a, or 0 if a is 0.  p - 2 has 223 one bits, a zero bit,
+ * 222 one bits, a zero bit, and a one bit.  t_n is a^(2^n - 1) */
+static void fe_invert (uint64_t * r, const uint64_t * a)
+{
+  fe448 t2, t3, t6, t12, t24, t30, t48, t96, t192, t222, t223, t;
+  fe_sq (t, a);
+  fe_mul (t2, t, a);
+  fe_sq (t, t2);
+  fe_mul (t3, t, a);
+  fe_sq_n (t, t3, 3);
+  fe_mul (t6, t, t3);
+  fe_sq_n (t, t6, 6);
+  fe_mul (t12, t, t6);
+  fe_sq_n (t, t12, 12);
+  fe_mul (t24, t, t12);
+  fe_sq_n (t, t24, 6);
+  fe_mul (t30, t, t6);
+  fe_sq_n (t, t24, 24);
+  fe_mul (t48, t, t24);
+  fe_sq_n (t, t48, 48);
+  fe_mul (t96, t, t48);
+  fe_sq_n (t, t96, 96);
+  fe_mul (t192, t, t96);
+  fe_sq_n (t, t192, 30);
+  fe_mul (t222, t, t30);
+  fe_sq (t, t222);
+  fe_mul (t223, t, a);
+  fe_sq_n (t, t223, 223);       /* 223 ones, one zero, 222 zeros */
+  fe_mul (t, t, t222);          /* 223 ones, one zero, 222 ones */
+  fe_sq_n (t, t, 2);
+  fe_mul (r, t, a);             /* ..., one zero, and a one */
+}
+
+/* the unique representative of a in 0..p-1 */
+static void fe_freeze (uint64_t * a)
+{
+  int pass, i;
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < FE_LIMBS - 1; i++) {
+      a [i + 1] += a [i] >> FE_BITS;
+      a [i] &= FE_MASK;
+    }
+    uint64_t top = a [7] >> FE_BITS;
+    a [7] &= FE_MASK;
+    a [0] += top;
+    a [4] += top;
+  }
+  /* now a < 2^448 < 2p, so subtract p once if a >= p */
+  fe448 s;
+  uint64_t borrow = 0;
+  for (i = 0; i < FE_LIMBS; i++) {
+    uint64_t diff = a [i] - fe_p_limb (i) - borrow;
+    s [i] = diff & FE_MASK;
+    borrow = diff >> 63;
+  }
+  uint64_t keep_a = ((uint64_t) 0) - borrow;   /* all ones if a < p */
+  for (i = 0; i < FE_LIMBS; i++)
+    a [i] = (a [i] & keep_a) | (s [i] & ~keep_a);
+}
+
+/* the bytes are big-endian, limb 0 is the least significant */
+static void fe_from_bytes (uint64_t * r, const char * bytes)
+{
+  const unsigned char * b = (const unsigned char *) bytes;
+  int i, j;
+  for (i = 0; i < FE_LIMBS; i++) {
+    r [i] = 0;
+    for (j = 0; j < FE_BITS / 8; j++)
+      r [i] |= ((uint64_t) b [DH448_SIZE - 1 - 7 * i - j]) << (8 * j);
+  }
+}
+
+static void fe_to_bytes (char * bytes, const uint64_t * a)
+{
+  int i, j;
+  for (i = 0; i < FE_LIMBS; i++)
+    for (j = 0; j < FE_BITS / 8; j++)
+      bytes [DH448_SIZE - 1 - 7 * i - j] = (char) ((a [i] >> (8 * j)) & 0xff);
+}
+
+/* the same ladder as x448_generic */
+static int x448_radix_56 (const char * k_bytes, const char * u_bytes,
+                          char * result)
+{
+  const unsigned char * k = (const unsigned char *) k_bytes;
+  fe448 x1, x2, z2, x3, z3;
+  fe_from_bytes (x1, u_bytes);
+  memset (x2, 0, sizeof (x2));
+  x2 [0] = 1;
+  memset (z2, 0, sizeof (z2));
+  memcpy (x3, x1, sizeof (x3));
+  memset (z3, 0, sizeof (z3));
+  z3 [0] = 1;
+  int swap = 0;
+
+  int t;
+  for (t = DH448_BITS - 1; t >= 0; t--) {
+    int k_t = (k [DH448_SIZE - 1 - t / 8] >> (t % 8)) & 1;
+    swap ^= k_t;
+    fe_cswap (swap, x2, x3);
+    fe_cswap (swap, z2, z3);
+    swap = k_t;
+
+    fe448 A, AA, B, BB, E, C, D, DA, CB, sum, diff, a24E;
+    fe_add (A, x2, z2);
+    fe_sq (AA, A);
+    fe_sub (B, x2, z2);
+    fe_sq (BB, B);
+    fe_sub (E, AA, BB);
+    fe_add (C, x3, z3);
+    fe_sub (D, x3, z3);
+    fe_mul (DA, D, A);
+    fe_mul (CB, C, B);
+    fe_add (sum, DA, CB);
+    fe_sq (x3, sum);                      /* (DA+CB)^2 */
+    fe_sub (diff, DA, CB);
+    fe_sq (diff, diff);                   /* (DA-CB)^2 */
+    fe_mul (z3, x1, diff);
+    fe_mul (x2, AA, BB);
+    fe_mul_small (a24E, E, 39081);
+    /* see the comment in x448_generic for the choice of AA or BB */
+#ifdef RFC_7748_STD   /* use AA instead of BB */
+    fe_add (sum, AA, a24E);
+#else /* use BB instead of AA, as per the errata to the RFC and as in openssl */
+    fe_add (sum, BB, a24E);
+#endif /* RFC_7748_STD */
+    fe_mul (z2, E, sum);
+  }
+  fe_cswap (swap, x2, x3);
+  fe_cswap (swap, z2, z3);
+  fe448 inverse, r;
+  fe_invert (inverse, z2);
+  fe_mul (r, x2, inverse);
+  fe_freeze (r);
+  fe_to_bytes (result, r);
+
+  return zero_if_all_zeros (result);
+}
+#endif /* DH448_RADIX_56 */
+
+/* all arrays must have size DH448_SIZE.
+ * k is the scalar, u is the u-coordinate.
+ * given a u5 (the last byte is 5 and the rest are 0) and a random secret r,
+ * each party sends to the other side allnet_x448(r, u5).
+ * upon receiving from the other side an authenticated s, each side
+ * computes the shared secret key as k = allnet_x448(r, s).
+ * the call returns 0 if the result is 0, and 1 otherwise */
+int allnet_x448 (const char * k_bytes, const char * u_bytes, char * result)
+{
+#ifdef DH448_RADIX_56
+  return x448_radix_56 (k_bytes, u_bytes, result);
+#else /* DH448_RADIX_56 */
+  return x448_generic (k_bytes, u_bytes, result);
+#endif /* DH448_RADIX_56 */
+}
 
 /* turn a randomly-generated string into a value that can be used with x448
  * (decodeScalar448 in RFC 7748) */
@@ -503,7 +827,32 @@ int main (int argc, char ** argv)
     printf ("success: alice's and bob's shared secret are both:\n");
     print_buffer (k_alice, sizeof (k_alice), NULL, 100, 1);
   }
-  
+
+#ifdef DH448_RADIX_56
+  printf ("\ncomparison with the generic implementation:\n");
+  int errors = 0;
+  int count = 200;
+  for (i = 0; i < count; i++) {
+    char k [DH448_SIZE];
+    char u [DH448_SIZE];
+    int j;
+    for (j = 0; j < DH448_SIZE; j++) {
+      k [j] = (char) (i * 37 + j * 101 + 3);
+      u [j] = (char) ((i == 0) ? 0xff : (i * 59 + j * j + 11));
+    }
+    allnet_x448_make_valid (k);
+    char r1 [DH448_SIZE];
+    char r2 [DH448_SIZE];
+    int v1 = x448_radix_56 (k, u, r1);
+    int v2 = x448_generic (k, u, r2);
+    if ((v1 != v2) || (memcmp (r1, r2, DH448_SIZE) != 0)) {
+      print_buffer (r1, DH448_SIZE, "radix 56 result", 100, 1);
+      print_buffer (r2, DH448_SIZE, " generic result", 100, 1);
+      errors++;
+    }
+  }
+  printf ("%d differences in %d comparisons\n", errors, count);
+#endif /* DH448_RADIX_56 */
 }
 
 #endif /* TEST_ALLNET_DH */
@@ -0,0 +1,136 @@
+/* handoff.c: hand the sockets of a running ad over to a new one */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "configfiles.h"
+
+/* returns 1 and fills in the address if the path fits, 0 otherwise */
+static int handoff_address (struct sockaddr_un * sun)
+{
+  char * fname = NULL;
+  if ((config_file_name ("ad", "handoff", &fname, 1) <= 0) || (fname == NULL))
+    return 0;
+  memset (sun, 0, sizeof (struct sockaddr_un));
+  sun->sun_family = AF_UNIX;
+  int fits = (strlen (fname) < sizeof (sun->sun_path));
+  if (fits)
+    strcpy (sun->sun_path, fname);
+  else
+    printf ("handoff: path %s is too long for a unix socket\n", fname);
+  free (fname);
+  return fits;
+}
+
+int handoff_listen (void)
+{
+  struct sockaddr_un sun;
+  if (! handoff_address (&sun))
+    return -1;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror ("handoff_listen socket");
+    return -1;
+  }
+  unlink (sun.sun_path);   /* left over from an earlier ad */
+  mode_t old_mask = umask (077);   /* only this user may connect */
+  int bound = bind (fd, (struct sockaddr *) &sun, sizeof (sun));
+  umask (old_mask);
+  if ((bound != 0) || (listen (fd, 1) != 0)) {
+    perror ("handoff_listen bind/listen");
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+int handoff_send (int conn, const struct handoff_socket * sockets,
+                  int num_sockets)
+{
+  if ((num_sockets <= 0) || (num_sockets > HANDOFF_MAX_SOCKETS))
+    return 0;
+  struct iovec iov = { .iov_base = (void *) sockets,
+                       .iov_len = num_sockets * sizeof (sockets [0]) };
+  char control [CMSG_SPACE (HANDOFF_MAX_SOCKETS * sizeof (int))];
+  memset (control, 0, sizeof (control));
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE (num_sockets * sizeof (int));
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (num_sockets * sizeof (int));
+  int * fds = (int *) CMSG_DATA (cmsg);
+  int i;
+  for (i = 0; i < num_sockets; i++)
+    fds [i] = sockets [i].sockfd;
+  if (sendmsg (conn, &msg, 0) != (ssize_t) iov.iov_len) {
+    perror ("handoff_send sendmsg");
+    return 0;
+  }
+  return 1;
+}
+
+int handoff_receive (struct handoff_socket * sockets, int max)
+{
+  struct sockaddr_un sun;
+  if (! handoff_address (&sun))
+    return 0;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror ("handoff_receive socket");
+    return 0;
+  }
+  if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) != 0) {
+    close (fd);     /* no running ad */
+    return 0;
+  }
+  struct handoff_socket received [HANDOFF_MAX_SOCKETS];
+  struct iovec iov = { .iov_base = received, .iov_len = sizeof (received) };
+  char control [CMSG_SPACE (HANDOFF_MAX_SOCKETS * sizeof (int))];
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  ssize_t n;
+  do {   /* the running ad saves its state before sending */
+    n = recvmsg (fd, &msg, 0);
+  } while ((n < 0) && (errno == EINTR));
+  int count = 0;
+  struct cmsghdr * cmsg = ((n > 0) ? CMSG_FIRSTHDR (&msg) : NULL);
+  if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+      (cmsg->cmsg_type == SCM_RIGHTS)) {
+    int num_fds = (int) ((cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int));
+    int num_records = (int) (n / sizeof (received [0]));
+    int * fds = (int *) CMSG_DATA (cmsg);
+    int i;
+    for (i = 0; i < num_fds; i++) {
+      if ((i < num_records) && (count < max)) {
+        sockets [count] = received [i];
+        sockets [count].sockfd = fds [i];  /* our number for the socket */
+        count++;
+      } else {
+        close (fds [i]);
+      }
+    }
+  }
+  char c;    /* wait for the running ad to close its copies */
+  do {
+    n = read (fd, &c, 1);
+  } while ((n > 0) || ((n < 0) && (errno == EINTR)));
+  close (fd);
+  return count;
+}
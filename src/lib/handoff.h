@@ -0,0 +1,36 @@
+/* handoff.h: hand the sockets of a running ad over to a new one, so
+ * that ad can be restarted (e.g. upgraded) without losing packets */
+
+#ifndef ALLNET_HANDOFF_H
+#define ALLNET_HANDOFF_H
+
+/* the running ad listens on the unix socket ~/.allnet/ad/handoff.
+ * A new allnetd (astart -R) connects and receives the sockets, after
+ * the running ad has saved its state.  The running ad then closes its
+ * copies of the sockets and the connection, and stops.  The new ad uses
+ * the sockets it was given rather than binding new ones, so any packets
+ * arriving in the meantime are queued in the sockets rather than lost. */
+
+#define HANDOFF_MAX_SOCKETS	16
+
+struct handoff_socket {
+  int sockfd;
+  int is_local;
+  int is_global_v6;
+  int is_global_v4;
+};
+
+/* returns the listening socket, or -1 for errors */
+extern int handoff_listen (void);
+
+/* sends the sockets over the connection (accepted from the listening
+ * socket).  Returns 1 for success, 0 for failure */
+extern int handoff_send (int conn, const struct handoff_socket * sockets,
+                         int num_sockets);
+
+/* connects to the running ad, receives its sockets, and waits for the
+ * running ad to close the connection.  Returns the number of sockets
+ * received (at most max), or 0 if there is no running ad to hand over */
+extern int handoff_receive (struct handoff_socket * sockets, int max);
+
+#endif /* ALLNET_HANDOFF_H */
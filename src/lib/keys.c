@@ -66,6 +66,10 @@ struct key_info {
   struct key_address local;          /* only defined if not a group */
   struct key_address remote;         /* only defined if not a group */
   char * dir_name;
+/* to start quickly with many contacts, the public/private keys are only
+ * read from dir_name (and the local DH public key computed) by load_keys,
+ * when first needed.  keys_pending is 1 until then */
+  int keys_pending;
   int num_group_members;             /* >= 0, only defined if is_group */
   char ** members;                   /* only defined if num_members > 0 */
 /* symmetric keys are useful for encrypting larger amounts of data,
@@ -79,6 +83,10 @@ struct key_info {
  * but usually will be. */
   int has_send_state;
   struct allnet_stream_encryption_state send_state;
+/* the file send_state has a counter KEY_STATE_RESERVE ahead of the
+ * counter when it was written, so it need not be written again until
+ * send_state.counter reaches send_reserved.  0 if not yet saved */
+  uint64_t send_reserved;
   int has_receive_state;
   struct allnet_stream_encryption_state receive_state;
 };
@@ -91,6 +99,136 @@ static int num_key_infos = 0;
 static char * * cpx = NULL;
 static int cp_used = 0;
 
+/* incremented whenever contacts or keysets are added, deleted, or
+ * changed, so other modules can tell when to update what they derive
+ * from them */
+static unsigned long long int generation = 0;
+
+/* contacts are looked up by name many times for each packet, so rather
+ * than compare the name to every entry, names are kept in hash indices.
+ * Each index records (name, value) pairs.  A slot of the hash table
+ * holds (one more than) the first record for a name, and records with
+ * the same name are chained in the order they were added.
+ * The names point into kip and cpx, so the indices must be rebuilt
+ * (with rebuild_indices) whenever a name or group member changes */
+struct name_index {
+  int num_slots;          /* a power of two, at least twice num_records */
+  int * slots;            /* 0 if free, otherwise 1 + index of a record */
+  int num_records;
+  const char ** names;
+  int * values;
+  int * next;             /* next record with the same name, or -1 */
+  int * last;             /* for the first record of each name, the last */
+};
+
+static struct name_index by_cpx;     /* cpx [i] -> i */
+static struct name_index by_name;    /* kip [i].contact_name -> i */
+static struct name_index by_member;  /* group member -> kip index of group */
+
+static unsigned int hash_name (const char * name)
+{
+  unsigned int result = 2166136261U;   /* 32-bit FNV-1a */
+  while (*name != '\0')
+    result = (result ^ ((unsigned char) (*(name++)))) * 16777619U;
+  return result;
+}
+
+static void clear_index (struct name_index * ni)
+{
+  if (ni->slots != NULL)
+    free (ni->slots);
+  if (ni->names != NULL)
+    free (ni->names);
+  memset (ni, 0, sizeof (struct name_index));
+}
+
+/* allocates room for up to max_records */
+static void init_index (struct name_index * ni, int max_records)
+{
+  clear_index (ni);
+  int slots = 16;
+  while (slots < 2 * max_records)
+    slots *= 2;
+  ni->num_slots = slots;
+  ni->slots = malloc_or_fail (slots * sizeof (int), "init_index slots");
+  memset (ni->slots, 0, slots * sizeof (int));
+  /* names, values, next, and last share one allocation */
+  size_t per_record = sizeof (char *) + 3 * sizeof (int);
+  char * mem = malloc_or_fail (per_record * (max_records + 1), "init_index");
+  ni->names = (const char **) mem;
+  ni->values = (int *) (mem + sizeof (char *) * (max_records + 1));
+  ni->next = ni->values + (max_records + 1);
+  ni->last = ni->next + (max_records + 1);
+}
+
+/* returns the slot that has, or should have, the first record for name */
+static int find_slot (struct name_index * ni, const char * name)
+{
+  int mask = ni->num_slots - 1;
+  int slot = hash_name (name) & mask;
+  while ((ni->slots [slot] != 0) &&
+         (strcmp (ni->names [ni->slots [slot] - 1], name) != 0))
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+/* the index must have been initialized with room for this record */
+static void index_add (struct name_index * ni, const char * name, int value)
+{
+  int record = ni->num_records++;
+  ni->names [record] = name;
+  ni->values [record] = value;
+  ni->next [record] = -1;
+  int slot = find_slot (ni, name);
+  if (ni->slots [slot] == 0) {
+    ni->slots [slot] = record + 1;
+    ni->last [record] = record;
+  } else {
+    int first = ni->slots [slot] - 1;
+    ni->next [ni->last [first]] = record;
+    ni->last [first] = record;
+  }
+}
+
+/* returns the first record with this name, or -1.  To loop over all
+ * the records with the name, follow ni->next until it is -1 */
+static int index_first (struct name_index * ni, const char * name)
+{
+  if ((name == NULL) || (ni->num_slots == 0))
+    return -1;
+  return ni->slots [find_slot (ni, name)] - 1;
+}
+
+/* must be called after any change to cpx or to the names or members
+ * in kip */
+static void rebuild_indices ()
+{
+  generation++;   /* names or group members may have changed */
+  int i;
+  init_index (&by_cpx, cp_used);
+  for (i = 0; i < cp_used; i++)
+    if (cpx [i] != NULL)
+      index_add (&by_cpx, cpx [i], i);
+  init_index (&by_name, num_key_infos);
+  int num_members = 0;
+  for (i = 0; i < num_key_infos; i++) {
+    if (kip [i].contact_name == NULL)
+      continue;
+    index_add (&by_name, kip [i].contact_name, i);
+    if ((kip [i].is_group) && (kip [i].num_group_members > 0))
+      num_members += kip [i].num_group_members;
+  }
+  init_index (&by_member, num_members);
+  for (i = 0; i < num_key_infos; i++) {
+    if ((kip [i].contact_name != NULL) && (kip [i].is_group) &&
+        (kip [i].num_group_members > 0) && (kip [i].members != NULL)) {
+      int m;
+      for (m = 0; m < kip [i].num_group_members; m++)
+        index_add (&by_member, kip [i].members [m], i);
+    }
+  }
+}
+
 #ifdef DEBUG_PRINT
 static void print_contacts (char * desc, int individual_only)
 {
@@ -107,16 +245,10 @@ static void print_contacts (char * desc, int individual_only)
  * contact's index in cp */
 static int contact_exists (const char * contact)
 {
-  if (contact == NULL)
+  int record = index_first (&by_cpx, contact);
+  if (record < 0)
     return 0;
-  int i;
-  for (i = 0; i < cp_used; i++) {
-    if (strcmp (cpx [i], contact) == 0)
-      return i + 1;
-    /* else
-      printf ("%d: %s does not match %s\n", i, contact, cp [i]); */
-  }
-  return 0;
+  return by_cpx.values [record] + 1;
 }
 
 static int valid_keyset (keyset k)
@@ -128,20 +260,24 @@ static void generate_contacts ()
 {
   int ki = 0;
   cp_used = 0;
+  init_index (&by_cpx, num_key_infos);  /* so contact_exists finds these */
   for (ki = 0; ki < num_key_infos; ki++) {
     if (kip [ki].contact_name != NULL) {
       int index_plus_one = contact_exists (kip [ki].contact_name);
       if (index_plus_one == 0) {  /* the normal case */
-        cpx [cp_used++] = kip [ki].contact_name;
+        cpx [cp_used] = kip [ki].contact_name;
       } else {                    /* duplicate name */
         printf ("duplicate name %s found at indices %d and %d\n",
                 kip [ki].contact_name, index_plus_one - 1, cp_used);
         char * dname = strcat_malloc (kip [ki].contact_name, " (duplicate)",
                                       "generate_contacts in keys.c");
-        cpx [cp_used++] = dname;
+        cpx [cp_used] = dname;
       }
+      index_add (&by_cpx, cpx [cp_used], cp_used);
+      cp_used++;
     }
   }
+  rebuild_indices ();
 }
 
 static void set_kip_size (int size)
@@ -336,6 +472,34 @@ static int read_dh_file (const char * basename, const char * name, char * dh)
   return 1;
 }
 
+/* reads the keys of a contact loaded by read_key_info, if not yet read */
+static void load_keys (struct key_info * ki)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  /* quick check, check again with the mutex.  The acquire pairs with the
+   * release below, so the keys are visible once keys_pending is 0 */
+  if (! __atomic_load_n (&(ki->keys_pending), __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock (&mutex);
+  if ((ki->keys_pending) && (ki->dir_name != NULL)) {
+    char * kname = strcat_malloc (ki->dir_name, "/my_key", "load_keys 1");
+    if (allnet_rsa_read_prvkey (kname, &(ki->my_key))) {
+      char * pname = strcat_malloc (ki->dir_name, "/contact_pubkey",
+                                    "load_keys 2");
+      ki->has_pub_key = allnet_rsa_read_pubkey (pname, &(ki->contact_pubkey));
+      free (pname);
+    }
+    free (kname);
+    if (ki->has_local_dh) {
+      char local_secret [DH448_SIZE];
+      memcpy (local_secret, ki->local_dh, DH448_SIZE);
+      set_local_dh (ki, local_secret);
+    }
+  }
+  __atomic_store_n (&(ki->keys_pending), 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&mutex);
+}
+
 /* return 1 for success, 0 for failure */
 static int read_symmetric_state (char * fname,
                                  struct allnet_stream_encryption_state * state)
@@ -519,21 +683,18 @@ static int read_key_info (const char * path, const char * file,
     result = 2;  /* found a group */
   } else {  /* it's not a group */
     if (info != NULL) {
+      /* the keys themselves are read by load_keys */
       char * kname = strcat_malloc (basename, "/my_key", "my key name");
-      if (allnet_rsa_read_prvkey (kname, &(info->my_key))) {
-        char * pname = strcat_malloc (basename, "/contact_pubkey", "pub name");
-        info->has_pub_key =
-          allnet_rsa_read_pubkey (pname, &(info->contact_pubkey));
-        free (pname);
+      if (file_size (kname) > 0) {
         read_address_file (basename, "local", &(info->local));
         read_address_file (basename, "remote", &(info->remote));
       }
       free (kname);
-      char local_secret [DH448_SIZE];
-      if (read_dh_file (basename, "local_dh", local_secret))
-        set_local_dh (info, local_secret);
+      if (read_dh_file (basename, "local_dh", info->local_dh))
+        info->has_local_dh = 1;
       info->has_shared_dh =
         read_dh_file (basename, "shared_dh", info->shared_dh);
+      info->keys_pending = 1;
     }
   }
   if (info != NULL) {
@@ -566,7 +727,7 @@ static int read_key_info (const char * path, const char * file,
         info->has_send_state = 1;
       free (sname);
       char * rname = strcat_malloc (basename, "/receive_state", "symm state 2");
-      if (read_symmetric_state (sname, &(info->receive_state)))
+      if (read_symmetric_state (rname, &(info->receive_state)))
         info->has_receive_state = 1;
       free (rname);
     }
@@ -578,6 +739,89 @@ static int read_key_info (const char * path, const char * file,
   return result;
 }
 
+/* contact directories are read by up to this many threads, one per
+ * processor (unless set by keys_load_threads), but only if there are
+ * at least KEYS_PARALLEL_MIN contacts */
+#define KEYS_MAX_LOAD_THREADS	8
+#define KEYS_PARALLEL_MIN	64
+static int load_threads = 0;   /* 0 to use one per processor */
+
+void keys_load_threads (int nthreads)
+{
+  load_threads = ((nthreads > KEYS_MAX_LOAD_THREADS) ? KEYS_MAX_LOAD_THREADS
+                                                     : nthreads);
+}
+
+struct load_keys_arg {
+  const char * dirname;
+  char ** files;
+  int num_files;
+  int first;           /* this thread reads first, first + step, ... */
+  int step;
+  struct key_info * infos;
+  int * loaded;
+};
+
+static void * load_key_infos (void * arg)
+{
+  struct load_keys_arg * a = (struct load_keys_arg *) arg;
+  int i;
+  for (i = a->first; i < a->num_files; i += a->step) {
+    a->loaded [i] = read_key_info (a->dirname, a->files [i], a->infos + i);
+    if (! a->loaded [i])
+      printf ("error: unable to load key from .allnet/contacts/%s/\n",
+              a->files [i]);
+  }
+  return NULL;
+}
+
+/* reads the key directories into infos, in the same order as files,
+ * using several threads if there are many.  Returns the number read */
+static int read_key_infos (const char * dirname, char ** files, int num_files,
+                           struct key_info * infos)
+{
+  int nthreads = load_threads;
+  if (nthreads <= 0) {
+    long int ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    nthreads = ((ncpus > KEYS_MAX_LOAD_THREADS) ? KEYS_MAX_LOAD_THREADS
+                                                : (int) ncpus);
+  }
+  if ((nthreads <= 1) || (num_files < KEYS_PARALLEL_MIN))
+    nthreads = 1;
+  int * loaded = malloc_or_fail (sizeof (int) * num_files, "read_key_infos");
+  pthread_t threads [KEYS_MAX_LOAD_THREADS];
+  struct load_keys_arg args [KEYS_MAX_LOAD_THREADS];
+  int started = 0;
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    args [i].dirname = dirname;
+    args [i].files = files;
+    args [i].num_files = num_files;
+    args [i].first = i;
+    args [i].step = nthreads;
+    args [i].infos = infos;
+    args [i].loaded = loaded;
+  }
+  /* this thread reads the files for args [0], and for any threads that
+   * cannot be started */
+  while ((started + 1 < nthreads) &&
+         (pthread_create (threads + started, NULL, load_key_infos,
+                          args + started + 1) == 0))
+    started++;
+  for (i = started + 1; i < nthreads; i++)
+    load_key_infos (args + i);
+  load_key_infos (args);
+  for (i = 0; i < started; i++)
+    pthread_join (threads [i], NULL);
+  /* keep the ones that were read, in order */
+  int count = 0;
+  for (i = 0; i < num_files; i++)
+    if (loaded [i])
+      infos [count++] = infos [i];
+  free (loaded);
+  return count;
+}
+
 static void init_from_file (const char * debug)
 {
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -612,37 +856,43 @@ static void init_from_file (const char * debug)
     pthread_mutex_unlock (&mutex);
     return;
   }
-  int num_keys = 0;
+  /* list the key directories, then read them all */
+  int num_files = 0;
+  int max_files = 0;
+  char ** files = NULL;
   struct dirent * dep;
   while ((dep = readdir (dir)) != NULL) {
     if (is_ndigits (dep->d_name, DATE_TIME_LEN)) { /* key directory */
-      if (read_key_info (dirname, dep->d_name, NULL)) {
-        num_keys++;
-      } else {
-        printf ("error: unable to load key from .allnet/contacts/%s/\n",
-                dep->d_name);
+      if (num_files >= max_files) {
+        max_files = 2 * max_files + 16;
+        files = realloc (files, sizeof (char *) * max_files);
+        if (files == NULL) {
+          printf ("init_from_file unable to allocate %d files\n", max_files);
+          exit (1);
+        }
       }
+      files [num_files++] = strcpy_malloc (dep->d_name, "init_from_file");
     }
   }
+  closedir (dir);
 
   set_kip_size (0);  /* get rid of anything that was previously there */
-  if (num_keys > 0) {
-    set_kip_size (num_keys);  /* create new array */
-
-    /* now load the keys */
-    rewinddir (dir);
-    int i = 0;
-    while ((i < num_keys) && ((dep = readdir (dir)) != NULL)) {
-      /* this is only legal as long as i < num_keys */
-      kip [i].local.nbits = ADDRESS_SIZE * 8;
-      kip [i].remote.nbits = ADDRESS_SIZE * 8;
-      if ((is_ndigits (dep->d_name, DATE_TIME_LEN)) && /* is a key directory */
-          (read_key_info (dirname, dep->d_name, kip + i))) {
-        i++;
-      }
+  if (num_files > 0) {
+    struct key_info * infos =
+      malloc_or_fail (sizeof (struct key_info) * num_files, "init infos");
+    int num_keys = read_key_infos (dirname, files, num_files, infos);
+    if (num_keys > 0) {
+      set_kip_size (num_keys);  /* create new array */
+      int i;
+      for (i = 0; i < num_keys; i++)
+        kip [i] = infos [i];
     }
+    free (infos);
+    int i;
+    for (i = 0; i < num_files; i++)
+      free (files [i]);
+    free (files);
   }
-  closedir (dir);
   free (dirname);
   generate_contacts ();
 #ifdef TEST_GROUP_MEMBERSHIP
@@ -758,6 +1008,56 @@ int all_individual_contacts (char *** contacts)
   return all_contacts_implementation (contacts, 1);
 }
 
+/* changes whenever contacts or keysets are created, deleted, renamed,
+ * hidden, or their addresses or public/private keys are modified */
+unsigned long long int keys_generation ()
+{
+  init_from_file ("keys_generation");
+  return generation;
+}
+
+/* the lists returned by borrow_contacts and borrow_individual_contacts.
+ * Each is rebuilt, and the previous list freed, only the first time it
+ * is borrowed after the generation has changed */
+struct contacts_snapshot {
+  int valid;
+  unsigned long long int generation;
+  char ** contacts;
+  int count;
+};
+static struct contacts_snapshot snapshots [2];  /* [individual_only] */
+
+static int borrow_implementation (char *** contacts, int individual_only)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  init_from_file ("borrow_implementation");
+  pthread_mutex_lock (&mutex);
+  struct contacts_snapshot * s = snapshots + individual_only;
+  if ((! s->valid) || (s->generation != generation)) {
+    if (s->contacts != NULL)
+      free (s->contacts);
+    s->contacts = NULL;
+    s->count = all_contacts_implementation (&(s->contacts), individual_only);
+    s->generation = generation;
+    s->valid = 1;
+  }
+  if (contacts != NULL)
+    *contacts = s->contacts;
+  int result = s->count;
+  pthread_mutex_unlock (&mutex);
+  return result;
+}
+
+int borrow_contacts (char *** contacts)
+{
+  return borrow_implementation (contacts, 0);
+}
+
+int borrow_individual_contacts (char *** contacts)
+{
+  return borrow_implementation (contacts, 1);
+}
+
 #if 0
 static void callback (int type, int count, void * arg)
 {
@@ -852,6 +1152,7 @@ static void write_member_file (const char * fname, char ** members,
 
 static void save_contact (struct key_info * k)
 {
+  generation++;
   if (k->is_deleted) {
     printf ("not saving deleted contact %s\n", k->contact_name);
     return;
@@ -931,7 +1232,9 @@ static void save_contact (struct key_info * k)
 #endif /* DEBUG_PRINT */
 }
 
-static int count_spare_key_files ()
+/* if keybits > 0, only counts the spare keys of that size, which
+ * requires reading each key */
+static int count_spare_key_files (int keybits)
 {
   char * dirname;
   int dirnamesize = config_file_name ("own_spare_keys", "", &dirname, 0);
@@ -946,9 +1249,22 @@ static int count_spare_key_files ()
   int result = 0;
   while ((de = readdir (dir)) != NULL) {
   /* count it as long as it has the right length and doesn't begin with . */
-    if ((de->d_name [0] != '.') &&
-        (strlen (de->d_name) == DATE_TIME_LEN))
+    if ((de->d_name [0] == '.') || (strlen (de->d_name) != DATE_TIME_LEN))
+      continue;
+    if (keybits <= 0) {
       result++;
+      continue;
+    }
+    char * fname;
+    if (config_file_name ("own_spare_keys", de->d_name, &fname, 0) < 0)
+      continue;
+    allnet_rsa_prvkey key;
+    if (allnet_rsa_read_prvkey (fname, &key)) {
+      if (allnet_rsa_prvkey_size (key) == keybits / 8)
+        result++;
+      allnet_rsa_free_prvkey (key);
+    }
+    free (fname);
   }
   closedir (dir);
 #ifdef DEBUG_PRINT
@@ -990,7 +1306,7 @@ static allnet_rsa_prvkey get_spare_key (int keybits)
 {
   allnet_rsa_prvkey result;
   allnet_rsa_null_prvkey (&result);
-  if (count_spare_key_files () <= 0)
+  if (count_spare_key_files (0) <= 0)
     return result;
   char * dirname;
   int dirnamesize = config_file_name ("own_spare_keys", "", &dirname, 0);
@@ -1044,6 +1360,8 @@ static int do_set_contact_pubkey (struct key_info * k,
 int set_contact_pubkey (keyset k, char * contact_key, int contact_ksize)
 {
   init_from_file ("set_contact_pubkey");
+  if (valid_keyset (k))
+    load_keys (kip + k);
   if ((! valid_keyset (k)) ||
       (! allnet_rsa_pubkey_is_null (kip [k].contact_pubkey)) ||
       (contact_key == NULL) || (contact_ksize == 0))
@@ -1109,6 +1427,7 @@ keyset create_contact (const char * contact, int keybits,
     keyset k = index_plus_one - 1;
     struct key_info * ki = kip + k;
     if (! ki->is_deleted) {  /* contact exists */
+      load_keys (ki);
       if (allnet_rsa_pubkey_is_null (ki->contact_pubkey) &&
           ((ki->local.nbits == 0) || (loc_nbits == ki->local.nbits))) {
         if (local != NULL)
@@ -1187,8 +1506,9 @@ keyset create_contact (const char * contact, int keybits,
   else
     set_kip_size (new_contact + 1);   /* make room for the new entry */
   kip [new_contact] = new;
-  if (preselected_index < 0)          /* re-initialize the list */
-    generate_contacts ();
+  /* re-initialize the list, which also replaces any pointer in cpx to
+   * the name of a deleted contact we freed above */
+  generate_contacts ();
 
 #ifdef DEBUG_PRINT
 #ifdef HAVE_OPENSSL
@@ -1246,6 +1566,10 @@ int rename_contact (const char * old, const char * new)
       free (name_file_name);
     }
   }
+  if (renamed) {
+    rebuild_indices ();
+    generation++;
+  }
   return renamed;
 }
 
@@ -1300,6 +1624,8 @@ int make_invisible (const char * contact)
       hidden = 1;
     }
   }
+  if (hidden)
+    generation++;
   return hidden;
 }
 
@@ -1333,6 +1659,8 @@ int make_visible (const char * contact)
       free (file_name);
     }
   }
+  if (success)
+    generation++;
   return success;
 }
 
@@ -1383,6 +1711,7 @@ int delete_contact (const char * contact)
         rmdir_and_all_files (kip [key].dir_name);
         kip [key].is_deleted = 1;
         result = 1;
+        generation++;
       } else {
         return 0;
       }
@@ -1460,17 +1789,24 @@ int contact_file_delete (const char * contact, const char * fname)
 int create_spare_key (int keybits, char * random, int rsize)
 {
   if (keybits < 0)
-    return count_spare_key_files ();
+    return count_spare_key_files (0);
   allnet_rsa_prvkey spare = allnet_rsa_generate_key (keybits, random, rsize);
   if (allnet_rsa_prvkey_is_null (spare)) {
     printf ("unable to generate spare RSA key\n");
     return 0;
   }
   if (save_spare_key (spare))
-    return count_spare_key_files ();
+    return count_spare_key_files (0);
   return 0;
 }
 
+/* returns the number of spare keys of the given size, or of all sizes
+ * if keybits <= 0 */
+int count_spare_keys (int keybits)
+{
+  return count_spare_key_files (keybits);
+}
+
 /*************** operations on groups of contacts ******************/
 
 /* a contact may actually be a group of contacts. */
@@ -1478,11 +1814,10 @@ int create_spare_key (int keybits, char * random, int rsize)
 /* deleting a group does not delete the members of the group. */
 int is_group (const char * contact)   
 {
-  int ki;
-  for (ki = 0; ki < num_key_infos; ki++) {
-    if ((! kip [ki].is_deleted) &&
-        (kip [ki].is_group) &&
-        (strcmp (kip [ki].contact_name, contact) == 0))
+  int r;
+  for (r = index_first (&by_name, contact); r >= 0; r = by_name.next [r]) {
+    int ki = by_name.values [r];
+    if ((! kip [ki].is_deleted) && (kip [ki].is_group))
       return 1;
   }
   return 0;
@@ -1553,85 +1888,163 @@ int group_membership (const char * group, char *** members)
   return kip [index].num_group_members;
 }
 
-static int string_in_array (char ** array, int count, const char * string)
+/* the transitive closure of each group is computed when first needed,
+ * and kept until the next change to the contacts or groups, as shown
+ * by generation.  The members point to strings in kip, which do not
+ * change until then either */
+struct group_closure {
+  int members_done;          /* whether members was computed */
+  int num_members;           /* individual members, of any subgroup */
+  const char ** members;
+  int keysets_state;         /* 0 not computed, 1 being computed, 2 done */
+  int num_keysets;           /* -1 if the group reaches itself */
+  keyset * keysets;
+};
+static struct group_closure * closures = NULL;
+static int num_closures = 0;
+static unsigned long long int closures_generation = 0;
+static pthread_mutex_t closures_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with closures_mutex held */
+static void validate_closures ()
 {
+  if ((closures != NULL) && (closures_generation == generation) &&
+      (num_closures == num_key_infos))
+    return;
   int i;
-  for (i = 0; i < count; i++)
-    if (strcmp (string, array [i]) == 0)
-      return 1;
-  return 0;
+  for (i = 0; i < num_closures; i++) {
+    if (closures [i].members != NULL)
+      free (closures [i].members);
+    if (closures [i].keysets != NULL)
+      free (closures [i].keysets);
+  }
+  if (closures != NULL)
+    free (closures);
+  num_closures = num_key_infos;
+  closures = malloc_or_fail (sizeof (struct group_closure) * (num_closures + 1),
+                             "validate_closures");
+  memset (closures, 0, sizeof (struct group_closure) * (num_closures + 1));
+  closures_generation = generation;
 }
 
-/* doesn't change the allocated memory, but returns the new count */
-static int remove_from_array (char ** array, int count, const char * string)
+/* an upper bound on the number of names in any group closure */
+static int total_group_members ()
 {
-  int i = 0;
-  while (i < count) {
-    if (strcmp (string, array [i]) == 0) {
-      count--;
-      array [i] = array [count];  /* replace with the last element */
-    } else {
-      i++;
-    }
-  }
-  return count;
+  int result = 1;
+  int i;
+  for (i = 0; i < num_key_infos; i++)
+    if ((kip [i].is_group) && (kip [i].num_group_members > 0))
+      result += kip [i].num_group_members;
+  return result;
 }
 
-/* assumes it's OK to reorder */
-static int eliminate_duplicates (char ** from, int fcount)
+/* returns 1 if name was added to set, 0 if already there */
+static int set_add (struct name_index * set, const char * name)
 {
-  int i = 0;
-  while (i < fcount) {             /* each loop, incr i or decr fcount */
-    int j;
-    int increment = 1;             /* increment i if no match found */
-    for (j = i + 1; j < fcount; j++) {
-      if (strcmp (from [i], from [j]) == 0) {
-        increment = 0;
-        fcount--;
-        from [j] = from [fcount];  /* put the last one in position j */
-        break;                     /* and start over with fcount less by 1 */
+  if (index_first (set, name) >= 0)
+    return 0;
+  index_add (set, name, 0);
+  return 1;
+}
+
+/* breadth-first from group (the kip index gi), one of each non-group
+ * member of group and of all its subgroups.  Must be called with
+ * closures_mutex held */
+static struct group_closure * closure_members (int gi)
+{
+  struct group_closure * c = closures + gi;
+  if (c->members_done)
+    return c;
+  int max = total_group_members ();
+  const char ** groups = malloc_or_fail (sizeof (char *) * max,
+                                         "closure_members groups");
+  c->members = malloc_or_fail (sizeof (char *) * max, "closure_members");
+  c->num_members = 0;
+  struct name_index seen_groups;
+  struct name_index seen_members;
+  memset (&seen_groups, 0, sizeof (seen_groups));
+  memset (&seen_members, 0, sizeof (seen_members));
+  init_index (&seen_groups, max);
+  init_index (&seen_members, max);
+  int ngroups = 0;
+  groups [ngroups++] = kip [gi].contact_name;
+  set_add (&seen_groups, kip [gi].contact_name);
+  int i;
+  for (i = 0; i < ngroups; i++) {
+    int index = ((i == 0) ? gi : (contact_exists (groups [i]) - 1));
+    if ((index < 0) || (kip [index].members == NULL))
+      continue;
+    int m;
+    for (m = 0; m < kip [index].num_group_members; m++) {
+      const char * member = kip [index].members [m];
+      if (is_group (member)) {
+        if (set_add (&seen_groups, member))
+          groups [ngroups++] = member;
+      } else if (set_add (&seen_members, member)) {
+        c->members [c->num_members++] = member;
       }
     }
-    i += increment;                /* i++ or no change to i */
   }
-  return fcount;
+  clear_index (&seen_groups);
+  clear_index (&seen_members);
+  free (groups);
+  c->members_done = 1;
+  return c;
 }
 
-/* assumes it's OK to reorder */
-static int merge_no_duplicates (char ** a, int acount, char ** b, int bcount,
-                                char *** result)
+/* the keysets of the members of group gi, and recursively of the members
+ * of its subgroups.  A contact is listed once for each time it is listed
+ * as a member.  Returns the number of keysets, or -1 if the group is
+ * (directly or indirectly) a member of itself.
+ * Must be called with closures_mutex held */
+static int closure_keysets (int gi)
 {
-  int i;
-  size_t needed = 0;  /* allocate for the duplicates too -- simpler */
-  int count = acount + bcount;
-  for (i = 0; i < acount; i++)
-    needed += sizeof (char *) + strlen (a [i]) + 1;
-  for (i = 0; i < bcount; i++)
-    needed += sizeof (char *) + strlen (b [i]) + 1;
-  char * memory = malloc_or_fail (needed, "merge_no_duplicates");
-  char ** res = (char **) memory;
-  *result = res;
-  char * strings = memory + (count * sizeof (char *));
-  ssize_t available = minzs (needed, (count * sizeof (char *)));
-  count = 0;
-  for (i = 0; i < acount; i++) {
-    if (! string_in_array (res, count, a [i])) {
-      strncpy (strings, a [i], available);
-      res [count] = strings;
-      available = minzs (available, (strlen (res [count]) + 1));
-      strings += (strlen (res [count]) + 1);
-      count++;
+  struct group_closure * c = closures + gi;
+  if (c->keysets_state == 2)
+    return c->num_keysets;
+  if (c->keysets_state == 1)   /* we are computing this, so found a loop */
+    return -1;
+  c->keysets_state = 1;
+  int count = 0;
+  int max = 0;
+  keyset * keysets = NULL;
+  int m;
+  for (m = 0; (count >= 0) && (m < kip [gi].num_group_members); m++) {
+    int r;
+    for (r = index_first (&by_name, kip [gi].members [m]);
+         (count >= 0) && (r >= 0); r = by_name.next [r]) {
+      int i = by_name.values [r];
+      int add = 1;
+      keyset * from = &i;
+      if ((kip [i].is_group) && (kip [i].num_group_members >= 0)) {
+        add = closure_keysets (i);
+        from = closures [i].keysets;
+        if (add < 0) {
+          count = -1;
+          break;
+        }
+      }
+      if (count + add > max) {
+        max = 2 * (count + add) + 4;
+        keysets = realloc (keysets, sizeof (keyset) * max);
+        if (keysets == NULL) {
+          printf ("unable to allocate %d keysets for group %s\n",
+                  max, kip [gi].contact_name);
+          exit (1);
+        }
+      }
+      if (add > 0)
+        memcpy (keysets + count, from, sizeof (keyset) * add);
+      count += add;
     }
   }
-  for (i = 0; i < bcount; i++) {
-    if (! string_in_array (res, count, b [i])) {
-      strncpy (strings, b [i], available);
-      res [count] = strings;
-      strings += (strlen (res [count]) + 1);
-      available = minzs (available, (strlen (res [count]) + 1));
-      count++;
-    }
+  if ((count < 0) && (keysets != NULL)) {
+    free (keysets);
+    keysets = NULL;
   }
+  c->keysets = keysets;
+  c->num_keysets = count;
+  c->keysets_state = 2;
   return count;
 }
 
@@ -1645,49 +2058,16 @@ int group_membership_recursive (const char * group, char *** members)
     *members = NULL;
   if (! is_group (group))
     return -1;
-  char ** first_members = NULL;
-  int first_count = group_membership (group, &first_members);
-  if ((first_count <= 0) || (first_members == NULL)) {
-    if (first_members != NULL)
-      free (first_members);
-    if (first_count > 0)
-      first_count = -1;   /* first_members is null, so there was some error */
-    return first_count;
-  }
-  /* if self is in group, remove */
-  first_count = remove_from_array (first_members, first_count, group);
-  int count = eliminate_duplicates (first_members, first_count);
-  char ** current_members = first_members;
-  int i = 0;
-  while (i < count) {  /* add members of any subgroup, but at most once */
-    char * this_member = current_members [i];
-    if (is_group (this_member)) {
-      count = remove_from_array (current_members, count, this_member);
-      char ** local_members = NULL;
-      int local_count = group_membership (this_member, &local_members);
-      if ((local_count > 0) && (local_members != NULL)) {
-        char ** new_members = NULL;
-        int new_count = merge_no_duplicates (current_members, count,
-                                             local_members, local_count,
-                                             &new_members);
-        if (new_count > count) {   /* added one or more */
-          free (current_members);
-          current_members = new_members;
-          count = new_count;
-          i = 0;   /* start again from the beginning of the array */
-          continue;
-        } else {   /* not added anything */
-          free (new_members);
-        }
-        free (local_members);
-      }
-    }
-    i++;
-  }
-  if (members != NULL)
-    *members = current_members;
-  else
-    free (current_members);
+  int index_plus_one = contact_exists (group);
+  if (index_plus_one <= 0)
+    return -1;
+  pthread_mutex_lock (&closures_mutex);
+  validate_closures ();
+  struct group_closure * c = closure_members (index_plus_one - 1);
+  int count = c->num_members;
+  if ((members != NULL) && (count > 0))
+    *members = malloc_copy_array_of_strings ((char **) (c->members), count);
+  pthread_mutex_unlock (&closures_mutex);
   return count;
 }
 
@@ -1714,6 +2094,7 @@ static int reload_members_from_file (int ki)
       mcount = get_members (members_content, mlen, &members_list);
     kip [ki].num_group_members = mcount;
     kip [ki].members = members_list;
+    rebuild_indices ();
   }
   if (members_content != NULL)
     free (members_content);
@@ -1806,30 +2187,17 @@ int remove_from_group (const char * group, const char * contact)
 
 static int groups_for_contact (const char * contact, int * groups, int ngroups)
 {
-  int i;
   int count = 0;
-  for (i = 0; i < num_key_infos; i++) {
-    if (kip [i].contact_name != NULL) {
+  int r;
+  /* by_member has one record for each time contact is listed in a group */
+  for (r = index_first (&by_member, contact); r >= 0; r = by_member.next [r]) {
+    int i = by_member.values [r];
 #ifdef DEBUG_GROUPS
-printf ("searching for contact %s in kip [%d].contact_name: %s, %d, %d\n", contact, i, kip [i].contact_name, kip [i].is_group, kip [i].num_group_members);
+printf ("found contact %s in kip [%d].contact_name: %s, %d, %d\n", contact, i, kip [i].contact_name, kip [i].is_group, kip [i].num_group_members);
 #endif /* DEBUG_GROUPS */
-      if ((kip [i].is_group) && (kip [i].num_group_members > 0)) {
-        int m;
-        for (m = 0; m < kip [i].num_group_members; m++) {
-#ifdef DEBUG_GROUPS
-printf ("comparing contact %s to kip [%d].members [%d]: %s\n", contact, i, m, kip [i].members [m]);
-#endif /* DEBUG_GROUPS */
-          if (strcmp (contact, kip [i].members [m]) == 0) {
-#ifdef DEBUG_GROUPS
-printf ("succcess comparing contact %s to kip [%d].members [%d]: %s\n", contact, i, m, kip [i].members [m]);
-#endif /* DEBUG_GROUPS */
-            if ((groups != NULL) && (count < ngroups))
-              groups [count] = i;
-            count++;
-          }
-        }
-      }
-    }
+    if ((groups != NULL) && (count < ngroups))
+      groups [count] = i;
+    count++;
   }
 #ifdef DEBUG_GROUPS
 printf ("%d groups for contact %s\n", count, contact);
@@ -1875,73 +2243,35 @@ int member_of_groups_recursive (const char * contact, char *** groups)
   init_from_file ("member_of_groups_recursive");
   if (groups != NULL)
     *groups = NULL;
-  char ** first_groups = NULL;
-  int first_count = member_of_groups (contact, &first_groups);
-  if ((first_count <= 0) || (first_groups == NULL)) {
-    if (first_groups != NULL)
-      free (first_groups);
-    if (first_count > 0)
-      first_count = -1;   /* first_groups is null, so there was some error */
-    return first_count;
-  }
-  /* if self is in group, remove */
-  first_count = remove_from_array (first_groups, first_count, contact);
-  int count = eliminate_duplicates (first_groups, first_count);
-  char ** current_groups = first_groups;
+  int max = total_group_members ();
+  const char ** found = malloc_or_fail (sizeof (char *) * max,
+                                        "member_of_groups_recursive");
+  struct name_index seen;
+  memset (&seen, 0, sizeof (seen));
+  init_index (&seen, max);
+  set_add (&seen, contact);   /* if self is in a group, do not list it */
+  int count = 0;
+  const char * current = contact;
   int i = 0;
-  while (i < count) {  /* add any supergroup, but at most once */
-    char ** local_groups = NULL;
-    int local_count = member_of_groups (current_groups [i], &local_groups);
-    if ((local_count > 0) && (local_groups != NULL)) {
-      char ** new_groups = NULL;
-      int new_count = merge_no_duplicates (current_groups, count,
-                                           local_groups, local_count,
-                                           &new_groups);
-      if (new_count > count) {
-        free (current_groups);
-        current_groups = new_groups;
-        count = new_count;
-/* note - relying on groups not disappearing from current_groups.
-   Otherwise should change i and start over again */
-      } else {
-        free (new_groups);
-      }
-      free (local_groups);
-    }
-    i++;
-  }
-  if (groups != NULL)
-    *groups = current_groups;
-  else
-    free (current_groups);
+  while (1) {   /* add the groups of each group found, at most once */
+    int r;
+    for (r = index_first (&by_member, current); r >= 0;
+         r = by_member.next [r]) {
+      const char * group = kip [by_member.values [r]].contact_name;
+      if (set_add (&seen, group))
+        found [count++] = group;
+    }
+    if (i >= count)
+      break;
+    current = found [i++];
+  }
+  clear_index (&seen);
+  if ((groups != NULL) && (count > 0))
+    *groups = malloc_copy_array_of_strings ((char **) found, count);
+  free (found);
   return count;
 }
 
-static int add_to_array (char *** array, int count, const char * value)
-{
-  int i;
-  char ** strings = *array;
-  size_t size = sizeof (char *) + strlen (value) + 1;
-  if (*array != NULL) {
-    for (i = 0; i < count; i++)
-      size += sizeof (char *) + strlen (strings [i]) + 1;
-  }
-  char * mem = malloc_or_fail (size, "add_to_array");
-  char ** res = (char **) mem;
-  size = minzs (size, (count + 1) * sizeof (char *));
-  mem += (count + 1) * sizeof (char *);
-  for (i = 0; i < count; i++) {
-    strncpy (mem, strings [i], size);
-    res [i] = mem;
-    size = minzs (size, strlen (strings [i]) + 1);
-    mem += strlen (strings [i]) + 1;
-  }
-  strncpy (mem, value, size);
-  res [count] = mem;
-  *array = res;
-  return count + 1;
-}
-
 /* same as group_membership, but (a) recursively examines all groups
  * and subgroups, and (b) includes one each of all non-group members
  * of all (sub)groups */
@@ -1951,47 +2281,21 @@ int group_contacts (const char * group, char *** members)
     *members = NULL;
   if (! is_group (group))
     return 0;
-  char ** all_members = NULL;
-  int nmembers = 0;
-  /* track the groups we add in case they refer to each other recursively */
-  /* begin with ourselves */
-  char ** subgroups = NULL;
-  int ngroups = add_to_array (&subgroups, 0, group);
-  int i = 0;
-  while (i < ngroups) {  /* add the members of each subgroup, at most once */
-    char ** local_members = NULL;
-    int local_count = group_membership (subgroups [i], &local_members);
-    if (local_members == NULL) { /* should never happen */
-      printf ("error in group_contacts: local_members [%d/%d/%s] is null, %d\n",
-              i, ngroups, subgroups [i], local_count);
-      continue;
-    }
-    /* add each member to subgroups or all_members, unless already there */
-    int j;
-    for (j = 0; j < local_count; j++) {
-      const char * member = local_members [j];
-      if (is_group (member)) {
-        if (! string_in_array (subgroups, ngroups, member)) {
-          /* increases ngroups, loops longer */
-          ngroups = add_to_array (&subgroups, ngroups, member);
-        }
-      } else {  /* not a group */
-        if (! string_in_array (all_members, nmembers, member)) {
-          nmembers = add_to_array (&all_members, nmembers, member);
-        }
-      }
-    }
-    i++;  /* process next subgroup */
-  }
-  free (subgroups);
-  if (members != NULL)
-    *members = all_members;
-  else
-    free (all_members);
+  int index_plus_one = contact_exists (group);
+  if (index_plus_one <= 0)
+    return 0;
+  pthread_mutex_lock (&closures_mutex);
+  validate_closures ();
+  struct group_closure * c = closure_members (index_plus_one - 1);
+  int nmembers = c->num_members;
+  if ((members != NULL) && (nmembers > 0))
+    *members = malloc_copy_array_of_strings ((char **) (c->members), nmembers);
+  pthread_mutex_unlock (&closures_mutex);
 #ifdef DEBUG_PRINT
   printf ("end of group_contacts, returning %d members:\n", nmembers);
-  for (i = 0; i < nmembers; i++)
-    printf ("   [%d] %s\n", i, all_members [i]);
+  int i;
+  for (i = 0; (members != NULL) && (i < nmembers); i++)
+    printf ("   [%d] %s\n", i, (*members) [i]);
 #endif /* DEBUG_PRINT */
   return nmembers;
 }
@@ -2000,37 +2304,38 @@ int group_contacts (const char * group, char *** members)
 
 #define RECURSIVELY_INCLUDE_GROUP_KEYS
 #ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-/* recursively (up to max depth) count keysets for groups */
-/* return -1 if a recursive loop is detected, as indicated by max_depth <= 0 */
+/* count keysets, for groups recursively counting the members' keysets */
+/* return -1 if a recursive loop is detected */
 /* if keysets is not null, assign up to the first num_keysets */
-static int recursive_num_keysets (const char * contact, int max_depth,
+static int recursive_num_keysets (const char * contact,
                                   keyset * keysets, int num_keysets)
 {
-  if (max_depth <= 0)
-    return -1;
-  int i;
   int count = 0;
-  for (i = 0; i < num_key_infos; i++) {
-    if ((kip [i].contact_name != NULL) &&
-        (strcmp (kip [i].contact_name, contact) == 0)) {
-      if ((! kip [i].is_group) || (kip [i].num_group_members < 0)) {
-        /* not a group */
-        if ((keysets != NULL) && (num_keysets > count))
-          keysets [count] = i;
-        count++;
-      } else {  /* recursively count each member's keys */
-        int m;
-        for (m = 0; m < kip [i].num_group_members; m++) {
-          int result =
-            recursive_num_keysets (kip [i].members [m], max_depth - 1,
-                                   keysets + count, num_keysets - count);
-          if (result < 0)
-            return result;
-          count += result;
-        }
+  pthread_mutex_lock (&closures_mutex);
+  validate_closures ();
+  int r;
+  for (r = index_first (&by_name, contact); r >= 0; r = by_name.next [r]) {
+    int i = by_name.values [r];
+    if ((! kip [i].is_group) || (kip [i].num_group_members < 0)) {
+      /* not a group */
+      if ((keysets != NULL) && (num_keysets > count))
+        keysets [count] = i;
+      count++;
+    } else {  /* add in the keys of all the members */
+      int n = closure_keysets (i);
+      if (n < 0) {
+        count = -1;
+        break;
       }
+      int copy = minz (num_keysets, count);   /* room left in keysets */
+      if (copy > n)
+        copy = n;
+      if ((keysets != NULL) && (copy > 0))
+        memcpy (keysets + count, closures [i].keysets, sizeof (keyset) * copy);
+      count += n;
     }
   }
+  pthread_mutex_unlock (&closures_mutex);
 #ifdef DEBUG_PRINT
   printf ("recursive_num_keysets (%s) returning %d, pointer %p %d\n",
           contact, count, keysets, num_keysets);
@@ -2045,12 +2350,11 @@ static int recursive_num_keysets (const char * contact, int max_depth,
 static int plain_num_keysets (const char * contact,
                               keyset * keysets, int num_keysets)
 {
-  int i;
   int count = 0;
-  for (i = 0; i < num_key_infos; i++) {
-    if ((kip [i].contact_name != NULL) &&
-        (strcmp (kip [i].contact_name, contact) == 0) &&
-        (! kip [i].is_group)) {
+  int r;
+  for (r = index_first (&by_name, contact); r >= 0; r = by_name.next [r]) {
+    int i = by_name.values [r];
+    if (! kip [i].is_group) {
       if ((keysets != NULL) && (num_keysets > count))
         keysets [count] = i;
       count++;
@@ -2071,7 +2375,7 @@ int num_keysets (const char * contact)
   if (! valid_keyset (k))
     return -1;
 #ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  return recursive_num_keysets (contact, num_key_infos + 1, NULL, 0);
+  return recursive_num_keysets (contact, NULL, 0);
 #else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
   return plain_num_keysets (contact, NULL, 0);
 #endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
@@ -2090,7 +2394,7 @@ int all_keys (const char * contact, keyset ** keysets)
   if (! contact_exists (contact))
     return -1;
 #ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  int count = recursive_num_keysets (contact, num_key_infos + 1, NULL, 0);
+  int count = recursive_num_keysets (contact, NULL, 0);
 #else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
   int count = plain_num_keysets (contact, NULL, 0);
 #endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
@@ -2102,8 +2406,7 @@ int all_keys (const char * contact, keyset ** keysets)
 
   *keysets = malloc_or_fail (count * sizeof (keyset), "all_keys");
 #ifdef RECURSIVELY_INCLUDE_GROUP_KEYS
-  int copied = recursive_num_keysets (contact, num_key_infos + 1,
-                                      *keysets, count);
+  int copied = recursive_num_keysets (contact, *keysets, count);
 #else /* ! RECURSIVELY_INCLUDE_GROUP_KEYS */
   int copied = plain_num_keysets (contact, *keysets, count);
 #endif /* RECURSIVELY_INCLUDE_GROUP_KEYS */
@@ -2149,6 +2452,7 @@ unsigned int get_contact_pubkey (keyset k, allnet_rsa_pubkey * key)
   init_from_file ("get_contact_pubkey");
   if (! valid_keyset (k))
     return 0;
+  load_keys (kip + k);
   *key = kip [k].contact_pubkey;
   return allnet_rsa_pubkey_size (*key);
 }
@@ -2158,6 +2462,7 @@ unsigned int get_my_pubkey (keyset k, allnet_rsa_pubkey * key)
   init_from_file ("get_my_pubkey");
   if (! valid_keyset (k))
     return 0;
+  load_keys (kip + k);
   *key = allnet_rsa_private_to_public (kip [k].my_key);
   return allnet_rsa_pubkey_size (*key);
 }
@@ -2167,6 +2472,7 @@ unsigned int get_my_privkey (keyset k, allnet_rsa_prvkey * key)
   init_from_file ("get_my_privkey");
   if (! valid_keyset (k))
     return 0;
+  load_keys (kip + k);
   *key = kip [k].my_key;
   return allnet_rsa_prvkey_size (*key);
 }
@@ -2181,6 +2487,7 @@ unsigned int get_dh_secret (keyset k, char * secret, char * public, int local)
   if (! valid_keyset (k))
     return 0;
   struct key_info * ki = kip + k;
+  load_keys (ki);
   if (local) {
     if (! ki->has_local_dh)
       return 0;
@@ -2200,6 +2507,7 @@ void set_dh_secret (keyset k, const char * secret, int local)
   if (! valid_keyset (k))
     return;
   struct key_info * ki = kip + k;
+  load_keys (ki);
   if (local) {
     set_local_dh (ki, secret);
   } else {
@@ -2261,6 +2569,7 @@ int mark_invalid (const char * contact, keyset k)
   init_from_file ("mark_invalid");
   if (! valid_keyset (k))
     return 0;
+  load_keys (kip + k);
   char * fname = strcat_malloc (kip [k].dir_name, "/my_key",
                                 "invalidate_symmetric_key-1");
   char * new_fname = strcat_malloc (fname, "_invalidated",
@@ -2276,25 +2585,27 @@ int mark_invalid (const char * contact, keyset k)
   free (new_fname);
   /* delete from data structure */
   allnet_rsa_null_prvkey (&(kip [k].my_key));
+  generation++;
   return result;
 }
 
 int invalid_keys (const char * contact, keyset ** keysets)
 {
   init_from_file ("invalid_keys");
-  int ki;
+  int first = index_first (&by_name, contact);
+  int r;
   int count = 0;
-  for (ki = 0; ki < num_key_infos; ki++)
-    if ((strcmp (kip [ki].contact_name, contact) == 0) &&
-        (allnet_rsa_prvkey_is_null (kip [ki].my_key)))
+  for (r = first; r >= 0; r = by_name.next [r]) {
+    load_keys (kip + by_name.values [r]);
+    if (allnet_rsa_prvkey_is_null (kip [by_name.values [r]].my_key))
       count++;
+  }
   if ((keysets != NULL) && (count > 0)) {
     *keysets = malloc_or_fail (sizeof (keyset *) * count, "invalid_keys");
     int index = 0;
-    for (ki = 0; ki < num_key_infos; ki++)
-      if ((strcmp (kip [ki].contact_name, contact) == 0) &&
-          (allnet_rsa_prvkey_is_null (kip [ki].my_key)))
-        (*keysets) [index++] = ki;
+    for (r = first; r >= 0; r = by_name.next [r])
+      if (allnet_rsa_prvkey_is_null (kip [by_name.values [r]].my_key))
+        (*keysets) [index++] = by_name.values [r];
   }
   return count;
 }
@@ -2305,6 +2616,7 @@ int mark_valid (const char * contact, keyset k)
   init_from_file ("mark_valid");
   if (! valid_keyset (k))
     return 0;
+  load_keys (kip + k);
   char * fname = strcat_malloc (kip [k].dir_name, "/my_key",
                                 "invalidate_symmetric_key-1");
   char * old_fname = strcat_malloc (fname, "_invalidated",
@@ -2322,6 +2634,8 @@ int mark_valid (const char * contact, keyset k)
   }
   free (old_fname);
   free (fname);
+  if (result)
+    generation++;
   return result;
 }
 
@@ -2454,16 +2768,14 @@ void incomplete_exchange_file (const char * contact, keyset k,
  * If the contact is not found, returns num_key_infos */
 static int find_symmetric_key (const char * contact)
 {
-  int ki = 0;
   int found = num_key_infos;
-  for (ki = 0; ki < num_key_infos; ki++) {
-    if ((kip [ki].contact_name != NULL) &&
-        (strcmp (kip [ki].contact_name, contact) == 0)) {
-      if (kip [ki].has_symmetric_key) {
-        return ki;
-      }
-      found = -1 - ki;
+  int r;
+  for (r = index_first (&by_name, contact); r >= 0; r = by_name.next [r]) {
+    int ki = by_name.values [r];
+    if (kip [ki].has_symmetric_key) {
+      return ki;
     }
+    found = -1 - ki;
   }
   return found;
 }
@@ -2496,7 +2808,7 @@ int set_symmetric_key (const char * contact, char * key, int ksize)
     return 0;
   /* else found contact, with or without symmetric key */
   if (ki < 0)  /* no symmetric key, but the code is the same */
-    ki = -ki;
+    ki = -ki - 1;  /* e.g., ki -1 becomes ki 0 */
   memcpy (kip [ki].symmetric_key, key, SYMMETRIC_KEY_SIZE);
   kip [ki].has_symmetric_key = 1;
   char * fname = strcat_malloc (kip [ki].dir_name, "/symmetric_key",
@@ -2512,17 +2824,15 @@ int set_symmetric_key (const char * contact, char * key, int ksize)
  * If the contact is not found, returns num_key_infos */
 static int find_state (const char * contact, int send)
 {
-  int ki = 0;
   int found = num_key_infos;
-  for (ki = 0; ki < num_key_infos; ki++) {
-    if ((kip [ki].contact_name != NULL) &&
-        (strcmp (kip [ki].contact_name, contact) == 0)) {
-      if ((send && (kip [ki].has_send_state)) ||
-          ((! send) && (kip [ki].has_receive_state))) {
-        return ki;
-      }
-      found = -1 - ki;
+  int r;
+  for (r = index_first (&by_name, contact); r >= 0; r = by_name.next [r]) {
+    int ki = by_name.values [r];
+    if ((send && (kip [ki].has_send_state)) ||
+        ((! send) && (kip [ki].has_receive_state))) {
+      return ki;
     }
+    found = -1 - ki;
   }
   return found;
 }
@@ -2575,6 +2885,14 @@ static char * array_to_buf (const char * array, int abytes,
   return p;
 }
 
+/* writing the send state for every message is slow, so instead the
+ * counter saved on disk is this many ahead (reserved), and the state
+ * is only saved again when the counter gets there.  If we stop before
+ * then, we start again from the reserved counter, so no counter is ever
+ * used twice.  Only done with 8-byte counters, since then the receiver
+ * gets the entire counter with each message */
+#define KEY_STATE_RESERVE	4096
+
 /* returns 1 if the state was saved, 0 otherwise. */
 int save_key_state (const char * contact, int send, /* 0 for recv */
                     struct allnet_stream_encryption_state * state)
@@ -2588,10 +2906,28 @@ int save_key_state (const char * contact, int send, /* 0 for recv */
   /* else found contact, with or without state */
   if (ki < 0)  /* no state, but the code is the same */
     ki = -ki - 1;  /* e.g., ki -1 becomes ki 0 */
+  struct allnet_stream_encryption_state saved = *state;
   if (send) {
-    memcpy (&(kip [ki].send_state), state,
-            sizeof (struct allnet_stream_encryption_state));
+    struct allnet_stream_encryption_state * old = &(kip [ki].send_state);
+    int reserved = ((kip [ki].has_send_state) &&
+                    (kip [ki].send_reserved > 0) &&
+                    (state->counter_size == 8) &&
+                    (old->counter_size == 8) &&
+                    (old->hash_size == state->hash_size) &&
+                    (memcmp (old->key, state->key, sizeof (old->key)) == 0) &&
+                    (memcmp (old->secret, state->secret,
+                             sizeof (old->secret)) == 0));
+    memcpy (old, state, sizeof (struct allnet_stream_encryption_state));
     kip [ki].has_send_state = 1;
+    if ((reserved) && (state->counter < kip [ki].send_reserved))
+      return 1;   /* the state on disk is still ahead of this state */
+    kip [ki].send_reserved = 0;
+    if ((state->counter_size == 8) &&
+        (state->counter < UINT64_MAX - KEY_STATE_RESERVE)) {
+      saved.counter = state->counter + KEY_STATE_RESERVE;
+      saved.block_offset = 0;
+      kip [ki].send_reserved = saved.counter;
+    }
   } else {
     memcpy (&(kip [ki].receive_state), state,
             sizeof (struct allnet_stream_encryption_state));
@@ -2602,12 +2938,19 @@ int save_key_state (const char * contact, int send, /* 0 for recv */
   char * next = array_to_buf (state->key, ALLNET_STREAM_KEY_SIZE,
                               print_buffer, &psize);
   next = array_to_buf (state->secret, ALLNET_STREAM_SECRET_SIZE, next, &psize);
-  snprintf (next, psize, "%d %d %" PRIu64 " %d\n", state->counter_size,
-            state->hash_size, state->counter, state->block_offset);
+  snprintf (next, psize, "%d %d %" PRIu64 " %d\n", saved.counter_size,
+            saved.hash_size, saved.counter, saved.block_offset);
   char * file_name = (send ? "/send_state" : "/receive_state");
   char * fname = strcat_malloc (kip [ki].dir_name, file_name, "save_key_state");
-  int result = write_file (fname, print_buffer, (int)strlen (print_buffer), 1);
+  int result = 0;
+  if (send)   /* the reservation must be on disk before it is used */
+    result = write_file (fname, print_buffer, (int)strlen (print_buffer), 1);
+  else        /* saved with each message received, do not wait for it */
+    result = write_file_async (fname, print_buffer, (int)strlen (print_buffer),
+                               0, 1);
   free (fname);
+  if (! result)
+    kip [ki].send_reserved = 0;   /* try again next time */
   return result;
 }
 
@@ -2644,7 +2987,7 @@ int revalidate_symmetric_key (const char * contact)
   int ki = find_symmetric_key (contact);
   if (ki >= 0)   /* no contact, or contact already has a symmetric key */
     return 0;
-  ki = -ki;   /* turn it into a valid index */
+  ki = -ki - 1;   /* turn it into a valid index */
   char * fname = strcat_malloc (kip [ki].dir_name, "/symmetric_key",
                                 "invalidate_symmetric_key-1");
   char * old_fname = strcat_malloc (fname, "_invalidated",
@@ -2696,6 +3039,14 @@ int num_own_bc_keys = -1;    /* not initialized */
 struct bc_key_info * other_bc_keys = NULL;
 int num_other_bc_keys = -1;  /* not initialized */
 
+/* other_bc_keys, indexed by the first byte of their address, so that
+ * broadcasts from senders we have not subscribed to are rejected without
+ * looking at every key.  Rebuilt after the keys are read again */
+#define BC_INDEX_BUCKETS	256
+static int * other_bc_by_byte = NULL;   /* key indices, by first byte */
+static int other_bc_bucket_start [BC_INDEX_BUCKETS + 1];
+static int other_bc_indexed = 0;
+
 extern void ** keyd_debug;
 
 static int count_keys (const char * path)
@@ -3038,37 +3389,95 @@ static char * make_address (allnet_rsa_pubkey key, int key_bits,
   off += snprintf (result + off, rsize - off, ",%s,%d", lang, bitstring_bits);
 
   printf ("make_address ==> %s\n", result);
-char * pkey;
-int pklen;
-rsa_to_external_pubkey (key, &pkey, &pklen);
-print_buffer (pkey, pklen, "public key", 12, 1);
-printf ("make_address verify_bc_key (%s) = %d\n", result,
-verify_bc_key (result, pkey, pklen, "en", 16, 0));
+  return result;
+}
 
+/* returns 1 if the address is valid for the key, 0 otherwise */
+static int check_address (const char * aaddr, allnet_rsa_pubkey key,
+                          int bitstring_bits)
+{
+  char * pkey;
+  int pklen;
+  rsa_to_external_pubkey (key, &pkey, &pklen);
+  int result = verify_bc_key (aaddr, pkey, pklen, NULL, bitstring_bits, 0);
+  if (! result) {
+    printf ("make_address gave %s, which does not verify\n", aaddr);
+    print_buffer (pkey, pklen, "public key", 12, 1);
+  }
+  free (pkey);
   return result;
 }
 
-static char * generate_one_key (int key_bits, char * phrase, char * lang,
-                                int bitstring_bits, int min_bitstrings)
+/* generate_key searches in up to this many threads, one per processor
+ * unless set by generate_key_threads */
+#define KEYS_MAX_GENERATE_THREADS	64
+static int generate_threads = 0;   /* 0 to use one per processor */
+
+void generate_key_threads (int nthreads)
+{
+  generate_threads = ((nthreads > KEYS_MAX_GENERATE_THREADS) ?
+                      KEYS_MAX_GENERATE_THREADS : nthreads);
+}
+
+struct generate_search {
+  int key_bits;
+  const char * phrase;
+  const char * lang;
+  int bitstring_bits;
+  int min_bitstrings;
+  int give_feedback;
+  pthread_mutex_t mutex;   /* for the remaining fields */
+  int done;                /* set once a matching key has been found */
+  unsigned long long int tried;
+  char * aaddr;            /* the address and key of the first match */
+  allnet_rsa_prvkey key;
+};
+
+static int search_done (struct generate_search * search)
 {
-  allnet_rsa_prvkey key = allnet_rsa_generate_key (key_bits, NULL, 0);
-  allnet_rsa_pubkey pubkey = allnet_rsa_private_to_public (key);
+  pthread_mutex_lock (&(search->mutex));
+  int result = search->done;
+  pthread_mutex_unlock (&(search->mutex));
+  return result;
+}
 
-  char * aaddr = make_address (pubkey, key_bits, phrase, lang, bitstring_bits,
-                               min_bitstrings);
-  if (aaddr != NULL) {
-    char * fname;
-    if (config_file_name ("own_bc_keys", aaddr, &fname, 1) < 0) {
-      printf ("unable to save key to ~/.allnet/own_bc_keys/%s\n", aaddr);
-    } else {
-      if (! allnet_rsa_write_prvkey (fname, key))
-        printf ("unable to write new key to file %s\n", fname);
-      free (fname);
+/* tries random keys until one matches or another thread finds one */
+static void * generate_key_thread (void * arg)
+{
+  struct generate_search * search = (struct generate_search *) arg;
+  while (! search_done (search)) {
+    allnet_rsa_prvkey key =
+      allnet_rsa_generate_key (search->key_bits, NULL, 0);
+    allnet_rsa_pubkey pubkey = allnet_rsa_private_to_public (key);
+    char * aaddr = make_address (pubkey, search->key_bits, search->phrase,
+                                 search->lang, search->bitstring_bits,
+                                 search->min_bitstrings);
+    if ((aaddr != NULL) &&
+        (! check_address (aaddr, pubkey, search->bitstring_bits))) {
+      free (aaddr);
+      aaddr = NULL;
+    }
+    pthread_mutex_lock (&(search->mutex));
+    search->tried++;
+    if ((aaddr != NULL) && (! search->done)) {  /* first match wins */
+      search->done = 1;
+      search->aaddr = aaddr;
+      search->key = key;
+      aaddr = NULL;
+      allnet_rsa_null_prvkey (&key);
+    } else if (search->give_feedback) {
+      printf (".");
+      if ((search->tried % 100) == 0)
+        printf (" %llu\n", search->tried);
+      fflush (stdout);
     }
+    pthread_mutex_unlock (&(search->mutex));
+    if (aaddr != NULL)   /* another thread found a key first */
+      free (aaddr);
+    if (! allnet_rsa_prvkey_is_null (key))
+      allnet_rsa_free_prvkey (key);
   }
-
-  allnet_rsa_free_prvkey (key);
-  return aaddr;
+  return NULL;
 }
 
 /* returns a malloc'd string with the address.  The key is saved and may
@@ -3077,16 +3486,56 @@ static char * generate_one_key (int key_bits, char * phrase, char * lang,
 char * generate_key (int key_bits, char * phrase, char * lang,
                      int bitstring_bits, int min_bitstrings, int give_feedback)
 {
-  char * result = NULL;
-  do {
-    if (give_feedback) {
-      printf (".");
-      fflush (stdout);
+  int nthreads = generate_threads;
+  if (nthreads <= 0) {
+    long int ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    nthreads = ((ncpus > KEYS_MAX_GENERATE_THREADS) ?
+                KEYS_MAX_GENERATE_THREADS : (int) ncpus);
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+  struct generate_search search;
+  search.key_bits = key_bits;
+  search.phrase = phrase;
+  search.lang = lang;
+  search.bitstring_bits = bitstring_bits;
+  search.min_bitstrings = min_bitstrings;
+  search.give_feedback = give_feedback;
+  pthread_mutex_init (&(search.mutex), NULL);
+  search.done = 0;
+  search.tried = 0;
+  search.aaddr = NULL;
+  allnet_rsa_null_prvkey (&(search.key));
+  pthread_t threads [KEYS_MAX_GENERATE_THREADS];
+  int started = 0;
+  int i;
+  for (i = 1; i < nthreads; i++) {   /* this thread also searches */
+    if (pthread_create (threads + started, NULL, generate_key_thread,
+                        &search) == 0)
+      started++;
+  }
+  generate_key_thread (&search);
+  for (i = 0; i < started; i++)
+    pthread_join (threads [i], NULL);
+  pthread_mutex_destroy (&(search.mutex));
+  if (give_feedback)
+    printf ("\ntried %llu keys\n", search.tried);
+  char * fname;
+  if (config_file_name ("own_bc_keys", search.aaddr, &fname, 1) < 0) {
+    printf ("unable to save key to ~/.allnet/own_bc_keys/%s\n", search.aaddr);
+  } else {
+    if (! allnet_rsa_write_prvkey (fname, search.key)) {
+      printf ("unable to write new key to file %s\n", fname);
+    } else if (num_own_bc_keys >= 0) {   /* reread to include the new key */
+      free_bc_keys (own_bc_keys, num_own_bc_keys);
+      own_bc_keys = NULL;
+      num_own_bc_keys = -1;
+      init_bc_key_set ("own_bc_keys", &own_bc_keys, &num_own_bc_keys, 1);
     }
-    result = generate_one_key (key_bits, phrase, lang, bitstring_bits,
-                               min_bitstrings);
-  } while (result == NULL);
-  return result;
+    free (fname);
+  }
+  allnet_rsa_free_prvkey (search.key);
+  return search.aaddr;
 }
 
 /* these give the "normal" version of the broadcast address, without the
@@ -3151,12 +3600,40 @@ int get_temporary_key (char ** pubkey, allnet_rsa_prvkey * prvkey)
   return result;
 }
 
-/* verifies that a key obtained by a key exchange matches the address */
-/* the default lang and bits are used if they are not part of the address */
-/* if save_if_correct != 0, also saves it to a file using the given address */
-unsigned int verify_bc_key (const char * ahra, const char * key, int key_bytes,
-                            const char * default_lang, int bitstring_bits,
-                            int save_if_correct)
+/* verification encrypts the mapped phrase with the key, so the results are
+ * kept in a small direct-mapped cache indexed by a hash of the address,
+ * bits, and key.  saved is set once an entry has been saved to a file. */
+#define BC_VERIFY_CACHE_SIZE	64
+
+struct bc_verify_entry {
+  char digest [SHA512_SIZE];   /* all zeros if the entry is unused */
+  unsigned int result;
+  int saved;
+};
+
+static struct bc_verify_entry bc_verify_cache [BC_VERIFY_CACHE_SIZE];
+static pthread_mutex_t bc_verify_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void bc_verify_digest (const char * ahra, const char * key,
+                              int key_bytes, int bitstring_bits, char * digest)
+{
+  if (key_bytes < 0)
+    key_bytes = 0;
+  int alen = (int) strlen (ahra) + 1;
+  int dsize = alen + 4 + key_bytes;
+  char * data = malloc_or_fail (dsize, "bc_verify_digest");
+  memcpy (data, ahra, alen);
+  writeb32 (data + alen, (unsigned long int) bitstring_bits);
+  if (key_bytes > 0)
+    memcpy (data + alen + 4, key, key_bytes);
+  sha512 (data, dsize, digest);
+  free (data);
+}
+
+/* verifies that the key matches the address, without using the cache */
+static unsigned int verify_bc_key_uncached (const char * ahra,
+                                            const char * key, int key_bytes,
+                                            int bitstring_bits)
 {
   if (((key != NULL) && (key_bytes > 0)) &&
       ((key_bytes != 513) || (*key != KEY_RSA4096_E65537))) {
@@ -3224,30 +3701,77 @@ unsigned int verify_bc_key (const char * ahra, const char * key, int key_bytes,
 
       free (encrypted);
       free (positions);
+      allnet_rsa_free_pubkey (rsa);
       return 0;
     }
   }
+  allnet_rsa_free_pubkey (rsa);
+  free (positions);
+  free (encrypted);
+  return 1;
+}
+
+/* returns 1 if the key was saved, 0 otherwise */
+static int save_bc_key (const char * ahra, const char * key, int key_bytes)
+{
+  allnet_rsa_pubkey rsa;
+  if (! allnet_pubkey_from_raw (&rsa, key, key_bytes))
+    return 0;
+  int result = 0;
   char * fname;
-  if (save_if_correct) {
-    if (config_file_name ("other_bc_keys", ahra, &fname, 1) < 0) {
-      printf ("unable to save key to ~/.allnet/other_bc_keys/%s\n", ahra);
+  if (config_file_name ("other_bc_keys", ahra, &fname, 1) < 0) {
+    printf ("unable to save key to ~/.allnet/other_bc_keys/%s\n", ahra);
+  } else {
+    if (! allnet_rsa_write_pubkey (fname, rsa)) {
+      printf ("unable to write broadcast key to file %s\n", fname);
     } else {
-      if (! allnet_rsa_write_pubkey (fname, rsa)) {
-        printf ("unable to write broadcast key to file %s\n", fname);
-      } else {
-        free_bc_keys (other_bc_keys, num_other_bc_keys);
-        other_bc_keys = NULL;
-        num_other_bc_keys = -1;  /* so init actually reads the keys */
-        init_bc_key_set ("other_bc_keys",
-                         &other_bc_keys, &num_other_bc_keys, 0);
-      }
-      free (fname);
+      free_bc_keys (other_bc_keys, num_other_bc_keys);
+      other_bc_keys = NULL;
+      num_other_bc_keys = -1;  /* so init actually reads the keys */
+      other_bc_indexed = 0;    /* and indexes them again */
+      init_bc_key_set ("other_bc_keys",
+                       &other_bc_keys, &num_other_bc_keys, 0);
+      result = 1;
     }
+    free (fname);
   }
   allnet_rsa_free_pubkey (rsa);
-  free (positions);
-  free (encrypted);
-  return 1;
+  return result;
+}
+
+/* verifies that a key obtained by a key exchange matches the address */
+/* the default lang and bits are used if they are not part of the address */
+/* if save_if_correct != 0, also saves it to a file using the given address */
+unsigned int verify_bc_key (const char * ahra, const char * key, int key_bytes,
+                            const char * default_lang, int bitstring_bits,
+                            int save_if_correct)
+{
+  if (ahra == NULL)
+    return 0;
+  char digest [SHA512_SIZE];
+  bc_verify_digest (ahra, key, key_bytes, bitstring_bits, digest);
+  int index = (int) (readb32 (digest) % BC_VERIFY_CACHE_SIZE);
+  struct bc_verify_entry * entry = bc_verify_cache + index;
+  unsigned int result = 0;
+  int saved = 0;
+  int found = 0;
+  pthread_mutex_lock (&bc_verify_mutex);
+  if (memcmp (entry->digest, digest, SHA512_SIZE) == 0) {
+    result = entry->result;
+    saved = entry->saved;
+    found = 1;
+  }
+  pthread_mutex_unlock (&bc_verify_mutex);
+  if (! found)
+    result = verify_bc_key_uncached (ahra, key, key_bytes, bitstring_bits);
+  if (result && save_if_correct && (! saved))
+    saved = save_bc_key (ahra, key, key_bytes);
+  pthread_mutex_lock (&bc_verify_mutex);
+  memcpy (entry->digest, digest, SHA512_SIZE);
+  entry->result = result;
+  entry->saved = saved;
+  pthread_mutex_unlock (&bc_verify_mutex);
+  return result;
 }
 
 /* if successful returns the number of keys and sets *keys to point to
@@ -3270,6 +3794,58 @@ unsigned int get_other_keys (struct bc_key_info ** keys)
   return num_other_bc_keys;
 }
 
+static void index_other_bc_keys ()
+{
+  if (other_bc_by_byte != NULL)
+    free (other_bc_by_byte);
+  other_bc_by_byte = NULL;
+  memset (other_bc_bucket_start, 0, sizeof (other_bc_bucket_start));
+  int n = num_other_bc_keys;
+  if (n > 0) {
+    other_bc_by_byte = malloc_or_fail (n * sizeof (int), "bc key index");
+    int i;
+    for (i = 0; i < n; i++)        /* count, offset by one */
+      other_bc_bucket_start [other_bc_keys [i].address [0] + 1]++;
+    for (i = 0; i < BC_INDEX_BUCKETS; i++)
+      other_bc_bucket_start [i + 1] += other_bc_bucket_start [i];
+    int fill [BC_INDEX_BUCKETS];
+    memcpy (fill, other_bc_bucket_start, sizeof (fill));
+    for (i = 0; i < n; i++)   /* in key order within each bucket */
+      other_bc_by_byte [fill [other_bc_keys [i].address [0]]++] = i;
+  }
+  other_bc_indexed = 1;
+}
+
+/* fills in indices (in the array returned by get_other_keys) of up to
+ * max keys whose address matches the nbits of source, in key order.
+ * returns the number of keys that match, which may be more than max */
+unsigned int get_other_keys_matching (const unsigned char * source, int nbits,
+                                      int * indices, int max)
+{
+  init_bc_keys ();
+  if (! other_bc_indexed)
+    index_other_bc_keys ();
+  if (num_other_bc_keys <= 0)
+    return 0;
+  int first = 0;
+  int last = num_other_bc_keys;
+  if (nbits >= 8) {   /* only look at the one bucket */
+    first = other_bc_bucket_start [source [0]];
+    last = other_bc_bucket_start [source [0] + 1];
+  }
+  unsigned int count = 0;
+  int i;
+  for (i = first; i < last; i++) {
+    int k = ((nbits >= 8) ? other_bc_by_byte [i] : i);
+    if (matches (other_bc_keys [k].address, ADDRESS_BITS, source, nbits) > 0) {
+      if (count < max)
+        indices [count] = k;
+      count++;
+    }
+  }
+  return count;
+}
+
 static struct bc_key_info * find_bc_key (const char * address,
                                          struct bc_key_info * keys, int nkeys)
 {
@@ -18,6 +18,12 @@ typedef int keyset;  /* opaque type, do not access directly */
 
 /*************** operations on contacts ********************/
 
+/* contacts are read from their directories on first use, by up to
+ * nthreads threads (by default one per processor).  Public and private
+ * keys are only read when first needed.
+ * keys_load_threads only has an effect if called before first use */
+extern void keys_load_threads (int nthreads);
+
 /* returns 0 or more */
 extern int num_contacts (void);
 
@@ -28,6 +34,19 @@ extern int all_contacts (char *** contacts);
 /* same, but only individual contacts, not groups */
 extern int all_individual_contacts (char *** contacts);
 
+/* changes whenever contacts or keysets are created, deleted, renamed,
+ * hidden, or their addresses or public/private keys are modified, so
+ * information derived from them can be recomputed only when needed */
+extern unsigned long long int keys_generation ();
+
+/* the same as all_contacts and all_individual_contacts, but without
+ * allocating: *contacts (if contacts is not NULL) points to a list kept
+ * by keys.c, which must not be modified or freed.  The list remains valid
+ * at least until keys_generation () changes, so callers that keep it
+ * should borrow it again when that happens */
+extern int borrow_contacts (char *** contacts);
+extern int borrow_individual_contacts (char *** contacts);
+
 /* returns the keyset if successful, -1 if the contact already existed
  * if successful and local/remote are not NULL, sets the local and remote
  * to the given values
@@ -219,6 +238,10 @@ extern void incomplete_exchange_file (const char * contact, keyset k,
  * should normally only be called after calling
  *    setpriority (PRIO_PROCESS, 0, n), with n >= 15 */
 extern int create_spare_key (int keybits, char * random, int rsize);
+/* returns the number of spare keys of the given size, or of all sizes
+ * if keybits <= 0.  Slower than create_spare_key (-1, ...) for keybits > 0,
+ * since each spare key has to be read */
+extern int count_spare_keys (int keybits);
 
 /*************** operations on symmetric keys ********************/
 
@@ -282,6 +305,9 @@ extern int revalidate_symmetric_key (const char * contact);
 extern char * generate_key (int key_bits, char * phrase, char * lang,
                             int bitstring_bits, int min_bitstrings,
                             int give_feedback);
+/* generate_key tries keys in nthreads threads, which by default is one
+ * per processor.  The first matching key is saved, the others stop */
+extern void generate_key_threads (int nthreads);
 
 /* these give the "normal" version of the broadcast address, without the
  * language, bits, or both.  The existing string is modified in place */
@@ -322,6 +348,14 @@ extern unsigned int get_own_keys (struct bc_key_info ** key);
  * if not successful, returns 0 */
 extern unsigned int get_other_keys (struct bc_key_info ** key);
 
+/* fills in indices (in the array returned by get_other_keys) of up to
+ * max keys whose address matches the nbits of source, in key order.
+ * Uses an index by address, so is fast even with many keys.
+ * returns the number of keys that match, which may be more than max */
+extern unsigned int get_other_keys_matching (const unsigned char * source,
+                                             int nbits, int * indices,
+                                             int max);
+
 /* return the specified key (statically allocated, do not modify), or NULL */
 extern struct bc_key_info * get_own_bc_key (const char * ahra);
 extern struct bc_key_info * get_other_bc_key (const char * ahra);
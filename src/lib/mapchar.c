@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "mapchar.h"
 #include "util.h"
@@ -117,15 +119,6 @@ static long long int get_next_char (const char * string, const char ** next)
   }
 }
 
-static int prefix_match (const char * s1, const char * s2, size_t length)
-{
-  size_t i;
-  for (i = 0; i < length; i++)
-    if (s1 [i] != s2 [i])
-      return 0;
-  return 1;
-}
-
 static int string_length (const char * s)
 {
   int result = 0;
@@ -134,24 +127,42 @@ static int string_length (const char * s)
   return result;
 }
 
-/* return 1 if the substring is found in string, 0 otherwise */
-static int string_in_string (const char * substring, size_t substring_length,
-                             const char * string)
+/* the code of each character in default_charmap, indexed by its unicode
+ * value, so map_char need not search the charmap.  Computed once, and
+ * covers at least the ASCII characters.  CJK characters are not in the
+ * table, since their codes are computed */
+static unsigned char * char_map = NULL;
+static long long int char_map_size = 0;
+static pthread_once_t char_map_once = PTHREAD_ONCE_INIT;
+
+static void init_char_map ()
 {
-  if (substring_length == 1) {   /* optimization for common case */
-    while (*string != '\0') {
-      if (*substring == *string)
-        return 1;
-      string++;
+  long long int max = 127;
+  int i;
+  for (i = 0; i <= MAPCHAR_IGNORE_CHAR; i++) {
+    const char * p = default_charmap [i];
+    while (*p != '\0') {
+      const char * next = p + 1;
+      long long int c = get_next_char (p, &next);
+      if (c > max)
+        max = c;
+      p = next;
     }
-    return 0;
   }
-  size_t slen = string_length (string);
-  size_t i;
-  for (i = 0; i + substring_length <= slen; i++)
-    if (prefix_match (substring, string + i, substring_length))
-      return 1;
-  return 0;
+  char_map_size = max + 1;
+  char_map = malloc_or_fail (char_map_size, "mapchar init_char_map");
+  memset (char_map, MAPCHAR_UNKNOWN_CHAR, char_map_size);
+  for (i = MAPCHAR_IGNORE_CHAR; i >= 0; i--) {  /* earlier entries win */
+    const char * p = default_charmap [i];
+    while (*p != '\0') {
+      const char * next = p + 1;
+      long long int c = get_next_char (p, &next);
+      if (c >= 0)
+        char_map [c] = i;
+      p = next;
+    }
+  }
+  char_map ['\n'] = MAPCHAR_IGNORE_CHAR;
 }
 
 /* convert the first character pointed to by char into an int, and return it */
@@ -164,36 +175,27 @@ static int string_in_string (const char * substring, size_t substring_length,
  * in case of errors, it is not set. */
 int map_char (const char * string, const char ** next)
 {
-  /* printf ("mapchar (%s) ==> ", string); */
+  pthread_once (&char_map_once, init_char_map);
+  if ((*string & 0x80) == 0) {   /* ASCII, the common case */
+    if (*string == '\0') {
+      *next = string;
+      return MAPCHAR_EOS;
+    }
+    *next = string + 1;
+    return char_map [(int) *string];
+  }
   long long int unicode = get_next_char (string, next);
   if (unicode < 0)
     return MAPCHAR_UNKNOWN_CHAR;
-  if (unicode == 0) {
+  if (unicode == 0) {   /* an overlong encoding of 0 */
     *next = string;
-    /* printf ("EOS (%d)\n", MAPCHAR_EOS); */
     return MAPCHAR_EOS;
   }
-  if (unicode == '\n') {   /* special case */
-    *next = string;
-    /* printf ("IGNORE (%d)\n", MAPCHAR_IGNORE_CHAR); */
-    return MAPCHAR_IGNORE_CHAR;
-  }
   if (known_cjk (unicode))
     return unicode % MAPCHAR_IGNORE_CHAR;
 /* for now, always use the default char map */
-  int i;
-  for (i = 0; i < MAPCHAR_IGNORE_CHAR; i++) {
-    if (string_in_string (string, (*next) - string, default_charmap [i])) {
-      /* printf ("%d\n", i); */
-      return i;
-    }
-  }
-  if (string_in_string (string, (*next) - string,
-                        default_charmap [MAPCHAR_IGNORE_CHAR])) {
-    /* printf ("IGNORE (%d)\n", MAPCHAR_IGNORE_CHAR); */
-    return MAPCHAR_IGNORE_CHAR;
-  }
-  /* printf ("UNKNOWN (%d) for '%s'\n", MAPCHAR_UNKNOWN_CHAR, string); */
+  if (unicode < char_map_size)
+    return char_map [unicode];
   return MAPCHAR_UNKNOWN_CHAR;
 }
 
@@ -289,6 +291,72 @@ static char * default_post [NUM_CODE_WORDS] = {
 
 /* for now, only use the defaults, later look for files */
 
+/* aaddr_decode_value finds each word with a perfect hash of the list:
+ * a seed is found for which the hashes of all the words differ */
+#define CODE_WORD_HASH_SIZE	4096   /* a power of two */
+#define CODE_WORD_MAX_SEEDS	1000
+struct code_word_hash {
+  uint32_t seed;                        /* 0 if no perfect hash was found */
+  short index [CODE_WORD_HASH_SIZE];    /* -1, or the position in the list */
+};
+static struct code_word_hash pre_hash;
+static struct code_word_hash post_hash;
+static pthread_once_t code_word_once = PTHREAD_ONCE_INIT;
+
+static uint32_t code_word_hash (const char * word, uint32_t seed)
+{
+  uint32_t h = seed;   /* FNV-1a, starting from the seed */
+  for (; *word != '\0'; word++) {
+    h ^= (unsigned char) (*word);
+    h *= 16777619;
+  }
+  h ^= h >> 15;
+  return h & (CODE_WORD_HASH_SIZE - 1);
+}
+
+static void code_word_hash_init (struct code_word_hash * hash, char ** words)
+{
+  uint32_t seed;
+  for (seed = 1; seed <= CODE_WORD_MAX_SEEDS; seed++) {
+    memset (hash->index, 0xff, sizeof (hash->index));   /* all -1 */
+    int i;
+    for (i = 0; i < NUM_CODE_WORDS; i++) {
+      uint32_t h = code_word_hash (words [i], seed);
+      if (hash->index [h] >= 0)   /* collision, try another seed */
+        break;
+      hash->index [h] = i;
+    }
+    if (i >= NUM_CODE_WORDS) {
+      hash->seed = seed;
+      return;
+    }
+  }
+  hash->seed = 0;   /* unlikely, code_word_find searches the list instead */
+}
+
+static void init_code_word_hashes ()
+{
+  code_word_hash_init (&pre_hash, default_pre);
+  code_word_hash_init (&post_hash, default_post);
+}
+
+/* returns the position of the word in the list, or -1 if not found */
+static int code_word_find (struct code_word_hash * hash, char ** words,
+                           const char * word)
+{
+  if (hash->seed == 0) {
+    int i;
+    for (i = 0; i < NUM_CODE_WORDS; i++)
+      if (strcmp (words [i], word) == 0)
+        return i;
+    return -1;
+  }
+  int i = hash->index [code_word_hash (word, hash->seed)];
+  if ((i >= 0) && (strcmp (words [i], word) == 0))
+    return i;
+  return -1;
+}
+
 /* allocates and return a string representing the value.  If the value
  * is greater than or equal to 2^14 (16384), returns NULL */
 /* if the language is unavailable, returns an available language,
@@ -333,25 +401,13 @@ int aaddr_decode_value (char * string, int slen)
   char post_buf [1000];
   aaddr_copy (post_buf, sizeof (post_buf), middle + 1);
 
-  int pre, post;
-  int first = -1;
-  for (pre = 0; pre < 128; pre++) {
-    if (strcmp (default_pre [pre], pre_buf) == 0) {
-      first = pre;
-      break;
-    }
-  }
+  pthread_once (&code_word_once, init_code_word_hashes);
+  int first = code_word_find (&pre_hash, default_pre, pre_buf);
   if (first < 0) {
     printf ("unable to decode value %s, pre-word not found\n", string);
     return -1;
   }
-  int second = -1;
-  for (post = 0; post < 128; post++) {
-    if (strcmp (default_post [post], post_buf) == 0) {
-      second = post;
-      break;
-    }
-  }
+  int second = code_word_find (&post_hash, default_post, post_buf);
   if (second < 0) {
     printf ("unable to decode value %s, post-word not found\n", string);
     return -1;
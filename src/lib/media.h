@@ -20,6 +20,8 @@
 #define ALLNET_MEDIA_AUDIO_MP4		0x20000003 /* MP4 audio */
 #define ALLNET_MEDIA_AUDIO_OGG_VORBIS	0x20000004 /* Ogg Vorbis audio */
 #define ALLNET_MEDIA_AUDIO_OPUS   0x20000005 /* Opus audio */
+#define ALLNET_MEDIA_AUDIO_OPUS_FRAMES 0x20000006 /* Opus, several frames each
+                                  * preceded by its 2-byte length */
 
 #define ALLNET_MEDIA_IMAGE_RAW_TIFF	0x30000001 /* TIFF/EP raw image */
 #define ALLNET_MEDIA_IMAGE_RAW_EXIF	0x30000002 /* Exif/TIFF raw image */
@@ -40,6 +42,9 @@
 #define ALLNET_MEDIA_TIME_TEXT_BIN	0x80000002 /* in UTF-8 then binary */
 #define ALLNET_MEDIA_PUBLIC_KEY		0x80000003
 #define ALLNET_MEDIA_PROFILE	        0x80000004 /* same as compound */
+#define ALLNET_MEDIA_TIME_CHAIN_ANCHOR	0x80000005 /* see below */
+#define ALLNET_MEDIA_TIME_CHAIN_TICK	0x80000006 /* see below */
+#define ALLNET_MEDIA_TEXT_COMPRESSED	0x80000007 /* see below */
 
 /* for development purposes */
 #define ALLNET_MEDIA_TESTING_1		0xE0000001
@@ -75,6 +80,10 @@ struct allnet_compound_data {
 /* a profile is the same as a compound.  It will typically have a vcard
  * and one or more images */
 
+/* a compressed text has the size of the UTF-8 text as a 4-byte big-endian
+ * number, followed by the text compressed as in lib/compress.h */
+#define ALLNET_MEDIA_COMPRESSED_SIZE	4
+
 /* a geographic location in AllNet is given by three coordinates: 
  * a latitude, a longitude, and a height
  * each is given in units of from the equator at the prime meridian
@@ -109,5 +118,31 @@ struct allnet_earth_position {
 #define ALLNET_HEIGHT_PRECISION_INDEX	2
 };
 
+/* time announcements may be authenticated with a hash chain, so only
+ * one signature is needed for many announcements.  The sender picks a
+ * random key k[n], and computes each k[i] as the first
+ * ALLNET_TIME_CHAIN_KEY_SIZE bytes of sha512 (k[i+1]), down to k[0].
+ * The anchor, with k[0], is signed (ALLNET_SIGTYPE_RSA_PKCS1) with the
+ * broadcast key, and may be sent many times.  The announcement for
+ * tick i, 1 <= i <= n, is unsigned and reveals k[i].  It is sent at time
+ * start + i * interval, and holds the same text and binary time as
+ * ALLNET_MEDIA_TIME_TEXT_BIN, followed by struct allnet_time_chain_tick.
+ * A receiver that has verified k[j], j < i, checks k[i] by hashing it
+ * i - j times.  Since k[i] is not known to anyone before the sender
+ * reveals it, a valid tick means the time is at least start + i * interval.
+ * A tick can be delayed, but not sent early. */
+#define ALLNET_TIME_CHAIN_KEY_SIZE	32
+struct allnet_time_chain_anchor {
+  unsigned char start [8];       /* allnet time (seconds) of tick 0 */
+  unsigned char interval [4];    /* seconds between ticks */
+  unsigned char count [4];       /* n, the number of ticks */
+  unsigned char key [ALLNET_TIME_CHAIN_KEY_SIZE];   /* k[0] */
+};
+
+struct allnet_time_chain_tick {
+  unsigned char index [4];       /* i */
+  unsigned char key [ALLNET_TIME_CHAIN_KEY_SIZE];   /* k[i] */
+};
+
 #endif /* MEDIA_H */
 
@@ -186,8 +186,18 @@ struct allnet_mgmt_trace_reply {
  * spoofed IP address), or
  * a sender authenticator and a receiver authenticator
  * if we previously sent a sender authenticator to this peer, the receiver
- * authenticator should now have a copy of that earlier sender authenticator */
+ * authenticator should now have a copy of that earlier sender authenticator
+ *
+ * only the sender of an authenticator ever checks it, so each sender may
+ * compute it however it likes.  The top bit of the first byte gives the
+ * version: 0 for the original sha512 hmac, 1 for siphash-2-4, which is
+ * much cheaper.  Receivers accept either, senders send siphash
+ * unless KEEPALIVE_AUTH_SIPHASH is defined as 0 */
 #define KEEPALIVE_AUTHENTICATION_SIZE	8
+#ifndef KEEPALIVE_AUTH_SIPHASH
+#define KEEPALIVE_AUTH_SIPHASH		1
+#endif /* KEEPALIVE_AUTH_SIPHASH */
+#define KEEPALIVE_AUTH_VERSION_BIT	0x80
 struct allnet_keepalive_optional {
   char sender [KEEPALIVE_AUTHENTICATION_SIZE];
   char receiver [KEEPALIVE_AUTHENTICATION_SIZE];
@@ -204,6 +214,89 @@ struct allnet_mgmt_id_request {
 };
 #endif /* IMPLEMENT_MGMT_ID_REQUEST */
 
+/* a local program may ask allnetd for statistics about how long each
+ * stage of packet handling takes, and for its packet counters.  The
+ * request and the reply are only exchanged with local programs, and
+ * never forwarded.
+ * Each stage has a histogram: bucket i counts the times t (in
+ * microseconds) with binary_log (t) == i (lib/util.h), so bucket 0 is
+ * for t == 0 and bucket i > 0 is for 2^(i-1) <= t < 2^i.  The last
+ * bucket also counts all longer times.
+ * The stages are followed by one counter for each combination of message
+ * type, class of socket or address, and what happened to the packet, in
+ * the order counts [type] [class] [counter].  The last type counts packets
+ * with unknown types.  The counters are totals since allnetd started
+ * uptime_ms milliseconds before sending the reply, so rates can be
+ * computed from two replies.  All counts are big-endian */
+#define ALLNET_STATS_NAME_SIZE	16
+#define ALLNET_STATS_BUCKETS	32
+#define ALLNET_COUNT_TYPES		(ALLNET_TYPE_MGMT + 2)
+#define ALLNET_COUNT_CLASS_LOCAL	0	/* local programs */
+#define ALLNET_COUNT_CLASS_IPV4		1
+#define ALLNET_COUNT_CLASS_IPV6		2
+#define ALLNET_COUNT_CLASS_BROADCAST	3	/* local area broadcasts */
+#define ALLNET_COUNT_CLASS_TCP		4	/* to and from atcpd */
+#define ALLNET_COUNT_CLASS_SHARD	5	/* to and from other shards */
+#define ALLNET_COUNT_CLASSES		6
+#define ALLNET_COUNT_RECEIVED		0	/* packets received */
+#define ALLNET_COUNT_BYTES		1	/* bytes received */
+#define ALLNET_COUNT_FORWARDED		2	/* forwarded locally and/or out */
+#define ALLNET_COUNT_DUPLICATE		3	/* seen before, or no new acks */
+#define ALLNET_COUNT_INVALID		4	/* not a valid packet */
+#define ALLNET_COUNT_THROTTLED		5	/* dropped by a rate limit */
+#define ALLNET_COUNT_CACHED		6	/* saved in the packet cache */
+#define ALLNET_COUNT_COUNTERS		7
+struct allnet_mgmt_stats_req {
+  unsigned char request_id [8];       /* returned in the reply */
+};
+
+struct allnet_mgmt_stats_stage {
+  char name [ALLNET_STATS_NAME_SIZE];  /* null-terminated */
+  unsigned char count [8];
+  unsigned char max_us [8];
+  unsigned char buckets [ALLNET_STATS_BUCKETS] [8];
+};
+
+struct allnet_mgmt_stats_reply {
+  unsigned char request_id [8];       /* from the request */
+  unsigned char num_stages;
+  unsigned char num_types;            /* ALLNET_COUNT_TYPES */
+  unsigned char num_classes;          /* ALLNET_COUNT_CLASSES */
+  unsigned char num_counters;         /* ALLNET_COUNT_COUNTERS */
+  unsigned char pad [4];              /* always send as 0s */
+  unsigned char uptime_ms [8];
+  struct allnet_mgmt_stats_stage stages [0];  /* really, num_stages */
+  /* followed by num_types * num_classes * num_counters 8-byte counts */
+};
+
+/* the first byte of the counts that follow the stages of a stats reply,
+ * so count i is at ALLNET_STATS_COUNTS (reply) + 8 * i */
+#define ALLNET_STATS_COUNTS(reply)	\
+  ((const unsigned char *) ((reply)->stages + (reply)->num_stages))
+
+/* a local program may also ask allnetd how many bytes each of its
+ * subsystems uses, as counted by the memory accounting in lib/util.h.
+ * As for the statistics, the request and reply are only exchanged locally.
+ * The budget is 0 if there is none.  All counts are big-endian */
+#define ALLNET_MEMORY_NAME_SIZE	16
+struct allnet_mgmt_memory_req {
+  unsigned char request_id [8];       /* returned in the reply */
+};
+
+struct allnet_mgmt_memory_subsystem {
+  char name [ALLNET_MEMORY_NAME_SIZE];  /* null-terminated */
+  unsigned char bytes [8];
+  unsigned char peak [8];             /* the most used since allnetd started */
+};
+
+struct allnet_mgmt_memory_reply {
+  unsigned char request_id [8];       /* from the request */
+  unsigned char budget [8];
+  unsigned char num_subsystems;
+  unsigned char pad [7];              /* always send as 0s */
+  struct allnet_mgmt_memory_subsystem subsystems [0];  /* num_subsystems */
+};
+
 /* the header that precedes each of the management messages */
 struct allnet_mgmt_header {
   /* specify the kind of management message */
@@ -219,6 +312,10 @@ struct allnet_mgmt_header {
 #ifdef IMPLEMENT_MGMT_ID_REQUEST  /* not used, so, not implemented */
 #define ALLNET_MGMT_ID_REQUEST		10	/* request specific IDs */
 #endif /* IMPLEMENT_MGMT_ID_REQUEST */
+#define ALLNET_MGMT_STATS_REQ		11	/* local: request statistics */
+#define ALLNET_MGMT_STATS_REPLY		12	/* local: allnetd statistics */
+#define ALLNET_MGMT_MEMORY_REQ		13	/* local: request memory use */
+#define ALLNET_MGMT_MEMORY_REPLY	14	/* local: allnetd memory use */
   unsigned char mgmt_type;   /* every management packet has this */
   char mpad [7];
 };
@@ -11,6 +11,7 @@
  */
 #define ALLNET_PORT 	     0xa119  /* ALLNet, 41241 */
 #define ALLNET_LOCAL_PORT    0xa11e  /* ALLnEt, 41246 */
+#define ALLNET_SHARD_PORT    0xa11f  /* 41247, only on loopback, see ad.c */
 
 /* protocol number used when sending/receiving over 802.11, WiFi */
 #define ALLNET_WIFI_PROTOCOL 0xa119  /* ALLNet, 41241 */
@@ -97,6 +98,18 @@ struct allnet_header {
 /* 24 bytes (192 bits) */
 #define ALLNET_HEADER_SIZE	(sizeof (struct allnet_header))
 
+/* quick check of the fixed header fields, with a single branch when the
+ * header is sane: packet size, version, address bits, hops and message
+ * type.  Messages that pass may still be invalid, see is_valid_message.
+ * hp is a (const) struct allnet_header *, evaluated several times */
+#define ALLNET_HEADER_IS_SANE(hp, size)					\
+  (((size) >= ALLNET_HEADER_SIZE) &&					\
+   ((((hp)->version ^ ALLNET_VERSION) |					\
+     ((hp)->src_nbits > ADDRESS_BITS) | ((hp)->dst_nbits > ADDRESS_BITS) | \
+     ((hp)->hops > (hp)->max_hops) |					\
+     (((unsigned int) (hp)->message_type - ALLNET_TYPE_DATA) >		\
+      (ALLNET_TYPE_MGMT - ALLNET_TYPE_DATA))) == 0))
+
 /* the maximum number of acks in an ack packet is 64, giving a total
  * ack packet size of 1048 bytes = 1024 (acks) + 24 (header).
  * an ack received with n hops remaining may be included in any
@@ -414,4 +427,24 @@ struct allnet_data_request {
   unsigned char mid_bitmap [0];      /* message ID for messages */
 };
 
+/* the bitmaps may be followed by a summary of the messages the sender of
+ * the request already has, so the responder only sends the difference.
+ * The summary is a Bloom filter of the IDs of the messages most recently
+ * saved by the sender, with 2^bits_power_two bits.  Each of the
+ * num_hashes hashes of an ID is the 32-bit big-endian number at
+ * ID byte 4*i, modulo the number of bits, and the bits within a byte are
+ * numbered as for the bitmaps.  A message whose ID is in the filter
+ * is not sent.  Since the summary is optional, it is ignored unless it
+ * starts with ALLNET_DATA_REQ_HAVE_MAGIC and fits in the request. */
+#define ALLNET_DATA_REQ_HAVE_MAGIC	0x48   /* 'H' */
+#define ALLNET_DATA_REQ_HAVE_MAX_BITS	13     /* 1KB filter */
+#define ALLNET_DATA_REQ_HAVE_MAX_HASHES	(MESSAGE_ID_SIZE / 4)
+struct allnet_data_request_have {
+  unsigned char magic;
+  unsigned char bits_power_two;      /* 3..ALLNET_DATA_REQ_HAVE_MAX_BITS */
+  unsigned char num_hashes;          /* 1..ALLNET_DATA_REQ_HAVE_MAX_HASHES */
+  unsigned char padding;             /* sent as zero, ignored on receipt */
+  unsigned char filter [0];
+};
+
 #endif /* PACKET_H */
@@ -13,39 +13,73 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sched.h>
 #include <inttypes.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "pcache.h"
 #include "util.h"
 #include "configfiles.h"
 #include "sha.h"
+#include "priority.h"
+#include "probes.h"
 
 /* implementation: acks are simple, a hash table, both on disk and in memory
  * the same for message IDs that we save (via pcache_record_packet),
  * and for trace requests and replies
  * likewise tokens are saved.  (the local token is handled separately)
  *
- * actual messages are stored sequentially in order of decreasing priority.
- * and their IDs are also stored in the mid_table.
- * every time we delete some messages, we decrease the priority
- * of the remaining messages */
+ * actual messages are appended to fixed-size segments of msg_table,
+ * and their IDs are also stored in the mid_table.  Deleting a message
+ * only sets its priority to zero.  A background thread compacts the
+ * segments, copying the messages still needed out of segments that
+ * are mostly deleted, expired, or acked messages, and freeing them.
+ * When space runs out, the lowest-priority messages are deleted first.
+ * The order of priorities is not kept in msg_table, but in a heap. */
 
 struct message_header {  /* 32 bytes per message header */
   char id [MESSAGE_ID_SIZE];
   uint32_t length;               /* actual length of the message */
   uint32_t priority;             /* set to zero for deleted messages */
-  uint64_t sent_to_tokens;
+  uint64_t serial;               /* the order in which messages were saved */
 };  /* length bytes of data follow, padded to a multiple of 16 bytes */
 
 static struct message_header * msg_table = NULL;
 static size_t msg_table_size = 0;   /* size in bytes */
 
+/* msg_table is made up of num_segments segments, each of which starts with
+ * a segment_header, followed by messages up to the used size.  Messages
+ * never cross segment boundaries. */
+#define SEGMENT_SIZE		(256 * 1024)
+#define MESSAGES_MIN_SIZE	(4 * 1024 * 1024)	/* at least four MBi */
+#define SEGMENT_MAGIC		"allnetsg"
+#define SEGMENT_MAGIC_SIZE	8
+struct segment_header {  /* 32 bytes */
+  char magic [SEGMENT_MAGIC_SIZE];
+  uint32_t used;                 /* bytes used, including the header */
+  uint32_t pad;
+  uint64_t sequence;             /* the order in which segments are used */
+  uint64_t valid_until;          /* see segment_valid_update */
+};  /* a segment that is all zeros, or without the magic string, is free */
+
+static int num_segments = 0;
+static int segment_limit = 0;         /* segments beyond are being removed */
+static size_t * segment_live = NULL;  /* bytes in undeleted messages */
+static int current_segment = -1;      /* where new messages are appended */
+static int free_segments = 0;         /* only counts those before the limit */
+static uint64_t next_sequence = 1;
+
 struct hash_entry {  /* 32 bytes per hash entry */
   char ida [MESSAGE_ID_SIZE]; /* for acks, this is the ack */
-  uint64_t sent_to_tokens;    /* 8 bytes */
+  uint64_t serial;            /* 8 bytes -- only used for acks */
   uint8_t used;               /* 1 byte */
   uint8_t max_hops;           /* 1 byte -- only used for acks */
   uint8_t pad [6];            /* may be used in the future -- 6 bytes */
@@ -59,29 +93,286 @@ static int num_mid = 0;
 static struct hash_entry * trc_table = NULL;  /* trace requests and replies */
 static int num_trc = 0;
 
-/* combine IDs with a random value to make it harder to guess how we hash */
-static unsigned long long int ack_secret = 0;
-static unsigned long long int mid_secret = 0;
-static unsigned long long int trc_secret = 0;
+/* hash IDs with a random key to make it harder to guess how we hash */
+static char ack_secret [SIPHASH_KEY_SIZE];
+static char mid_secret [SIPHASH_KEY_SIZE];
+static char trc_secret [SIPHASH_KEY_SIZE];
 
-#define MAX_TOKENS	64	/* external tokens.  The list of which tokens
-                                   we have sent to can be saved in a uint64_t */
+#define MAX_TOKENS	4096	/* external tokens, a power of two */
 struct tokens {  /* format saved on file and in memory */
   char tokens [MAX_TOKENS] [ALLNET_TOKEN_SIZE];
-  char num_tokens;
-  char most_recent_token;  /* when we run out of space, we clear from here */
+  uint32_t num_tokens;
+  uint32_t most_recent_token;  /* when we run out of space, we replace
+                                  the token after this one */
 };
 
 static struct tokens tokens = { .num_tokens = 0,
                                 .most_recent_token = MAX_TOKENS - 1 };
 
-static int save_tokens = 0;
-static int save_ack_hashes = 0;
-static int save_trc_hashes = 0;
-static int save_messages = 0;
+/* tokens are found through a chained hash table, which is not saved.
+ * token_buckets and token_next hold token indices, or -1 */
+static int token_buckets [MAX_TOKENS];
+static int token_next [MAX_TOKENS];
+static char token_secret [SIPHASH_KEY_SIZE];
+
+/* which messages and acks have been sent to each token.  Every message
+ * and ack gets a serial number when it is saved, and for each token we
+ * keep the set of serial numbers sent to it, so the message headers
+ * need not grow with the number of tokens.  As in roaring bitmaps, a
+ * set is split into chunks of 2^16 serial numbers.  A chunk with few
+ * members stores their low 16 bits in a sorted array, and otherwise
+ * has a bitmap.  Chunks older than any message (or ack) still saved
+ * are discarded */
+#define CHUNK_BITS		16
+#define CHUNK_ARRAY_MAX		4096   /* a larger array uses more space
+                                          than the bitmap */
+#define CHUNK_BITMAP_WORDS	((1 << CHUNK_BITS) / 64)
+struct serial_chunk {
+  uint64_t key;                  /* serial >> CHUNK_BITS */
+  uint32_t count;
+  uint32_t capacity;             /* size of array, 0 if bitmap is used */
+  uint16_t * array;              /* sorted */
+  uint64_t * bitmap;
+};
+struct serial_set {
+  struct serial_chunk * chunks;  /* sorted by key */
+  int num_chunks;
+  int max_chunks;
+};
+struct delivery {
+  struct serial_set messages;
+  struct serial_set acks;
+};
+static struct delivery deliveries [MAX_TOKENS];
+
+/* the cache files are in ~/.allnet/cache_directory */
+static const char * cache_directory = "acache";
+
+/* serial numbers start at 1 */
+static uint64_t next_msg_serial = 1;
+static atomic_ullong next_ack_serial = 1;
+static uint64_t delivery_msg_serial = 0;  /* next_msg_serial when the
+                                             deliveries were saved */
+
+/* the IDs of the messages most recently saved, for the summaries in
+ * forwarded data requests, so these need not look at the whole cache.
+ * The entry for each message is at its serial number modulo
+ * PCACHE_RECENT_IDS, and is cleared when the message is deleted.
+ * Protected by msg_lock */
+#ifndef PCACHE_RECENT_IDS
+#define PCACHE_RECENT_IDS	1024	/* summaries have at most this many */
+#endif /* PCACHE_RECENT_IDS */
+struct recent_id {
+  uint64_t serial;                /* 0 if unused */
+  char id [MESSAGE_ID_SIZE];
+};
+static struct recent_id recent_ids [PCACHE_RECENT_IDS];
+
+static void recent_id_add (const struct message_header * hp)
+{
+  struct recent_id * r = recent_ids + (hp->serial % PCACHE_RECENT_IDS);
+  if (hp->serial < r->serial)     /* already has a more recent message */
+    return;
+  r->serial = hp->serial;
+  memcpy (r->id, hp->id, MESSAGE_ID_SIZE);
+}
+
+/* set when a table changes, cleared when the table is saved */
+static atomic_int save_tokens = 0;
+static atomic_int save_ack_hashes = 0;
+static atomic_int save_trc_hashes = 0;
+static atomic_int save_messages = 0;
+static atomic_int save_deliveries = 0;
 
 static const uint64_t one64 = 1;
 
+/* allnetd may call the pcache functions from several worker threads.
+ * The locks, in the order they are acquired (a thread holding one of
+ * these locks only ever waits for locks later in the list):
+ *
+ * msg_lock protects msg_table and its segments, indexes, and heap.
+ *   pcache_request holds it for reading, so concurrent requests do not
+ *   block each other.  Anything that adds, deletes, or moves messages
+ *   holds it for writing.
+ * token_lock protects the tokens and their hash table.
+ * hash_locks protect the entries of ack_table, mid_table, and trc_table.
+ *   Entry i of each of these is protected by hash_locks [i % HASH_LOCKS],
+ *   so lookups of different IDs seldom wait for each other.  At most
+ *   one of these is held at any time, except to write a whole table.
+ * delivery_locks protect the deliveries.  Those of token i are
+ *   protected by delivery_locks [i % HASH_LOCKS].  At most one of
+ *   these is held at any time.
+ * file_lock protects the dirty ranges of the table files.
+ *
+ * the tables are created once, by pcache_init.  The compaction thread
+ * may later resize them: msg_table while holding msg_lock for writing,
+ * and the hash tables as described before hash_table, with a lock
+ * for each table that is acquired between msg_lock and token_lock.
+ * Static functions assume the caller holds the locks they need. */
+static pthread_rwlock_t msg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HASH_LOCKS	64
+static pthread_mutex_t hash_locks [HASH_LOCKS];
+static pthread_mutex_t delivery_locks [HASH_LOCKS];
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hash_lock (int index)
+{
+  pthread_mutex_lock (hash_locks + (index % HASH_LOCKS));
+}
+
+static void hash_unlock (int index)
+{
+  pthread_mutex_unlock (hash_locks + (index % HASH_LOCKS));
+}
+
+static void delivery_lock (int token_index)
+{
+  pthread_mutex_lock (delivery_locks + (token_index % HASH_LOCKS));
+}
+
+static void delivery_unlock (int token_index)
+{
+  pthread_mutex_unlock (delivery_locks + (token_index % HASH_LOCKS));
+}
+
+/* the ack, trace, and message tables are normally mapped from their files,
+ * so startup does not read them, and saving only writes back the part
+ * of each table modified since the last save.  If a file cannot be
+ * mapped, its table is malloc'd and read and written as a whole */
+struct table_file {
+  char * base;          /* NULL if the table is not mapped */
+  size_t size;          /* size of the mapping */
+  size_t dirty_start;   /* the bytes modified since the last sync, */
+  size_t dirty_end;     /* dirty_start >= dirty_end if none */
+};
+static struct table_file ack_file = { .base = NULL };
+static struct table_file trc_file = { .base = NULL };
+static struct table_file msg_file = { .base = NULL };
+
+/* record that len bytes at p (which may be outside the mapping) changed */
+static void table_dirty (struct table_file * tf, const void * p, size_t len)
+{
+  if ((tf->base == NULL) || (len == 0) || (((const char *) p) < tf->base))
+    return;
+  size_t start = ((const char *) p) - tf->base;
+  if (start >= tf->size)
+    return;
+  size_t end = ((start + len > tf->size) ? tf->size : (start + len));
+  pthread_mutex_lock (&file_lock);
+  if (tf->dirty_start >= tf->dirty_end) {  /* nothing dirty so far */
+    tf->dirty_start = start;
+    tf->dirty_end = end;
+  } else {
+    if (start < tf->dirty_start)
+      tf->dirty_start = start;
+    if (end > tf->dirty_end)
+      tf->dirty_end = end;
+  }
+  pthread_mutex_unlock (&file_lock);
+}
+
+static void table_dirty_all (struct table_file * tf)
+{
+  table_dirty (tf, tf->base, tf->size);
+}
+
+/* returns the size of the open file, or -1 for errors */
+static ssize_t table_file_size (int fd)
+{
+  struct stat st;
+  if (fstat (fd, &st) != 0)
+    return -1;
+  return st.st_size;
+}
+
+/* maps size bytes of the file, extending (or truncating) it as needed,
+ * and closes fd.  Returns the mapping, or NULL if it fails */
+static char * table_map (int fd, size_t size, struct table_file * tf)
+{
+  char * base = NULL;
+  if ((size > 0) && (ftruncate (fd, size) == 0)) {
+    base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+  }
+  close (fd);
+  tf->base = base;
+  tf->size = ((base == NULL) ? 0 : size);
+  tf->dirty_start = tf->dirty_end = 0;
+  return base;
+}
+
+#ifdef PRINT_CACHE_FILES
+/* maps the whole file read-only, and returns the mapping and its size,
+ * or NULL.  Changes to the mapping (e.g. by rehashing) are private, and
+ * never written to the file */
+static char * map_private (const char * fname, size_t * size)
+{
+  int fd = open_read_config (cache_directory, fname, 1);
+  if (fd < 0)
+    return NULL;
+  ssize_t file_size = table_file_size (fd);
+  char * base = NULL;
+  if (file_size > 0) {
+    base = mmap (NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+  }
+  close (fd);
+  *size = ((base == NULL) ? 0 : file_size);
+  return base;
+}
+#endif /* PRINT_CACHE_FILES */
+
+static void table_unmap (struct table_file * tf)
+{
+  if (tf->base != NULL)
+    munmap (tf->base, tf->size);
+  tf->base = NULL;
+  tf->size = tf->dirty_start = tf->dirty_end = 0;
+}
+
+/* write back the pages modified since the last sync.  If wait, only
+ * returns once the pages are on disk */
+static void table_sync (struct table_file * tf, int wait)
+{
+  if (tf->base == NULL)
+    return;
+  pthread_mutex_lock (&file_lock);
+  size_t dirty_start = tf->dirty_start;
+  size_t dirty_end = tf->dirty_end;
+  tf->dirty_start = tf->dirty_end = 0;
+  pthread_mutex_unlock (&file_lock);
+  if (dirty_start >= dirty_end)
+    return;
+  long page = sysconf (_SC_PAGESIZE);
+  if (page <= 0)
+    page = 4096;
+  size_t start = (dirty_start / page) * page;  /* msync needs alignment */
+  if (msync (tf->base + start, dirty_end - start,
+             (wait ? MS_SYNC : MS_ASYNC)) != 0)
+    perror ("pcache msync");
+}
+
+#ifndef PRINT_CACHE_FILES
+/* files that are not mapped are written by the writer thread of
+ * write_file_async, so saving does not wait for the disk while
+ * holding the locks */
+static void write_config_async (const char * fname, const void * data,
+                                size_t size)
+{
+  char * path = NULL;
+  if (config_file_name (cache_directory, fname, &path, 1) <= 0)
+    return;
+  if (size > INT_MAX)
+    printf ("pcache unable to write %zd bytes to %s\n", size, path);
+  else
+    write_file_async (path, data, (int) size, 0, 1);
+  free (path);
+}
+#endif /* PRINT_CACHE_FILES */
+
 static void crash (const char * reason)
 {
   printf ("crashing %d (%s):\n", getpid (), reason);
@@ -95,58 +386,298 @@ static uint32_t msg_storage (uint32_t size)
   return (((size + 15) / 16) * 16);
 }
 
+static struct segment_header * segment_header (int segment)
+{
+  return (struct segment_header *)
+           (((char *) msg_table) + ((size_t) segment) * SEGMENT_SIZE);
+}
+
+static int segment_in_use (int segment)
+{
+  struct segment_header * sh = segment_header (segment);
+  return ((memcmp (sh->magic, SEGMENT_MAGIC, SEGMENT_MAGIC_SIZE) == 0) &&
+          (sh->used >= sizeof (struct segment_header)) &&
+          (sh->used <= SEGMENT_SIZE));
+}
+
+static int segment_of (const void * p)
+{
+  return (int) ((((const char *) p) - ((char *) msg_table)) / SEGMENT_SIZE);
+}
+
+static size_t record_size (const struct message_header * hp)
+{
+  return sizeof (struct message_header) + msg_storage (hp->length);
+}
+
+/* return the message following hp in the same segment: if there is none,
+ * the first message of the next segment in use.  If hp is NULL, the first
+ * message in msg_table.  Returns NULL at the end */
 static struct message_header * next_message (struct message_header * hp)
 {
   const size_t mh_size = sizeof (struct message_header);
-  struct message_header * result = NULL;   /* this is our result */
-  if (hp == NULL) {   /* special case, check whether msg_table is empty */
-    if ((msg_table_size < mh_size) || (msg_table->length == 0))
-      return NULL;
-    result = msg_table;   /* return the first message */
-  } else {
-    size_t msg_table_offset = ((char *) hp) - ((char *) msg_table);
-    size_t current_size = mh_size + msg_storage (hp->length);
-    /* do some checking, so we don't have to do it elsewhere */
-    if ((hp->length == 0) || (hp->length > ALLNET_MTU) ||
-        ((msg_table_offset % 16) != 0) ||
-        (current_size + msg_table_offset > msg_table_size)) {
-      printf ("next_message: hp %p/%d, offset %d, sizes %zd+%zd, table %p\n",
-              hp, hp->length, (int)(((char *) hp) - ((char *) msg_table)),
-              current_size, msg_table_offset, msg_table);
-      return NULL;
+  int segment = 0;
+  size_t offset = sizeof (struct segment_header);  /* within the segment */
+  if (hp != NULL) {
+    segment = segment_of (hp);
+    offset = (((char *) hp) - ((char *) segment_header (segment))) +
+             record_size (hp);
+  }
+  while (segment < num_segments) {
+    if (segment_in_use (segment)) {
+      struct segment_header * sh = segment_header (segment);
+      if (offset + mh_size <= sh->used) {
+        struct message_header * result =
+          (struct message_header *) (((char *) sh) + offset);
+        /* do some checking, so we don't have to do it elsewhere */
+        if ((result->length > 0) && (result->length <= ALLNET_MTU) &&
+            (offset + record_size (result) <= sh->used))
+          return result;
+        printf ("next_message: bad message of size %d in segment %d at %zd\n",
+                result->length, segment, offset);
+      }
     }
-    result = (struct message_header *) (((char *) hp) + current_size);
-  }
-  if (result == NULL) { printf ("major error in next_message\n"); crash ("major error in next_message"); }
-  char * p = (char *) result;
-  size_t msg_table_offset = p - ((char *) msg_table);
-  if ((msg_table_offset % 16) != 0) {
-    printf ("next_message error: next %p, offset %zd, table %p\n",
-            p, msg_table_offset, msg_table);
-    crash ("next_message error");
-    return NULL;
+    segment++;
+    offset = sizeof (struct segment_header);
   }
-  if (result->length == 0)  /* end of messages */
-    return NULL;
-  int result_size = mh_size + msg_storage (result->length);
-  if (msg_table_offset + result_size > msg_table_size)
-    return NULL;
+  return NULL;
+}
+
+/* returns the position of the chunk with this key or, if there is none,
+ * -1 - the position where it belongs */
+static int set_find_chunk (const struct serial_set * set, uint64_t key)
+{
+  int low = 0;
+  int high = set->num_chunks;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (set->chunks [mid].key == key)
+      return mid;
+    if (set->chunks [mid].key < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return -1 - low;
+}
+
+/* returns the position of value in the array of the chunk or, if it is
+ * not there, -1 - the position where it belongs */
+static int chunk_array_find (const struct serial_chunk * c, uint16_t value)
+{
+  int low = 0;
+  int high = (int) c->count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (c->array [mid] == value)
+      return mid;
+    if (c->array [mid] < value)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return -1 - low;
+}
+
+static int set_contains (const struct serial_set * set, uint64_t serial)
+{
+  int pos = set_find_chunk (set, serial >> CHUNK_BITS);
+  if (pos < 0)
+    return 0;
+  const struct serial_chunk * c = set->chunks + pos;
+  uint16_t low = (uint16_t) serial;
+  if (c->bitmap != NULL)
+    return (int) ((c->bitmap [low / 64] >> (low % 64)) & 1);
+  return (chunk_array_find (c, low) >= 0);
+}
+
+static void chunk_to_bitmap (struct serial_chunk * c)
+{
+  size_t size = CHUNK_BITMAP_WORDS * sizeof (uint64_t);
+  c->bitmap = malloc_or_fail (size, "pcache chunk_to_bitmap");
+  memset (c->bitmap, 0, size);
+  uint32_t i;
+  for (i = 0; i < c->count; i++)
+    c->bitmap [c->array [i] / 64] |= (((uint64_t) 1) << (c->array [i] % 64));
+  free (c->array);
+  c->array = NULL;
+  c->capacity = 0;
+}
+
+/* returns 1 if the serial was added, 0 if it was already in the set */
+static int set_add (struct serial_set * set, uint64_t serial)
+{
+  uint64_t key = serial >> CHUNK_BITS;
+  int pos = set_find_chunk (set, key);
+  if (pos < 0) {   /* add a chunk */
+    pos = -1 - pos;
+    if (set->num_chunks >= set->max_chunks) {
+      int max = ((set->max_chunks == 0) ? 4 : (set->max_chunks * 2));
+      struct serial_chunk * chunks =
+        malloc_or_fail (max * sizeof (struct serial_chunk), "pcache set_add");
+      if (set->chunks != NULL) {
+        memcpy (chunks, set->chunks,
+                set->num_chunks * sizeof (struct serial_chunk));
+        free (set->chunks);
+      }
+      set->chunks = chunks;
+      set->max_chunks = max;
+    }
+    memmove (set->chunks + pos + 1, set->chunks + pos,
+             (set->num_chunks - pos) * sizeof (struct serial_chunk));
+    memset (set->chunks + pos, 0, sizeof (struct serial_chunk));
+    set->chunks [pos].key = key;
+    set->num_chunks++;
+  }
+  struct serial_chunk * c = set->chunks + pos;
+  uint16_t low = (uint16_t) serial;
+  if ((c->bitmap == NULL) && (c->count >= CHUNK_ARRAY_MAX) &&
+      (chunk_array_find (c, low) < 0))
+    chunk_to_bitmap (c);
+  if (c->bitmap != NULL) {
+    uint64_t bit = ((uint64_t) 1) << (low % 64);
+    if (c->bitmap [low / 64] & bit)
+      return 0;
+    c->bitmap [low / 64] |= bit;
+    c->count++;
+    return 1;
+  }
+  int index = chunk_array_find (c, low);
+  if (index >= 0)
+    return 0;
+  index = -1 - index;
+  if (c->count >= c->capacity) {
+    uint32_t capacity = ((c->capacity == 0) ? 16 : (c->capacity * 2));
+    uint16_t * array =
+      malloc_or_fail (capacity * sizeof (uint16_t), "pcache set_add array");
+    if (c->array != NULL) {
+      memcpy (array, c->array, c->count * sizeof (uint16_t));
+      free (c->array);
+    }
+    c->array = array;
+    c->capacity = capacity;
+  }
+  memmove (c->array + index + 1, c->array + index,
+           (c->count - index) * sizeof (uint16_t));
+  c->array [index] = low;
+  c->count++;
+  return 1;
+}
+
+static void chunk_free (struct serial_chunk * c)
+{
+  if (c->array != NULL)
+    free (c->array);
+  if (c->bitmap != NULL)
+    free (c->bitmap);
+  c->array = NULL;
+  c->bitmap = NULL;
+}
+
+/* discard the chunks whose serials are all less than min_serial */
+static void set_prune (struct serial_set * set, uint64_t min_serial)
+{
+  uint64_t min_key = min_serial >> CHUNK_BITS;
+  int n = 0;
+  while ((n < set->num_chunks) && (set->chunks [n].key < min_key))
+    chunk_free (set->chunks + n++);
+  if (n == 0)
+    return;
+  set->num_chunks -= n;
+  memmove (set->chunks, set->chunks + n,
+           set->num_chunks * sizeof (struct serial_chunk));
+  if (set->num_chunks == 0) {
+    free (set->chunks);
+    set->chunks = NULL;
+    set->max_chunks = 0;
+  }
+}
+
+static void set_clear (struct serial_set * set)
+{
+  int i;
+  for (i = 0; i < set->num_chunks; i++)
+    chunk_free (set->chunks + i);
+  if (set->chunks != NULL)
+    free (set->chunks);
+  set->chunks = NULL;
+  set->num_chunks = set->max_chunks = 0;
+}
+
+/* returns 1 if the message (or if acks is true, the ack) with this
+ * serial has been sent to the token, 0 otherwise */
+static int delivery_test (int token_index, int acks, uint64_t serial)
+{
+  struct delivery * dp = deliveries + token_index;
+  delivery_lock (token_index);
+  int result = set_contains ((acks ? &(dp->acks) : &(dp->messages)), serial);
+  delivery_unlock (token_index);
   return result;
 }
 
+/* record that the message (or ack) has been sent to the token.
+ * Returns 1 if it had not been sent before, 0 otherwise */
+static int delivery_add (int token_index, int acks, uint64_t serial)
+{
+  struct delivery * dp = deliveries + token_index;
+  delivery_lock (token_index);
+  int result = set_add ((acks ? &(dp->acks) : &(dp->messages)), serial);
+  delivery_unlock (token_index);
+  if (result)
+    save_deliveries = 1;
+  return result;
+}
+
+static int token_bucket (const char * token)
+{
+  return (int) (siphash24 (token, ALLNET_TOKEN_SIZE, token_secret) %
+                MAX_TOKENS);
+}
+
+static void token_hash_insert (int token_index)
+{
+  int bucket = token_bucket (tokens.tokens [token_index]);
+  token_next [token_index] = token_buckets [bucket];
+  token_buckets [bucket] = token_index;
+}
+
+static void token_hash_remove (int token_index)
+{
+  int * p = token_buckets + token_bucket (tokens.tokens [token_index]);
+  while ((*p >= 0) && (*p != token_index))
+    p = token_next + *p;
+  if (*p == token_index)
+    *p = token_next [token_index];
+  token_next [token_index] = -1;
+}
+
+/* called after the tokens are read */
+static void token_hash_build ()
+{
+  random_bytes (token_secret, sizeof (token_secret));
+  int i;
+  for (i = 0; i < MAX_TOKENS; i++)
+    token_buckets [i] = token_next [i] = -1;
+  for (i = 0; i < MAX_TOKENS; i++)
+    if (! memget (tokens.tokens [i], 0, ALLNET_TOKEN_SIZE))
+      token_hash_insert (i);
+}
+
 /* return -1 if not found, the token index otherwise */
 static int token_find_index (const unsigned char * token)
 {
   if ((token == NULL) || (memget (token, 0, ALLNET_TOKEN_SIZE)))
     return -1;   /* all-zeros token is never found */
   int i;
-  for (i = 0; i < MAX_TOKENS; i++) {
+  for (i = token_buckets [token_bucket ((const char *) token)]; i >= 0;
+       i = token_next [i]) {
     if (memcmp (tokens.tokens [i], token, ALLNET_TOKEN_SIZE) == 0) /* found */
       return i;
   }
   return -1; /* token not found */
 }
 
+/* called with token_lock held */
 static int add_token (const unsigned char * token, const char * caller)
 {
   if ((token == NULL) || (memget (token, 0, ALLNET_TOKEN_SIZE))) {
@@ -157,132 +688,862 @@ static int add_token (const unsigned char * token, const char * caller)
   }
   save_tokens = 1;
   int token_index = (tokens.most_recent_token + 1) % MAX_TOKENS;
-  if ((tokens.num_tokens == MAX_TOKENS) && (token_index % 8 == 0)) {
-    /* discard the next 8 tokens, clearing the corresponding byte
-     * in all the records */
-    memset (tokens.tokens + token_index, 0, 8 * ALLNET_TOKEN_SIZE);
-    /* adjust all the sent_to_tokens fields */
-    int byte_index = token_index / 8;
-    int i;
-    for (i = 0; i < num_ack; i++)
-      if (ack_table [i].used)
-        ((char *)(&ack_table [i].sent_to_tokens)) [byte_index] = 0;
-    for (i = 0; i < num_trc; i++)
-      if (trc_table [i].used)
-        ((char *)(&trc_table [i].sent_to_tokens)) [byte_index] = 0;
-    for (i = 0; i + sizeof (struct message_header) <= msg_table_size; ) {
-      char * p = (char *) msg_table;
-      struct message_header * hp = (struct message_header *) (p + i);
-      if (hp->length == 0)  /* last message, used as a sentinel */
-        break;
-      ((char *)(&hp->sent_to_tokens)) [byte_index] = 0;
-      i += sizeof (struct message_header) + msg_storage (hp->length);
-    }
-    save_ack_hashes = 1;
-    save_trc_hashes = 1;
-    save_messages = 1;
+  if (! memget (tokens.tokens [token_index], 0, ALLNET_TOKEN_SIZE)) {
+    /* replace the oldest token, forgetting what was sent to it */
+    token_hash_remove (token_index);
+    delivery_lock (token_index);
+    set_clear (&(deliveries [token_index].messages));
+    set_clear (&(deliveries [token_index].acks));
+    delivery_unlock (token_index);
+    save_deliveries = 1;
   }
   memcpy (tokens.tokens [token_index], token, ALLNET_TOKEN_SIZE);
+  token_hash_insert (token_index);
   if (tokens.num_tokens < MAX_TOKENS)
     tokens.num_tokens++;
   tokens.most_recent_token = token_index;
   return token_index;
 }
 
+/* returns the index of the token, or -1 if the token is all zeros.
+ * If the token is new and add is true, adds it */
+static int token_lookup (const unsigned char * token, int add,
+                         const char * caller)
+{
+  pthread_mutex_lock (&token_lock);
+  int result = token_find_index (token);
+  if ((result < 0) && (add) && (! memget (token, 0, ALLNET_TOKEN_SIZE)))
+    result = add_token (token, caller);
+  pthread_mutex_unlock (&token_lock);
+  return result;
+}
+
 /* returns a valid index, 0 <= i < hash_table_size.
  * id must have size 16, which is MESSAGE_ID_SIZE
- * we use sha512 hash so that even if an observer notices a collision,
- * they cannot guess the secret */
+ * we use a keyed hash (siphash) so that even if an observer notices
+ * a collision, they cannot guess the secret */
 static int id_index (const char * id, unsigned long long int hash_table_size,
-                     unsigned long long int secret)
+                     const char * secret)
 {
-  char source [MESSAGE_ID_SIZE + 8];
-  memcpy (source, id, MESSAGE_ID_SIZE);
-  writeb64 (source + MESSAGE_ID_SIZE, secret);
-  char hash [SHA512_SIZE];
-  sha512 (source, sizeof (source), hash);
-  return (int) (readb64 (hash + SHA512_SIZE / 2) % hash_table_size);
+  return (int) (siphash24 (id, MESSAGE_ID_SIZE, secret) % hash_table_size);
 }
 
-/* the index for the ack is computed from the corresponding ID */
-static int ack_index (const char * ack)
+/* blocked Bloom filters in front of the hash tables, so most lookups of
+ * IDs and acks that are not in the tables need neither a sha512 nor a
+ * probe of the table.  Each key sets BLOOM_BITS bits in one 64-byte
+ * block.  Entries in the tables are replaced but never deleted, so
+ * the filters are rebuilt from the tables after every limit additions.
+ * A rebuild fills the inactive copy, then makes it active.  Lookups
+ * read the active copy, and additions set bits in both.  The two copies
+ * may have different sizes while the filter is resized, so each has
+ * its own number of blocks */
+#define BLOOM_BLOCK_WORDS	8    /* 512 bits, one cache line */
+#define BLOOM_BITS		4
+struct bloom {
+  uint64_t * blocks [2];
+  atomic_int active;             /* the copy used for lookups */
+  uint64_t num_blocks [2];       /* each a power of two */
+  uint64_t secret;
+  atomic_int additions;          /* since the last rebuild */
+  int limit;
+  atomic_int rebuilding;
+};
+static struct bloom mid_bloom = { .num_blocks = { 0, 0 } };   /* message IDs */
+static struct bloom ack_bloom = { .num_blocks = { 0, 0 } };   /* acks */
+static struct bloom acked_bloom = { .num_blocks = { 0, 0 } }; /* IDs of acks */
+
+/* about 16 bits per entry */
+static uint64_t bloom_blocks_for (int entries)
 {
-  char id [MESSAGE_ID_SIZE];
-  sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
-  return id_index (id, num_ack, ack_secret);
+  uint64_t result = 1;
+  while (result * BLOOM_BLOCK_WORDS * 64 < ((uint64_t) entries) * 16)
+    result *= 2;
+  return result;
+}
+
+static uint64_t * bloom_alloc (uint64_t num_blocks)
+{
+  size_t size = num_blocks * BLOOM_BLOCK_WORDS * sizeof (uint64_t);
+  uint64_t * result = malloc_or_fail (size, "pcache bloom_alloc");
+  memset (result, 0, size);
+  return result;
+}
+
+static void bloom_init (struct bloom * b, int entries)
+{
+  int i;
+  for (i = 0; i < 2; i++) {
+    b->num_blocks [i] = bloom_blocks_for (entries);
+    b->blocks [i] = bloom_alloc (b->num_blocks [i]);
+  }
+  b->active = 0;
+  b->secret = random_int (0, (unsigned long long int) (-1));
+  b->additions = 0;
+  b->limit = entries / 2;
+  b->rebuilding = 0;
+}
+
+/* IDs and acks are already hashes (or random), so mixing them with
+ * the secret is enough */
+static uint64_t bloom_hash (const struct bloom * b, const char * key)
+{
+  uint64_t h = readb64 (key) ^ readb64 (key + 8) ^ b->secret;
+  h ^= h >> 33;   /* the murmur3 finalizer */
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static void bloom_set (const struct bloom * b, int copy, uint64_t h)
+{
+  uint64_t * block = b->blocks [copy] +
+                     (h & (b->num_blocks [copy] - 1)) * BLOOM_BLOCK_WORDS;
+  int i;
+  for (i = 0; i < BLOOM_BITS; i++) {
+    int bit = (int) ((h >> (28 + 9 * i)) & 511);
+    __atomic_fetch_or (block + bit / 64, one64 << (bit % 64), __ATOMIC_RELAXED);
+  }
+}
+
+/* returns 0 if the key is definitely not in the table, 1 if it may be */
+static int bloom_maybe (struct bloom * b, const char * key)
+{
+  if (b->num_blocks [0] == 0)
+    return 1;
+  uint64_t h = bloom_hash (b, key);
+  int active = atomic_load (&(b->active));
+  const uint64_t * block = b->blocks [active] +
+                           (h & (b->num_blocks [active] - 1)) *
+                           BLOOM_BLOCK_WORDS;
+  int i;
+  for (i = 0; i < BLOOM_BITS; i++) {
+    int bit = (int) ((h >> (28 + 9 * i)) & 511);
+    if (! (__atomic_load_n (block + bit / 64, __ATOMIC_RELAXED) &
+           (one64 << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+/* returns 1 if the filter should now be rebuilt */
+static int bloom_add (struct bloom * b, const char * key)
+{
+  if (b->num_blocks [0] == 0)
+    return 0;
+  uint64_t h = bloom_hash (b, key);
+  bloom_set (b, 0, h);
+  bloom_set (b, 1, h);
+  return (atomic_fetch_add (&(b->additions), 1) + 1 == b->limit);
+}
+
+/* the ack, message ID, and trace tables change size with the traffic.
+ * A table grows when it is mostly full and its entries are replaced
+ * within HASH_TURNOVER_FAST seconds, so useful entries are being lost.
+ * It shrinks when replacing all its entries would take more than
+ * HASH_TURNOVER_SLOW seconds, or when the cache uses more than its
+ * memory budget.  Resizing allocates the new table, then moves
+ * HASH_RESIZE_STEP entries a second from the old table, which is
+ * searched as well until all its entries have been moved.  New entries
+ * only go into the new table.  A saved table is mapped from a new file
+ * <name>.resize, which replaces the old file once all entries are moved.
+ *
+ * resize_lock is held for reading to use the table, and for writing
+ * only to replace the table or its Bloom filters, which takes constant
+ * time.  It is acquired after msg_lock and before the other locks */
+#define HASH_MIN_ENTRIES	(4 * 1024)	/* may shrink to this many */
+#define HASH_RESIZE_STEP	(16 * 1024)	/* entries moved per second */
+#define HASH_RESIZE_PERIOD	600		/* seconds between decisions */
+#define HASH_TURNOVER_FAST	3600
+#define HASH_TURNOVER_SLOW	(2 * 86400)
+struct hash_table {
+  const char * fname;            /* NULL if the table is not saved */
+  int acks;                      /* indexed by the IDs of the acks */
+  struct hash_entry ** table;
+  int * num;
+  const char * secret;
+  struct table_file * tf;        /* NULL if never mapped */
+  atomic_int * save;             /* NULL if not saved */
+  struct bloom * blooms [2];     /* the filters on this table, or NULL */
+  int bloom_by_id [2];           /* for acks, filters on the IDs of acks */
+  pthread_rwlock_t resize_lock;
+  struct hash_entry * old;       /* NULL unless resizing */
+  int old_num;
+  struct table_file old_file;    /* if the old table is mapped */
+  int moved;                     /* old entries before this were moved */
+  atomic_int used;               /* used entries in the (new) table */
+  atomic_int additions;          /* since the last decision */
+};
+static struct table_file mid_file = { .base = NULL };  /* never mapped */
+static struct hash_table ack_hash =
+  { .fname = "ack", .acks = 1, .table = &ack_table, .num = &num_ack,
+    .secret = ack_secret, .tf = &ack_file, .save = &save_ack_hashes,
+    .blooms = { &ack_bloom, &acked_bloom }, .bloom_by_id = { 0, 1 },
+    .resize_lock = PTHREAD_RWLOCK_INITIALIZER };
+static struct hash_table mid_hash =
+  { .fname = NULL, .acks = 0, .table = &mid_table, .num = &num_mid,
+    .secret = mid_secret, .tf = &mid_file, .save = NULL,
+    .blooms = { &mid_bloom, NULL }, .bloom_by_id = { 0, 0 },
+    .resize_lock = PTHREAD_RWLOCK_INITIALIZER };
+static struct hash_table trc_hash =
+  { .fname = "trace", .acks = 0, .table = &trc_table, .num = &num_trc,
+    .secret = trc_secret, .tf = &trc_file, .save = &save_trc_hashes,
+    .blooms = { NULL, NULL }, .bloom_by_id = { 0, 0 },
+    .resize_lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static void hash_read_lock (struct hash_table * t)
+{
+  pthread_rwlock_rdlock (&(t->resize_lock));
+}
+
+static void hash_resize_unlock (struct hash_table * t)
+{
+  pthread_rwlock_unlock (&(t->resize_lock));
+}
+
+/* the key an entry was saved under: the ID, or the ID of the ack */
+static void hash_entry_key (struct hash_table * t, const struct hash_entry * e,
+                            char * key)
+{
+  if (t->acks)
+    sha512_bytes (e->ida, MESSAGE_ID_SIZE, key, MESSAGE_ID_SIZE);
+  else
+    memcpy (key, e->ida, MESSAGE_ID_SIZE);
+}
+
+/* rebuild the filter from the entries of the table (both tables while
+ * resizing).  If by_id, the filter has the IDs of the acks in the table,
+ * rather than the acks.  Called with resize_lock held for reading, and
+ * without holding any hash_locks.  Returns 0 if another thread is
+ * rebuilding the filter, 1 otherwise */
+static int bloom_rebuild (struct bloom * b, struct hash_table * t, int by_id)
+{
+  if ((b->num_blocks [0] == 0) || (atomic_exchange (&(b->rebuilding), 1)))
+    return 0;   /* another thread is rebuilding */
+  int inactive = 1 - atomic_load (&(b->active));
+  uint64_t * blocks = b->blocks [inactive];
+  uint64_t w;   /* bloom_add may be setting bits at the same time */
+  for (w = 0; w < b->num_blocks [inactive] * BLOOM_BLOCK_WORDS; w++)
+    __atomic_store_n (blocks + w, 0, __ATOMIC_RELAXED);
+  b->additions = 0;
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    struct hash_entry * table = ((pass == 0) ? *(t->table) : t->old);
+    int num = ((pass == 0) ? *(t->num) : t->old_num);
+    if (table == NULL)
+      continue;
+    int lock;
+    for (lock = 0; lock < HASH_LOCKS; lock++) {  /* additions from now on */
+      hash_lock (lock);                          /* are in both copies */
+      int i;
+      for (i = lock; i < num; i += HASH_LOCKS) {
+        if (table [i].used) {
+          char id [MESSAGE_ID_SIZE];
+          if (by_id)
+            sha512_bytes (table [i].ida, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+          bloom_set (b, inactive, bloom_hash (b, (by_id ? id : table [i].ida)));
+        }
+      }
+      hash_unlock (lock);
+    }
+  }
+  atomic_store (&(b->active), inactive);
+  b->rebuilding = 0;
+  return 1;
+}
+
+/* rebuild all the filters on the table, with resize_lock held for reading */
+static void hash_bloom_rebuild (struct hash_table * t)
+{
+  int i;
+  for (i = 0; i < 2; i++)
+    if (t->blooms [i] != NULL)
+      bloom_rebuild (t->blooms [i], t, t->bloom_by_id [i]);
 }
 
-/* is the ack for this ID in the ack table? */
-static int id_is_acked (const char * id)
+/* the entry index i for key holds ida (or, if ida is NULL, an ack whose
+ * ID is key).  Called with hash_lock (i) held */
+static int hash_entry_matches (struct hash_table * t,
+                               const struct hash_entry * e,
+                               const char * key, const char * ida)
 {
-  int aindex = id_index (id, num_ack, ack_secret);
-  char check_id [MESSAGE_ID_SIZE];
-  sha512_bytes (ack_table [aindex].ida, MESSAGE_ID_SIZE,
-                check_id, MESSAGE_ID_SIZE);
-  return (memcmp (id, check_id, MESSAGE_ID_SIZE) == 0);
+  if (! e->used)
+    return 0;
+  if (ida != NULL)
+    return (memcmp (e->ida, ida, MESSAGE_ID_SIZE) == 0);
+  char check [MESSAGE_ID_SIZE];
+  hash_entry_key (t, e, check);
+  return (memcmp (check, key, MESSAGE_ID_SIZE) == 0);
+}
+
+/* looks for the entry saved under key that holds ida (if ida is NULL,
+ * any ack whose ID is key), in the old table too while resizing.
+ * If found, returns 1 and copies the entry to result, if not NULL.
+ * Called with resize_lock held for reading */
+static int hash_find (struct hash_table * t, const char * key,
+                      const char * ida, struct hash_entry * result)
+{
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    struct hash_entry * table = ((pass == 0) ? *(t->table) : t->old);
+    int num = ((pass == 0) ? *(t->num) : t->old_num);
+    if (table == NULL)
+      break;
+    int index = id_index (key, num, t->secret);
+    hash_lock (index);
+    int found = hash_entry_matches (t, table + index, key, ida);
+    if ((found) && (result != NULL))
+      *result = table [index];
+    hash_unlock (index);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+/* saves e under key, replacing any other entry at its index, unless the
+ * same entry is already saved.  For acks, gives the entry a serial number.
+ * Returns 0 if it was already there, 1 if it was added, and 2 if it was
+ * added and the filters should now be rebuilt (with hash_bloom_rebuild).
+ * Called with resize_lock held for reading */
+static int hash_add (struct hash_table * t, const char * key,
+                     const struct hash_entry * e)
+{
+  if ((t->old != NULL) && (hash_find (t, key, e->ida, NULL)))
+    return 0;  /* still in the old table */
+  struct hash_entry * table = *(t->table);
+  int index = id_index (key, *(t->num), t->secret);
+  int result = 0;
+  hash_lock (index);
+  if ((! table [index].used) ||
+      (memcmp (table [index].ida, e->ida, MESSAGE_ID_SIZE) != 0)) {
+    if (! table [index].used)
+      t->used++;
+    table [index] = *e;
+    table [index].used = 1;
+    if (t->acks)
+      table [index].serial = next_ack_serial++;
+    table_dirty (t->tf, table + index, sizeof (struct hash_entry));
+    int i;
+    for (i = 0; i < 2; i++)
+      if ((t->blooms [i] != NULL) &&
+          (bloom_add (t->blooms [i], (t->bloom_by_id [i] ? key : e->ida))))
+        result = 2;
+    if (result == 0)
+      result = 1;
+    t->additions++;
+  }
+  hash_unlock (index);
+  return result;
+}
+
+/* count the used entries of a table that was just loaded */
+static void hash_count_used (struct hash_table * t)
+{
+  int count = 0;
+  int i;
+  for (i = 0; i < *(t->num); i++)
+    if ((*(t->table)) [i].used)
+      count++;
+  t->used = count;
+}
+
+/* is the ack for this ID in the ack table?  If so and ack is not NULL,
+ * copies the ack to ack */
+static int id_is_acked (const char * id, char * ack)
+{
+  struct hash_entry e;
+  hash_read_lock (&ack_hash);
+  int result = ((bloom_maybe (&acked_bloom, id)) &&
+                (hash_find (&ack_hash, id, NULL, &e)));
+  hash_resize_unlock (&ack_hash);
+  if ((result) && (ack != NULL))
+    memcpy (ack, e.ida, MESSAGE_ID_SIZE);
+  return result;
+}
+
+/* secondary indexes over msg_table, so that a data request only looks
+ * at the messages that might match it.  Each message is indexed by the
+ * first byte of its destination, of its source, and of its message ID.
+ * Each bucket holds the msg_table offsets of its messages, in no
+ * particular order.  The indexes are built from msg_table when first
+ * needed, and updated as messages are added and segments freed. */
+#define INDEX_DST	0
+#define INDEX_SRC	1
+#define INDEX_MID	2
+#define NUM_INDICES	3
+#define INDEX_BUCKETS	256
+struct index_bucket {
+  size_t * offsets;
+  int count;
+  int size;     /* number of offsets allocated */
+};
+static struct index_bucket msg_index [NUM_INDICES] [INDEX_BUCKETS];
+static int msg_index_valid = 0;
+
+static void index_clear ()
+{
+  int k;
+  int b;
+  for (k = 0; k < NUM_INDICES; k++)
+    for (b = 0; b < INDEX_BUCKETS; b++)
+      msg_index [k] [b].count = 0;   /* keep the memory for the next build */
+  msg_index_valid = 0;
+}
+
+static int index_key (const struct message_header * mhp, int which)
+{
+  const struct allnet_header * hp = (const struct allnet_header *)
+    (((const char *) mhp) + sizeof (struct message_header));
+  if (which == INDEX_DST)
+    return hp->destination [0];
+  if (which == INDEX_SRC)
+    return hp->source [0];
+  return ((const unsigned char *) (mhp->id)) [0];
+}
+
+/* add offset to the bucket.  Returns 0 if out of memory */
+static int index_add (struct index_bucket * bucket, size_t offset)
+{
+  if (bucket->count >= bucket->size) {
+    int new_size = ((bucket->size == 0) ? 16 : bucket->size * 2);
+    size_t * new = realloc (bucket->offsets, new_size * sizeof (size_t));
+    if (new == NULL)
+      return 0;
+    bucket->offsets = new;
+    bucket->size = new_size;
+  }
+  bucket->offsets [bucket->count++] = offset;
+  return 1;
+}
+
+/* add the message to all the indexes */
+static void index_insert (struct message_header * hp)
+{
+  if (! msg_index_valid)
+    return;
+  size_t offset = ((char *) hp) - ((char *) msg_table);
+  int k;
+  for (k = 0; k < NUM_INDICES; k++) {
+    if (! index_add (msg_index [k] + index_key (hp, k), offset)) {
+      index_clear ();   /* requests will look at all the messages */
+      return;
+    }
+  }
+}
+
+/* remove the messages of a segment that is being freed */
+static void index_remove_segment (int segment)
+{
+  if (! msg_index_valid)
+    return;
+  size_t start = ((size_t) segment) * SEGMENT_SIZE;
+  size_t end = start + SEGMENT_SIZE;
+  int k;
+  int b;
+  for (k = 0; k < NUM_INDICES; k++) {
+    for (b = 0; b < INDEX_BUCKETS; b++) {
+      struct index_bucket * bucket = msg_index [k] + b;
+      int from;
+      int to = 0;
+      for (from = 0; from < bucket->count; from++)
+        if ((bucket->offsets [from] < start) || (bucket->offsets [from] >= end))
+          bucket->offsets [to++] = bucket->offsets [from];
+      bucket->count = to;
+    }
+  }
+}
+
+static void index_build ()
+{
+  index_clear ();
+  msg_index_valid = 1;
+  struct message_header * current = NULL;
+  while ((msg_index_valid) && ((current = next_message (current)) != NULL))
+    if (current->priority != 0)   /* not deleted */
+      index_insert (current);
+}
+
+/* the lowest-priority messages are deleted first when space runs out.
+ * The heap has an entry for every undeleted message, and also entries
+ * for messages that have since been deleted or moved.  These are
+ * recognized and discarded when they reach the top of the heap */
+struct heap_entry {
+  size_t offset;
+  uint32_t priority;
+  char id [8];                   /* first bytes of the message ID */
+};
+static struct heap_entry * msg_heap = NULL;
+static int heap_count = 0;
+static int heap_size = 0;
+static int live_messages = 0;    /* the number of undeleted messages */
+
+static void heap_push (struct message_header * hp)
+{
+  if (heap_count >= heap_size) {
+    int new_size = ((heap_size == 0) ? 1024 : heap_size * 2);
+    struct heap_entry * new =
+      realloc (msg_heap, new_size * sizeof (struct heap_entry));
+    if (new == NULL)
+      return;   /* the message can still be deleted when its segment is */
+    msg_heap = new;
+    heap_size = new_size;
+  }
+  struct heap_entry e = { .offset = ((char *) hp) - ((char *) msg_table),
+                          .priority = hp->priority };
+  memcpy (e.id, hp->id, sizeof (e.id));
+  int i = heap_count++;
+  while (i > 0) {   /* sift up */
+    int parent = (i - 1) / 2;
+    if (msg_heap [parent].priority <= e.priority)
+      break;
+    msg_heap [i] = msg_heap [parent];
+    i = parent;
+  }
+  msg_heap [i] = e;
+}
+
+static struct heap_entry heap_pop ()
+{
+  struct heap_entry result = msg_heap [0];
+  struct heap_entry last = msg_heap [--heap_count];
+  int i = 0;
+  while (1) {   /* sift down */
+    int child = 2 * i + 1;
+    if (child >= heap_count)
+      break;
+    if ((child + 1 < heap_count) &&
+        (msg_heap [child + 1].priority < msg_heap [child].priority))
+      child++;
+    if (last.priority <= msg_heap [child].priority)
+      break;
+    msg_heap [i] = msg_heap [child];
+    i = child;
+  }
+  if (heap_count > 0)
+    msg_heap [i] = last;
+  return result;
+}
+
+/* returns the message if the entry still refers to an undeleted message */
+static struct message_header * heap_message (struct heap_entry * e)
+{
+  int segment = (int) (e->offset / SEGMENT_SIZE);
+  if ((segment >= num_segments) || (! segment_in_use (segment)) ||
+      (e->offset + sizeof (struct message_header) >
+       ((size_t) segment) * SEGMENT_SIZE + segment_header (segment)->used))
+    return NULL;
+  struct message_header * hp =
+    (struct message_header *) (((char *) msg_table) + e->offset);
+  if ((hp->priority != e->priority) || (hp->priority == 0) ||
+      (memcmp (hp->id, e->id, sizeof (e->id)) != 0))
+    return NULL;
+  return hp;
+}
+
+static void heap_build ()
+{
+  heap_count = 0;
+  struct message_header * current = NULL;
+  while ((current = next_message (current)) != NULL)
+    if (current->priority != 0)
+      heap_push (current);
+}
+
+/* each segment records an allnet time (allnet_time ()) until which all
+ * its messages are known to be valid, the earliest expiration of any of
+ * its messages, so until then they need not be checked again.  Segments
+ * saved by older versions have 0, and are checked by segment_refresh */
+#define VALID_FOREVER	UINT64_MAX
+
+/* returns 0 if the message is not valid */
+static uint64_t message_valid_until (const char * message, unsigned int msize)
+{
+  if (! is_valid_message (message, msize, NULL))
+    return 0;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((hp->transport & ALLNET_TRANSPORT_EXPIRATION) == 0)
+    return VALID_FOREVER;
+  return readb64 (ALLNET_EXPIRATION (hp, hp->transport, msize));
+}
+
+/* called when a message is added to a segment */
+static void segment_valid_update (struct message_header * hp)
+{
+  struct segment_header * sh = segment_header (segment_of (hp));
+  uint64_t until =
+    message_valid_until (((char *) hp) + sizeof (struct message_header),
+                         hp->length);
+  if (until < sh->valid_until) {
+    sh->valid_until = until;
+    table_dirty (&msg_file, sh, sizeof (struct segment_header));
+  }
 }
 
 static void save_message (char * destination, const char * id,
                           const char * message, int msize, int priority)
 {
-  struct message_header * new = (struct message_header *) destination;
-  size_t total_size = sizeof (struct message_header) + msg_storage (msize);
-  memset (new, 0, total_size);
-  memcpy (new->id, id, MESSAGE_ID_SIZE);
-  new->length = msize;
-  new->priority = priority;
-  new->sent_to_tokens = 0;
-  memcpy (destination + sizeof (struct message_header), message, msize);
-  save_messages = 1;
+  struct message_header * new = (struct message_header *) destination;
+  size_t total_size = sizeof (struct message_header) + msg_storage (msize);
+  memset (new, 0, total_size);
+  memcpy (new->id, id, MESSAGE_ID_SIZE);
+  new->length = msize;
+  new->priority = priority;
+  new->serial = next_msg_serial++;
+  memcpy (destination + sizeof (struct message_header), message, msize);
+  segment_valid_update (new);
+  recent_id_add (new);
+  save_messages = 1;
+}
+
+/* mark the message as deleted.  Its space is recovered when its
+ * segment is compacted */
+static void message_delete (struct message_header * hp)
+{
+  if (hp->priority == 0)
+    return;
+  struct recent_id * r = recent_ids + (hp->serial % PCACHE_RECENT_IDS);
+  if (r->serial == hp->serial)
+    r->serial = 0;
+  hp->priority = 0;
+  table_dirty (&msg_file, hp, sizeof (struct message_header));
+  segment_live [segment_of (hp)] -= record_size (hp);
+  live_messages--;
+  save_messages = 1;
+}
+
+/* a free segment is always kept for compaction, so only compaction may
+ * use the last free segment */
+#define SEGMENTS_FREE_TARGET	2
+
+/* returns where a message of the given size can be added, or NULL if
+ * there is no space.  The space is counted as used, and live */
+static char * segment_allocate (size_t size, int for_compaction)
+{
+  if (current_segment >= 0) {
+    struct segment_header * sh = segment_header (current_segment);
+    if (sh->used + size <= SEGMENT_SIZE) {
+      char * result = ((char *) sh) + sh->used;
+      sh->used += size;
+      table_dirty (&msg_file, sh, sizeof (struct segment_header));
+      segment_live [current_segment] += size;
+      return result;
+    }
+  }
+  if (free_segments <= (for_compaction ? 0 : 1))
+    return NULL;
+  int segment;
+  for (segment = 0; segment < segment_limit; segment++)
+    if ((segment != current_segment) && (! segment_in_use (segment)))
+      break;
+  if (segment >= segment_limit) {   /* should never happen */
+    printf ("pcache error: %d free segments not found\n", free_segments);
+    free_segments = 0;
+    return NULL;
+  }
+  struct segment_header * sh = segment_header (segment);
+  memset (sh, 0, sizeof (struct segment_header));
+  memcpy (sh->magic, SEGMENT_MAGIC, SEGMENT_MAGIC_SIZE);
+  sh->used = sizeof (struct segment_header);
+  sh->sequence = next_sequence++;
+  sh->valid_until = VALID_FOREVER;
+  table_dirty (&msg_file, sh, sizeof (struct segment_header));
+  free_segments--;
+  current_segment = segment;
+  segment_live [segment] = 0;
+  return segment_allocate (size, for_compaction);
+}
+
+/* add a copy of the message (with its header) to the current segment */
+static struct message_header * message_append (struct message_header * hp,
+                                               int for_compaction)
+{
+  size_t size = record_size (hp);
+  char * p = segment_allocate (size, for_compaction);
+  if (p == NULL)
+    return NULL;
+  memcpy (p, hp, size);
+  table_dirty (&msg_file, p, size);
+  struct message_header * result = (struct message_header *) p;
+  segment_valid_update (result);
+  live_messages++;
+  index_insert (result);
+  heap_push (result);
+  return result;
+}
+
+/* find the segments in use, and how many undeleted bytes each has */
+static void segments_init ()
+{
+  num_segments = (int) (msg_table_size / SEGMENT_SIZE);
+  segment_limit = num_segments;
+  if (segment_live != NULL)
+    free (segment_live);
+  segment_live = malloc_or_fail (num_segments * sizeof (size_t),
+                                 "pcache segments_init");
+  memset (segment_live, 0, num_segments * sizeof (size_t));
+  current_segment = -1;
+  free_segments = 0;
+  live_messages = 0;
+  next_sequence = 1;
+  int segment;
+  for (segment = 0; segment < num_segments; segment++) {
+    if (! segment_in_use (segment)) {
+      free_segments++;
+      continue;
+    }
+    struct segment_header * sh = segment_header (segment);
+    if (sh->sequence >= next_sequence) {   /* continue in the latest */
+      next_sequence = sh->sequence + 1;
+      current_segment = segment;
+    }
+  }
+  struct message_header * current = NULL;
+  while ((current = next_message (current)) != NULL) {
+    if (current->priority != 0) {
+      segment_live [segment_of (current)] += record_size (current);
+      live_messages++;
+    }
+  }
+}
+
+/* before version 3.3.x, messages were stored one after the other in
+ * order of decreasing priority, followed by an all-zeros header.
+ * Copy them into segments */
+static void segments_convert ()
+{
+  char * old = malloc_or_fail (msg_table_size, "pcache segments_convert");
+  memcpy (old, msg_table, msg_table_size);
+  memset (msg_table, 0, msg_table_size);
+  table_dirty_all (&msg_file);
+  segments_init ();   /* all the segments are now free */
+  size_t offset = 0;
+  while (offset + sizeof (struct message_header) <= msg_table_size) {
+    struct message_header * hp = (struct message_header *) (old + offset);
+    if ((hp->length == 0) || (hp->length > ALLNET_MTU) ||
+        (offset + record_size (hp) > msg_table_size))
+      break;   /* end of the messages */
+    if ((hp->priority != 0) && (message_append (hp, 0) == NULL))
+      break;   /* no more space */
+    offset += record_size (hp);
+  }
+  free (old);
+  index_clear ();
+}
+
+/* check the messages of the segment, deleting any that have been acked,
+ * and, if the segment is no longer known to be valid, any that are expired
+ * or otherwise invalid */
+static void segment_refresh (int segment)
+{
+  if (! segment_in_use (segment))
+    return;
+  struct segment_header * sh = segment_header (segment);
+  uint64_t now = allnet_time ();
+  int check = (sh->valid_until < now);
+  uint64_t until = VALID_FOREVER;
+  size_t offset = sizeof (struct segment_header);
+  while (offset + sizeof (struct message_header) <= sh->used) {
+    struct message_header * hp =
+      (struct message_header *) (((char *) sh) + offset);
+    if ((hp->length == 0) || (offset + record_size (hp) > sh->used))
+      break;
+    if (hp->priority != 0) {
+      uint64_t valid = VALID_FOREVER;
+      if (check)
+        valid = message_valid_until (((char *) hp) +
+                                     sizeof (struct message_header),
+                                     hp->length);
+      if ((valid < now) || (id_is_acked (hp->id, NULL)))
+        message_delete (hp);
+      else if (valid < until)
+        until = valid;
+    }
+    offset += record_size (hp);
+  }
+  if (check) {
+    sh->valid_until = until;
+    table_dirty (&msg_file, sh, sizeof (struct segment_header));
+  }
+}
+
+/* copy the undeleted messages of the segment to the current segment,
+ * then free it.  Returns 1 if the segment was freed, 0 otherwise */
+static int segment_compact (int segment)
+{
+  segment_refresh (segment);
+  struct segment_header * sh = segment_header (segment);
+  size_t offset = sizeof (struct segment_header);
+  while (offset + sizeof (struct message_header) <= sh->used) {
+    struct message_header * hp =
+      (struct message_header *) (((char *) sh) + offset);
+    if ((hp->length == 0) || (offset + record_size (hp) > sh->used))
+      break;
+    if (hp->priority != 0) {
+      if (message_append (hp, 1) == NULL)
+        return 0;   /* messages copied so far are deleted, no harm done */
+      message_delete (hp);
+    }
+    offset += record_size (hp);
+  }
+  index_remove_segment (segment);
+  memset (sh, 0, sizeof (struct segment_header));
+  table_dirty (&msg_file, sh, sizeof (struct segment_header));
+  segment_live [segment] = 0;
+  if (segment < segment_limit)
+    free_segments++;
+  return 1;
+}
+
+/* delete the lowest-priority messages, at least size bytes worth */
+static void evict (size_t size)
+{
+  while ((size > 0) && (heap_count > 0)) {
+    struct heap_entry e = heap_pop ();
+    struct message_header * hp = heap_message (&e);
+    if (hp == NULL)   /* deleted or moved */
+      continue;
+    size_t rsize = record_size (hp);
+    message_delete (hp);
+    size = ((rsize >= size) ? 0 : (size - rsize));
+  }
+  if (heap_count > 2 * live_messages + 1024)  /* mostly deleted entries */
+    heap_build ();
 }
 
-/* if id != NULL and message != NULL and msize > 0 and priority > 0,
- * inserts the message while gc'ing */
-static size_t gc_messages (const char * id, const char * message, int msize,
-                           int priority)
+/* one round of compaction.  Compacts the segment with the fewest
+ * undeleted bytes, if it is mostly empty, or if free space is needed
+ * (when force is true, or when fewer than SEGMENTS_FREE_TARGET segments
+ * are free).  If every segment is nearly full, first deletes the
+ * lowest-priority messages.  Returns 1 if a segment was freed */
+static int compact_step (int force)
 {
-  if ((id == NULL) || (message == NULL) || (msize <= 0) || (priority <= 0)) {
-    id = NULL;
-    message = NULL;
-    msize = 0;
-    priority = 0;
-/* printf ("starting gc, length is %zd\n", msg_table_size); */
+  int victim = -1;
+  int segment;
+  for (segment = 0; segment < num_segments; segment++)
+    if ((segment != current_segment) && (segment_in_use (segment)) &&
+        ((victim < 0) || (segment_live [segment] < segment_live [victim])))
+      victim = segment;
+  if (victim < 0)
+    return 0;
+  int need_space = (force || (free_segments < SEGMENTS_FREE_TARGET));
+  if ((! need_space) && (segment_live [victim] > SEGMENT_SIZE / 4))
+    return 0;
+  if (segment_live [victim] > SEGMENT_SIZE - SEGMENT_SIZE / 8) {
+    evict (SEGMENT_SIZE / 4);
+    for (segment = 0; segment < num_segments; segment++)
+      if ((segment != current_segment) && (segment_in_use (segment)) &&
+          (segment_live [segment] < segment_live [victim]))
+        victim = segment;
   }
-  char * copy_to = (char *) msg_table;
-  const size_t mh_size = sizeof (struct message_header);
-  struct message_header * next = next_message (NULL);
-  while (next != NULL) {
-    struct message_header * current = next;
-    /* update next *before* modifying the message table or anything else */
-    next = next_message (current);
-    const uint32_t eff_len = msg_storage (current->length);
-    size_t hdr_msg_size = mh_size + eff_len;
-    const char * current_message = ((char *) current) + mh_size;
-    /* delete messages with priority 0, invalid (likely expired)
-     * messages, and messages that have been acked.  We delete them by
-     * only keeping messages that don't match any of these criteria */
-    if ((current->priority != 0) &&
-        (is_valid_message (current_message, current->length, NULL)) &&
-        (! id_is_acked (current->id))) {
-      if (((char *)current) != copy_to)
-        memmove (copy_to, current, hdr_msg_size);
-      save_messages = 1;          /* gc'd at least one message */
-      copy_to += hdr_msg_size;
-    } /* done with this message */
-  }
-  char * p = (char *) msg_table;
-  if ((copy_to - p) + mh_size <= msg_table_size) { /* add a sentinel record */
-    memset (copy_to, 0, mh_size);
-    copy_to += mh_size; 
-  }
-/* printf ("finishing gc, length is %zd\n", copy_to - p); */
-/* print_buffer (p, copy_to - p, "finished gc", 40, 1);  */
-  return copy_to - p;
+  return segment_compact (victim);
 }
 
+
 static int get_size_from_file (int line, int dflt)
 {
-  int fd = open_read_config ("acache", "sizes", 1);
+  int fd = open_read_config (cache_directory, "sizes", 1);
   char * data = NULL;
   int size = read_fd_malloc (fd, &data, 0, 1, "~/.allnet/acache/sizes");
   if (size <= 0)
@@ -316,38 +1577,18 @@ static int get_size_from_file (int line, int dflt)
 
 static void read_tokens_file ()
 {
-  int fd = open_read_config ("acache", "token", 1);
+  int fd = open_read_config (cache_directory, "token", 1);
   if (fd >= 0) {
     ssize_t n = read (fd, &tokens, sizeof (tokens));
     close (fd);
-    if ((n == sizeof (tokens)) && (tokens.num_tokens >= 0) &&
-        (tokens.num_tokens <= MAX_TOKENS)) {
-      int first_zero = -1;
-      int last_zero = -1;
-      int num_zero = 0;
-      int i;
-      for (i = 0; i < tokens.num_tokens; i++) {
-        if (memget (tokens.tokens [i], 0, ALLNET_TOKEN_SIZE)) {
-          if (num_zero == 0) {
-            first_zero = i;
-            last_zero = i;
-            num_zero = 1;
-          } else if ((last_zero + 1) % MAX_TOKENS == i) {
-            last_zero = i;
-            num_zero++;
-          } else { /* (last_zero + 1) % MAX_TOKENS != i */
-            printf ("error, zero token %d (%d/%d) does not follow %d/%d/%d\n",
-                    i, tokens.num_tokens, MAX_TOKENS,
-                    last_zero, first_zero, num_zero);
-            num_zero += 10000;  /* make it easy to see future errors */
-          }
-        }
-      }
-      if (num_zero < 8)  /* successfully found at most 7 adjacent 0 tokens */
-        return;
-    } else {  /* error */
+    if ((n == sizeof (tokens)) && (tokens.num_tokens > 0) &&
+        (tokens.num_tokens <= MAX_TOKENS) &&
+        (tokens.most_recent_token < MAX_TOKENS)) {
+      token_hash_build ();
+      return;
+    } else {  /* error, or the file from an older version */
       printf ("tokens file size %zd, expected %zd, ", n, sizeof (tokens));
-      printf ("num_tokens not 0 <= %d <= %d\n", tokens.num_tokens, MAX_TOKENS);
+      printf ("num_tokens not 0 < %u <= %d\n", tokens.num_tokens, MAX_TOKENS);
     }
   }
   /* some error, initialize from scratch */
@@ -357,58 +1598,343 @@ static void read_tokens_file ()
   random_bytes (tokens.tokens [0], ALLNET_TOKEN_SIZE);
   tokens.num_tokens = 1;   /* record that we have a local token */
   save_tokens = 1;
+  token_hash_build ();
 }
 
 static void write_tokens_file (int always)
 {
 #ifndef PRINT_CACHE_FILES
-  if ((! always) && (! save_tokens))
+  if ((! atomic_exchange (&save_tokens, 0)) && (! always))
     return;
+  pthread_mutex_lock (&token_lock);
   if (tokens.num_tokens <= 0) {
     printf ("saving tokens file, but only has %d tokens, setting to 1\n",
             tokens.num_tokens);
     tokens.num_tokens = 1;         /* at least the local token */
   }
-  int fd = open_write_config ("acache", "token", 1);
+  write_config_async ("token", &tokens, sizeof (tokens));
+  pthread_mutex_unlock (&token_lock);
+#endif /* PRINT_CACHE_FILES */
+}
+
+/* the delivery file has a header, then for each chunk of each set,
+ * a delivery_record followed by the array (padded to a multiple of
+ * 8 bytes) or the bitmap of the chunk */
+#define DELIVERY_MAGIC		"allnetdv"
+struct delivery_file_header {
+  char magic [8];
+  uint64_t next_msg_serial;
+  uint64_t next_ack_serial;
+};
+struct delivery_record {
+  uint32_t token_index;
+  uint32_t acks;       /* 1 for the set of acks, 0 for messages */
+  uint64_t key;
+  uint32_t count;
+  uint32_t bitmap;     /* 1 if the bitmap follows, 0 for the array */
+};
+
+static size_t delivery_data_size (const struct delivery_record * r)
+{
+  if (r->bitmap)
+    return CHUNK_BITMAP_WORDS * sizeof (uint64_t);
+  return ((r->count * sizeof (uint16_t) + 7) / 8) * 8;
+}
+
+/* called after the messages and acks are read, and only if the tokens
+ * were read successfully.  A missing or bad file only means messages
+ * and acks may be sent again */
+static void read_delivery_file ()
+{
+  int fd = open_read_config (cache_directory, "delivery", 1);
+  if (fd < 0)
+    return;
+  char * data = NULL;
+  int size = read_fd_malloc (fd, &data, 1, 1, "~/.allnet/acache/delivery");
+  close (fd);
+  if ((data == NULL) || (size < (int) sizeof (struct delivery_file_header)) ||
+      (memcmp (data, DELIVERY_MAGIC, 8) != 0)) {
+    if ((size > 0) && (data != NULL))
+      free (data);
+    return;
+  }
+  struct delivery_file_header * hp = (struct delivery_file_header *) data;
+  /* if messages or acks saved since were lost, never reuse their serials */
+  if (hp->next_msg_serial > delivery_msg_serial)
+    delivery_msg_serial = hp->next_msg_serial;
+  if (hp->next_ack_serial > next_ack_serial)
+    next_ack_serial = hp->next_ack_serial;
+  size_t offset = sizeof (struct delivery_file_header);
+  while (offset + sizeof (struct delivery_record) <= (size_t) size) {
+    struct delivery_record * r = (struct delivery_record *) (data + offset);
+    offset += sizeof (struct delivery_record);
+    size_t dsize = delivery_data_size (r);
+    if ((r->token_index >= MAX_TOKENS) || (r->count > (1 << CHUNK_BITS)) ||
+        (offset + dsize > (size_t) size)) {
+      printf ("pcache: bad delivery record at %zd of %d\n", offset, size);
+      break;
+    }
+    struct delivery * dp = deliveries + r->token_index;
+    struct serial_set * set = (r->acks ? &(dp->acks) : &(dp->messages));
+    uint64_t base = r->key << CHUNK_BITS;
+    if (r->bitmap) {
+      const uint64_t * bitmap = (const uint64_t *) (data + offset);
+      int i;
+      for (i = 0; i < (1 << CHUNK_BITS); i++)
+        if ((bitmap [i / 64] >> (i % 64)) & 1)
+          set_add (set, base + i);
+    } else {
+      const uint16_t * array = (const uint16_t *) (data + offset);
+      uint32_t i;
+      for (i = 0; i < r->count; i++)
+        set_add (set, base + array [i]);
+    }
+    offset += dsize;
+  }
+  free (data);
+}
+
+#ifndef PRINT_CACHE_FILES
+static int write_set (int fd, int token_index, int acks,
+                      const struct serial_set * set)
+{
+  int i;
+  for (i = 0; i < set->num_chunks; i++) {
+    const struct serial_chunk * c = set->chunks + i;
+    struct delivery_record r =
+      { .token_index = token_index, .acks = acks, .key = c->key,
+        .count = c->count, .bitmap = (c->bitmap != NULL) };
+    size_t dsize = delivery_data_size (&r);
+    const char * d = (const char *) ((r.bitmap) ? ((void *) (c->bitmap)) :
+                                                  ((void *) (c->array)));
+    size_t asize = c->count * sizeof (uint16_t);  /* array without padding */
+    char pad [8];
+    memset (pad, 0, sizeof (pad));
+    if ((write (fd, &r, sizeof (r)) != sizeof (r)) ||
+        (write (fd, d, (r.bitmap ? dsize : asize)) !=
+         (ssize_t) (r.bitmap ? dsize : asize)) ||
+        ((! r.bitmap) && (dsize > asize) &&
+         (write (fd, pad, dsize - asize) != (ssize_t) (dsize - asize))))
+      return 0;
+  }
+  return 1;
+}
+
+#endif /* PRINT_CACHE_FILES */
+
+/* the header is written last, so next_ack_serial is larger than
+ * any serial in the sets */
+static void write_delivery_file (int always)
+{
+#ifndef PRINT_CACHE_FILES
+  if ((! atomic_exchange (&save_deliveries, 0)) && (! always))
+    return;
+  int fd = open_write_config (cache_directory, "delivery", 1);
   if (fd < 0)
     return;
-  ssize_t n = write (fd, &tokens, sizeof (tokens));
-  if (n != sizeof (tokens))
-    perror ("error writing tokens file\n");
+  struct delivery_file_header h;
+  memset (&h, 0, sizeof (h));
+  int ok = (write (fd, &h, sizeof (h)) == sizeof (h));
+  int i;
+  for (i = 0; (ok) && (i < MAX_TOKENS); i++) {
+    delivery_lock (i);
+    ok = ((write_set (fd, i, 0, &(deliveries [i].messages))) &&
+          (write_set (fd, i, 1, &(deliveries [i].acks))));
+    delivery_unlock (i);
+  }
+  memcpy (h.magic, DELIVERY_MAGIC, 8);
+  h.next_msg_serial = next_msg_serial;
+  h.next_ack_serial = next_ack_serial;
+  if ((! ok) || (pwrite (fd, &h, sizeof (h), 0) != sizeof (h))) {
+    perror ("error writing delivery file");
+    save_deliveries = 1;
+  }
   close (fd);
-  save_tokens = 0;
 #endif /* PRINT_CACHE_FILES */
 }
 
-static void read_hash_file (const char * fname, int fsize,
+/* forget deliveries of messages and acks that are no longer saved.
+ * Called with msg_lock held for writing */
+static void delivery_prune ()
+{
+  uint64_t min_msg = next_msg_serial;
+  struct message_header * hp = NULL;
+  while ((hp = next_message (hp)) != NULL)
+    if ((hp->priority != 0) && (hp->serial < min_msg))
+      min_msg = hp->serial;
+  uint64_t min_ack = next_ack_serial;
+  hash_read_lock (&ack_hash);
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    struct hash_entry * table = ((pass == 0) ? ack_table : ack_hash.old);
+    int num = ((pass == 0) ? num_ack : ack_hash.old_num);
+    int lock;
+    for (lock = 0; (table != NULL) && (lock < HASH_LOCKS); lock++) {
+      hash_lock (lock);
+      int i;
+      for (i = lock; i < num; i += HASH_LOCKS)
+        if ((table [i].used) && (table [i].serial < min_ack))
+          min_ack = table [i].serial;
+      hash_unlock (lock);
+    }
+  }
+  hash_resize_unlock (&ack_hash);
+  int i;
+  for (i = 0; i < MAX_TOKENS; i++) {
+    delivery_lock (i);
+    set_prune (&(deliveries [i].messages), min_msg);
+    set_prune (&(deliveries [i].acks), min_ack);
+    delivery_unlock (i);
+  }
+}
+
+/* find the next ack serial number, then number any acks that have
+ * none (all of them, if the tokens were reset) */
+static void ack_serials_init ()
+{
+  int i;
+  for (i = 0; i < num_ack; i++)
+    if ((ack_table [i].used) && (ack_table [i].serial >= next_ack_serial))
+      next_ack_serial = ack_table [i].serial + 1;
+  for (i = 0; i < num_ack; i++) {
+    if ((ack_table [i].used) && (ack_table [i].serial == 0)) {
+      ack_table [i].serial = next_ack_serial++;
+      table_dirty (&ack_file, ack_table + i, sizeof (struct hash_entry));
+      save_ack_hashes = 1;
+    }
+  }
+}
+
+/* a hash file has the entries of the table followed by the secret,
+ * SIPHASH_KEY_SIZE bytes.  Files from older versions have instead an
+ * 8-byte secret for sha512 hashing (or no secret at all), and are
+ * rehashed when read.  A table may have been resized to fewer than
+ * fsize entries, so any file with at least HASH_MIN_ENTRIES is valid.
+ * Returns the number of bytes after the entries, or -1 if the size
+ * is not valid */
+static int hash_file_trailer (ssize_t size)
+{
+  const size_t es = sizeof (struct hash_entry);
+  int modulo = ((size > 0) ? ((int) (size % es)) : 0);
+  if ((size < HASH_MIN_ENTRIES * es) ||   /* resized files may be smaller */
+      ((modulo != 0) && (modulo != 8) && (modulo != SIPHASH_KEY_SIZE)))
+    return -1;
+  return modulo;
+}
+
+/* copy the used entries of old_table into table, using the new secret.
+ * The ack table is indexed by the IDs of the acks, not the acks */
+static void hash_file_rehash (struct hash_entry * table,
+                              const struct hash_entry * old_table, int num,
+                              const char * secret, int acks)
+{
+  int i;
+  for (i = 0; i < num; i++) {
+    if (old_table [i].used) {
+      char id [MESSAGE_ID_SIZE];
+      memcpy (id, old_table [i].ida, MESSAGE_ID_SIZE);
+      if (acks)
+        sha512_bytes (old_table [i].ida, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+      table [id_index (id, num, secret)] = old_table [i];
+    }
+  }
+}
+
+/* map the hash file.  Returns 1 for success, 0 if it cannot be mapped */
+static int map_hash_file (const char * fname, int fsize, int acks,
+                          struct table_file * tf, struct hash_entry ** table,
+                          int * num, char * secret)
+{
+#ifdef PRINT_CACHE_FILES   /* only look at the files, never modify them */
+  size_t fsize_actual = 0;
+  char * fbase = map_private (fname, &fsize_actual);
+  if (fbase == NULL)
+    return 0;
+  if (hash_file_trailer (fsize_actual) != SIPHASH_KEY_SIZE) {
+    munmap (fbase, fsize_actual);   /* read it and rehash it in memory */
+    return 0;
+  }
+  tf->base = fbase;
+  tf->size = fsize_actual;
+  tf->dirty_start = tf->dirty_end = 0;
+  *table = (struct hash_entry *) fbase;
+  *num = (int) ((fsize_actual - SIPHASH_KEY_SIZE) / sizeof (struct hash_entry));
+  memcpy (secret, fbase + (fsize_actual - SIPHASH_KEY_SIZE), SIPHASH_KEY_SIZE);
+  return 1;
+#endif /* PRINT_CACHE_FILES */
+  int fd = open_rw_config (cache_directory, fname, 1);
+  if (fd < 0)
+    return 0;
+  const size_t es = sizeof (struct hash_entry);
+  ssize_t size = table_file_size (fd);
+  int trailer = hash_file_trailer (size);
+  int valid = (trailer >= 0);
+  size_t entries_size = (valid ? (size - trailer) : ((fsize / es) * es));
+  if ((! valid) && (size > 0) && (ftruncate (fd, 0) != 0)) {
+    close (fd);     /* cannot discard the bad contents */
+    return 0;
+  }
+  char * base = table_map (fd, entries_size + SIPHASH_KEY_SIZE, tf);
+  if (base == NULL)   /* table_map closed fd */
+    return 0;
+  *table = (struct hash_entry *) base;
+  *num = (int) (entries_size / es);
+  if (trailer == SIPHASH_KEY_SIZE) {
+    memcpy (secret, base + entries_size, SIPHASH_KEY_SIZE);
+  } else {   /* new, or from an older version.  Create a new secret */
+    random_bytes (secret, SIPHASH_KEY_SIZE);
+    if (valid) {   /* rehash.  Should only happen once */
+      struct hash_entry * old_hash =
+        malloc_or_fail (entries_size, "map_hash_file rehash");
+      memcpy (old_hash, base, entries_size);
+      memset (base, 0, entries_size);
+      hash_file_rehash (*table, old_hash, *num, secret, acks);
+      free (old_hash);
+    }
+    memcpy (base + entries_size, secret, SIPHASH_KEY_SIZE);
+    table_dirty_all (tf);
+  }
+  if (save_tokens) {  /* tokens have been reset */
+    int i;
+    for (i = 0; i < *num; i++)
+      (*table) [i].serial = 0;
+    table_dirty_all (tf);
+  }
+  return 1;
+}
+
+static void read_hash_file (const char * fname, int fsize, int acks,
+                            struct table_file * tf,
                             struct hash_entry ** table, int * num,
-                            unsigned long long int * secret)
+                            char * secret)
 {
-  if ((*num > 0) && (*table != NULL))
+  if (tf->base != NULL)
+    table_unmap (tf);
+  else if ((*num > 0) && (*table != NULL))
     free (*table);
   *table = NULL;
   *num = 0;
-  *secret = 0;
-  int fd = open_read_config ("acache", fname, 1);
+  if (map_hash_file (fname, fsize, acks, tf, table, num, secret))
+    return;
+  int fd = open_read_config (cache_directory, fname, 1);
   if (fd >= 0) {
     char * file_contents = NULL;
     int actual_size = read_fd_malloc (fd, &file_contents, 1, 1, fname);
-    int modulo = actual_size % sizeof (struct hash_entry);
-    if ((file_contents != NULL) && (actual_size >= fsize) &&
-        ((modulo == 0) || (modulo == 8))) {  /* valid */
+    int trailer = hash_file_trailer (actual_size);
+    if ((file_contents != NULL) && (trailer >= 0)) {  /* valid */
       *table = (struct hash_entry *) file_contents;
-      *num = actual_size / sizeof (struct hash_entry);
-      if (modulo == 8) {
-        *secret = readb64 (file_contents + (actual_size - 8));
+      *num = (actual_size - trailer) / sizeof (struct hash_entry);
+      if (trailer == SIPHASH_KEY_SIZE) {
+        memcpy (secret, file_contents + (actual_size - trailer),
+                SIPHASH_KEY_SIZE);
       } else {   /* create a new secret and rehash.  Should only happen once */
-        *secret = random_int (0, (unsigned long long int) (-1));
+        random_bytes (secret, SIPHASH_KEY_SIZE);
         struct hash_entry * old_hash = *table;
+        size_t new_size = *num * sizeof (struct hash_entry);
         struct hash_entry * new =
-          malloc_or_fail (actual_size, "read_hash_file rehash");
-        int i;
-        for (i = 0; i < *num; i++)
-          if (old_hash [i].used)
-            new [id_index (old_hash [i].ida, *num, *secret)] = old_hash [i];
+          malloc_or_fail (new_size, "read_hash_file rehash");
+        memset (new, 0, new_size);
+        hash_file_rehash (new, old_hash, *num, secret, acks);
         free (old_hash);
         *table = new;
       }
@@ -416,7 +1942,7 @@ static void read_hash_file (const char * fname, int fsize,
       int i;
       if (save_tokens)  /* tokens have been reset */
         for (i = 0; i < *num; i++)
-          hash [i].sent_to_tokens = 0;
+          hash [i].serial = 0;
       return;
     } /* else size is too small or bad, ignore contents */
     /* free the file contents if they were allocated */
@@ -426,76 +1952,149 @@ static void read_hash_file (const char * fname, int fsize,
   *num = fsize / sizeof (struct hash_entry);
   *table = malloc_or_fail (fsize, "read_hash_file");
   memset (*table, 0, fsize);
-  *secret = random_int (0, (unsigned long long int) (-1));
+  random_bytes (secret, SIPHASH_KEY_SIZE);
 }
 
-static void write_hash_file (const char * fname, struct hash_entry * table,
-                             int num, unsigned long long int secret)
+/* a mapped table only needs its modified pages written back */
+static void write_hash_file (const char * fname, struct table_file * tf,
+                             struct hash_entry * table, int num,
+                             const char * secret, int always)
 {
-#ifndef PRINT_CACHE_FILES
-  int fd = open_write_config ("acache", fname, 1);
-  if (fd >= 0) {
-    size_t w = write (fd, table, num * sizeof (struct hash_entry));
-    if (w != num * sizeof (struct hash_entry))
-      perror ("write_hash_file error writing hash");
-    char buffer [8];
-    writeb64 (buffer, secret);
-    size_t ws = write (fd, buffer, sizeof (buffer));
-    if (ws != sizeof (buffer))
-      perror ("write_hash_file error writing secret");
-    close (fd);
+  if (tf->base != NULL) {
+    table_sync (tf, always);
+    return;
   }
+#ifndef PRINT_CACHE_FILES
+  size_t size = num * sizeof (struct hash_entry);
+  char * copy = malloc_or_fail (size + SIPHASH_KEY_SIZE, "write_hash_file");
+  int i;
+  for (i = 0; i < HASH_LOCKS; i++)   /* no entry may change while copying */
+    pthread_mutex_lock (hash_locks + i);
+  memcpy (copy, table, size);
+  for (i = 0; i < HASH_LOCKS; i++)
+    pthread_mutex_unlock (hash_locks + i);
+  memcpy (copy + size, secret, SIPHASH_KEY_SIZE);
+  write_config_async (fname, copy, size + SIPHASH_KEY_SIZE);
+  free (copy);
 #endif /* PRINT_CACHE_FILES */
 }
 
 /* a hash table should have at least 64K ids */
 static const int min_hash_file_size = 64 * 1024 * sizeof (struct hash_entry);
 
-static void read_hash_files ()
+static int hash_file_size ()
 {
   int default_file_size = get_size_from_file (2, min_hash_file_size);
   if (default_file_size < min_hash_file_size)
     default_file_size = min_hash_file_size;
-  read_hash_file ("ack", default_file_size, &ack_table, &num_ack, &ack_secret);
-  read_hash_file ("trace", default_file_size,
-                  &trc_table, &num_trc, &trc_secret);
-  save_ack_hashes = save_trc_hashes = 1;
+  return default_file_size;
+}
+
+static void read_ack_file ()
+{
+  read_hash_file ("ack", hash_file_size (), 1, &ack_file,
+                  &ack_table, &num_ack, ack_secret);
+  save_ack_hashes = 1;
+}
+
+static void read_trace_file ()
+{
+  read_hash_file ("trace", hash_file_size (), 0, &trc_file,
+                  &trc_table, &num_trc, trc_secret);
+  save_trc_hashes = 1;
 }
 
 static void write_hash_files (int always)
 {
-  if (always || save_ack_hashes) {
-    write_hash_file ("ack", ack_table, num_ack, ack_secret);
-    save_ack_hashes = 0;
+  if (atomic_exchange (&save_ack_hashes, 0) || always) {
+    hash_read_lock (&ack_hash);
+    write_hash_file ("ack", &ack_file, ack_table, num_ack, ack_secret,
+                     always);
+    hash_resize_unlock (&ack_hash);
+  }
+  if (atomic_exchange (&save_trc_hashes, 0) || always) {
+    hash_read_lock (&trc_hash);
+    write_hash_file ("trace", &trc_file, trc_table, num_trc, trc_secret,
+                     always);
+    hash_resize_unlock (&trc_hash);
+  }
+}
+
+/* the messages table holds a whole number of segments */
+static ssize_t segments_round (ssize_t size)
+{
+  return ((size + SEGMENT_SIZE - 1) / SEGMENT_SIZE) * SEGMENT_SIZE;
+}
+
+/* map the messages file, extending it to at least min_size.
+ * Returns the mapping and sets *size, or returns NULL */
+static char * map_messages_file (ssize_t min_size, ssize_t * size)
+{
+#ifdef PRINT_CACHE_FILES   /* only look at the files, never modify them */
+  size_t fsize = 0;
+  char * fbase = map_private ("message", &fsize);
+  if ((fbase != NULL) &&   /* older formats are converted in memory */
+      ((fsize < SEGMENT_SIZE) || (fsize % SEGMENT_SIZE != 0))) {
+    munmap (fbase, fsize);
+    fbase = NULL;
+  }
+  msg_file.base = fbase;
+  msg_file.size = ((fbase == NULL) ? 0 : fsize);
+  msg_file.dirty_start = msg_file.dirty_end = 0;
+  *size = msg_file.size;
+  return fbase;
+#endif /* PRINT_CACHE_FILES */
+  int fd = open_rw_config (cache_directory, "message", 1);
+  if (fd < 0)
+    return NULL;
+  ssize_t file_size = table_file_size (fd);
+  if (file_size < 0) {
+    close (fd);
+    return NULL;
   }
-  if (always || save_trc_hashes) {
-    write_hash_file ("trace", trc_table, num_trc, trc_secret);
-    save_trc_hashes = 0;
+  if (file_size == 0) {   /* new file */
+    printf ("error reading messages file, initializing from scratch\n");
+    if (min_size < MESSAGES_MIN_SIZE)
+      min_size = MESSAGES_MIN_SIZE;
+  } else if (min_size > file_size) {  /* keep the size it was resized to */
+    min_size = MESSAGES_MIN_SIZE;
   }
+  *size = ((file_size > min_size) ? file_size : min_size);
+  *size = segments_round (*size);
+  return table_map (fd, *size, &msg_file);  /* closes fd */
 }
 
 static void read_messages_file ()
 {
   if (save_tokens)
     save_messages = 1;
-  int fd = open_read_config ("acache", "message", 1);
-  char * data = NULL;
-  ssize_t size = read_fd_malloc (fd, &data, 1, 1, "~/.allnet/acache/message");
-  close (fd);
-  if ((size > 0) && (data != NULL)) {  /* check and create mid */
-    ssize_t min_size = get_size_from_file (1, 8 * min_hash_file_size);
-    if (size < min_size) {  /* extend to min size */
-      char * new_data = realloc (data, min_size);
+  ssize_t min_size = get_size_from_file (1, 8 * min_hash_file_size);
+  ssize_t size = 0;
+  char * data = map_messages_file (min_size, &size);
+  if (data == NULL) {   /* read the file into memory */
+    int fd = open_read_config (cache_directory, "message", 1);
+    size = read_fd_malloc (fd, &data, 1, 1, "~/.allnet/acache/message");
+    close (fd);
+    ssize_t new_size =   /* keep the size it was resized to */
+      segments_round ((size < MESSAGES_MIN_SIZE) ? min_size : size);
+    if ((size > 0) && (data != NULL) && (size < new_size)) {
+      char * new_data = realloc (data, new_size);  /* extend to min size */
       if (new_data == NULL) {
         free (data);
         return;
       }
       data = new_data;
-      memset (data + size, 0, min_size - size);
-      size = min_size;
+      memset (data + size, 0, new_size - size);
+      size = new_size;
     }
+  }
+  if ((size > 0) && (data != NULL)) {  /* check and create mid */
     msg_table = (struct message_header *) data;
     msg_table_size = size;
+    if ((memcmp (data, SEGMENT_MAGIC, SEGMENT_MAGIC_SIZE) != 0) &&
+        (! memget (data, 0, sizeof (struct segment_header))))
+      segments_convert ();   /* messages file from an older version */
+    segments_init ();
     /* create the message ID table, and fill it in as we check the messages */
     ssize_t mid_size = get_size_from_file (2, min_hash_file_size);
     if (size > min_size * 2)  /* increase the mid table size in proportion */
@@ -504,17 +2103,29 @@ static void read_messages_file ()
       mid_size = min_hash_file_size;
     num_mid = (int) (mid_size / sizeof (struct hash_entry));
     mid_table = malloc_or_fail (mid_size, "read_messages_file mid_table");
+    memset (mid_table, 0, mid_size);
     /* now check each message and add it to the mid */
     struct message_header * current = NULL;
     while ((current = next_message (current)) != NULL) {
       if (current->priority > 0) { /* message has not been deleted */
+        int index = id_index (current->id, num_mid, mid_secret);
+        if ((mid_table [index].used) &&  /* copied by interrupted compaction */
+            (memcmp (mid_table [index].ida, current->id,
+                     MESSAGE_ID_SIZE) == 0)) {
+          message_delete (current);
+          continue;
+        }
         save_messages = 1;    /* found at least one good message */
-        if (save_tokens)  /* tokens have been reset */
-          current->sent_to_tokens = 0;
+        if (save_tokens) { /* tokens have been reset, number the messages */
+          current->serial = next_msg_serial++;
+          table_dirty (&msg_file, current, sizeof (struct message_header));
+        } else if (current->serial >= next_msg_serial) {
+          next_msg_serial = current->serial + 1;
+        }
+        recent_id_add (current);
         /* add to mid table */
-        int index = id_index (current->id, num_mid, mid_secret);
         memcpy (mid_table [index].ida, current->id, MESSAGE_ID_SIZE);
-        mid_table [index].sent_to_tokens = current->sent_to_tokens;
+        mid_table [index].serial = current->serial;
         mid_table [index].used = 1;
         /* .max_hops = 0 -- max_hops not used in message ID table */
       }
@@ -526,11 +2137,13 @@ static void read_messages_file ()
     free (data);
   printf ("error reading messages file, initializing from scratch\n");
   msg_table_size = get_size_from_file (1, 8 * min_hash_file_size);
-  if (msg_table_size < 4 * 1024 * 1024)  /* at least four MBi */
-    msg_table_size = 4 * 1024 * 1024;
+  if (msg_table_size < MESSAGES_MIN_SIZE)
+    msg_table_size = MESSAGES_MIN_SIZE;
+  msg_table_size = segments_round (msg_table_size);
   msg_table = malloc_or_fail (msg_table_size, "read_messages_file init");
-  /* put an all-zero message_header as a marker that we are at the end */
-  memset (msg_table, 0, sizeof (struct message_header));
+  /* all segments are free */
+  memset (msg_table, 0, msg_table_size);
+  segments_init ();
   int mid_size = get_size_from_file (2, min_hash_file_size);
   if (mid_size < min_hash_file_size)
     mid_size = min_hash_file_size;
@@ -541,57 +2154,564 @@ static void read_messages_file ()
                  "finished init msgtbl", 40, 1); */
 }
 
-static void write_messages_file (int always)
+/* with a mapped file, write back the modified pages.  Otherwise,
+ * write the entire table.  Called with msg_lock held, at least for reading */
+static void write_messages_file (int always)
+{
+  if ((! atomic_exchange (&save_messages, 0)) && (! always))
+    return;
+  if (msg_file.base != NULL) {
+    table_sync (&msg_file, always);
+    return;
+  }
+#ifndef PRINT_CACHE_FILES
+  write_config_async ("message", msg_table, msg_table_size);
+#endif /* PRINT_CACHE_FILES */
+}
+
+/* save at least once when first called.  Further, save every 1-60 minutes.
+ * Called with msg_lock held for writing */
+static void pcache_maint ()
+{
+  static unsigned long long int next_save = 0;
+  static unsigned long long int minutes_increment = 1;
+  if (allnet_time () >= next_save) {
+    delivery_prune ();
+    write_tokens_file (0);
+    write_delivery_file (0);
+    write_hash_files (0);
+    write_messages_file (0);
+    next_save = allnet_time () + minutes_increment * 60;
+    if (minutes_increment < 60)
+      minutes_increment += 1;  /* add one minute */
+  }
+}
+
+#ifndef PRINT_CACHE_FILES
+/* the memory budget for the tables and messages, in MiB, is the third
+ * line of the sizes file.  By default, it is 1/16 of the physical memory */
+#ifndef PCACHE_BUDGET_FRACTION
+#define PCACHE_BUDGET_FRACTION	16
+#endif /* PCACHE_BUDGET_FRACTION */
+static size_t pcache_memory_budget ()
+{
+  size_t mib = 64;   /* if the size of physical memory is not known */
+#ifdef _SC_PHYS_PAGES
+  long pages = sysconf (_SC_PHYS_PAGES);
+  long page = sysconf (_SC_PAGESIZE);
+  if ((pages > 0) && (page > 0))
+    mib = ((size_t) pages) / PCACHE_BUDGET_FRACTION * page / (1024 * 1024);
+#endif /* _SC_PHYS_PAGES */
+  if (mib < MESSAGES_MIN_SIZE / (1024 * 1024))
+    mib = MESSAGES_MIN_SIZE / (1024 * 1024);
+  int configured = get_size_from_file (3, (int) mib);
+  if (configured > 0)
+    mib = configured;
+  return mib * 1024 * 1024;
+}
+
+/* the bytes used by the tables, including old tables that are being
+ * resized, and by the messages.  The compaction thread is the only one
+ * that changes the sizes */
+static size_t pcache_memory_used ()
+{
+  struct hash_table * tables [] = { &ack_hash, &mid_hash, &trc_hash };
+  size_t entries = 0;
+  unsigned int i;
+  for (i = 0; i < sizeof (tables) / sizeof (tables [0]); i++)
+    entries += *(tables [i]->num) + tables [i]->old_num;
+  return entries * sizeof (struct hash_entry) + msg_table_size;
+}
+
+static void hash_write_lock (struct hash_table * t)
+{
+  pthread_rwlock_wrlock (&(t->resize_lock));
+}
+
+/* start resizing the table to new_num entries.  Called without locks */
+static void hash_resize_start (struct hash_table * t, int new_num)
+{
+  size_t size = ((size_t) new_num) * sizeof (struct hash_entry);
+  struct table_file tf = { .base = NULL, .size = 0,
+                           .dirty_start = 0, .dirty_end = 0 };
+  struct hash_entry * table = NULL;
+  if (t->tf->base != NULL) {   /* mapped, map the new table as well */
+    char fname [100];
+    snprintf (fname, sizeof (fname), "%s.resize", t->fname);
+    int fd = open_rw_config (cache_directory, fname, 1);
+    if (fd < 0)
+      return;
+    if (ftruncate (fd, 0) != 0) {  /* discard any earlier attempt */
+      perror ("pcache hash_resize_start ftruncate");
+      close (fd);
+      return;
+    }
+    char * base = table_map (fd, size + SIPHASH_KEY_SIZE, &tf);
+    if (base == NULL)   /* table_map closed fd */
+      return;           /* keep the old table, which is still mapped */
+    memcpy (base + size, t->secret, SIPHASH_KEY_SIZE);
+    table_dirty_all (&tf);
+    table = (struct hash_entry *) base;
+  } else {
+    table = malloc_or_fail (size, "pcache hash_resize_start");
+    memset (table, 0, size);
+  }
+  hash_write_lock (t);
+  t->old = *(t->table);
+  t->old_num = *(t->num);
+  t->old_file = *(t->tf);
+  *(t->table) = table;
+  *(t->num) = new_num;
+  *(t->tf) = tf;
+  t->moved = 0;
+  t->used = 0;
+  hash_resize_unlock (t);
+}
+
+/* replace the inactive copy of the filter with an empty one of num_blocks,
+ * while no thread is using the filter.  Called without locks */
+static void bloom_replace_inactive (struct bloom * b, struct hash_table * t,
+                                    uint64_t num_blocks)
+{
+  hash_write_lock (t);
+  int inactive = 1 - atomic_load (&(b->active));
+  free (b->blocks [inactive]);
+  b->blocks [inactive] = bloom_alloc (num_blocks);
+  b->num_blocks [inactive] = num_blocks;
+  hash_resize_unlock (t);
+}
+
+/* give the filter the size for the (resized) table */
+static void bloom_resize (struct bloom * b, struct hash_table * t, int by_id)
+{
+  uint64_t num_blocks = bloom_blocks_for (*(t->num));
+  if ((b->num_blocks [0] == 0) || (b->num_blocks [b->active] == num_blocks))
+    return;
+  bloom_replace_inactive (b, t, num_blocks);
+  hash_read_lock (t);   /* the next rebuild makes the new size active */
+  while (b->num_blocks [atomic_load (&(b->active))] != num_blocks)
+    if (! bloom_rebuild (b, t, by_id))
+      sched_yield ();   /* another thread is rebuilding it */
+  hash_resize_unlock (t);
+  bloom_replace_inactive (b, t, num_blocks);   /* the old size */
+  b->limit = *(t->num) / 2;
+}
+
+/* move up to HASH_RESIZE_STEP entries from the old table to the new,
+ * and when all are moved, stop using the old table.  Entries that would
+ * replace another entry in the new table are dropped.  Only called from
+ * the compaction thread, without locks */
+static void hash_resize_step (struct hash_table * t)
+{
+  hash_read_lock (t);
+  if (t->old == NULL) {
+    hash_resize_unlock (t);
+    return;
+  }
+  struct hash_entry * table = *(t->table);
+  int end = t->moved + HASH_RESIZE_STEP;
+  if (end > t->old_num)
+    end = t->old_num;
+  int i;
+  for (i = t->moved; i < end; i++) {
+    const struct hash_entry * e = t->old + i;   /* the old table is never */
+    if (! e->used)                              /* modified, so need not */
+      continue;                                 /* be locked */
+    char key [MESSAGE_ID_SIZE];
+    hash_entry_key (t, e, key);
+    int index = id_index (key, *(t->num), t->secret);
+    hash_lock (index);
+    if (! table [index].used) {
+      table [index] = *e;
+      t->used++;
+      table_dirty (t->tf, table + index, sizeof (struct hash_entry));
+    }
+    hash_unlock (index);
+  }
+  t->moved = end;
+  int done = (t->moved >= t->old_num);
+  hash_resize_unlock (t);
+  if (! done)
+    return;
+  hash_write_lock (t);
+  struct hash_entry * old = t->old;
+  struct table_file old_file = t->old_file;
+  t->old = NULL;
+  t->old_num = 0;
+  t->old_file.base = NULL;
+  hash_resize_unlock (t);
+  if (old_file.base != NULL) {   /* the new file replaces the old one */
+    table_unmap (&old_file);
+    char fname [100];
+    snprintf (fname, sizeof (fname), "%s.resize", t->fname);
+    char * from = NULL;
+    char * to = NULL;
+    if ((config_file_name (cache_directory, fname, &from, 1) > 0) &&
+        (config_file_name (cache_directory, t->fname, &to, 1) > 0) &&
+        (rename (from, to) != 0))
+      perror ("pcache hash_resize_step rename");
+    if (from != NULL)
+      free (from);
+    if (to != NULL)
+      free (to);
+  } else {
+    free (old);
+  }
+  if (t->save != NULL)
+    *(t->save) = 1;
+  for (i = 0; i < 2; i++)
+    if (t->blooms [i] != NULL)
+      bloom_resize (t->blooms [i], t, t->bloom_by_id [i]);
+}
+
+/* called every HASH_RESIZE_PERIOD to decide whether to resize the table */
+static void hash_resize_check (struct hash_table * t, int over_budget,
+                               size_t room)
+{
+  if (t->old != NULL)   /* still resizing */
+    return;
+  uint64_t num = *(t->num);
+  uint64_t additions = atomic_exchange (&(t->additions), 0);
+  uint64_t used = t->used;
+  if ((! over_budget) && (used > num / 4 * 3) &&
+      (additions * HASH_TURNOVER_FAST > num * HASH_RESIZE_PERIOD) &&
+      (num * sizeof (struct hash_entry) <= room) && (num <= INT_MAX / 4))
+    hash_resize_start (t, (int) (num * 2));
+  else if ((num / 2 >= HASH_MIN_ENTRIES) &&
+           ((over_budget) ||
+            (additions * HASH_TURNOVER_SLOW < num * HASH_RESIZE_PERIOD)))
+    hash_resize_start (t, (int) (num / 2));
+}
+
+/* change msg_table to have num segments.  The segments beyond num, if any,
+ * must be free.  Returns 1 for success, 0 for failure.
+ * Called with msg_lock held for writing */
+static int messages_remap (int num)
+{
+  size_t size = ((size_t) num) * SEGMENT_SIZE;
+  size_t * live = malloc_or_fail (num * sizeof (size_t), "messages_remap");
+  memset (live, 0, num * sizeof (size_t));
+  memcpy (live, segment_live,
+          ((num < num_segments) ? num : num_segments) * sizeof (size_t));
+  char * base = NULL;
+  if (msg_file.base != NULL) {
+    int fd = open_rw_config (cache_directory, "message", 1);
+    struct table_file old = msg_file;
+    if (fd >= 0)
+      base = table_map (fd, size, &msg_file);  /* closes fd */
+    if (base == NULL) {
+      msg_file = old;
+      free (live);
+      return 0;
+    }
+    table_sync (&old, 0);
+    table_unmap (&old);
+  } else {
+    base = realloc (msg_table, size);
+    if (base == NULL) {
+      free (live);
+      return 0;
+    }
+    if (size > msg_table_size)
+      memset (base + msg_table_size, 0, size - msg_table_size);
+  }
+  if (num > num_segments)   /* the new segments are all free */
+    free_segments += num - num_segments;
+  free (segment_live);
+  segment_live = live;
+  msg_table = (struct message_header *) base;
+  msg_table_size = size;
+  num_segments = segment_limit = num;
+  save_messages = 1;
+  return 1;
+}
+
+/* stop using the segments from num on, so they can be removed once
+ * their messages are moved.  First deletes the lowest-priority messages
+ * that would not fit.  Called with msg_lock held for writing */
+static void messages_shrink_start (int num)
+{
+  size_t live = 0;
+  int segment;
+  for (segment = 0; segment < num_segments; segment++)
+    live += segment_live [segment];
+  size_t fit = ((size_t) num) * SEGMENT_SIZE / 4 * 3;
+  if (live > fit)
+    evict (live - fit);
+  for (segment = num; segment < num_segments; segment++)
+    if (! segment_in_use (segment))
+      free_segments--;
+  segment_limit = num;
+  if (current_segment >= segment_limit)
+    current_segment = -1;
+}
+
+/* move the messages out of a few of the segments beyond segment_limit.
+ * Once they are all free, remove them.
+ * Called with msg_lock held for writing */
+static void messages_shrink_step ()
+{
+  int count = 0;
+  int segment;
+  for (segment = segment_limit; segment < num_segments; segment++) {
+    if (! segment_in_use (segment))
+      continue;
+    if (count++ >= 4)    /* a few segments at a time */
+      return;
+    if (! segment_compact (segment)) {  /* no free segment before the limit */
+      struct segment_header * sh = segment_header (segment);
+      size_t offset = sizeof (struct segment_header);
+      while (offset + sizeof (struct message_header) <= sh->used) {
+        struct message_header * hp =   /* drop its remaining messages */
+          (struct message_header *) (((char *) sh) + offset);
+        if ((hp->length == 0) || (offset + record_size (hp) > sh->used))
+          break;
+        message_delete (hp);
+        offset += record_size (hp);
+      }
+      if (! segment_compact (segment))
+        return;
+    }
+  }
+  messages_remap (segment_limit);
+}
+
+/* called every HASH_RESIZE_PERIOD to decide whether to resize msg_table.
+ * Called with msg_lock held for writing */
+static void messages_resize_check (int over_budget, size_t room)
+{
+  if (segment_limit < num_segments)   /* still shrinking */
+    return;
+  size_t live = 0;
+  int segment;
+  for (segment = 0; segment < num_segments; segment++)
+    live += segment_live [segment];
+  if ((! over_budget) && (live > msg_table_size / 4 * 3) &&
+      (msg_table_size <= room) && (num_segments <= INT_MAX / 4))
+    messages_remap (num_segments * 2);
+  else if ((((size_t) (num_segments / 2)) * SEGMENT_SIZE >=
+            MESSAGES_MIN_SIZE) &&
+           ((over_budget) || (live < msg_table_size / 4)))
+    messages_shrink_start (num_segments / 2);
+}
+
+/* the bytes last counted for ALLNET_MEMORY_PCACHE (lib/util.h), and
+ * when the process is over its memory budget, the bytes over */
+static size_t memory_counted = 0;
+static size_t memory_pressure = 0;
+
+/* move some entries of any tables being resized and, every
+ * HASH_RESIZE_PERIOD or when over the memory budget, decide which
+ * tables to resize.  Called from the compaction thread, without locks */
+static void pcache_resize ()
+{
+  struct hash_table * tables [] = { &ack_hash, &mid_hash, &trc_hash };
+  const unsigned int num_tables = sizeof (tables) / sizeof (tables [0]);
+  unsigned int i;
+  for (i = 0; i < num_tables; i++)
+    hash_resize_step (tables [i]);
+  size_t used_now = pcache_memory_used ();
+  allnet_memory_account (ALLNET_MEMORY_PCACHE,
+                         ((long long int) used_now) -
+                         ((long long int) memory_counted));
+  memory_counted = used_now;
+  static unsigned long long int next_check = 0;
+  unsigned long long int now = allnet_time ();
+  if (next_check == 0)   /* count the additions over a full period */
+    next_check = now + HASH_RESIZE_PERIOD;
+  size_t pressure = __atomic_exchange_n (&memory_pressure, 0,
+                                         __ATOMIC_RELAXED);
+  if ((now < next_check) && (pressure == 0))
+    return;
+  next_check = now + HASH_RESIZE_PERIOD;
+  size_t budget = pcache_memory_budget ();
+  if (pressure > 0)   /* the process is over its budget, so shrink now */
+    budget = ((used_now > pressure) ? (used_now - pressure) : 0);
+  for (i = 0; i < num_tables; i++) {
+    size_t used = pcache_memory_used ();
+    hash_resize_check (tables [i], (used > budget),
+                       ((used > budget) ? 0 : (budget - used)));
+  }
+  size_t used = pcache_memory_used ();
+  pthread_rwlock_wrlock (&msg_lock);
+  messages_resize_check ((used > budget),
+                         ((used > budget) ? 0 : (budget - used)));
+  pthread_rwlock_unlock (&msg_lock);
+}
+
+#endif /* PRINT_CACHE_FILES */
+
+/* the compaction thread runs compact_step every second, or when
+ * signaled that free space is low */
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+
+#ifndef PRINT_CACHE_FILES
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* called by the memory accounting when the process is over its memory
+ * budget.  Unless the last excess has not yet been handled, has the
+ * compaction thread shrink the tables and messages */
+static void pcache_shrink (long long int excess)
+{
+  size_t none = 0;
+  if (__atomic_compare_exchange_n (&memory_pressure, &none, (size_t) excess,
+                                   0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    pthread_cond_signal (&compact_cond);
+}
+
+static void * compact_thread (void * arg)
+{
+  allnet_memory_register_shrink (ALLNET_MEMORY_PCACHE, pcache_shrink);
+  int refresh = 0;    /* look for expired and acked messages, in turn */
+  while (1) {
+    struct timespec until;
+    clock_gettime (CLOCK_REALTIME, &until);
+    until.tv_sec += 1;
+    pthread_mutex_lock (&compact_mutex);
+    pthread_cond_timedwait (&compact_cond, &compact_mutex, &until);
+    pthread_mutex_unlock (&compact_mutex);
+    pthread_rwlock_wrlock (&msg_lock);
+    if (num_segments > 0) {
+      refresh = (refresh + 1) % num_segments;
+      if (refresh != current_segment)
+        segment_refresh (refresh);
+      int i;   /* a few segments at a time, so others can have the lock */
+      for (i = 0; (i < 4) && (compact_step (0)); i++)
+        ;
+      if (segment_limit < num_segments)
+        messages_shrink_step ();
+    }
+    pcache_maint ();
+    pthread_rwlock_unlock (&msg_lock);
+    pcache_resize ();
+  }
+  return NULL;
+}
+#endif /* PRINT_CACHE_FILES */
+
+/* create the tables, exactly once.
+ * The tokens are read first.  Then the acks (with the deliveries) and
+ * the traces are loaded in parallel with the messages.  pcache_init
+ * returns once the acks and traces are available, so they can be
+ * looked up while the messages finish loading in the background.
+ * Functions that use the messages or message IDs call
+ * pcache_init_messages, which waits until they are loaded */
+static pthread_once_t pcache_once = PTHREAD_ONCE_INIT;
+static atomic_int pcache_initialized = 0;
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int acks_loaded = 0;
+static atomic_int messages_loaded = 0;
+
+static void load_done (atomic_int * loaded)
+{
+  pthread_mutex_lock (&load_mutex);
+  *loaded = 1;
+  pthread_cond_broadcast (&load_cond);
+  pthread_mutex_unlock (&load_mutex);
+}
+
+static void load_wait (atomic_int * loaded)
+{
+  if (*loaded)
+    return;
+  pthread_mutex_lock (&load_mutex);
+  while (! *loaded)
+    pthread_cond_wait (&load_cond, &load_mutex);
+  pthread_mutex_unlock (&load_mutex);
+}
+
+static void * load_acks (void * arg)
 {
-  if ((! always) && (! save_messages))
-    return;
-  size_t len = gc_messages (NULL, NULL, 0, 0);
+  read_ack_file ();
+  ack_serials_init ();
+  if (! save_tokens)   /* the tokens are the ones the deliveries refer to */
+    read_delivery_file ();
+  hash_count_used (&ack_hash);
+  bloom_init (&ack_bloom, num_ack);
+  bloom_init (&acked_bloom, num_ack);
+  hash_read_lock (&ack_hash);
+  hash_bloom_rebuild (&ack_hash);
+  hash_resize_unlock (&ack_hash);
+  load_done (&acks_loaded);
+  return NULL;
+}
+
+static void * load_traces (void * arg)
+{
+  read_trace_file ();
+  hash_count_used (&trc_hash);
+  return NULL;
+}
+
+static void * load_messages (void * arg)
+{
+  read_messages_file ();
+  hash_count_used (&mid_hash);
+  bloom_init (&mid_bloom, num_mid);
+  hash_read_lock (&mid_hash);
+  hash_bloom_rebuild (&mid_hash);
+  hash_resize_unlock (&mid_hash);
+  load_wait (&acks_loaded);  /* for delivery_msg_serial */
+  if (delivery_msg_serial > next_msg_serial)
+    next_msg_serial = delivery_msg_serial;
+  load_done (&messages_loaded);
 #ifndef PRINT_CACHE_FILES
-  int fd = open_write_config ("acache", "message", 1);
-  if (fd >= 0) {
-    size_t w = write (fd, msg_table, len);
-    if (w != len) {
-      perror ("write_messages_file error writing messages");
-      printf ("error writing %zd bytes, wrote %zd\n", len, w);
-    } else
-      save_messages = 0;
-    close (fd);
-  }
-#else /* PRINT_CACHE_FILES */
-  if (len < 1000)
-    printf ("after gc, %zd bytes left\n", len);
+  pthread_t compact;
+  if (pthread_create (&compact, NULL, compact_thread, NULL) == 0)
+    pthread_detach (compact);
+  else  /* pcache_save_packet will compact and save as needed */
+    perror ("pcache_init pthread_create");
 #endif /* PRINT_CACHE_FILES */
+  return NULL;
 }
 
-/* initialize and do any needed maintenance */
-static int pcache_init_maint_initialized = 0;
-static void pcache_init_maint ()
+/* start a thread to run f or, if that fails, run f in this thread.
+ * Returns 1 if the thread was started */
+static int load_start (pthread_t * thread, void * (* f) (void *))
 {
-  if (! pcache_init_maint_initialized) {
-    mid_secret = random_int (0, (unsigned long long int) (-1));
-    read_tokens_file ();
-    read_hash_files ();
-    read_messages_file ();
-    pcache_init_maint_initialized = 1;
-  }
-/* save at least once when first called.  Further, save every 1-60 minutes */
-  static unsigned long long int next_save = 0;
-  static unsigned long long int minutes_increment = 1;
-  if (allnet_time () >= next_save) {
-    write_tokens_file (0);
-    write_hash_files (0);
-    write_messages_file (0);
-    next_save = allnet_time () + minutes_increment * 60;
-    if (minutes_increment < 60)
-      minutes_increment += 1;  /* add one minute */
+  if (pthread_create (thread, NULL, f, NULL) == 0)
+    return 1;
+  perror ("pcache load pthread_create");
+  f (NULL);
+  return 0;
+}
+
+static void pcache_init_once ()
+{
+  int i;
+  for (i = 0; i < HASH_LOCKS; i++) {
+    pthread_mutex_init (hash_locks + i, NULL);
+    pthread_mutex_init (delivery_locks + i, NULL);
   }
+  random_bytes (mid_secret, sizeof (mid_secret));
+  read_tokens_file ();
+  pthread_t acks, traces, messages;
+  int acks_started = load_start (&acks, load_acks);
+  int traces_started = load_start (&traces, load_traces);
+  if (load_start (&messages, load_messages))
+    pthread_detach (messages);
+  if (acks_started)
+    pthread_join (acks, NULL);
+  if (traces_started)
+    pthread_join (traces, NULL);
+  pcache_initialized = 1;
 }
 
-/* return 1 for success, 0 for failure.
- * look inside a message and fill in its ID (MESSAGE_ID_SIZE bytes). */
-int pcache_message_id (const char * message, int msize, char * result_id)
+static void pcache_init ()
+{
+  pthread_once (&pcache_once, pcache_init_once);
+}
+
+static void pcache_init_messages ()
+{
+  pcache_init ();
+  load_wait (&messages_loaded);
+}
+
+/* return 1 for success, 0 for failure.  Does not access the tables. */
+static int message_id (const char * message, int msize, char * result_id)
 {
-  pcache_init_maint ();
   if (msize < ALLNET_HEADER_SIZE)
     return 0;
   struct allnet_header * hp = (struct allnet_header *) message;
@@ -610,55 +2730,64 @@ int pcache_message_id (const char * message, int msize, char * result_id)
   return 1;
 }
 
+/* return 1 for success, 0 for failure.
+ * look inside a message and fill in its ID (MESSAGE_ID_SIZE bytes). */
+int pcache_message_id (const char * message, int msize, char * result_id)
+{
+  pcache_init ();
+  return message_id (message, msize, result_id);
+}
+
 /* if the packet has no ID, return 0
  * if the packet was already in the mid_table, return 0
  * else add to the mid_table and return 1
  * id must have MESSAGE_ID_SIZE bytes */
 static int pcache_record_packet_id (const char * message, int msize, char * id)
 {
-  pcache_init_maint ();
-  if (! pcache_message_id (message, msize, id)) {
+  pcache_init_messages ();
+  if (! message_id (message, msize, id)) {
     print_buffer (message, msize, "no message ID for packet: ", msize, 1);
     return 0;
   }
-  int index = id_index (id, num_mid, mid_secret);
-  if (memcmp (mid_table [index].ida, id, MESSAGE_ID_SIZE) == 0)
-    return 0;    /* we have it already */
-  memcpy (mid_table [index].ida, id, MESSAGE_ID_SIZE);
-  mid_table [index].sent_to_tokens = 0; 
-  mid_table [index].used = 1; 
-  return 1;
+  struct hash_entry e = { .serial = 0, .used = 1, .max_hops = 0 };
+  memcpy (e.ida, id, MESSAGE_ID_SIZE);
+  hash_read_lock (&mid_hash);
+  int result = hash_add (&mid_hash, id, &e);  /* 0 if we have it already */
+  if (result == 2)
+    hash_bloom_rebuild (&mid_hash);
+  hash_resize_unlock (&mid_hash);
+  return (result != 0);
 }
 
 /* save this (received) packet */
 void pcache_save_packet (const char * message, int msize, int priority)
 {
   char id [MESSAGE_ID_SIZE];
-  if (! pcache_record_packet_id (message, msize, id))  /* cannot save */
+  if ((! pcache_record_packet_id (message, msize, id)) ||  /* cannot save */
+      (msize <= 0) || (msize > ALLNET_MTU) || (priority <= 0)) {
+    ALLNET_PROBE4 (pcache_save, message, msize, priority, 0);
     return;
-  char * p = (char *) msg_table;
-  const size_t mh_size = sizeof (struct message_header);
-  const size_t needed = mh_size + msg_storage (msize);
-  size_t i;
-  for (i = 0; i + needed <= msg_table_size; ) {
-    struct message_header * hp = (struct message_header *)(p + i);
-    const size_t next_i = i + needed;
-    /* to do later maybe: if we find a sufficiently large deleted message,
-     * and the next message has lower priority, insert there.  Or else
-     * do a gc as we go along, since we're copying many bytes anyway.
-     * we could even combine this code with the gc code, so the same
-     * code does a gc, and optionally inserts a packet (if the packet is
-     * inserted, the gc could be partial, only up to the insertion point) */
-    if (((hp->priority != 0) && (priority >= hp->priority)) || /* insert here */
-        (hp->length == 0)) {           /* last message, used as a sentinel */
-      if (next_i < msg_table_size)    /* move others out of the way */
-        memmove (p + next_i, p + i, msg_table_size - next_i);
-      save_message (p + i, id, message, msize, priority);
-      save_messages = 1;
-      return;
-    }
-    i += mh_size + msg_storage (hp->length);
   }
+  pthread_rwlock_wrlock (&msg_lock);
+  const size_t needed = sizeof (struct message_header) + msg_storage (msize);
+  char * p = segment_allocate (needed, 0);
+  if (p == NULL) {   /* compaction is behind, do one step ourselves */
+    compact_step (1);
+    p = segment_allocate (needed, 0);
+  }
+  if (p != NULL) {
+    save_message (p, id, message, msize, priority);
+    table_dirty (&msg_file, p, needed);
+    struct message_header * hp = (struct message_header *) p;
+    live_messages++;
+    index_insert (hp);
+    heap_push (hp);
+  }   /* else the message is dropped, though its ID is recorded */
+  ALLNET_PROBE4 (pcache_save, message, msize, priority, (p != NULL));
+  if (free_segments < SEGMENTS_FREE_TARGET)
+    pthread_cond_signal (&compact_cond);
+  pcache_maint ();
+  pthread_rwlock_unlock (&msg_lock);
 }
 
 /* record this packet ID, without actually saving it */
@@ -672,9 +2801,12 @@ void pcache_record_packet (const char * message, int msize)
  * ID is MESSAGE_ID_SIZE bytes. */
 int pcache_id_found (const char * id)
 {
-  pcache_init_maint ();
-  int index = id_index (id, num_mid, mid_secret);
-  return (memcmp (mid_table [index].ida, id, MESSAGE_ID_SIZE) == 0);
+  pcache_init_messages ();
+  hash_read_lock (&mid_hash);
+  int result = ((bloom_maybe (&mid_bloom, id)) &&
+                (hash_find (&mid_hash, id, id, NULL)));
+  hash_resize_unlock (&mid_hash);
+  return result;
 }
 
 /* return whether this packet is to be returned given this bitmap.
@@ -698,6 +2830,16 @@ static int
   return ((bitmap [index] & mask) != 0);
 }
 
+/* the size in bytes of a bitmap with 2^bits_power_two bits */
+static int bitmap_bytes (int bits_power_two)
+{
+  if (bits_power_two >= 3)
+    return (1 << (bits_power_two - 3));
+  else if (bits_power_two > 0)
+    return 1;
+  return 0;
+}
+
 /* returns NULL if the address does not match the bitmap, and
  * the new bitmap otherwise */
 static const unsigned char *
@@ -707,23 +2849,87 @@ static const unsigned char *
   if ((bits_power_two > 0) &&
       (! address_matches_bitmap (nbits, addr, bits_power_two, bitmap)))
     return NULL;
-  if (bits_power_two >= 3)
-    return bitmap + (1 << (bits_power_two - 3));
-  else if (bits_power_two > 0)
-    return bitmap + (1 << (bits_power_two - 3));
-  return bitmap;
+  return bitmap + bitmap_bytes (bits_power_two);
+}
+
+/* the summary, if any, of the messages the requester already has */
+struct request_have {
+  int bits_power_two;
+  int num_hashes;            /* 0 if there is no summary */
+  const unsigned char * filter;
+};
+
+/* the size of the request up to and including the bitmaps, or -1 if
+ * the request is too short for its bitmaps */
+static int request_bitmaps_size (const struct allnet_data_request * req,
+                                 int rlen)
+{
+  int size = (int) sizeof (struct allnet_data_request) +
+             bitmap_bytes (req->dst_bits_power_two) +
+             bitmap_bytes (req->src_bits_power_two) +
+             bitmap_bytes (req->mid_bits_power_two);
+  return ((size <= rlen) ? size : -1);
+}
+
+static struct request_have request_have (const struct allnet_data_request * req,
+                                         int rlen)
+{
+  struct request_have result = { .bits_power_two = 0, .num_hashes = 0,
+                                 .filter = NULL };
+  if ((req == NULL) || (rlen < (int) sizeof (struct allnet_data_request)))
+    return result;
+  int offset = request_bitmaps_size (req, rlen);
+  if ((offset < 0) ||
+      (offset + (int) sizeof (struct allnet_data_request_have) > rlen))
+    return result;
+  const struct allnet_data_request_have * have =
+    (const struct allnet_data_request_have *) (((const char *) req) + offset);
+  if ((have->magic != ALLNET_DATA_REQ_HAVE_MAGIC) ||
+      (have->bits_power_two < 3) ||
+      (have->bits_power_two > ALLNET_DATA_REQ_HAVE_MAX_BITS) ||
+      (have->num_hashes < 1) ||
+      (have->num_hashes > ALLNET_DATA_REQ_HAVE_MAX_HASHES) ||
+      (offset + (int) sizeof (struct allnet_data_request_have) +
+       bitmap_bytes (have->bits_power_two) > rlen))
+    return result;
+  result.bits_power_two = have->bits_power_two;
+  result.num_hashes = have->num_hashes;
+  result.filter = have->filter;
+  return result;
+}
+
+/* the bit for hash i of the ID, as described in packet.h */
+static int have_bit (int bits_power_two, const char * id, int i)
+{
+  return (int) (readb32u ((const unsigned char *) (id + 4 * i)) &
+                ((1U << bits_power_two) - 1));
+}
+
+static int have_contains (const struct request_have * have, const char * id)
+{
+  if (have->num_hashes <= 0)
+    return 0;
+  int i;
+  for (i = 0; i < have->num_hashes; i++) {
+    int bit = have_bit (have->bits_power_two, id, i);
+    if ((have->filter [bit / 8] & (0x80 >> (bit % 8))) == 0)
+      return 0;
+  }
+  return 1;
 }
 
+/* ti is the index of the request token, or -1 */
 static int message_matches (const struct allnet_data_request * req, int rlen,
-                            int nbits, const unsigned char * addr,
+                            int nbits, const unsigned char * addr, int ti,
+                            const struct request_have * have,
                             const struct message_header * mhp,
                             const char * message)
 {
   const struct allnet_header * hp = (const struct allnet_header *) message;
-  int ti = ((rlen >= ALLNET_TOKEN_SIZE) ?
-            (token_find_index (req->token)) : -1);
-  if ((ti >= 0) && (mhp->sent_to_tokens & (one64 << ti)))
+  if ((ti >= 0) && (delivery_test (ti, 0, mhp->serial)))
     return 0;             /* already returned this message to this token */
+  if (have_contains (have, mhp->id))
+    return 0;             /* the requester (probably) has this message */
   /* An empty data request message is also allowed, and requests all
      packets addressed TO the given address. */
   if ((rlen == 0) || (req == NULL)) {
@@ -746,6 +2952,232 @@ static int message_matches (const struct allnet_data_request * req, int rlen,
   return 1;
 }
 
+/* does the bitmap have a bit set for any address starting with this byte? */
+static int bucket_in_bitmap (int bits_power_two, const unsigned char * bitmap,
+                             int b)
+{
+  int sub = ((bits_power_two > 8) ? (1 << (bits_power_two - 8)) : 1);
+  int j;
+  for (j = 0; j < sub; j++) {
+    int sixteen = (b << 8) | (j << (16 - bits_power_two));
+    if (bitmap [allnet_bitmap_byte_index (bits_power_two, sixteen)] &
+        allnet_bitmap_byte_mask (bits_power_two, sixteen))
+      return 1;
+  }
+  return 0;
+}
+
+/* sort higher priorities first */
+static int compare_priorities (const void * a, const void * b)
+{
+  const struct message_header * ha = (const struct message_header *)
+    (((const char *) msg_table) + *((const size_t *) a));
+  const struct message_header * hb = (const struct message_header *)
+    (((const char *) msg_table) + *((const size_t *) b));
+  if (ha->priority != hb->priority)
+    return ((ha->priority > hb->priority) ? -1 : 1);
+  if (*((const size_t *) a) != *((const size_t *) b))
+    return ((*((const size_t *) a) < *((const size_t *) b)) ? -1 : 1);
+  return 0;
+}
+
+/* use the indexes to find the messages that might match the request.
+ * Called with msg_lock held, at least for reading.
+ * If the indexes cannot narrow the search, all messages are candidates.
+ * returns -1 if the indexes cannot be used, and otherwise the number
+ * of candidates, stored in *result in order of descending priority (if
+ * the result is > 0, *result is malloc'd and must be freed by the caller) */
+static int request_candidates (const struct allnet_data_request * req,
+                               int rlen, int nbits, const unsigned char * addr,
+                               size_t ** result)
+{
+  *result = NULL;
+  if (! msg_index_valid)
+    return -1;
+  char selected [NUM_INDICES] [INDEX_BUCKETS];
+  memset (selected, 0, sizeof (selected));
+  int best = -1;
+  int best_count = 0;
+  if ((rlen == 0) || (req == NULL)) {  /* destination must match addr/nbits */
+    if ((nbits >= 8) && (addr != NULL)) {
+      best = INDEX_DST;
+      selected [best] [addr [0]] = 1;
+      best_count = msg_index [best] [addr [0]].count;
+    }
+  } else {
+    int p2s [NUM_INDICES] = { req->dst_bits_power_two, req->src_bits_power_two,
+                              req->mid_bits_power_two };
+    const unsigned char * bitmap = req->dst_bitmap;
+    int k;
+    for (k = 0; k < NUM_INDICES; k++) {
+      int p2 = p2s [k];
+      if (p2 <= 0)      /* no bitmap, matches everything */
+        continue;
+      if (((const char *) bitmap) + bitmap_bytes (p2) >
+          ((const char *) req) + rlen)
+        break;          /* request is too short for this bitmap */
+      if (p2 <= 16) {   /* larger bitmaps are not used */
+        int count = 0;
+        int b;
+        for (b = 0; b < INDEX_BUCKETS; b++) {
+          if (bucket_in_bitmap (p2, bitmap, b)) {
+            selected [k] [b] = 1;
+            count += msg_index [k] [b].count;
+          }
+        }
+        if ((best < 0) || (count < best_count)) {
+          best = k;
+          best_count = count;
+        }
+      }
+      bitmap += bitmap_bytes (p2);
+    }
+  }
+  if (best < 0) {   /* every message is a candidate */
+    best = INDEX_DST;
+    memset (selected [best], 1, INDEX_BUCKETS);
+    best_count = 0;
+    int b;
+    for (b = 0; b < INDEX_BUCKETS; b++)
+      best_count += msg_index [best] [b].count;
+  }
+  if (best_count <= 0)
+    return 0;
+  size_t * offsets = malloc (best_count * sizeof (size_t));
+  if (offsets == NULL)
+    return -1;
+  int n = 0;
+  int b;
+  for (b = 0; b < INDEX_BUCKETS; b++) {
+    if (selected [best] [b]) {
+      struct index_bucket * bucket = msg_index [best] + b;
+      memcpy (offsets + n, bucket->offsets, bucket->count * sizeof (size_t));
+      n += bucket->count;
+    }
+  }
+  qsort (offsets, n, sizeof (size_t), compare_priorities);
+  *result = offsets;
+  return n;
+}
+
+/* add the message to the result if it matches the request.
+ * *ti is the index of the request token, or -1 if it has not been added.
+ * returns 0 if there is no more space in the buffer, 1 otherwise */
+/* returns 0 if the callback ended the request, 1 otherwise */
+static int request_add (struct message_header * current,
+                        const struct allnet_data_request * req, int rlen,
+                        int nbits, const unsigned char * addr, int * ti,
+                        const struct request_have * have,
+                        pcache_message_fun f, void * ref, int * count,
+                        uint64_t now)
+{
+  const char * message = ((char *) current) + sizeof (struct message_header);
+  if ((current->priority != 0) &&  /* the message has not been deleted */
+      ((segment_header (segment_of (current))->valid_until >= now) ||
+       (is_valid_message (message, current->length, NULL))) &&
+      (! id_is_acked (current->id, NULL))) {
+    if (message_matches (req, rlen, nbits, addr, *ti, have, current,
+                         message)) {
+      /* messages that do not match do not end the search, so the result
+       * is the same whether or not the indexes are used */
+      if (! f (message, current->length, current->priority, ref))
+        return 0;
+      *count += 1;
+      if ((rlen >= ALLNET_TOKEN_SIZE) &&
+          (! (memget (req->token, 0, ALLNET_TOKEN_SIZE)))) {
+        if (*ti < 0)
+          *ti = token_lookup (req->token, 1, "pcache_request");
+        if (*ti >= 0)
+          delivery_add (*ti, 0, current->serial);
+      }
+    } /* else no match, do not add to the results */
+  }  /* deleted or invalid (probably expired) or acked messages are
+      * left for segment_refresh to delete */
+  return 1;
+}
+
+/* give each matching message to f, in order of descending priority,
+ * until f returns 0 or max messages have been given.
+ * Where the request allows, only the messages found through the indexes
+ * are considered.  If the indexes cannot be built (out of memory), the
+ * messages are given in storage order rather than by priority.
+ * returns the number of messages f accepted */
+int pcache_request_each (const struct allnet_data_request * req, int rlen,
+                         int nbits, const unsigned char * addr, int max,
+                         pcache_message_fun f, void * ref)
+{
+  ALLNET_PROBE2 (pcache_request_start, nbits, max);
+  pcache_init_messages ();
+  pthread_rwlock_rdlock (&msg_lock);
+  if (! msg_index_valid) {   /* building the indexes needs the write lock */
+    pthread_rwlock_unlock (&msg_lock);
+    pthread_rwlock_wrlock (&msg_lock);
+    if (! msg_index_valid)
+      index_build ();
+    pthread_rwlock_unlock (&msg_lock);
+    pthread_rwlock_rdlock (&msg_lock);
+  }
+  int count = 0;
+  uint64_t now = allnet_time ();
+  int ti = (((req != NULL) && (rlen >= ALLNET_TOKEN_SIZE)) ?
+            (token_lookup (req->token, 0, NULL)) : -1);
+  struct request_have have = request_have (req, rlen);
+  size_t * candidates = NULL;
+  int num_candidates = request_candidates (req, rlen, nbits, addr,
+                                           &candidates);
+  if (num_candidates < 0) {      /* look at all the messages, unsorted */
+    struct message_header * current = NULL;
+    while (((max <= 0) || (count < max)) &&
+           ((current = next_message (current)) != NULL)) {
+      if (! request_add (current, req, rlen, nbits, addr, &ti, &have, f, ref,
+                         &count, now))
+        break;
+    }
+  } else {
+    int i;
+    for (i = 0; (i < num_candidates) && ((max <= 0) || (count < max)); i++) {
+      struct message_header * current = (struct message_header *)
+        (((char *) msg_table) + candidates [i]);
+      if (! request_add (current, req, rlen, nbits, addr, &ti, &have, f, ref,
+                         &count, now))
+        break;
+    }
+    if (candidates != NULL)
+      free (candidates);
+  }
+  pthread_rwlock_unlock (&msg_lock);
+  ALLNET_PROBE1 (pcache_request_done, count);
+  return count;
+}
+
+struct request_buffer {
+  char * buffer;
+  size_t offset;                 /* bytes in buffer not used for messages */
+  struct pcache_result * result;
+};
+
+/* the front of the buffer is used for the messages array,
+ * the back of the buffer stores the actual messages */
+static int request_copy (const char * message, int msize, int priority,
+                         void * ref)
+{
+  struct request_buffer * rb = (struct request_buffer *) ref;
+  const uint32_t eff_len = msg_storage (msize);
+  const size_t pm_size = sizeof (struct pcache_message);
+  /* to see if we have room, compute array size including this message, n+1 */
+  const size_t array_size = pm_size * (rb->result->n + 1);
+  if (pm_size + eff_len + array_size > rb->offset)  /* no more space */
+    return 0;
+  rb->offset -= eff_len;
+  memcpy (rb->buffer + rb->offset, message, msize);
+  struct pcache_message * pm = rb->result->messages + rb->result->n;
+  pm->message = rb->buffer + rb->offset;
+  pm->msize = msize;
+  pm->priority = priority;
+  rb->result->n += 1;
+  return 1;
+}
+
 /* if successful, return the messages.
    return a result with n = 0 if there are no messages,
    and n = -1 in case of failure
@@ -755,93 +3187,118 @@ static int message_matches (const struct allnet_data_request * req, int rlen,
    and if nbits is 0 or source is NULL, returns all messages
    The memory used by pcache_result is allocated in the given buffer
    If the request includes a token, the token is marked as having received
-   these messages.
-
-   implementation: the front of the buffer is used for the messages array,
-   the back of the buffer stores the actual messages */
+   these messages. */
 struct pcache_result
   pcache_request (const struct allnet_data_request * req, int rlen,
                   int nbits, const unsigned char * addr, int max,
                   char * buffer, int bsize)
 {
-  pcache_init_maint ();
   struct pcache_result
     result = {.n = 0, .messages = (struct pcache_message *) buffer };
   if (bsize <= 0)
     return result;
   memset (buffer, 0, bsize);
-  size_t buffer_offset = bsize;     /* bytes in buffer not used for messages */
-  struct message_header * current = NULL;
-  while (((max <= 0) || (result.n < max)) &&
-         ((current = next_message (current)) != NULL)) {
-    const uint32_t eff_len = msg_storage (current->length);
-    const size_t pm_size = sizeof (struct pcache_message);
-    const size_t mh_size = sizeof (struct message_header);
-    const size_t needed = pm_size + eff_len;
-  /* to see if we have room, compute array size including this message, n+1 */
-    const size_t array_size = pm_size * (result.n + 1);
-    if (needed + array_size > buffer_offset)  /* no more space */
-      break;
-    const char * message = ((char *) current) + mh_size;
-    if ((current->priority != 0) &&  /* the message has not been deleted */
-        (is_valid_message (message, current->length, NULL)) &&
-        (! id_is_acked (current->id))) {
-      if (message_matches (req, rlen, nbits, addr, current, message)) {
-        /* add this message */
-        if (buffer_offset < needed + array_size) {
-          printf ("error: offset %zd <= needed %zd + array %zd\n",
-                  buffer_offset, needed, array_size);
-          printf ("  sizes %zd + %zd, n %d\n",
-                  sizeof (struct pcache_message *),
-                  sizeof (struct pcache_message), result.n);
-          crash ("error adding message");
-        }
-        /* copy the message to the buffer */
-        buffer_offset -= eff_len;
-        memcpy (buffer + buffer_offset, message, eff_len);
-        result.messages [result.n].message = buffer + buffer_offset;
-        result.messages [result.n].msize = current->length;
-        result.messages [result.n].priority = current->priority;
-        result.n += 1;
-        if ((rlen >= ALLNET_TOKEN_SIZE) &&
-            (! (memget (req->token, 0, ALLNET_TOKEN_SIZE)))) {
-          int ti = token_find_index (req->token);
-          if (ti < 0)  /* no such token */
-            ti = add_token (req->token, "pcache_request");
-          if (ti >= 0) {
-            current->sent_to_tokens |= (one64 << ti);
-            save_messages = 1;
-          }
+  struct request_buffer rb =
+    { .buffer = buffer, .offset = bsize, .result = &result };
+  pcache_request_each (req, rlen, nbits, addr, max, request_copy, &rb);
+  return result;
+}
+ 
+/* number of bits in the summary for each message ID, and hashes per ID.
+ * With 16 bits and 4 hashes, about 1 in 400 messages the requester does
+ * not have is not sent (until the message is no longer among the
+ * requester's most recent) */
+#define HAVE_BITS_PER_ID	16
+#define HAVE_HASHES		4
+
+int pcache_request_summary (struct allnet_data_request * req, int rlen,
+                            int rmax, int max_ids)
+{
+  int offset = request_bitmaps_size (req, rlen);
+  if (offset < 0)
+    return rlen;
+  rlen = offset;    /* remove any existing summary */
+  if (max_ids <= 0)
+    return rlen;
+  if (max_ids > PCACHE_RECENT_IDS)
+    max_ids = PCACHE_RECENT_IDS;
+  pcache_init_messages ();
+  pthread_rwlock_rdlock (&msg_lock);
+  uint64_t first = ((next_msg_serial > (uint64_t) max_ids) ?
+                    (next_msg_serial - max_ids) : 0);
+  int count = 0;
+  int i;
+  for (i = 0; i < PCACHE_RECENT_IDS; i++)
+    if ((recent_ids [i].serial != 0) && (recent_ids [i].serial >= first))
+      count++;
+  int p2 = 3;
+  while ((p2 < ALLNET_DATA_REQ_HAVE_MAX_BITS) &&
+         ((1 << p2) < count * HAVE_BITS_PER_ID))
+    p2++;
+  int hsize = (int) sizeof (struct allnet_data_request_have) +
+              bitmap_bytes (p2);
+  if ((count > 0) && (rlen + hsize <= rmax)) {
+    struct allnet_data_request_have * have =
+      (struct allnet_data_request_have *) (((char *) req) + rlen);
+    memset (have, 0, hsize);
+    have->magic = ALLNET_DATA_REQ_HAVE_MAGIC;
+    have->bits_power_two = p2;
+    have->num_hashes = HAVE_HASHES;
+    for (i = 0; i < PCACHE_RECENT_IDS; i++) {
+      if ((recent_ids [i].serial != 0) && (recent_ids [i].serial >= first)) {
+        int h;
+        for (h = 0; h < HAVE_HASHES; h++) {
+          int bit = have_bit (p2, recent_ids [i].id, h);
+          have->filter [bit / 8] |= (0x80 >> (bit % 8));
         }
-      } /* else no match, do not add to the results */
-    } else {   /* deleted or invalid (probably expired) or acked message */
-      current->priority = 0;     /* mark as deleted */
+      }
     }
+    rlen += hsize;
   }
-  return result;
+  pthread_rwlock_unlock (&msg_lock);
+  return rlen;
 }
+#undef HAVE_BITS_PER_ID
+#undef HAVE_HASHES
  
+void pcache_set_directory (const char * name)
+{
+  cache_directory = name;
+}
+
 /* acks */
 
 /* add this ack to ack_table, setting max_hops.
  * does NOT delete any matching message in msg_table -- that is
- * taken care of by pcache_request and gc_messages */
+ * taken care of by pcache_request and by compaction */
 static void save_one_ack (const char * ack, int max_hops)
 {
-  int aindex = ack_index (ack);
-  if (memcmp (ack_table [aindex].ida, ack, MESSAGE_ID_SIZE) != 0) {
-    memcpy (ack_table [aindex].ida, ack, MESSAGE_ID_SIZE);
-    ack_table [aindex].max_hops = max_hops;
-    ack_table [aindex].used = 1;
-    ack_table [aindex].sent_to_tokens = 0;
-  }
+  char id [MESSAGE_ID_SIZE];
+  sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+  struct hash_entry e = { .serial = 0, .used = 1, .max_hops = max_hops };
+  memcpy (e.ida, ack, MESSAGE_ID_SIZE);
+  hash_read_lock (&ack_hash);
+  if (hash_add (&ack_hash, id, &e) == 2)  /* serial set by hash_add */
+    hash_bloom_rebuild (&ack_hash);
+  hash_resize_unlock (&ack_hash);
+}
+
+/* is this ack in the ack table?  If so and result is not NULL, copies
+ * the entry to result.  Called with ack_hash.resize_lock held for reading */
+static int ack_find (const char * ack, struct hash_entry * result)
+{
+  if (! bloom_maybe (&ack_bloom, ack))
+    return 0;
+  char id [MESSAGE_ID_SIZE];
+  sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+  return hash_find (&ack_hash, id, ack, result);
 }
 
 /* each ack has size MESSAGE_ID_SIZE */
 /* record all these acks and delete (stop caching) corresponding messages */
 void pcache_save_acks (const char * acks, int num_acks, int max_hops)
 {
-  pcache_init_maint ();
+  pcache_init ();
   int i;
   for (i = 0; i < num_acks; i++)
     save_one_ack (acks + i * MESSAGE_ID_SIZE, max_hops);
@@ -851,51 +3308,53 @@ void pcache_save_acks (const char * acks, int num_acks, int max_hops)
 /* return 1 if we have the ack, 0 if we do not */
 int pcache_ack_found (const char * ack)
 {
-  pcache_init_maint ();
-  int aindex = ack_index (ack);
-  if (memcmp (ack_table [aindex].ida, ack, MESSAGE_ID_SIZE) == 0)
-    return 1;
-  return 0;
+  pcache_init ();
+  hash_read_lock (&ack_hash);
+  int result = ack_find (ack, NULL);
+  hash_resize_unlock (&ack_hash);
+  return result;
 }
 
 /* return 1 if we have the ack for this ID, 0 if we do not
  * if returning 1, fill in the ack */
 int pcache_id_acked (const char * id, char * ack)
 {
-  pcache_init_maint ();
-  int aindex = id_index (id, num_ack, ack_secret);
-  char check_id [MESSAGE_ID_SIZE];
-  sha512_bytes (ack_table [aindex].ida, MESSAGE_ID_SIZE,
-                check_id, MESSAGE_ID_SIZE);
-  if (memcmp (id, check_id, MESSAGE_ID_SIZE) == 0) {
-    memcpy (ack, ack_table [aindex].ida, MESSAGE_ID_SIZE);
-    return 1;
-  }
-  return 0;
+  pcache_init ();
+  return id_is_acked (id, ack);
 }
 
-/* return 1 if the ack has not yet been sent to this token,
- * and mark it as sent to this token.
- * otherwise, return 0 */
-int pcache_ack_for_token (const unsigned char * token, const char * ack)
+/* pcache_ack_for_token, called without holding any lock */
+static int ack_for_token (const unsigned char * token, const char * ack)
 {
-  pcache_init_maint ();
-  int aindex = ack_index (ack);
-  if (memcmp (ack_table [aindex].ida, ack, MESSAGE_ID_SIZE) != 0)
+  hash_read_lock (&ack_hash);
+  if (! ack_find (ack, NULL)) {
+    hash_resize_unlock (&ack_hash);
     return 1; /* this ack is not in the table, go ahead and forward it */
-  int itoken = token_find_index (token);
+  }
+  int itoken = token_lookup (token, 0, NULL);
   if (itoken < 0) { /* no such token */
     if (memget (token, 0, ALLNET_TOKEN_SIZE)) {
       printf ("pcache_ack_for_token given zero token\n");
+      hash_resize_unlock (&ack_hash);
       return 0;     /* illegal token, never send acks to it */
     }
-    itoken = add_token (token, "pcache_ack_for_token");
+    itoken = token_lookup (token, 1, "pcache_ack_for_token");
   }
-  if (ack_table [aindex].sent_to_tokens & (one64 << itoken))
-    return 0;    /* already sent */
-  save_ack_hashes = 1;
-  ack_table [aindex].sent_to_tokens |= (one64 << itoken);  /* mark it sent */
-  return 1;
+  int result = 1;  /* if replaced in the meantime, forward it */
+  struct hash_entry e;
+  if (ack_find (ack, &e))
+    result = delivery_add (itoken, 1, e.serial);
+  hash_resize_unlock (&ack_hash);
+  return result;
+}
+
+/* return 1 if the ack has not yet been sent to this token,
+ * and mark it as sent to this token.
+ * otherwise, return 0 */
+int pcache_ack_for_token (const unsigned char * token, const char * ack)
+{
+  pcache_init ();
+  return ack_for_token (token, ack);
 }
 
 /* call pcache_ack_for_token repeatedly for all these acks,
@@ -904,13 +3363,13 @@ int pcache_ack_for_token (const unsigned char * token, const char * ack)
 int pcache_acks_for_token (const unsigned char * token,
                            char * acks, int num_acks)
 {
-  pcache_init_maint ();
+  pcache_init ();
   const char * ack = acks;
   char * offset = acks;
   int result = 0;
   int i;
   for (i = 0; i < num_acks; i++) {
-    if (pcache_ack_for_token (token, ack)) {  /* good one, keep it */
+    if (ack_for_token (token, ack)) {  /* good one, keep it */
       if (offset != ack)
         memcpy (offset, ack, MESSAGE_ID_SIZE);
       offset += MESSAGE_ID_SIZE; /* increment offset only for new acks */
@@ -925,23 +3384,22 @@ int pcache_acks_for_token (const unsigned char * token,
  * return 0 and save the ID.  Trace ID should be MESSAGE_ID_SIZE bytes */
 int pcache_trace_request (const char * id)
 {
-  pcache_init_maint ();
-  int index = id_index (id, num_trc, trc_secret);
-  if (memcmp (trc_table [index].ida, id, MESSAGE_ID_SIZE) == 0)
-    return 1;  /* already there */
-  save_trc_hashes = 1;
-  memcpy (trc_table [index].ida, id, MESSAGE_ID_SIZE);
-  trc_table [index].sent_to_tokens = 0;
-  trc_table [index].used = 1;
-  trc_table [index].max_hops = 0;   /* not used for traces */
-  memset (trc_table [index].pad, 0, sizeof (trc_table [index].pad));
-  return 0;
+  pcache_init ();
+  struct hash_entry e;
+  memset (&e, 0, sizeof (e));   /* max_hops is not used for traces */
+  memcpy (e.ida, id, MESSAGE_ID_SIZE);
+  e.used = 1;
+  hash_read_lock (&trc_hash);
+  int result = (hash_add (&trc_hash, id, &e) == 0);  /* 1 if already there */
+  hash_resize_unlock (&trc_hash);
+  if (! result)
+    save_trc_hashes = 1;
+  return result;
 }
 
 /* for replies, we look at the entire packet, without the header */
 int pcache_trace_reply (const char * msg, int msize)
 {
-  pcache_init_maint ();
   char id [MESSAGE_ID_SIZE];
   sha512_bytes (msg, msize, id, sizeof (id));
   return pcache_trace_request (id);
@@ -950,11 +3408,16 @@ int pcache_trace_reply (const char * msg, int msize)
 /* save cached information to disk */
 void pcache_write (void)
 {
-  if (pcache_init_maint_initialized) {
-    write_tokens_file (1);
-    write_hash_files (1);
-    write_messages_file (1);
-  }
+  if (! pcache_initialized)
+    return;
+  load_wait (&messages_loaded);
+  pthread_rwlock_rdlock (&msg_lock);
+  write_tokens_file (1);
+  write_delivery_file (1);
+  write_hash_files (1);
+  write_messages_file (1);
+  pthread_rwlock_unlock (&msg_lock);
+  file_writes_flush ();   /* on disk before returning */
 }
 
 #ifdef PRINT_CACHE_FILES
@@ -1017,9 +3480,9 @@ static void print_hash_entry (const char * name, int index, int verbose,
   struct hash_entry * current = table + index;
   if (verbose || current->used) {  /* print this ack */
     char desc [1000];
-    snprintf (desc, sizeof (desc), "%s %d/%d: max %d, u %d, token %" PRIx64,
+    snprintf (desc, sizeof (desc), "%s %d/%d: max %d, u %d, serial %" PRIu64,
               name, index, num_entries, current->max_hops,
-              current->used, current->sent_to_tokens);
+              current->used, current->serial);
     print_buffer (table [index].ida, MESSAGE_ID_SIZE, desc,
                   MESSAGE_ID_SIZE, 1);
   }
@@ -1192,43 +3655,23 @@ static void print_matching_req (const char * arg)
 static void print_message_ack (int index, int verbose,
                                int msgs, int acks, int trcs)
 {
-  size_t msg_table_offset = 0;      /* where we are reading msg_table */
-  const size_t mh_size = sizeof (struct message_header);
-  char * p = (char *) msg_table;
   int count = 0;
-  while (1) {
-    if (msg_table_size < msg_table_offset + mh_size) {
-      if (verbose)
-        printf ("at end of table: %zd < %zd + %zd\n",
-                msg_table_size, msg_table_offset, mh_size);
-      break;  /* done */
-    }
-    struct message_header * current =
-      (struct message_header *) (p + msg_table_offset);
-    if (current->length <= 0) { /* sentinel to mark the end of the messages */
-      if (verbose) printf ("found zero-length message\n");
-      break;
-    }
-    uint32_t eff_len = msg_storage (current->length);
-    size_t hdr_msg_size = mh_size + eff_len;
-    if (msg_table_size < msg_table_offset + hdr_msg_size) {
-      printf ("incomplete message at end of table: %zd < %zd + %zd\n",
-              msg_table_size, msg_table_offset, hdr_msg_size);
-      break;   /* no more messages */
-    }
+  struct message_header * current = NULL;
+  while ((current = next_message (current)) != NULL) {
+    size_t msg_table_offset = ((char *) current) - ((char *) msg_table);
     if (((index == count) || (index < 0)) &&
         (verbose || (current->priority != 0))) {  /* print this message */
       char desc [1000];
       snprintf (desc, sizeof (desc),
                 "message %d@%zx: id %02x.%02x.%02x.%02x "
-                "p %x, token %" PRIx64 "", count, msg_table_offset,
+                "p %x, serial %" PRIu64 "", count, msg_table_offset,
                 current->id [0] & 0xff, current->id [1] & 0xff,
                 current->id [2] & 0xff, current->id [3] & 0xff,
-                current->priority, current->sent_to_tokens);
+                current->priority, current->serial);
       int first = 1;
       int x;
       for (x = 0; x < MAX_TOKENS; x++) {
-        if ((current->sent_to_tokens & (one64 << x)) != 0) {  /* bit set */
+        if (delivery_test (x, 0, current->serial)) {  /* sent to token x */
           int c = ((first) ? '=' : ',');
           first = 0;
           int n = strlen (desc);
@@ -1237,7 +3680,6 @@ static void print_message_ack (int index, int verbose,
       }
     }
     count++;
-    msg_table_offset += hdr_msg_size;
   }
   if (acks)
     print_hash_all ("ack", index, verbose, ack_table, num_ack);
@@ -1247,9 +3689,306 @@ static void print_message_ack (int index, int verbose,
     print_hash_all ("mid", index, verbose, mid_table, num_mid);
 }
 
+/* the summary is computed in a single pass over each cache file, mapped
+ * read-only, without loading the cache.  It is quick even for large
+ * caches, and does not compete with allnetd (which may be running)
+ * for memory or reading the files */
+#define SUMMARY_BUCKETS	20	/* bucket 0 is 0, i is [2^(i-1), 2^i) */
+struct summary_hist {
+  uint64_t count [SUMMARY_BUCKETS];
+};
+
+static void summary_hist_add (struct summary_hist * h, uint64_t value)
+{
+  int bucket = 0;
+  while ((value > 0) && (bucket + 1 < SUMMARY_BUCKETS)) {
+    bucket++;
+    value = value / 2;
+  }
+  h->count [bucket]++;
+}
+
+/* by time until expiration */
+#define SUMMARY_EXPIRED		0
+#define SUMMARY_HOUR		1
+#define SUMMARY_DAY		2
+#define SUMMARY_WEEK		3
+#define SUMMARY_LATER		4
+#define SUMMARY_NEVER		5
+#define SUMMARY_EXPIRATIONS	6
+static const char * summary_expiration_names [SUMMARY_EXPIRATIONS] =
+  { "expired", "hour", "day", "week", "later", "never" };
+#define SUMMARY_PRIORITIES	8	/* eighths of ALLNET_PRIORITY_MAX */
+
+struct summary {
+  int have_messages;
+  uint64_t file_bytes;
+  int segments, segments_used;
+  uint64_t segment_bytes;  /* used by segments, including deleted messages */
+  uint64_t live, deleted, live_bytes;
+  uint64_t priority [SUMMARY_PRIORITIES];
+  struct summary_hist age;   /* in segments used since the message's */
+  uint64_t expiration [SUMMARY_EXPIRATIONS];
+  int have_acks, have_traces;
+  uint64_t acks, ack_slots, traces, trace_slots;
+  int have_tokens;
+  int num_tokens;
+  int have_deliveries;
+  int tokens_delivered;      /* tokens with at least one delivery */
+  uint64_t msg_deliveries, ack_deliveries;
+  struct summary_hist per_token;   /* messages and acks sent to a token */
+};
+
+static int summary_expiration (const struct message_header * mhp,
+                               uint64_t now)
+{
+  const struct allnet_header * hp = (const struct allnet_header *) (mhp + 1);
+  unsigned int msize = mhp->length;
+  if (msize < ALLNET_HEADER_SIZE)
+    return SUMMARY_NEVER;
+  const char * ep = ALLNET_EXPIRATION (hp, hp->transport, msize);
+  if ((ep == NULL) || (ep + ALLNET_TIME_SIZE > ((const char *) hp) + msize))
+    return SUMMARY_NEVER;
+  uint64_t expiration = readb64 (ep);
+  if (expiration <= now)                    return SUMMARY_EXPIRED;
+  if (expiration <= now + 3600)             return SUMMARY_HOUR;
+  if (expiration <= now + 86400)            return SUMMARY_DAY;
+  if (expiration <= now + 7 * 86400)        return SUMMARY_WEEK;
+  return SUMMARY_LATER;
+}
+
+static void summary_messages (struct summary * sum)
+{
+  size_t size = 0;
+  char * base = map_private ("message", &size);
+  if ((base == NULL) || (size < SEGMENT_SIZE) ||
+      (memcmp (base, SEGMENT_MAGIC, SEGMENT_MAGIC_SIZE) != 0)) {
+    if (base != NULL)   /* empty, or an older format than segments */
+      munmap (base, size);
+    return;
+  }
+  madvise (base, size, MADV_SEQUENTIAL);
+  sum->have_messages = 1;
+  sum->file_bytes = size;
+  msg_table = (struct message_header *) base;
+  msg_table_size = (size / SEGMENT_SIZE) * SEGMENT_SIZE;
+  num_segments = (int) (msg_table_size / SEGMENT_SIZE);
+  sum->segments = num_segments;
+  uint64_t now = allnet_time ();
+  uint64_t max_sequence = 0;
+  int segment;
+  for (segment = 0; segment < num_segments; segment++) {
+    if (segment_in_use (segment)) {
+      struct segment_header * sh = segment_header (segment);
+      sum->segments_used++;
+      sum->segment_bytes += sh->used;
+      if (sh->sequence > max_sequence)
+        max_sequence = sh->sequence;
+    }
+  }
+  struct message_header * current = NULL;
+  while ((current = next_message (current)) != NULL) {
+    if (current->priority == 0) {
+      sum->deleted++;
+      continue;
+    }
+    sum->live++;
+    sum->live_bytes += current->length;
+    uint64_t p = ((uint64_t) current->priority) * SUMMARY_PRIORITIES /
+                 ALLNET_PRIORITY_MAX;
+    sum->priority [(p < SUMMARY_PRIORITIES) ? p : (SUMMARY_PRIORITIES - 1)]++;
+    uint64_t sequence = segment_header (segment_of (current))->sequence;
+    summary_hist_add (&(sum->age), max_sequence - sequence);
+    sum->expiration [summary_expiration (current, now)]++;
+  }
+  msg_table = NULL;
+  msg_table_size = 0;
+  num_segments = 0;
+  munmap (base, size);
+}
+
+static int summary_hash (const char * fname, uint64_t * used, uint64_t * slots)
+{
+  size_t size = 0;
+  char * base = map_private (fname, &size);
+  if (base == NULL)
+    return 0;
+  madvise (base, size, MADV_SEQUENTIAL);
+  size_t num = size / sizeof (struct hash_entry);  /* ignore the trailer */
+  const struct hash_entry * table = (const struct hash_entry *) base;
+  size_t i;
+  for (i = 0; i < num; i++)
+    if (table [i].used)
+      (*used)++;
+  *slots = num;
+  munmap (base, size);
+  return 1;
+}
+
+static void summary_tokens (struct summary * sum)
+{
+  size_t size = 0;
+  char * base = map_private ("token", &size);
+  if (base != NULL) {
+    const struct tokens * tp = (const struct tokens *) base;
+    if ((size == sizeof (struct tokens)) && (tp->num_tokens <= MAX_TOKENS)) {
+      sum->have_tokens = 1;
+      sum->num_tokens = tp->num_tokens;
+    }
+    munmap (base, size);
+  }
+  base = map_private ("delivery", &size);
+  if (base == NULL)
+    return;
+  if ((size < sizeof (struct delivery_file_header)) ||
+      (memcmp (base, DELIVERY_MAGIC, 8) != 0)) {
+    munmap (base, size);
+    return;
+  }
+  madvise (base, size, MADV_SEQUENTIAL);
+  sum->have_deliveries = 1;
+  static uint64_t per_token [MAX_TOKENS];
+  memset (per_token, 0, sizeof (per_token));
+  size_t offset = sizeof (struct delivery_file_header);
+  while (offset + sizeof (struct delivery_record) <= size) {
+    const struct delivery_record * r =
+      (const struct delivery_record *) (base + offset);
+    offset += sizeof (struct delivery_record) + delivery_data_size (r);
+    if ((r->token_index >= MAX_TOKENS) || (offset > size))
+      break;
+    per_token [r->token_index] += r->count;
+    if (r->acks)
+      sum->ack_deliveries += r->count;
+    else
+      sum->msg_deliveries += r->count;
+  }
+  munmap (base, size);
+  int i;
+  for (i = 0; i < MAX_TOKENS; i++) {
+    if (per_token [i] > 0) {
+      sum->tokens_delivered++;
+      summary_hist_add (&(sum->per_token), per_token [i]);
+    }
+  }
+}
+
+static void summary_print_hist (const char * name,
+                                const struct summary_hist * h, int json)
+{
+  int last = SUMMARY_BUCKETS - 1;   /* omit the empty buckets at the end */
+  while ((last > 0) && (h->count [last] == 0))
+    last--;
+  if (json)
+    printf (",\n    \"%s\": [", name);
+  else
+    printf ("  %s:", name);
+  int i;
+  for (i = 0; i <= last; i++) {
+    if (json)
+      printf ("%s%" PRIu64, ((i == 0) ? "" : ", "), h->count [i]);
+    else if (h->count [i] > 0)
+      printf (" %" PRIu64 "@%s%" PRIu64 "", h->count [i],
+              ((i > 1) ? ">=" : ""), ((i == 0) ? 0 : (one64 << (i - 1))));
+  }
+  printf ((json) ? "]" : "\n");
+}
+
+static void print_summary (int json)
+{
+  struct summary sum;
+  memset (&sum, 0, sizeof (sum));
+  summary_messages (&sum);
+  sum.have_acks = summary_hash ("ack", &sum.acks, &sum.ack_slots);
+  sum.have_traces = summary_hash ("trace", &sum.traces, &sum.trace_slots);
+  summary_tokens (&sum);
+  int i;
+  if (json) {
+    printf ("{\n  \"time\": %llu", allnet_time ());
+    if (sum.have_messages) {
+      printf (",\n  \"messages\": {\n    \"file_bytes\": %" PRIu64
+              ", \"segments\": %d, \"segments_used\": %d, "
+              "\"segment_bytes\": %" PRIu64 ",\n    \"live\": %" PRIu64
+              ", \"deleted\": %" PRIu64 ", \"live_bytes\": %" PRIu64
+              ",\n    \"priority\": [",
+              sum.file_bytes, sum.segments, sum.segments_used,
+              sum.segment_bytes, sum.live, sum.deleted, sum.live_bytes);
+      for (i = 0; i < SUMMARY_PRIORITIES; i++)
+        printf ("%s%" PRIu64, ((i == 0) ? "" : ", "), sum.priority [i]);
+      printf ("],\n    \"expiration\": {");
+      for (i = 0; i < SUMMARY_EXPIRATIONS; i++)
+        printf ("%s\"%s\": %" PRIu64, ((i == 0) ? "" : ", "),
+                summary_expiration_names [i], sum.expiration [i]);
+      printf ("}");
+      summary_print_hist ("age_segments", &(sum.age), json);
+      printf ("\n  }");
+    }
+    if (sum.have_acks)
+      printf (",\n  \"acks\": { \"used\": %" PRIu64 ", \"slots\": %" PRIu64
+              " }", sum.acks, sum.ack_slots);
+    if (sum.have_traces)
+      printf (",\n  \"traces\": { \"used\": %" PRIu64 ", \"slots\": %" PRIu64
+              " }", sum.traces, sum.trace_slots);
+    if (sum.have_tokens || sum.have_deliveries) {
+      printf (",\n  \"tokens\": {\n    \"count\": %d, \"max\": %d",
+              sum.num_tokens, MAX_TOKENS);
+      if (sum.have_deliveries) {
+        printf (", \"delivered\": %d, \"message_deliveries\": %" PRIu64
+                ", \"ack_deliveries\": %" PRIu64, sum.tokens_delivered,
+                sum.msg_deliveries, sum.ack_deliveries);
+        summary_print_hist ("per_token", &(sum.per_token), json);
+      }
+      printf ("\n  }");
+    }
+    printf ("\n}\n");
+    return;
+  }
+  char date [ALLNET_TIME_STRING_SIZE];
+  allnet_time_string (allnet_time (), date);
+  printf ("cache summary @ %s:\n", date);
+  if (sum.have_messages) {
+    printf ("%" PRIu64 " messages with %" PRIu64 " bytes, %" PRIu64
+            " deleted, %d/%d segments used (%" PRIu64 "/%" PRIu64 " bytes)\n",
+            sum.live, sum.live_bytes, sum.deleted, sum.segments_used,
+            sum.segments, sum.segment_bytes, sum.file_bytes);
+    printf ("  priority (eighths):");
+    for (i = 0; i < SUMMARY_PRIORITIES; i++)
+      printf (" %" PRIu64, sum.priority [i]);
+    printf ("\n  expiration:");
+    for (i = 0; i < SUMMARY_EXPIRATIONS; i++)
+      printf (" %s %" PRIu64, summary_expiration_names [i],
+              sum.expiration [i]);
+    printf ("\n");
+    summary_print_hist ("age (segments)", &(sum.age), json);
+  } else {
+    printf ("no messages file\n");
+  }
+  if (sum.have_acks)
+    printf ("%" PRIu64 "/%" PRIu64 " acks", sum.acks, sum.ack_slots);
+  if (sum.have_traces)
+    printf ("%s%" PRIu64 "/%" PRIu64 " traces", ((sum.have_acks) ? ", " : ""),
+            sum.traces, sum.trace_slots);
+  if (sum.have_acks || sum.have_traces)
+    printf ("\n");
+  if (sum.have_tokens)
+    printf ("%d/%d tokens\n", sum.num_tokens, MAX_TOKENS);
+  if (sum.have_deliveries) {
+    printf ("%" PRIu64 " messages and %" PRIu64 " acks sent to %d tokens\n",
+            sum.msg_deliveries, sum.ack_deliveries, sum.tokens_delivered);
+    summary_print_hist ("per token", &(sum.per_token), json);
+  }
+}
+
+/* with "summary" or "json" as the only argument, prints the summary
+ * (as JSON for "json") without loading the cache.  Otherwise loads
+ * the cache and prints the requested entries, then the statistics */
 int main (int argc, char ** argv)
 {
-  pcache_init_maint ();
+  if ((argc == 2) && ((strcasecmp (argv [1], "summary") == 0) ||
+                      (strcasecmp (argv [1], "json") == 0))) {
+    print_summary (strcasecmp (argv [1], "json") == 0);
+    return 0;
+  }
+  pcache_init_messages ();
   int do_print_mids = 0;
   int do_print_acks = 0;
   int do_print_traces = 0;
@@ -10,6 +10,8 @@
 
    since acks aren't acked, they are removed when they are replaced by
    a new ack that hashes to the same location
+
+   all these functions may be called concurrently from different threads.
  */
 
 #ifndef PACKET_CACHE_H
@@ -60,6 +62,37 @@ extern struct pcache_result
                   int nbits, const unsigned char * addr, int max,
                   char * buffer, int bsize);
 
+/* called by pcache_request_each for each message.  The message is in
+   the cache itself, and only valid until the function returns.
+   Return 1 to accept the message, or 0 to end the request, in which case
+   the message is not counted, and not marked as sent to the token. */
+typedef int (* pcache_message_fun) (const char * message, int msize,
+                                    int priority, void * ref);
+
+/* like pcache_request, but without a buffer: gives the same messages,
+   in the same order, one at a time to f, until f returns 0 or max
+   messages have been accepted.  Returns the number accepted.
+   f is called while the cache is locked, so f must not call
+   pcache_save_packet, pcache_request, pcache_request_each, or pcache_write
+ */
+extern int pcache_request_each (const struct allnet_data_request *req,
+                                int rlen, int nbits,
+                                const unsigned char * addr, int max,
+                                pcache_message_fun f, void * ref);
+
+/* replaces any summary at the end of the data request (see packet.h)
+   with a summary of the max_ids messages most recently saved in the cache
+   (at most PCACHE_RECENT_IDS, in pcache.c), or removes the summary if
+   max_ids is 0.  req has rlen bytes and room
+   for rmax bytes.  Returns the new size of the request. */
+extern int pcache_request_summary (struct allnet_data_request * req, int rlen,
+                                   int rmax, int max_ids);
+
+/* use ~/.allnet/name for the cache files rather than ~/.allnet/acache,
+   e.g. so several processes can each have their own cache.  Must be
+   called before any other pcache function, and name must remain valid */
+extern void pcache_set_directory (const char * name);
+
 /* acks */
 
 /* each ack has size MESSAGE_ID_SIZE */
@@ -0,0 +1,284 @@
+/* pcache_bench.c: measure the throughput and latency of pcache operations */
+/* command line:
+   pcache_bench [-d dir] [-m messages] [-a acks] [-n lookups] [-s size]
+     -d gives the directory for the cache files (default, a new directory
+        in /tmp, which is removed at the end)
+     -m the number of messages to save (default 20000)
+     -a the number of acks to save (default 20000)
+     -n the number of lookups and requests to time (default 100000)
+     -s the largest message data size, in bytes (default 500).  Sizes
+        are random between 1 and this
+   the cache is filled with random messages and acks, then each operation
+   is timed.  For each operation, prints the number of calls, the calls
+   per second, and the 50th, 90th, and 99th percentiles and the maximum
+   of the latency, in microseconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "packet.h"
+#include "pcache.h"
+#include "util.h"
+#include "configfiles.h"
+#include "priority.h"
+
+static unsigned long long int now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_ull (const void * a, const void * b)
+{
+  unsigned long long int x = * ((const unsigned long long int *) a);
+  unsigned long long int y = * ((const unsigned long long int *) b);
+  return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+/* sorts the latencies, then prints the summary */
+static void print_times (const char * name, unsigned long long int * ns,
+                         int count, unsigned long long int total_ns)
+{
+  if (count <= 0) {
+    printf ("%-24s %10d\n", name, 0);
+    return;
+  }
+  qsort (ns, count, sizeof (unsigned long long int), compare_ull);
+  double rate = ((total_ns == 0) ? 0.0 : (count * 1.0e9 / total_ns));
+  printf ("%-24s %10d %12.0f %9.2f %9.2f %9.2f %10.2f\n", name, count, rate,
+          ns [count / 2] / 1000.0, ns [(count * 9) / 10] / 1000.0,
+          ns [(count * 99) / 100] / 1000.0, ns [count - 1] / 1000.0);
+}
+
+/* returns a new data message with random addresses and contents */
+static struct allnet_header * random_message (int max_size,
+                                              unsigned int * msize)
+{
+  unsigned char source [ADDRESS_SIZE];
+  unsigned char dest [ADDRESS_SIZE];
+  random_bytes ((char *) source, sizeof (source));
+  random_bytes ((char *) dest, sizeof (dest));
+  int dsize = (int) random_int (1, max_size);
+  struct allnet_header * hp =
+    create_packet (dsize, ALLNET_TYPE_DATA, 10, ALLNET_SIGTYPE_NONE,
+                   source, 16, dest, 16, NULL, NULL, msize);
+  random_bytes (((char *) hp) + ALLNET_SIZE (hp->transport), dsize);
+  return hp;
+}
+
+/* saves count messages, recording their IDs if ids is not NULL */
+static void bench_save (const char * name, int count, int max_size,
+                        char * ids, unsigned long long int * ns)
+{
+  unsigned long long int total = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    unsigned int msize = 0;
+    struct allnet_header * hp = random_message (max_size, &msize);
+    if (ids != NULL)
+      pcache_message_id ((char *) hp, msize, ids + i * MESSAGE_ID_SIZE);
+    int priority = (int) random_int (1, ALLNET_PRIORITY_MAX);
+    unsigned long long int start = now_ns ();
+    pcache_save_packet ((char *) hp, msize, priority);
+    ns [i] = now_ns () - start;
+    total += ns [i];
+    free (hp);
+  }
+  print_times (name, ns, count, total);
+}
+
+static void bench_save_acks (int count, char * acks, unsigned long long int * ns)
+{
+  unsigned long long int total = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    char * ack = acks + i * MESSAGE_ID_SIZE;
+    random_bytes (ack, MESSAGE_ID_SIZE);
+    unsigned long long int start = now_ns ();
+    pcache_save_acks (ack, 1, 5);
+    ns [i] = now_ns () - start;
+    total += ns [i];
+  }
+  print_times ("pcache_save_acks", ns, count, total);
+}
+
+/* looks up count keys, half of which (chosen at random) are known */
+static void bench_found (const char * name, int (* found) (const char * key),
+                         const char * known, int num_known, int count,
+                         unsigned long long int * ns)
+{
+  unsigned long long int total = 0;
+  int hits = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    char key [MESSAGE_ID_SIZE];
+    if ((num_known > 0) && (random_int (0, 1)))
+      memcpy (key, known + random_int (0, num_known - 1) * MESSAGE_ID_SIZE,
+              MESSAGE_ID_SIZE);
+    else
+      random_bytes (key, sizeof (key));
+    unsigned long long int start = now_ns ();
+    hits += found (key);
+    ns [i] = now_ns () - start;
+    total += ns [i];
+  }
+  char desc [100];
+  snprintf (desc, sizeof (desc), "%s (%d%%)", name,
+            ((count > 0) ? (hits * 100 / count) : 0));
+  print_times (desc, ns, count, total);
+}
+
+/* each request has a new token, and a destination bitmap of 2^power_two
+ * bits with one random bit set (power_two 0 requests all messages) */
+static void bench_request (int power_two, int count, char * buffer, int bsize,
+                           unsigned long long int * ns)
+{
+  char request [sizeof (struct allnet_data_request) + 512 * 8];
+  int bitmap_size = ((power_two > 3) ? ((1 << power_two) / 8) : 1);
+  int rlen = (int) sizeof (struct allnet_data_request) +
+             ((power_two > 0) ? bitmap_size : 0);
+  struct allnet_data_request * req = (struct allnet_data_request *) request;
+  unsigned long long int total = 0;
+  unsigned long long int messages = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    memset (request, 0, sizeof (request));
+    random_bytes ((char *) (req->token), sizeof (req->token));
+    req->dst_bits_power_two = power_two;
+    if (power_two > 0) {
+      int bit = (int) random_int (0, (1 << power_two) - 1);
+      unsigned char * bitmap =
+        (unsigned char *) (request + sizeof (struct allnet_data_request));
+      bitmap [bit / 8] |= (0x80 >> (bit % 8));
+    }
+    unsigned long long int start = now_ns ();
+    struct pcache_result r =
+      pcache_request (req, rlen, 0, NULL, 0, buffer, bsize);
+    ns [i] = now_ns () - start;
+    total += ns [i];
+    if (r.n > 0)
+      messages += r.n;
+  }
+  char desc [100];
+  snprintf (desc, sizeof (desc), "pcache_request %d bits", 1 << power_two);
+  print_times (desc, ns, count, total);
+  printf ("%24s (%llu messages per request)\n", "",
+          ((count > 0) ? (messages / count) : 0));
+}
+
+static void bench_write (int count, int max_size, unsigned long long int * ns)
+{
+  unsigned long long int total = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    int j;   /* some changes to write */
+    for (j = 0; j < 100; j++) {
+      unsigned int msize = 0;
+      struct allnet_header * hp = random_message (max_size, &msize);
+      pcache_save_packet ((char *) hp, msize, 1);
+      free (hp);
+    }
+    unsigned long long int start = now_ns ();
+    pcache_write ();
+    ns [i] = now_ns () - start;
+    total += ns [i];
+  }
+  print_times ("pcache_write", ns, count, total);
+}
+
+static void usage (const char * program)
+{
+  printf ("usage: %s [-d dir] [-m messages] [-a acks] [-n lookups] "
+          "[-s size]\n", program);
+  exit (1);
+}
+
+static int get_arg (int argc, char ** argv, int i)
+{
+  if ((i + 1 >= argc) || (atoi (argv [i + 1]) < 0))
+    usage (argv [0]);
+  return atoi (argv [i + 1]);
+}
+
+int main (int argc, char ** argv)
+{
+  int num_messages = 20000;
+  int num_acks = 20000;
+  int num_lookups = 100000;
+  int max_size = 500;
+  char * dir = NULL;
+  int i;
+  for (i = 1; i < argc; i += 2) {
+    if ((strcmp (argv [i], "-d") == 0) && (i + 1 < argc))
+      dir = argv [i + 1];
+    else if (strcmp (argv [i], "-m") == 0)
+      num_messages = get_arg (argc, argv, i);
+    else if (strcmp (argv [i], "-a") == 0)
+      num_acks = get_arg (argc, argv, i);
+    else if (strcmp (argv [i], "-n") == 0)
+      num_lookups = get_arg (argc, argv, i);
+    else if (strcmp (argv [i], "-s") == 0)
+      max_size = get_arg (argc, argv, i);
+    else
+      usage (argv [0]);
+  }
+  if ((max_size < 1) || (max_size > ALLNET_MTU - ALLNET_HEADER_SIZE - 100))
+    max_size = 500;
+  char temp_dir [] = "/tmp/pcache-bench-XXXXXX";
+  if (dir == NULL) {
+    dir = mkdtemp (temp_dir);
+    if (dir == NULL) {
+      perror ("mkdtemp");
+      return 1;
+    }
+  }
+  set_home_directory (dir);
+  int max_count = num_messages;
+  if (num_acks > max_count)
+    max_count = num_acks;
+  if (num_lookups > max_count)
+    max_count = num_lookups;
+  unsigned long long int * ns =
+    malloc_or_fail ((max_count + 1) * sizeof (unsigned long long int),
+                    "pcache_bench times");
+  char * ids = malloc_or_fail ((num_messages + 1) * MESSAGE_ID_SIZE,
+                               "pcache_bench ids");
+  memset (ids, 0, (num_messages + 1) * MESSAGE_ID_SIZE);
+  char * acks = malloc_or_fail ((num_acks + 1) * MESSAGE_ID_SIZE,
+                                "pcache_bench acks");
+  int bsize = 1024 * 1024;
+  char * buffer = malloc_or_fail (bsize, "pcache_bench buffer");
+
+  unsigned long long int start = now_ns ();
+  pcache_id_found (ids);   /* load the cache */
+  printf ("startup took %.3fms\n", (now_ns () - start) / 1.0e6);
+  printf ("%-24s %10s %12s %9s %9s %9s %10s\n", "operation", "count",
+          "per second", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+  bench_save ("pcache_save_packet", num_messages, max_size, ids, ns);
+  bench_save_acks (num_acks, acks, ns);
+  bench_found ("pcache_id_found", pcache_id_found, ids, num_messages,
+               num_lookups, ns);
+  bench_found ("pcache_ack_found", pcache_ack_found, acks, num_acks,
+               num_lookups, ns);
+  int request_count = num_lookups / 100 + 1;
+  int power_two;
+  for (power_two = 0; power_two <= 12; power_two += 4)
+    bench_request (power_two, request_count, buffer, bsize, ns);
+  bench_write (10, max_size, ns);
+  free (buffer);
+  free (acks);
+  free (ids);
+  free (ns);
+  if (dir == temp_dir) {   /* remove the files we created */
+    char command [sizeof (temp_dir) + 100];
+    snprintf (command, sizeof (command), "rm -rf %s", temp_dir);
+    if (system (command) != 0)
+      printf ("unable to remove %s\n", temp_dir);
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "priority.h"
 
@@ -49,6 +50,54 @@ unsigned int allnet_divide (unsigned int n1, unsigned int n2)
   return divide (n1, n2);
 }
 
+/* compute_priority is called for every forwarded packet, so the factors
+ * that only depend on small integer arguments are precomputed in tables,
+ * and the fractions are combined with 64-bit multiplies and shifts.
+ * The results are the same as computing each factor separately, since
+ * the tables hold exactly the values that would be computed. */
+
+/* hops_already is 1, 2, 3, 4, or more (index 4), hops_max is 0..31,
+ * where 31 or more gives ALLNET_PRIORITY_EPSILON, as does 0 */
+#define PRIORITY_HOPS_CARRIED	5
+#define PRIORITY_HOPS_TOTAL	32
+/* the boost fraction for expiration/6 < PRIORITY_EXPIRATIONS needs no
+ * division at run time */
+#define PRIORITY_EXPIRATIONS	1024
+
+static unsigned int hops_factor [PRIORITY_HOPS_CARRIED] [PRIORITY_HOPS_TOTAL];
+static unsigned int boost_fractions [PRIORITY_EXPIRATIONS];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned int multiply (unsigned int p1, unsigned int p2)
+{
+  return (unsigned int) ((((uint64_t) p1) * ((uint64_t) p2)) >> 30);
+}
+
+static void init_tables ()
+{
+  int hc;
+  for (hc = 0; hc < PRIORITY_HOPS_CARRIED; hc++) {
+    /* For Pm and Ph 1/m heavily prioritizes short-distance traffic, and
+     * and 1 - h/m gives local traffic a slight edge */
+    unsigned int hops_carried_priority = ALLNET_ONE_HALF;
+    if (hc < 4)
+      hops_carried_priority = ALLNET_PRIORITY_MAX - ALLNET_ONE_EIGHT * hc;
+    int ht;
+    for (ht = 0; ht < PRIORITY_HOPS_TOTAL; ht++) {
+      unsigned int hops_total_priority =
+        (ht > 0) ? power_half_fraction (ht - 1)
+                 : ALLNET_PRIORITY_EPSILON;  /* illegal packet anyway */
+      if (hops_total_priority <= 0) /* multiplication is 0, make epsilon */
+        hops_total_priority = ALLNET_PRIORITY_EPSILON;
+      hops_factor [hc] [ht] =
+        multiply (hops_carried_priority, hops_total_priority);
+    }
+  }
+  int e;
+  for (e = 0; e < PRIORITY_EXPIRATIONS; e++)
+    boost_fractions [e] = ALLNET_PRIORITY_MAX / ((e <= 10) ? 10 : e);
+}
+
 /* expiration in seconds from now, or 0 for a packet that does not expire */
 unsigned int compute_priority (unsigned int size,
                                unsigned int sbits, unsigned int dbits,
@@ -57,52 +106,36 @@ unsigned int compute_priority (unsigned int size,
                                unsigned int rate_fraction,
                                unsigned int expiration, int cacheable)
 {
-  int debug = 0;
-  if (debug)
-    printf ("compute_priority (%d, %d, %d, %d, %d, %d, %d)\n",
-            size, sbits, dbits, hops_already,
-            hops_max, social_distance, rate_fraction);
   if (social_distance <= 1)
     return ALLNET_PRIORITY_FRIENDS_HIGH;
+  pthread_once (&tables_once, init_tables);
   /* compute Ps = 2^(1-social_distance).
    * So for d == 2, Ps = 0.5, for d == 3, Ps = 0.25, etc */
-  int social_priority = power_half_fraction (social_distance - 1);
-  if (debug) print_fraction (social_priority, "social");
-
-  /* For Pm and Ph 1/m heavily prioritizes short-distance traffic, and
-   * and 1 - h/m gives local traffic a slight edge */
-  int hops_carried_priority = ALLNET_ONE_HALF;
-  if (hops_already < 1)  /* should be local, but be sane anyway */
-    hops_already = 1;
-  if (hops_already <= 4)
-    hops_carried_priority =
-      ALLNET_PRIORITY_MAX - ALLNET_ONE_EIGHT * (hops_already - 1);
-  if (debug) print_fraction (hops_carried_priority, "hops_carried");
-  int hops_total_priority = 
-    (hops_max > 0) ? power_half_fraction (hops_max - 1)
-                   : ALLNET_PRIORITY_EPSILON;  /* illegal packet anyway */
-  if (hops_total_priority <= 0) /* multiplication below is 0, make epsilon */
-    hops_total_priority = ALLNET_PRIORITY_EPSILON;
-  if (debug) print_fraction (hops_total_priority, "hops_total");
+  unsigned int social_priority = power_half_fraction (social_distance - 1);
+
+  /* Pm and Ph, from the table */
+  unsigned int hc = ((hops_already < 1) ? 0 :     /* should be local */
+                     ((hops_already > PRIORITY_HOPS_CARRIED) ?
+                      (PRIORITY_HOPS_CARRIED - 1) : (hops_already - 1)));
+  unsigned int ht = ((hops_max >= PRIORITY_HOPS_TOTAL) ?
+                     (PRIORITY_HOPS_TOTAL - 1) : hops_max);
+  unsigned int hops_priority = hops_factor [hc] [ht];
 
   /* compute Pb as 1 - 2^(1-dbits).  So for dbits == 0, Pb = 1/2,
      for dbits = 1, Pb = 3/4, for dbits = 2, Pb = 7/8, etc. */
-  int bits_priority = ALLNET_PRIORITY_MAX - power_half_fraction (dbits + 1);
-  if (debug) print_fraction (bits_priority, "bits");
+  unsigned int bits_priority =
+    ALLNET_PRIORITY_MAX - power_half_fraction (dbits + 1);
 
   /* Pl = 1 - r' / r, where r' is our sending rate, and r is the maximum
    * sending rate.  rate_fraction is already r' / r */
   int rate_priority = ALLNET_PRIORITY_MAX - rate_fraction;
   if (rate_priority < ALLNET_ONE_HALF) rate_priority = ALLNET_ONE_HALF;
-  if (debug) print_fraction (rate_priority, "rate");
 
   /* combine these as 1 - (1 - Ps) * (1 - Pb * Pg * Ph * Pl) */
   int result =
-    allnet_multiply
-      (social_priority,
-       allnet_multiply (allnet_multiply (bits_priority, rate_priority),
-                        allnet_multiply (hops_carried_priority,
-                                         hops_total_priority)));
+    (int) multiply (social_priority,
+                    multiply (multiply (bits_priority, rate_priority),
+                              hops_priority));
   /* give a slight boost to packets that are not cacheable */
   if (! cacheable) {
     if (result >= ALLNET_PRIORITY_MAX - (ALLNET_PRIORITY_MAX / 10))
@@ -114,9 +147,11 @@ unsigned int compute_priority (unsigned int size,
   if (expiration > 0) {
     /* expiration within a minute or less gets maximum boost (10%), anything
      * else is inversely proportional, e.g. 2min is 5%, 3min is 3.3%, etc. */
-    unsigned int boost_fraction = ALLNET_PRIORITY_MAX /
-                                  ((expiration <= 60) ? 10 : (expiration / 6));
-    unsigned int boost = allnet_multiply (result, boost_fraction);
+    unsigned int e = expiration / 6;
+    unsigned int boost_fraction =
+      ((e < PRIORITY_EXPIRATIONS) ? boost_fractions [e]
+                                  : (ALLNET_PRIORITY_MAX / e));
+    unsigned int boost = multiply (result, boost_fraction);
 #ifdef DEBUG_PRINT
     int original_result = result;
 #endif /* DEBUG_PRINT */
@@ -129,22 +164,16 @@ unsigned int compute_priority (unsigned int size,
             expiration, boost_fraction, boost, boost, original_result, result);
 #endif /* DEBUG_PRINT */
   }
-if ((result <= 0) && (hops_max < 15) && (hops_max > 0)) debug = 1;
-  if (debug)
+  if ((result <= 0) && (hops_max < 15) && (hops_max > 0)) {
     printf ("compute_priority (%d, %d, %d, %d, %d, %d, %d, %d)\n",
             size, sbits, dbits, hops_already,
             hops_max, social_distance, rate_fraction, cacheable);
-  if (debug)
-    printf ("result %x product of %x %x %x %x %x\n",
+    printf ("result %x product of %x %x %x %x\n",
             result, social_priority, bits_priority, rate_priority,
-            hops_carried_priority, hops_total_priority);
-  if (debug)
-    printf ("result %d product of %d %d %d %d %d\n",
-            result, social_priority, bits_priority, rate_priority,
-            hops_carried_priority, hops_total_priority);
-  if (debug) print_fraction (result, "resulting priority");
-if (result <= 0) result = ALLNET_PRIORITY_EPSILON;
-  
+            hops_priority);
+    print_fraction (result, "resulting priority");
+  }
+  if (result <= 0)
+    result = ALLNET_PRIORITY_EPSILON;
   return result;
 }
-
@@ -0,0 +1,212 @@
+/* priority_bench.c: check and time compute_priority */
+/* command line:
+   priority_bench [-n calls]
+     -n the number of calls to time (default 10000000)
+   compute_priority is compared to reference_priority, the original
+   implementation which computes each factor separately, for all the
+   small values and for random values of each argument.  Any difference
+   is printed, and then the exit status is 1.
+   Then both are timed on the same random arguments, printing the
+   nanoseconds per call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "priority.h"
+#include "util.h"
+
+static unsigned long long int now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the original compute_priority, without the debugging output */
+static unsigned int reference_priority (unsigned int size,
+                                        unsigned int sbits, unsigned int dbits,
+                                        unsigned int hops_already,
+                                        unsigned int hops_max,
+                                        unsigned int social_distance,
+                                        unsigned int rate_fraction,
+                                        unsigned int expiration, int cacheable)
+{
+  if (social_distance <= 1)
+    return ALLNET_PRIORITY_FRIENDS_HIGH;
+  int social_priority = power_half_fraction (social_distance - 1);
+  int hops_carried_priority = ALLNET_ONE_HALF;
+  if (hops_already < 1)
+    hops_already = 1;
+  if (hops_already <= 4)
+    hops_carried_priority =
+      ALLNET_PRIORITY_MAX - ALLNET_ONE_EIGHT * (hops_already - 1);
+  int hops_total_priority =
+    (hops_max > 0) ? power_half_fraction (hops_max - 1)
+                   : ALLNET_PRIORITY_EPSILON;
+  if (hops_total_priority <= 0)
+    hops_total_priority = ALLNET_PRIORITY_EPSILON;
+  int bits_priority = ALLNET_PRIORITY_MAX - power_half_fraction (dbits + 1);
+  int rate_priority = ALLNET_PRIORITY_MAX - rate_fraction;
+  if (rate_priority < ALLNET_ONE_HALF) rate_priority = ALLNET_ONE_HALF;
+  int result =
+    allnet_multiply
+      (social_priority,
+       allnet_multiply (allnet_multiply (bits_priority, rate_priority),
+                        allnet_multiply (hops_carried_priority,
+                                         hops_total_priority)));
+  if (! cacheable) {
+    if (result >= ALLNET_PRIORITY_MAX - (ALLNET_PRIORITY_MAX / 10))
+      result = ALLNET_PRIORITY_MAX;
+    else
+      result += result / 10;
+  }
+  if (expiration > 0) {
+    unsigned int boost_fraction = ALLNET_PRIORITY_MAX /
+                                  ((expiration <= 60) ? 10 : (expiration / 6));
+    unsigned int boost = allnet_multiply (result, boost_fraction);
+    if (result >= ALLNET_PRIORITY_MAX - boost)
+      result = ALLNET_PRIORITY_MAX;
+    else
+      result += boost;
+  }
+  if (result <= 0) result = ALLNET_PRIORITY_EPSILON;
+  return result;
+}
+
+struct args {
+  unsigned int dbits;
+  unsigned int hops_already;
+  unsigned int hops_max;
+  unsigned int social_distance;
+  unsigned int rate_fraction;
+  unsigned int expiration;
+  int cacheable;
+};
+
+/* compute_priority prints its arguments when the product is 0 (for which
+ * it returns ALLNET_PRIORITY_EPSILON), which is not helpful here */
+static int skip_zero (struct args * a)
+{
+  return ((a->hops_max > 0) && (a->hops_max < 15) &&
+          (reference_priority (100, 16, a->dbits, a->hops_already,
+                               a->hops_max, a->social_distance,
+                               a->rate_fraction, a->expiration,
+                               a->cacheable) == ALLNET_PRIORITY_EPSILON));
+}
+
+static int check (struct args * a)
+{
+  if (skip_zero (a))
+    return 0;
+  unsigned int x = compute_priority (100, 16, a->dbits, a->hops_already,
+                                     a->hops_max, a->social_distance,
+                                     a->rate_fraction, a->expiration,
+                                     a->cacheable);
+  unsigned int y = reference_priority (100, 16, a->dbits, a->hops_already,
+                                       a->hops_max, a->social_distance,
+                                       a->rate_fraction, a->expiration,
+                                       a->cacheable);
+  if (x == y)
+    return 0;
+  printf ("mismatch for dbits %u, hops %u/%u, social %u, rate %u, "
+          "expiration %u, cacheable %d: %u, reference %u\n",
+          a->dbits, a->hops_already, a->hops_max, a->social_distance,
+          a->rate_fraction, a->expiration, a->cacheable, x, y);
+  return 1;
+}
+
+static void random_args (struct args * a)
+{
+  a->dbits = (unsigned int) random_int (0, 64);
+  a->hops_already = (unsigned int) random_int (0, 40);
+  a->hops_max = (unsigned int) random_int (0, 40);
+  a->social_distance = (unsigned int) random_int (0, 40);
+  a->rate_fraction = (unsigned int) random_int (0, ALLNET_PRIORITY_MAX + 10);
+  a->expiration = (unsigned int) random_int (0, 1000000);
+  a->cacheable = (int) random_int (0, 1);
+}
+
+/* returns the number of mismatches */
+static int compare (int count)
+{
+  static const unsigned int rates [] =
+    { 0, 1, ALLNET_ONE_QUARTER, ALLNET_ONE_HALF - 1, ALLNET_ONE_HALF,
+      ALLNET_ONE_HALF + 1, ALLNET_PRIORITY_MAX - 1, ALLNET_PRIORITY_MAX,
+      ALLNET_PRIORITY_MAX + 1 };
+  static const unsigned int expirations [] =
+    { 0, 1, 59, 60, 61, 65, 66, 120, 6143, 6144, 6150, 86400, 0xffffffff };
+  int errors = 0;
+  struct args a;
+  for (a.dbits = 0; a.dbits <= 34; a.dbits++)
+    for (a.hops_already = 0; a.hops_already <= 8; a.hops_already++)
+      for (a.hops_max = 0; a.hops_max <= 34; a.hops_max++)
+        for (a.social_distance = 0; a.social_distance <= 6;
+             a.social_distance++) {
+          unsigned int r;
+          for (r = 0; r < sizeof (rates) / sizeof (rates [0]); r++) {
+            a.rate_fraction = rates [r];
+            unsigned int e;
+            for (e = 0; e < sizeof (expirations) / sizeof (expirations [0]);
+                 e++) {
+              a.expiration = expirations [e];
+              for (a.cacheable = 0; a.cacheable <= 1; a.cacheable++)
+                errors += check (&a);
+            }
+          }
+        }
+  int i;
+  for (i = 0; i < count; i++) {
+    random_args (&a);
+    errors += check (&a);
+  }
+  return errors;
+}
+
+int main (int argc, char ** argv)
+{
+  int count = 10000000;
+  if ((argc == 3) && (strcmp (argv [1], "-n") == 0) && (atoi (argv [2]) > 0))
+    count = atoi (argv [2]);
+  else if (argc != 1) {
+    printf ("usage: %s [-n calls]\n", argv [0]);
+    return 1;
+  }
+  int errors = compare (1000000);
+  printf ("%d mismatches\n", errors);
+
+  int num_args = 4096;
+  struct args * a = malloc_or_fail (num_args * sizeof (struct args),
+                                    "priority_bench args");
+  int i;
+  for (i = 0; i < num_args; i++) {
+    do {
+      random_args (a + i);
+    } while (skip_zero (a + i));
+  }
+  unsigned long long int sum = 0;   /* so the calls are not optimized away */
+  unsigned long long int start = now_ns ();
+  for (i = 0; i < count; i++) {
+    struct args * p = a + (i % num_args);
+    sum += compute_priority (100, 16, p->dbits, p->hops_already, p->hops_max,
+                             p->social_distance, p->rate_fraction,
+                             p->expiration, p->cacheable);
+  }
+  unsigned long long int fast = now_ns () - start;
+  start = now_ns ();
+  for (i = 0; i < count; i++) {
+    struct args * p = a + (i % num_args);
+    sum -= reference_priority (100, 16, p->dbits, p->hops_already,
+                               p->hops_max, p->social_distance,
+                               p->rate_fraction, p->expiration, p->cacheable);
+  }
+  unsigned long long int slow = now_ns () - start;
+  printf ("compute_priority   %8.2fns per call\n", fast / (double) count);
+  printf ("reference_priority %8.2fns per call\n", slow / (double) count);
+  if (sum != 0)
+    printf ("error: sums differ by %llu\n", sum);
+  free (a);
+  return ((errors == 0) && (sum == 0)) ? 0 : 1;
+}
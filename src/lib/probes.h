@@ -0,0 +1,43 @@
+/* probes.h: static tracepoints along the path of each packet */
+
+#ifndef ALLNET_PROBES_H
+#define ALLNET_PROBES_H
+
+/* when built with <sys/sdt.h> (from systemtap), each ALLNET_PROBEn
+ * compiles to a single nop plus a note in the binary, so the probes
+ * cost (almost) nothing unless a tracer attaches to them, e.g.
+ *   bpftrace -e 'usdt:/usr/local/bin/allnetd:allnet:send_out { ... }'
+ *   perf probe -x /usr/local/bin/allnetd sdt_allnet:socket_read
+ * The provider is always "allnet".  Without <sys/sdt.h>, or if
+ * ALLNET_NO_PROBES is defined, the probes compile to nothing.
+ *
+ * the probes and their arguments:
+ *   socket_read (message, msize, priority)   ad received a packet
+ *   packet_validate (message, msize, valid, reason)   reason if not valid
+ *   packet_process (message, msize, process, reason)   the decision of
+ *         process_message or process_mgmt, PROCESS_PACKET_* from ad.c
+ *   send_out (message, msize, priority, max_addrs)
+ *   pcache_save (message, msize, priority, saved)
+ *   pcache_request_start (nbits, max), pcache_request_done (count)
+ *   atcp_frame_in (fd, message, msize, valid)   a frame from a peer
+ *   atcp_frame_out (fd, message, msize, sent)
+ *   xchat_packet_start (packet, psize), xchat_packet_done (psize, result)
+ *   decrypt_verify_start (esize, sig_algo),
+ *   decrypt_verify_done (esize, result)
+ */
+
+#if defined (HAVE_SYS_SDT_H) && ! defined (ALLNET_NO_PROBES)
+#include <sys/sdt.h>
+#define ALLNET_PROBE1(name, a)		DTRACE_PROBE1 (allnet, name, a)
+#define ALLNET_PROBE2(name, a, b)	DTRACE_PROBE2 (allnet, name, a, b)
+#define ALLNET_PROBE3(name, a, b, c)	DTRACE_PROBE3 (allnet, name, a, b, c)
+#define ALLNET_PROBE4(name, a, b, c, d)	\
+  DTRACE_PROBE4 (allnet, name, a, b, c, d)
+#else /* no probes */
+#define ALLNET_PROBE1(name, a)
+#define ALLNET_PROBE2(name, a, b)
+#define ALLNET_PROBE3(name, a, b, c)
+#define ALLNET_PROBE4(name, a, b, c, d)
+#endif /* HAVE_SYS_SDT_H && ! ALLNET_NO_PROBES */
+
+#endif /* ALLNET_PROBES_H */
@@ -1,29 +1,39 @@
 /* record.c: keep track of recently received packets */
 
-/* the way we keep track is to use two hash tables.  Each hash table
- * is indexed by two bytes of the hash of the packet, and records
- * the entire hash.  New hashes overwrite old hashes, but presumably
- * in different locations in the two hash tables, so in at least one
- * of the hash tables, the hash is likely to remain for a while.
- * When looking up, a match in either hash table means we have seen
- * the packet recently.
+/* the way we keep track is to use an open-addressing hash table, indexed
+ * by a keyed hash of the packet.  Each slot is one 64-bit word holding
+ * 32 bits of the hash (the fingerprint, never zero) and the time the
+ * packet was last seen, so slots are read and updated atomically, and
+ * threads can record packets concurrently without a lock.
+ * A packet is looked for in RECORD_PROBES consecutive slots.  If it is
+ * not found, it goes in the first empty slot, or else replaces the
+ * oldest of those slots (an eviction).
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "record.h"
 #include "packet.h"
+#include "util.h"
+#include "sha.h"
 
-#define ENTRIES_PER_TABLE		(64 * 1024)
+#define RECORD_PROBES	8
 
-struct hash_entry {
-  time_t last_seen;
-  unsigned int hash;
-};
+static atomic_uint_least64_t * slots = NULL;
+static unsigned int num_slots = 0;     /* a power of two */
+static char hash_key [SIPHASH_KEY_SIZE];
+static time_t epoch = 0;               /* slot times are relative to this */
+static atomic_int initialized = 0;
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static struct hash_entry hash1 [ENTRIES_PER_TABLE];
-static struct hash_entry hash2 [ENTRIES_PER_TABLE];
+static atomic_ullong num_used = 0;       /* slots that have been filled */
+static atomic_ullong num_evictions = 0;  /* recent packets overwritten */
 
 /* data must have at least ((bits + 7) / 8) bytes, and bits should be > 0 */
 int allnet_record_simple_hash_fn (char * data, unsigned int bits)
@@ -57,53 +67,42 @@ int allnet_record_simple_hash_fn (char * data, unsigned int bits)
   return result;
 }
 
-static void lr_hash_fun (char * data, unsigned int bits, unsigned int * hash,
-                         unsigned int * lindex, unsigned int * rindex)
+/* sets the number of slots, rounded up to a power of two.  Only has an
+ * effect before the first call to record_packet */
+void record_init (unsigned int entries)
 {
-  *hash = allnet_record_simple_hash_fn (data, bits);
-  int left_hash  = (((*hash) >> 16) & 0xff00) | (((*hash) >> 8) & 0xff);
-  *lindex = left_hash % ENTRIES_PER_TABLE;
-  int right_hash = (((*hash) >>  8) & 0xff00) | ( (*hash)       & 0xff);
-  *rindex = right_hash % ENTRIES_PER_TABLE;
-#ifdef DEBUG_PRINT
-  printf ("hash = %x, left %d %x, right = %d %x\n", (*hash),
-          left_hash % ENTRIES_PER_TABLE,
-          hash1 [left_hash  % ENTRIES_PER_TABLE].hash,
-          right_hash % ENTRIES_PER_TABLE,
-          hash2 [right_hash  % ENTRIES_PER_TABLE].hash);
-#endif /* DEBUG_PRINT */
-}
-
-/* returns 0 if not found, 1 or more if found */
-static unsigned int get_hash_time (struct hash_entry * entry,
-                                   unsigned int hash, time_t now)
-{
-  if ((entry->hash != hash) || (entry->last_seen == 0))
-    return 0;
-  time_t hash_time = now - entry->last_seen;
-  if (hash_time <= 0)
-    hash_time = 1;
-  return (unsigned int) hash_time;
+  if (atomic_load (&initialized))
+    return;
+  pthread_mutex_lock (&init_mutex);
+  if (! atomic_load (&initialized)) {
+    if (entries < RECORD_PROBES)
+      entries = RECORD_DEFAULT_ENTRIES;
+    unsigned int size = RECORD_PROBES;
+    while ((size < entries) && (size < (1U << 30)))
+      size *= 2;
+    slots = malloc_or_fail (size * sizeof (atomic_uint_least64_t),
+                            "record_init");
+    unsigned int i;
+    for (i = 0; i < size; i++)
+      atomic_init (slots + i, 0);
+    num_slots = size;
+    random_bytes (hash_key, sizeof (hash_key));
+    epoch = time (NULL) - 1;   /* so all slot times are at least 1 */
+    atomic_store (&initialized, 1);
+  }
+  pthread_mutex_unlock (&init_mutex);
 }
 
-static void init ()
+static uint64_t make_slot (uint32_t fingerprint, uint32_t seen)
 {
-  static int initialized = 0;
-  if (! initialized) {
-    int i;
-    for (i = 0; i < ENTRIES_PER_TABLE; i++) {
-      hash1 [i].hash = 0; hash1 [i].last_seen = 0;
-      hash2 [i].hash = 0; hash2 [i].last_seen = 0;
-    }
-    initialized = 1;
-  }
+  return (((uint64_t) fingerprint) << 32) | seen;
 }
 
 /* return 0 if this is a new packet, and the number of seconds (at least 1)
  * since it has been seen, if it has been seen before on this connection */
 unsigned int record_packet (char * packet, unsigned int psize)
 {
-  init ();
+  record_init (RECORD_DEFAULT_ENTRIES);
 
   if ((packet == NULL) || (psize < ALLNET_HEADER_SIZE))
     return 1;    /* do not forward */
@@ -113,25 +112,63 @@ unsigned int record_packet (char * packet, unsigned int psize)
   if (psize < (unsigned int) offset)
     return 1;   /* should never happen */
 
-  unsigned int hash, left_index, right_index;
-  lr_hash_fun (packet + offset, (psize - (unsigned int)offset) * 8,
-               &hash, &left_index, &right_index);
-  time_t now = time (NULL);
-  unsigned int left_time  = get_hash_time (hash1 + left_index , hash, now);
-  unsigned int right_time = get_hash_time (hash2 + right_index, hash, now);
-
-  /* store into both hash tables */
-  hash1 [left_index].hash = hash;
-  hash1 [left_index].last_seen = now;
-  hash2 [right_index].hash = hash;
-  hash2 [right_index].last_seen = now;
-
-  if (left_time  == 0)
-    return right_time;
-  if (right_time == 0)
-    return left_time;
-  if (left_time > right_time)
-    return right_time;  /* return lesser time */
-  return left_time;
+  uint64_t hash = siphash24 (packet + offset, (int) (psize - offset),
+                             hash_key);
+  uint32_t fingerprint = (uint32_t) (hash >> 32);
+  if (fingerprint == 0)
+    fingerprint = 1;   /* zero marks an empty slot */
+  uint32_t now = (uint32_t) (time (NULL) - epoch);
+  uint64_t new_slot = make_slot (fingerprint, now);
+  unsigned int first = (unsigned int) (hash & (num_slots - 1));
+  while (1) {   /* repeat if another thread changed a slot we chose */
+    atomic_uint_least64_t * empty = NULL;
+    atomic_uint_least64_t * oldest = NULL;
+    uint64_t oldest_value = 0;
+    int i;
+    for (i = 0; i < RECORD_PROBES; i++) {
+      atomic_uint_least64_t * p = slots + ((first + i) & (num_slots - 1));
+      uint64_t value = atomic_load_explicit (p, memory_order_relaxed);
+      if (value == 0) {
+        if (empty == NULL)
+          empty = p;
+        continue;
+      }
+      if ((uint32_t) (value >> 32) == fingerprint) {   /* seen before */
+        uint32_t seen = (uint32_t) value;
+        if ((seen < now) &&
+            (! atomic_compare_exchange_strong (p, &value, new_slot)))
+          continue;  /* someone else updated it, they saved the time */
+        return (seen < now) ? (now - seen) : 1;
+      }
+      if ((oldest == NULL) || ((uint32_t) value < (uint32_t) oldest_value)) {
+        oldest = p;
+        oldest_value = value;
+      }
+    }
+    if (empty != NULL) {
+      uint64_t expected = 0;
+      if (atomic_compare_exchange_strong (empty, &expected, new_slot)) {
+        atomic_fetch_add (&num_used, 1);
+        return 0;
+      }
+    } else if (atomic_compare_exchange_strong (oldest, &oldest_value,
+                                               new_slot)) {
+      atomic_fetch_add (&num_evictions, 1);
+      return 0;
+    }
+  }
 }
 
+/* for sizing the table: fills in the number of slots, how many have been
+ * used, and how many recorded packets have been overwritten by others */
+void record_stats (unsigned long long int * entries,
+                   unsigned long long int * used,
+                   unsigned long long int * evictions)
+{
+  if (entries != NULL)
+    *entries = num_slots;
+  if (used != NULL)
+    *used = atomic_load (&num_used);
+  if (evictions != NULL)
+    *evictions = atomic_load (&num_evictions);
+}
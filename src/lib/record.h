@@ -3,10 +3,25 @@
 #ifndef RECORD_H
 #define RECORD_H
 
+/* the number of packets remembered, unless record_init is called */
+#define RECORD_DEFAULT_ENTRIES	(256 * 1024)
+
+/* sets the number of packets remembered, rounded up to a power of two.
+ * Only has an effect before the first call to record_packet */
+extern void record_init (unsigned int entries);
+
 /* return 0 if this is a new packet, and the number of seconds (at least 1)
- * since it has been seen, if it has been seen before */
+ * since it has been seen, if it has been seen before.
+ * May be called from multiple threads at the same time */
 extern unsigned int record_packet (char * packet, unsigned int psize);
 
+/* for sizing the table: fills in (for each that is not NULL) the number
+ * of entries, how many have been used, and how many recorded packets
+ * have been overwritten by others before being seen again */
+extern void record_stats (unsigned long long int * entries,
+                          unsigned long long int * used,
+                          unsigned long long int * evictions);
+
 /* possibly useful elsewhere. */
 /* data must have at least ((bits + 7) / 8) bytes, and bits should be > 0 */
 extern int allnet_record_simple_hash_fn (char * data, unsigned int bits);
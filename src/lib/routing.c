@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <sys/types.h>
@@ -35,14 +36,349 @@ struct peer_info {
 
 struct peer_info peers [MAX_PEERS];
 
-/* for now use a fixed-size array of addr_infos to store the ping list. */
-/* addresses are added at the front and dropped from the back */
+/* the ping list is kept in the slots of a fixed-size array.  The slots
+ * in use are linked from the newest to the oldest address, so adding or
+ * refreshing an address moves it to the front, and when the list is full
+ * the oldest address is dropped.  A hash on the destination finds the
+ * slot of an address, so adds, deletes, and lookups take constant time */
+#ifndef MAX_PINGS
 #define MAX_PINGS	128
+#endif /* MAX_PINGS */
+#define PING_HASH	(2 * MAX_PINGS)
 
 static struct peer_info pings [MAX_PINGS];
+static int ping_newer [MAX_PINGS];     /* -1 for the newest */
+static int ping_older [MAX_PINGS];     /* -1 for the oldest, or the next free */
+static int ping_hash_next [MAX_PINGS]; /* -1 at the end of each chain */
+static int ping_hash [PING_HASH];
+static int ping_newest = -1;
+static int ping_oldest = -1;
+static int ping_free = -1;
+
+/* the peers are found by IP and by destination through hashes that are
+ * rebuilt when needed.  The lookups skip entries with nbits 0, so deleting
+ * a peer does not change the hashes, but any code that adds or moves
+ * peers must set peers_index_valid to 0.  All protected by the mutex */
+#define PEER_HASH	(2 * MAX_PEERS)
+static int peer_ip_hash [PEER_HASH];
+static int peer_dest_hash [PEER_HASH];
+static int peer_ip_next [MAX_PEERS];
+static int peer_dest_next [MAX_PEERS];
+static int peers_index_valid = 0;
 
 static char my_address [ADDRESS_SIZE] = {0, 0, 0, 0, 0, 0, 0, 0};
 
+/* binary tries over the ADDRESS_BITS of the destinations in peers and in
+ * pings, so lookups take time proportional to ADDRESS_BITS rather than to
+ * the number of entries.  Each leaf lists, in index order, the entries
+ * with that destination (the same destination may be listed with both
+ * IPv4 and IPv6).  The tries are only built for snapshots, below */
+#define TRIE_MAX_ENTRIES	((MAX_PEERS > MAX_PINGS) ? MAX_PEERS : MAX_PINGS)
+
+struct trie_node {
+  int child [2];     /* node indices, or -1 */
+  int first;         /* for leaves, the first entry with this address */
+};
+
+struct trie {
+  struct trie_node * nodes;   /* nodes [0] is the root */
+  int num_nodes;
+  int max_nodes;
+  int next [TRIE_MAX_ENTRIES]; /* next entry with the same address, or -1 */
+};
+
+static int addr_bit (const unsigned char * addr, int pos)
+{
+  return (addr [pos / 8] >> (7 - (pos % 8))) & 1;
+}
+
+static int trie_new_node (struct trie * t)
+{
+  if (t->num_nodes >= t->max_nodes) {
+    int new_max = ((t->max_nodes == 0) ? 1024 : (t->max_nodes * 2));
+    struct trie_node * new =
+      realloc (t->nodes, new_max * sizeof (struct trie_node));
+    if (new == NULL) {
+      printf ("routing.c trie_new_node: unable to realloc %d nodes\n",
+              new_max);
+      exit (1);
+    }
+    allnet_memory_account (ALLNET_MEMORY_ROUTING,
+                           (new_max - t->max_nodes) * sizeof (struct trie_node));
+    t->nodes = new;
+    t->max_nodes = new_max;
+  }
+  int n = t->num_nodes++;
+  t->nodes [n].child [0] = -1;
+  t->nodes [n].child [1] = -1;
+  t->nodes [n].first = -1;
+  return n;
+}
+
+static void trie_build (struct trie * t, struct peer_info * ds, int max)
+{
+  t->num_nodes = 0;
+  trie_new_node (t);   /* the root */
+  int i;
+  for (i = max - 1; i >= 0; i--) {  /* so each leaf list is in index order */
+    t->next [i] = -1;
+    if (ds [i].ai.nbits == 0)
+      continue;
+    int node = 0;
+    int bit;
+    for (bit = 0; bit < ADDRESS_BITS; bit++) {
+      int b = addr_bit (ds [i].ai.destination, bit);
+      if (t->nodes [node].child [b] < 0) {
+        int new = trie_new_node (t);  /* may move t->nodes */
+        t->nodes [node].child [b] = new;
+      }
+      node = t->nodes [node].child [b];
+    }
+    t->next [i] = t->nodes [node].first;
+    t->nodes [node].first = i;
+  }
+}
+
+/* returns the node reached by following the first nbits of addr, or -1 */
+static int trie_find (struct trie * t, const unsigned char * addr, int nbits)
+{
+  int node = 0;
+  int bit;
+  for (bit = 0; (node >= 0) && (bit < nbits); bit++)
+    node = t->nodes [node].child [addr_bit (addr, bit)];
+  return node;
+}
+
+static int routing_hash (const void * data, int size, int range)
+{
+  unsigned int hash = 2166136261U;   /* FNV-1a */
+  const unsigned char * p = (const unsigned char *) data;
+  int i;
+  for (i = 0; i < size; i++)
+    hash = (hash ^ p [i]) * 16777619U;
+  return (int) (hash % range);
+}
+
+/* the functions from here to routing_ping_iterator are always called with
+ * the lock held */
+static void ping_unlink (int slot)
+{
+  if (ping_newer [slot] >= 0)
+    ping_older [ping_newer [slot]] = ping_older [slot];
+  else
+    ping_newest = ping_older [slot];
+  if (ping_older [slot] >= 0)
+    ping_newer [ping_older [slot]] = ping_newer [slot];
+  else
+    ping_oldest = ping_newer [slot];
+}
+
+static void ping_link_newest (int slot)
+{
+  ping_newer [slot] = -1;
+  ping_older [slot] = ping_newest;
+  if (ping_newest >= 0)
+    ping_newer [ping_newest] = slot;
+  else
+    ping_oldest = slot;
+  ping_newest = slot;
+}
+
+static void ping_link_oldest (int slot)
+{
+  ping_older [slot] = -1;
+  ping_newer [slot] = ping_oldest;
+  if (ping_oldest >= 0)
+    ping_older [ping_oldest] = slot;
+  else
+    ping_newest = slot;
+  ping_oldest = slot;
+}
+
+static void ping_hash_add (int slot)
+{
+  int * chain =
+    ping_hash + routing_hash (pings [slot].ai.destination, ADDRESS_SIZE,
+                              PING_HASH);
+  ping_hash_next [slot] = *chain;
+  *chain = slot;
+}
+
+static void ping_remove (int slot)
+{
+  int * p = ping_hash + routing_hash (pings [slot].ai.destination,
+                                      ADDRESS_SIZE, PING_HASH);
+  while ((*p >= 0) && (*p != slot))
+    p = ping_hash_next + *p;
+  if (*p == slot)
+    *p = ping_hash_next [slot];
+  ping_unlink (slot);
+  pings [slot].ai.nbits = 0;
+  pings [slot].refreshed = 0;
+  ping_older [slot] = ping_free;
+  ping_free = slot;
+}
+
+/* returns -1 if not found, the slot if found */
+static int find_ping (const struct addr_info * addr)
+{
+  int slot = ping_hash [routing_hash (addr->destination, ADDRESS_SIZE,
+                                      PING_HASH)];
+  while ((slot >= 0) &&
+         (memcmp (pings [slot].ai.destination, addr->destination,
+                  ADDRESS_SIZE) != 0))
+    slot = ping_hash_next [slot];
+  return slot;
+}
+
+/* rebuilds the list, the hash, and the free slots after pings has been
+ * loaded, with lower indices newer.  Later duplicates are dropped */
+static void pings_index_rebuild ()
+{
+  int i;
+  for (i = 0; i < PING_HASH; i++)
+    ping_hash [i] = -1;
+  ping_newest = -1;
+  ping_oldest = -1;
+  ping_free = -1;
+  for (i = MAX_PINGS - 1; i >= 0; i--) {
+    if (pings [i].ai.nbits == 0) {
+      ping_older [i] = ping_free;
+      ping_free = i;
+    }
+  }
+  for (i = 0; i < MAX_PINGS; i++) {
+    if (pings [i].ai.nbits > 0) {
+      if (find_ping (&(pings [i].ai)) >= 0) {
+        pings [i].ai.nbits = 0;
+        pings [i].refreshed = 0;
+        ping_older [i] = ping_free;
+        ping_free = i;
+      } else {
+        ping_hash_add (i);
+        ping_link_oldest (i);
+      }
+    }
+  }
+}
+
+static void peers_index_build ()
+{
+  if (peers_index_valid)
+    return;
+  int i;
+  for (i = 0; i < PEER_HASH; i++) {
+    peer_ip_hash [i] = -1;
+    peer_dest_hash [i] = -1;
+  }
+  for (i = MAX_PEERS - 1; i >= 0; i--) {  /* so each chain is in index order */
+    if (peers [i].ai.nbits > 0) {
+      int h = routing_hash (&(peers [i].ai.ip.ip), sizeof (peers [i].ai.ip.ip),
+                            PEER_HASH);
+      peer_ip_next [i] = peer_ip_hash [h];
+      peer_ip_hash [h] = i;
+      h = routing_hash (peers [i].ai.destination, ADDRESS_SIZE, PEER_HASH);
+      peer_dest_next [i] = peer_dest_hash [h];
+      peer_dest_hash [h] = i;
+    }
+  }
+  peers_index_valid = 1;
+}
+
+/* routing_top_dht_matches is called for every packet we forward, so it
+ * and the exact matches never take the mutex.  Instead they read an
+ * immutable snapshot of peers, pings, and my_address.  Writers change
+ * the arrays with the mutex held, set snapshot_changed, and call
+ * publish_snapshot, which builds a new snapshot, swaps the pointer, waits
+ * until no reader can still be using the old snapshot, and frees it.
+ * Readers count themselves in snapshot_readers [snapshot_epoch % 2] */
+struct routing_snapshot {
+  unsigned char my_address [ADDRESS_SIZE];
+  struct peer_info peers [MAX_PEERS];
+  struct peer_info pings [MAX_PINGS];
+  struct trie peer_trie;
+  struct trie ping_trie;
+};
+
+static _Atomic (struct routing_snapshot *) snapshot = NULL;
+static atomic_uint snapshot_epoch = 0;
+static atomic_int snapshot_readers [2];
+static int snapshot_changed = 1;   /* protected by the mutex */
+/* when readers should next check for a changed peers file, 0 before init */
+static atomic_ullong snapshot_next_check = 0;
+
+/* waits until every reader that might have the previous snapshot is done.
+ * A reader may read the epoch just before it changes and count itself
+ * just after, so wait for the readers of each epoch in turn */
+static void snapshot_synchronize ()
+{
+  int i;
+  for (i = 0; i < 2; i++) {
+    int old = atomic_fetch_add (&snapshot_epoch, 1) % 2;
+    while (atomic_load (snapshot_readers + old) > 0)
+      usleep (10);
+  }
+}
+
+/* always called with lock held */
+static void publish_snapshot ()
+{
+  struct routing_snapshot * old = atomic_load (&snapshot);
+  if ((old != NULL) && (! snapshot_changed))
+    return;
+  struct routing_snapshot * new =
+    malloc_tagged (sizeof (struct routing_snapshot), ALLNET_MEMORY_ROUTING,
+                   "routing snapshot");
+  memset (new, 0, sizeof (struct routing_snapshot));
+  memcpy (new->my_address, my_address, ADDRESS_SIZE);
+  memcpy (new->peers, peers, sizeof (peers));
+  memcpy (new->pings, pings, sizeof (pings));
+  trie_build (&(new->peer_trie), new->peers, MAX_PEERS);
+  trie_build (&(new->ping_trie), new->pings, MAX_PINGS);
+  atomic_store (&snapshot, new);
+  snapshot_changed = 0;
+  if (old != NULL) {
+    snapshot_synchronize ();
+    allnet_memory_account (ALLNET_MEMORY_ROUTING,
+                           - (long long int) ((old->peer_trie.max_nodes +
+                                               old->ping_trie.max_nodes) *
+                                              sizeof (struct trie_node)));
+    free (old->peer_trie.nodes);
+    free (old->ping_trie.nodes);
+    free_tagged (old);
+  }
+}
+
+static int init_peers (int check_only, int always_read_from_file);
+
+/* returns the current snapshot.  The caller must call snapshot_release
+ * with the same index when done with the snapshot */
+static struct routing_snapshot * snapshot_acquire (int * index)
+{
+  unsigned long long int check = atomic_load (&snapshot_next_check);
+  int locked = 0;
+  if (check == 0) {   /* not initialized, wait for the lock */
+    pthread_mutex_lock (&mutex);
+    locked = 1;
+  } else if (allnet_time () >= check) {  /* about once a second */
+    locked = (pthread_mutex_trylock (&mutex) == 0);
+  }
+  if (locked) {       /* reload the peers file if it has changed */
+    init_peers (0, 0);
+    publish_snapshot ();
+    atomic_store (&snapshot_next_check, allnet_time () + 1);
+    pthread_mutex_unlock (&mutex);
+  }
+  *index = atomic_load (&snapshot_epoch) % 2;
+  atomic_fetch_add (snapshot_readers + *index, 1);
+  return atomic_load (&snapshot);
+}
+
+static void snapshot_release (int index)
+{
+  atomic_fetch_sub (snapshot_readers + index, 1);
+}
+
 /* some of these domain names may not be defined, but at least some should be */
 /* in case DNS is broken, we include the current IPv4 address for alnt.org */
 static const char * default_dns [] =
@@ -129,19 +465,16 @@ void print_ping_list (int fd)
   }
   if (fd == 0)
     fd = STDOUT_FILENO;
-  int i, n;
+  int i, n, slot;
   int count = 0;
-  for (i = 0; i < MAX_PINGS; i++)
-    if (pings [i].ai.nbits > 0)
-      count++;
+  for (slot = ping_newest; slot >= 0; slot = ping_older [slot])
+    count++;
   snprintf (alog->b, alog->s, "pings: %d\n", count);
   if (fd < 0) log_print (alog); else dprintf (fd, "%s", alog->b);
-  for (i = 0; i < MAX_PINGS; i++) {
-    if (pings [i].ai.nbits > 0) {
-      n = snprintf (alog->b, alog->s, "%3d (%d): ", i, pings [i].refreshed);
-      addr_info_to_string (&(pings [i].ai), alog->b + n, alog->s - n);
-      if (fd < 0) log_print (alog); else dprintf (fd, "%s", alog->b);
-    }
+  for (i = 0, slot = ping_newest; slot >= 0; i++, slot = ping_older [slot]) {
+    n = snprintf (alog->b, alog->s, "%3d (%d): ", i, pings [slot].refreshed);
+    addr_info_to_string (&(pings [slot].ai), alog->b + n, alog->s - n);
+    if (fd < 0) log_print (alog); else dprintf (fd, "%s", alog->b);
   }
 }
 
@@ -252,26 +585,183 @@ static void routing_add_dht_sockaddr (const char * name, int id, int valid,
 
 static time_t peers_file_time = 0;
 
-static int entry_to_file (int fd, struct addr_info * entry, int index,
-                          const char * caller)
+/* appends the entry as a line of text to buf, returns the number of
+ * characters added, or 0 if the entry is not saved */
+static int entry_to_buffer (char * buf, int bsize, struct addr_info * entry,
+                            int index, const char * caller)
 {
   if (! sane_addr_info (entry, caller)) /* don't save insane entries */
     return 0;
-  char line [300];
-  char buf [200];
+  char line [200];
   if (entry->nbits != 0) {
-    addr_info_to_string (entry, buf, sizeof (buf));
+    addr_info_to_string (entry, line, sizeof (line));
+    int n;
     if (index >= 0)
-      snprintf (line, sizeof (line), "%d: %s", index, buf);
+      n = snprintf (buf, bsize, "%d: %s", index, line);
     else
-      snprintf (line, sizeof (line), "p: %s", buf);
-    if (write (fd, line, strlen (line)) != (int) (strlen (line)))
-      perror ("write entry to peer file");
-    return 1;
+      n = snprintf (buf, bsize, "p: %s", line);
+    if ((n < 0) || (n >= bsize))
+      return 0;
+    return n;
   }
   return 0;
 }
 
+/* the peers are saved in two formats: the text file adht/peers,
+ * and the binary file adht/peers.bin, which is faster to read and is
+ * used if it is at least as recent as the text file.  peers.bin has
+ * PEERS_BINARY_MAGIC, then for each entry, 2 bytes of big-endian index
+ * (PEERS_BINARY_PING for pings) and the addr_info */
+#define PEERS_BINARY_MAGIC	"allnetpr"
+#define PEERS_BINARY_MAGIC_SIZE	8
+#define PEERS_BINARY_PING	0xffff
+#define PEERS_BINARY_RECORD	(2 + sizeof (struct addr_info))
+
+/* what save_peers writes, copied with the lock held */
+struct peers_to_save {
+  struct peer_info peers [MAX_PEERS];
+  struct peer_info pings [MAX_PINGS];
+  struct sockaddr_storage saved_ips [NUM_DEFAULTS + NUM_DEFAULTS];
+};
+
+/* writes adht/<file>.tmp, then renames it to adht/<file>, so the file
+ * is never seen partially written.  Returns 1 for success, 0 otherwise */
+static int write_config_atomically (const char * file, const char * data,
+                                    int dsize)
+{
+  char tmp [100];
+  snprintf (tmp, sizeof (tmp), "%s.tmp", file);
+  int fd = open_write_config ("adht", tmp, 1);
+  if (fd < 0)
+    return 0;
+  int result = 1;
+  ssize_t w = write (fd, data, dsize);
+  if (w != dsize) {
+    perror ("write_config_atomically write");
+    printf ("wrote %zd rather than %d bytes to %s\n", w, dsize, tmp);
+    result = 0;
+  } else if (fsync (fd) != 0) {
+    perror ("write_config_atomically fsync");
+    result = 0;
+  }
+  close (fd);
+  char * tmp_name = NULL;
+  char * name = NULL;
+  if ((result) &&
+      (config_file_name ("adht", tmp, &tmp_name, 1) > 0) &&
+      (config_file_name ("adht", file, &name, 1) > 0) &&
+      (rename (tmp_name, name) != 0)) {
+    perror ("write_config_atomically rename");
+    printf ("unable to rename %s to %s\n", tmp_name, name);
+  }
+  if (tmp_name != NULL)
+    free (tmp_name);
+  if (name != NULL)
+    free (name);
+  return result;
+}
+
+static void write_peers_files (struct peers_to_save * save)
+{
+  /* the writer thread and routing_save_peers may both write */
+  static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock (&file_mutex);
+  int tsize = (MAX_PEERS + MAX_PINGS) * 300;
+  char * text = malloc_or_fail (tsize, "write_peers_files text");
+  int bsize = PEERS_BINARY_MAGIC_SIZE +
+              (MAX_PEERS + MAX_PINGS) * PEERS_BINARY_RECORD;
+  char * binary = malloc_or_fail (bsize, "write_peers_files binary");
+  memcpy (binary, PEERS_BINARY_MAGIC, PEERS_BINARY_MAGIC_SIZE);
+  int tlen = 0;
+  int blen = PEERS_BINARY_MAGIC_SIZE;
+  int cpeer = 0;
+  int cping = 0;
+  int i;
+  for (i = 0; i < MAX_PEERS + MAX_PINGS; i++) {
+    int is_peer = (i < MAX_PEERS);
+    struct peer_info * entry =
+      ((is_peer) ? (save->peers + i) : (save->pings + (i - MAX_PEERS)));
+    if (! entry->refreshed)
+      continue;
+    int n = entry_to_buffer (text + tlen, tsize - tlen, &(entry->ai),
+                             ((is_peer) ? i : -1),
+                             ((is_peer) ? "save_peers/peer" : "save_peers/ping"));
+    if (n <= 0)
+      continue;
+    tlen += n;
+    writeb16 (binary + blen, ((is_peer) ? i : PEERS_BINARY_PING));
+    memcpy (binary + blen + 2, &(entry->ai), sizeof (struct addr_info));
+    blen += PEERS_BINARY_RECORD;
+    if (is_peer) cpeer++; else cping++;
+  }
+  /* peers.bin is written last, so it is at least as recent as peers */
+  write_config_atomically ("peers", text, tlen);
+  write_config_atomically ("peers.bin", binary, blen);
+  write_config_atomically ("saved_ips", (char *) (save->saved_ips),
+                           sizeof (save->saved_ips));
+  free (binary);
+  free (text);
+  pthread_mutex_unlock (&file_mutex);
+#ifdef DEBUG_PRINT
+  printf ("saved %d peers and %d pings\n", cpeer, cping);
+#endif /* DEBUG_PRINT */
+}
+
+/* always called with lock held */
+static void copy_peers_to_save (struct peers_to_save * save)
+{
+  memcpy (save->peers, peers, sizeof (peers));
+  memset (save->pings, 0, sizeof (save->pings));
+  int i = 0;   /* saved from newest to oldest */
+  int slot;
+  for (slot = ping_newest; slot >= 0; slot = ping_older [slot])
+    save->pings [i++] = pings [slot];
+  memcpy (save->saved_ips, saved_ips, sizeof (saved_ips));
+}
+
+/* save_peers only sets peers_dirty.  The peers_writer thread then writes
+ * all the changes made so far, waiting first for the interval since its
+ * last write, which starts at 1 second and doubles with each write up to
+ * 30 minutes.  All of these are protected by the mutex */
+static int peers_dirty = 0;
+static int peers_writing = 0;  /* load_peers must not re-read our own write */
+static int peers_writer_started = 0;
+static pthread_cond_t peers_cond = PTHREAD_COND_INITIALIZER;
+#define PEERS_WRITE_MIN	1             /* 1 second */
+#define PEERS_WRITE_MAX	(30 * 60)     /* 30 minutes */
+
+static void * peers_writer (void * arg)
+{
+  struct peers_to_save * save =
+    malloc_or_fail (sizeof (struct peers_to_save), "peers_writer");
+  time_t last_write = 0;
+  int interval = PEERS_WRITE_MIN;
+  pthread_mutex_lock (&mutex);
+  while (1) {
+    while (! peers_dirty)
+      pthread_cond_wait (&peers_cond, &mutex);
+    time_t next = last_write + interval;
+    while ((peers_dirty) && (time (NULL) < next)) {
+      struct timespec until = { next, 0 };
+      pthread_cond_timedwait (&peers_cond, &mutex, &until);
+    }
+    if (! peers_dirty)   /* routing_save_peers wrote it */
+      continue;
+    copy_peers_to_save (save);
+    peers_dirty = 0;
+    peers_writing++;
+    pthread_mutex_unlock (&mutex);
+    write_peers_files (save);
+    pthread_mutex_lock (&mutex);
+    peers_writing--;
+    peers_file_time = time (NULL);  /* no need to re-read in load_peers (1) */
+    last_write = peers_file_time;
+    interval = ((interval * 2 > PEERS_WRITE_MAX) ? PEERS_WRITE_MAX
+                                                 : (interval * 2));
+  }
+  return NULL;
+}
+
 static void save_id ()
 {
 #ifdef DEBUG_PRINT
@@ -290,6 +780,7 @@ static void save_id ()
   }
 }
 
+/* always called with lock held */
 static void save_peers ()
 {
 #ifdef DEBUG_PRINT
@@ -299,41 +790,17 @@ static void save_peers ()
 #endif /* DEBUG_PRINT */
   if (dns_init <= 0)  /* only save after we are initialized */
     return;
-  /* only save once every second to once every 30min, depending how
-   * long we've been running */
-  static unsigned long long int num_saves = 0;
-  static unsigned long long int last_saved = 0;
-  unsigned long long int min = 1 * ALLNET_US_PER_S;        /* 1 second */
-  unsigned long long int max = 30 * 60 * ALLNET_US_PER_S;  /* 30 minutes */
-  if (! time_exp_interval (&last_saved, &num_saves, min, max))
-    return;  /* don't save now */
-  int cpeer = 0;
-  int cping = 0;
-  int fd = open_write_config ("adht", "peers", 0);
-  int i;
-  for (i = 0; i < MAX_PEERS; i++) {
-    if (peers [i].refreshed)
-      cpeer += entry_to_file (fd, &(peers [i].ai), i, "save_peers/peer");
-  }
-  for (i = 0; i < MAX_PINGS; i++) {
-    if (pings [i].refreshed)
-      cping += entry_to_file (fd, &(pings [i].ai), -1, "save_peers/ping");
-  }
-  close (fd);
-  peers_file_time = time (NULL);  /* no need to re-read in load_peers (1) */
-  int fdi = open_write_config ("adht", "saved_ips", 0);
-  if (fdi >= 0) {
-    ssize_t w = write (fdi, saved_ips, sizeof (saved_ips));
-    if (w != sizeof (saved_ips)) {
-      perror ("writing saved_ips");
-      printf ("wrote %zd rather than %zd\n", w, sizeof (saved_ips));
+  peers_dirty = 1;
+  if (! peers_writer_started) {
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, peers_writer, NULL) != 0) {
+      perror ("save_peers pthread_create");
+      return;   /* try again on the next call */
     }
-    close (fdi);
+    pthread_detach (thread);
+    peers_writer_started = 1;
   }
-#ifdef DEBUG_PRINT
-  printf ("saved %d peers and %d pings, time is %ld\n",
-          cpeer, cping, peers_file_time);
-#endif /* DEBUG_PRINT */
+  pthread_cond_signal (&peers_cond);
 }
 
 /* allnet_dns takes about 4-5s and is called repeatedly,
@@ -408,7 +875,9 @@ static void * init_default_dns (void * arg)
 #endif /* DEBUG_PRINT */
   log_print (alog);
   dns_init = 1;  /* done initializing addresses from dns */
+  pthread_mutex_lock (&mutex);
   save_peers ();
+  pthread_mutex_unlock (&mutex);
 #ifdef DEBUG_PRINT
   printf ("after init, ");
   print_dht (0);
@@ -621,6 +1090,7 @@ static void read_my_id ()
   if (initialized)
     return;
   initialized = 1;
+  snapshot_changed = 1;
   char line [1000];
   int fd = open_read_config ("adht", "my_id", 0);
   if (fd < 0) {
@@ -644,8 +1114,51 @@ static void read_my_id ()
   }
 }
 
+/* returns 1 if the peers were loaded from adht/peers.bin, 0 otherwise */
+static int read_peers_binary ()
+{
+  time_t btime = config_file_mod_time ("adht", "peers.bin", 0);
+  if ((btime == 0) || (btime < config_file_mod_time ("adht", "peers", 0)))
+    return 0;   /* missing, or the text file is newer */
+  int fd = open_read_config ("adht", "peers.bin", 0);
+  if (fd < 0)
+    return 0;
+  char * data = NULL;
+  int size = read_fd_malloc (fd, &data, 0, 1, "peers.bin");
+  if ((size < PEERS_BINARY_MAGIC_SIZE) ||
+      (memcmp (data, PEERS_BINARY_MAGIC, PEERS_BINARY_MAGIC_SIZE) != 0) ||
+      (((size - PEERS_BINARY_MAGIC_SIZE) % PEERS_BINARY_RECORD) != 0)) {
+    if (data != NULL)
+      free (data);
+    return 0;
+  }
+  int ping_index = 0;
+  int off;
+  for (off = PEERS_BINARY_MAGIC_SIZE; off < size; off += PEERS_BINARY_RECORD) {
+    int index = readb16 (data + off);
+    struct addr_info ai;
+    memcpy (&ai, data + off + 2, sizeof (ai));
+    if ((ai.nbits == 0) || (ai.nbits > ADDRESS_BITS) ||
+        ((ai.ip.ip_version != 4) && (ai.ip.ip_version != 6)))
+      continue;
+    struct peer_info * entry = NULL;
+    if ((index == PEERS_BINARY_PING) && (ping_index < MAX_PINGS))
+      entry = pings + (ping_index++);
+    else if (index < MAX_PEERS)
+      entry = peers + index;
+    if (entry != NULL) {
+      entry->ai = ai;
+      entry->refreshed = 1;
+    }
+  }
+  free (data);
+  return 1;
+}
+
 static void read_peers_file ()
 {
+  if (read_peers_binary ())
+    return;
   char line [1000];
   int fd = open_read_config ("adht", "peers", 0);
   if (fd < 0)
@@ -674,15 +1187,19 @@ print_dht (0); */
 static void load_peers (int only_if_newer)
 {
   time_t mtime = config_file_mod_time ("adht", "peers", 0);
-  if ((only_if_newer) && ((mtime == 0) || (mtime <= peers_file_time)))
+  if ((only_if_newer) &&
+      ((mtime == 0) || (mtime <= peers_file_time) || (peers_writing > 0)))
     return;
   peers_file_time = mtime;
   /* an unused entry has nbits set to 0 -- might as well clear everything */
   memset ((char *) (peers), 0, sizeof (peers));
   memset ((char *) (pings), 0, sizeof (pings));
+  snapshot_changed = 1;
+  peers_index_valid = 0;
   read_saved_ips ();
   read_my_id ();
   read_peers_file ();
+  pings_index_rebuild ();
 #ifdef DEBUG_PRINT
   printf ("load_peers complete:\n");
   print_dht (0);
@@ -728,36 +1245,48 @@ void routing_my_address (unsigned char * addr)
   pthread_mutex_unlock (&mutex);
 }
 
-/* return true if the destination is closer to target than to
- * current.  Target and current are assumed to have ADDRESS_BITS
- * also returns true if the first nbits of dest match the target address
- * if nbits is 0, will always return 1 */
-static int addr_closer (const unsigned char * dest, int nbits,
-                        const unsigned char * current, unsigned char * target)
-{
-  if ((matching_bits (dest, nbits, current, ADDRESS_BITS) <
-       matching_bits (dest, nbits, target, ADDRESS_BITS)) ||
-      (matching_bits (dest, nbits, target, ADDRESS_BITS) == nbits))
-    return 1;
-  return 0;
-}
+struct dht_matches {
+  struct sockaddr_storage * result;
+  socklen_t * alen;
+  int count;
+  int max;
+};
 
-static int addr_in_list (const unsigned char * addr,
-                         const char * prev, int prev_count)
+/* adds the peers under this node of the snapshot's peer_trie, those
+ * closest to target first, until m->max are found.  Each address is
+ * added at most once */
+static void trie_matches (struct routing_snapshot * s, int node, int depth,
+                          const unsigned char * target, struct dht_matches * m)
 {
-  int i;
-  for (i = 0; i < prev_count; i++)
-    if (memcmp (addr, prev + (i * ADDRESS_SIZE), ADDRESS_SIZE) == 0)
-      return 1;
-  return 0;
+  struct trie * t = &(s->peer_trie);
+  if ((node < 0) || (m->count >= m->max))
+    return;
+  if (depth >= ADDRESS_BITS) {   /* a leaf */
+    int i;
+    for (i = t->nodes [node].first; i >= 0; i = t->next [i]) {
+      if (ai_to_sockaddr (&(s->peers [i].ai), m->result + m->count,
+                          m->alen + m->count)) {
+        m->count++;   /* a valid translation */
+        return;
+      }
+    }
+    return;
+  }
+  int b = addr_bit (target, depth);
+  trie_matches (s, t->nodes [node].child [b], depth + 1, target, m);
+  trie_matches (s, t->nodes [node].child [1 - b], depth + 1, target, m);
 }
 
 /* fills in an array of sockaddr_storage to the top internet addresses
  * (up to max_matches) for the given AllNet address.
  * returns the number of matches
  * returns zero if there are no matches */
-/* the top matches are the ones with the most matching bits, so we start
- * looking from the last row of the array. */
+/* the DHT forwarding is to include up to max_matches neighbors from
+ * the routing table, each of them closer than I am to the destination,
+ * or matching all nbits of the destination.  If my address matches m < nbits
+ * bits of dest, these are the peers matching the first m + 1 bits of dest,
+ * otherwise the peers matching the first nbits.  Either way, they are the
+ * peers under one node of peer_trie, and the closest are found first */
 int routing_top_dht_matches (const unsigned char * dest, int nbits,
                              struct sockaddr_storage * result, socklen_t * alen,
                              int max_matches)
@@ -765,40 +1294,26 @@ int routing_top_dht_matches (const unsigned char * dest, int nbits,
 /* print_buffer (dest, nbits, "routing_top_dht_matches:", (nbits + 7) / 8, 1);
 print_dht (0); */
   memset (result, 0, max_matches * sizeof (struct sockaddr_storage));
-  int peer = 0;
   if (nbits < 0)
     nbits = 0;
   if (nbits > ADDRESS_BITS)
     nbits = ADDRESS_BITS;
-  /* peers may have both IPv4 and IPv6 addresses: send to each at most once */
-  char prev_matches [1000 * ADDRESS_SIZE];
-  int prev_count = 0;
-  if (max_matches > 1000) {   /* prevent overflow of our fixed-sized array */
-    printf ("error: max_matches %d > 1000\n", max_matches);
-    max_matches = 1000;
-  }
-  pthread_mutex_lock (&mutex);
-  init_peers (0, 0);
-  int row, col;
-  for (row = ADDRESS_BITS - 1; ((peer < max_matches) && (row >= 0)); row--) {
-    for (col = 0; ((peer < max_matches) && (col < PEERS_PER_BIT)); col++) {
-      struct addr_info * ai = &(peers [row * PEERS_PER_BIT + col].ai);
-/* the DHT forwarding is to include up to max_matches neighbors from
- * the routing table, each of them closer than I am to the destination */
-      if ((ai->nbits > 0) &&
-          (addr_closer (dest, nbits, (unsigned char *) my_address,
-                        ai->destination)) &&
-          (! addr_in_list (ai->destination, prev_matches, prev_count))) {
-        if (ai_to_sockaddr (ai, result + peer, alen + peer)) {
-          peer++;   /* a valid translation */
-          memcpy (prev_matches + (prev_count * ADDRESS_SIZE),  /* add to list */
-                  ai->destination, ADDRESS_SIZE);
-          prev_count++;
-        }
-      }
-    }
-  }
-  pthread_mutex_unlock (&mutex);
+  struct dht_matches m = { result, alen, 0, max_matches };
+  int index;
+  struct routing_snapshot * s = snapshot_acquire (&index);
+  int mine = matching_bits (dest, nbits, s->my_address, ADDRESS_BITS);
+  int prefix = ((mine < nbits) ? (mine + 1) : nbits);
+  /* closeness beyond the first nbits of dest is closeness to my address */
+  unsigned char target [ADDRESS_SIZE];
+  memcpy (target, s->my_address, ADDRESS_SIZE);
+  int bit;
+  for (bit = 0; bit < nbits; bit++)
+    target [bit / 8] = (target [bit / 8] & ~(0x80 >> (bit % 8))) |
+                       (dest [bit / 8] & (0x80 >> (bit % 8)));
+  trie_matches (s, trie_find (&(s->peer_trie), target, prefix), prefix,
+                target, &m);
+  snapshot_release (index);
+  int peer = m.count;
 /* if there is room left, include the "seeds" from the DNS list */
   if (peer < max_matches)
     peer += add_default_routes (result, alen, peer, max_matches);
@@ -839,21 +1354,16 @@ static void exact_match_print (char * description, int found,
 }
 
 /* returns 1 if found (and fills in result if not NULL), otherwise returns 0 */
-static int search_data_structure (struct peer_info * ds, int max,
+static int search_data_structure (struct trie * t, struct peer_info * ds,
                                   const unsigned char * addr,
                                   struct addr_info * result)
 {
-  int found = 0;
-  int i;
-  for (i = 0; (i < max) && (found == 0); i++) {
-    if ((ds [i].ai.nbits != 0) &&
-        (memcmp (addr, ds [i].ai.destination, ADDRESS_SIZE) == 0)) {
-      found = 1;
-      if (result != NULL)
-        *result = ds [i].ai;
-    }
-  }
-  return found;
+  int node = trie_find (t, addr, ADDRESS_BITS);
+  if ((node < 0) || (t->nodes [node].first < 0))
+    return 0;
+  if (result != NULL)
+    *result = ds [t->nodes [node].first].ai;
+  return 1;
 }
 
 /* returns 1 and fills in result (if not NULL) if it finds an exact
@@ -861,23 +1371,22 @@ static int search_data_structure (struct peer_info * ds, int max,
  * otherwise returns 0.  */
 int routing_exact_match (const unsigned char * addr, struct addr_info * result)
 {
-  int found = 0;
-  pthread_mutex_lock (&mutex);
-  init_peers (0, 0);
-  found = search_data_structure (peers, MAX_PEERS, addr, result);
+  int index;
+  struct routing_snapshot * s = snapshot_acquire (&index);
+  int found = search_data_structure (&(s->peer_trie), s->peers, addr, result);
   if (! found)
-    found = search_data_structure (pings, MAX_PINGS, addr, result);
-  pthread_mutex_unlock (&mutex);
+    found = search_data_structure (&(s->ping_trie), s->pings, addr, result);
+  snapshot_release (index);
   exact_match_print ("routing_exact_match", found, addr, result);
   return found;
 }
 
 int ping_exact_match (const unsigned char * addr, struct addr_info * result)
 {
-  pthread_mutex_lock (&mutex);
-  init_peers (0, 0);
-  int found = search_data_structure (pings, MAX_PINGS, addr, result);
-  pthread_mutex_unlock (&mutex);
+  int index;
+  struct routing_snapshot * s = snapshot_acquire (&index);
+  int found = search_data_structure (&(s->ping_trie), s->pings, addr, result);
+  snapshot_release (index);
   exact_match_print ("ping_exact_match", found, addr, result);
   return found;
 }
@@ -886,11 +1395,17 @@ int ping_exact_match (const unsigned char * addr, struct addr_info * result)
 static int find_peer (struct peer_info * peers_data, int max,
                       struct addr_info * addr)
 {
+  int bits [MAX_PEERS];
+  if (max > MAX_PEERS)
+    max = MAX_PEERS;
+  if (matching_bits_array (addr->destination, ADDRESS_BITS,
+                           peers_data [0].ai.destination,
+                           sizeof (struct peer_info), ADDRESS_BITS,
+                           max, bits) < ADDRESS_BITS)
+    return -1;   /* no destination matches */
   int i;
   for (i = 0; i < max; i++) {
-    if ((peers_data [i].ai.nbits > 0) &&
-        (matches (peers_data [i].ai.destination, ADDRESS_BITS,
-                  addr->destination, ADDRESS_BITS) >= ADDRESS_BITS) &&
+    if ((peers_data [i].ai.nbits > 0) && (bits [i] >= ADDRESS_BITS) &&
   /* allow same destination if different IP version, i.e. ipv4 and ipv6 */
   /* this makes sure we don't automatically default to IPv6, and lets us
    * keep track of IPv4 addresses for DHT hosts as well as IPv6 addresses */
@@ -900,11 +1415,29 @@ static int find_peer (struct peer_info * peers_data, int max,
   return -1;
 }
 
+/* same as find_peer (peers, MAX_PEERS, addr), but using the index */
+static int find_any_peer (struct addr_info * addr)
+{
+  peers_index_build ();
+  int i = peer_dest_hash [routing_hash (addr->destination, ADDRESS_SIZE,
+                                        PEER_HASH)];
+  for ( ; i >= 0; i = peer_dest_next [i]) {
+    if ((peers [i].ai.nbits > 0) &&
+        (memcmp (peers [i].ai.destination, addr->destination,
+                 ADDRESS_SIZE) == 0) &&
+        (peers [i].ai.ip.ip_version == addr->ip.ip_version))
+      return i;
+  }
+  return -1;
+}
+
 /* returns the index of the entry with the given IP, or -1 if none found */
 static int find_ip (struct internet_addr * addr)
 {
-  int i;
-  for (i = 0; i < MAX_PEERS; i++) {
+  peers_index_build ();
+  int i = peer_ip_hash [routing_hash (&(addr->ip), sizeof (addr->ip),
+                                      PEER_HASH)];
+  for ( ; i >= 0; i = peer_ip_next [i]) {
     if ((peers [i].ai.nbits > 0) &&
         (memcmp (&(addr->ip), &(peers [i].ai.ip.ip), sizeof (addr->ip)) == 0))
       return i;
@@ -914,13 +1447,9 @@ static int find_ip (struct internet_addr * addr)
 
 static void delete_ping (struct addr_info * addr)
 {
-  int i;
-  for (i = 0; i < MAX_PINGS; i++) {
-    if ((pings [i].ai.nbits > 0) &&
-        (matches (pings [i].ai.destination, ADDRESS_BITS,
-                  addr->destination, ADDRESS_BITS) >= ADDRESS_BITS))
-      pings [i].ai.nbits = 0;  /* delete */
-  }
+  int slot;
+  while ((slot = find_ping (addr)) >= 0)
+    ping_remove (slot);
 }
 
 /* either adds or refreshes a DHT entry.
@@ -975,7 +1504,10 @@ int routing_add_dht (struct addr_info addr)
     peers [index].refreshed = 1;
     if (found < 0)   /* if it is in the ping list, delete it from there */
       delete_ping (&addr);
+    snapshot_changed = 1;
+    peers_index_valid = 0;
   }
+  publish_snapshot ();   /* before the slower save_peers */
   static unsigned long long int last_saved = 0;
   int save = result > 0;
   /* if result is zero, there are no new addresses but the order of
@@ -1077,25 +1609,11 @@ int routing_add_external (struct internet_addr ip)
   return 1;
 }
 
-/* returns -1 if not found, the index if found */
-static int find_ping (struct addr_info * addr)
-{
-  int i;
-  for (i = 0; i < MAX_PINGS; i++) {
-    if ((pings [i].ai.nbits > 0) &&
-        (matches (pings [i].ai.destination, ADDRESS_BITS,
-                  addr->destination, ADDRESS_BITS) >= ADDRESS_BITS))
-      return i;
-  } 
-  return -1;
-}
-
 /* either adds or refreshes a ping entry.
  * returns 1 for a new entry, 0 for an existing entry, -1 for an entry that
  * is already in the DHT list, and -2 for other errors */
 static int routing_add_ping_locked (struct addr_info * addr)
 {
-  int i;
   if (! sane_addr_info (addr, "routing_add_ping_locked"))
 { print_buffer (addr, sizeof (struct addr_info), "rapl: bad addr_info", 40, 1);
     return -2;
@@ -1105,7 +1623,7 @@ static int routing_add_ping_locked (struct addr_info * addr)
     print_addr_info (addr);
     return -1;
   }
-  if (find_peer (peers, MAX_PEERS, addr) >= 0) {
+  if (find_any_peer (addr) >= 0) {
 #ifdef DEBUG_PRINT
     printf ("rapl found peer, returning -1\n");
 #endif /* DEBUG_PRINT */
@@ -1117,20 +1635,25 @@ static int routing_add_ping_locked (struct addr_info * addr)
     return -1;
   } else {
     int n = find_ping (addr);
+    snapshot_changed = 1;
     if (n == -1) {   /* add to the front */
-      for (i = MAX_PINGS - 1; i > 0; i--)
-        pings [i] = pings [i - 1];
-      pings [0].ai = *addr;
-      pings [0].refreshed = 1;
+      if (ping_free < 0)   /* drop the oldest */
+        ping_remove (ping_oldest);
+      n = ping_free;
+      ping_free = ping_older [n];
+      pings [n].ai = *addr;
+      pings [n].refreshed = 1;
+      ping_hash_add (n);
+      ping_link_newest (n);
 #ifdef DEBUG_PRINT
       printf ("rapl did not find ping, returning 1\n");
 #endif /* DEBUG_PRINT */
       return 1;
-    } else {         /* move to the front */
-      for (i = n; i > 0; i--)
-        pings [i] = pings [i - 1];
-      pings [0].ai = *addr;
-      pings [0].refreshed = 1;
+    } else {         /* move to the front, same destination so same hash */
+      ping_unlink (n);
+      pings [n].ai = *addr;
+      pings [n].refreshed = 1;
+      ping_link_newest (n);
 #ifdef DEBUG_PRINT
       printf ("rapl found ping, returning 0\n");
 #endif /* DEBUG_PRINT */
@@ -1175,16 +1698,19 @@ void routing_expire_dht (struct socket_set * s)
   int changed = 0;
   int i;
   /* delete pings that haven't been refreshed */
-  for (i = 0; i < MAX_PINGS; i++) {
-    if ((pings [i].ai.nbits > 0) && (! pings [i].refreshed)) {
-      pings [i].ai.nbits = 0;
+  int slot = ping_newest;
+  while (slot >= 0) {
+    int older = ping_older [slot];
+    if (! pings [slot].refreshed) {
+      ping_remove (slot);
       changed = 1;
 #ifdef DEBUG_PRINT
       debug_ping_count++;
 #endif /* DEBUG_PRINT */
     }
     /* mark all pings as not refreshed */
-    pings [i].refreshed = 0;
+    pings [slot].refreshed = 0;
+    slot = older;
   }
   /* delete peers that haven't been refreshed (put them into the ping list) */
   for (i = 0; i < MAX_PEERS; i++) {
@@ -1206,8 +1732,11 @@ void routing_expire_dht (struct socket_set * s)
     /* mark all peers as not refreshed */
     peers [i].refreshed = 0;
   }
-  if (changed)
+  if (changed) {
+    snapshot_changed = 1;
+    publish_snapshot ();
     save_peers ();
+  }
   pthread_mutex_unlock (&mutex);
 #ifdef DEBUG_PRINT
   printf ("routing_expire_dht () finished, %s, expired %d pings, %d peers\n",
@@ -1236,11 +1765,19 @@ static struct addr_info * get_nth_peer (int n)
 int is_in_routing_table (const struct sockaddr * addr, socklen_t alen)
 {
   int result = 0;
+  if ((addr->sa_family != AF_INET) && (addr->sa_family != AF_INET6))
+    return 0;   /* peers only have IPv4 and IPv6 addresses */
+  struct internet_addr ia;
+  if (! sockaddr_to_ia (addr, alen, &ia))
+    return 0;
   pthread_mutex_lock (&mutex);
   init_peers (0, 0);
-  int i;
-  for (i = 0; i < MAX_PEERS; i++) {
-    if (peers [i].ai.nbits > 0) {
+  peers_index_build ();
+  /* only the peers with the same IP can have the same sockaddr */
+  int i = peer_ip_hash [routing_hash (&(ia.ip), sizeof (ia.ip), PEER_HASH)];
+  for ( ; i >= 0; i = peer_ip_next [i]) {
+    if ((peers [i].ai.nbits > 0) &&
+        (memcmp (&(ia.ip), &(peers [i].ai.ip.ip), sizeof (ia.ip)) == 0)) {
       struct sockaddr_storage peer;
       socklen_t plen;
       ai_to_sockaddr (&(peers [i].ai), &peer, &plen);
@@ -1300,6 +1837,7 @@ int routing_add_ping (struct addr_info * addr)
   pthread_mutex_lock (&mutex);
   init_peers (0, 0);
   int result = routing_add_ping_locked (addr);
+  publish_snapshot ();
   if (result >= 0)
     save_peers ();
   pthread_mutex_unlock (&mutex);
@@ -1309,26 +1847,34 @@ int routing_add_ping (struct addr_info * addr)
 /* when iter is zero, initializes the iterator and fills in the first
  * value, if any.  Every subsequent call should use the prior return value >= 0
  * When there are no more values to fill in, returns -1 */
+/* the pings are returned from newest to oldest.  A return value n > 0
+ * means slot n - 1 was returned.  If that slot is deleted before the
+ * next call, the iteration ends early */
 int routing_ping_iterator (int iter, struct addr_info * ai)
 {
-  if ((iter < 0) || (iter >= MAX_PINGS))
+  if ((iter < 0) || (iter > MAX_PINGS))
     return -1;
   pthread_mutex_lock (&mutex);
   init_peers (0, 0);
-  while ((iter < MAX_PINGS) && (pings [iter].ai.nbits == 0))
-    iter++;
-  if ((iter < MAX_PINGS) && (ai != NULL))
-    *ai = pings [iter].ai;
+  int slot = -1;
+  if (iter == 0)
+    slot = ping_newest;
+  else if (pings [iter - 1].ai.nbits > 0)
+    slot = ping_older [iter - 1];
+  struct addr_info copy;
+  if (slot >= 0)
+    copy = pings [slot].ai;
   pthread_mutex_unlock (&mutex);
-  if (iter < MAX_PINGS) {
-    if (pings [iter].ai.nbits > ADDRESS_BITS) {
-      printf ("error: routing_ping_iterator %d/%d returning %d > %d bits\n",
-              iter, MAX_PINGS, pings [iter].ai.nbits, ADDRESS_BITS);
-      print_addr_info (&(pings [iter].ai));
-    }
-    return iter + 1;
+  if (slot < 0)
+    return -1;
+  if (copy.nbits > ADDRESS_BITS) {
+    printf ("error: routing_ping_iterator %d/%d returning %d > %d bits\n",
+            slot, MAX_PINGS, copy.nbits, ADDRESS_BITS);
+    print_addr_info (&copy);
   }
-  return -1;
+  if (ai != NULL)
+    *ai = copy;
+  return slot + 1;
 }
 
 /* returns the number of entries filled in, 0...max */
@@ -1480,12 +2026,24 @@ int routing_init_is_complete (int wait_for_init)
 /* save the peers file before shutting down */
 void routing_save_peers ()
 {
+  struct peers_to_save * save = NULL;
   pthread_mutex_lock (&mutex);
   if (! init_peers (1, 0)) {
     dns_init = 1;   /* save whatever state has accumulated so far */
-    save_peers ();
+    save = malloc_or_fail (sizeof (struct peers_to_save), "routing_save_peers");
+    copy_peers_to_save (save);
+    peers_dirty = 0;   /* written here, rather than by peers_writer */
+    peers_writing++;
   }
   pthread_mutex_unlock (&mutex);
+  if (save != NULL) {
+    write_peers_files (save);
+    free (save);
+    pthread_mutex_lock (&mutex);
+    peers_writing--;
+    peers_file_time = time (NULL);
+    pthread_mutex_unlock (&mutex);
+  }
 }
 
 /* if token is not NULL, this call fills its ALLNET_TOKEN_SIZE bytes */
@@ -0,0 +1,367 @@
+/* sendq.c: output queues for ad, sending in priority order within
+ * the rate allowed on each link */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sendq.h"
+#include "packet.h"
+#include "util.h"
+#include "ai.h"
+#include "sockets.h"
+#include "configfiles.h"
+
+#define SENDQ_MAX_LINKS		256
+#define SENDQ_HASH		64	/* a power of two */
+#define SENDQ_QUEUE_MAX		64	/* packets queued on a link */
+#define SENDQ_QUEUE_BYTES	(32 * 1024)
+
+/* tokens are kept in millionths of a byte, so that a bucket can be
+ * refilled from the elapsed microseconds without losing precision */
+#define SENDQ_SCALE		1000000LL
+
+struct sendq_packet {
+  char * message;                /* from allnet_packet_alloc */
+  int msize;
+  unsigned int priority;
+  unsigned long long int queued_us;
+};
+
+struct sendq_bucket {
+  long long int rate;            /* bytes/second, 0 for unlimited */
+  long long int burst;           /* bytes */
+  long long int tokens;          /* millionths of a byte */
+  unsigned long long int last_us;
+};
+
+struct sendq_link {
+  int in_use;
+  int sockfd;
+  struct sockaddr_storage addr;
+  socklen_t alen;
+  int hash_next;                 /* next link in the hash chain, or -1 */
+  unsigned long long int last_used_us;
+  struct sendq_bucket bucket;
+  /* sorted by decreasing priority, in the order queued for equal ones */
+  struct sendq_packet queue [SENDQ_QUEUE_MAX];
+  int count;
+  int bytes;
+};
+
+static pthread_mutex_t sendq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sendq_link links [SENDQ_MAX_LINKS];
+static int hash_chains [SENDQ_HASH];
+static int initialized = 0;
+static struct sendq_bucket total;
+static long long int link_rate = SENDQ_LINK_RATE;
+static long long int link_burst = SENDQ_LINK_BURST;
+static int next_run_link = 0;    /* sendq_run starts here, for fairness */
+
+static void bucket_init (struct sendq_bucket * b, long long int rate,
+                         long long int burst, unsigned long long int now)
+{
+  b->rate = rate;
+  b->burst = burst;
+  b->tokens = burst * SENDQ_SCALE;
+  b->last_us = now;
+}
+
+static void bucket_refill (struct sendq_bucket * b, unsigned long long int now)
+{
+  if (b->rate <= 0)
+    return;
+  if (now > b->last_us) {
+    /* the elapsed time is bounded by the time to fill the bucket,
+     * so the multiplication cannot overflow */
+    unsigned long long int delta = now - b->last_us;
+    unsigned long long int full_us = (b->burst * SENDQ_SCALE) / b->rate + 1;
+    if (delta > full_us)
+      delta = full_us;
+    b->tokens += delta * b->rate;
+    if (b->tokens > b->burst * SENDQ_SCALE)
+      b->tokens = b->burst * SENDQ_SCALE;
+  }
+  b->last_us = now;
+}
+
+/* returns 0 if size bytes may be sent now, and otherwise the number
+ * of microseconds until they may be sent */
+static unsigned long long int bucket_wait (const struct sendq_bucket * b,
+                                           int size)
+{
+  if (b->rate <= 0)
+    return 0;
+  long long int needed = size * SENDQ_SCALE;
+  if (needed > b->burst * SENDQ_SCALE)  /* larger than the bucket */
+    needed = b->burst * SENDQ_SCALE;    /* send once the bucket is full */
+  if (b->tokens >= needed)
+    return 0;
+  return (needed - b->tokens) / b->rate + 1;
+}
+
+static void bucket_take (struct sendq_bucket * b, int size)
+{
+  if (b->rate > 0)
+    b->tokens -= size * SENDQ_SCALE;  /* may go negative for large ones */
+}
+
+static long long int read_rate (const char * contents, const char * name,
+                                long long int dflt)
+{
+  if (contents == NULL)
+    return dflt;
+  size_t len = strlen (name);
+  const char * p = contents;
+  while (p != NULL) {
+    if ((strncmp (p, name, len) == 0) && ((p [len] == ' ') ||
+                                          (p [len] == '\t'))) {
+      char * end = NULL;
+      long long int value = strtoll (p + len, &end, 10);
+      if ((end != p + len) && (value >= 0))
+        return value;
+      return dflt;
+    }
+    p = strchr (p, '\n');
+    if (p != NULL)
+      p++;
+  }
+  return dflt;
+}
+
+void sendq_init (void)
+{
+  static time_t rates_time = 0;   /* when the rates file was last changed */
+  time_t mod_time = config_file_mod_time ("ad", "rates", 0);
+  if ((initialized) && (mod_time == rates_time))
+    return;
+  rates_time = mod_time;
+  char * contents = NULL;
+  if (read_config_cached ("ad", "rates", &contents, 0) <= 0)
+    contents = NULL;
+  unsigned long long int now = allnet_coarse_monotonic_us ();
+  pthread_mutex_lock (&sendq_mutex);
+  if (! initialized) {
+    int i;
+    for (i = 0; i < SENDQ_HASH; i++)
+      hash_chains [i] = -1;
+    initialized = 1;
+  }
+  link_rate = read_rate (contents, "link_rate", SENDQ_LINK_RATE);
+  link_burst = read_rate (contents, "link_burst", SENDQ_LINK_BURST);
+  long long int total_rate = read_rate (contents, "total_rate",
+                                        SENDQ_TOTAL_RATE);
+  long long int total_burst = read_rate (contents, "total_burst",
+                                         SENDQ_TOTAL_BURST);
+  if (link_burst < ALLNET_MTU)   /* must be able to send any packet */
+    link_burst = ALLNET_MTU;
+  if (total_burst < ALLNET_MTU)
+    total_burst = ALLNET_MTU;
+  bucket_init (&total, total_rate, total_burst, now);
+  int i;
+  for (i = 0; i < SENDQ_MAX_LINKS; i++)
+    if (links [i].in_use)
+      bucket_init (&(links [i].bucket), link_rate, link_burst, now);
+  pthread_mutex_unlock (&sendq_mutex);
+  if (contents != NULL)
+    free (contents);
+}
+
+static int addr_hash (const struct sockaddr_storage * addr, socklen_t alen)
+{
+  unsigned int hash = 2166136261U;   /* FNV-1a */
+  const unsigned char * p = (const unsigned char *) addr;
+  socklen_t i;
+  for (i = 0; i < alen; i++)
+    hash = (hash ^ p [i]) * 16777619U;
+  return (int) (hash & (SENDQ_HASH - 1));
+}
+
+static void link_unhash (int index)
+{
+  int * p = hash_chains + addr_hash (&(links [index].addr), links [index].alen);
+  while ((*p >= 0) && (*p != index))
+    p = &(links [*p].hash_next);
+  if (*p == index)
+    *p = links [index].hash_next;
+}
+
+/* called with sendq_mutex held.  Returns the link for this address,
+ * creating it if need be, or NULL if all links already have queued
+ * packets */
+static struct sendq_link * find_link (int sockfd,
+                                      const struct sockaddr_storage * addr,
+                                      socklen_t alen,
+                                      unsigned long long int now)
+{
+  int hash = addr_hash (addr, alen);
+  int index;
+  for (index = hash_chains [hash]; index >= 0;
+       index = links [index].hash_next) {
+    struct sendq_link * link = links + index;
+    if ((link->sockfd == sockfd) &&
+        (same_sockaddr (&(link->addr), link->alen, addr, alen)))
+      return link;
+  }
+  int free_index = -1;   /* prefer an unused link, else the oldest idle one */
+  for (index = 0; index < SENDQ_MAX_LINKS; index++) {
+    if (! links [index].in_use) {
+      free_index = index;
+      break;
+    }
+    if ((links [index].count == 0) &&
+        ((free_index < 0) ||
+         (links [index].last_used_us < links [free_index].last_used_us)))
+      free_index = index;
+  }
+  if (free_index < 0)
+    return NULL;
+  struct sendq_link * link = links + free_index;
+  if (link->in_use)
+    link_unhash (free_index);
+  link->in_use = 1;
+  link->sockfd = sockfd;
+  memcpy (&(link->addr), addr, alen);
+  link->alen = alen;
+  link->count = 0;
+  link->bytes = 0;
+  link->last_used_us = now;
+  bucket_init (&(link->bucket), link_rate, link_burst, now);
+  link->hash_next = hash_chains [hash];
+  hash_chains [hash] = free_index;
+  return link;
+}
+
+/* called with sendq_mutex held */
+static void queue_remove (struct sendq_link * link, int position)
+{
+  link->bytes -= link->queue [position].msize;
+  link->count--;
+  memmove (link->queue + position, link->queue + position + 1,
+           (link->count - position) * sizeof (struct sendq_packet));
+}
+
+/* called with sendq_mutex held */
+static void queue_expire (struct sendq_link * link, unsigned long long int now)
+{
+  int i = 0;
+  while (i < link->count) {
+    if (link->queue [i].queued_us + SENDQ_MAX_DELAY_MS * 1000 < now) {
+      allnet_packet_free (link->queue [i].message);
+      queue_remove (link, i);
+    } else {
+      i++;
+    }
+  }
+}
+
+int sendq_admit (int sockfd, const struct sockaddr_storage * addr,
+                 socklen_t alen, const char * message, int msize,
+                 unsigned int priority)
+{
+  if ((msize <= 0) || (msize > ALLNET_MTU) ||
+      (alen <= 0) || (alen > sizeof (struct sockaddr_storage)))
+    return SENDQ_SEND_NOW;
+  unsigned long long int now = allnet_coarse_monotonic_us ();
+  pthread_mutex_lock (&sendq_mutex);
+  if (! initialized) {
+    pthread_mutex_unlock (&sendq_mutex);
+    sendq_init ();
+    pthread_mutex_lock (&sendq_mutex);
+  }
+  struct sendq_link * link = find_link (sockfd, addr, alen, now);
+  if (link == NULL) {   /* every link is busy, do not hold this up */
+    pthread_mutex_unlock (&sendq_mutex);
+    return SENDQ_SEND_NOW;
+  }
+  link->last_used_us = now;
+  bucket_refill (&(link->bucket), now);
+  bucket_refill (&total, now);
+  if ((link->count == 0) && (bucket_wait (&(link->bucket), msize) == 0) &&
+      (bucket_wait (&total, msize) == 0)) {
+    bucket_take (&(link->bucket), msize);
+    bucket_take (&total, msize);
+    pthread_mutex_unlock (&sendq_mutex);
+    return SENDQ_SEND_NOW;
+  }
+  /* make room if needed, dropping the lowest priority packets */
+  while ((link->count > 0) &&
+         ((link->count >= SENDQ_QUEUE_MAX) ||
+          (link->bytes + msize > SENDQ_QUEUE_BYTES))) {
+    int last = link->count - 1;
+    if (link->queue [last].priority >= priority) {  /* drop the new one */
+      pthread_mutex_unlock (&sendq_mutex);
+      return SENDQ_DROPPED;
+    }
+    allnet_packet_free (link->queue [last].message);
+    queue_remove (link, last);
+  }
+  int position = link->count;
+  while ((position > 0) && (link->queue [position - 1].priority < priority))
+    position--;
+  memmove (link->queue + position + 1, link->queue + position,
+           (link->count - position) * sizeof (struct sendq_packet));
+  struct sendq_packet * qp = link->queue + position;
+  qp->message = allnet_packet_alloc (msize, "sendq_admit");
+  memcpy (qp->message, message, msize);
+  qp->msize = msize;
+  qp->priority = priority;
+  qp->queued_us = now;
+  link->count++;
+  link->bytes += msize;
+  pthread_mutex_unlock (&sendq_mutex);
+  return SENDQ_QUEUED;
+}
+
+int sendq_run (void)
+{
+  struct socket_send_batch batch = { .count = 0 };
+  char * sent [SOCKET_SEND_BATCH_MAX];
+  unsigned long long int now = allnet_coarse_monotonic_us ();
+  unsigned long long int wait_us = 0;  /* 0 if nothing is queued */
+  pthread_mutex_lock (&sendq_mutex);
+  bucket_refill (&total, now);
+  int i;
+  for (i = 0; (i < SENDQ_MAX_LINKS) && (batch.count < SOCKET_SEND_BATCH_MAX);
+       i++) {
+    int index = (next_run_link + i) % SENDQ_MAX_LINKS;
+    struct sendq_link * link = links + index;
+    if ((! link->in_use) || (link->count == 0))
+      continue;
+    queue_expire (link, now);
+    bucket_refill (&(link->bucket), now);
+    while ((link->count > 0) && (batch.count < SOCKET_SEND_BATCH_MAX)) {
+      struct sendq_packet * qp = link->queue;
+      unsigned long long int link_wait = bucket_wait (&(link->bucket),
+                                                      qp->msize);
+      unsigned long long int total_wait = bucket_wait (&total, qp->msize);
+      if ((link_wait > 0) || (total_wait > 0)) {
+        unsigned long long int w =
+          ((link_wait > total_wait) ? link_wait : total_wait);
+        if ((wait_us == 0) || (w < wait_us))
+          wait_us = w;
+        break;
+      }
+      bucket_take (&(link->bucket), qp->msize);
+      bucket_take (&total, qp->msize);
+      sent [batch.count] = qp->message;
+      socket_send_batch_add (&batch, link->sockfd, qp->message, qp->msize,
+                             link->addr, link->alen);
+      queue_remove (link, 0);
+    }
+  }
+  if (batch.count >= SOCKET_SEND_BATCH_MAX)  /* may be able to send more */
+    wait_us = 1;
+  next_run_link = (next_run_link + 1) % SENDQ_MAX_LINKS;
+  pthread_mutex_unlock (&sendq_mutex);
+  if (batch.count > 0) {
+    socket_send_batch_flush (&batch, "sendq_run");
+    for (i = 0; i < batch.count; i++)
+      allnet_packet_free (sent [i]);
+  }
+  if (wait_us == 0)
+    return -1;
+  return (int) ((wait_us + 999) / 1000);   /* at least 1 */
+}
@@ -0,0 +1,56 @@
+/* sendq.h: output queues for ad, sending in priority order within
+ * the rate allowed on each link */
+
+#ifndef ALLNET_SENDQ_H
+#define ALLNET_SENDQ_H
+
+#include <sys/socket.h>
+
+/* each remote address is a link, with its own token bucket and queue.
+ * A packet is sent immediately if its link has nothing queued and
+ * both the link's bucket and the total bucket have room for it.
+ * Otherwise it is queued, and sendq_run sends the queued packets in
+ * order of priority as the buckets fill.  When a link's queue is full,
+ * the lowest priority packet is dropped, which may be the new one.
+ * Packets that have been queued longer than SENDQ_MAX_DELAY_MS are
+ * dropped as well.
+ *
+ * the rates may be set in ~/.allnet/ad/rates, one per line, as a name
+ * and a number of bytes (per second for the rates):
+ *   link_rate 65536
+ *   link_burst 16384
+ *   total_rate 262144
+ *   total_burst 65536
+ * a rate of 0 means the rate is not limited. */
+
+#ifndef SENDQ_LINK_RATE
+#define SENDQ_LINK_RATE		(64 * 1024)	/* bytes/second */
+#endif /* SENDQ_LINK_RATE */
+#ifndef SENDQ_LINK_BURST
+#define SENDQ_LINK_BURST	(16 * 1024)	/* bytes */
+#endif /* SENDQ_LINK_BURST */
+#ifndef SENDQ_TOTAL_RATE
+#define SENDQ_TOTAL_RATE	(256 * 1024)	/* bytes/second */
+#endif /* SENDQ_TOTAL_RATE */
+#ifndef SENDQ_TOTAL_BURST
+#define SENDQ_TOTAL_BURST	(64 * 1024)	/* bytes */
+#endif /* SENDQ_TOTAL_BURST */
+#define SENDQ_MAX_DELAY_MS	5000
+
+/* reads the rates.  May be called periodically, and only reads the rates
+ * again if the rates file has changed */
+extern void sendq_init (void);
+
+#define SENDQ_SEND_NOW	0	/* the caller should send the packet */
+#define SENDQ_QUEUED	1	/* a copy was queued, to be sent later */
+#define SENDQ_DROPPED	2	/* not sent, the link's queue is full */
+extern int sendq_admit (int sockfd, const struct sockaddr_storage * addr,
+                        socklen_t alen, const char * message, int msize,
+                        unsigned int priority);
+
+/* sends what the rates allow of the queued packets.  Should be called
+ * often, e.g. every time around the main loop.  Returns -1 if nothing
+ * is queued, or the number of ms until more can be sent */
+extern int sendq_run (void);
+
+#endif /* ALLNET_SENDQ_H */
@@ -7,6 +7,24 @@
 #include <string.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <pthread.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#if defined (__GNUC__) && (! defined (SHA_NO_ACCELERATION))
+#define SHA_X86_SHA_NI
+#define SHA_X86_LANES
+#include <cpuid.h>
+#include <immintrin.h>
+#endif /* __GNUC__ && ! SHA_NO_ACCELERATION */
+#endif /* __x86_64__ || __i386__ */
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#ifndef HAVE_OPENSSL_ONE_ONE
+#define EVP_MD_CTX_new		EVP_MD_CTX_create
+#define EVP_MD_CTX_free		EVP_MD_CTX_destroy
+#endif /* HAVE_OPENSSL_ONE_ONE */
+#endif /* HAVE_OPENSSL */
 
 #include "sha.h"
 
@@ -28,6 +46,17 @@ typedef union uint160 {
   uint32_t i [160 / (8 * sizeof (uint32_t))];  	/* 5 words */
 } uint160;
 
+/* the fastest available implementations are selected on first use */
+typedef void (* sha1_block_fn) (const char * block, uint160 * hash);
+static void sha1_portable_block (const char * block, uint160 * hash);
+static sha1_block_fn sha1_block = sha1_portable_block;
+static void sha1_with (sha1_block_fn block_fn,
+                       const char * data, int dsize, char * result);
+static void sha512_portable (const char * input, int bytes, char * result);
+static void (* sha512_implementation) (const char * input, int bytes,
+                                       char * result) = sha512_portable;
+static void select_sha_implementations ();
+
 static const uint64_t K512 [] = {
 0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
 0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
@@ -258,16 +287,9 @@ static void compute_sha512 (const uint64_t * block,
             hash->i [4], hash->i [5], hash->i [6], hash->i [7]);
 }
 
-/* the result array must have size SHA512_SIZE */
-/* #define SHA512_SIZE	64 */
-void sha512 (const char * input, int bytes, char * result)
+static void sha512_portable (const char * input, int bytes, char * result)
 {
   int i;
-  if (bytes < 0) {
-    printf ("error in sha computation; %d (%x) bytes requested\n",
-            bytes, bytes);
-    exit (1);
-  }
   /* padding */
   unsigned int bits = bytes * 8;
   int input_blocks = bytes / SHA512_BLOCK_SIZE;
@@ -325,6 +347,19 @@ void sha512 (const char * input, int bytes, char * result)
 #endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
 }
 
+/* the result array must have size SHA512_SIZE */
+/* #define SHA512_SIZE	64 */
+void sha512 (const char * input, int bytes, char * result)
+{
+  if (bytes < 0) {
+    printf ("error in sha computation; %d (%x) bytes requested\n",
+            bytes, bytes);
+    exit (1);
+  }
+  select_sha_implementations ();
+  sha512_implementation (input, bytes, result);
+}
+
 /* the result array must have size rsize, only the first rsize bytes
  * of the hash are saved (or the hash is padded with zeros) */
 void sha512_bytes (const char * data, int dsize, char * result, int rsize)
@@ -339,6 +374,189 @@ void sha512_bytes (const char * data, int dsize, char * result, int rsize)
   }
 }
 
+#ifdef SHA_X86_LANES
+/* sha512 of up to SHA512_LANES independent inputs, each in one 64-bit
+ * lane of a vector.  The code uses the gcc vector extensions, compiled
+ * for AVX-512.  Inputs of different lengths are handled by masking the
+ * state update for inputs that are done.
+ * With AVX2 each operation takes two instructions, and this is slower
+ * than hashing each input separately, so it is only used with AVX-512 */
+#define SHA512_LANES	8
+
+typedef uint64_t sha512_vector __attribute__ ((vector_size (8 * SHA512_LANES)));
+
+#define vrotr64(n, x) (((x) >> (n)) | ((x) << (64 - (n))))
+
+struct sha512_lane {
+  const char * data;   /* NULL if this lane is not used */
+  int input_blocks;    /* the number of full blocks in data */
+  int total_blocks;    /* input_blocks plus 1 or 2 padding blocks */
+  char last [2 * SHA512_BLOCK_SIZE];  /* the padding blocks */
+};
+
+/* the padding is the same as in sha512_portable */
+static void init_lane (struct sha512_lane * lane, const char * data, int bytes)
+{
+  lane->data = data;
+  lane->input_blocks = bytes / SHA512_BLOCK_SIZE;
+  memset (lane->last, 0, sizeof (lane->last));
+  unsigned int bits = bytes * 8;
+  int last_bytes = bytes % SHA512_BLOCK_SIZE;
+  int padding = SHA512_BLOCK_SIZE - last_bytes;
+  if (last_bytes > 0)
+    memcpy (lane->last, data + (bytes - last_bytes), last_bytes);
+  lane->last [last_bytes] = 0x80;
+  int padding_blocks = ((padding < 17) ? 2 : 1);
+  write_int (lane->last + (padding_blocks * SHA512_BLOCK_SIZE - 8), bits);
+  lane->total_blocks = lane->input_blocks + padding_blocks;
+}
+
+static inline const char * lane_block (struct sha512_lane * lane, int b)
+{
+  if (b < lane->input_blocks)
+    return lane->data + b * SHA512_BLOCK_SIZE;
+  return lane->last + (b - lane->input_blocks) * SHA512_BLOCK_SIZE;
+}
+
+/* hashes the inputs in all the lanes, leaving the hashes in state */
+static inline __attribute__ ((always_inline))
+  void sha512_lanes_generic (struct sha512_lane * lanes, sha512_vector * state)
+{
+  int max_blocks = 0;
+  int l;
+  int t;
+  for (t = 0; t < 8; t++)
+    for (l = 0; l < SHA512_LANES; l++)
+      state [t] [l] = init_H512 [t];
+  for (l = 0; l < SHA512_LANES; l++)
+    if ((lanes [l].data != NULL) && (lanes [l].total_blocks > max_blocks))
+      max_blocks = lanes [l].total_blocks;
+  int b;
+  for (b = 0; b < max_blocks; b++) {
+    sha512_vector W [80];
+    sha512_vector active;   /* all ones for lanes with a block b */
+    for (l = 0; l < SHA512_LANES; l++) {
+      if ((lanes [l].data == NULL) || (b >= lanes [l].total_blocks)) {
+        active [l] = 0;
+        for (t = 0; t < 16; t++)
+          W [t] [l] = 0;
+      } else {
+        active [l] = ~((uint64_t) 0);
+        const char * block = lane_block (lanes + l, b);
+        for (t = 0; t < 16; t++)
+          W [t] [l] = read_int ((char *) (block + 8 * t));
+      }
+    }
+    for (t = 16; t < 80; t++) {
+      sha512_vector w2 = W [t - 2];
+      sha512_vector w15 = W [t - 15];
+      W [t] = (vrotr64 (19, w2) ^ vrotr64 (61, w2) ^ (w2 >> 6)) + W [t - 7] +
+              (vrotr64 (1, w15) ^ vrotr64 (8, w15) ^ (w15 >> 7)) + W [t - 16];
+    }
+    sha512_vector a = state [0];
+    sha512_vector b_ = state [1];
+    sha512_vector c = state [2];
+    sha512_vector d = state [3];
+    sha512_vector e = state [4];
+    sha512_vector f = state [5];
+    sha512_vector g = state [6];
+    sha512_vector h = state [7];
+    for (t = 0; t < 80; t++) {
+      sha512_vector t1 = h +
+        (vrotr64 (14, e) ^ vrotr64 (18, e) ^ vrotr64 (41, e)) +
+        ((e & f) ^ ((~ e) & g)) + K512 [t] + W [t];
+      sha512_vector t2 =
+        (vrotr64 (28, a) ^ vrotr64 (34, a) ^ vrotr64 (39, a)) +
+        ((a & b_) ^ (a & c) ^ (b_ & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b_;
+      b_ = a;
+      a = t1 + t2;
+    }
+    state [0] += a & active;
+    state [1] += b_ & active;
+    state [2] += c & active;
+    state [3] += d & active;
+    state [4] += e & active;
+    state [5] += f & active;
+    state [6] += g & active;
+    state [7] += h & active;
+  }
+}
+
+__attribute__ ((target ("avx512f")))
+static void sha512_lanes_avx512 (struct sha512_lane * lanes,
+                                 sha512_vector * state)
+{
+  sha512_lanes_generic (lanes, state);
+}
+
+/* NULL if the processor does not have AVX-512 */
+static void (* sha512_lanes) (struct sha512_lane * lanes,
+                              sha512_vector * state) = NULL;
+
+/* hashes count <= SHA512_LANES inputs */
+static void sha512_bytes_lanes (int count, const char ** data,
+                                const int * dsize, char ** result, int rsize)
+{
+  struct sha512_lane lanes [SHA512_LANES];
+  sha512_vector state [8];
+  int l;
+  for (l = 0; l < SHA512_LANES; l++) {
+    if (l < count)
+      init_lane (lanes + l, data [l], dsize [l]);
+    else
+      lanes [l].data = NULL;
+  }
+  sha512_lanes (lanes, state);
+  for (l = 0; l < count; l++) {
+    char sha [SHA512_SIZE];
+    int t;
+    for (t = 0; t < 8; t++)
+      write_int (sha + 8 * t, state [t] [l]);
+    if (rsize <= SHA512_SIZE) {
+      memcpy (result [l], sha, rsize);
+    } else {
+      memcpy (result [l], sha, SHA512_SIZE);
+      memset (result [l] + SHA512_SIZE, 0, rsize - SHA512_SIZE);
+    }
+  }
+}
+#endif /* SHA_X86_LANES */
+
+/* same as calling sha512_bytes (data [i], dsize [i], result [i], rsize)
+ * for each 0 <= i < count, but where the processor allows, hashes
+ * several inputs at the same time */
+void sha512_bytes_batch (int count, const char ** data, const int * dsize,
+                         char ** result, int rsize)
+{
+  int i;
+  for (i = 0; i < count; i++) {
+    if (dsize [i] < 0) {
+      printf ("error in sha computation; %d (%x) bytes requested\n",
+              dsize [i], dsize [i]);
+      exit (1);
+    }
+  }
+  select_sha_implementations ();
+  i = 0;
+#ifdef SHA_X86_LANES
+  if (sha512_lanes != NULL) {
+    while (count - i > 1) {   /* a single input is faster by itself */
+      int n = ((count - i < SHA512_LANES) ? (count - i) : SHA512_LANES);
+      sha512_bytes_lanes (n, data + i, dsize + i, result + i, rsize);
+      i += n;
+    }
+  }
+#endif /* SHA_X86_LANES */
+  for ( ; i < count; i++)
+    sha512_bytes (data [i], dsize [i], result [i], rsize);
+}
+
 static inline void
   init_w32_native_byte_order (uint32_t * W, const uint32_t * block)
 {
@@ -448,15 +666,192 @@ static void compute_sha1 (const uint32_t * block,
             hash->i [0], hash->i [1], hash->i [2], hash->i [3], hash->i [4]);
 }
 
-/* the result array must have size SHA1_SIZE */
-void sha1 (const char * data, int dsize, char * result)
+static void sha1_portable_block (const char * block, uint160 * hash)
 {
-  int i;
-  if (dsize < 0) {
-    printf ("error in sha1 computation; %d (%x) bytes requested\n",
-            dsize, dsize);
-    exit (1);
+  compute_sha1 ((const uint32_t *) block, hash, 0);
+}
+
+#ifdef SHA_X86_SHA_NI
+/* one block of sha1 using the x86 SHA extensions.  The state is kept as
+ * abcd in one vector (with a in the highest 32 bits) and e in the highest
+ * 32 bits of another, and each sha1rnds4 computes four rounds */
+__attribute__ ((target ("sha,ssse3,sse4.1")))
+static void sha1_x86_block (const char * block, uint160 * hash)
+{
+  const __m128i byte_swap =
+    _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((__m128i *) hash->i),
+                                    0x1b);
+  __m128i e0 = _mm_set_epi32 (hash->i [4], 0, 0, 0);
+  __m128i abcd_save = abcd;
+  __m128i e0_save = e0;
+  __m128i msg [4];
+  int j;
+  for (j = 0; j < 4; j++)
+    msg [j] = _mm_shuffle_epi8 (_mm_loadu_si128 ((__m128i *) (block + 16 * j)),
+                                byte_swap);
+  /* in iteration j, msg [j % 4] has W [4j..4j+3], and the next
+   * three message vectors are partly computed from it */
+  __m128i prev = abcd;   /* abcd before the previous four rounds */
+  for (j = 0; j < 20; j++) {
+    __m128i e = ((j == 0) ? _mm_add_epi32 (e0, msg [0])
+                          : _mm_sha1nexte_epu32 (prev, msg [j % 4]));
+    prev = abcd;
+    if ((j >= 3) && (j <= 18))
+      msg [(j + 1) % 4] = _mm_sha1msg2_epu32 (msg [(j + 1) % 4], msg [j % 4]);
+    switch (j / 5) {  /* the function must be a constant */
+    case 0: abcd = _mm_sha1rnds4_epu32 (abcd, e, 0); break;
+    case 1: abcd = _mm_sha1rnds4_epu32 (abcd, e, 1); break;
+    case 2: abcd = _mm_sha1rnds4_epu32 (abcd, e, 2); break;
+    default: abcd = _mm_sha1rnds4_epu32 (abcd, e, 3); break;
+    }
+    if ((j >= 1) && (j <= 16))
+      msg [(j + 3) % 4] = _mm_sha1msg1_epu32 (msg [(j + 3) % 4], msg [j % 4]);
+    if ((j >= 2) && (j <= 17))
+      msg [(j + 2) % 4] = _mm_xor_si128 (msg [(j + 2) % 4], msg [j % 4]);
+  }
+  e0 = _mm_sha1nexte_epu32 (prev, e0_save);
+  abcd = _mm_shuffle_epi32 (_mm_add_epi32 (abcd, abcd_save), 0x1b);
+  _mm_storeu_si128 ((__m128i *) hash->i, abcd);
+  hash->i [4] = (uint32_t) _mm_extract_epi32 (e0, 3);
+}
+
+static int x86_has_sha ()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  if (((ecx & bit_SSSE3) == 0) || ((ecx & bit_SSE4_1) == 0))
+    return 0;
+  if (! __get_cpuid_count (7, 0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return ((ebx & bit_SHA) != 0);
+}
+#endif /* SHA_X86_SHA_NI */
+
+#ifdef HAVE_OPENSSL
+/* openssl selects at run time among its implementations, including those
+ * for the x86 and ARMv8.2 SHA-512 instructions, and AVX2.  The one-call
+ * SHA512 () looks up the algorithm and allocates a context each time,
+ * which is slower than our own code for short inputs such as message IDs,
+ * so the algorithm is looked up once in select_once, and each thread
+ * keeps its own context */
+static const EVP_MD * sha512_md = NULL;
+static pthread_key_t sha512_ctx_key;
+
+static void sha512_ctx_free (void * arg)
+{
+  EVP_MD_CTX_free ((EVP_MD_CTX *) arg);
+}
+
+static void sha512_openssl (const char * input, int bytes, char * result)
+{
+  EVP_MD_CTX * ctx = pthread_getspecific (sha512_ctx_key);
+  if (ctx == NULL) {
+    ctx = EVP_MD_CTX_new ();
+    if ((ctx == NULL) || (pthread_setspecific (sha512_ctx_key, ctx) != 0)) {
+      if (ctx != NULL)
+        EVP_MD_CTX_free (ctx);
+      sha512_portable (input, bytes, result);
+      return;
+    }
   }
+  if ((EVP_DigestInit_ex (ctx, sha512_md, NULL) != 1) ||
+      (EVP_DigestUpdate (ctx, input, bytes) != 1) ||
+      (EVP_DigestFinal_ex (ctx, (unsigned char *) result, NULL) != 1))
+    sha512_portable (input, bytes, result);
+}
+
+/* returns 1 if sha512_openssl can be used, 0 otherwise */
+static int sha512_openssl_init ()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  sha512_md = EVP_MD_fetch (NULL, "SHA512", NULL);  /* kept until exit */
+#else /* OPENSSL_VERSION_NUMBER < 0x30000000L */
+  sha512_md = EVP_sha512 ();
+#endif /* OPENSSL_VERSION_NUMBER */
+  if (sha512_md == NULL)
+    return 0;
+  return (pthread_key_create (&sha512_ctx_key, sha512_ctx_free) == 0);
+}
+#endif /* HAVE_OPENSSL */
+
+static pthread_once_t sha_once = PTHREAD_ONCE_INIT;
+/* the fastest implementations, saved for sha_accelerated */
+static void (* sha512_fastest) (const char * input, int bytes,
+                                 char * result) = sha512_portable;
+static sha1_block_fn sha1_fastest = sha1_portable_block;
+#ifdef SHA_X86_LANES
+static void (* sha512_lanes_fastest) (struct sha512_lane * lanes,
+                                       sha512_vector * state) = NULL;
+#endif /* SHA_X86_LANES */
+
+static void select_once ()
+{
+#ifdef HAVE_OPENSSL
+  if (sha512_openssl_init ())
+    sha512_implementation = sha512_openssl;
+#endif /* HAVE_OPENSSL */
+#ifdef SHA_X86_SHA_NI
+  if (x86_has_sha ()) {   /* only use it if it gives the right answer */
+    char expected [SHA1_SIZE];
+    char result [SHA1_SIZE];
+    sha1_with (sha1_portable_block, "abc", 3, expected);
+    sha1_with (sha1_x86_block, "abc", 3, result);
+    if (memcmp (expected, result, SHA1_SIZE) == 0)
+      sha1_block = sha1_x86_block;
+  }
+#endif /* SHA_X86_SHA_NI */
+#ifdef SHA_X86_LANES
+  void (* lanes_fn) (struct sha512_lane *, sha512_vector *) = NULL;
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512f"))
+    lanes_fn = sha512_lanes_avx512;
+  if (lanes_fn != NULL) {   /* only use it if it gives the right answer */
+    struct sha512_lane lanes [SHA512_LANES];
+    sha512_vector state [8];
+    char expected [SHA512_SIZE];
+    sha512_portable ("abc", 3, expected);
+    int l;
+    for (l = 0; l < SHA512_LANES; l++)
+      init_lane (lanes + l, "abc", 3);
+    lanes_fn (lanes, state);
+    int t;
+    for (t = 0; t < 8; t++)
+      for (l = 0; l < SHA512_LANES; l++)
+        if (state [t] [l] != read_int (expected + 8 * t))
+          lanes_fn = NULL;
+    sha512_lanes = lanes_fn;
+  }
+#endif /* SHA_X86_LANES */
+  sha512_fastest = sha512_implementation;
+  sha1_fastest = sha1_block;
+#ifdef SHA_X86_LANES
+  sha512_lanes_fastest = sha512_lanes;
+#endif /* SHA_X86_LANES */
+}
+
+static void select_sha_implementations ()
+{
+  pthread_once (&sha_once, select_once);
+}
+
+/* sha_accelerated (0) switches to the portable code, and
+ * sha_accelerated (1) back to the implementations selected above */
+void sha_accelerated (int use)
+{
+  select_sha_implementations ();
+  sha512_implementation = (use ? sha512_fastest : sha512_portable);
+  sha1_block = (use ? sha1_fastest : sha1_portable_block);
+#ifdef SHA_X86_LANES
+  sha512_lanes = (use ? sha512_lanes_fastest : NULL);
+#endif /* SHA_X86_LANES */
+}
+
+static void sha1_with (sha1_block_fn block_fn,
+                       const char * data, int dsize, char * result)
+{
+  int i;
   /* padding */
   unsigned int bits = dsize * 8;
   /* number of full input blocks */
@@ -483,7 +878,7 @@ void sha1 (const char * data, int dsize, char * result)
   uint160 hash;
   memcpy (hash.c, init_H1, sizeof (init_H1));
   for (i = 0; i < input_blocks; i++) {
-    compute_sha1 (((uint32_t *) (data + SHA1_BLOCK_SIZE * i)), &hash, 0);
+    block_fn (data + SHA1_BLOCK_SIZE * i, &hash);
 #ifdef DEBUG_PRINT
     if (debugging) {
       printf ("sha1 is %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n", hash.i [0], hash.i [1], hash.i [2], hash.i [3], hash.i [4]);
@@ -491,9 +886,9 @@ void sha1 (const char * data, int dsize, char * result)
     }
 #endif /* DEBUG_PRINT */
   }
-  compute_sha1 (((uint32_t *) last1), &hash, 0);
+  block_fn (last1, &hash);
   if (padding < 9)
-    compute_sha1 (((uint32_t *) last2), &hash, 0);
+    block_fn (last2, &hash);
 #ifdef DEBUG_PRINT
     if (debugging) {
       printf ("final sha1 is %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n", hash.i [0], hash.i [1], hash.i [2], hash.i [3], hash.i [4]);
@@ -512,12 +907,24 @@ void sha1 (const char * data, int dsize, char * result)
 #endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
 }
 
+/* the result array must have size SHA1_SIZE */
+void sha1 (const char * data, int dsize, char * result)
+{
+  if (dsize < 0) {
+    printf ("error in sha1 computation; %d (%x) bytes requested\n",
+            dsize, dsize);
+    exit (1);
+  }
+  select_sha_implementations ();
+  sha1_with (sha1_block, data, dsize, result);
+}
+
 /* the result array must have size rsize, only the first rsize bytes
  * of the hash are saved (or the hash is padded with zeros) */
 void sha1_bytes (const char * data, int dsize, char * result, int rsize)
 {
   char sha [SHA1_SIZE];
-  sha512 (data, dsize, sha);
+  sha1 (data, dsize, sha);
   if (rsize <= SHA1_SIZE) {
     memcpy (result, sha, rsize);
   } else {
@@ -583,6 +990,61 @@ void sha512hmac (const char * data, int dsize, const char * key, int ksize,
   sha512 (buffer, SHA512_BLOCK_SIZE + SHA512_SIZE, result);
 }
 
+/* bytes are taken in little-endian order, as in the SipHash paper */
+static uint64_t siphash_read64 (const unsigned char * p)
+{
+  uint64_t result = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    result = (result << 8) | p [i];
+  return result;
+}
+
+#define SIPHASH_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+  do { \
+    v0 += v1; v1 = SIPHASH_ROTL (v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL (v0, 32); \
+    v2 += v3; v3 = SIPHASH_ROTL (v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIPHASH_ROTL (v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIPHASH_ROTL (v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL (v2, 32); \
+  } while (0)
+
+unsigned long long int siphash24 (const char * data, int dsize,
+                                  const char * key)
+{
+  const unsigned char * k = (const unsigned char *) key;
+  const unsigned char * d = (const unsigned char *) data;
+  uint64_t k0 = siphash_read64 (k);
+  uint64_t k1 = siphash_read64 (k + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  int i;
+  for (i = 0; i + 8 <= dsize; i += 8) {
+    uint64_t m = siphash_read64 (d + i);
+    v3 ^= m;
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    SIPHASH_ROUND (v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t last = ((uint64_t) (dsize & 0xff)) << 56;
+  int j;
+  for (j = dsize - i - 1; j >= 0; j--)
+    last |= ((uint64_t) d [i + j]) << (8 * j);
+  v3 ^= last;
+  SIPHASH_ROUND (v0, v1, v2, v3);
+  SIPHASH_ROUND (v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  for (i = 0; i < 4; i++)
+    SIPHASH_ROUND (v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPHASH_ROUND
+#undef SIPHASH_ROTL
+
 #ifdef SHA_UNIT_TEST
 
 #include <sys/time.h>
@@ -657,35 +1119,202 @@ static void sha_given_array (char * array)
 #undef DATA_SIZE
 }
 
-static void compare_to_openssl ()
+/* test vectors from the SipHash paper: key 00..0f, messages 00..(n-1) */
+static void siphash_test ()
 {
-  if (SHA512_SIZE != SHA512_DIGEST_LENGTH) {
-    printf ("error: sha 512 size %d, digest length %d\n",
-            (int) SHA512_SIZE, (int) SHA512_DIGEST_LENGTH);
-    exit (1);
+  char key [SIPHASH_KEY_SIZE];
+  char data [64];
+  int i;
+  for (i = 0; i < SIPHASH_KEY_SIZE; i++)
+    key [i] = i;
+  for (i = 0; i < sizeof (data); i++)
+    data [i] = i;
+  unsigned long long int r0 = siphash24 (data, 0, key);
+  unsigned long long int r15 = siphash24 (data, 15, key);
+  if ((r0 != 0x726fdb47dd0e0e31ULL) || (r15 != 0xa129ca6149be45e5ULL))
+    printf ("error: siphash gives %016llx, %016llx\n", r0, r15);
+  else
+    printf ("siphash gives standard results\n");
+}
+
+/* compare the cost of the two ways of hashing a message ID (16 bytes)
+ * with a secret into a table index */
+static void siphash_benchmark ()
+{
+#define BENCHMARK_COUNT	1000000
+  char id [16 + 8];   /* id, then the secret for sha512 */
+  char key [SIPHASH_KEY_SIZE];
+  memset (id, 0x5a, sizeof (id));
+  memset (key, 0xa5, sizeof (key));
+  char hash [SHA512_SIZE];
+  unsigned long long int sum = 0;
+  struct timeval start, middle, finish;
+  gettimeofday (&start, NULL);
+  int i;
+  for (i = 0; i < BENCHMARK_COUNT; i++) {
+    id [0] = i;
+    sha512 (id, sizeof (id), hash);
+    sum += hash [SHA512_SIZE / 2];
+  }
+  gettimeofday (&middle, NULL);
+  for (i = 0; i < BENCHMARK_COUNT; i++) {
+    id [0] = i;
+    sum += siphash24 (id, 16, key);
   }
+  gettimeofday (&finish, NULL);
+  double sha_us = (middle.tv_sec - start.tv_sec) * 1000000.0 +
+                  (middle.tv_usec - start.tv_usec);
+  double sip_us = (finish.tv_sec - middle.tv_sec) * 1000000.0 +
+                  (finish.tv_usec - middle.tv_usec);
+  printf ("hashing a message ID: sha512 %.1fns, siphash %.1fns (%llx)\n",
+          sha_us * 1000.0 / BENCHMARK_COUNT, sip_us * 1000.0 / BENCHMARK_COUNT,
+          sum & 0xff);
+#undef BENCHMARK_COUNT
+}
+
+static void sha512_selected (const char * input, int bytes, char * result)
+{
+  sha512 (input, bytes, result);
+}
+
+static void sha1_selected (const char * input, int bytes, char * result)
+{
+  sha1 (input, bytes, result);
+}
+
+static void sha1_portable (const char * input, int bytes, char * result)
+{
+  sha1_with (sha1_portable_block, input, bytes, result);
+}
+
+#ifdef SHA_X86_SHA_NI
+static void sha1_x86 (const char * input, int bytes, char * result)
+{
+  sha1_with (sha1_x86_block, input, bytes, result);
+}
+#endif /* SHA_X86_SHA_NI */
+
+typedef void (* sha_fn) (const char * input, int bytes, char * result);
+
+/* compares fn to openssl for every length up to DATA_SIZE, then times it */
+static void compare_one (const char * name, sha_fn fn, int is_sha1)
+{
 #define DATA_SIZE	10000
   unsigned char data [DATA_SIZE];
   int i;
   for (i = 0; i < DATA_SIZE; i++)
     data [i] = i * 41 + 53;   /* pseudo-random sequence */
+  int size = (is_sha1 ? SHA1_SIZE : SHA512_SIZE);
   char this_result [SHA512_SIZE];
   char ssl_result [SHA512_SIZE];
   for (i = 0; i <= DATA_SIZE; i++) {
-    sha512 (data, i, this_result);
-    SHA512 (data, i, ssl_result);
-    if (memcmp (this_result, ssl_result, SHA512_SIZE) != 0) {
-      printf ("error: for length = %d sha512 gives non-standard result\n", i);
-      for (int j = 0; j < SHA512_SIZE; j++)
+    fn ((char *) data, i, this_result);
+    if (is_sha1)
+      SHA1 (data, i, (unsigned char *) ssl_result);
+    else
+      SHA512 (data, i, (unsigned char *) ssl_result);
+    if (memcmp (this_result, ssl_result, size) != 0) {
+      printf ("error: for length = %d %s gives non-standard result\n",
+              i, name);
+      for (int j = 0; j < size; j++)
         printf ("%02x/%02x ", this_result [j] & 0xff, ssl_result [j] & 0xff);
       printf ("\n");
       exit (1);
     }
   }
-  printf ("sha512 gives standard results\n");
+  struct timeval start;
+  struct timeval finish;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < 1000; i++)
+    fn ((char *) data, DATA_SIZE, this_result);
+  gettimeofday (&finish, NULL);
+  double us = (finish.tv_sec - start.tv_sec) * 1000000.0 +
+              (finish.tv_usec - start.tv_usec);
+  printf ("%s gives standard results, %.1fMB/s\n", name,
+          ((us > 0) ? (DATA_SIZE * 1000.0 / us) : 0.0));
 #undef DATA_SIZE
 }
 
+/* compares sha512_bytes_batch to sha512_bytes, then times both */
+static void batch_test ()
+{
+#define BATCH	32
+#define BATCH_MAX_INPUT	1000
+  static char data [BATCH] [BATCH_MAX_INPUT];
+  const char * inputs [BATCH];
+  int sizes [BATCH];
+  char results [BATCH] [SHA512_SIZE + 8];
+  char * outputs [BATCH];
+  int i;
+  for (i = 0; i < BATCH; i++) {
+    int j;
+    for (j = 0; j < BATCH_MAX_INPUT; j++)
+      data [i] [j] = (i + 1) * 37 + j * 41;
+    inputs [i] = data [i];
+    outputs [i] = results [i];
+  }
+  int trial;
+  for (trial = 0; trial < 10000; trial++) {
+    int count = trial % (BATCH + 1);
+    int rsize = ((trial % 3 == 0) ? (SHA512_SIZE + 8) : (trial % SHA512_SIZE));
+    for (i = 0; i < count; i++)
+      sizes [i] = (trial * 7 + i * 131) % BATCH_MAX_INPUT;
+    sha512_bytes_batch (count, inputs, sizes, outputs, rsize);
+    for (i = 0; i < count; i++) {
+      char expected [SHA512_SIZE + 8];
+      sha512_bytes (inputs [i], sizes [i], expected, rsize);
+      if (memcmp (expected, results [i], rsize) != 0) {
+        printf ("error: sha512_bytes_batch %d/%d, size %d, rsize %d\n",
+                i, count, sizes [i], rsize);
+        exit (1);
+      }
+    }
+  }
+  printf ("sha512_bytes_batch gives the same results as sha512_bytes\n");
+  int size;
+  for (size = 24; size <= BATCH_MAX_INPUT; size = size * 6 + 16) {
+    for (i = 0; i < BATCH; i++)
+      sizes [i] = size;
+    struct timeval start, middle, finish;
+    gettimeofday (&start, NULL);
+    for (trial = 0; trial < 10000; trial++)
+      for (i = 0; i < BATCH; i++)
+        sha512_bytes (inputs [i], size, outputs [i], SHA512_SIZE);
+    gettimeofday (&middle, NULL);
+    for (trial = 0; trial < 10000; trial++)
+      sha512_bytes_batch (BATCH, inputs, sizes, outputs, SHA512_SIZE);
+    gettimeofday (&finish, NULL);
+    double single_us = (middle.tv_sec - start.tv_sec) * 1000000.0 +
+                       (middle.tv_usec - start.tv_usec);
+    double batch_us = (finish.tv_sec - middle.tv_sec) * 1000000.0 +
+                      (finish.tv_usec - middle.tv_usec);
+    printf ("hashing %d-byte inputs: sha512_bytes %.1fns, batch %.1fns each\n",
+            size, single_us * 1000.0 / (10000 * BATCH),
+            batch_us * 1000.0 / (10000 * BATCH));
+  }
+#undef BATCH
+#undef BATCH_MAX_INPUT
+}
+
+static void compare_to_openssl ()
+{
+  if (SHA512_SIZE != SHA512_DIGEST_LENGTH) {
+    printf ("error: sha 512 size %d, digest length %d\n",
+            (int) SHA512_SIZE, (int) SHA512_DIGEST_LENGTH);
+    exit (1);
+  }
+  compare_one ("sha512 (portable)", sha512_portable, 0);
+  compare_one ("sha512", sha512_selected, 0);
+  compare_one ("sha1 (portable)", sha1_portable, 1);
+#ifdef SHA_X86_SHA_NI
+  if (x86_has_sha ())
+    compare_one ("sha1 (x86 SHA extensions)", sha1_x86, 1);
+  else
+    printf ("x86 SHA extensions not available\n");
+#endif /* SHA_X86_SHA_NI */
+  compare_one ("sha1", sha1_selected, 1);
+}
+
 int main (int argc, char ** argv)
 {
   if (argc > 1) {
@@ -865,6 +1494,10 @@ int main (int argc, char ** argv)
   run_test_sha1 (sha1_t6, 495, sha1_r6);
 
   compare_to_openssl ();
+  batch_test ();
+
+  siphash_test ();
+  siphash_benchmark ();
 
   return 0;
 }
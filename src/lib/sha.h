@@ -20,8 +20,28 @@ extern void sha512_bytes (const char * data, int dsize,
 extern void sha1_bytes (const char * data, int dsize,
                         char * result, int rsize);
 
+/* same as calling sha512_bytes (data [i], dsize [i], result [i], rsize)
+ * for each 0 <= i < count, but where the processor allows, hashes
+ * several inputs at the same time */
+extern void sha512_bytes_batch (int count, const char ** data,
+                                const int * dsize, char ** result, int rsize);
+
 /* the result array must have size SHA512_SIZE */
 extern void sha512hmac (const char * data, int dsize,
                         const char * key, int ksize, char * result);
 
+/* sha512, sha1, and the functions that call them use processor
+ * instructions or openssl when available, unless sha_accelerated (0)
+ * is called.  For testing and benchmarking */
+extern void sha_accelerated (int use);
+
+#define SIPHASH_KEY_SIZE	16
+
+/* SipHash-2-4, a fast keyed hash for hash tables.  Not a substitute
+ * for sha512 where a cryptographic hash is needed, but an observer who
+ * does not know the key cannot predict or provoke collisions.
+ * key must have SIPHASH_KEY_SIZE bytes */
+extern unsigned long long int siphash24 (const char * data, int dsize,
+                                         const char * key);
+
 #endif /* ALLNET_SHA_H */
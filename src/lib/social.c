@@ -8,7 +8,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "social.h"
 #include "packet.h"
@@ -56,18 +58,105 @@ static void print_social_tier (int tier, struct social_one_tier * soc,
   log_print (log->b);
   int i;
   for (i = 0; i < soc->connections.num_slots; i++)
-    print_table_entry (i, soc->connections.table [i],
-                       soc->connections.num_data_bytes);
+    print_table_entry (&(soc->connections), i);
  */
 }
 
+/* is_my_contact tries to verify the signature with the key of every
+ * contact whose address matches the source.  To avoid this for most
+ * packets, the first SOCIAL_PREFIX_BITS of each contact's address are
+ * kept in an index giving, for each prefix, the lowest social tier with
+ * that prefix (0 if none).  The index is rebuilt by update_social, and
+ * at least every SOCIAL_INDEX_SECONDS so new contacts are found */
+#define SOCIAL_PREFIX_BITS	16
+#define SOCIAL_PREFIXES		(1 << SOCIAL_PREFIX_BITS)
+#define SOCIAL_INDEX_SECONDS	60
+
 struct social_info {
   struct social_one_tier info [MAX_SOCIAL_TIER];
   int max_bytes;    /* should not use more than max_bytes of storage */
   int max_check;    /* should not check more than max_check sigs per call */
   struct allnet_log * log;
+  unsigned char prefix_tier [SOCIAL_PREFIXES];
+  time_t index_time;   /* when the index was last built, 0 if never */
+  pthread_mutex_t mutex;   /* for prefix_tier and index_time */
 };
 
+/* the range of prefixes matching the first nbits of address */
+static void prefix_range (const unsigned char * address, int nbits,
+                          int * first, int * count)
+{
+  if (nbits > SOCIAL_PREFIX_BITS)
+    nbits = SOCIAL_PREFIX_BITS;
+  if (nbits < 0)
+    nbits = 0;
+  int prefix = readb16u (address);
+  *count = 1 << (SOCIAL_PREFIX_BITS - nbits);
+  *first = prefix & ~(*count - 1);
+}
+
+static void index_address (struct social_info * soc,
+                           const unsigned char * address, int nbits, int tier)
+{
+  int first;
+  int count;
+  prefix_range (address, nbits, &first, &count);
+  int i;
+  for (i = first; i < first + count; i++)
+    if ((soc->prefix_tier [i] == 0) || (soc->prefix_tier [i] > tier))
+      soc->prefix_tier [i] = tier;
+}
+
+/* must be called with the mutex held */
+static void build_index (struct social_info * soc)
+{
+  memset (soc->prefix_tier, 0, sizeof (soc->prefix_tier));
+  char ** contacts = NULL;   /* borrowed, do not free */
+  int nc = borrow_contacts (&contacts);
+  int ic;
+  for (ic = 0; ic < nc; ic++) {
+    keyset * keysets = NULL;
+    int nk = all_keys (contacts [ic], &keysets);
+    int ink;
+    for (ink = 0; ink < nk; ink++) {
+      unsigned char address [ADDRESS_SIZE];
+      int na_bits = get_remote (keysets [ink], address);
+      index_address (soc, address, na_bits, 1);
+    }
+    if (keysets != NULL)
+      free (keysets);
+  }
+  struct bc_key_info * bc;
+  int nbc = get_other_keys (&bc);
+  int ibc;
+  for (ibc = 0; ibc < nbc; ibc++)
+    index_address (soc, (unsigned char *) (bc [ibc].address),
+                   ADDRESS_BITS, 1);
+  soc->index_time = time (NULL);
+}
+
+/* returns the lowest social tier that might match the first sbits of
+ * source, or 0 if none can */
+static int lookup_index (struct social_info * soc,
+                         const unsigned char * source, int sbits)
+{
+  pthread_mutex_lock (&(soc->mutex));
+  if ((soc->index_time == 0) ||
+      (time (NULL) >= soc->index_time + SOCIAL_INDEX_SECONDS))
+    build_index (soc);
+  int first;
+  int count;
+  prefix_range (source, sbits, &first, &count);
+  int result = 0;
+  int i;
+  for (i = first; i < first + count; i++)
+    if ((soc->prefix_tier [i] != 0) &&
+        ((result == 0) || (soc->prefix_tier [i] < result)))
+      result = soc->prefix_tier [i];
+  pthread_mutex_unlock (&(soc->mutex));
+  return result;
+}
+
 struct social_info * init_social (int max_bytes, int max_check,
                                   struct allnet_log * log)
 {
@@ -76,6 +165,9 @@ struct social_info * init_social (int max_bytes, int max_check,
   result->max_bytes = max_bytes;
   result->max_check = max_check;
   result->log = log;
+  memset (result->prefix_tier, 0, sizeof (result->prefix_tier));
+  result->index_time = 0;
+  pthread_mutex_init (&(result->mutex), NULL);
   int bytes = ADDRESS_SIZE;
   int i;
   for (i = 0; i < MAX_SOCIAL_TIER; i++) {
@@ -148,6 +240,9 @@ time_t update_social (struct social_info * soc, int update_seconds)
     print_social_tier (i, soc->info + i, only_print_if_new, soc->log);
   }
   only_print_if_new = 1;
+  pthread_mutex_lock (&(soc->mutex));
+  build_index (soc);
+  pthread_mutex_unlock (&(soc->mutex));
   return (time (NULL) + update_seconds);
 }
 
@@ -157,8 +252,8 @@ static int is_my_contact (char * message, int msize,
                           int algo, char * sig, int ssize,
                           struct allnet_log * log)
 {
-  char ** contacts = NULL;
-  int nc = all_contacts (&contacts);
+  char ** contacts = NULL;   /* borrowed, do not free */
+  int nc = borrow_contacts (&contacts);
   int ic;
   for (ic = 0; ic < nc; ic++) {
     keyset * keysets = NULL;
@@ -174,15 +269,12 @@ static int is_my_contact (char * message, int msize,
         snprintf (log->b, LOG_SIZE, "verified from contact %d %d\n", ic, ink);
         log_print (log);
         free (keysets);
-        free (contacts);
         return 1;
       }
     }
     if (keysets != NULL)
       free (keysets);
   }
-  if (contacts != NULL)
-    free (contacts);
 
   struct bc_key_info * bc;
   int nbc = get_other_keys (&bc);
@@ -208,6 +300,8 @@ int social_connection (struct social_info * soc, char * vmessage, int vsize,
   if (algo == ALLNET_SIGTYPE_NONE)
     return UNKNOWN_SOCIAL_TIER;
   *valid = 0;
+  if (lookup_index (soc, src, sbits) != 1)  /* not from a contact */
+    return UNKNOWN_SOCIAL_TIER;
   if (is_my_contact (vmessage, vsize, src, sbits, algo, sig, ssize, soc->log)) {
     *valid = 1;
     return 1;
@@ -1,5 +1,11 @@
 /* manage sockets, mostly for use by ad and app_util */
 
+#if defined(linux) || defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   /* recvmmsg, sendmmsg only declared with _GNU_SOURCE */
+#endif /* _GNU_SOURCE */
+#endif /* linux */
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -18,11 +24,90 @@
 #include "ai.h"   /* same_sockaddr */
 #include "configfiles.h"
 #include "routing.h"   /* print_dht */
+#include "probes.h"
 
 #ifdef ALLNET_NETPACKET_SUPPORT
 #include <linux/if_packet.h>  /* sockaddr_ll */
 #endif /* ALLNET_NETPACKET_SUPPORT */
 
+/* socket_read uses epoll or kqueue where available, and select otherwise.
+ * define ALLNET_SOCKETS_USE_SELECT to always use select */
+#ifndef ALLNET_SOCKETS_USE_SELECT
+#if defined(linux) || defined(__linux__)
+#define ALLNET_SOCKETS_USE_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+      defined(__NetBSD__) || defined(__DragonFly__)
+#define ALLNET_SOCKETS_USE_KQUEUE
+#include <sys/event.h>
+#endif /* linux, __APPLE__ || BSD */
+#endif /* ALLNET_SOCKETS_USE_SELECT */
+#if defined(ALLNET_SOCKETS_USE_EPOLL) || defined(ALLNET_SOCKETS_USE_KQUEUE)
+#define ALLNET_SOCKETS_USE_EVENTS
+/* max number of ready sockets returned by one call to epoll/kqueue */
+#define SOCKETS_MAX_EVENTS	32
+#endif /* ALLNET_SOCKETS_USE_EPOLL || ALLNET_SOCKETS_USE_KQUEUE */
+
+/* where available, socket_read uses recvmmsg to receive up to
+ * SOCKETS_RECV_BATCH datagrams from a ready socket with one system call.
+ * The first is returned immediately, the others are kept in the
+ * socket_recv_batch and returned by the next calls to socket_read */
+#if defined(linux) || defined(__linux__)
+#ifndef ALLNET_SOCKETS_NO_RECVMMSG
+#define ALLNET_SOCKETS_USE_RECVMMSG
+#endif /* ALLNET_SOCKETS_NO_RECVMMSG */
+#ifndef ALLNET_SOCKETS_NO_SENDMMSG
+#define ALLNET_SOCKETS_USE_SENDMMSG
+#endif /* ALLNET_SOCKETS_NO_SENDMMSG */
+#endif /* linux */
+
+/* where available (linux), socket_send_batch_flush sends a train of
+ * messages of the same size to the same address with one UDP_SEGMENT
+ * (generic segmentation offload) send, and socket_create_bind enables
+ * UDP_GRO on internet sockets, so that a train received from one peer
+ * may arrive as one buffer, which socket_read splits into datagrams.
+ * define ALLNET_SOCKETS_NO_GSO to send and receive each datagram
+ * separately */
+#if defined(ALLNET_SOCKETS_USE_RECVMMSG) && \
+    defined(ALLNET_SOCKETS_USE_SENDMMSG) && (! defined(ALLNET_SOCKETS_NO_GSO))
+#include <netinet/udp.h>
+#if defined(UDP_SEGMENT) && defined(UDP_GRO) && defined(SOL_UDP)
+#define ALLNET_SOCKETS_USE_GSO
+#endif /* UDP_SEGMENT && UDP_GRO && SOL_UDP */
+#endif /* RECVMMSG && SENDMMSG && ! ALLNET_SOCKETS_NO_GSO */
+#ifdef ALLNET_SOCKETS_USE_GSO
+/* the kernel limits a GSO send to 64 segments and 64KiB.  The segments
+ * must also fit the path MTU, since they are not fragmented, so larger
+ * messages are sent one at a time, and rely on IP fragmentation */
+#define SOCKETS_GSO_MAX_SEGMENTS	64
+#define SOCKETS_GSO_MAX_BYTES		65000
+#define SOCKETS_GSO_MAX_SEGMENT		1452  /* 1500 - IPv6 and UDP headers */
+/* a coalesced receive has at most 64 datagrams and 64KiB */
+#define SOCKETS_RECV_PENDING		64
+#define SOCKETS_GRO_BUFFER		65536
+/* set if the kernel refuses a GSO send, after which none are attempted */
+static int gso_disabled = 0;
+#else /* ! ALLNET_SOCKETS_USE_GSO */
+#define SOCKETS_RECV_PENDING		SOCKETS_RECV_BATCH
+#endif /* ALLNET_SOCKETS_USE_GSO */
+
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+struct socket_recv_batch {
+  int sockfd;      /* the socket on which the pending datagrams arrived */
+  int count;       /* number of datagrams received */
+  int next;        /* index of the next datagram to return, <= count */
+  /* each datagram is in buffers, or for a coalesced receive, in gro */
+  char * datagrams [SOCKETS_RECV_PENDING];
+  int sizes [SOCKETS_RECV_PENDING];
+  struct sockaddr_storage addrs [SOCKETS_RECV_PENDING];
+  socklen_t alens [SOCKETS_RECV_PENDING];
+  char buffers [SOCKETS_RECV_BATCH] [SOCKET_READ_MIN_BUFFER];
+#ifdef ALLNET_SOCKETS_USE_GSO
+  char gro [SOCKETS_GRO_BUFFER];
+#endif /* ALLNET_SOCKETS_USE_GSO */
+};
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+
 static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void lock (const char * caller)
@@ -88,6 +173,8 @@ struct socket_set * debug_copy_socket_set (const struct socket_set * s)
   for (si = 0; si < s->num_sockets; si++) {
     res->sockets [si] = s->sockets [si];
     res->sockets [si].send_addrs = savp;
+    res->sockets [si].addr_index = NULL;   /* not copied */
+    res->sockets [si].addr_index_size = 0;
     savp += s->sockets [si].num_addrs;
     int ai;
     for (ai = 0; ai < res->sockets [si].num_addrs; ai++) {
@@ -149,19 +236,71 @@ void print_socket_global_addrs (struct socket_set * s)
   print_socket_global_addrs_to_fd (s, STDOUT_FILENO);
 }
 
-void close_socket_set (struct socket_set * s)
+#ifdef ALLNET_SOCKETS_USE_EVENTS
+/* register (add = 1) or deregister (add = 0) the sockfd with the event fd,
+ * creating the event fd if needed.  Called with the mutex locked.
+ * if anything fails, the event fd is closed and socket_read uses select */
+static void event_register (struct socket_set * s, int sockfd, int add)
 {
-  if ((s == NULL) || (s->num_sockets <= 0) || (s->sockets == NULL))
-    return;
-  int is;
-  for (is = 0; is < s->num_sockets; is++) {
-    close (s->sockets [is].sockfd);
-    if (s->sockets [is].send_addrs != NULL)
-      free (s->sockets [is].send_addrs);
+  if ((! s->event_fd_valid) && (! add))
+    return;          /* nothing to deregister from */
+  if (! s->event_fd_valid) {
+    if (s->num_sockets > 1)  /* other sockets are not registered */
+      return;
+#ifdef ALLNET_SOCKETS_USE_EPOLL
+    s->event_fd = epoll_create (SOCKETS_MAX_EVENTS);
+#else /* ALLNET_SOCKETS_USE_KQUEUE */
+    s->event_fd = kqueue ();
+#endif /* ALLNET_SOCKETS_USE_EPOLL */
+    if (s->event_fd < 0) {
+      perror ("sockets.c event_register create");
+      return;
+    }
+    s->event_fd_valid = 1;
   }
-  s->num_sockets = 0;
-  s->sockets = NULL;
+#ifdef ALLNET_SOCKETS_USE_EPOLL
+  struct epoll_event event = { .events = EPOLLIN, .data.fd = sockfd };
+  int result = epoll_ctl (s->event_fd, (add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL),
+                          sockfd, &event);
+#else /* ALLNET_SOCKETS_USE_KQUEUE */
+  struct kevent event;
+  EV_SET (&event, sockfd, EVFILT_READ, (add ? EV_ADD : EV_DELETE), 0, 0, NULL);
+  int result = kevent (s->event_fd, &event, 1, NULL, 0, NULL);
+#endif /* ALLNET_SOCKETS_USE_EPOLL */
+  if ((result != 0) && add) {  /* fall back to select */
+    perror ("sockets.c event_register");
+    close (s->event_fd);
+    s->event_fd_valid = 0;
+  }
+}
+
+/* returns the number of ready sockfds placed in fds, 0 for timeout,
+ * and -1 for errors (errno is set) */
+static int event_wait (int event_fd, int * fds, int max_fds, int timeout)
+{
+#ifdef ALLNET_SOCKETS_USE_EPOLL
+  struct epoll_event events [SOCKETS_MAX_EVENTS];
+  if (max_fds > SOCKETS_MAX_EVENTS)
+    max_fds = SOCKETS_MAX_EVENTS;
+  int n = epoll_wait (event_fd, events, max_fds, timeout);
+  int i;
+  for (i = 0; i < n; i++)
+    fds [i] = events [i].data.fd;
+#else /* ALLNET_SOCKETS_USE_KQUEUE */
+  struct kevent events [SOCKETS_MAX_EVENTS];
+  if (max_fds > SOCKETS_MAX_EVENTS)
+    max_fds = SOCKETS_MAX_EVENTS;
+  struct timespec ts = { .tv_sec = timeout / 1000,
+                         .tv_nsec = (timeout % 1000) * 1000000 };
+  int n = kevent (event_fd, NULL, 0, events, max_fds,
+                  ((timeout < 0) ? NULL : &ts));
+  int i;
+  for (i = 0; i < n; i++)
+    fds [i] = (int) (events [i].ident);
+#endif /* ALLNET_SOCKETS_USE_EPOLL */
+  return n;
 }
+#endif /* ALLNET_SOCKETS_USE_EVENTS */
 
 void check_sav (struct socket_address_validity * sav, const char * desc)
 {
@@ -188,6 +327,433 @@ static void add_priority (const char * message, int msize, unsigned int p,
   writeb32 (buffer + msize, p);
 }
 
+/* the address index is an open-addressing hash table with linear probing.
+ * Addresses that same_sockaddr considers the same must hash the same, so
+ * IPv4 addresses mapped into IPv6 are hashed as their IPv4 address */
+#define ADDR_INDEX_MIN_SIZE	16
+static uint64_t addr_hash (const struct sockaddr_storage * addr, socklen_t alen)
+{
+  const unsigned char * bytes = (const unsigned char *) addr;
+  int nbytes = alen;
+  unsigned char normalized [2 + 16];   /* port, then the IP address */
+  if ((alen == sizeof (struct sockaddr_in)) && (addr->ss_family == AF_INET)) {
+    const struct sockaddr_in * sin = (const struct sockaddr_in *) addr;
+    memcpy (normalized, &(sin->sin_port), 2);
+    memcpy (normalized + 2, &(sin->sin_addr), 4);
+    bytes = normalized;
+    nbytes = 6;
+  } else if ((alen == sizeof (struct sockaddr_in6)) &&
+             (addr->ss_family == AF_INET6)) {
+    const struct sockaddr_in6 * sin6 = (const struct sockaddr_in6 *) addr;
+    const char * ip6 = (const char *) &(sin6->sin6_addr);
+    memcpy (normalized, &(sin6->sin6_port), 2);
+    if ((readb64 (ip6) == 0) && (readb16 (ip6 + 8) == 0) &&
+        (readb16 (ip6 + 10) == 0xffff)) {    /* IPv4 in IPv6 */
+      memcpy (normalized + 2, ip6 + 12, 4);
+      nbytes = 6;
+    } else {
+      memcpy (normalized + 2, ip6, 16);
+      nbytes = 18;
+    }
+    bytes = normalized;
+  }
+  uint64_t hash = 14695981039346656037ULL;   /* FNV-1a */
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    hash ^= bytes [i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void addr_index_insert (struct socket_address_set * sock, int ai)
+{
+  struct socket_address_validity * sav = sock->send_addrs + ai;
+  int mask = sock->addr_index_size - 1;
+  int pos = (int) (addr_hash (&(sav->addr), sav->alen) & mask);
+  while (sock->addr_index [pos] >= 0)
+    pos = (pos + 1) & mask;
+  sock->addr_index [pos] = ai;
+}
+
+/* forget the index, e.g. after addresses are deleted and the
+ * send_addrs array is compressed.  The next lookup rebuilds it */
+static void addr_index_invalidate (struct socket_address_set * sock)
+{
+  if (sock->addr_index != NULL)
+    free (sock->addr_index);
+  sock->addr_index = NULL;
+  sock->addr_index_size = 0;
+}
+
+/* returns 1 for success, 0 if unable to allocate the index */
+static int addr_index_build (struct socket_address_set * sock, int min_addrs)
+{
+  int size = ADDR_INDEX_MIN_SIZE;
+  while (size < 2 * min_addrs)   /* keep the table at most half full */
+    size *= 2;
+  int * index = malloc (size * sizeof (int));
+  if (index == NULL)
+    return 0;
+  addr_index_invalidate (sock);
+  sock->addr_index = index;
+  sock->addr_index_size = size;
+  int i;
+  for (i = 0; i < size; i++)
+    sock->addr_index [i] = -1;
+  for (i = 0; i < sock->num_addrs; i++)
+    addr_index_insert (sock, i);
+  return 1;
+}
+
+/* returns the sav with this address, or NULL if none */
+static struct socket_address_validity *
+  addr_index_find (struct socket_address_set * sock,
+                   const struct sockaddr_storage * addr, socklen_t alen)
+{
+  if (sock->num_addrs <= 0)
+    return NULL;
+  if ((sock->addr_index == NULL) &&
+      (! addr_index_build (sock, sock->num_addrs))) {  /* linear search */
+    int ai;
+    for (ai = 0; ai < sock->num_addrs; ai++) {
+      struct socket_address_validity * sav = sock->send_addrs + ai;
+      if (same_sockaddr (addr, alen, &(sav->addr), sav->alen))
+        return sav;
+    }
+    return NULL;
+  }
+  int mask = sock->addr_index_size - 1;
+  int pos = (int) (addr_hash (addr, alen) & mask);
+  while (sock->addr_index [pos] >= 0) {
+    struct socket_address_validity * sav =
+      sock->send_addrs + sock->addr_index [pos];
+    if (same_sockaddr (addr, alen, &(sav->addr), sav->alen))
+      return sav;
+    pos = (pos + 1) & mask;
+  }
+  return NULL;
+}
+#undef ADDR_INDEX_MIN_SIZE
+
+/* remove the entry for send_addrs [ai] from the index, shifting back
+ * any later entries in the same probe sequence */
+static void addr_index_remove (struct socket_address_set * sock, int ai)
+{
+  if (sock->addr_index == NULL)
+    return;
+  struct socket_address_validity * sav = sock->send_addrs + ai;
+  int * index = sock->addr_index;
+  int mask = sock->addr_index_size - 1;
+  int i = (int) (addr_hash (&(sav->addr), sav->alen) & mask);
+  while ((index [i] >= 0) && (index [i] != ai))
+    i = (i + 1) & mask;
+  if (index [i] < 0)
+    return;   /* not found, should never happen */
+  int j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (index [j] < 0)
+      break;
+    struct socket_address_validity * jsav = sock->send_addrs + index [j];
+    int k = (int) (addr_hash (&(jsav->addr), jsav->alen) & mask);
+    /* the entry at j stays if its home k is cyclically in (i, j] */
+    if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+      continue;
+    index [i] = index [j];
+    i = j;
+  }
+  index [i] = -1;
+}
+
+/* remove send_addrs [ai] by moving the last address into its place.
+ * Unlike compressing the array, this keeps the index valid */
+static void addr_remove (struct socket_address_set * sock, int ai)
+{
+  addr_index_remove (sock, ai);
+  int last = sock->num_addrs - 1;
+  if (ai != last) {
+    if (sock->addr_index != NULL) {
+      struct socket_address_validity * lsav = sock->send_addrs + last;
+      int mask = sock->addr_index_size - 1;
+      int i = (int) (addr_hash (&(lsav->addr), lsav->alen) & mask);
+      while ((sock->addr_index [i] >= 0) && (sock->addr_index [i] != last))
+        i = (i + 1) & mask;
+      sock->addr_index [i] = ai;
+    }
+    sock->send_addrs [ai] = sock->send_addrs [last];
+  }
+  sock->num_addrs--;
+}
+
+/* each address has a keepalive timer and an expiration timer.  The
+ * timers are kept in hierarchical timer wheels, so socket_send_keepalives
+ * and socket_update_time only look at the addresses that are due.
+ * Times are whatever the caller uses, normally ad's virtual clock.
+ * Timers are not updated when an address is sent to or received from.
+ * Instead, when a timer comes due, the address is checked, and if
+ * the keepalive or expiration is not yet due, the timer is reset.
+ * Timers refer to their address by socket and sockaddr, and a timer_id
+ * that is different every time an address is added, so timers for
+ * addresses that have been deleted are recognized and discarded. */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	3
+#define WHEEL_RANGE	(1LL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct socket_timer {
+  struct socket_timer * next;
+  long long int due;
+  int sockfd;
+  unsigned long long int timer_id;
+  struct sockaddr_storage addr;
+  socklen_t alen;
+};
+
+struct socket_timer_wheel {
+  long long int now;   /* all timers due at or before now have been run */
+  /* level l has the timers due within WHEEL_SLOTS^(l+1) of now */
+  struct socket_timer * slots [WHEEL_LEVELS] [WHEEL_SLOTS];
+};
+
+struct socket_timers {
+  struct socket_timer_wheel keepalive;
+  struct socket_timer_wheel expiration;
+  struct socket_timer * free_timers;
+  unsigned long long int next_timer_id;
+  /* the keepalive intervals from the latest call to socket_send_keepalives */
+  long long int local_interval;
+  long long int remote_interval;
+};
+
+static struct socket_timers * timers_get (struct socket_set * s)
+{
+  if (s->timers == NULL) {
+    s->timers = malloc_or_fail (sizeof (struct socket_timers), "timers_get");
+    memset (s->timers, 0, sizeof (struct socket_timers));
+    s->timers->next_timer_id = 1;
+    s->timers->local_interval = 1;
+    s->timers->remote_interval = 1;
+  }
+  return s->timers;
+}
+
+static void timer_list_free (struct socket_timer * t)
+{
+  while (t != NULL) {
+    struct socket_timer * next = t->next;
+    free (t);
+    t = next;
+  }
+}
+
+static void timers_free (struct socket_set * s)
+{
+  struct socket_timers * ts = s->timers;
+  if (ts == NULL)
+    return;
+  int l, i;
+  for (l = 0; l < WHEEL_LEVELS; l++) {
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+      timer_list_free (ts->keepalive.slots [l] [i]);
+      timer_list_free (ts->expiration.slots [l] [i]);
+    }
+  }
+  timer_list_free (ts->free_timers);
+  free (ts);
+  s->timers = NULL;
+}
+
+/* t->due must be set.  A timer due at or before now is run at now + 1 */
+static void wheel_place (struct socket_timer_wheel * w, struct socket_timer * t)
+{
+  if (t->due <= w->now)
+    t->due = w->now + 1;
+  long long int at = t->due;
+  /* a slot at level l is next visited in the first block (of
+   * WHEEL_SLOTS^l ticks) after the block containing now that maps
+   * to this slot, so use the lowest level where that is at's block */
+  int level = 0;
+  while ((level + 1 < WHEEL_LEVELS) &&
+         ((at >> (WHEEL_BITS * level)) - (w->now >> (WHEEL_BITS * level)) >
+          WHEEL_SLOTS))
+    level++;
+  int shift = WHEEL_BITS * level;
+  if ((at >> shift) - (w->now >> shift) > WHEEL_SLOTS)  /* too far, look */
+    at = ((w->now >> shift) + WHEEL_SLOTS) << shift;  /* again when there */
+  int slot = (int) ((at >> shift) & WHEEL_MASK);
+  t->next = w->slots [level] [slot];
+  w->slots [level] [slot] = t;
+}
+
+static void timer_add (struct socket_timers * ts, struct socket_timer_wheel * w,
+                       int sockfd, struct socket_address_validity * sav,
+                       long long int due)
+{
+  struct socket_timer * t = ts->free_timers;
+  if (t != NULL)
+    ts->free_timers = t->next;
+  else
+    t = malloc_or_fail (sizeof (struct socket_timer), "timer_add");
+  t->due = due;
+  t->sockfd = sockfd;
+  t->timer_id = sav->timer_id;
+  t->addr = sav->addr;
+  t->alen = sav->alen;
+  wheel_place (w, t);
+}
+
+/* start the timers for a newly added address */
+static void timers_add_address (struct socket_set * s,
+                                struct socket_address_set * sock,
+                                struct socket_address_validity * sav)
+{
+  struct socket_timers * ts = timers_get (s);
+  sav->timer_id = ts->next_timer_id++;
+  if (! sock->is_broadcast) {
+    long long int interval =
+      ((sock->is_local) ? ts->local_interval : ts->remote_interval);
+    timer_add (ts, &(ts->keepalive), sock->sockfd, sav,
+               sav->alive_sent + interval);
+  }
+  timer_add (ts, &(ts->expiration), sock->sockfd, sav,
+             ((sav->time_limit == 0) ? ts->expiration.now + WHEEL_RANGE
+                                     : sav->time_limit + 1));
+}
+
+/* find the address for this timer, returning NULL if it has been deleted.
+ * If sip and aip are not NULL, they are set to the socket and address
+ * positions */
+static struct socket_address_validity *
+  timer_address (struct socket_set * s, struct socket_timer * t,
+                 int * sip, int * aip)
+{
+  int si;
+  for (si = 0; si < s->num_sockets; si++) {
+    struct socket_address_set * sock = s->sockets + si;
+    if (sock->sockfd == t->sockfd) {
+      struct socket_address_validity * sav =
+        addr_index_find (sock, &(t->addr), t->alen);
+      if ((sav == NULL) || (sav->timer_id != t->timer_id))
+        return NULL;
+      if (sip != NULL)
+        *sip = si;
+      if (aip != NULL)
+        *aip = (int) (sav - sock->send_addrs);
+      return sav;
+    }
+  }
+  return NULL;
+}
+
+/* f is called for each timer that comes due.  f must either put the
+ * timer back on the wheel, or on the free list */
+typedef void (* timer_fun) (struct socket_set * s, struct socket_timers * ts,
+                            struct socket_timer * t, void * ref);
+
+static void run_timers (struct socket_set * s, struct socket_timers * ts,
+                        struct socket_timer * list, timer_fun f, void * ref)
+{
+  while (list != NULL) {
+    struct socket_timer * t = list;
+    list = list->next;
+    f (s, ts, t, ref);
+  }
+}
+
+/* re-place all the timers in this slot.  Some may now be due */
+static void wheel_cascade (struct socket_timer_wheel * w, int level)
+{
+  int slot = (int) (((w->now + 1) >> (WHEEL_BITS * level)) & WHEEL_MASK);
+  struct socket_timer * t = w->slots [level] [slot];
+  w->slots [level] [slot] = NULL;
+  while (t != NULL) {
+    struct socket_timer * next = t->next;
+    wheel_place (w, t);
+    t = next;
+  }
+}
+
+/* run all the timers that are due at or before new_time */
+static void wheel_advance (struct socket_set * s, struct socket_timers * ts,
+                           struct socket_timer_wheel * w,
+                           long long int new_time, timer_fun f, void * ref)
+{
+  if (new_time - w->now > WHEEL_RANGE) {  /* big jump, take everything out */
+    struct socket_timer * due = NULL;
+    struct socket_timer * later = NULL;
+    int l, i;
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+      for (i = 0; i < WHEEL_SLOTS; i++) {
+        struct socket_timer * t = w->slots [l] [i];
+        w->slots [l] [i] = NULL;
+        while (t != NULL) {
+          struct socket_timer * next = t->next;
+          struct socket_timer ** list = ((t->due <= new_time) ? &due : &later);
+          t->next = *list;
+          *list = t;
+          t = next;
+        }
+      }
+    }
+    w->now = new_time;
+    while (later != NULL) {
+      struct socket_timer * next = later->next;
+      wheel_place (w, later);
+      later = next;
+    }
+    run_timers (s, ts, due, f, ref);
+    return;
+  }
+  while (w->now < new_time) {
+    long long int tick = w->now + 1;
+    /* at the start of each block of slots, bring the timers for this
+     * block down from the higher levels, highest level first */
+    int l;
+    for (l = WHEEL_LEVELS - 1; l > 0; l--)
+      if ((tick & ((1LL << (WHEEL_BITS * l)) - 1)) == 0)
+        wheel_cascade (w, l);
+    int slot = (int) (tick & WHEEL_MASK);
+    struct socket_timer * due = w->slots [0] [slot];
+    w->slots [0] [slot] = NULL;
+    w->now = tick;
+    run_timers (s, ts, due, f, ref);
+  }
+}
+
+static void timer_free (struct socket_timers * ts, struct socket_timer * t)
+{
+  t->next = ts->free_timers;
+  ts->free_timers = t;
+}
+
+void close_socket_set (struct socket_set * s)
+{
+  if (s == NULL)
+    return;
+  int is;
+  for (is = 0; (s->sockets != NULL) && (is < s->num_sockets); is++) {
+    close (s->sockets [is].sockfd);
+    if (s->sockets [is].send_addrs != NULL)
+      free (s->sockets [is].send_addrs);
+    if (s->sockets [is].addr_index != NULL)
+      free (s->sockets [is].addr_index);
+  }
+  /* even a set with no sockets left has its batch and event fd */
+  s->num_sockets = 0;
+  s->sockets = NULL;
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+  if (s->recv_batch != NULL)
+    free (s->recv_batch);
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+  s->recv_batch = NULL;
+  if (s->event_fd_valid)
+    close (s->event_fd);
+  s->event_fd_valid = 0;
+  timers_free (s);
+}
+
 static int socket_sock_loop_locked (struct socket_set * s,
                                     socket_sock_loop_fun f, void * ref)
 {
@@ -202,6 +768,14 @@ static int socket_sock_loop_locked (struct socket_set * s,
                 sas->sockfd, sas->is_local, sas->is_global_v4,
                 sas->is_global_v6, sas->is_broadcast, sas->num_addrs);
 #endif /* DEBUG_PRINT */
+#ifdef ALLNET_SOCKETS_USE_EVENTS
+      event_register (s, sas->sockfd, 0);
+#endif /* ALLNET_SOCKETS_USE_EVENTS */
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+      if ((s->recv_batch != NULL) && (s->recv_batch->sockfd == sas->sockfd))
+        s->recv_batch->count = s->recv_batch->next = 0;  /* discard */
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+      addr_index_invalidate (sas);
       close (sas->sockfd);
       count++;
       /* compress the array to replace the deleted element */
@@ -246,6 +820,7 @@ check_sav (sav, "socket_addr_loop");
           sas->send_addrs [aim] = sas->send_addrs [aim + 1];
         sas->num_addrs--;
         ai--;   /* so the loop does the next element, which now is at ai */
+        addr_index_invalidate (sas);   /* the positions have changed */
       }
     }
   }
@@ -283,6 +858,12 @@ static int socket_add_locked (struct socket_set * s, int sockfd, int is_local,
   s->sockets [index].is_broadcast = is_bc;
   s->sockets [index].num_addrs = 0;
   s->sockets [index].send_addrs = NULL;
+  s->sockets [index].addr_index = NULL;
+  s->sockets [index].addr_index_size = 0;
+  s->sockets [index].gro = 0;
+#ifdef ALLNET_SOCKETS_USE_EVENTS
+  event_register (s, sockfd, 1);
+#endif /* ALLNET_SOCKETS_USE_EVENTS */
   return 1;
 }
 /* returns a pointer to the new sav, or NULL in case of errors (e.g.
@@ -304,13 +885,8 @@ static struct socket_address_validity *
     print_socket_set (s);
     return NULL;
   }
-  int ai;
-  for (ai = 0; ai < sock->num_addrs; ai++) {
-    struct socket_address_validity * sav = &(sock->send_addrs [ai]);
-    check_sav (sav, "socket_address_add_locked");
-    if (same_sockaddr (&(addr.addr), addr.alen, &(sav->addr), sav->alen))
-      return NULL;  /* already there, no need to add */
-  }
+  if (addr_index_find (sock, &(addr.addr), addr.alen) != NULL)
+    return NULL;  /* already there, no need to add */
   int index = sock->num_addrs;
   sock->num_addrs++;
   int size = sock->num_addrs * sizeof (struct socket_address_validity);
@@ -322,6 +898,12 @@ static struct socket_address_validity *
   sock->send_addrs = new_sa;
   sock->send_addrs [index] = addr;
   check_sav (sock->send_addrs + index, "return value from saal");
+  timers_add_address (s, sock, sock->send_addrs + index);
+  if ((sock->addr_index != NULL) &&
+      (2 * sock->num_addrs <= sock->addr_index_size))
+    addr_index_insert (sock, index);
+  else if (! addr_index_build (sock, 2 * sock->num_addrs))  /* or grow */
+    addr_index_invalidate (sock);
   return sock->send_addrs + index;
 }
 
@@ -349,25 +931,6 @@ check_sav (&addr, "socket_address_add return value");
   return result;
 }
 
-struct recv_limit_data {
-  int updated;
-  int new_recv_limit;
-  struct sockaddr_storage addr;
-  socklen_t alen;
-};
-
-static int update_recv_limit_fun (struct socket_address_set * sock,
-                                  struct socket_address_validity * sav,
-                                  void * ref)
-{
-  struct recv_limit_data * rld = (struct recv_limit_data *) ref;
-  if (same_sockaddr (&(rld->addr), rld->alen, &(sav->addr), sav->alen)) {
-    rld->updated = 1; /* found! */
-    sav->recv_limit = rld->new_recv_limit;
-  }
-  return 1;   /* keep the record */
-}
-
 /* returns 1 if the receive limit was updated, 0 otherwise */
 int socket_update_recv_limit (int new_recv_limit, struct socket_set * s,
                               struct sockaddr_storage addr, socklen_t alen)
@@ -375,15 +938,19 @@ int socket_update_recv_limit (int new_recv_limit, struct socket_set * s,
 #ifdef DEBUG_SOCKETS
 struct socket_set * debug_copy = debug_copy_socket_set (s);
 #endif /* DEBUG_SOCKETS */
-  struct recv_limit_data rld =
-    { .updated = 0, .new_recv_limit = new_recv_limit, .alen = alen };
-  memcpy (&(rld.addr), &addr, sizeof (addr));
-  int del = socket_addr_loop (s, update_recv_limit_fun, &rld);
-  if (del != 0) {
-    printf ("error: update_recv_limit deleted %d addrs\n", del);
-    exit (1);
+  int updated = 0;
+  lock ("socket_update_recv_limit");
+  int si;
+  for (si = 0; si < s->num_sockets; si++) {
+    struct socket_address_validity * sav =
+      addr_index_find (s->sockets + si, &addr, alen);
+    if (sav != NULL) {
+      updated = 1; /* found! */
+      sav->recv_limit = new_recv_limit;
+    }
   }
-  if (! rld.updated) {   /* likely error -- report for now */
+  unlock ("socket_update_recv_limit");
+  if (! updated) {   /* likely error -- report for now */
     char st [1000];
     print_sockaddr_str ((struct sockaddr *) &addr, alen, st, sizeof (st));
     printf ("warning: update_recv_limit %s did not update any addresses\n", st);
@@ -396,30 +963,52 @@ struct socket_set * debug_copy = debug_copy_socket_set (s);
 #ifdef DEBUG_SOCKETS
   if (debug_copy != NULL) free (debug_copy);
 #endif /* DEBUG_SOCKETS */
-  return rld.updated;
+  return updated;
 }
 
-static int update_time_fun (struct socket_address_set * sock,
-                            struct socket_address_validity * sav,
-                            void * ref)
+struct update_time_data {
+  long long int new_time;
+  int deleted;
+};
+
+static void update_time_fun (struct socket_set * s, struct socket_timers * ts,
+                             struct socket_timer * t, void * ref)
 {
-  long long int new_time = * ((long long int *) ref);
+  struct update_time_data * utd = (struct update_time_data *) ref;
+  int si, ai;
+  struct socket_address_validity * sav = timer_address (s, t, &si, &ai);
+  if (sav == NULL) {         /* address no longer in the set */
+    timer_free (ts, t);
+    return;
+  }
 check_sav (sav, "update_time_fun");
+  if ((sav->time_limit == 0) || (sav->time_limit >= utd->new_time)) {
+    t->due = ((sav->time_limit == 0) ? utd->new_time + WHEEL_RANGE
+                                     : sav->time_limit + 1);
+    wheel_place (&(ts->expiration), t);
+    return;
+  }
 #ifdef DEBUG_PRINT
   char timestring [ALLNET_TIME_STRING_SIZE];
   allnet_localtime_string (allnet_time (), timestring);
-  if (! ((sav->time_limit == 0) || (sav->time_limit >= new_time)))
-    printf ("%s: update_time_fun deleting record, time_limit %lld <? %lld\n",
-            timestring, sav->time_limit, new_time);
+  printf ("%s: update_time_fun deleting record, time_limit %lld <? %lld\n",
+          timestring, sav->time_limit, utd->new_time);
 #endif /* DEBUG_PRINT */
-  return ((sav->time_limit == 0) || (sav->time_limit >= new_time));
+  addr_remove (s->sockets + si, ai);
+  utd->deleted++;
+  timer_free (ts, t);
 }
 
 /* remove all socket addresses whose time is less than new_time.
  * return the number of records deleted */
 int socket_update_time (struct socket_set * s, long long int new_time)
 {
-  return socket_addr_loop (s, update_time_fun, &new_time);
+  struct update_time_data utd = { .new_time = new_time, .deleted = 0 };
+  lock ("socket_update_time");
+  struct socket_timers * ts = timers_get (s);
+  wheel_advance (s, ts, &(ts->expiration), new_time, update_time_fun, &utd);
+  unlock ("socket_update_time");
+  return utd.deleted;
 }
 
 static void add_fd_to_bitset (fd_set * set, int fd, int * max)
@@ -448,22 +1037,17 @@ static void update_read (struct sockaddr_storage sas, socklen_t alen,
   *savp = NULL;     /* in case we don't find it */
   *is_new = 1;      /* in case we don't find it */
   *recv_limit_reached = 0; /* in case we don't find it (and good default) */
-  int i;
-  for (i = 0; i < sock->num_addrs; i++) {
-    struct socket_address_validity * sav = sock->send_addrs + i;
+  struct socket_address_validity * sav = addr_index_find (sock, &sas, alen);
+  if (sav != NULL) {  /* found! */
 check_sav (sav, "update_read");
-    if (same_sockaddr (&sas, alen, &(sav->addr), sav->alen)) {  /* found! */
-/* printf ("update_read %d found: ", sock->sockfd); print_sav(sav); */
-      *savp = sav;
-      *is_new = 0;
-      sav->alive_rcvd = rcvd_time;
-      if (sav->recv_limit >= 1)
-        sav->recv_limit--;
-      *recv_limit_reached = (sav->recv_limit == 0);
-      if ((sav->send_limit_on_recv != 0) && auth)
-        sav->send_limit = sav->send_limit_on_recv;
-      break;
-    }
+    *savp = sav;
+    *is_new = 0;
+    sav->alive_rcvd = rcvd_time;
+    if (sav->recv_limit >= 1)
+      sav->recv_limit--;
+    *recv_limit_reached = (sav->recv_limit == 0);
+    if ((sav->send_limit_on_recv != 0) && auth)
+      sav->send_limit = sav->send_limit_on_recv;
   }
 }
 
@@ -506,7 +1090,250 @@ if (! is_new) check_sav (r.sav, "record_message result");
   return r;
 }
 
-/* returns the max parameter to pass to select */
+/* called with the mutex locked.  If the datagram has a legal size,
+ * fills in *result, unlocks the mutex, and returns 1.
+ * Otherwise returns 0 with the mutex still locked */
+static int deliver_datagram (struct socket_set * s,
+                             struct socket_address_set * sock,
+                             char * buffer, ssize_t rcvd,
+                             struct sockaddr_storage sas, socklen_t alen,
+                             long long int rcvd_time,
+                             struct socket_read_result * result)
+{
+  struct sockaddr * sap = (struct sockaddr *) (&sas);
+  /* all packets must have a min header, local packets also have priority */
+  int min = ALLNET_HEADER_SIZE + ((sock->is_local) ? 4 : 0);
+  if ((rcvd < (ssize_t) min) || (rcvd > SOCKET_READ_MIN_BUFFER)) {
+    printf ("received illegal message of size %zd\n", rcvd);
+    return 0;
+  }
+#ifdef ALLNET_NETPACKET_SUPPORT
+  /* special handling for 40-byte ack packets sent on ethernet,
+   * which get padded with 0s out to 46 bytes */
+  if ((sap->sa_family == AF_PACKET) && (rcvd == 46) &&
+      (buffer [1] == ALLNET_TYPE_ACK) && (memget (buffer + 40, 0, 6)))
+    rcvd = 40;
+#endif /* ALLNET_NETPACKET_SUPPORT */
+  int auth = ((sock->is_global_v4 || sock->is_global_v6) ?
+              is_auth_keepalive (sas, s->random_secret, 
+                                 sizeof (s->random_secret), s->counter,
+                                 buffer, (int)rcvd) : 1);
+  sockets_log_sr (0, "socket_read", buffer, (int)rcvd, sap, alen, -100);
+  *result = record_message (s, rcvd_time, sock, sas, alen,
+                            buffer, (int)rcvd, auth);
+  return 1;
+}
+
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+/* called with the mutex locked.  Returns 1 if a pending datagram was
+ * delivered (and the mutex unlocked), 0 otherwise (mutex still locked) */
+static int deliver_pending (struct socket_set * s, long long int rcvd_time,
+                            struct socket_read_result * result)
+{
+  struct socket_recv_batch * b = s->recv_batch;
+  if ((b == NULL) || (b->next >= b->count))
+    return 0;
+  struct socket_address_set * sock = NULL;
+  int si;
+  for (si = 0; si < s->num_sockets; si++) {
+    if (s->sockets [si].sockfd == b->sockfd) {
+      sock = s->sockets + si;
+      break;
+    }
+  }
+  if (sock == NULL) {   /* socket was deleted, discard its datagrams */
+    b->count = b->next = 0;
+    return 0;
+  }
+  while (b->next < b->count) {
+    int index = b->next++;
+    /* no copy: the result points into the batch, which is only refilled
+     * once all its datagrams have been returned by socket_read */
+    if (deliver_datagram (s, sock, b->datagrams [index], b->sizes [index],
+                          b->addrs [index], b->alens [index],
+                          rcvd_time, result))
+      return 1;
+  }
+  return 0;
+}
+
+/* called with the mutex locked.  Receives as many as SOCKETS_RECV_BATCH
+ * datagrams, the first into buffer, the rest into s->recv_batch.
+ * returns the number of datagrams received, or -1 for errors.
+ * If the batch cannot be allocated, receives at most one datagram */
+static int receive_batch (struct socket_set * s, int sockfd, char * buffer,
+                          int * first_size, struct sockaddr_storage * first_sas,
+                          socklen_t * first_alen)
+{
+  if (s->recv_batch == NULL)
+    s->recv_batch = malloc (sizeof (struct socket_recv_batch));
+  struct socket_recv_batch * b = s->recv_batch;
+  int max = ((b == NULL) ? 1 : SOCKETS_RECV_BATCH);
+  struct mmsghdr msgs [SOCKETS_RECV_BATCH];
+  struct iovec iovs [SOCKETS_RECV_BATCH];
+  memset (msgs, 0, sizeof (msgs));
+  int i;
+  for (i = 0; i < max; i++) {
+    iovs [i].iov_base = ((i == 0) ? buffer : b->buffers [i]);
+    iovs [i].iov_len = SOCKET_READ_MIN_BUFFER;
+    msgs [i].msg_hdr.msg_iov = iovs + i;
+    msgs [i].msg_hdr.msg_iovlen = 1;
+    msgs [i].msg_hdr.msg_name = ((i == 0) ? first_sas : (b->addrs + i));
+    msgs [i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+  }
+  int n = recvmmsg (sockfd, msgs, max, MSG_DONTWAIT, NULL);
+  if (n <= 0)
+    return ((n == 0) ? 0 : -1);
+  *first_size = msgs [0].msg_len;
+  *first_alen = msgs [0].msg_hdr.msg_namelen;
+  if (b != NULL) {
+    b->sockfd = sockfd;
+    b->count = n;
+    b->next = 1;       /* the first has been returned in buffer */
+    for (i = 1; i < n; i++) {
+      b->datagrams [i] = b->buffers [i];
+      b->sizes [i] = msgs [i].msg_len;
+      b->alens [i] = msgs [i].msg_hdr.msg_namelen;
+    }
+  }
+  return n;
+}
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+
+#ifdef ALLNET_SOCKETS_USE_GSO
+/* like receive_batch, for a socket with UDP_GRO enabled.  Receives one
+ * buffer, which may hold several datagrams from the same sender, each
+ * (except perhaps the last) of the size given by the kernel.  The first
+ * datagram is copied into buffer, the others are left in s->recv_batch */
+static int receive_gro (struct socket_set * s, int sockfd, char * buffer,
+                        int * first_size, struct sockaddr_storage * first_sas,
+                        socklen_t * first_alen)
+{
+  if (s->recv_batch == NULL)
+    s->recv_batch = malloc (sizeof (struct socket_recv_batch));
+  struct socket_recv_batch * b = s->recv_batch;
+  if (b == NULL)   /* coalesced datagrams will be truncated, but rarely */
+    return receive_batch (s, sockfd, buffer, first_size, first_sas,
+                          first_alen);
+  struct iovec iov = { .iov_base = b->gro, .iov_len = sizeof (b->gro) };
+  char control [CMSG_SPACE (sizeof (int))];
+  struct msghdr mh;
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_name = first_sas;
+  mh.msg_namelen = sizeof (struct sockaddr_storage);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof (control);
+  ssize_t rcvd = recvmsg (sockfd, &mh, MSG_DONTWAIT);
+  if (rcvd <= 0)
+    return ((rcvd == 0) ? 0 : -1);
+  int segment = (int) rcvd;   /* the size of each datagram but the last */
+  struct cmsghdr * cmsg;
+  for (cmsg = CMSG_FIRSTHDR (&mh); cmsg != NULL; cmsg = CMSG_NXTHDR (&mh, cmsg))
+    if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO) &&
+        (cmsg->cmsg_len >= CMSG_LEN (sizeof (int))))
+      memcpy (&segment, CMSG_DATA (cmsg), sizeof (int));
+  if ((segment <= 0) || (segment > rcvd))
+    segment = (int) rcvd;
+  *first_alen = mh.msg_namelen;
+  int n = 0;
+  int offset = 0;
+  while ((offset < rcvd) && (n < SOCKETS_RECV_PENDING)) {
+    int size = (((rcvd - offset) < segment) ? ((int) rcvd - offset) : segment);
+    if (size > SOCKET_READ_MIN_BUFFER)   /* truncate, as recvfrom would */
+      size = SOCKET_READ_MIN_BUFFER;
+    if (n == 0) {
+      memcpy (buffer, b->gro, size);
+      *first_size = size;
+    } else {
+      b->datagrams [n] = b->gro + offset;
+      b->sizes [n] = size;
+      b->addrs [n] = *first_sas;
+      b->alens [n] = mh.msg_namelen;
+    }
+    n++;
+    offset += segment;
+  }
+  b->sockfd = sockfd;
+  b->count = n;
+  b->next = 1;       /* the first has been returned in buffer */
+  return n;
+}
+#endif /* ALLNET_SOCKETS_USE_GSO */
+
+/* called with the mutex locked.  Returns 1 if a message was received,
+ * in which case *result is filled in and the mutex has been unlocked.
+ * Otherwise the mutex is still locked, and the return value is
+ * 0 if there was nothing to receive on this socket, or -1 for errors */
+static int receive_on_socket (struct socket_set * s,
+                              struct socket_address_set * sock,
+                              char * buffer, long long int rcvd_time,
+                              struct socket_read_result * result)
+{
+  struct sockaddr_storage sas;
+  socklen_t alen = sizeof (sas);
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+  int size = 0;
+#ifdef ALLNET_SOCKETS_USE_GSO
+  int n = ((sock->gro) ?
+           receive_gro (s, sock->sockfd, buffer, &size, &sas, &alen) :
+           receive_batch (s, sock->sockfd, buffer, &size, &sas, &alen));
+#else /* ! ALLNET_SOCKETS_USE_GSO */
+  int n = receive_batch (s, sock->sockfd, buffer, &size, &sas, &alen);
+#endif /* ALLNET_SOCKETS_USE_GSO */
+  ssize_t rcvd = ((n > 0) ? size : n);
+#else /* ! ALLNET_SOCKETS_USE_RECVMMSG */
+  ssize_t rcvd = recvfrom (sock->sockfd, buffer, SOCKET_READ_MIN_BUFFER,
+                           MSG_DONTWAIT, (struct sockaddr *) (&sas), &alen);
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+  int save_errno = errno;
+  if (rcvd >= 0) {
+    if (deliver_datagram (s, sock, buffer, rcvd, sas, alen, rcvd_time, result))
+      return 1;
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+    /* illegal first datagram, but there may be others */
+    if (deliver_pending (s, rcvd_time, result))
+      return 1;
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+    return 0;     /* try the next socket */
+  }
+  if ((save_errno == EAGAIN) || (save_errno == EWOULDBLOCK))
+    return 0;     /* nothing to read after all, try the next socket */
+  static int error_count = 0;
+  if (error_count++ < 30)
+    perror ("get_message recvfrom");
+  if (error_count < 10) {
+    if (save_errno == ENODEV) { /* not sure. 2019/02/13 */
+      printf ("errno %d on socket %d\n", save_errno, sock->sockfd);
+      print_socket_set (s);
+    } else if (save_errno != ECONNREFUSED) {
+      printf ("error number %d on socket %d\n", save_errno, sock->sockfd);
+    }
+  }
+  if ((error_count >= 10) || (save_errno == ECONNREFUSED)) {
+    /* ECONNREFUSED: connected socket closed by peer */
+    result->success = 0;    /* error on this socket */
+    result->sock = sock;
+    int zero = 0; result->success = error_count / zero;  /* crash */
+  }
+  return -1;
+}
+
+/* returns the number of datagrams received by an earlier socket_read
+ * and not yet returned.  socket_read returns these right away */
+int socket_read_pending (struct socket_set * s)
+{
+  int result = 0;
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+  lock ("socket_read_pending");
+  if (s->recv_batch != NULL)
+    result = s->recv_batch->count - s->recv_batch->next;
+  unlock ("socket_read_pending");
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+  return result;
+}
+
 /* called with the mutex locked, unlocks it before returning */
 static struct socket_read_result
   get_message (struct socket_set * s, char * buffer, fd_set * set,
@@ -517,67 +1344,82 @@ static struct socket_read_result
   for (i = 0; i < s->num_sockets; i++) {
     struct socket_address_set * sock = s->sockets + i;
     if (FD_ISSET (sock->sockfd, set)) { 
-      struct sockaddr_storage sas;
-      struct sockaddr * sap = (struct sockaddr *) (&sas);
-      socklen_t alen = sizeof (sas);
-      ssize_t rcvd = recvfrom (sock->sockfd, buffer, SOCKET_READ_MIN_BUFFER,
-                               MSG_DONTWAIT, sap, &alen);
-      int save_errno = errno;
-      /* all packets must have a min header, local packets also have priority */
-      int min = ALLNET_HEADER_SIZE + ((sock->is_local) ? 4 : 0);
-      if ((rcvd >= (ssize_t) min) && (rcvd <= SOCKET_READ_MIN_BUFFER)) {
-#ifdef ALLNET_NETPACKET_SUPPORT
-        /* special handling for 40-byte ack packets sent on ethernet,
-         * which get padded with 0s out to 46 bytes */
-        if ((sap->sa_family == AF_PACKET) && (rcvd == 46) &&
-            (buffer [1] == ALLNET_TYPE_ACK) && (memget (buffer + 40, 0, 6)))
-          rcvd = 40;
-#endif /* ALLNET_NETPACKET_SUPPORT */
-        int auth = ((sock->is_global_v4 || sock->is_global_v6) ?
-                    is_auth_keepalive (sas, s->random_secret, 
-                                       sizeof (s->random_secret), s->counter,
-                                       buffer, (int)rcvd) : 1);
-        sockets_log_sr (0, "socket_read", buffer, (int)rcvd, sap, alen, -100);
-        return record_message (s, rcvd_time, sock, sas, alen,
-                               buffer, (int)rcvd, auth);
-      }
-if (rcvd >= 0) printf ("received illegal message of size %zd\n", rcvd);
-      if (rcvd >= 0)  /* try the next socket */
-        continue;
-      static int error_count = 0;
-      if (error_count++ < 30)
-        perror ("get_message recvfrom");
-      if (error_count < 10) {
-        if (save_errno == ENODEV) { /* not sure. 2019/02/13 */
-          printf ("errno %d on socket %d\n", save_errno, sock->sockfd);
-          print_socket_set (s);
-        } else if (save_errno != ECONNREFUSED) {
-          printf ("error number %d on socket %d\n", save_errno, sock->sockfd);
-        }
-      }
-      if ((error_count >= 10) || (save_errno == ECONNREFUSED)) {
-        /* ECONNREFUSED: connected socket closed by peer */
-        result.success = 0;    /* error on this socket */
-        result.sock = sock;
-        int zero = 0; result.success = error_count / zero;  /* crash */
-      }
-      break;
+      int r = receive_on_socket (s, sock, buffer, rcvd_time, &result);
+      if (r > 0)     /* receive_on_socket unlocked the mutex */
+        return result;
+      if (r < 0)
+        break;
     }
   }
   unlock ("get_message");
   return result;
 }
 
+#ifdef ALLNET_SOCKETS_USE_EVENTS
+/* socket_read using epoll or kqueue.  Unlike select, we can wait
+ * without holding the lock, so we wait for the entire timeout */
+static struct socket_read_result
+  socket_read_events (struct socket_set * s, int event_fd, char * buffer,
+                      int timeout, long long int rcvd_time,
+                      struct socket_read_result r)  /* init'd by caller */
+{
+  int fds [SOCKETS_MAX_EVENTS];
+  int n = event_wait (event_fd, fds, SOCKETS_MAX_EVENTS,
+                      ((timeout == SOCKETS_TIMEOUT_FOREVER) ? -1 : timeout));
+  if (n < 0) {         /* some error */
+    if (errno != EINTR)   /* it is normal to be killed during epoll/kevent */
+      perror ("socket_read_events");
+    r.success = -1;    /* error */
+    return r;
+  }
+  lock ("socket_read_events");
+  int i;
+  for (i = 0; i < n; i++) {
+    /* the socket may have been deleted while we were waiting */
+    struct socket_address_set * sock = NULL;
+    int si;
+    for (si = 0; si < s->num_sockets; si++) {
+      if (s->sockets [si].sockfd == fds [i]) {
+        sock = s->sockets + si;
+        break;
+      }
+    }
+    if (sock == NULL)
+      continue;
+    int res = receive_on_socket (s, sock, buffer, rcvd_time, &r);
+    if (res > 0)     /* receive_on_socket unlocked the mutex */
+      return r;
+    if (res < 0)
+      break;
+  }
+  unlock ("socket_read_events");
+  return r;
+}
+#endif /* ALLNET_SOCKETS_USE_EVENTS */
+
 /* the buffer must have length at least SOCKET_READ_MIN_BUFFER = ALLNET_MTU+4 */
-struct socket_read_result socket_read (struct socket_set * s,
-                                       char * buffer, int timeout,
-                                       long long int rcvd_time)
+static struct socket_read_result
+  socket_read_any (struct socket_set * s, char * buffer, int timeout,
+                   long long int rcvd_time)
 {
   struct socket_read_result r = { .success = 0, .message = NULL, .msize = 0,
                                   .priority = 0, .sock = NULL, .alen = 0,
                                   .socket_address_is_new = 0,
                                   .sav = NULL, .recv_limit_reached = 0 };
   memset (&(r.from), 0, sizeof (r.from));
+#ifdef ALLNET_SOCKETS_USE_RECVMMSG
+  lock ("socket_read pending");
+  if (deliver_pending (s, rcvd_time, &r))
+    return r;   /* deliver_pending unlocked the mutex */
+  unlock ("socket_read pending");
+#endif /* ALLNET_SOCKETS_USE_RECVMMSG */
+#ifdef ALLNET_SOCKETS_USE_EVENTS
+  lock ("socket_read events");
+  int event_fd = ((s->event_fd_valid) ? s->event_fd : -1);
+  unlock ("socket_read events");
+  if (event_fd >= 0)
+    return socket_read_events (s, event_fd, buffer, timeout, rcvd_time, r);
+#endif /* ALLNET_SOCKETS_USE_EVENTS */
   int remaining_time = timeout;
   while ((timeout == SOCKETS_TIMEOUT_FOREVER) || (remaining_time > 0)) {
     lock ("socket_read");
@@ -607,6 +1449,17 @@ struct socket_read_result socket_read (struct socket_set * s,
   return r;
 }
 
+struct socket_read_result socket_read (struct socket_set * s,
+                                       char * buffer, int timeout,
+                                       long long int rcvd_time)
+{
+  struct socket_read_result r = socket_read_any (s, buffer, timeout,
+                                                 rcvd_time);
+  if (r.success > 0)
+    ALLNET_PROBE3 (socket_read, r.message, r.msize, r.priority);
+  return r;
+}
+
 /* any of these may be null, si and ai set to -1 if they are not known. */
 static void send_error (const char * message, int msize, int flags, int res,
                         const struct sockaddr_storage sas, socklen_t alen,
@@ -685,8 +1538,14 @@ check_sav (sav, "send_on_socket");
   return 0;
 }
 
+/* which sockets socket_send_fun sends on */
+#define SEND_ALL_SOCKETS	0
+#define SEND_NO_BROADCAST	1
+#define SEND_ONLY_BROADCAST	2
+
 struct socket_send_data {
   int local_not_remote;
+  int broadcast_mode;
   const char * message;
   int msize;
   struct internet_addr * save_dest_addr; /* may be NULL */
@@ -697,6 +1556,8 @@ struct socket_send_data {
   struct sockaddr_storage * sent_addrs;  /* may be NULL */
   int sent_num;
   int sent_available;
+  socket_send_admit_fun admit;           /* may be NULL */
+  void * admit_ref;
 };
 
 static int socket_send_fun (struct socket_address_set * sock,
@@ -705,6 +1566,9 @@ static int socket_send_fun (struct socket_address_set * sock,
 {
   struct socket_send_data * ssd = (struct socket_send_data *) ref;
 check_sav (sav, "socket_send_fun");
+  if (((ssd->broadcast_mode == SEND_NO_BROADCAST) && (sock->is_broadcast)) ||
+      ((ssd->broadcast_mode == SEND_ONLY_BROADCAST) && (! sock->is_broadcast)))
+    return 1;       /* do not delete */
   if ((sock->is_local == ssd->local_not_remote) &&
       (! same_sockaddr (&(ssd->except_to), ssd->alen,
                         &(sav->addr), sav->alen))) {
@@ -722,6 +1586,9 @@ check_sav (sav, "socket_send_fun");
                         "socket_send_fun: unable to save", sav->alen, 1);
       }
     }
+    if ((ssd->admit != NULL) &&
+        (! ssd->admit (sock, sav, ssd->message, ssd->msize, ssd->admit_ref)))
+      return 1;     /* not sent now, do not delete */
     if (send_on_socket (ssd->message, ssd->msize, ssd->sent_time,
                         sock->sockfd, sav, "socket_send_fun", NULL, -1, -1)) {
       if ((ssd->sent_addrs != NULL) && (ssd->sent_num < ssd->sent_available))
@@ -785,12 +1652,27 @@ int socket_send_out (struct socket_set * s, const char * message,
                      unsigned long long int sent_time,
                      struct sockaddr_storage except_to, socklen_t alen,
                      struct sockaddr_storage * sent_to, int * num_sent)
+{
+  return socket_send_out_admit (s, message, msize, save_dest_address,
+                                sent_time, except_to, alen, sent_to, num_sent,
+                                NULL, NULL);
+}
+
+int socket_send_out_admit (struct socket_set * s, const char * message,
+                           int msize, struct internet_addr * save_dest_address,
+                           unsigned long long int sent_time,
+                           struct sockaddr_storage except_to, socklen_t alen,
+                           struct sockaddr_storage * sent_to, int * num_sent,
+                           socket_send_admit_fun admit, void * ref)
 {
   struct socket_send_data ssd =
     { .message = message, .msize = msize, .save_dest_addr = save_dest_address,
       .sent_time = sent_time, .alen = alen, .local_not_remote = 0, .error = 0,
       .sent_addrs = sent_to, .sent_num = 0,
-      .sent_available = ((num_sent != NULL) ? *num_sent : 0) };
+      .sent_available = ((num_sent != NULL) ? *num_sent : 0),
+      .broadcast_mode = ((s->defer_broadcast) ? SEND_NO_BROADCAST
+                                              : SEND_ALL_SOCKETS),
+      .admit = admit, .admit_ref = ref };
   if (num_sent != NULL) *num_sent = 0;
   memset (&(ssd.except_to), 0, sizeof (ssd.except_to));
   if ((alen > 0) && (alen < sizeof (except_to)))
@@ -802,6 +1684,21 @@ int socket_send_out (struct socket_set * s, const char * message,
   return 1;
 }
 
+int socket_send_broadcast (struct socket_set * s, const char * message,
+                           int msize, unsigned long long int sent_time)
+{
+  struct socket_send_data ssd =
+    { .message = message, .msize = msize, .save_dest_addr = NULL,
+      .sent_time = sent_time, .alen = 0, .local_not_remote = 0, .error = 0,
+      .sent_addrs = NULL, .sent_num = 0, .sent_available = 0,
+      .broadcast_mode = SEND_ONLY_BROADCAST };
+  memset (&(ssd.except_to), 0, sizeof (ssd.except_to));
+  socket_addr_loop (s, socket_send_fun, &ssd);
+  if (ssd.error)
+    return 0;
+  return 1;
+}
+
 struct dec_send_limit_data {
   struct sockaddr_storage addr;
   socklen_t alen;
@@ -885,55 +1782,272 @@ int socket_send_to_ip (int sockfd, const char * message, int msize,
   return 0;
 }
 
+/* adds the message to the batch, and returns the index of the message in
+ * the batch, or -1 if the batch is full */
+int socket_send_batch_add (struct socket_send_batch * b, int sockfd,
+                           const char * message, int msize,
+                           struct sockaddr_storage sas, socklen_t alen)
+{
+  if ((b->count < 0) || (b->count >= SOCKET_SEND_BATCH_MAX))
+    return -1;
+  int index = b->count++;
+  b->sockfds [index] = sockfd;
+  b->messages [index] = message;
+  b->msizes [index] = msize;
+  b->addrs [index] = sas;
+  b->alens [index] = alen;
+  b->sent [index] = 0;
+  return index;
+}
+
+#ifdef ALLNET_SOCKETS_USE_GSO
+/* returns the number of messages, starting at index first, that can be
+ * sent together with one GSO send: to the same address on the same
+ * socket, all but the last of the same size, and the last no larger */
+static int gso_run (const struct socket_send_batch * b, int first)
+{
+  int segment = b->msizes [first];
+  if ((segment > SOCKETS_GSO_MAX_SEGMENT) ||
+      (__atomic_load_n (&gso_disabled, __ATOMIC_RELAXED)))
+    return 1;
+  int bytes = segment;
+  int run = 1;
+  while ((first + run < b->count) && (run < SOCKETS_GSO_MAX_SEGMENTS)) {
+    int next = first + run;
+    if ((b->sockfds [next] != b->sockfds [first]) ||
+        (b->msizes [next] > segment) ||
+        (bytes + b->msizes [next] > SOCKETS_GSO_MAX_BYTES) ||
+        (b->alens [next] != b->alens [first]) ||
+        (memcmp (b->addrs + next, b->addrs + first, b->alens [first]) != 0))
+      break;
+    bytes += b->msizes [next];
+    run++;
+    if (b->msizes [next] < segment)   /* only the last may be smaller */
+      break;
+  }
+  return run;
+}
+
+/* errors that mean this system or route cannot send with UDP_SEGMENT */
+static int gso_unsupported_error (int e)
+{
+  return ((e == EINVAL) || (e == EIO) || (e == EOPNOTSUPP) ||
+          (e == ENOPROTOOPT));
+}
+#endif /* ALLNET_SOCKETS_USE_GSO */
+
+/* sends all the messages in the batch, using sendmmsg where available,
+ * and sets b->sent for each.  Returns the number of messages sent. */
+int socket_send_batch_flush (struct socket_send_batch * b, const char * debug)
+{
+  int count = 0;
+  int i = 0;
+#ifdef ALLNET_SOCKETS_USE_SENDMMSG
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags = MSG_NOSIGNAL;
+#endif /* MSG_NOSIGNAL */
+  /* each msgs entry j sends num [j] messages starting with first [j].
+   * Without GSO, each entry sends one message */
+  struct mmsghdr msgs [SOCKET_SEND_BATCH_MAX];
+  struct iovec iovs [SOCKET_SEND_BATCH_MAX];
+  int first [SOCKET_SEND_BATCH_MAX];
+  int num [SOCKET_SEND_BATCH_MAX];
+#ifdef ALLNET_SOCKETS_USE_GSO
+  union {   /* aligned for struct cmsghdr */
+    char buf [CMSG_SPACE (sizeof (uint16_t))];
+    struct cmsghdr align;
+  } controls [SOCKET_SEND_BATCH_MAX];
+#endif /* ALLNET_SOCKETS_USE_GSO */
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < b->count; i++) {
+    iovs [i].iov_base = (char *) (b->messages [i]);
+    iovs [i].iov_len = b->msizes [i];
+  }
+  int entries = 0;
+  i = 0;
+  while (i < b->count) {
+    int run = 1;
+#ifdef ALLNET_SOCKETS_USE_GSO
+    run = gso_run (b, i);
+#endif /* ALLNET_SOCKETS_USE_GSO */
+    struct msghdr * mh = &(msgs [entries].msg_hdr);
+    mh->msg_iov = iovs + i;   /* the kernel concatenates the messages */
+    mh->msg_iovlen = run;
+    mh->msg_name = b->addrs + i;
+    mh->msg_namelen = b->alens [i];
+#ifdef ALLNET_SOCKETS_USE_GSO
+    if (run > 1) {
+      mh->msg_control = controls [entries].buf;
+      mh->msg_controllen = sizeof (controls [entries].buf);
+      struct cmsghdr * cmsg = CMSG_FIRSTHDR (mh);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+      uint16_t segment = (uint16_t) (b->msizes [i]);
+      memcpy (CMSG_DATA (cmsg), &segment, sizeof (segment));
+    }
+#endif /* ALLNET_SOCKETS_USE_GSO */
+    first [entries] = i;
+    num [entries] = run;
+    entries++;
+    i += run;
+  }
+  int j = 0;
+  while (j < entries) {
+    /* sendmmsg sends on one socket, so send each run of the same sockfd */
+    int sockfd = b->sockfds [first [j]];
+    int run = 1;
+    while ((j + run < entries) && (b->sockfds [first [j + run]] == sockfd))
+      run++;
+    int n = sendmmsg (sockfd, msgs + j, run, flags);
+    int k;
+    if (n <= 0) {   /* entry j was not sent, report it and skip it */
+      int e = errno;
+#ifdef ALLNET_SOCKETS_USE_GSO
+      if ((num [j] > 1) && (gso_unsupported_error (e))) {
+        /* send these messages one at a time, now and from now on */
+        __atomic_store_n (&gso_disabled, 1, __ATOMIC_RELAXED);
+        for (k = first [j]; k < first [j] + num [j]; k++) {
+          b->sent [k] = socket_send_to_ip (sockfd, b->messages [k],
+                                           b->msizes [k], b->addrs [k],
+                                           b->alens [k], debug);
+          if (b->sent [k])
+            count++;
+        }
+        j++;
+        continue;
+      }
+#endif /* ALLNET_SOCKETS_USE_GSO */
+      for (k = first [j]; k < first [j] + num [j]; k++) {
+        struct sockaddr * sap = (struct sockaddr *) (b->addrs + k);
+        sockets_log_sr (1, debug, b->messages [k], b->msizes [k], sap,
+                        b->alens [k], -1);
+        b->sent [k] = 0;
+      }
+      i = first [j];
+      if (unusual_sendto_error (e)) {
+        char desc [1000];
+        snprintf (desc, sizeof (desc), "%s socket_send_batch_flush", debug);
+        send_error (b->messages [i], b->msizes [i], flags, n, b->addrs [i],
+                    b->alens [i], desc, NULL, sockfd, NULL, -1, -1);
+      }
+      j++;
+      continue;
+    }
+    int m;
+    for (m = j; m < j + n; m++) {
+      unsigned int bytes = 0;
+      for (k = first [m]; k < first [m] + num [m]; k++)
+        bytes += b->msizes [k];
+      int all_sent = (msgs [m].msg_len == bytes);
+      for (k = first [m]; k < first [m] + num [m]; k++) {
+        struct sockaddr * sap = (struct sockaddr *) (b->addrs + k);
+        sockets_log_sr (1, debug, b->messages [k], b->msizes [k], sap,
+                        b->alens [k], ((all_sent) ? b->msizes [k] : -1));
+        b->sent [k] = all_sent;
+        if (b->sent [k])
+          count++;
+      }
+    }
+    j += n;   /* if n < run, the next call reports the error */
+  }
+#else /* ! ALLNET_SOCKETS_USE_SENDMMSG */
+  for (i = 0; i < b->count; i++) {
+    b->sent [i] = socket_send_to_ip (b->sockfds [i], b->messages [i],
+                                     b->msizes [i], b->addrs [i], b->alens [i],
+                                     debug);
+    if (b->sent [i])
+      count++;
+  }
+#endif /* ALLNET_SOCKETS_USE_SENDMMSG */
+  return count;
+}
+
 /* send a keepalive to addresses whose sent time + local/remote <= current_time
  * returns the number of messages sent
  * if the keepalive is being sent through the internet,
  * sender and receiver authentications
  * are copied into each keepalive before it is sent
  * do NOT send keepalives to broadcast addresses */
+struct send_keepalive_data {
+  long long int current_time;
+  long long int local;
+  long long int remote;
+  const char * message;            /* basic keepalive */
+  unsigned int msize;
+  const char * message_local;      /* with priority, for local sockets */
+  int msize_local;
+  int count;
+};
+
+static void send_keepalive_fun (struct socket_set * s,
+                                struct socket_timers * ts,
+                                struct socket_timer * t, void * ref)
+{
+  struct send_keepalive_data * skd = (struct send_keepalive_data *) ref;
+  int si, ai;
+  struct socket_address_validity * sav = timer_address (s, t, &si, &ai);
+  if ((sav == NULL) || (s->sockets [si].is_broadcast)) {
+    timer_free (ts, t);
+    return;
+  }
+  struct socket_address_set * sas = s->sockets + si;
+check_sav (sav, "socket_send_keepalives");
+  long long int interval = ((sas->is_local) ? skd->local : skd->remote);
+  if (interval <= 0)
+    interval = 1;
+  if (sav->alive_sent + interval <= skd->current_time) {
+    /* size and msg refer to either message or auth_msg */
+    const char * msg = skd->message;
+    int size = skd->msize;
+    if (sas->is_local) {
+      msg = skd->message_local;
+      size = skd->msize_local;
+    }
+    char auth_msg [ALLNET_MTU];
+    if (sas->is_global_v4 || sas->is_global_v6) {
+      /* an authenticating keepalive, specific to this destination */
+      size = keepalive_auth (auth_msg, sizeof (auth_msg),
+                             sav->addr, s->random_secret,
+                             sizeof (s->random_secret), s->counter,
+                             sav->keepalive_auth);
+      msg = auth_msg;
+    }
+    if (send_on_socket (msg, size, skd->current_time, sas->sockfd, sav,
+                        "socket_send_keepalives", s, si, ai))
+      skd->count++;
+    else    /* try again next time */
+      interval = 1;
+    t->due = skd->current_time + interval;
+  } else {
+    t->due = sav->alive_sent + interval;
+  }
+  wheel_place (&(ts->keepalive), t);
+}
+
 int socket_send_keepalives (struct socket_set * s, long long int current_time,
                             long long int local, long long int remote)
 {
-  int count = 0;
   unsigned int msize;
   /* the basic keepalive, only sent to local processes */
   const char * message = keepalive_packet (&msize); /* small, w/o auth */
   char message_with_priority [ALLNET_MTU + 4];
-  if (local)
-    add_priority (message, msize, ALLNET_PRIORITY_EPSILON,
-                  message_with_priority, sizeof (message_with_priority));
-  int msize_local = msize + 4;
-  int si;
-  for (si = 0; si < s->num_sockets; si++) {
-    struct socket_address_set * sas = &(s->sockets [si]);
-    if (sas->is_broadcast)
-      continue;
-    /* size and msg refer to either message (above) or auth_msg (below) */
-    const char * msg = message;
-    int size = msize;
-    if (sas->is_local) {
-      msg = message_with_priority;
-      size = msize_local;
-    }
-    int ai;
-    for (ai = 0; ai < sas->num_addrs; ai++) {
-      struct socket_address_validity * sav = &(sas->send_addrs [ai]);
-check_sav (sav, "socket_send_keepalives");
-      char auth_msg [ALLNET_MTU];
-      if (sas->is_global_v4 || sas->is_global_v6) {
-        /* an authenticating keepalive, specific to this destination */
-        size = keepalive_auth (auth_msg, sizeof (auth_msg),
-                               sav->addr, s->random_secret,
-                               sizeof (s->random_secret), s->counter,
-                               sav->keepalive_auth);
-        msg = auth_msg;
-      }
-      if (send_on_socket (msg, size, current_time, sas->sockfd, sav,
-                          "socket_send_keepalives", s, si, ai))
-        count++;
-    }
-  }
-  return count;
+  add_priority (message, msize, ALLNET_PRIORITY_EPSILON,
+                message_with_priority, sizeof (message_with_priority));
+  struct send_keepalive_data skd =
+    { .current_time = current_time, .local = local, .remote = remote,
+      .message = message, .msize = msize,
+      .message_local = message_with_priority, .msize_local = msize + 4,
+      .count = 0 };
+  lock ("socket_send_keepalives");
+  struct socket_timers * ts = timers_get (s);
+  ts->local_interval = ((local > 0) ? local : 1);
+  ts->remote_interval = ((remote > 0) ? remote : 1);
+  wheel_advance (s, ts, &(ts->keepalive), current_time,
+                 send_keepalive_fun, &skd);
+  unlock ("socket_send_keepalives");
+  return skd.count;
 }
 
 /* create a socket and bind it as appropriate for the given address
@@ -951,12 +2065,33 @@ int socket_create_bind (struct socket_set * s, int is_local,
     if (! quiet) perror ("socket_create_bind: socket");
     return -1;
   }
+#ifdef SO_REUSEPORT
+  int reuse = 1;
+  if ((s->reuse_port) && (! is_local) &&
+      (setsockopt (sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                   sizeof (reuse)) != 0) && (! quiet))
+    perror ("socket_create_bind: setsockopt SO_REUSEPORT");
+#endif /* SO_REUSEPORT */
   if (bind (sockfd, sap, alen) != 0) {
     if (! quiet) perror ("socket_create_bind: bind");
     return -1;
   }
-  if (socket_add (s, sockfd, is_local, is_global_v6, is_global_v4, 0))
+  if (socket_add (s, sockfd, is_local, is_global_v6, is_global_v4, 0)) {
+#ifdef ALLNET_SOCKETS_USE_GSO
+    /* enabled with the lock held, so socket_read always knows whether
+     * a datagram received on this socket may be coalesced */
+    int one = 1;
+    lock ("socket_create_bind");
+    int si;
+    for (si = 0; si < s->num_sockets; si++)
+      if ((s->sockets [si].sockfd == sockfd) && (! is_local) &&
+          ((sap->sa_family == AF_INET) || (sap->sa_family == AF_INET6)) &&
+          (setsockopt (sockfd, SOL_UDP, UDP_GRO, &one, sizeof (one)) == 0))
+        s->sockets [si].gro = 1;
+    unlock ("socket_create_bind");
+#endif /* ALLNET_SOCKETS_USE_GSO */
     return sockfd;
+  }
   if (! quiet) printf ("unable to add %d socket %d\n", sap->sa_family, sockfd);
   return -1;
 }
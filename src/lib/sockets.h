@@ -34,6 +34,7 @@ struct socket_address_validity {
   int send_limit;                /* num packets can send, 0 if no send limit */
   int send_limit_on_recv;        /* new send limit on recv, 0 to disable */
   char keepalive_auth [KEEPALIVE_AUTHENTICATION_SIZE];  /* send with keepalives */
+  unsigned long long int timer_id;  /* set by socket_address_add */
 };
 
 struct socket_address_set {
@@ -44,14 +45,44 @@ struct socket_address_set {
   int is_broadcast;              /* true if added to support broadcasts */; 
   int num_addrs;
   struct socket_address_validity * send_addrs;
+  /* hash index on the address, maintained by sockets.c.  Each entry is
+   * -1 or the position of the address in send_addrs.  NULL if not yet
+   * built, in which case the next lookup builds it */
+  int * addr_index;
+  int addr_index_size;           /* a power of two if addr_index != NULL */
+  int gro;                       /* true if UDP_GRO is enabled, sockets.c */
 };
 
+/* datagrams received together by socket_read, defined in sockets.c */
+struct socket_recv_batch;
+/* keepalive and expiration timers, defined in sockets.c */
+struct socket_timers;
+
 struct socket_set {
   int num_sockets;
   struct socket_address_set * sockets;
+  /* datagrams already received but not yet returned by socket_read.
+   * zero-initializing the socket_set gives recv_batch = NULL */
+  struct socket_recv_batch * recv_batch;
+  /* if the system supports it (epoll or kqueue), the sockets are also
+   * registered with an event fd, so socket_read need not use select.
+   * zero-initializing the socket_set gives event_fd_valid = 0 */
+  int event_fd_valid;
+  int event_fd;
+  /* socket_send_keepalives and socket_update_time only look at addresses
+   * whose timers are due.  zero-initializing gives timers = NULL */
+  struct socket_timers * timers;
   /* needed to send authentication in keepalives */
   char random_secret [KEEPALIVE_AUTHENTICATION_SIZE];
   uint64_t counter;
+  /* if nonzero, socket_send_out does not send on broadcast sockets, and
+   * the caller sends broadcasts with socket_send_broadcast (see abc.h).
+   * zero-initializing gives defer_broadcast = 0, sending at once */
+  int defer_broadcast;
+  /* if nonzero, socket_create_bind lets other processes bind the same
+   * port for non-local sockets (SO_REUSEPORT, where supported).
+   * zero-initializing gives reuse_port = 0, the port is not shared */
+  int reuse_port;
 };
 
 /* return 1 if was able to add, and 0 otherwise (e.g. if already in the set) */
@@ -80,7 +111,8 @@ extern int socket_addr_loop (struct socket_set * s,
 /* only messages sent and received on a local socket have a priority */
 struct socket_read_result {
   int success;                   /* other fields only valid if this is 1 */
-  char * message;                /* points to the buffer passed as parameter */
+  char * message;                /* the buffer passed as parameter, or */
+                                 /* a receive buffer in the socket set */
   int msize;
   unsigned int priority;         /* valid for local messages, otherwise 1 */
   struct socket_address_set * sock;
@@ -97,6 +129,8 @@ struct socket_read_result {
  * returns success = 1 and fields should be valid, and
  * updates the socket_address_validity's alive_rcvd to rcvd_time.
  * the pointers point into the socket_set or buffer, do not free.
+ * message is only valid until the next call to socket_read, and
+ * may be modified (e.g. to increment the hop count) until then.
  * the buffer must have size at least ALLNET_MTU + 4 (the + 4 is important!)
  * special cases of "success": 
  *   if the address is not found in the socket set, socket_address_is_new
@@ -111,6 +145,11 @@ struct socket_read_result {
 extern struct socket_read_result socket_read (struct socket_set * s,
                                               char * buffer, int timeout,
                                               long long int rcvd_time);
+/* where supported, socket_read receives up to SOCKETS_RECV_BATCH datagrams
+ * at a time, and returns the remaining ones on subsequent calls without
+ * waiting.  socket_read_pending returns the number of these datagrams */
+#define SOCKETS_RECV_BATCH	16
+extern int socket_read_pending (struct socket_set * s);
 /* returns 1 if the receive limit was updated, 0 otherwise */
 extern int socket_update_recv_limit (int new_recv_limit, struct socket_set * s,
                                      struct sockaddr_storage addr,
@@ -139,6 +178,27 @@ extern int socket_send_out (struct socket_set * s, const char * message,
                             unsigned long long int sent_time,
                             struct sockaddr_storage except_to, socklen_t alen,
                             struct sockaddr_storage * sent_to, int * num_sent);
+/* the same as socket_send_out, but before sending to each address,
+ * calls admit, and only sends if admit returns 1.  If admit returns 0,
+ * the address is skipped (admit may have queued the message to send
+ * later).  ref is passed to admit */
+typedef int (* socket_send_admit_fun) (struct socket_address_set * sock,
+                                       struct socket_address_validity * sav,
+                                       const char * message, int msize,
+                                       void * ref);
+extern int socket_send_out_admit (struct socket_set * s, const char * message,
+                                  int msize,
+                                  struct internet_addr * save_dest_address,
+                                  unsigned long long int sent_time,
+                                  struct sockaddr_storage except_to,
+                                  socklen_t alen,
+                                  struct sockaddr_storage * sent_to,
+                                  int * num_sent,
+                                  socket_send_admit_fun admit, void * ref);
+/* the same as socket_send_out, but only sends on broadcast sockets,
+ * whether or not s->defer_broadcast is set */
+extern int socket_send_broadcast (struct socket_set * s, const char * message,
+                                  int msize, unsigned long long int sent_time);
 /* send only to the given socket and address */
 extern int socket_send_to (const char * message, int msize,
                            unsigned int priority,
@@ -151,6 +211,37 @@ extern int socket_send_to (const char * message, int msize,
 extern int socket_send_to_ip (int sockfd, const char * message, int msize,
                               struct sockaddr_storage sas, socklen_t alen,
                               const char * debug);
+/* a socket_send_batch collects messages to be sent to addresses that
+ * may not be in a socket set (as in socket_send_to_ip), so they can all
+ * be sent with as few system calls as possible.  The messages are not
+ * copied, and must remain valid until socket_send_batch_flush returns.
+ * Where supported, consecutive messages of the same size to the same
+ * address are sent together with segmentation offload, so a train of
+ * messages to one peer should be added in order.
+ * A zero-initialized socket_send_batch is empty. */
+#define SOCKET_SEND_BATCH_MAX	64
+struct socket_send_batch {
+  int count;
+  int sockfds [SOCKET_SEND_BATCH_MAX];
+  const char * messages [SOCKET_SEND_BATCH_MAX];
+  int msizes [SOCKET_SEND_BATCH_MAX];
+  struct sockaddr_storage addrs [SOCKET_SEND_BATCH_MAX];
+  socklen_t alens [SOCKET_SEND_BATCH_MAX];
+  /* set by socket_send_batch_flush: 1 if the message was sent, 0 if not */
+  int sent [SOCKET_SEND_BATCH_MAX];
+};
+/* adds the message to the batch, and returns the index of the message in
+ * the batch, or -1 if the batch is full */
+extern int socket_send_batch_add (struct socket_send_batch * b, int sockfd,
+                                  const char * message, int msize,
+                                  struct sockaddr_storage sas, socklen_t alen);
+/* sends all the messages in the batch, using sendmmsg where available,
+ * and sets b->sent for each.  Returns the number of messages sent.
+ * b->count is left unchanged, so the caller can examine b->sent,
+ * and must be set to 0 before the batch is reused */
+extern int socket_send_batch_flush (struct socket_send_batch * b,
+                                    const char * debug);
+
 /* send a keepalive to addresses whose sent time + local/remote <= current_time
  * returns the number of messages sent
  * if the keepalive is being sent through the internet,
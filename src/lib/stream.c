@@ -51,36 +51,75 @@ static void update_counter (char * bytes, uint64_t value)
   writeb64 (bytes + write_offset, value);
 }
 
-/* serves two purposes: initializing the block, or getting the next aes char */
-static int aes_next_byte (struct allnet_stream_encryption_state * sp,
-                          char * block, int init)
+/* only the first STREAM_BLOCK_BYTES of each encrypted counter block are
+ * used for the keystream (this has always been so, and must stay so for
+ * compatibility).  block_offset, if STREAM_BLOCK_BYTES, means the block
+ * for counter has been used up */
+#define STREAM_BLOCK_BYTES	(WP_AES_BLOCK_SIZE - 1)
+/* the number of blocks encrypted at once */
+#define STREAM_CHUNK_BLOCKS	16
+
+/* xors size bytes of in with the keystream, starting from sp->counter
+ * and sp->block_offset, which are updated.  key is sp->key, expanded */
+static void stream_crypt (struct allnet_stream_encryption_state * sp,
+                          const struct wp_aes_key * key,
+                          const char * in, int size, char * out)
 {
-  if ((init) || (((sp->block_offset + 1) % WP_AES_BLOCK_SIZE) == 0)) {
-    if (! init) {
-      (sp->counter)++;
-      sp->block_offset = 0;
-    }
+  if (sp->block_offset >= STREAM_BLOCK_BYTES) {
+    (sp->counter)++;
+    sp->block_offset = 0;
+  }
+  while (size > 0) {
+    int nblocks = (sp->block_offset + size + STREAM_BLOCK_BYTES - 1) /
+                  STREAM_BLOCK_BYTES;
+    if (nblocks > STREAM_CHUNK_BLOCKS)
+      nblocks = STREAM_CHUNK_BLOCKS;
     char counter [WP_AES_BLOCK_SIZE];
     update_counter (counter, sp->counter);
-    if (! allnet_aes_encrypt_block (sp->key, counter, block)) {
-      printf ("aes unknown error, unable to encrypt\n");
-      return -1;
+    char keystream [STREAM_CHUNK_BLOCKS * WP_AES_BLOCK_SIZE];
+    wp_aes_ctr_blocks (key, counter, keystream, nblocks);
+    int b;
+    for (b = 0; b < nblocks; b++) {
+      const char * block = keystream + b * WP_AES_BLOCK_SIZE;
+      int n = STREAM_BLOCK_BYTES - sp->block_offset;
+      if (n > size)
+        n = size;
+      int i;
+      for (i = 0; i < n; i++)
+        out [i] = in [i] ^ block [sp->block_offset + i];
+      in += n;
+      out += n;
+      size -= n;
+      sp->block_offset += n;
+      if (size <= 0)   /* the block may be only partly used */
+        break;
+      (sp->counter)++;
+      sp->block_offset = 0;
     }
-    if (init)
-      return 0;
   }
-  int index = sp->block_offset;
-  (sp->block_offset)++;
-  return block [index];
 }
 
-/* allnet_stream_encrypt_buffer encrypts a buffer given an encryption state
- * state must have been initialized by allnet_stream_init
- * rsize must be >= tsize + counter_size + hash_size specified for state
- * returns the encrypted size for success, 0 for failure */
-int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
-                                  const char * text, int tsize,
-                                  char * result, int rsize)
+/* advances sp->counter and sp->block_offset past size bytes of keystream,
+ * exactly as stream_crypt does */
+static void stream_advance (struct allnet_stream_encryption_state * sp,
+                            int size)
+{
+  if (size <= 0)
+    return;
+  if (sp->block_offset >= STREAM_BLOCK_BYTES) {
+    (sp->counter)++;
+    sp->block_offset = 0;
+  }
+  /* as in stream_crypt, a block that is used up exactly is left with
+   * block_offset == STREAM_BLOCK_BYTES */
+  uint64_t end = sp->block_offset + (uint64_t) size - 1;
+  sp->counter += end / STREAM_BLOCK_BYTES;
+  sp->block_offset = (int) (end % STREAM_BLOCK_BYTES) + 1;
+}
+
+/* checks the sizes for allnet_stream_encrypt_buffer, returns 1 if OK */
+static int stream_check_sizes (const struct allnet_stream_encryption_state
+                               * sp, int tsize, int rsize)
 {
   if (tsize <= 0) {
     printf ("error: aes encryption needs at least 1 text byte, %d given\n",
@@ -93,14 +132,15 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
     printf ("but only %d available\n", rsize);
     return 0;
   }
-  /* compute the initial counter value, measured in bytes */
-  uint64_t send_counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
-  /* encrypt the data */
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < tsize; i++)
-    result [i] = text [i] ^ aes_next_byte (sp, crypt_block, 0);
+  return 1;
+}
+
+/* adds the counter and hmac after tsize bytes of ciphertext in result,
+ * returns the encrypted size */
+static int stream_add_counter_hmac (const struct allnet_stream_encryption_state
+                                    * sp, uint64_t send_counter,
+                                    char * result, int tsize)
+{
   int written = tsize;
   /* write the least significant sp->counter_size bytes of the send
    * counter to the result */
@@ -135,6 +175,95 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
   return written;
 }
 
+/* allnet_stream_encrypt_buffer encrypts a buffer given an encryption state
+ * state must have been initialized by allnet_stream_init
+ * rsize must be >= tsize + counter_size + hash_size specified for state
+ * returns the encrypted size for success, 0 for failure */
+int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
+                                  const char * text, int tsize,
+                                  char * result, int rsize)
+{
+  if (! stream_check_sizes (sp, tsize, rsize))
+    return 0;
+  /* compute the initial counter value, measured in bytes */
+  uint64_t send_counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
+  /* encrypt the data */
+  struct wp_aes_key key;
+  wp_aes_set_key (ALLNET_STREAM_KEY_SIZE, sp->key, &key);
+  stream_crypt (sp, &key, text, tsize, result);
+  return stream_add_counter_hmac (sp, send_counter, result, tsize);
+}
+
+/* computes the next ksize bytes of keystream and advances the state
+ * past them, as described in stream.h */
+void allnet_stream_keystream (struct allnet_stream_encryption_state * sp,
+                              char * keystream, int ksize)
+{
+  if (ksize <= 0)
+    return;
+  struct wp_aes_key key;
+  wp_aes_set_key (ALLNET_STREAM_KEY_SIZE, sp->key, &key);
+  memset (keystream, 0, ksize);
+  stream_crypt (sp, &key, keystream, ksize, keystream);
+}
+
+/* like allnet_stream_encrypt_buffer, with precomputed keystream */
+int allnet_stream_encrypt_keystream (struct allnet_stream_encryption_state
+                                     * sp, const char * keystream,
+                                     const char * text, int tsize,
+                                     char * result, int rsize)
+{
+  if (! stream_check_sizes (sp, tsize, rsize))
+    return 0;
+  uint64_t send_counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
+  int i;
+  for (i = 0; i < tsize; i++)
+    result [i] = text [i] ^ keystream [i];
+  stream_advance (sp, tsize);
+  return stream_add_counter_hmac (sp, send_counter, result, tsize);
+}
+
+/* the position of the packet in the stream, from the counter bytes in
+ * the packet, as described in stream.h */
+uint64_t
+  allnet_stream_packet_position (const struct allnet_stream_encryption_state
+                                 * sp, const char * packet, int psize)
+{
+  uint64_t counter = allnet_stream_position (sp);
+  if ((sp->counter_size <= 0) ||
+      (psize < sp->counter_size + sp->hash_size))
+    return counter;
+  char counter_bytes [sizeof (uint64_t)];
+  memset (counter_bytes, 0, sizeof (counter_bytes));
+  unsigned int num_bytes = sp->counter_size;
+  if (num_bytes > sizeof (uint64_t))
+    num_bytes = sizeof (uint64_t);
+  memcpy (counter_bytes + (sizeof (uint64_t) - num_bytes),
+          packet + (psize - sp->hash_size - num_bytes), num_bytes);
+  uint64_t received_counter = readb64 (counter_bytes);
+  int shift = 8 * num_bytes;
+  if (shift >= 64)
+    return received_counter;
+  /* only the low bits are sent.  The sender's counter is the one with
+   * these low bits that is closest to ours, so a packet that is lost or
+   * out of order where the low bits wrap around does not throw off the
+   * high bits, for this and all later packets */
+  uint64_t window = ((uint64_t) 1) << shift;
+  uint64_t result = (((counter >> shift) << shift) | received_counter);
+  if ((result > counter) && (result - counter > window / 2) &&
+      (result >= window))
+    result -= window;
+  else if ((result < counter) && (counter - result > window / 2))
+    result += window;
+  return result;
+}
+
+uint64_t
+  allnet_stream_position (const struct allnet_stream_encryption_state * sp)
+{
+  return sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
+}
+
 /* allnet_stream_encrypt_buffer decrypts a buffer given an encryption state
  * the buffer must normally have been created by a corresponding call to
  * allnet_stream_encrypt_buffer, usually on a remote system.
@@ -183,31 +312,14 @@ int allnet_stream_decrypt_buffer (struct allnet_stream_encryption_state * sp,
     }
   }
   /* hmac checks out, decrypt the packet */
-  uint64_t counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
-  if (sp->counter_size > 0) {
-    char counter_bytes [sizeof (uint64_t)];
-    memset (counter_bytes, 0, sizeof (counter_bytes));
-    unsigned int num_bytes = sp->counter_size;
-    if (num_bytes > sizeof (uint64_t))
-      num_bytes = sizeof (uint64_t);
-    memcpy (counter_bytes + (sizeof (uint64_t) - num_bytes),
-            packet + (psize - sp->hash_size - num_bytes), num_bytes);
-    uint64_t received_counter = readb64 (counter_bytes);
-    int shift = 8 * num_bytes;
-    if (shift >= 64)
-      counter = received_counter;
-    else
-      counter = (((counter >> shift) << shift) | received_counter);
-  }
+  uint64_t counter = allnet_stream_packet_position (sp, packet, psize);
   sp->block_offset = counter % WP_AES_BLOCK_SIZE;
   sp->counter = counter / WP_AES_BLOCK_SIZE;
   /* decrypt and return */
   int rsize = psize - (sp->counter_size + sp->hash_size);
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < rsize; i++)
-    text [i] = packet [i] ^ aes_next_byte (sp, crypt_block, 0);
+  struct wp_aes_key key;
+  wp_aes_set_key (ALLNET_STREAM_KEY_SIZE, sp->key, &key);
+  stream_crypt (sp, &key, packet, rsize, text);
   return 1;
 }
 
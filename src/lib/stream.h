@@ -57,6 +57,25 @@ extern int
                                 const char * text, int tsize,
                                 char * result, int rsize);
 
+/* allnet_stream_keystream computes the next ksize bytes of keystream that
+ * allnet_stream_encrypt_buffer would use, and advances the state past them.
+ * Called on a copy of the encrypting state, perhaps in another thread,
+ * this computes the keystream ahead of time, to be used in order with
+ * allnet_stream_encrypt_keystream on the original state */
+extern void
+  allnet_stream_keystream (struct allnet_stream_encryption_state * state,
+                           char * keystream, int ksize);
+
+/* same as allnet_stream_encrypt_buffer, but the text is xor'd with the
+ * given keystream, which must be the next tsize bytes of keystream for
+ * this state, as computed by allnet_stream_keystream.
+ * returns the encrypted size for success, 0 for failure */
+extern int
+  allnet_stream_encrypt_keystream (struct allnet_stream_encryption_state
+                                   * state, const char * keystream,
+                                   const char * text, int tsize,
+                                   char * result, int rsize);
+
 /* allnet_stream_decrypt_buffer decrypts a buffer given an encryption state
  * the buffer must normally have been created by a corresponding call to
  * allnet_stream_encrypt_buffer, usually on a remote system.
@@ -72,4 +91,18 @@ extern int
                                 const char * packet, int psize,
                                 char * text, int tsize);
 
+/* the position in the stream of the next buffer to be encrypted, or of
+ * the end of the last buffer decrypted.  Positions increase with each
+ * buffer encrypted, so they may be used to put received buffers in order */
+extern uint64_t
+  allnet_stream_position (const struct allnet_stream_encryption_state * state);
+
+/* the position that allnet_stream_decrypt_buffer will use to decrypt the
+ * packet, that is, the position of the beginning of the buffer that was
+ * encrypted.  If counter_size < 8, among the positions with the low bytes
+ * sent in the packet, this is the one closest to the current position */
+extern uint64_t
+  allnet_stream_packet_position (const struct allnet_stream_encryption_state
+                                 * state, const char * packet, int psize);
+
 #endif /* STREAM_ENCRYPTION_H */
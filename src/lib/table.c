@@ -11,23 +11,16 @@
 #include "table.h"
 #include "util.h"
 
-/* a table is an array of pointers to entries, each of which may
- * point to another entry */
-struct table_entry {
-  struct table_entry * next;
-  char data [0];    /* actually, table->bytes_per_entry of data */
-};
-
 void init_table (struct table * table)
 {
   table->num_entries = 0;
   table->num_slots = 0;
   table->bytes_per_entry = 0;
-  /* table->bytes_per_entry = 0; */
+  table->prefixes = NULL;
+  table->slot_start = NULL;
+  table->data = NULL;
   table->storage_size = 0;
-  table->table = NULL;
   table->storage = NULL;
-  table->freeptr = NULL;
 }
 
 /* returns the correct result except when n = 0, and the correct
@@ -61,19 +54,16 @@ static int round_up_power_two (int n)
 }
 
 /* returns 0 if it fails, otherwise the number of bytes used */
+/* the table may have fewer than num_entries, if max_bytes is too small */
 static int init_table_size (struct table * table, int num_entries,
                             int num_data_bytes, int max_bytes)
 {
-  int needed_per_slot = sizeof (struct table_entry *);
-  int needed_per_entry = sizeof (struct table_entry) + num_data_bytes;
-  if (needed_per_entry % 8 != 0) {
-  /* make the size a multiple of 8 bytes, which gives 64-bit alignment */
-    int mod = needed_per_entry % 8;
-    needed_per_entry += 8 - mod;
-  }
+  int needed_per_slot = sizeof (int);
+  int needed_per_entry = sizeof (uint64_t) + num_data_bytes;
 
   int num_slots = round_up_power_two (num_entries);
-  int needed = needed_per_entry * num_entries + num_slots * needed_per_slot;
+  int needed = needed_per_entry * num_entries +
+               (num_slots + 1) * needed_per_slot;
 /*
   printf ("needed is %d * %d + %d * %d = %d\n",
           needed_per_entry, num_entries, num_slots, needed_per_slot, needed);
@@ -82,9 +72,13 @@ static int init_table_size (struct table * table, int num_entries,
     /* slight approximation -- assume we need twice as many slots as table
        entries.  This is safe, but may give us somewhat fewer entries than
        we could otherwise have. */
-    num_entries = max_bytes / (needed_per_entry + 2 * needed_per_slot);
+    num_entries = (max_bytes - needed_per_slot) /
+                  (needed_per_entry + 2 * needed_per_slot);
+    if (num_entries < 0)
+      num_entries = 0;
     num_slots = round_up_power_two (num_entries);
-    needed = needed_per_entry * num_entries + num_slots * needed_per_slot;
+    needed = needed_per_entry * num_entries +
+             (num_slots + 1) * needed_per_slot;
 /*
     printf ("new needed is %d * %d + %d * %d = %d\n",
             needed_per_entry, num_entries, num_slots, needed_per_slot, needed);
@@ -101,18 +95,16 @@ static int init_table_size (struct table * table, int num_entries,
   if (table->storage != NULL)
     free (table->storage);
   table->storage = new_space;
-  /* put slots (i.e. the table) after the entries */
-  int offset = num_entries * needed_per_entry;
-  table->table = ((struct table_entry **) (table->storage + offset));
-  /* the first entry is at the beginning of storage */
-  table->freeptr = table->storage;
+  /* the prefixes first, for 64-bit alignment, then the slots, then data */
+  table->prefixes = (uint64_t *) new_space;
+  table->slot_start =
+    (int *) (new_space + num_entries * sizeof (uint64_t));
+  table->data = ((char *) (table->slot_start)) +
+                (num_slots + 1) * needed_per_slot;
   table->num_entries = num_entries;
   table->num_slots = num_slots;
   table->bytes_per_entry = num_data_bytes;
   table->storage_size = needed;
-  int i;
-  for (i = 0; i < num_slots; i++)
-    table->table [i] = NULL;
 /*
   printf ("initialized %d-byte table %d entries %d user bytes, %d slots\n",
           needed, num_entries, num_data_bytes, num_slots);
@@ -120,6 +112,17 @@ static int init_table_size (struct table * table, int num_entries,
   return needed;
 }
 
+/* the first 8 bytes of the key (or fewer, if bytes < 8), as a
+ * big-endian number, so comparing prefixes compares the leading bits */
+static uint64_t key_prefix (const char * key, int bytes)
+{
+  uint64_t result = 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    result = (result << 8) | ((i < bytes) ? (key [i] & 0xff) : 0);
+  return result;
+}
+
 #if 0
 /* like memcmp, bur for fewer than 8 bits */
 static int bitcmp (char b1, char b2, int bits)
@@ -166,25 +169,26 @@ static void get_indices (char * bitstring, int bits, int num_slots,
     bits_to_use = bits;
   int index = 0;
   int i = 0;
-  while (bits_to_use >= 8) {
+  int remaining = bits_to_use;
+  while (remaining >= 8) {
     index = ((index << 8) | (bitstring [i] & 0xff));
-    bits_to_use -= 8;
+    remaining -= 8;
     i++;
   }
-  if (bits_to_use > 0)
-    index = ((index << bits_to_use) |
-             ((bitstring [i] & 0xff) >> (8 - bits_to_use)));
-  if (bits_to_use <= bits) {
+  if (remaining > 0)
+    index = ((index << remaining) |
+             ((bitstring [i] & 0xff) >> (8 - remaining)));
+  if (log2 <= bits) {
     *first_index = index;
     *last_index  = index;
   } else {
-    *first_index = index << (bits_to_use - bits);
+    *first_index = index << (log2 - bits);
     /* next statement does not work if
          (index + 1) << (bits_to_use - bits) >= 2^32,
        which implies a 4GB table, which leads to negative indices anyway.
        so it should be OK
      */
-    *last_index = ((index + 1) << (bits_to_use - bits)) - 1;
+    *last_index = ((index + 1) << (log2 - bits)) - 1;
   }
 /*
   printf ("get_indices (%02x %02x %02x %02x, %d, %d) => %d, %d\n",
@@ -232,93 +236,39 @@ int table_find (char * bitstring, int bits, struct table * table,
     print_not_implemented = 0;
   }
 
-  if (table->table == NULL)
+  if (table->num_entries <= 0)
     return 0;
 
   int first, last;
   get_indices (bitstring, bits, table->num_slots, &first, &last);
-  while (first <= last) {
-    struct table_entry * entry = table->table [first];
-    while (entry != NULL) {
-      /* print_table_entry (first, entry, table->bytes_per_entry); */
-      if (matches ((unsigned char *) (entry->data), table->bytes_per_entry * 8,
-                   (unsigned char *) bitstring, bits))
-        return 1;
-      /* printf ("no match on entry\n"); */
-      entry = entry->next;
+  int bpe = table->bytes_per_entry;
+  int cmp_bits = bits;
+  if (cmp_bits > bpe * 8)
+    cmp_bits = bpe * 8;
+  uint64_t mask = 0;
+  if (cmp_bits >= 64)
+    mask = ~((uint64_t) 0);
+  else if (cmp_bits > 0)
+    mask = (~((uint64_t) 0)) << (64 - cmp_bits);
+  uint64_t key = key_prefix (bitstring, (cmp_bits + 7) / 8) & mask;
+  /* the entries of slots first..last are contiguous */
+  int end = table->slot_start [last + 1];
+  int i;
+  for (i = table->slot_start [first]; i < end; i++) {
+    if ((table->prefixes [i] & mask) != key)
+      continue;
+    char * entry = table->data + i * bpe;
+    if ((cmp_bits <= 64) ||
+        (matches ((unsigned char *) entry, bpe * 8,
+                  (unsigned char *) bitstring, bits))) {
+      *data = entry;
+      *dsize = bpe;
+      return 1;
     }
-    first++;
   }
   return 0;   /* not found */
 }
 
-/* everything should have been allocated, so error checking is only for
- * debugging */
-static void table_add (struct table * table, char * data, int dsize)
-{
-  int first, last;
-  get_indices (data, dsize * 8, table->num_slots, &first, &last);
-  if (first != last) {
-    printf ("error: table_add dsize %d less than %d needed fro addressing\n",
-            dsize * 8, log2_floor (table->num_slots));
-    exit (1);
-  }
-  /* index to use is first == last */
-  int entry_size = 8;   /* to do: fix this (was: table->bytes_per_entry;) */
-  struct table_entry * new = (struct table_entry *) table->freeptr;
-  if (table->freeptr + entry_size > ((char *) table->table)) { /* overflow */
-    static int printed = 0;
-    if (printed == 0) {  /* only print once */
-      printf ("warning: out of space for new table entries\n");
-/*
-      printf ("warning: out of space for table entries, %p %p %d\n",
-              table->freeptr, table->table, entry_size);
-*/
-      printed = 1;
-    }
-    return;
-  }
-  table->freeptr += entry_size;
-  /* link the new entry to the old entry (if any) */
-  new->next = table->table [first];
-  if (dsize > table->bytes_per_entry)
-    dsize = table->bytes_per_entry;
-  memcpy (new->data, data, dsize);
-  table->table [first] = new;
-  /* printf ("added new entry at index %d\n", first); */
-}
-
-static int countlines (int fd, int maxlen)
-{
-  if (lseek (fd, 0, SEEK_SET) == ((off_t) -1)) {
-    perror ("countlines lseek");
-    return 0;
-  }
-  int result = 0;
-  ssize_t r;   /* result from reading */
-  int this_line = 0;   /* how many bytes in this line */
-  do {
-    char buf [1];
-    r = read (fd, buf, 1);
-    if ((r == 1) && (buf [0] == '\n')) {
-      if (this_line == maxlen)
-        result++;
-      this_line = 0;
-    } else if (r == 1) {
-      this_line++;
-    }
-  } while (r == 1);
-  if (r < 0) {
-    perror ("table read");
-    return 0;
-  }
-  if (lseek (fd, 0, SEEK_SET) == ((off_t) -1)) {
-    perror ("counlines 2 lseek");
-    return 0;
-  }
-  return result;
-}
-
 static int hexvalue (int c)
 {
   if ((c >= '0') && (c <= '9'))
@@ -327,45 +277,54 @@ static int hexvalue (int c)
     return (c - 'a' + 10);
   if ((c >= 'A') && (c <= 'F'))
     return (c - 'A' + 10);
-  printf ("error: table line in file has char %d/%x\n", c, c);
-  exit (1);
+  return -1;
 }
 
-static int hexbyte (int c1, int c2)
+/* fills in keys from the lines of text that have exactly 2 * dsize hex
+ * digits, ignoring other lines.  Returns the number of keys */
+static int parse_hex_lines (const char * text, int tsize, char * keys,
+                            int dsize, int max_keys)
 {
-  return (hexvalue (c1) << 4) | (hexvalue (c2));
+  int count = 0;
+  int pos = 0;
+  while ((pos < tsize) && (count < max_keys)) {
+    int len = 0;
+    while ((pos + len < tsize) && (text [pos + len] != '\n'))
+      len++;
+    if (len == 2 * dsize) {
+      char * key = keys + count * dsize;
+      int index;
+      for (index = 0; index < dsize; index++) {
+        int high = hexvalue (text [pos + index * 2]);
+        int low = hexvalue (text [pos + index * 2 + 1]);
+        if ((high < 0) || (low < 0))
+          break;
+        key [index] = (char) ((high << 4) | low);
+      }
+      if (index >= dsize)
+        count++;
+      else
+        printf ("error: table line in file has non-hex char\n");
+    }
+    pos += len + 1;
+  }
+  return count;
 }
 
-#define MAX_ENTRY	1024
-/* return the number of bytes read, or 0 if there are more than dsize */
-static int readline_bytes (int fd, char * data, int dsize)
+/* a table image is TABLE_IMAGE_MAGIC, 4 bytes each of bytes per entry and
+ * number of entries, then the entries */
+#define TABLE_IMAGE_MAGIC	"allnettb"
+#define TABLE_IMAGE_MAGIC_SIZE	8
+#define TABLE_IMAGE_HEADER_SIZE	(TABLE_IMAGE_MAGIC_SIZE + 8)
+
+static int sort_bytes = 0;  /* table_from_file and qsort are not reentrant */
+
+static int compare_entries (const void * a, const void * b)
 {
-  if (dsize <= 0)
-    return 0;
-  char line [MAX_ENTRY * 2 + 1];
-  int chars = 0;
-  int linesize = (int) sizeof (line);
-  while (chars < linesize) {
-    ssize_t r = read (fd, line + chars, 1);
-    if ((r == 1) && (line [chars] == '\n'))
-      break;       /* done!  Convert the hex to binary */
-    chars++;
-  }
-  if (chars >= linesize) {    /* ran out of room, which is an error */
-    printf ("error: table line in file exceeds %zd bytes\n", sizeof (line));
-    return 0;
-  }
-  if (chars != 2 * dsize) {
-    printf ("error: table line in file is %d, expected %d \n",
-            chars, 2 * dsize);
-    return 0;
-  }
-  int index = 0;
-  for (index = 0; index < dsize; index++)
-    data [index] = hexbyte (line [index * 2], line [index * 2 + 1]);
-  return dsize;
+  return memcmp (a, b, sort_bytes);
 }
 
+#define MAX_ENTRY	1024
 /* returns the number of bytes in the table. */
 /* will not exceed free_bytes, ignoring entries that would require
  * too much room */
@@ -374,13 +333,42 @@ static int readline_bytes (int fd, char * data, int dsize)
 int table_from_file (struct table * table,
 		     int fd, int bytes_per_entry, int free_bytes)
 {
-  if (bytes_per_entry > MAX_ENTRY) {  /* sanity check */
+  if ((bytes_per_entry <= 0) || (bytes_per_entry > MAX_ENTRY)) {
     printf ("error: table can only handle %d bytes, requested %d\n",
             MAX_ENTRY, bytes_per_entry);
     return 0;  /* no change */
   }
-  int num_lines = countlines (fd, bytes_per_entry * 2);
-  int num_entries = num_lines;
+  if (lseek (fd, 0, SEEK_SET) == ((off_t) -1)) {
+    perror ("table_from_file lseek");
+    return 0;
+  }
+  char * content = NULL;
+  int csize = read_fd_malloc (fd, &content, 1, 0, NULL);
+  if ((csize <= 0) || (content == NULL))
+    return 0;
+  char * keys = NULL;    /* content, or allocated if parsed */
+  int num_keys = 0;
+  if ((csize >= TABLE_IMAGE_HEADER_SIZE) &&
+      (memcmp (content, TABLE_IMAGE_MAGIC, TABLE_IMAGE_MAGIC_SIZE) == 0)) {
+    long int bpe = readb32 (content + TABLE_IMAGE_MAGIC_SIZE);
+    long int n = readb32 (content + TABLE_IMAGE_MAGIC_SIZE + 4);
+    if ((bpe != bytes_per_entry) ||
+        (n > (csize - TABLE_IMAGE_HEADER_SIZE) / bytes_per_entry)) {
+      printf ("error: table image has %ld entries of %ld bytes, "
+              "expected %d-byte entries in %d bytes\n",
+              n, bpe, bytes_per_entry, csize);
+      free (content);
+      return 0;
+    }
+    keys = content + TABLE_IMAGE_HEADER_SIZE;
+    num_keys = (int) n;
+  } else {
+    int max_keys = csize / (2 * bytes_per_entry) + 1;
+    keys = malloc_or_fail (max_keys * bytes_per_entry, "table_from_file");
+    num_keys = parse_hex_lines (content, csize, keys, bytes_per_entry,
+                                max_keys);
+  }
+  int num_entries = num_keys;
   if (bytes_per_entry < 4) {
     /* maximum addressable entries with the given number of bits */
     int max_entries = 1 << (bytes_per_entry * 8);
@@ -390,32 +378,71 @@ int table_from_file (struct table * table,
   }
   int bytes_used = init_table_size (table, num_entries,
                                     bytes_per_entry, free_bytes);
-  if (bytes_used == 0)
-    return 0;
-
-  while (num_lines-- > 0) {
-    char line [MAX_ENTRY];
-    int bytes = readline_bytes (fd, line, bytes_per_entry);
-    if (bytes > 0)
-      table_add (table, line, bytes);
+  if (bytes_used > 0) {
+    if (table->num_entries < num_keys) {
+      static int printed = 0;
+      if (printed == 0) {  /* only print once */
+        printf ("warning: out of space for new table entries\n");
+        printed = 1;
+      }
+    }
+    /* sorting puts the entries for each slot together, in slot order */
+    memcpy (table->data, keys, table->num_entries * bytes_per_entry);
+    sort_bytes = bytes_per_entry;
+    qsort (table->data, table->num_entries, bytes_per_entry,
+           compare_entries);
+    int slot = 0;
+    int i;
+    for (i = 0; i < table->num_entries; i++) {
+      char * entry = table->data + i * bytes_per_entry;
+      table->prefixes [i] = key_prefix (entry, bytes_per_entry);
+      int first, last;
+      get_indices (entry, bytes_per_entry * 8, table->num_slots,
+                   &first, &last);
+      while (slot <= first)
+        table->slot_start [slot++] = i;
+    }
+    while (slot <= table->num_slots)
+      table->slot_start [slot++] = table->num_entries;
   }
+  if (keys != content + TABLE_IMAGE_HEADER_SIZE)
+    free (keys);
+  free (content);
   return bytes_used;
 }
 
+/* saves an image of the table that table_from_file can read without
+ * parsing.  returns 1 for success, 0 for failure */
+int table_to_file (struct table * table, int fd)
+{
+  char header [TABLE_IMAGE_HEADER_SIZE];
+  memcpy (header, TABLE_IMAGE_MAGIC, TABLE_IMAGE_MAGIC_SIZE);
+  writeb32 (header + TABLE_IMAGE_MAGIC_SIZE, table->bytes_per_entry);
+  writeb32 (header + TABLE_IMAGE_MAGIC_SIZE + 4, table->num_entries);
+  ssize_t dsize = ((ssize_t) (table->num_entries)) * table->bytes_per_entry;
+  if ((write (fd, header, sizeof (header)) != (ssize_t) (sizeof (header))) ||
+      ((dsize > 0) && (write (fd, table->data, dsize) != dsize))) {
+    perror ("table_to_file write");
+    return 0;
+  }
+  return 1;
+}
+
 /* for debugging */
-void print_table_entry (int index, struct table_entry * entry,
-                        int num_data_bytes)
+void print_table_entry (struct table * table, int index)
 {
-  while (entry != NULL) {
-    printf ("%d (%p): next %p, data %d: ", index, entry, entry->next,
-            num_data_bytes);
+  if ((index < 0) || (index >= table->num_slots))
+    return;
+  int num_data_bytes = table->bytes_per_entry;
+  int e;
+  for (e = table->slot_start [index]; e < table->slot_start [index + 1]; e++) {
+    char * entry = table->data + e * num_data_bytes;
+    printf ("%d (%d): data %d: ", index, e, num_data_bytes);
     int i;
     for (i = 0; i < num_data_bytes && i < 10; i++)
-      printf (" %02x", entry->data [i] & 0xff);
+      printf (" %02x", entry [i] & 0xff);
     if (i < num_data_bytes)
       printf (" ...");
     printf ("\n");
-
-    entry = entry->next;
   }
 }
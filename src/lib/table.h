@@ -3,34 +3,45 @@
 #ifndef ALLNET_TABLE_H
 #define ALLNET_TABLE_H
 
+#include <stdint.h>
+
+/* the entries are sorted, so the entries for each slot (selected by the
+ * first log2 (num_slots) bits of an entry) are contiguous.  Probes only
+ * read the contiguous array of 64-bit prefixes, and only entries longer
+ * than 64 bits have their data compared */
 struct table {
   int num_entries;
   int num_slots;    /* the next higher power of two for num_entries */
-  struct table_entry ** table;
   int bytes_per_entry;   /* how many bytes are kept per entry */
-  int stored_size;
+  uint64_t * prefixes;   /* first 8 bytes of each entry, big-endian */
+  int * slot_start; /* num_slots + 1 indices, slot i is [start[i], start[i+1]) */
+  char * data;      /* num_entries * bytes_per_entry */
   int storage_size;
-  char * storage;   /* freed when reallocating */
-  char * freeptr;   /* data available */
+  char * storage;   /* holds all of the above, freed when reallocating */
 };
 
 /* initializes to an empty state, where essentially no space is used */
 extern void init_table (struct table * table);
 
-/* will not exceed free_bytes, ignoring entries that would require
+/* the file may have one entry per line, in hex, or be a table image
+ * saved by table_to_file.
+ * will not exceed free_bytes, ignoring entries that would require
  * too much room */
 /* returns the number of bytes in the table. */
 /* in case of failure returns 0 and the table is unchanged */
 extern int table_from_file (struct table * table, int fd,
                             int bytes_per_entry, int free_bytes);
 
+/* saves an image of the table that table_from_file can read without
+ * parsing.  returns 1 for success, 0 for failure */
+extern int table_to_file (struct table * table, int fd);
+
 /* returns 1 if found, 0 otherwise */
 /* if returns 1, also fills in *data and *dsize */
 extern int table_find (char * bitstring, int bits, struct table * table,
                        char ** data, int * dsize);
 
 /* for debugging */
-extern void print_table_entry (int index, struct table_entry * entry,
-                               int num_data_bytes);
+extern void print_table_entry (struct table * table, int index);
 
 #endif /* ALLNET_TABLE_H */
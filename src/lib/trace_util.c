@@ -428,9 +428,9 @@ static void send_trace (int sock, const unsigned char * address, int abits,
   unsigned int data_size = minz (total_size, ALLNET_SIZE (0));
   unsigned int allocated = 0;
   struct allnet_header * hp =
-    create_packet (data_size, ALLNET_TYPE_MGMT, max_hops, ALLNET_SIGTYPE_NONE,
-                   my_address, my_abits, address, abits, NULL, NULL,
-                   &allocated);
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, max_hops,
+                        ALLNET_SIGTYPE_NONE, my_address, my_abits,
+                        address, abits, NULL, NULL, &allocated);
   if (allocated != total_size) {
     printf ("error in send_trace: %d %d %d, %d %d %d %d %d\n", allocated,
             total_size, data_size,
@@ -439,6 +439,7 @@ static void send_trace (int sock, const unsigned char * address, int abits,
             (int)ALLNET_SIZE(transport),
             (int)sizeof (struct allnet_mgmt_trace_req),
             (int)sizeof (struct allnet_mgmt_trace_entry));
+    allnet_packet_free (hp);
     return;
   }
   if (expiration_sec > 0) {
@@ -474,6 +475,7 @@ static void send_trace (int sock, const unsigned char * address, int abits,
     log_print (alog);
 #endif /* DEBUG_PRINT */
   }
+  allnet_packet_free (buffer);
 }
 
 /* in case of overflow, returns ULLONG_MAX */
@@ -1088,3 +1090,379 @@ void trace_to_string (char * string, size_t slen,
   }
 }
 
+
+/* the parallel trace engine keeps up to max_outstanding traces waiting
+ * for replies at the same time, sending a new trace whenever one
+ * finishes or times out.  Replies are matched to their trace by the
+ * trace ID, and statistics are kept for each destination, and for each
+ * node that replies on the way to it */
+
+struct trace_pending {
+  char trace_id [MESSAGE_ID_SIZE];
+  int dest;                          /* index of the destination address */
+  unsigned long long int sent;       /* allnet_time_us () */
+  int in_use;
+};
+
+/* open addressing with linear probing, size is a power of two.
+ * trace IDs are random, so their first bytes are a good enough hash */
+struct trace_table {
+  struct trace_pending * entries;
+  int size;
+  int count;
+};
+
+struct trace_rtt {
+  int count;
+  unsigned long long int min;        /* all in microseconds */
+  unsigned long long int max;
+  unsigned long long int sum;
+};
+
+struct trace_hop {
+  int dest;
+  int hops;
+  unsigned char address [ADDRESS_SIZE];   /* of the node that replied */
+  int nbits;
+  struct trace_rtt rtt;
+};
+
+struct trace_dest {
+  int sent;
+  struct trace_rtt rtt;              /* of the replies from the destination */
+};
+
+static int trace_table_home (struct trace_table * t, const char * id)
+{
+  return (int) (readb64 (id) & (t->size - 1));
+}
+
+/* returns the entry with this ID, or NULL if none */
+static struct trace_pending * trace_table_find (struct trace_table * t,
+                                                const char * id)
+{
+  int i = trace_table_home (t, id);
+  while (t->entries [i].in_use) {
+    if (memcmp (t->entries [i].trace_id, id, MESSAGE_ID_SIZE) == 0)
+      return t->entries + i;
+    i = (i + 1) & (t->size - 1);
+  }
+  return NULL;
+}
+
+/* the table must have at least one free entry */
+static struct trace_pending * trace_table_add (struct trace_table * t,
+                                               const char * id)
+{
+  int i = trace_table_home (t, id);
+  while (t->entries [i].in_use)
+    i = (i + 1) & (t->size - 1);
+  memcpy (t->entries [i].trace_id, id, MESSAGE_ID_SIZE);
+  t->entries [i].in_use = 1;
+  t->count++;
+  return t->entries + i;
+}
+
+/* entries after the removed one are moved back into the hole if their
+ * home position allows, so that lookups never stop at the hole */
+static void trace_table_remove (struct trace_table * t,
+                                struct trace_pending * p)
+{
+  int mask = t->size - 1;
+  int hole = (int) (p - t->entries);
+  t->entries [hole].in_use = 0;
+  t->count--;
+  int i = (hole + 1) & mask;
+  while (t->entries [i].in_use) {
+    int home = trace_table_home (t, t->entries [i].trace_id);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      t->entries [hole] = t->entries [i];
+      t->entries [i].in_use = 0;
+      hole = i;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+static void trace_rtt_add (struct trace_rtt * r, unsigned long long int us)
+{
+  if ((r->count == 0) || (us < r->min))
+    r->min = us;
+  if ((r->count == 0) || (us > r->max))
+    r->max = us;
+  r->sum += us;
+  r->count++;
+}
+
+static void trace_record_hop (struct trace_hop ** hops, int * num_hops,
+                              int * num_alloc, int dest,
+                              struct allnet_mgmt_trace_entry * entry,
+                              unsigned long long int us)
+{
+  int nbits = (entry->nbits > ADDRESS_BITS) ? ADDRESS_BITS : entry->nbits;
+  int i;
+  for (i = 0; i < *num_hops; i++) {
+    struct trace_hop * h = (*hops) + i;
+    if ((h->dest == dest) && (h->hops == entry->hops_seen) &&
+        (h->nbits == nbits) &&
+        (matches (h->address, nbits, entry->address, nbits) >= nbits)) {
+      trace_rtt_add (&(h->rtt), us);
+      return;
+    }
+  }
+  if (*num_hops >= *num_alloc) {
+    *num_alloc = (*num_alloc == 0) ? 64 : (*num_alloc * 2);
+    *hops = realloc (*hops, *num_alloc * sizeof (struct trace_hop));
+    if (*hops == NULL) {
+      printf ("trace_record_hop: unable to allocate %d hops\n", *num_alloc);
+      exit (1);
+    }
+  }
+  struct trace_hop * h = (*hops) + *num_hops;
+  memset (h, 0, sizeof (struct trace_hop));
+  h->dest = dest;
+  h->hops = entry->hops_seen;
+  h->nbits = nbits;
+  memcpy (h->address, entry->address, (nbits + 7) / 8);
+  trace_rtt_add (&(h->rtt), us);
+  (*num_hops)++;
+}
+
+/* returns 1 if the reply was the final reply to one of our traces */
+static int trace_parallel_reply (char * message, int msize,
+                                 struct trace_table * table,
+                                 struct trace_dest * dests,
+                                 struct trace_hop ** hops, int * num_hops,
+                                 int * hops_alloc, int record_intermediates,
+                                 char * rememberedh, int nh, int * positionh)
+{
+  char * reason = NULL;
+  if (! is_valid_message (message, msize, &reason))
+    return 0;
+  struct allnet_header * hp = (struct allnet_header *) message;
+  if ((hp->message_type != ALLNET_TYPE_MGMT) ||
+      (msize < (int) ALLNET_TRACE_REPLY_SIZE (hp->transport, 1)))
+    return 0;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (message + ALLNET_SIZE (hp->transport));
+  if (mp->mgmt_type != ALLNET_MGMT_TRACE_REPLY)
+    return 0;
+  struct allnet_mgmt_trace_reply * trp =
+    (struct allnet_mgmt_trace_reply *)
+      (message + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  if ((trp->encrypted) || (trp->num_entries < 1) ||
+      (msize < (int) ALLNET_TRACE_REPLY_SIZE (hp->transport,
+                                              trp->num_entries)))
+    return 0;
+  struct trace_pending * p = trace_table_find (table, (char *) trp->trace_id);
+  if (p == NULL)   /* not ours, or already finished */
+    return 0;
+  if (packet_received_before (message, msize, rememberedh, nh, positionh))
+    return 0;
+  unsigned long long int us = allnet_time_us () - p->sent;
+  struct allnet_mgmt_trace_entry * entry = trp->trace + (trp->num_entries - 1);
+  trace_record_hop (hops, num_hops, hops_alloc, p->dest, entry, us);
+  if (trp->intermediate_reply)
+    return 0;
+  trace_rtt_add (&(dests [p->dest].rtt), us);
+  /* without intermediate replies, nothing more is expected */
+  if (! record_intermediates)
+    trace_table_remove (table, p);
+  return 1;
+}
+
+static int trace_hop_compare (const void * a, const void * b)
+{
+  const struct trace_hop * ha = (const struct trace_hop *) a;
+  const struct trace_hop * hb = (const struct trace_hop *) b;
+  if (ha->dest != hb->dest)
+    return ha->dest - hb->dest;
+  if (ha->hops != hb->hops)
+    return ha->hops - hb->hops;
+  if (ha->nbits != hb->nbits)
+    return ha->nbits - hb->nbits;
+  return memcmp (ha->address, hb->address, ADDRESS_SIZE);
+}
+
+/* prints the count, then min, mean, max in milliseconds (or none if
+ * the count is 0), each preceded by its field prefix */
+static int trace_rtt_string (char * buf, int bsize, struct trace_rtt * r,
+                             const char * f1, const char * f2,
+                             const char * f3, const char * f4,
+                             const char * none)
+{
+  if (r->count == 0)
+    return snprintf (buf, bsize, "%s0%s%s%s%s%s%s", f1, f2, none, f3, none,
+                     f4, none);
+  return snprintf (buf, bsize, "%s%d%s%llu.%03llu%s%llu.%03llu%s%llu.%03llu",
+                   f1, r->count, f2, r->min / 1000, r->min % 1000,
+                   f3, (r->sum / r->count) / 1000, (r->sum / r->count) % 1000,
+                   f4, r->max / 1000, r->max % 1000);
+}
+
+static void trace_parallel_print (int naddrs, unsigned char * addresses,
+                                  int * abits, struct trace_dest * dests,
+                                  struct trace_hop * hops, int num_hops,
+                                  int format, int fd_out)
+{
+  qsort (hops, num_hops, sizeof (struct trace_hop), trace_hop_compare);
+  char buf [1000];
+  char dest_string [100];
+  int d;
+  int h = 0;
+  if (format == TRACE_OUTPUT_CSV)
+    write_string_to ("type,destination,sent,hops,responder,"
+                     "replies,min_ms,mean_ms,max_ms\n", 0, fd_out);
+  else
+    write_string_to ("{\"destinations\":[", 0, fd_out);
+  for (d = 0; d < naddrs; d++) {
+    snprintf (dest_string, sizeof (dest_string), "%s",
+              print_addr (addresses + d * ADDRESS_SIZE, abits [d]));
+    int off;
+    if (format == TRACE_OUTPUT_CSV) {
+      off = snprintf (buf, sizeof (buf), "destination,%s,%d,,",
+                      dest_string, dests [d].sent);
+      off += trace_rtt_string (buf + off, sizeof (buf) - off,
+                               &(dests [d].rtt), ",", ",", ",", ",", "");
+      snprintf (buf + off, sizeof (buf) - off, "\n");
+    } else {
+      off = snprintf (buf, sizeof (buf),
+                      "%s\n{\"destination\":\"%s\",\"sent\":%d",
+                      ((d > 0) ? "," : ""), dest_string, dests [d].sent);
+      off += trace_rtt_string (buf + off, sizeof (buf) - off,
+                               &(dests [d].rtt), ",\"replies\":",
+                               ",\"min_ms\":", ",\"mean_ms\":",
+                               ",\"max_ms\":", "null");
+      snprintf (buf + off, sizeof (buf) - off, ",\"hops\":[");
+    }
+    write_string_to (buf, 0, fd_out);
+    int first = 1;
+    for ( ; (h < num_hops) && (hops [h].dest == d); h++) {
+      char * responder = print_addr (hops [h].address, hops [h].nbits);
+      if (format == TRACE_OUTPUT_CSV) {
+        off = snprintf (buf, sizeof (buf), "hop,%s,,%d,%s,",
+                        dest_string, hops [h].hops, responder);
+        off += trace_rtt_string (buf + off, sizeof (buf) - off,
+                                 &(hops [h].rtt), "", ",", ",", ",", "");
+        snprintf (buf + off, sizeof (buf) - off, "\n");
+      } else {
+        off = snprintf (buf, sizeof (buf),
+                        "%s\n {\"hops\":%d,\"responder\":\"%s\"",
+                        (first ? "" : ","), hops [h].hops, responder);
+        off += trace_rtt_string (buf + off, sizeof (buf) - off,
+                                 &(hops [h].rtt), ",\"replies\":",
+                                 ",\"min_ms\":", ",\"mean_ms\":",
+                                 ",\"max_ms\":", "null");
+        snprintf (buf + off, sizeof (buf) - off, "}");
+      }
+      write_string_to (buf, 0, fd_out);
+      first = 0;
+    }
+    if (format != TRACE_OUTPUT_CSV)
+      write_string_to ("]}", 0, fd_out);
+  }
+  if (format != TRACE_OUTPUT_CSV)
+    write_string_to ("\n]}\n", 0, fd_out);
+}
+
+void do_trace_parallel (int sock,
+                        int naddrs, unsigned char * addresses, int * abits,
+                        int count, int max_outstanding, int timeout_sec,
+                        int nhops, int record_intermediates, int caching,
+                        int format, int fd_out, struct allnet_log * alog)
+{
+  if ((naddrs <= 0) || (count <= 0))
+    return;
+  if (max_outstanding < 1)
+    max_outstanding = 1;
+  if (timeout_sec < 1)
+    timeout_sec = 1;
+  struct trace_table table;
+  table.size = 2;
+  while (table.size < 2 * max_outstanding)
+    table.size *= 2;
+  table.count = 0;
+  size_t tsize = table.size * sizeof (struct trace_pending);
+  table.entries = malloc_or_fail (tsize, "do_trace_parallel table");
+  memset (table.entries, 0, tsize);
+  size_t dsize = naddrs * sizeof (struct trace_dest);
+  struct trace_dest * dests = malloc_or_fail (dsize, "do_trace_parallel");
+  memset (dests, 0, dsize);
+  struct trace_hop * hops = NULL;
+  int num_hops = 0;
+  int hops_alloc = 0;
+#define PARALLEL_REMEMBERED_HASHES	1000
+  char * remembered =
+    malloc_or_fail (PARALLEL_REMEMBERED_HASHES * MESSAGE_ID_SIZE,
+                    "do_trace_parallel remembered");
+  int remembered_position = -1;   /* packet_received_before initializes */
+
+  unsigned char my_addr [ADDRESS_SIZE];
+  routing_my_address (my_addr);
+  int addr_high_5bits = my_addr [0] & 0xf8;   /* my 5 high bits */
+  memset (my_addr, 0, sizeof (my_addr));
+  my_addr [0] = addr_high_5bits;
+
+  unsigned long long int timeout_us = timeout_sec * ALLNET_US_PER_S;
+  int total = naddrs * count;
+  int issued = 0;
+  while ((issued < total) || (table.count > 0)) {
+    unsigned long long int now = allnet_time_us ();
+    /* give up on traces that have waited long enough, and find out
+     * when the next one will time out */
+    unsigned long long int next_timeout = now + timeout_us;
+    int i = 0;
+    while (i < table.size) {
+      struct trace_pending * p = table.entries + i;
+      if ((p->in_use) && (p->sent + timeout_us <= now)) {
+        trace_table_remove (&table, p);  /* may move another entry to i */
+      } else {
+        if ((p->in_use) && (p->sent + timeout_us < next_timeout))
+          next_timeout = p->sent + timeout_us;
+        i++;
+      }
+    }
+    /* send more traces, taking the destinations in turn */
+    while ((issued < total) && (table.count < max_outstanding)) {
+      int dest = issued % naddrs;
+      char trace_id [MESSAGE_ID_SIZE];
+      do {
+        random_bytes (trace_id, sizeof (trace_id));
+      } while (trace_table_find (&table, trace_id) != NULL);
+      struct trace_pending * p = trace_table_add (&table, trace_id);
+      p->dest = dest;
+      p->sent = allnet_time_us ();
+      send_trace (sock, addresses + (dest * ADDRESS_SIZE), abits [dest],
+                  trace_id, my_addr, 5, nhops, record_intermediates,
+                  timeout_sec * 10, caching, alog);
+      dests [dest].sent++;
+      issued++;
+    }
+    if (table.count == 0)
+      continue;
+    now = allnet_time_us ();
+    unsigned int ms = 1;
+    if (next_timeout > now)
+      ms = (unsigned int) ((next_timeout - now + 999) / 1000);
+    unsigned int pri;
+    char * message;
+    int found = local_receive (ms, &message, &pri);
+    if (found > 0) {
+      trace_parallel_reply (message, found, &table, dests, &hops, &num_hops,
+                            &hops_alloc, record_intermediates, remembered,
+                            PARALLEL_REMEMBERED_HASHES, &remembered_position);
+      free (message);
+    } else if (found < 0) {
+      break;
+    }
+    local_send_keepalive (0);
+  }
+#undef PARALLEL_REMEMBERED_HASHES
+  trace_parallel_print (naddrs, addresses, abits, dests, hops, num_hops,
+                        format, fd_out);
+  free (remembered);
+  if (hops != NULL)
+    free (hops);
+  free (dests);
+  free (table.entries);
+}
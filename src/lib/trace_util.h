@@ -36,6 +36,22 @@ extern void do_trace_loop (int sock,
                            int fd_out, int reset_counts,
                            struct allnet_log * alog);
 
+/* traces each of the naddrs addresses count times, keeping up to
+ * max_outstanding traces waiting for replies at once.  Each trace waits
+ * at most timeout_sec for replies.  At the end, prints to fd_out the
+ * number of traces and the replies and rtt (min/mean/max) for each
+ * destination, and for each node replying on the way to it, in the
+ * given format */
+#define TRACE_OUTPUT_CSV	1
+#define TRACE_OUTPUT_JSON	2
+extern void do_trace_parallel (int sock,
+                               int naddrs, unsigned char * addresses,
+                               int * abits, int count, int max_outstanding,
+                               int timeout_sec, int nhops,
+                               int record_intermediates, int caching,
+                               int format, int fd_out,
+                               struct allnet_log * alog);
+
 /* returns a (malloc'd) string representation of the trace result */
 extern char * trace_string (const char * tmp_dir, int sleep,
                             const char * dest, int nhops,
@@ -2,29 +2,125 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "packet.h"
 #include "priority.h"
 #include "util.h"
+#include "sha.h"
 #include "track.h"
 
-#define SAVED_ADDRESSES	128
+/* the bytes received from each source are counted in a count-min sketch:
+ * TRACK_DEPTH rows of TRACK_WIDTH counters, each row indexed by a
+ * differently keyed hash of the source.  The estimate for a source is
+ * the smallest of its counters, which is never less than the true count,
+ * and memory and time per packet are the same however many sources send.
+ * Every TRACK_HALF_LIFE seconds, all the counts are halved, so the
+ * estimates are for recent traffic */
+#define TRACK_DEPTH	4
+#define TRACK_WIDTH	1024
+#define TRACK_HALF_LIFE	10     /* seconds */
 
-struct rate_record {
-  unsigned char address [ADDRESS_SIZE];
-  unsigned char num_bits;
-  unsigned int packet_size;
+/* a source is its number of bits and the address, with unused bits zero */
+#define TRACK_KEY_SIZE	(1 + ADDRESS_SIZE)
+
+static unsigned long long int sketch [TRACK_DEPTH] [TRACK_WIDTH];
+static unsigned long long int total = 0;   /* decayed bytes from all sources */
+static char hash_keys [TRACK_DEPTH] [SIPHASH_KEY_SIZE];
+static unsigned long long int last_decay = 0;  /* 0 until initialized */
+
+/* the sources with the largest estimates, for largest_rate */
+#define TRACK_HEAVY	8
+
+struct heavy_hitter {
+  unsigned char key [TRACK_KEY_SIZE];
+  unsigned long long int count;
 };
 
-static struct rate_record record [SAVED_ADDRESSES];
+static struct heavy_hitter heavy [TRACK_HEAVY];
 
-static int next = -1;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define DEFAULT_MAX	(ALLNET_PRIORITY_MAX - 1)
 
+/* always called with the lock held */
+static void decay (unsigned long long int now)
+{
+  if (last_decay == 0) {    /* initialize */
+    memset (sketch, 0, sizeof (sketch));
+    memset (heavy, 0, sizeof (heavy));
+    random_bytes ((char *) hash_keys, sizeof (hash_keys));
+    total = 0;
+    last_decay = now;
+    return;
+  }
+  if (now < last_decay + TRACK_HALF_LIFE)
+    return;
+  unsigned long long int halvings = (now - last_decay) / TRACK_HALF_LIFE;
+  last_decay += halvings * TRACK_HALF_LIFE;
+  int shift = ((halvings > 63) ? 63 : ((int) halvings));
+  int r, c;
+  for (r = 0; r < TRACK_DEPTH; r++)
+    for (c = 0; c < TRACK_WIDTH; c++)
+      sketch [r] [c] >>= shift;
+  for (c = 0; c < TRACK_HEAVY; c++)
+    heavy [c].count >>= shift;
+  total >>= shift;
+}
+
+static void make_key (unsigned char * source, unsigned int sbits,
+                      unsigned char * key)
+{
+  if (sbits > ADDRESS_BITS)
+    sbits = ADDRESS_BITS;
+  memset (key, 0, TRACK_KEY_SIZE);
+  key [0] = sbits;
+  memcpy (key + 1, source, (sbits + 7) / 8);
+  if ((sbits % 8) != 0)
+    key [1 + sbits / 8] &= (0xff << (8 - (sbits % 8))) & 0xff;
+}
+
+/* always called with the lock held */
+static void record_heavy (unsigned char * key, unsigned long long int count)
+{
+  int min = 0;
+  int i;
+  for (i = 0; i < TRACK_HEAVY; i++) {
+    if (memcmp (heavy [i].key, key, TRACK_KEY_SIZE) == 0) {
+      heavy [i].count = count;
+      return;
+    }
+    if (heavy [i].count < heavy [min].count)
+      min = i;
+  }
+  if (count > heavy [min].count) {
+    memcpy (heavy [min].key, key, TRACK_KEY_SIZE);
+    heavy [min].count = count;
+  }
+}
+
+/* always called with the lock held */
+static unsigned int rate_fraction (unsigned long long int count)
+{
+  if (count >= total)
+    return ALLNET_PRIORITY_MAX;
+  return (unsigned int) ((ALLNET_PRIORITY_MAX * (double) count) / total);
+}
+
 unsigned int largest_rate ()
 {
-  return DEFAULT_MAX;
+  pthread_mutex_lock (&mutex);
+  decay (allnet_time ());
+  unsigned long long int largest = 0;
+  int i;
+  for (i = 0; i < TRACK_HEAVY; i++)
+    if (heavy [i].count > largest)
+      largest = heavy [i].count;
+  unsigned int result = DEFAULT_MAX;
+  if (largest > 0)
+    result = rate_fraction (largest);
+  pthread_mutex_unlock (&mutex);
+  return result;
 }
 
 /* record that this source is sending this packet of given size */
@@ -35,44 +131,37 @@ unsigned int largest_rate ()
 unsigned int track_rate (unsigned char * source, unsigned int sbits,
                          unsigned int packet_size)
 {
-  int i;
-  if (next < 0) {    /* initialize */
-    for (i = 0; i < SAVED_ADDRESSES; i++) {
-      memset (record [i].address, 0, ADDRESS_SIZE);
-      record [i].num_bits = 0;
-      record [i].packet_size = 0;
-    }
-    next = 0;
+  unsigned char key [TRACK_KEY_SIZE];
+  make_key (source, sbits, key);
+  pthread_mutex_lock (&mutex);
+  decay (allnet_time ());
+  /* conservative update: raise each counter only as far as the new
+   * estimate, which keeps the estimates closer to the true counts */
+  unsigned long long int * counters [TRACK_DEPTH];
+  unsigned long long int estimate = 0;
+  int r;
+  for (r = 0; r < TRACK_DEPTH; r++) {
+    unsigned long long int h =
+      siphash24 ((char *) key, sizeof (key), hash_keys [r]);
+    counters [r] = &(sketch [r] [h % TRACK_WIDTH]);
+    if ((r == 0) || (*(counters [r]) < estimate))
+      estimate = *(counters [r]);
   }
-
-  /* how many saved packets have the same source as this one? */
-  unsigned int nmatches = 0;
-  unsigned int total = 0;
-  for (i = 0; i < SAVED_ADDRESSES; i++) {
-    if (record [i].packet_size > 0) {
-      total += record [i].packet_size;
-      if (matches (source, sbits, record [i].address, record [i].num_bits))
-        nmatches += record [i].packet_size;
-    }
-  }
-
-  /* save this packet */
-  memcpy (record [next].address, source, ADDRESS_SIZE);
-  record [next].num_bits = sbits;
-  record [next].packet_size = packet_size;
-  next = (next + 1) % SAVED_ADDRESSES;
-
-  nmatches += packet_size;    /* add in this packet */
+  estimate += packet_size;    /* add in this packet */
+  for (r = 0; r < TRACK_DEPTH; r++)
+    if (*(counters [r]) < estimate)
+      *(counters [r]) = estimate;
   total += packet_size;    /* add in this packet */
-
-  if (total == 0) {
-    printf ("error in track_rate: illegal total size %d, returning one\n",
+  record_heavy (key, estimate);
+  unsigned int result = DEFAULT_MAX;
+  if (total == 0)
+    printf ("error in track_rate: illegal total size %llu, returning max\n",
             total);
-    return DEFAULT_MAX;
-  }
+  else
+    result = rate_fraction (estimate);
 #ifdef DEBUG_PRINT
-  printf ("total %d, matching %d\n", total, nmatches);
+  printf ("total %llu, matching %llu\n", total, estimate);
 #endif /* DEBUG_PRINT */
-  return (ALLNET_PRIORITY_MAX / total) * nmatches;
+  pthread_mutex_unlock (&mutex);
+  return result;
 }
-
@@ -1,5 +1,11 @@
 /* util.c: a place for useful functions used by different programs */
 
+#if defined(linux) || defined(__linux__)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE   /* pthread_setaffinity_np, CPU_SET */
+#endif /* _GNU_SOURCE */
+#endif /* linux */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,6 +17,12 @@
 #include <netdb.h>  /* h_errno */
 #include <dirent.h>  /* h_errno */
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ctype.h>
+#ifdef __APPLE__
+#include <pthread/qos.h>   /* pthread_set_qos_class_self_np */
+#endif /* __APPLE__ */
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -709,13 +721,13 @@ struct allnet_header *
  * If ack is not NULL, the data size parameter should NOT include the
  * MESSAGE_ID_SIZE bytes of the ack.
  * *size is set to the size to send */
-struct allnet_header *
-  create_packet (unsigned int data_size, unsigned int message_type,
-                 unsigned int max_hops, unsigned int sig_algo,
-                 const unsigned char * source, unsigned int sbits,
-                 const unsigned char * dest, unsigned int dbits,
-                 const unsigned char * stream, const unsigned char * ack,
-                 unsigned int * size)
+static struct allnet_header *
+  create_packet_alloc (unsigned int data_size, unsigned int message_type,
+                       unsigned int max_hops, unsigned int sig_algo,
+                       const unsigned char * source, unsigned int sbits,
+                       const unsigned char * dest, unsigned int dbits,
+                       const unsigned char * stream, const unsigned char * ack,
+                       unsigned int * size, int pooled)
 {
   int transport = 0;
   if (stream != NULL)
@@ -725,17 +737,48 @@ struct allnet_header *
   unsigned int alloc_size = ALLNET_SIZE (transport) + data_size;
   if (ack != NULL)
     alloc_size += MESSAGE_ID_SIZE;
-  char * buffer = malloc_or_fail (alloc_size, "util.c create_packet");
+  char * buffer = ((pooled) ?
+                   allnet_packet_alloc (alloc_size, "util.c create_packet") :
+                   malloc_or_fail (alloc_size, "util.c create_packet"));
   *size = alloc_size;
   struct allnet_header * result =
     init_packet (buffer, alloc_size, message_type, max_hops, sig_algo,
                  source, sbits, dest, dbits, stream, ack);
   if (result != NULL)
     return result;
-  free (buffer);
+  if (pooled)
+    allnet_packet_free (buffer);
+  else
+    free (buffer);
   return NULL;
 }
 
+struct allnet_header *
+  create_packet (unsigned int data_size, unsigned int message_type,
+                 unsigned int max_hops, unsigned int sig_algo,
+                 const unsigned char * source, unsigned int sbits,
+                 const unsigned char * dest, unsigned int dbits,
+                 const unsigned char * stream, const unsigned char * ack,
+                 unsigned int * size)
+{
+  return create_packet_alloc (data_size, message_type, max_hops, sig_algo,
+                              source, sbits, dest, dbits, stream, ack,
+                              size, 0);
+}
+
+struct allnet_header *
+  create_pool_packet (unsigned int data_size, unsigned int message_type,
+                      unsigned int max_hops, unsigned int sig_algo,
+                      const unsigned char * source, unsigned int sbits,
+                      const unsigned char * dest, unsigned int dbits,
+                      const unsigned char * stream, const unsigned char * ack,
+                      unsigned int * size)
+{
+  return create_packet_alloc (data_size, message_type, max_hops, sig_algo,
+                              source, sbits, dest, dbits, stream, ack,
+                              size, 1);
+}
+
 /* return a keepalive packet, which is in a static buffer
  * (do not change or free) and fill in the size to send */
 const char * keepalive_packet (unsigned int * size)
@@ -956,14 +999,74 @@ void print_timestamp (const char * message)
   printf ("%s at %ld.%06ld\n", message, now.tv_sec, (long) (now.tv_usec));
 }
 
-static int get_bit (const unsigned char * data, int pos)
+/* the bit matching functions compare up to 64 bits at a time: the
+ * bits are loaded into a 64-bit word with the first bit as the most
+ * significant bit, and the first difference is the number of leading
+ * zeros of the exclusive or.  No byte is read beyond the last one that
+ * holds a bit being compared. */
+
+/* returns the first nbytes (at most 8) of p as the most significant
+ * bytes of a 64-bit word, with any remaining bytes set to zero */
+static uint64_t prefix_word (const unsigned char * p, int nbytes)
+{
+  uint64_t result = 0;
+#if defined (__GNUC__) && defined (__BYTE_ORDER__)
+  if (nbytes >= 8) {
+    memcpy (&result, p, sizeof (result));
+#if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    result = __builtin_bswap64 (result);
+#endif /* __ORDER_LITTLE_ENDIAN__ */
+    return result;
+  }
+#endif /* __GNUC__ && __BYTE_ORDER__ */
+  int i;
+  for (i = 0; (i < nbytes) && (i < 8); i++)
+    result |= ((uint64_t) (p [i])) << (56 - 8 * i);
+  return result;
+}
+
+/* the number of leading zero bits of a nonzero word */
+static int leading_zeros (uint64_t w)
 {
-  int byte = data [pos / 8];
-  int shift = 7 - (pos % 8);
-  int bit = byte;
-  if (shift > 0)
-    bit = (byte >> shift);
-  return bit & 0x1;
+#if defined (__GNUC__)
+  return __builtin_clzll (w);
+#else /* ! __GNUC__ */
+  int result = 0;
+  while ((w & (((uint64_t) 1) << 63)) == 0) {
+    w <<= 1;
+    result++;
+  }
+  return result;
+#endif /* __GNUC__ */
+}
+
+/* the nbits (1..64) bits of p that start at bit offset off, as the most
+ * significant bits of a word.  Since off % 8 is added to the bits needed,
+ * nbits must be at most 64 if off % 8 == 0 and at most 56 otherwise */
+static uint64_t bits_word (const unsigned char * p, int off, int nbits)
+{
+  int shift = off % 8;
+  uint64_t w = prefix_word (p + off / 8, (shift + nbits + 7) / 8) << shift;
+  if (nbits < 64)
+    w &= ~(((uint64_t) -1) >> nbits);
+  return w;
+}
+
+/* returns the position of the first differing bit among the first nbits
+ * bits of x (after xoff bits) and y (after yoff bits), or nbits if none */
+static int first_difference (const unsigned char * x, int xoff,
+                             const unsigned char * y, int yoff, int nbits)
+{
+  /* with a bit offset, the bits may straddle 9 bytes, so use 56 at once */
+  int chunk = (((xoff % 8) == 0) && ((yoff % 8) == 0)) ? 64 : 56;
+  int pos;
+  for (pos = 0; pos < nbits; pos += chunk) {
+    int n = ((nbits - pos < chunk) ? (nbits - pos) : chunk);
+    uint64_t diff = bits_word (x, xoff + pos, n) ^ bits_word (y, yoff + pos, n);
+    if (diff != 0)
+      return pos + leading_zeros (diff);
+  }
+  return nbits;
 }
 
 /* returns the number of matching bits starting from the front of the
@@ -974,11 +1077,37 @@ int matching_bits (const unsigned char * x, int xbits,
   int nbits = xbits;
   if (nbits > ybits)
     nbits = ybits;
+  if (nbits <= 0)
+    return nbits;
+  return first_difference (x, 0, y, 0, nbits);
+}
+
+/* results [i] = matching_bits (x, xbits, ys + i * stride, ybits) */
+int matching_bits_array (const unsigned char * x, int xbits,
+                         const unsigned char * ys, size_t stride, int ybits,
+                         int count, int * results)
+{
+  int nbits = xbits;
+  if (nbits > ybits)
+    nbits = ybits;
+  int best = 0;
   int i;
-  for (i = 0; i < nbits; i++)
-    if (get_bit (x, i) != get_bit (y, i))
-      return i;
-  return nbits;
+  if ((nbits > 0) && (nbits <= 64)) {   /* usual case, load x only once */
+    uint64_t xw = bits_word (x, 0, nbits);
+    for (i = 0; i < count; i++) {
+      uint64_t diff = xw ^ bits_word (ys + i * stride, 0, nbits);
+      results [i] = ((diff == 0) ? nbits : leading_zeros (diff));
+      if (results [i] > best)
+        best = results [i];
+    }
+    return best;
+  }
+  for (i = 0; i < count; i++) {
+    results [i] = matching_bits (x, xbits, ys + i * stride, ybits);
+    if (results [i] > best)
+      best = results [i];
+  }
+  return best;
 }
 
 /* return nbits+1 if the first nbits of x match the first nbits of y, else 0 */
@@ -989,25 +1118,10 @@ int matches (const unsigned char * x, int xbits,
   int nbits = xbits;
   if (nbits > ybits)
     nbits = ybits;
-  int bytes = nbits / 8;  /* rounded-down number of bytes */
-/*
-  printf ("matching %d bits, %d bytes, of ", nbits, bytes);
-  print_buffer (x, bytes + 1, NULL, 6, 0);
-  printf (", ");
-  print_buffer (y, bytes + 1, NULL, 6, 1);
-*/
-  int i;
-  for (i = 0; i < bytes; i++)
-    if (x [i] != y [i])
-      return 0;
-/* if ((nbits % 8) == 0) printf ("matches!!!\n"); */
-  if ((nbits % 8) == 0)   /* identical */
+  if (nbits <= 0)   /* the empty bitstring matches everything */
     return nbits + 1;
-  int shift = 8 - nbits % 8;
-  if ((((x [bytes]) & 0xff) >> shift) == (((y [bytes]) & 0xff) >> shift)) {
-    /* printf ("bits match!!!\n"); */
+  if (first_difference (x, 0, y, 0, nbits) >= nbits)
     return nbits + 1;
-  }
   return 0;
 }
 
@@ -1034,11 +1148,9 @@ void print_bitstring (const unsigned char * x, int xoff, int nbits,
 int bitstring_matches (const unsigned char * x, int xoff,
                        const unsigned char * y, int yoff, int nbits)
 {
-  int i;
-  for (i = 0; i < nbits; i++)
-    if (get_bit (x, xoff + i) != get_bit (y, yoff + i))
-      return 0;
-  return 1;
+  if (nbits <= 0)
+    return 1;
+  return (first_difference (x, xoff, y, yoff, nbits) >= nbits);
 }
 
 /* functions used to modify and read data request bitmaps
@@ -1117,6 +1229,116 @@ unsigned long long allnet_time_ms ()  /* milliseconds since Y2K */
   return allnet_time_us () / ALLNET_US_PER_MS;
 }
 
+/* microseconds since some unspecified start, on a clock that is not
+ * changed when the system time is set */
+unsigned long long int allnet_monotonic_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * ALLNET_US_PER_S +
+         ts.tv_nsec / 1000;
+}
+
+unsigned long long int allnet_monotonic_ms (void)
+{
+  return allnet_monotonic_us () / ALLNET_US_PER_MS;
+}
+
+/* the coarse monotonic clock, or 0 if never updated.  Several threads
+ * may update it, so it only moves forward */
+static unsigned long long int coarse_monotonic_us = 0;
+
+/* the coarse clock, in microseconds since Y2K, or 0 if never updated.
+ * Several threads may update it, so a reading slightly older than the
+ * stored time is from a thread that lost the race, and is ignored.  A
+ * reading more than COARSE_CLOCK_STEP_US older means the system clock
+ * was set back, and is stored, so the coarse clock does not stop until
+ * the system clock catches up */
+static unsigned long long int coarse_clock_us = 0;
+#define COARSE_CLOCK_STEP_US	ALLNET_US_PER_S
+
+void allnet_clock_update (void)
+{
+  unsigned long long int now = allnet_time_us ();
+  unsigned long long int old = __atomic_load_n (&coarse_clock_us,
+                                                __ATOMIC_RELAXED);
+  while (((old < now) || (old - now > COARSE_CLOCK_STEP_US)) &&
+         (! __atomic_compare_exchange_n (&coarse_clock_us, &old, now, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+    ;   /* old has been reloaded, try again */
+  now = allnet_monotonic_us ();
+  old = __atomic_load_n (&coarse_monotonic_us, __ATOMIC_RELAXED);
+  while ((old < now) &&
+         (! __atomic_compare_exchange_n (&coarse_monotonic_us, &old, now, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+    ;   /* old has been reloaded, try again */
+}
+
+static void * clock_thread (void * arg)
+{
+  int ms = * ((int *) arg);
+  free (arg);
+  while (1) {
+    allnet_clock_update ();
+    usleep (ms * 1000);
+  }
+  return NULL;
+}
+
+void allnet_clock_start_thread (int ms)
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static int started = 0;
+  pthread_mutex_lock (&mutex);
+  if (! started) {
+    int * arg = malloc_or_fail (sizeof (int), "allnet_clock_start_thread");
+    *arg = ((ms > 0) ? ms : 1);
+    allnet_clock_update ();
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, clock_thread, arg) == 0) {
+      pthread_detach (thread);
+      started = 1;
+    } else {
+      perror ("allnet_clock_start_thread pthread_create");
+      free (arg);
+    }
+  }
+  pthread_mutex_unlock (&mutex);
+}
+
+unsigned long long int allnet_coarse_time_us (void)
+{
+  unsigned long long int result = __atomic_load_n (&coarse_clock_us,
+                                                   __ATOMIC_RELAXED);
+  if (result == 0)   /* never updated, use the precise clock */
+    return allnet_time_us ();
+  return result;
+}
+
+unsigned long long int allnet_coarse_time_ms (void)
+{
+  return allnet_coarse_time_us () / ALLNET_US_PER_MS;
+}
+
+unsigned long long int allnet_coarse_time (void)
+{
+  return allnet_coarse_time_us () / ALLNET_US_PER_S;
+}
+
+unsigned long long int allnet_coarse_monotonic_us (void)
+{
+  unsigned long long int result = __atomic_load_n (&coarse_monotonic_us,
+                                                   __ATOMIC_RELAXED);
+  if (result == 0)   /* never updated, use the precise clock */
+    return allnet_monotonic_us ();
+  return result;
+}
+
+unsigned long long int allnet_coarse_monotonic_ms (void)
+{
+  return allnet_coarse_monotonic_us () / ALLNET_US_PER_MS;
+}
+
 /* returns the result of calling ctime_r on the given allnet time. */
 /* the result buffer must be at least 30 bytes long */
 /* #define ALLNET_TIME_STRING_SIZE		30 */
@@ -1384,6 +1606,401 @@ void * memcpy_malloc (const void * bytes, size_t bsize, const char * desc)
   return result;
 }
 
+/* packet buffers are allocated and freed often, so buffers of up to
+ * ALLNET_MTU bytes are kept on a free list for each size class, with
+ * each list limited to PACKET_POOL_MAX_FREE buffers.  Every buffer is
+ * preceded by a header that records its size class, so
+ * allnet_packet_free knows where it goes.  Larger buffers are malloc'd
+ * and freed each time */
+#ifndef PACKET_POOL_MAX_FREE
+#define PACKET_POOL_MAX_FREE	32
+#endif /* PACKET_POOL_MAX_FREE */
+#define PACKET_POOL_CLASSES	5
+#define PACKET_POOL_MAGIC	0x706f6f6c   /* "pool" */
+#define PACKET_POOL_OVERSIZE	PACKET_POOL_CLASSES
+
+static const size_t packet_pool_sizes [PACKET_POOL_CLASSES] =
+  { 256, 1024, 2048, 4096, ALLNET_MTU };
+
+union packet_pool_header {
+  struct {
+    int size_class;
+    unsigned int magic;
+  } h;
+  long double align;   /* so the buffer is aligned for any use */
+};
+
+struct packet_pool_class {
+  pthread_mutex_t mutex;
+  void * free_list;     /* the first bytes of each buffer point to the next */
+  int num_free;
+};
+
+static struct packet_pool_class packet_pool [PACKET_POOL_CLASSES] =
+  { { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, NULL, 0 } };
+static unsigned long long int packet_pool_hits = 0;
+static unsigned long long int packet_pool_misses = 0;
+
+void * allnet_packet_alloc (size_t size, const char * desc)
+{
+  int c;
+  for (c = 0; (c < PACKET_POOL_CLASSES) && (size > packet_pool_sizes [c]); c++)
+    ;
+  if (c < PACKET_POOL_CLASSES) {
+    struct packet_pool_class * pc = packet_pool + c;
+    pthread_mutex_lock (&(pc->mutex));
+    void * result = pc->free_list;
+    if (result != NULL) {
+      memcpy (&(pc->free_list), result, sizeof (void *));
+      pc->num_free--;
+    }
+    pthread_mutex_unlock (&(pc->mutex));
+    if (result != NULL) {
+      __atomic_add_fetch (&packet_pool_hits, 1, __ATOMIC_RELAXED);
+      return result;
+    }
+    size = packet_pool_sizes [c];
+  }
+  __atomic_add_fetch (&packet_pool_misses, 1, __ATOMIC_RELAXED);
+  union packet_pool_header * hp =
+    malloc_or_fail (sizeof (union packet_pool_header) + size, desc);
+  hp->h.size_class = c;   /* PACKET_POOL_OVERSIZE if too large for a class */
+  hp->h.magic = PACKET_POOL_MAGIC;
+  return hp + 1;
+}
+
+void allnet_packet_free (void * buffer)
+{
+  if (buffer == NULL)
+    return;
+  union packet_pool_header * hp = ((union packet_pool_header *) buffer) - 1;
+  int c = hp->h.size_class;
+  if ((hp->h.magic != PACKET_POOL_MAGIC) || (c < 0) ||
+      (c > PACKET_POOL_OVERSIZE)) {
+    printf ("allnet_packet_free: %p was not allocated by allnet_packet_alloc\n",
+            buffer);
+    return;   /* leak it rather than corrupt the heap */
+  }
+  if (c < PACKET_POOL_CLASSES) {
+    struct packet_pool_class * pc = packet_pool + c;
+    pthread_mutex_lock (&(pc->mutex));
+    if (pc->num_free < PACKET_POOL_MAX_FREE) {
+      memcpy (buffer, &(pc->free_list), sizeof (void *));
+      pc->free_list = buffer;
+      pc->num_free++;
+      buffer = NULL;
+    }
+    pthread_mutex_unlock (&(pc->mutex));
+    if (buffer == NULL)   /* kept on the free list */
+      return;
+  }
+  free (hp);
+}
+
+void allnet_packet_pool_stats (unsigned long long int * hits,
+                               unsigned long long int * misses)
+{
+  if (hits != NULL)
+    *hits = __atomic_load_n (&packet_pool_hits, __ATOMIC_RELAXED);
+  if (misses != NULL)
+    *misses = __atomic_load_n (&packet_pool_misses, __ATOMIC_RELAXED);
+}
+
+/* memory accounting by subsystem.  The counts are only changed atomically,
+ * so the allocation functions take no locks.  As for the packet pool,
+ * every tagged buffer is preceded by a header, which records its size
+ * and subsystem for free_tagged */
+#define MEMORY_TAG_MAGIC	0x74616773   /* "tags" */
+#ifndef ALLNET_MEMORY_BUDGET_FRACTION
+#define ALLNET_MEMORY_BUDGET_FRACTION	4
+#endif /* ALLNET_MEMORY_BUDGET_FRACTION */
+#define MEMORY_SHRINK_INTERVAL	1	/* seconds between budget checks */
+
+static const char * memory_names [ALLNET_MEMORY_SUBSYSTEMS] =
+  { "other", "pcache", "routing", "dcache", "store", "xchat", "atcpd" };
+static long long int memory_counts [ALLNET_MEMORY_SUBSYSTEMS];
+static long long int memory_peaks [ALLNET_MEMORY_SUBSYSTEMS];
+static long long int memory_total = 0;
+static long long int memory_budget = -1;   /* -1 until first needed */
+static void (* memory_shrinkers [ALLNET_MEMORY_SUBSYSTEMS]) (long long int);
+static pthread_once_t memory_shrink_once = PTHREAD_ONCE_INIT;
+
+union memory_tag_header {
+  struct {
+    size_t bytes;
+    int subsystem;
+    unsigned int magic;
+  } h;
+  long double align;   /* so the buffer is aligned for any use */
+};
+
+void allnet_memory_account (int subsystem, long long int bytes)
+{
+  if ((subsystem < 0) || (subsystem >= ALLNET_MEMORY_SUBSYSTEMS))
+    subsystem = ALLNET_MEMORY_OTHER;
+  long long int used =
+    __atomic_add_fetch (memory_counts + subsystem, bytes, __ATOMIC_RELAXED);
+  long long int peak =
+    __atomic_load_n (memory_peaks + subsystem, __ATOMIC_RELAXED);
+  while ((used > peak) &&  /* if it fails, peak has the new value */
+         (! __atomic_compare_exchange_n (memory_peaks + subsystem, &peak,
+                                         used, 1, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)))
+    ;
+  __atomic_add_fetch (&memory_total, bytes, __ATOMIC_RELAXED);
+}
+
+void * malloc_tagged (size_t bytes, int subsystem, const char * desc)
+{
+  union memory_tag_header * hp =
+    malloc_or_fail (sizeof (union memory_tag_header) + bytes, desc);
+  if ((subsystem < 0) || (subsystem >= ALLNET_MEMORY_SUBSYSTEMS))
+    subsystem = ALLNET_MEMORY_OTHER;
+  hp->h.bytes = bytes;
+  hp->h.subsystem = subsystem;
+  hp->h.magic = MEMORY_TAG_MAGIC;
+  allnet_memory_account (subsystem, (long long int) bytes);
+  return hp + 1;
+}
+
+void * memcpy_malloc_tagged (const void * bytes, size_t bsize,
+                             int subsystem, const char * desc)
+{
+  if (bsize <= 0)
+    return NULL;
+  char * result = malloc_tagged (bsize, subsystem, desc);
+  memcpy (result, bytes, bsize);
+  return result;
+}
+
+void free_tagged (void * buffer)
+{
+  if (buffer == NULL)
+    return;
+  union memory_tag_header * hp = ((union memory_tag_header *) buffer) - 1;
+  if (hp->h.magic != MEMORY_TAG_MAGIC) {
+    printf ("free_tagged: %p was not allocated by malloc_tagged\n", buffer);
+    return;   /* leak it rather than corrupt the heap */
+  }
+  hp->h.magic = 0;   /* so freeing it again is detected */
+  allnet_memory_account (hp->h.subsystem, - (long long int) (hp->h.bytes));
+  free (hp);
+}
+
+const char * allnet_memory_used (int subsystem, long long int * used,
+                                 long long int * peak)
+{
+  if ((subsystem < 0) || (subsystem >= ALLNET_MEMORY_SUBSYSTEMS))
+    return NULL;
+  if (used != NULL)
+    *used = __atomic_load_n (memory_counts + subsystem, __ATOMIC_RELAXED);
+  if (peak != NULL)
+    *peak = __atomic_load_n (memory_peaks + subsystem, __ATOMIC_RELAXED);
+  return memory_names [subsystem];
+}
+
+long long int allnet_memory_budget (void)
+{
+  long long int budget = __atomic_load_n (&memory_budget, __ATOMIC_RELAXED);
+  if (budget >= 0)
+    return budget;
+  budget = 0;
+#ifdef _SC_PHYS_PAGES
+  long pages = sysconf (_SC_PHYS_PAGES);
+  long page = sysconf (_SC_PAGESIZE);
+  if ((pages > 0) && (page > 0))
+    budget = ((long long int) pages) / ALLNET_MEMORY_BUDGET_FRACTION * page;
+#endif /* _SC_PHYS_PAGES */
+  const char * env = getenv ("ALLNET_MEMORY_BUDGET");
+  if ((env != NULL) && (*env >= '0') && (*env <= '9'))
+    budget = atoll (env) * 1024 * 1024;
+  __atomic_store_n (&memory_budget, budget, __ATOMIC_RELAXED);
+  return budget;
+}
+
+void allnet_memory_set_budget (long long int bytes)
+{
+  __atomic_store_n (&memory_budget, ((bytes > 0) ? bytes : 0),
+                    __ATOMIC_RELAXED);
+}
+
+static void * memory_shrink_thread (void * arg)
+{
+  while (1) {
+    sleep (MEMORY_SHRINK_INTERVAL);
+    int i;
+    for (i = 0; i < ALLNET_MEMORY_SUBSYSTEMS; i++) {
+      long long int budget = allnet_memory_budget ();
+      long long int excess =
+        __atomic_load_n (&memory_total, __ATOMIC_RELAXED) - budget;
+      void (* shrink) (long long int) =
+        __atomic_load_n (memory_shrinkers + i, __ATOMIC_RELAXED);
+      if ((budget > 0) && (excess > 0) && (shrink != NULL))
+        shrink (excess);
+    }
+  }
+  return NULL;
+}
+
+static void memory_shrink_start (void)
+{
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, memory_shrink_thread, NULL) == 0)
+    pthread_detach (thread);
+  else
+    perror ("memory_shrink_start pthread_create");
+}
+
+void allnet_memory_register_shrink (int subsystem,
+                                    void (* shrink) (long long int))
+{
+  if ((subsystem < 0) || (subsystem >= ALLNET_MEMORY_SUBSYSTEMS))
+    return;
+  __atomic_store_n (memory_shrinkers + subsystem, shrink, __ATOMIC_RELAXED);
+  pthread_once (&memory_shrink_once, memory_shrink_start);
+}
+
+/* the priority given to SCHED_FIFO and SCHED_RR threads if the
+ * configuration does not specify one */
+#ifndef ALLNET_THREAD_DEFAULT_PRIORITY
+#define ALLNET_THREAD_DEFAULT_PRIORITY	10
+#endif /* ALLNET_THREAD_DEFAULT_PRIORITY */
+
+/* returns 1 for success, 0 if the policy is unknown or cannot be set */
+static int thread_set_policy (const char * var, const char * policy,
+                              int priority)
+{
+#ifdef __APPLE__
+  /* macOS has no real-time policies for ordinary programs, so use the
+   * quality of service classes instead */
+  qos_class_t qos = QOS_CLASS_DEFAULT;
+  if ((strcmp (policy, "fifo") == 0) || (strcmp (policy, "rr") == 0) ||
+      (strcmp (policy, "interactive") == 0))
+    qos = QOS_CLASS_USER_INTERACTIVE;
+  else if (strcmp (policy, "initiated") == 0)
+    qos = QOS_CLASS_USER_INITIATED;
+  else if (strcmp (policy, "utility") == 0)
+    qos = QOS_CLASS_UTILITY;
+  else if (strcmp (policy, "background") == 0)
+    qos = QOS_CLASS_BACKGROUND;
+  else if (strcmp (policy, "other") != 0) {
+    printf ("%s: unknown scheduling class %s\n", var, policy);
+    return 0;
+  }
+  int err = pthread_set_qos_class_self_np (qos, 0);
+#else /* ! __APPLE__ */
+  int p = SCHED_OTHER;
+  if (strcmp (policy, "fifo") == 0)
+    p = SCHED_FIFO;
+  else if (strcmp (policy, "rr") == 0)
+    p = SCHED_RR;
+  else if (strcmp (policy, "other") != 0) {
+    printf ("%s: unknown scheduling policy %s\n", var, policy);
+    return 0;
+  }
+  struct sched_param param;
+  memset (&param, 0, sizeof (param));
+  if (p != SCHED_OTHER) {
+    if (priority < 0)
+      priority = ALLNET_THREAD_DEFAULT_PRIORITY;
+    if (priority < sched_get_priority_min (p))
+      priority = sched_get_priority_min (p);
+    if (priority > sched_get_priority_max (p))
+      priority = sched_get_priority_max (p);
+    param.sched_priority = priority;
+  }
+  int err = pthread_setschedparam (pthread_self (), p, &param);
+#endif /* __APPLE__ */
+  if (err != 0) {
+    printf ("%s: unable to set scheduling %s: %s\n", var, policy,
+            strerror (err));
+    return 0;
+  }
+  return 1;
+}
+
+/* cpus is a list such as 0,2-3.  Returns 1 for success, 0 otherwise */
+static int thread_set_affinity (const char * var, const char * cpus)
+{
+#if (defined(linux) || defined(__linux__)) && defined(CPU_SET)
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  const char * p = cpus;
+  while (*p != '\0') {
+    char * end;
+    long first = strtol (p, &end, 10);
+    long last = first;
+    if (end == p) {
+      printf ("%s: illegal cpu list %s\n", var, cpus);
+      return 0;
+    }
+    p = end;
+    if (*p == '-') {
+      last = strtol (p + 1, &end, 10);
+      if (end == p + 1) {
+        printf ("%s: illegal cpu list %s\n", var, cpus);
+        return 0;
+      }
+      p = end;
+    }
+    long cpu;
+    for (cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++)
+      if (cpu >= 0)
+        CPU_SET (cpu, &set);
+    if (*p == ',')
+      p++;
+  }
+  int err = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+  if (err != 0) {
+    printf ("%s: unable to run on cpus %s: %s\n", var, cpus, strerror (err));
+    return 0;
+  }
+  return 1;
+#else /* ! linux */
+  printf ("%s: cpu affinity is not supported on this system\n", var);
+  return 0;
+#endif /* linux */
+}
+
+/* sets the scheduling of the calling thread as configured for name */
+int allnet_thread_config (const char * name)
+{
+  char var [100];
+  const char * prefix = "ALLNET_SCHED_";
+  size_t len = strlen (prefix);
+  memcpy (var, prefix, len);
+  int i;
+  for (i = 0; (name [i] != '\0') && (len + 1 < sizeof (var)); i++)
+    var [len++] = (isalnum ((unsigned char) (name [i])) ?
+                   toupper ((unsigned char) (name [i])) : '_');
+  var [len] = '\0';
+  const char * spec = getenv (var);
+  if ((spec == NULL) || (*spec == '\0'))
+    return 1;
+  /* [policy][:priority][@cpus] */
+  char policy [20];
+  size_t plen = strcspn (spec, ":@");
+  if (plen >= sizeof (policy))
+    plen = sizeof (policy) - 1;
+  memcpy (policy, spec, plen);
+  policy [plen] = '\0';
+  int priority = -1;
+  const char * colon = strchr (spec, ':');
+  if (colon != NULL)
+    priority = atoi (colon + 1);
+  const char * at = strchr (spec, '@');
+  int result = 1;
+  if ((plen > 0) && (! thread_set_policy (var, policy, priority)))
+    result = 0;
+  if ((at != NULL) && (! thread_set_affinity (var, at + 1)))
+    result = 0;
+  return result;
+}
+
 /* copy two buffers to new storage, using malloc_or_fail to get the memory */
 void * memcat_malloc (const void * bytes1, size_t bsize1,
                       const void * bytes2, size_t bsize2,
@@ -1526,9 +2143,13 @@ int read_fd_malloc (int fd, char ** content_p, int print_errors, int close_fd,
  * array to hold the file contents and assigns it to content_p.
  * one extra byte is allocated at the end and the content is null terminated.
  * in case of problems, returns -1, and prints the error if print_errors != 0 */
+/* see write_file_async */
+static void async_wait (const char * fname);
+
 int read_file_malloc (const char * file_name, char ** content_p,
                       int print_errors)
 {
+  async_wait (file_name);   /* read what was written */
   if (content_p != NULL)
     *content_p = NULL;
   long long int size = file_size (file_name);
@@ -1603,6 +2224,196 @@ int append_file (const char * fname, const char * contents, int len,
   return result;
 }
 
+/* asynchronous writes are queued, and made in order by a writer thread.
+ * Any queued write of a file is replaced by a later write_file_async
+ * of the same file, and appends to the same file queued one after the
+ * other are made as a single append.  Each batch of writes is written
+ * first, then the files that need it are synced, then closed.
+ * If ALLNET_SYNC_FILE_WRITES is defined or the thread cannot be started,
+ * the writes are made synchronously instead */
+struct async_write {
+  char * fname;
+  char * contents;
+  int len;
+  int alloc;
+  int append;
+  int sync;
+  int print_errors;
+  struct async_write * next;
+};
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct async_write * async_head = NULL;
+static struct async_write * async_tail = NULL;
+static struct async_write * async_writing = NULL;  /* the current batch */
+static int async_thread_state = 0;  /* 1 running, -1 failed to start */
+
+static void async_free (struct async_write * w)
+{
+  while (w != NULL) {
+    struct async_write * next = w->next;
+    free (w->fname);
+    free (w->contents);
+    free (w);
+    w = next;
+  }
+}
+
+static void * async_write_thread (void * arg)
+{
+  pthread_mutex_lock (&async_mutex);
+  while (1) {
+    while (async_head == NULL)
+      pthread_cond_wait (&async_cond, &async_mutex);
+    struct async_write * batch = async_writing = async_head;
+    async_head = async_tail = NULL;
+    pthread_mutex_unlock (&async_mutex);
+    int count = 0;
+    struct async_write * w;
+    for (w = batch; w != NULL; w = w->next)
+      count++;
+    int * fds = malloc_or_fail (count * sizeof (int), "async_write_thread");
+    int i = 0;
+    for (w = batch; w != NULL; w = w->next) {
+      int flags = O_WRONLY | O_CREAT | (w->append ? O_APPEND : O_TRUNC);
+      int fd = fds [i++] = open (w->fname, flags, 0600);
+      if ((! write_to_fd (fd, w->contents, w->len, w->print_errors,
+                          w->fname)) && (fd >= 0)) {
+        close (fd);
+        fds [i - 1] = -1;
+      }
+    }
+    for (i = 0, w = batch; w != NULL; i++, w = w->next)
+      if ((fds [i] >= 0) && (w->sync) && (fsync (fds [i]) != 0) &&
+          (w->print_errors))
+        perror ("async_write_thread fsync");
+    for (i = 0; i < count; i++)
+      if (fds [i] >= 0)
+        close (fds [i]);
+    free (fds);
+    pthread_mutex_lock (&async_mutex);
+    async_writing = NULL;
+    async_free (batch);
+    pthread_cond_broadcast (&async_cond);  /* for file_writes_flush */
+  }
+  return NULL;
+}
+
+/* returns 1 if the write was queued, 0 if it should be done synchronously.
+ * Called with async_mutex held */
+static int async_queue (const char * fname, const char * contents, int len,
+                        int append, int sync, int print_errors)
+{
+#ifdef ALLNET_SYNC_FILE_WRITES
+  return 0;
+#endif /* ALLNET_SYNC_FILE_WRITES */
+  if (async_thread_state == 0) {
+    pthread_t thread;
+    async_thread_state = -1;
+    if (pthread_create (&thread, NULL, async_write_thread, NULL) == 0) {
+      pthread_detach (thread);
+      async_thread_state = 1;
+      atexit (file_writes_flush);   /* finish the writes before exiting */
+    } else {
+      perror ("async_queue pthread_create");
+    }
+  }
+  if (async_thread_state < 0)
+    return 0;
+  if (len < 0)
+    len = 0;
+  struct async_write * last = NULL;  /* the last queued write of this file */
+  struct async_write * w;
+  for (w = async_head; w != NULL; w = w->next)
+    if (strcmp (w->fname, fname) == 0)
+      last = w;
+  if ((last != NULL) && (! append)) {     /* replace it */
+    free (last->contents);
+    last->contents = NULL;
+    last->len = last->alloc = 0;
+    last->append = 0;
+  } else if ((last == NULL) || (last != async_tail)) {  /* new write */
+    last = malloc_or_fail (sizeof (struct async_write), "async_queue");
+    last->fname = strcpy_malloc (fname, "async_queue");
+    last->contents = NULL;
+    last->len = last->alloc = 0;
+    last->append = append;
+    last->sync = 0;
+    last->print_errors = 0;
+    last->next = NULL;
+    if (async_tail == NULL)
+      async_head = last;
+    else
+      async_tail->next = last;
+    async_tail = last;
+  }   /* else add to the append at the end of the queue */
+  if (last->len + len > last->alloc) {
+    last->alloc = last->len + len;
+    last->contents = realloc (last->contents, last->alloc);
+    if (last->contents == NULL) {
+      printf ("async_queue unable to allocate %d bytes\n", last->alloc);
+      exit (1);
+    }
+  }
+  if (len > 0)
+    memcpy (last->contents + last->len, contents, len);
+  last->len += len;
+  last->sync |= sync;
+  last->print_errors |= print_errors;
+  pthread_cond_broadcast (&async_cond);
+  return 1;
+}
+
+int write_file_async (const char * fname, const char * contents, int len,
+                      int sync, int print_errors)
+{
+  pthread_mutex_lock (&async_mutex);
+  int queued = async_queue (fname, contents, len, 0, sync, print_errors);
+  pthread_mutex_unlock (&async_mutex);
+  if (queued)
+    return 1;
+  return write_file (fname, contents, len, print_errors);
+}
+
+int append_file_async (const char * fname, const char * contents, int len,
+                       int sync, int print_errors)
+{
+  pthread_mutex_lock (&async_mutex);
+  int queued = async_queue (fname, contents, len, 1, sync, print_errors);
+  pthread_mutex_unlock (&async_mutex);
+  if (queued)
+    return 1;
+  return append_file (fname, contents, len, print_errors);
+}
+
+/* returns 1 if there is a queued or current write of fname (of any
+ * file, if fname is NULL).  Called with async_mutex held */
+static int async_pending (const char * fname)
+{
+  struct async_write * lists [2] = { async_head, async_writing };
+  int i;
+  for (i = 0; i < 2; i++) {
+    struct async_write * w;
+    for (w = lists [i]; w != NULL; w = w->next)
+      if ((fname == NULL) || (strcmp (w->fname, fname) == 0))
+        return 1;
+  }
+  return 0;
+}
+
+static void async_wait (const char * fname)
+{
+  pthread_mutex_lock (&async_mutex);
+  while (async_pending (fname))
+    pthread_cond_wait (&async_cond, &async_mutex);
+  pthread_mutex_unlock (&async_mutex);
+}
+
+void file_writes_flush (void)
+{
+  async_wait (NULL);
+}
+
 /* low-grade randomness, in case the other calls don't work */
 static void computed_random_bytes (char * buffer, size_t bsize)
 {
@@ -1642,12 +2453,194 @@ static int dev_urandom_bytes (char * buffer, size_t bsize)
   return 1;
 }
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+/* seed bytes from the kernel.  returns 1 for success, 0 for failure */
+static int kernel_random_bytes (char * buffer, size_t bsize)
+{
+#if defined(__linux__) && defined(SYS_getrandom)
+  size_t done = 0;
+  while (done < bsize) {
+    long r = syscall (SYS_getrandom, buffer + done, bsize - done, 0);
+    if ((r < 0) && (errno == EINTR))
+      continue;
+    if (r <= 0)   /* e.g. ENOSYS on older kernels */
+      return dev_urandom_bytes (buffer, bsize);
+    done += r;
+  }
+  return 1;
+#else /* no getrandom */
+  return dev_urandom_bytes (buffer, bsize);
+#endif /* __linux__ && SYS_getrandom */
+}
+
+/* each thread has its own ChaCha20 generator, seeded from the kernel.
+ * After each refill the first 32 bytes of the keystream become the next
+ * key, and bytes are erased from the buffer as they are handed out, so
+ * earlier output cannot be recovered from the state.  The generator is
+ * reseeded after RANDOM_RESEED_BYTES, and in the child after a fork */
+#ifndef RANDOM_RESEED_BYTES
+#define RANDOM_RESEED_BYTES	(1024 * 1024)
+#endif /* RANDOM_RESEED_BYTES */
+#define RANDOM_BLOCKS		16   /* 64-byte ChaCha20 blocks per refill */
+#define RANDOM_KEY_SIZE		32
+
+struct random_state {
+  uint32_t key [8];
+  uint64_t counter;
+  unsigned char buffer [RANDOM_BLOCKS * 64];
+  size_t position;           /* next unused byte in buffer */
+  size_t since_seed;         /* bytes generated since the last seed */
+  unsigned int fork_generation;
+};
+
+static pthread_once_t random_once = PTHREAD_ONCE_INIT;
+static pthread_key_t random_key;
+static volatile unsigned int random_fork_generation = 0;
+
+static void random_fork_child (void)
+{
+  random_fork_generation++;
+}
+
+static void random_state_free (void * arg)
+{
+  memset (arg, 0, sizeof (struct random_state));
+  free (arg);
+}
+
+static void random_init_once (void)
+{
+  pthread_key_create (&random_key, random_state_free);
+  pthread_atfork (NULL, NULL, random_fork_child);
+}
+
+#define CHACHA_ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d)					\
+  a += b; d ^= a; d = CHACHA_ROTL (d, 16);			\
+  c += d; b ^= c; b = CHACHA_ROTL (b, 12);			\
+  a += b; d ^= a; d = CHACHA_ROTL (d, 8);			\
+  c += d; b ^= c; b = CHACHA_ROTL (b, 7)
+
+/* one 64-byte block of ChaCha20 keystream, RFC 7539 with a zero nonce
+ * and a 64-bit block counter */
+static void chacha20_block (const uint32_t * key, uint64_t counter,
+                            unsigned char * result)
+{
+  uint32_t in [16];
+  in [0] = 0x61707865;   /* "expand 32-byte k" */
+  in [1] = 0x3320646e;
+  in [2] = 0x79622d32;
+  in [3] = 0x6b206574;
+  memcpy (in + 4, key, RANDOM_KEY_SIZE);
+  in [12] = (uint32_t) counter;
+  in [13] = (uint32_t) (counter >> 32);
+  in [14] = 0;
+  in [15] = 0;
+  uint32_t x [16];
+  memcpy (x, in, sizeof (x));
+  int i;
+  for (i = 0; i < 10; i++) {
+    CHACHA_QR (x [0], x [4], x [ 8], x [12]);
+    CHACHA_QR (x [1], x [5], x [ 9], x [13]);
+    CHACHA_QR (x [2], x [6], x [10], x [14]);
+    CHACHA_QR (x [3], x [7], x [11], x [15]);
+    CHACHA_QR (x [0], x [5], x [10], x [15]);
+    CHACHA_QR (x [1], x [6], x [11], x [12]);
+    CHACHA_QR (x [2], x [7], x [ 8], x [13]);
+    CHACHA_QR (x [3], x [4], x [ 9], x [14]);
+  }
+  for (i = 0; i < 16; i++) {   /* little-endian output */
+    uint32_t v = x [i] + in [i];
+    result [4 * i    ] = v & 0xff;
+    result [4 * i + 1] = (v >> 8) & 0xff;
+    result [4 * i + 2] = (v >> 16) & 0xff;
+    result [4 * i + 3] = (v >> 24) & 0xff;
+  }
+}
+#undef CHACHA_QR
+#undef CHACHA_ROTL
+
+/* mixes kernel randomness into the key.  Returns 0 if none was available */
+static int random_seed (struct random_state * rs)
+{
+  uint32_t seed [8];
+  if (! kernel_random_bytes ((char *) seed, sizeof (seed)))
+    return 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    rs->key [i] ^= seed [i];
+  memset (seed, 0, sizeof (seed));
+  rs->position = sizeof (rs->buffer);   /* discard any buffered output */
+  rs->since_seed = 0;
+  rs->fork_generation = random_fork_generation;
+  return 1;
+}
+
+static void random_refill (struct random_state * rs)
+{
+  int i;
+  for (i = 0; i < RANDOM_BLOCKS; i++)
+    chacha20_block (rs->key, rs->counter++, rs->buffer + (64 * i));
+  memcpy (rs->key, rs->buffer, RANDOM_KEY_SIZE);
+  memset (rs->buffer, 0, RANDOM_KEY_SIZE);
+  rs->position = RANDOM_KEY_SIZE;
+}
+
+/* returns NULL if the generator cannot be seeded */
+static struct random_state * random_get_state (void)
+{
+  pthread_once (&random_once, random_init_once);
+  struct random_state * rs = pthread_getspecific (random_key);
+  if (rs == NULL) {
+    rs = malloc (sizeof (struct random_state));
+    if (rs == NULL)
+      return NULL;
+    memset (rs, 0, sizeof (struct random_state));
+    if (! random_seed (rs)) {
+      free (rs);
+      return NULL;
+    }
+    pthread_setspecific (random_key, rs);
+  } else if (rs->fork_generation != random_fork_generation) {
+    /* without a new seed, a forked child would repeat its parent's
+     * output, so use the fallback until seeding works */
+    if (! random_seed (rs))
+      return NULL;
+  } else if (rs->since_seed >= RANDOM_RESEED_BYTES) {
+    if (! random_seed (rs))   /* keep going with the current key */
+      rs->since_seed = 0;
+  }
+  return rs;
+}
+
 /* fill this array with random bytes */
 void random_bytes (char * buffer, size_t bsize)
 {
-  if (! dev_urandom_bytes (buffer, bsize))
-    computed_random_bytes (buffer, bsize);
+  struct random_state * rs = random_get_state ();
+  if (rs == NULL) {
+    if (! dev_urandom_bytes (buffer, bsize))
+      computed_random_bytes (buffer, bsize);
+    return;
+  }
+  rs->since_seed += bsize;
+  while (bsize > 0) {
+    if (rs->position >= sizeof (rs->buffer))
+      random_refill (rs);
+    size_t n = sizeof (rs->buffer) - rs->position;
+    if (n > bsize)
+      n = bsize;
+    memcpy (buffer, rs->buffer + rs->position, n);
+    memset (rs->buffer + rs->position, 0, n);
+    rs->position += n;
+    buffer += n;
+    bsize -= n;
+  }
 }
+#undef RANDOM_BLOCKS
+#undef RANDOM_KEY_SIZE
 
 /* a random int between min and max (inclusive) */
 /* returns min if min >= max */
@@ -1894,32 +2887,34 @@ int is_expired_message (const char * packet, unsigned int size)
 extern int is_valid_message (const char * packet, unsigned int size,
                              char ** error_desc)
 {
-  if (size < (int) ALLNET_HEADER_SIZE)
-    return_valid_err ("packet size less than header size");
-/* received a message with a header */
   const struct allnet_header * ah = (const struct allnet_header *) packet;
+  if (! ALLNET_HEADER_IS_SANE (ah, size)) {  /* find out what is wrong */
+    if (size < (int) ALLNET_HEADER_SIZE)
+      return_valid_err ("packet size less than header size");
 /* make sure version, address bit counts and hops are sane */
-  if ((ah->version != ALLNET_VERSION) ||
-      (ah->src_nbits > ADDRESS_BITS) || (ah->dst_nbits > ADDRESS_BITS) ||
-      (ah->hops > ah->max_hops)) {
+    if ((ah->version != ALLNET_VERSION) ||
+        (ah->src_nbits > ADDRESS_BITS) || (ah->dst_nbits > ADDRESS_BITS) ||
+        (ah->hops > ah->max_hops)) {
 #if 0
-    printf ("received version %d addr sizes %d %d / %d, hops %d/%d, pid %d\n",
-            ah->version, ah->src_nbits, ah->dst_nbits, ADDRESS_BITS,
-            ah->hops, ah->max_hops, getpid ());
-    print_buffer (packet, size, "received bytes", size, 1);
+      printf ("received version %d addr sizes %d %d / %d, hops %d/%d, pid %d\n",
+              ah->version, ah->src_nbits, ah->dst_nbits, ADDRESS_BITS,
+              ah->hops, ah->max_hops, getpid ());
+      print_buffer (packet, size, "received bytes", size, 1);
 sleep (60);
 ah->version = 0;
 printf ("time to crash %d\n", 1000 / ah->version);
 #endif /* 0 */
-    if (ah->hops > ah->max_hops) return_valid_err ("hops > max_hops");
-    if (ah->dst_nbits > ADDRESS_BITS) return_valid_err ("dst_nbits > 64");
-    if (ah->src_nbits > ADDRESS_BITS) return_valid_err ("src_nbits > 64");
-    if (ah->version != ALLNET_VERSION) return_valid_err ("version number");
+      if (ah->hops > ah->max_hops) return_valid_err ("hops > max_hops");
+      if (ah->dst_nbits > ADDRESS_BITS) return_valid_err ("dst_nbits > 64");
+      if (ah->src_nbits > ADDRESS_BITS) return_valid_err ("src_nbits > 64");
+      if (ah->version != ALLNET_VERSION) return_valid_err ("version number");
+      return_valid_err ("unknown error");
+    }
+    if ((ah->message_type < ALLNET_TYPE_DATA) ||
+        (ah->message_type > ALLNET_TYPE_MGMT))    /* nonsense packet */
+      return_valid_err ("bad message type");
     return_valid_err ("unknown error");
   }
-  if ((ah->message_type < ALLNET_TYPE_DATA) ||
-      (ah->message_type > ALLNET_TYPE_MGMT))    /* nonsense packet */
-    return_valid_err ("bad message type");
 /* check the validity of the packet, as defined in packet.h */
   if ((ah->message_type == ALLNET_TYPE_ACK) && (ah->transport != 0)) {
     /* printf ("received ack, transport 0x%x != 0", ah->transport); */
@@ -1993,27 +2988,22 @@ printf ("got data request of size %d, min %d\n", size, wanted);
   return 1;
 }
 
-/* computes the sender authentication into the given buffer */
-void compute_sender_auth (struct sockaddr_storage addr,
-                          const char * secret, int slen,
-                          long long int counter,
-                          char * to, int tsize)
+/* fills in the bytes the keepalive authentication is computed over,
+ * returns the number of bytes, or 0 if addr is not an IP address */
+static int sender_auth_input (struct sockaddr_storage * addr,
+                              long long int counter, char * buffer)
 {
-  if (tsize <= 0)
-    return;
-  memset (to, 0, tsize);
-  char buffer [sizeof (counter) + sizeof (struct sockaddr_storage)];
   writeb64 (buffer, counter);
   int off = sizeof (counter);
-  struct sockaddr * sap = (struct sockaddr *) (&addr);
+  struct sockaddr * sap = (struct sockaddr *) addr;
   if (sap->sa_family == AF_INET) {
-    struct sockaddr_in * sin = (struct sockaddr_in *) (&addr);
+    struct sockaddr_in * sin = (struct sockaddr_in *) addr;
     memcpy (buffer + off, &(sin->sin_addr), 4);
     off += 4;
     memcpy (buffer + off, &(sin->sin_port), 2);
     off += 2;
   } else if (sap->sa_family == AF_INET6) {
-    struct sockaddr_in6 * sin = (struct sockaddr_in6 *) (&addr);
+    struct sockaddr_in6 * sin = (struct sockaddr_in6 *) addr;
     if (memget (sin->sin6_addr.s6_addr, 0, 10) &&
         memget (sin->sin6_addr.s6_addr + 10, 0xff, 2)) {  /* ipv4 in ipv6 */
       memcpy (buffer + off, (sin->sin6_addr.s6_addr + 12), 4);
@@ -2025,13 +3015,146 @@ void compute_sender_auth (struct sockaddr_storage addr,
     memcpy (buffer + off, &(sin->sin6_port), 2);
     off += 2;
   } else
+    return 0;   /* not an IP address */
+  return off;
+}
+
+#define SENDER_AUTH_INPUT_SIZE	(8 + 16 + 2)   /* counter, ipv6, port */
+#define SENDER_AUTH_MAX_SECRET	64   /* longer secrets are not cached */
+#ifndef SENDER_AUTH_KEYS
+#define SENDER_AUTH_KEYS	4    /* ad, atcpd, and spares */
+#endif /* SENDER_AUTH_KEYS */
+#ifndef SENDER_AUTH_PEERS
+#define SENDER_AUTH_PEERS	1024
+#endif /* SENDER_AUTH_PEERS */
+
+/* the siphash key for each secret is derived with sha512, so is kept
+ * here rather than recomputed.  A secret that is replaced gets a new
+ * generation, making the authenticators cached for it obsolete */
+struct sender_auth_key {
+  unsigned int generation;   /* 0 if unused */
+  int slen;
+  char secret [SENDER_AUTH_MAX_SECRET];
+  char key [SIPHASH_KEY_SIZE];
+};
+/* and since the counter rarely changes, the authenticator for each peer
+ * is the same every time we send to or hear from that peer */
+struct sender_auth_peer {
+  unsigned int generation;   /* 0 if unused */
+  int isize;
+  char input [SENDER_AUTH_INPUT_SIZE];
+  char auth [KEEPALIVE_AUTHENTICATION_SIZE];
+};
+static struct sender_auth_key sender_auth_keys [SENDER_AUTH_KEYS];
+static struct sender_auth_peer sender_auth_peers [SENDER_AUTH_PEERS];
+static unsigned int sender_auth_generation = 0;
+static int sender_auth_next_key = 0;   /* next key slot to replace */
+static pthread_mutex_t sender_auth_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* key must have SIPHASH_KEY_SIZE bytes */
+static void sender_auth_derive_key (const char * secret, int slen, char * key)
+{
+  char hash [SHA512_SIZE];
+  static const char * label = "allnet keepalive authentication";
+  sha512hmac (label, (int)strlen (label), secret, slen, hash);
+  memcpy (key, hash, SIPHASH_KEY_SIZE);
+}
+
+/* must be called with sender_auth_mutex held.
+ * returns the cached key for this secret, adding it if needed */
+static struct sender_auth_key * sender_auth_key (const char * secret,
+                                                 int slen)
+{
+  int i;
+  for (i = 0; i < SENDER_AUTH_KEYS; i++) {
+    struct sender_auth_key * k = sender_auth_keys + i;
+    if ((k->generation != 0) && (k->slen == slen) &&
+        (memcmp (k->secret, secret, slen) == 0))
+      return k;
+  }
+  struct sender_auth_key * k = sender_auth_keys + sender_auth_next_key;
+  sender_auth_next_key = (sender_auth_next_key + 1) % SENDER_AUTH_KEYS;
+  if (++sender_auth_generation == 0)   /* 0 means unused */
+    sender_auth_generation = 1;
+  k->generation = sender_auth_generation;
+  k->slen = slen;
+  memcpy (k->secret, secret, slen);
+  sender_auth_derive_key (secret, slen, k->key);
+  return k;
+}
+
+/* only needs to spread the peers over the table, so need not be keyed:
+ * an attacker who makes peers collide only makes them slower */
+static int sender_auth_peer_index (const char * input, int isize)
+{
+  uint32_t hash = 2166136261U;   /* FNV-1a */
+  int i;
+  for (i = 0; i < isize; i++)
+    hash = (hash ^ ((unsigned char) input [i])) * 16777619U;
+  return (int) (hash % SENDER_AUTH_PEERS);
+}
+
+static void sender_auth_siphash (const char * input, int isize,
+                                 const char * secret, int slen, char * auth)
+{
+  if ((slen <= 0) || (slen > SENDER_AUTH_MAX_SECRET)) {  /* do not cache */
+    char key [SIPHASH_KEY_SIZE];
+    sender_auth_derive_key (secret, slen, key);
+    writeb64 (auth, siphash24 (input, isize, key));
+    return;
+  }
+  pthread_mutex_lock (&sender_auth_mutex);
+  struct sender_auth_key * k = sender_auth_key (secret, slen);
+  struct sender_auth_peer * p =
+    sender_auth_peers + sender_auth_peer_index (input, isize);
+  if ((p->generation != k->generation) || (p->isize != isize) ||
+      (memcmp (p->input, input, isize) != 0)) {
+    p->generation = k->generation;
+    p->isize = isize;
+    memcpy (p->input, input, isize);
+    writeb64 (p->auth, siphash24 (input, isize, k->key));
+  }
+  memcpy (auth, p->auth, KEEPALIVE_AUTHENTICATION_SIZE);
+  pthread_mutex_unlock (&sender_auth_mutex);
+}
+
+/* computes the sender authentication of the given version
+ * (0 for sha512 hmac, 1 for siphash) into the given buffer */
+static void compute_sender_auth_version (struct sockaddr_storage * addr,
+                                         const char * secret, int slen,
+                                         long long int counter, int version,
+                                         char * to, int tsize)
+{
+  if (tsize <= 0)
+    return;
+  memset (to, 0, tsize);
+  char buffer [SENDER_AUTH_INPUT_SIZE];
+  int off = sender_auth_input (addr, counter, buffer);
+  if (off <= 0)
     return;   /* not an IP address */
   char result [SHA512_SIZE];
-  sha512hmac (buffer, off, secret, KEEPALIVE_AUTHENTICATION_SIZE, result);
+  if (version)
+    sender_auth_siphash (buffer, off, secret, slen, result);
+  else
+    sha512hmac (buffer, off, secret, KEEPALIVE_AUTHENTICATION_SIZE, result);
   int csize = tsize;   /* copy size, for memcpy */
-  if (csize > sizeof (result))
-    csize = sizeof (result);
+  if (csize > KEEPALIVE_AUTHENTICATION_SIZE)
+    csize = KEEPALIVE_AUTHENTICATION_SIZE;
   memcpy (to, result, csize);
+  if (version)
+    to [0] |= KEEPALIVE_AUTH_VERSION_BIT;
+  else
+    to [0] &= ~KEEPALIVE_AUTH_VERSION_BIT;
+}
+
+/* computes the sender authentication into the given buffer */
+void compute_sender_auth (struct sockaddr_storage addr,
+                          const char * secret, int slen,
+                          long long int counter,
+                          char * to, int tsize)
+{
+  compute_sender_auth_version (&addr, secret, slen, counter,
+                               KEEPALIVE_AUTH_SIPHASH, to, tsize);
 }
 
 /* returns whether this keepalive has the right authentication */
@@ -2048,11 +3171,12 @@ int is_auth_keepalive (struct sockaddr_storage addr,
   int hsize = ALLNET_MGMT_HEADER_SIZE (hp->transport);
   if (msize != (hsize + 2 * KEEPALIVE_AUTHENTICATION_SIZE))
     return 0;   /* not a valid authentication packet */
+  const char * received = message + hsize + KEEPALIVE_AUTHENTICATION_SIZE;
+  int version = ((received [0] & KEEPALIVE_AUTH_VERSION_BIT) != 0);
   char verification [KEEPALIVE_AUTHENTICATION_SIZE];
-  compute_sender_auth (addr, secret, slen, counter,
-                       verification, sizeof (verification));
-  return (memcmp (message + hsize + KEEPALIVE_AUTHENTICATION_SIZE,
-                  verification, KEEPALIVE_AUTHENTICATION_SIZE) == 0);
+  compute_sender_auth_version (&addr, secret, slen, counter, version,
+                               verification, sizeof (verification));
+  return (memcmp (received, verification, KEEPALIVE_AUTHENTICATION_SIZE) == 0);
 }
 
 void print_gethostbyname_error (const char * hostname, struct allnet_log * log)
@@ -63,6 +63,15 @@ extern struct allnet_header *
                  const unsigned char * dest, unsigned int dbits,
                  const unsigned char * stream, const unsigned char * ack,
                  unsigned int * size);
+/* the same, but the packet is allocated with allnet_packet_alloc, and
+ * must be freed with allnet_packet_free, not free */
+extern struct allnet_header *
+  create_pool_packet (unsigned int data_size, unsigned int message_type,
+                      unsigned int max_hops, unsigned int sig_algo,
+                      const unsigned char * source, unsigned int sbits,
+                      const unsigned char * dest, unsigned int dbits,
+                      const unsigned char * stream, const unsigned char * ack,
+                      unsigned int * size);
 
 /* return a keepalive packet, which is in a static buffer
  * (do not change or free) and fill in the size to send */
@@ -138,6 +147,14 @@ extern int bitstring_matches (const unsigned char * x, int xoff,
 extern int matching_bits (const unsigned char * x, int xbits,
                           const unsigned char * y, int ybits);
 
+/* compares x to count bitstrings, the first at ys and each stride bytes
+ * after the previous one (so ys may point into an array of structs).
+ * sets results [i] to matching_bits (x, xbits, ys + i * stride, ybits)
+ * and returns the largest of the results, or 0 if count is 0 */
+extern int matching_bits_array (const unsigned char * x, int xbits,
+                                const unsigned char * ys, size_t stride,
+                                int ybits, int count, int * results);
+
 /* functions used to modify and read data request bitmaps
  * power_two is the size of the bitmap, in bits.
  * first_sixteen holds the first sixteen bits of the address or ID.
@@ -160,6 +177,27 @@ extern unsigned long long int allnet_time (void);   /* seconds since Y2K */
 extern unsigned long long int allnet_time_ms (void);/* milliseconds since Y2K */
 extern unsigned long long int allnet_time_us (void);/* microseconds since Y2K */
 
+/* the coarse clock is for loops that read the time often, but can use
+ * a time that may be somewhat out of date.  It only changes when
+ * allnet_clock_update is called, e.g. once per event loop iteration
+ * (right after waiting), or every ms milliseconds once
+ * allnet_clock_start_thread has been called.  Reading it is a single
+ * atomic load.  Until the first update, the coarse functions return the
+ * precise time.  If the system clock is set back by more than a second,
+ * the coarse clock follows it at the next update. */
+extern void allnet_clock_update (void);
+extern void allnet_clock_start_thread (int ms);
+extern unsigned long long int allnet_coarse_time (void);
+extern unsigned long long int allnet_coarse_time_ms (void);
+extern unsigned long long int allnet_coarse_time_us (void);
+/* for timers and rate limits, which measure intervals: the monotonic
+ * clocks count from an unspecified start, and are not changed when the
+ * system time is set.  The coarse ones are updated with the coarse clock */
+extern unsigned long long int allnet_monotonic_us (void);
+extern unsigned long long int allnet_monotonic_ms (void);
+extern unsigned long long int allnet_coarse_monotonic_us (void);
+extern unsigned long long int allnet_coarse_monotonic_ms (void);
+
 /* returns the result of calling ctime_r on the given allnet time. */
 /* the result buffer must be at least 30 bytes long */
 #define ALLNET_TIME_STRING_SIZE		30
@@ -223,6 +261,69 @@ extern char * string_replace_once (const char * original, const char * pattern,
 /* copy memory to new storage, using malloc_or_fail to get the memory */
 extern void * memcpy_malloc (const void * bytes, size_t bsize,
                              const char * desc);
+/* thread-safe allocation of packet buffers, which are reused rather than
+ * returned to malloc if they have at most ALLNET_MTU bytes.
+ * allnet_packet_alloc never returns NULL (it uses malloc_or_fail).
+ * Buffers must be freed with allnet_packet_free, never with free, and
+ * buffers from malloc must never be given to allnet_packet_free.
+ * allnet_packet_pool_stats reports how many allocations were served
+ * from the pool (hits) and how many needed malloc (misses) */
+extern void * allnet_packet_alloc (size_t size, const char * desc);
+extern void allnet_packet_free (void * buffer);
+extern void allnet_packet_pool_stats (unsigned long long int * hits,
+                                      unsigned long long int * misses);
+/* memory accounting by subsystem, so the memory used by each can be
+ * reported (allnetd answers ALLNET_MGMT_MEMORY_REQ, lib/mgmt.h).
+ * malloc_tagged and memcpy_malloc_tagged are like malloc_or_fail and
+ * memcpy_malloc, but count the bytes for the subsystem until the memory
+ * is given to free_tagged (never to free).  Memory obtained in other
+ * ways, e.g. mapped, is counted by calling allnet_memory_account with
+ * the number of bytes added (or, if negative, released) */
+#define ALLNET_MEMORY_OTHER		0
+#define ALLNET_MEMORY_PCACHE		1	/* messages and hash tables */
+#define ALLNET_MEMORY_ROUTING		2	/* routing snapshots */
+#define ALLNET_MEMORY_DCACHE		3	/* dcache tables */
+#define ALLNET_MEMORY_STORE		4	/* xchat message cache */
+#define ALLNET_MEMORY_XCHAT		5	/* xchat ID caches */
+#define ALLNET_MEMORY_ATCPD		6	/* atcpd connection buffers */
+#define ALLNET_MEMORY_SUBSYSTEMS	7
+extern void * malloc_tagged (size_t bytes, int subsystem, const char * desc);
+extern void * memcpy_malloc_tagged (const void * bytes, size_t bsize,
+                                    int subsystem, const char * desc);
+extern void free_tagged (void * buffer);
+extern void allnet_memory_account (int subsystem, long long int bytes);
+/* returns the name of the subsystem, and the bytes it currently uses.
+ * If peak is not NULL, *peak is set to the most it has used */
+extern const char * allnet_memory_used (int subsystem, long long int * used,
+                                        long long int * peak);
+/* a process may keep the memory counted for all subsystems within a budget,
+ * by default 1/4 of the physical memory, or the number of MiB in the
+ * environment variable ALLNET_MEMORY_BUDGET (0 for no budget).
+ * About once a second, if the total is over the budget, each registered
+ * shrink function is called in turn with the number of bytes over, and
+ * should release what it can, e.g. by evicting cached entries.  The
+ * shrink functions are called in a separate thread, holding no locks */
+extern long long int allnet_memory_budget (void);
+extern void allnet_memory_set_budget (long long int bytes);
+extern void allnet_memory_register_shrink (int subsystem,
+                                           void (* shrink) (long long int));
+
+/* sets the scheduling of the calling thread as configured for the given
+ * name, for example "atcpd" or "voa-audio".  The configuration is the
+ * environment variable ALLNET_SCHED_ followed by the name in upper case,
+ * with other characters replaced by _ (e.g. ALLNET_SCHED_VOA_AUDIO), of
+ * the form [policy][:priority][@cpus], for example fifo:20@2,3
+ *   policy is fifo, rr or other.  On macOS, where fifo and rr give the
+ *     user-interactive QoS class, it may also be a QoS class: interactive,
+ *     initiated, utility or background
+ *   priority is for fifo and rr, by default 10
+ *   cpus is a list of cpus and ranges of cpus, e.g. 0,2-3 (linux only)
+ * Threads later created by this thread inherit the settings.
+ * Returns 1 if there is no configuration or all of it was applied,
+ * 0 otherwise (in which case the reason is printed; real-time policies
+ * usually need privileges, such as CAP_SYS_NICE on linux) */
+extern int allnet_thread_config (const char * name);
+
 /* copy two buffers to new storage, using malloc_or_fail to get the memory */
 extern void * memcat_malloc (const void * bytes1, size_t bsize1,
                              const void * bytes2, size_t bsize2,
@@ -245,6 +346,18 @@ extern int write_file (const char * file_name, const char * content, int clen,
                        int print_errors);
 extern int append_file (const char * file_name, const char * content, int clen,
                         int print_errors);
+/* same, but the content is copied and written later by a writer thread,
+ * so these return without waiting for the disk.  Errors are printed
+ * (if print_errors) when the write is made.  If sync, the file is also
+ * synced once written.  Return 1 if the write was queued, or otherwise
+ * the result of write_file or append_file.  read_file_malloc returns
+ * the content most recently queued */
+extern int write_file_async (const char * file_name, const char * content,
+                             int clen, int sync, int print_errors);
+extern int append_file_async (const char * file_name, const char * content,
+                              int clen, int sync, int print_errors);
+/* returns once all queued writes have been made */
+extern void file_writes_flush (void);
 /* return -1 in case of errors, usually if the file doesn't exist */
 extern long long int file_size (const char * file_name);
 extern long long int fd_size (int fd);
@@ -8,6 +8,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define WP_AES_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif /* (__x86_64__ || __i386__) && __GNUC__ */
+
+/* the ARMv8 AES instructions are only used if the compiler is allowed to
+ * generate them, e.g. with -march=armv8-a+crypto */
+#if defined (__aarch64__) && defined (__linux__) && \
+    (defined (__ARM_FEATURE_CRYPTO) || defined (__ARM_FEATURE_AES))
+#define WP_AES_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif /* __aarch64__ && __linux__ && __ARM_FEATURE_CRYPTO */
 
 #include "wp_aes.h"
 
@@ -419,6 +436,448 @@ static void AES(const unsigned char *M, unsigned char *C, uint32_t *w)
 /* end of Wes's AES.c */
 
 
+/* the code above is simple and clear, but slow.  For speed, blocks are
+ * encrypted with the processor's AES instructions if it has them, and
+ * otherwise with 32-bit tables that combine SubBytes, ShiftRows, and
+ * MixColumns, ("T-tables").  The code above checks that an
+ * implementation gives the right result before it is used */
+
+/* Te [i] [x] is the column contributed by byte x of row i */
+static uint32_t Te [4] [256];
+
+static void init_t_tables ()
+{
+  int x;
+  for (x = 0; x < 256; x++) {
+    uint32_t s = SB [x];
+    uint32_t t = (times (2, s) << 24) | (s << 16) | (s << 8) | times (3, s);
+    int i;
+    for (i = 0; i < 4; i++) {
+      Te [i] [x] = t;
+      t = (t >> 8) | (t << 24);
+    }
+  }
+}
+
+static void encrypt_t_tables (const struct wp_aes_key * key,
+                              const unsigned char * in, unsigned char * out)
+{
+  const uint32_t * w = key->w;
+  uint32_t s0 = makeword (in) ^ w [0];
+  uint32_t s1 = makeword (in + 4) ^ w [1];
+  uint32_t s2 = makeword (in + 8) ^ w [2];
+  uint32_t s3 = makeword (in + 12) ^ w [3];
+  int round;
+  for (round = 1; round < Nr; round++) {
+    w += Nb;
+    uint32_t t0 = Te [0] [s0 >> 24] ^ Te [1] [(s1 >> 16) & 0xff] ^
+                  Te [2] [(s2 >> 8) & 0xff] ^ Te [3] [s3 & 0xff] ^ w [0];
+    uint32_t t1 = Te [0] [s1 >> 24] ^ Te [1] [(s2 >> 16) & 0xff] ^
+                  Te [2] [(s3 >> 8) & 0xff] ^ Te [3] [s0 & 0xff] ^ w [1];
+    uint32_t t2 = Te [0] [s2 >> 24] ^ Te [1] [(s3 >> 16) & 0xff] ^
+                  Te [2] [(s0 >> 8) & 0xff] ^ Te [3] [s1 & 0xff] ^ w [2];
+    uint32_t t3 = Te [0] [s3 >> 24] ^ Te [1] [(s0 >> 16) & 0xff] ^
+                  Te [2] [(s1 >> 8) & 0xff] ^ Te [3] [s2 & 0xff] ^ w [3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+  w += Nb;   /* the last round has no MixColumns */
+  uint32_t state [4];
+  state [0] = (((uint32_t) SB [s0 >> 24]) << 24) | (SB [(s1 >> 16) & 0xff] << 16) |
+              (SB [(s2 >> 8) & 0xff] << 8) | SB [s3 & 0xff];
+  state [1] = (((uint32_t) SB [s1 >> 24]) << 24) | (SB [(s2 >> 16) & 0xff] << 16) |
+              (SB [(s3 >> 8) & 0xff] << 8) | SB [s0 & 0xff];
+  state [2] = (((uint32_t) SB [s2 >> 24]) << 24) | (SB [(s3 >> 16) & 0xff] << 16) |
+              (SB [(s0 >> 8) & 0xff] << 8) | SB [s1 & 0xff];
+  state [3] = (((uint32_t) SB [s3 >> 24]) << 24) | (SB [(s0 >> 16) & 0xff] << 16) |
+              (SB [(s1 >> 8) & 0xff] << 8) | SB [s2 & 0xff];
+  int i;
+  for (i = 0; i < 4; i++) {
+    uint32_t v = state [i] ^ w [i];
+    out [4 * i    ] = v >> 24;
+    out [4 * i + 1] = (v >> 16) & 0xff;
+    out [4 * i + 2] = (v >> 8) & 0xff;
+    out [4 * i + 3] = v & 0xff;
+  }
+}
+
+#ifdef WP_AES_X86
+__attribute__ ((target ("aes,sse2")))
+static void encrypt_x86 (const struct wp_aes_key * key,
+                         const unsigned char * in, unsigned char * out)
+{
+  const __m128i * rk = (const __m128i *) (key->round_keys);
+  __m128i x = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) in),
+                             _mm_loadu_si128 (rk));
+  int round;
+  for (round = 1; round < Nr; round++)
+    x = _mm_aesenc_si128 (x, _mm_loadu_si128 (rk + round));
+  x = _mm_aesenclast_si128 (x, _mm_loadu_si128 (rk + Nr));
+  _mm_storeu_si128 ((__m128i *) out, x);
+}
+
+/* each aesenc takes several cycles, but a new one can start every cycle,
+ * so encrypting WP_AES_LANES independent blocks at once is much faster */
+#define WP_AES_LANES	8
+
+/* the lanes are in separate variables so they stay in registers */
+__attribute__ ((target ("aes,sse2"), always_inline))
+static inline void encrypt_lanes_x86 (const struct wp_aes_key * key,
+                                      __m128i * x)
+{
+  const __m128i * rk = (const __m128i *) (key->round_keys);
+  __m128i k = _mm_loadu_si128 (rk);
+  __m128i x0 = _mm_xor_si128 (x [0], k);
+  __m128i x1 = _mm_xor_si128 (x [1], k);
+  __m128i x2 = _mm_xor_si128 (x [2], k);
+  __m128i x3 = _mm_xor_si128 (x [3], k);
+  __m128i x4 = _mm_xor_si128 (x [4], k);
+  __m128i x5 = _mm_xor_si128 (x [5], k);
+  __m128i x6 = _mm_xor_si128 (x [6], k);
+  __m128i x7 = _mm_xor_si128 (x [7], k);
+  int round;
+  for (round = 1; round < Nr; round++) {
+    k = _mm_loadu_si128 (rk + round);
+    x0 = _mm_aesenc_si128 (x0, k);
+    x1 = _mm_aesenc_si128 (x1, k);
+    x2 = _mm_aesenc_si128 (x2, k);
+    x3 = _mm_aesenc_si128 (x3, k);
+    x4 = _mm_aesenc_si128 (x4, k);
+    x5 = _mm_aesenc_si128 (x5, k);
+    x6 = _mm_aesenc_si128 (x6, k);
+    x7 = _mm_aesenc_si128 (x7, k);
+  }
+  k = _mm_loadu_si128 (rk + Nr);
+  x [0] = _mm_aesenclast_si128 (x0, k);
+  x [1] = _mm_aesenclast_si128 (x1, k);
+  x [2] = _mm_aesenclast_si128 (x2, k);
+  x [3] = _mm_aesenclast_si128 (x3, k);
+  x [4] = _mm_aesenclast_si128 (x4, k);
+  x [5] = _mm_aesenclast_si128 (x5, k);
+  x [6] = _mm_aesenclast_si128 (x6, k);
+  x [7] = _mm_aesenclast_si128 (x7, k);
+}
+
+__attribute__ ((target ("aes,sse2")))
+static void encrypt_blocks_x86 (const struct wp_aes_key * key,
+                                const unsigned char * in, unsigned char * out,
+                                int nblocks)
+{
+  while (nblocks >= WP_AES_LANES) {
+    __m128i x [WP_AES_LANES];
+    int i;
+    for (i = 0; i < WP_AES_LANES; i++)
+      x [i] = _mm_loadu_si128 (((const __m128i *) in) + i);
+    encrypt_lanes_x86 (key, x);
+    for (i = 0; i < WP_AES_LANES; i++)
+      _mm_storeu_si128 (((__m128i *) out) + i, x [i]);
+    in += WP_AES_LANES * WP_AES_BLOCK_SIZE;
+    out += WP_AES_LANES * WP_AES_BLOCK_SIZE;
+    nblocks -= WP_AES_LANES;
+  }
+  for ( ; nblocks > 0; nblocks--) {
+    encrypt_x86 (key, in, out);
+    in += WP_AES_BLOCK_SIZE;
+    out += WP_AES_BLOCK_SIZE;
+  }
+}
+
+/* the counter blocks are made in registers: storing them to memory and
+ * loading them again is slower than encrypting them */
+__attribute__ ((target ("aes,sse2")))
+static void ctr_blocks_x86 (const struct wp_aes_key * key,
+                            unsigned char * counter, unsigned char * out,
+                            int nblocks)
+{
+  uint64_t high;
+  uint64_t low;
+  memcpy (&high, counter, 8);
+  memcpy (&low, counter + 8, 8);
+  high = __builtin_bswap64 (high);
+  low = __builtin_bswap64 (low);
+  while (nblocks > 0) {
+    __m128i x [WP_AES_LANES];   /* the last lanes may not be used */
+    uint64_t h = high;
+    uint64_t l = low;
+    int i;
+    for (i = 0; i < WP_AES_LANES; i++) {
+      x [i] = _mm_set_epi64x ((long long int) __builtin_bswap64 (l),
+                              (long long int) __builtin_bswap64 (h));
+      if (++l == 0)
+        h++;
+    }
+    encrypt_lanes_x86 (key, x);
+    int n = (nblocks < WP_AES_LANES) ? nblocks : WP_AES_LANES;
+    for (i = 0; i < n; i++)
+      _mm_storeu_si128 (((__m128i *) out) + i, x [i]);
+    low += n;
+    if (low < (uint64_t) n)   /* carry */
+      high++;
+    out += n * WP_AES_BLOCK_SIZE;
+    nblocks -= n;
+  }
+  high = __builtin_bswap64 (high);
+  low = __builtin_bswap64 (low);
+  memcpy (counter, &high, 8);
+  memcpy (counter + 8, &low, 8);
+}
+
+static int x86_has_aes ()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (((ecx & bit_AES) != 0) && ((edx & bit_SSE2) != 0));
+}
+#endif /* WP_AES_X86 */
+
+#ifdef WP_AES_ARM
+/* aese does AddRoundKey, SubBytes, and ShiftRows, aesmc does MixColumns */
+static void encrypt_arm (const struct wp_aes_key * key,
+                         const unsigned char * in, unsigned char * out)
+{
+  uint8x16_t x = vld1q_u8 (in);
+  int round;
+  for (round = 0; round < Nr - 1; round++)
+    x = vaesmcq_u8 (vaeseq_u8 (x, vld1q_u8 (key->round_keys + 16 * round)));
+  x = vaeseq_u8 (x, vld1q_u8 (key->round_keys + 16 * (Nr - 1)));
+  x = veorq_u8 (x, vld1q_u8 (key->round_keys + 16 * Nr));
+  vst1q_u8 (out, x);
+}
+
+/* as for x86, independent blocks keep the AES unit busy */
+static void encrypt_blocks_arm (const struct wp_aes_key * key,
+                                const unsigned char * in, unsigned char * out,
+                                int nblocks)
+{
+  while (nblocks >= 4) {
+    uint8x16_t x0 = vld1q_u8 (in);
+    uint8x16_t x1 = vld1q_u8 (in + 16);
+    uint8x16_t x2 = vld1q_u8 (in + 32);
+    uint8x16_t x3 = vld1q_u8 (in + 48);
+    int round;
+    for (round = 0; round < Nr - 1; round++) {
+      uint8x16_t k = vld1q_u8 (key->round_keys + 16 * round);
+      x0 = vaesmcq_u8 (vaeseq_u8 (x0, k));
+      x1 = vaesmcq_u8 (vaeseq_u8 (x1, k));
+      x2 = vaesmcq_u8 (vaeseq_u8 (x2, k));
+      x3 = vaesmcq_u8 (vaeseq_u8 (x3, k));
+    }
+    uint8x16_t k = vld1q_u8 (key->round_keys + 16 * (Nr - 1));
+    uint8x16_t last = vld1q_u8 (key->round_keys + 16 * Nr);
+    vst1q_u8 (out     , veorq_u8 (vaeseq_u8 (x0, k), last));
+    vst1q_u8 (out + 16, veorq_u8 (vaeseq_u8 (x1, k), last));
+    vst1q_u8 (out + 32, veorq_u8 (vaeseq_u8 (x2, k), last));
+    vst1q_u8 (out + 48, veorq_u8 (vaeseq_u8 (x3, k), last));
+    in += 4 * WP_AES_BLOCK_SIZE;
+    out += 4 * WP_AES_BLOCK_SIZE;
+    nblocks -= 4;
+  }
+  for ( ; nblocks > 0; nblocks--) {
+    encrypt_arm (key, in, out);
+    in += WP_AES_BLOCK_SIZE;
+    out += WP_AES_BLOCK_SIZE;
+  }
+}
+#endif /* WP_AES_ARM */
+
+/* adds 1 to the big-endian counter */
+static void increment (unsigned char * counter)
+{
+  int i;
+  for (i = WP_AES_BLOCK_SIZE - 1; i >= 0; i--)
+    if (++(counter [i]) != 0)   /* no carry */
+      break;
+}
+
+static void encrypt_blocks_t_tables (const struct wp_aes_key * key,
+                                     const unsigned char * in,
+                                     unsigned char * out, int nblocks)
+{
+  for ( ; nblocks > 0; nblocks--) {
+    encrypt_t_tables (key, in, out);
+    in += WP_AES_BLOCK_SIZE;
+    out += WP_AES_BLOCK_SIZE;
+  }
+}
+
+typedef void (* encrypt_fn) (const struct wp_aes_key * key,
+                             const unsigned char * in, unsigned char * out);
+/* in and out may be the same, each has nblocks * WP_AES_BLOCK_SIZE bytes */
+typedef void (* encrypt_blocks_fn) (const struct wp_aes_key * key,
+                                    const unsigned char * in,
+                                    unsigned char * out, int nblocks);
+
+/* fills keystream with the encryption of nblocks successive values of
+ * the big-endian counter, which is then updated to the next value */
+typedef void (* ctr_fn) (const struct wp_aes_key * key,
+                         unsigned char * counter, unsigned char * keystream,
+                         int nblocks);
+
+struct implementation {
+  encrypt_fn one;
+  encrypt_blocks_fn many;
+  ctr_fn ctr;        /* NULL to use many */
+};
+
+static const struct implementation t_tables =
+  { encrypt_t_tables, encrypt_blocks_t_tables, NULL };
+static struct implementation implementation =
+  { encrypt_t_tables, encrypt_blocks_t_tables, NULL };
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+/* returns 1 if impl gives the same results as the reference code */
+static int check_implementation (const struct implementation * impl)
+{
+  unsigned char key [AES_KEY_256_BYTES];
+  /* enough blocks to use every code path in impl->many */
+  unsigned char in [19 * WP_AES_BLOCK_SIZE];
+  unsigned char expected [sizeof (in)];
+  unsigned char result [sizeof (in)];
+  int i;
+  for (i = 0; i < AES_KEY_256_BYTES; i++)
+    key [i] = i * 37 + 11;
+  for (i = 0; i < (int) sizeof (in); i++)
+    in [i] = i * 53 + 7;
+  struct wp_aes_key k;
+  wp_aes_set_key (AES_KEY_256_BYTES, (char *) key, &k);
+  for (i = 0; i < (int) sizeof (in); i += WP_AES_BLOCK_SIZE)
+    AES (in + i, expected + i, k.w);
+  impl->one (&k, in, result);
+  if (memcmp (expected, result, WP_AES_BLOCK_SIZE) != 0)
+    return 0;
+  impl->many (&k, in, result, sizeof (in) / WP_AES_BLOCK_SIZE);
+  if (memcmp (expected, result, sizeof (in)) != 0)
+    return 0;
+  if (impl->ctr == NULL)
+    return 1;
+  /* counters ending in ..., 00 ff ff fd, 00 ff ff fe, 00 ff ff ff, 01 00 00 00,
+   * test the carry */
+  unsigned char counter [WP_AES_BLOCK_SIZE];
+  memcpy (counter, in, sizeof (counter));
+  memset (counter + 9, 0xff, 7);
+  counter [15] = 0xf0;
+  for (i = 0; i < (int) sizeof (in); i += WP_AES_BLOCK_SIZE) {
+    memcpy (in + i, counter, WP_AES_BLOCK_SIZE);
+    AES (in + i, expected + i, k.w);
+    increment (counter);
+  }
+  memcpy (counter, in, sizeof (counter));
+  /* two calls, to check the counter is updated correctly */
+  impl->ctr (&k, counter, result, 3);
+  impl->ctr (&k, counter, result + 3 * WP_AES_BLOCK_SIZE,
+             sizeof (in) / WP_AES_BLOCK_SIZE - 3);
+  return (memcmp (expected, result, sizeof (in)) == 0);
+}
+
+static void select_implementation ()
+{
+  init_t_tables ();
+  struct implementation best = t_tables;
+#ifdef WP_AES_X86
+  if (x86_has_aes ()) {
+    best.one = encrypt_x86;
+    best.many = encrypt_blocks_x86;
+    best.ctr = ctr_blocks_x86;
+  }
+#endif /* WP_AES_X86 */
+#ifdef WP_AES_ARM
+  if ((getauxval (AT_HWCAP) & HWCAP_AES) != 0) {
+    best.one = encrypt_arm;
+    best.many = encrypt_blocks_arm;
+  }
+#endif /* WP_AES_ARM */
+  if ((best.one != t_tables.one) && (! check_implementation (&best)))
+    best = t_tables;
+  if (! check_implementation (&best)) {   /* should never happen */
+    printf ("error: wp_aes T-tables do not give the right result\n");
+    exit (1);
+  }
+  implementation = best;
+}
+
+/* expands the key, so it can be used for many blocks.
+ * ksize must be 32 */
+void wp_aes_set_key (int ksize, const char * key, struct wp_aes_key * result)
+{
+  if (ksize != 32) {
+    printf ("error: wp_aes_set_key only supports 32-byte/256-bit key\n");
+    printf ("       %d-byte key specified\n", ksize);
+    exit (1);   /* this is a serious error in the caller */
+  }
+  KeyExpansion ((const unsigned char *) key, result->w);
+  int i;
+  for (i = 0; i < Nb * (Nr + 1); i++) {
+    result->round_keys [4 * i    ] = result->w [i] >> 24;
+    result->round_keys [4 * i + 1] = (result->w [i] >> 16) & 0xff;
+    result->round_keys [4 * i + 2] = (result->w [i] >> 8) & 0xff;
+    result->round_keys [4 * i + 3] = result->w [i] & 0xff;
+  }
+}
+
+/* in, out may be the same or different buffer, both should
+ * have WP_AES_BLOCK_SIZE bytes */
+void wp_aes_encrypt_with_key (const struct wp_aes_key * key,
+                              const char * in, char * out)
+{
+  pthread_once (&select_once, select_implementation);
+  implementation.one (key, (const unsigned char *) in, (unsigned char *) out);
+}
+
+/* the number of blocks encrypted at once by wp_aes_ctr_crypt */
+#define CTR_CHUNK_BLOCKS	32
+
+/* fills keystream with the encryption of nblocks successive values of
+ * the big-endian counter, which is then updated to the next value */
+void wp_aes_ctr_blocks (const struct wp_aes_key * key, char * counter,
+                        char * keystream, int nblocks)
+{
+  pthread_once (&select_once, select_implementation);
+  unsigned char * c = (unsigned char *) counter;
+  unsigned char * out = (unsigned char *) keystream;
+  if (implementation.ctr != NULL) {
+    implementation.ctr (key, c, out, nblocks);
+    return;
+  }
+  int i;
+  for (i = 0; i < nblocks; i++) {
+    memcpy (out + i * WP_AES_BLOCK_SIZE, c, WP_AES_BLOCK_SIZE);
+    increment (c);
+  }
+  implementation.many (key, out, out, nblocks);
+}
+
+/* counter mode encryption or decryption of dsize bytes.  Each block of
+ * data uses the next value of counter, which is updated */
+void wp_aes_ctr_crypt (const struct wp_aes_key * key, char * counter,
+                       const char * data, int dsize, char * result)
+{
+  uint64_t keystream [CTR_CHUNK_BLOCKS * WP_AES_BLOCK_SIZE / 8];
+  while (dsize > 0) {
+    int nblocks = (dsize + WP_AES_BLOCK_SIZE - 1) / WP_AES_BLOCK_SIZE;
+    if (nblocks > CTR_CHUNK_BLOCKS)
+      nblocks = CTR_CHUNK_BLOCKS;
+    wp_aes_ctr_blocks (key, counter, (char *) keystream, nblocks);
+    int n = nblocks * WP_AES_BLOCK_SIZE;
+    if (n > dsize)
+      n = dsize;
+    int i;
+    for (i = 0; i + 8 <= n; i += 8) {   /* 8 bytes at a time */
+      uint64_t x;
+      memcpy (&x, data + i, 8);
+      x ^= keystream [i / 8];
+      memcpy (result + i, &x, 8);
+    }
+    for ( ; i < n; i++)
+      result [i] = data [i] ^ ((char *) keystream) [i];
+    data += n;
+    result += n;
+    dsize -= n;
+  }
+}
+
 /* for AES in counter mode, only encryption is used
  * in, out may be the same or different buffer, both should
  * have WP_AES_BLOCK_SIZE bytes
@@ -426,18 +885,14 @@ static void AES(const unsigned char *M, unsigned char *C, uint32_t *w)
 void wp_aes_encrypt_block (int ksize, const char * key,
                            const char * in, char * out)
 {
-  if (ksize != 32) {
-    printf ("error: wp_aes_encrypt_block only supports 32-byte/256-bit key\n");
-    printf ("       %d-byte key specified\n", ksize);
-    exit (1);   /* this is a serious error in the caller */
-  }
-  uint32_t w[60];  /* 60 = Nb*(Nr+1)  */
-  /* uint32_t state[4]; */
-  KeyExpansion((const unsigned char *) key, w);
-  AES ((const unsigned char *) in, (unsigned char *) out, w);
+  struct wp_aes_key k;
+  wp_aes_set_key (ksize, key, &k);
+  wp_aes_encrypt_with_key (&k, in, out);
 }
 
 #ifdef AES_UNIT_TEST
+#include <time.h>
+
 int main (int argc, char ** argv)
 {
   char key [] =   /* not random */
@@ -458,7 +913,88 @@ int main (int argc, char ** argv)
     printf ("error: AES did not give the right result\n");
     return 1;
   }
+  struct wp_aes_key k;
+  wp_aes_set_key (32, key, &k);
+  encrypt_t_tables (&k, (unsigned char *) data, (unsigned char *) result);
+  if (memcmp (expected, result, sizeof (result)) != 0) {
+    printf ("error: AES T-tables did not give the right result\n");
+    return 1;
+  }
   printf ("AES test was successful\n");
+
+  /* compare the implementations on many blocks, and time them */
+  int count = 1000000;
+  if (argc > 1)
+    count = atoi (argv [1]);
+  int i;
+  for (i = 0; i < 32; i++)
+    key [i] = i * 7 + 1;
+  wp_aes_set_key (32, key, &k);
+  encrypt_fn fns [] = { NULL /* reference */, encrypt_t_tables,
+                        implementation.one };
+  const char * names [] = { "reference", "T-tables", "selected" };
+  char sums [3] [WP_AES_BLOCK_SIZE];
+  int f;
+  for (f = 0; f < 3; f++) {
+    memset (data, 0, sizeof (data));
+    struct timespec start, finish;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {   /* each block encrypts the previous one */
+      if (fns [f] == NULL)
+        AES ((unsigned char *) data, (unsigned char *) data, k.w);
+      else
+        fns [f] (&k, (unsigned char *) data, (unsigned char *) data);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &finish);
+    memcpy (sums [f], data, sizeof (data));
+    double ns = (finish.tv_sec - start.tv_sec) * 1e9 +
+                (finish.tv_nsec - start.tv_nsec);
+    printf ("%-10s %8.2fns per block\n", names [f], ns / count);
+  }
+  if ((memcmp (sums [0], sums [1], WP_AES_BLOCK_SIZE) != 0) ||
+      (memcmp (sums [0], sums [2], WP_AES_BLOCK_SIZE) != 0)) {
+    printf ("error: AES implementations give different results\n");
+    return 1;
+  }
+
+  /* counter mode, one block at a time and in chunks */
+  int csize = 1000 * WP_AES_BLOCK_SIZE + 5;
+  char * plain = malloc (csize);
+  char * one = malloc (csize);
+  char * chunks = malloc (csize);
+  for (i = 0; i < csize; i++)
+    plain [i] = i % 251;
+  char counter [WP_AES_BLOCK_SIZE];
+  memset (counter, 0, sizeof (counter));
+  counter [15] = 0xf0;   /* carry into the next byte */
+  char block [WP_AES_BLOCK_SIZE];
+  for (i = 0; i < csize; i++) {
+    if ((i % WP_AES_BLOCK_SIZE) == 0)
+      wp_aes_ctr_blocks (&k, counter, block, 1);
+    one [i] = plain [i] ^ block [i % WP_AES_BLOCK_SIZE];
+  }
+  memset (counter, 0, sizeof (counter));
+  counter [15] = 0xf0;
+  struct timespec start, finish;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  int loops = count / 1000 + 1;
+  for (f = 0; f < loops; f++) {
+    char c [WP_AES_BLOCK_SIZE];
+    memcpy (c, counter, sizeof (c));
+    wp_aes_ctr_crypt (&k, c, plain, csize, chunks);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &finish);
+  double ns = (finish.tv_sec - start.tv_sec) * 1e9 +
+              (finish.tv_nsec - start.tv_nsec);
+  printf ("counter mode %6.2fns per block\n", ns / ((double) loops * 1000));
+  int ctr_ok = (memcmp (one, chunks, csize) == 0);
+  free (plain);
+  free (one);
+  free (chunks);
+  if (! ctr_ok) {
+    printf ("error: counter mode gives different results in chunks\n");
+    return 1;
+  }
   return 0;
 }
 #endif /* AES_UNIT_TEST */
@@ -15,10 +15,40 @@
 
 #define WP_AES_BLOCK_SIZE	16
 
+/* an expanded key, to encrypt many blocks with the same key */
+struct wp_aes_key {
+  uint32_t w [60];                  /* 4 words for each of the 15 rounds */
+  unsigned char round_keys [60 * 4];   /* the same, as bytes */
+};
+
+/* expands the key.  ksize must be 32 */
+extern void wp_aes_set_key (int ksize, const char * key,
+                            struct wp_aes_key * result);
+
+/* in, out may be the same or different buffer, both should
+ * have WP_AES_BLOCK_SIZE bytes.  Uses the processor's AES instructions
+ * if it has them */
+extern void wp_aes_encrypt_with_key (const struct wp_aes_key * key,
+                                     const char * in, char * out);
+
+/* fills keystream (nblocks * WP_AES_BLOCK_SIZE bytes) with the encryption
+ * of nblocks successive values of the big-endian counter (which has
+ * WP_AES_BLOCK_SIZE bytes), and updates counter to the next value.
+ * Several blocks are encrypted at once, which is much faster */
+extern void wp_aes_ctr_blocks (const struct wp_aes_key * key, char * counter,
+                               char * keystream, int nblocks);
+
+/* counter mode encryption or decryption of dsize bytes: each block of the
+ * data is xor'd with the encryption of the next value of counter.
+ * data and result may be the same */
+extern void wp_aes_ctr_crypt (const struct wp_aes_key * key, char * counter,
+                              const char * data, int dsize, char * result);
+
 /* for AES in counter mode, only encryption is used
  * in, out may be the same or different buffer, both should
  * have WP_AES_BLOCK_SIZE bytes
- * ksize must be 16, 24, or 32 */
+ * ksize must be 32.  To encrypt several blocks with the same key,
+ * wp_aes_set_key and wp_aes_encrypt_with_key are faster */
 extern void wp_aes_encrypt_block (int ksize, const char * key,
                                   const char * in, char * out);
 
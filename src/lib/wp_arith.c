@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "wp_arith.h"
 
@@ -307,7 +308,7 @@ static int wp_add_unrolled (int nwords, uint64_t * res,
   return carry;
 }
 
-#ifdef TEST_AGAINST_OPENSSL_BIGNUMS
+#if defined (TEST_AGAINST_OPENSSL_BIGNUMS) || defined (BENCHMARK_AGAINST_BIGNUMS)
 #include <openssl/bn.h>
 static BIGNUM * make_bn (int nbits, const uint64_t * v)
 {
@@ -338,7 +339,7 @@ static int same_bn (int nbits, const uint64_t * v, BIGNUM * bn)
   }
   return 1;
 }
-#endif /* TEST_AGAINST_OPENSSL_BIGNUMS */
+#endif /* TEST_AGAINST_OPENSSL_BIGNUMS || BENCHMARK_AGAINST_BIGNUMS */
 
 /* returns carry.  res, v1, and v2 may be the same */
 int wp_add (int nbits, uint64_t * res,
@@ -561,6 +562,7 @@ void wp_multiply (int rbits, uint64_t * res,
   }
 }
 
+#ifndef __SIZEOF_INT128__
 static uint64_t add128 (uint64_t * res, uint64_t v, uint64_t carry)
 {
   res [1] += v;
@@ -573,10 +575,16 @@ static uint64_t add128 (uint64_t * res, uint64_t v, uint64_t carry)
 }
 
 static const uint64_t mask32 = 0xffffffff;
+#endif /* __SIZEOF_INT128__ */
 
 static void multiply128 (uint64_t * result_high, uint64_t * result_low,
                          uint64_t v1, uint64_t v2)
 {
+#ifdef __SIZEOF_INT128__   /* one instruction on x86-64 and arm64 */
+  unsigned __int128 product = ((unsigned __int128) v1) * v2;
+  *result_high = (uint64_t) (product >> 64);
+  *result_low = (uint64_t) product;
+#else /* __SIZEOF_INT128__ */
   uint64_t v1_low = v1 & mask32;
   uint64_t v1_high = (v1 >> 32) & mask32;
   uint64_t v2_low = v2 & mask32;
@@ -595,6 +603,7 @@ v1, v2, r2, r1);
 */
   *result_high = r2;
   *result_low = r1;
+#endif /* __SIZEOF_INT128__ */
 }
 
 /* multiply a by b64 and add the result to r, putting the overflow into rhigh.
@@ -937,27 +946,19 @@ printf ("%s)\n", wp_itox (nbits, mod));
    http://www.nugae.com/encryption/fap4/montgomery.htm
  */
 
-static void init_shifted_montgomery (int nbits_plus, uint64_t * shifted,
-                                     int nbits, const uint64_t * mod)
+/* the montgomery reduction adds a multiple q of mod to make the low word
+ * zero, with q = low word * (-1 / mod) modulo 2^64.  mont has the
+ * -1 / mod in mont [0], followed by the nbits of mod */
+static void init_montgomery (int nbits, uint64_t * mont, const uint64_t * mod)
 {
   int nwords = NUM_WORDS (nbits);
-  int nwords_plus = NUM_WORDS (nbits_plus);
-  memset (shifted, 0, nwords_plus * sizeof (uint64_t));
-  memcpy (shifted + 1, mod, nwords * sizeof (uint64_t));
-  size_t size = nwords_plus * sizeof (uint64_t);
-  uint64_t * prev = shifted;
+  uint64_t m = mod [nwords - 1];   /* least significant word, odd */
+  uint64_t inverse = m;   /* correct in the low 3 bits, since m * m = 1 mod 8 */
   int i;
-  for (i = 1; i < 64; i++) {
-    uint64_t * this = prev + nwords_plus;
-    memcpy (this, prev, size);
-    wp_shift_left (nbits_plus, this);
-    prev = this;
-  }
-/*
-for (i = 0; i < 64; i++)
-printf ("shifted [%d] is %s/%p\n", i,
-wp_itox (nbits_plus, shifted + nwords_plus * i), shifted + nwords_plus * i);
-*/
+  for (i = 0; i < 5; i++)   /* newton's method doubles the correct bits */
+    inverse *= 2 - m * inverse;
+  mont [0] = - inverse;
+  memcpy (mont + 1, mod, nwords * sizeof (uint64_t));
 }
 
 /* r is 2^nbits.  res, mod, and temp[12] are nbits */
@@ -996,101 +997,32 @@ static void compute_r_squared (int nbits, uint64_t * res, const uint64_t * mod,
 }
 
 /* res = res + a * b, where a is nwords_a and b a single uint64_t */
-/* res has one more uint64_t than a. */
-static void multiply64_add (int nwords_res, uint64_t * res,
-                            int nwords_a, const uint64_t * a, uint64_t b)
-{
-#ifdef CHECK_AGAINST_PLAIN_OLD_OPS
-  uint64_t * old = malloc (nwords_res * 8 * 8);  /* plenty of space, 5 used */
-  uint64_t * b_ext = old + nwords_res;
-  uint64_t * prod = b_ext + nwords_res;
-  uint64_t * prod_half = prod + nwords_a;  /* less significant half of prod */
-  uint64_t * prod_half_min1 = prod_half - 1;
-  uint64_t * sum = prod + nwords_res + nwords_res;  /* prod is double-sized */
-  memcpy (old, res, nwords_res * 8);
-  int nbits = nwords_a * 64;
-  wp_init (nbits, b_ext, 0);
-  b_ext [nwords_a - 1] = b;
-  wp_copy (nbits + 64, sum, res);
-  if (sum [0] != 0) printf ("sum [0] is %" PRIx64 "\n", sum [0]);
-  wp_multiply (nbits + nbits, prod, nbits, a, b_ext);
-  wp_add (nbits + 64, sum, sum, prod_half_min1);
-  /* wp_copy (nbits + 64, res, sum);  return; -- this is correct */
-#endif /* CHECK_AGAINST_PLAIN_OLD_OPS */
-        
+/* res has one more uint64_t than a.  Returns the carry out of res */
+static uint64_t multiply64_add (int nwords_res, uint64_t * res,
+                                int nwords_a, const uint64_t * a, uint64_t b)
+{
   my_assert ((nwords_a + 1) == nwords_res, "multiply64_add");
-  uint64_t high, low;
-  uint64_t carry = 0;
   int i;
+#ifdef __SIZEOF_INT128__
+  /* the sum is at most (2^64 - 1)^2 + 2 (2^64 - 1) = 2^128 - 1 */
+  uint64_t carry = 0;
   for (i = nwords_a - 1; i >= 0; i--) {
-    multiply128 (&high, &low, a [i], b);
-    carry = add128 (res + i, low, carry + high);
-  }
-  if (carry != 0) {
-    printf ("multiply64_add (%d, %s, ", nwords_res * 64,
-            wp_itox (nwords_res * 64, res));
-    printf ("%s, %" PRIx64 ")\n", wp_itox (nwords_a * 64, a), b);
-    printf ("unexpected (please check), carry is %" PRIx64 "\n", carry);
-    exit (1);
+    unsigned __int128 sum = ((unsigned __int128) a [i]) * b + res [i + 1] +
+                            carry;
+    res [i + 1] = (uint64_t) sum;
+    carry = (uint64_t) (sum >> 64);
   }
   res [0] += carry;
-  /* ignore the most significant carry, if any */
-#ifdef DEBUG_PRINT_MONT
-  if (res [0] < carry) {  /* overflow from adding carry */
-    printf ("multiply64_add (%s (final) ", wp_itox (nwords_res * 64, res));
-    printf ("+= %s * %016" PRIx64 "), carry %" PRIx64 ", res [0] %" PRIx64 "\n",
-            wp_itox (nwords_a * 64, a), b, carry, res [0]);
-exit (1);   /* not happened yet */
-  }
-#endif /* DEBUG_PRINT_MONT */
-#ifdef CHECK_AGAINST_PLAIN_OLD_OPS
-  if (wp_compare (nbits + 64, res, sum) != 0) {
-    printf ("found error: %s != ", wp_itox (nwords_res * 64, res));
-    printf ("%s, carry %" PRIx64 "\n", wp_itox (nbits + 64, sum), carry);
-    exit (1);
-  }
-  free (old);
-#endif /* CHECK_AGAINST_PLAIN_OLD_OPS */
-}
-
-/* the shifted mod is added or not to make 0 the low word of res
- * each unit of shifted_mod is nwords, as is res */
-static void add_multiple_to_make_low_word_zero (int nwords, uint64_t * res,
-                                                const uint64_t * shifted_mod)
-{
-#ifdef DEBUG_PRINT_MONT
-  printf ("initial result %s, %d words\n", wp_itox (nwords * 64, res), nwords);
-#endif /* DEBUG_PRINT_MONT */
-  uint64_t i = 0;
+  return (res [0] < carry);
+#else /* __SIZEOF_INT128__ */
+  uint64_t high, low;
   uint64_t carry = 0;
-  for (i = 0; i < 64; i++) {
-    if ((((uint64_t) 1) << i) & (res [nwords - 1])) {
-uint64_t copy;
-copy = res [nwords - 1];
-      /* add the i-th temp to res */
-      carry += wp_add (nwords * 64, res, res, shifted_mod + (i * nwords));
-      /* if there is a carry, should subtract mod until fits -- but cannot
-         without changing the invariant that bit i is now 0.  so instead,
-         accumulate carries, and do the mod below */
-if ((((uint64_t) 1) << i) & (res [nwords - 1])) {
-printf ("error: bit %" PRId64 " not cleared from %" PRIx64 "\n",
-        i, res [nwords - 1]);
-printf ("original %" PRIx64 " + %" PRIx64 " = %" PRIx64 "\n",
-        copy, (shifted_mod + (i * nwords)) [nwords - 1], res [nwords - 1]);
-printf ("added %s\n", wp_itox (nwords * 64, shifted_mod + (i * nwords)));
-exit (1);
-}
-      my_assert (((((uint64_t) 1) << i) & (res [nwords - 1])) == 0, "cleared");
-#ifdef DEBUG_PRINT_MONT
-      printf (" result %s\n", wp_itox (nwords * 64, res));
-#endif /* DEBUG_PRINT_MONT */
-    }
+  for (i = nwords_a - 1; i >= 0; i--) {
+    multiply128 (&high, &low, a [i], b);
+    carry = add128 (res + i, low, carry + high);
   }
-/* here subtract until carry is zero and res < mod (mod is shifted_mod + 1) */
-  int nbits_minus = (nwords - 1) * 64;
-  while ((carry > 0) ||
-         (wp_compare (nbits_minus, res, shifted_mod + 1) >= 0))
-    carry -= wp_sub (nbits_minus, res, res, shifted_mod + 1);
+  return carry;
+#endif /* __SIZEOF_INT128__ */
 }
 
 static void shift_right_64 (int nwords, uint64_t * value)
@@ -1101,35 +1033,36 @@ static void shift_right_64 (int nwords, uint64_t * value)
   value [0] = 0;
 }
 
-/* res = a * b / 2^nbits % mod.  a, b, and mod are different from res,
- * a, b, and mod are nbits long, res is nbits+64. shifted_mod has
- * 64 successive locations each nbits+64 long */
+/* res = a * b / 2^nbits % mod.  a, b, and mont are different from res,
+ * a and b are nbits long, res is nbits+64 with the result in res + 1,
+ * and mont is from init_montgomery */
 static void montgomery_step (int nbits, uint64_t * res,
                              const uint64_t * a, const uint64_t * b,
-                             const uint64_t * shifted_mod)
+                             const uint64_t * mont)
 {
   int nlong = nbits + 64;
   wp_init (nlong, res, 0);
   int nwords = NUM_WORDS (nbits);
   int nwords_plus = nwords + 1;
+  const uint64_t * mod = mont + 1;
 #ifdef DEBUG_PRINT_MONT
   printf ("montgomery_step (%s * ", wp_itox (nbits, a));
   printf ("%s ", wp_itox (nbits, b));
-  printf ("%% %s)\n", wp_itox (nbits, shifted_mod + 1));
+  printf ("%% %s)\n", wp_itox (nbits, mod));
 #endif /* DEBUG_PRINT_MONT */
-#ifdef DEBUG_PRINT
-#endif /* DEBUG_PRINT */
+  /* res stays less than a + mod, so needs at most one bit more than
+   * nwords_plus, which is kept in top */
   int w;
   for (w = nwords - 1; w >= 0; w--) {
-    multiply64_add (nwords_plus, res, nwords, a, b [w]);
-#ifdef DEBUG_PRINT_MONT
-    printf ("a %s * b [%d] ", wp_itox (nwords * 64, a), w);
-    printf ("%016" PRIx64 " = %s\n", b [w], wp_itox (nwords_plus * 64, res));
-#endif /* DEBUG_PRINT_MONT */
-    add_multiple_to_make_low_word_zero (nwords_plus, res, shifted_mod);
+    uint64_t top = multiply64_add (nwords_plus, res, nwords, a, b [w]);
+    uint64_t q = res [nwords_plus - 1] * mont [0];
+    top += multiply64_add (nwords_plus, res, nwords, mod, q);
     my_assert ((res [nwords_plus - 1] == 0), "low word zero before shift");
     shift_right_64 (nwords_plus, res);
+    res [0] = top;
   }
+  while ((res [0] != 0) || (wp_compare (nbits, res + 1, mod) >= 0))
+    res [0] -= wp_sub (nbits, res + 1, res + 1, mod);
 #ifdef DEBUG_PRINT_MONT
   printf ("   ==> %s\n", wp_itox (nbits, res + 1));
 #endif /* DEBUG_PRINT_MONT */
@@ -1140,32 +1073,178 @@ static void montgomery_step (int nbits, uint64_t * res,
 /* temp is a temporary array used internally and must have at least nbits */
 void wp_exp_mod_montgomery_65537 (int nbits, uint64_t * res,
                                   const uint64_t * base,
-                                  const uint64_t * shifted_mod,
+                                  const uint64_t * mont,
                                   uint64_t * temp)
 {
-  montgomery_step (nbits, res,  base + 1, base + 1, shifted_mod); /*^2*/
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^4 */
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^8 */
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^16 */
+  montgomery_step (nbits, res,  base + 1, base + 1, mont); /*^2*/
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^4 */
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^8 */
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^16 */
 
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^32 */
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^64 */
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^128 */
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^256 */
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^32 */
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^64 */
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^128 */
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^256 */
 
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^512 */
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^1024*/
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^2048*/
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^4096*/
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^512 */
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^1024*/
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^2048*/
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^4096*/
 
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^8192*/
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^16384*/
-  montgomery_step (nbits, res,  temp + 1, temp + 1, shifted_mod); /*^32768*/
-  montgomery_step (nbits, temp, res + 1,  res + 1,  shifted_mod); /*^65536*/
-  montgomery_step (nbits, res,  temp + 1, base + 1, shifted_mod); /*^65537*/
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^8192*/
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^16384*/
+  montgomery_step (nbits, res,  temp + 1, temp + 1, mont); /*^32768*/
+  montgomery_step (nbits, temp, res + 1,  res + 1,  mont); /*^65536*/
+  montgomery_step (nbits, res,  temp + 1, base + 1, mont); /*^65537*/
 }
 #endif /* OPTIMIZATION_GIVES_NO_SPEEDUP */
 
+/* compute_r_squared takes about as long as several montgomery steps, and
+ * the same few moduli (the RSA keys, and their p and q) are used over and
+ * over, so r^2 is saved for the most recently used moduli.
+ * The cache is keyed by the modulus rather than kept with each key,
+ * because keys are copied by value and built in many places */
+#define R_SQUARED_CACHE_SIZE	64
+#define R_SQUARED_MAX_WORDS	64    /* 4096 bits, larger moduli not cached */
+
+struct r_squared_entry {
+  int nbits;    /* 0 if the entry is not used */
+  uint64_t mod [R_SQUARED_MAX_WORDS];
+  uint64_t r_squared [R_SQUARED_MAX_WORDS];
+  uint64_t last_use;
+};
+
+static struct r_squared_entry r_squared_cache [R_SQUARED_CACHE_SIZE];
+static uint64_t r_squared_uses = 0;
+static pthread_mutex_t r_squared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* same as compute_r_squared */
+static void cached_r_squared (int nbits, uint64_t * res, const uint64_t * mod,
+                              uint64_t * temp1, uint64_t * temp2)
+{
+  int nwords = NUM_WORDS (nbits);
+  if (nwords > R_SQUARED_MAX_WORDS) {
+    compute_r_squared (nbits, res, mod, temp1, temp2);
+    return;
+  }
+  size_t size = nwords * sizeof (uint64_t);
+  pthread_mutex_lock (&r_squared_mutex);
+  struct r_squared_entry * oldest = r_squared_cache;
+  int i;
+  for (i = 0; i < R_SQUARED_CACHE_SIZE; i++) {
+    struct r_squared_entry * e = r_squared_cache + i;
+    if ((e->nbits == nbits) && (memcmp (e->mod, mod, size) == 0)) {
+      memcpy (res, e->r_squared, size);
+      e->last_use = ++r_squared_uses;
+      pthread_mutex_unlock (&r_squared_mutex);
+      return;
+    }
+    if (e->last_use < oldest->last_use)
+      oldest = e;
+  }
+  pthread_mutex_unlock (&r_squared_mutex);
+  /* compute without holding the lock, then save */
+  compute_r_squared (nbits, res, mod, temp1, temp2);
+  pthread_mutex_lock (&r_squared_mutex);
+  oldest->nbits = nbits;
+  memcpy (oldest->mod, mod, size);
+  memcpy (oldest->r_squared, res, size);
+  oldest->last_use = ++r_squared_uses;
+  pthread_mutex_unlock (&r_squared_mutex);
+}
+
+/* exponents with more than MONT_BINARY_MAX_BITS (private exponents, and
+ * those used in primality tests) are done MONT_WINDOW_BITS at a time,
+ * using a table of the first MONT_WINDOW_SIZE powers of the base.  Each
+ * window takes the same squarings and one multiplication, and every table
+ * entry is read to get the one needed, so the sequence of operations and
+ * memory accesses only depends on the length of the exponent.  Shorter
+ * (public) exponents such as 65537 are faster bit by bit */
+#define MONT_BINARY_MAX_BITS	64
+#define MONT_WINDOW_BITS	5
+#define MONT_WINDOW_SIZE	(1 << MONT_WINDOW_BITS)
+
+/* the number of significant bits in exp */
+static int exp_bits (int nwords, const uint64_t * exp)
+{
+  int i;
+  for (i = 0; i < nwords; i++) {
+    if (exp [i] != 0) {
+      int bits = 64;
+      while (((exp [i] >> (bits - 1)) & 1) == 0)
+        bits--;
+      return (nwords - 1 - i) * 64 + bits;
+    }
+  }
+  return 0;
+}
+
+/* the MONT_WINDOW_BITS of exp starting at bit pos (0 is the least
+ * significant bit) */
+static int exp_window (int nwords, const uint64_t * exp, int pos)
+{
+  int result = 0;
+  int bit;
+  for (bit = pos + MONT_WINDOW_BITS - 1; bit >= pos; bit--) {
+    int value = 0;
+    if (bit < nwords * 64)
+      value = (exp [nwords - 1 - bit / 64] >> (bit % 64)) & 1;
+    result = (result << 1) | value;
+  }
+  return result;
+}
+
+/* copies entry index of the table to dst, reading all the entries */
+static void select_power (int nwords, uint64_t * dst, const uint64_t * table,
+                          int index)
+{
+  memset (dst, 0, nwords * sizeof (uint64_t));
+  int i;
+  for (i = 0; i < MONT_WINDOW_SIZE; i++) {
+    uint64_t mask = ((uint64_t) 0) - ((uint64_t) (i == index));
+    const uint64_t * entry = table + i * nwords;
+    int w;
+    for (w = 0; w < nwords; w++)
+      dst [w] |= entry [w] & mask;
+  }
+}
+
+/* mres = mbase ^ exp, all in montgomery form (nbits + 64).
+ * mone is 1 in montgomery form.  exp has ebits significant bits */
+static void exp_window_montgomery (int nbits, uint64_t * mres,
+                                   uint64_t * mtemp, const uint64_t * mbase,
+                                   const uint64_t * mone,
+                                   const uint64_t * exp, int ebits,
+                                   const uint64_t * mont)
+{
+  int nwords = NUM_WORDS (nbits);
+  int nwords_plus = nwords + 1;
+  int nbits_plus = nbits + 64;
+  uint64_t table [MONT_WINDOW_SIZE * nwords_plus];
+  wp_copy (nbits_plus, table, mone);
+  wp_copy (nbits_plus, table + nwords_plus, mbase);
+  int i;
+  for (i = 2; i < MONT_WINDOW_SIZE; i++)
+    montgomery_step (nbits, table + i * nwords_plus,
+                     table + (i - 1) * nwords_plus + 1, mbase + 1,
+                     mont);
+  uint64_t power [nwords_plus];
+  int pos = ((ebits - 1) / MONT_WINDOW_BITS) * MONT_WINDOW_BITS;
+  select_power (nwords_plus, mres, table, exp_window (nwords, exp, pos));
+  for (pos -= MONT_WINDOW_BITS; pos >= 0; pos -= MONT_WINDOW_BITS) {
+    for (i = 0; i < MONT_WINDOW_BITS; i += 2) {  /* square, two at a time */
+      montgomery_step (nbits, mtemp, mres + 1, mres + 1, mont);
+      if (i + 1 < MONT_WINDOW_BITS)
+        montgomery_step (nbits, mres, mtemp + 1, mtemp + 1, mont);
+      else
+        wp_copy (nbits_plus, mres, mtemp);
+    }
+    select_power (nwords_plus, power, table, exp_window (nwords, exp, pos));
+    montgomery_step (nbits, mtemp, mres + 1, power + 1, mont);
+    wp_copy (nbits_plus, mres, mtemp);
+  }
+}
+
 /* largely based on http://en.wikipedia.org/wiki/Montgomery_reduction */
 /* R is 2^nbits */
 /* temp must have at least 70 * (nbits + 64) */
@@ -1177,6 +1256,7 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
     printf ("wp_exp_mod_montgomery warning: even modulo %s\n",
             wp_itox (nbits, mod));
     wp_exp_mod (nbits, res, base, exp, mod, temp);
+    return;
   }
 #ifdef DEBUG_PRINT_MONT
   printf ("wp_exp_mod_montgomery (%d, %s ^ ", nbits, wp_itox (nbits, base));
@@ -1190,22 +1270,29 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
   uint64_t * mtemp = temp + nwords_plus * 1;
   /* r_squared and one only need nwords, but simpler to have them nwords_plus */
   uint64_t * r_squared = temp + nwords_plus * 2;
-  compute_r_squared (nbits, r_squared, mod, mres, mtemp);
+  cached_r_squared (nbits, r_squared, mod, mres, mtemp);
   uint64_t * one = temp + nwords_plus * 3;
   wp_init (nbits, one, 1);
   uint64_t * mbase = temp + nwords_plus * 4;
-  uint64_t * shifted_mod = temp + nwords_plus * 5;
-  init_shifted_montgomery (nbits_plus, shifted_mod, nbits, mod);
+  uint64_t * mont = temp + nwords_plus * 5;
+  init_montgomery (nbits, mont, mod);
   /* convert base to montgomery form by multiplying by r^2 */
-  montgomery_step (nbits, mbase, base, r_squared, shifted_mod);
+  montgomery_step (nbits, mbase, base, r_squared, mont);
   wp_init (nbits_plus, mres, 0);
 #ifdef DEBUG_PRINT_MONT
   printf ("base %s is ", wp_itox (nbits, base));
   printf ("%s\n", wp_itox (nbits_plus, mbase));
 #endif /* DEBUG_PRINT_MONT */
+  int ebits = exp_bits (nwords, exp);
+  if (ebits > MONT_BINARY_MAX_BITS) {
+    uint64_t * mone = temp + nwords_plus * 6;   /* 1 in montgomery form */
+    montgomery_step (nbits, mone, r_squared, one, mont);
+    exp_window_montgomery (nbits, mres, mtemp, mbase, mone, exp, ebits,
+                           mont);
+  } else {
 #ifdef OPTIMIZATION_GIVES_NO_SPEEDUP
   if (is65537 (nbits, exp)) {
-    wp_exp_mod_montgomery_65537 (nbits, mres, mbase, shifted_mod, mtemp);
+    wp_exp_mod_montgomery_65537 (nbits, mres, mbase, mont, mtemp);
   } else {   /* do it bit by bit, skipping any high-order zero words */
 #endif /* OPTIMIZATION_GIVES_NO_SPEEDUP */
     int outer;
@@ -1217,9 +1304,9 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
         while (inner) {
           if (! wp_is_zero (nbits_plus, mres)) {
             /* square res modulo mod*/
-            montgomery_step (nbits, mtemp, mres + 1, mres + 1, shifted_mod);
+            montgomery_step (nbits, mtemp, mres + 1, mres + 1, mont);
             if (inner & word) /* multiply by base modulo mod */
-              montgomery_step (nbits, mres, mtemp + 1, mbase + 1, shifted_mod);
+              montgomery_step (nbits, mres, mtemp + 1, mbase + 1, mont);
             else
               wp_copy (nbits_plus, mres, mtemp);
           } else {   /* high bit not found yet, test for it now. */
@@ -1233,8 +1320,9 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
 #ifdef OPTIMIZATION_GIVES_NO_SPEEDUP
   }
 #endif /* OPTIMIZATION_GIVES_NO_SPEEDUP */
+  }
   wp_init (nbits, one, 1);
-  montgomery_step (nbits, mtemp, mres + 1, one, shifted_mod);
+  montgomery_step (nbits, mtemp, mres + 1, one, mont);
   wp_copy (nbits, res, mtemp + 1);
 #ifdef DEBUG_PRINT_MONT
   printf ("  => %s\n", wp_itox (nbits, res));
@@ -2128,6 +2216,63 @@ static int time_em_mont (int nbits)
   return 1;
 }
 
+#ifdef BENCHMARK_AGAINST_BIGNUMS
+static uint64_t usec_since (struct timeval * start)
+{
+  struct timeval finish;
+  gettimeofday (&finish, NULL);
+  return ((uint64_t) (finish.tv_sec - start->tv_sec)) * 1000000 +
+         (finish.tv_usec - start->tv_usec);
+}
+
+/* compare wp_exp_mod_montgomery to BN_mod_exp, for the same values as
+ * time_em_mont, checking the results */
+static int time_em_bn (int nbits)
+{
+  int nwords = NUM_WORDS (nbits);
+  static uint64_t mod [LARGE];
+  static uint64_t base [LARGE];
+  static uint64_t exp [LARGE];
+  static uint64_t result [LARGE];
+  static uint64_t temp [LARGE * 70];
+  int i;
+  for (i = 0; i < nwords; i++) {
+    mod [i] = i + 0x876543210ffffedc;
+    base [i] = 0x3fff0000ffff0000 + i;
+    exp [i] = (((uint64_t) (i * 11) + 1) << 30) - 1;
+  }
+  BIGNUM * bn_mod = make_bn (nbits, mod);
+  BIGNUM * bn_base = make_bn (nbits, base);
+  BIGNUM * bn_exp = make_bn (nbits, exp);
+  BIGNUM * bn_result = BN_new ();
+  BN_CTX * ctx = BN_CTX_new ();
+  int loops = 4096 * 4 / nbits;
+  int ok = 1;
+  struct timeval start;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < loops; i++)
+    wp_exp_mod_montgomery (nbits, result, base, exp, mod, temp);
+  uint64_t wp_us = usec_since (&start);
+  gettimeofday (&start, NULL);
+  for (i = 0; i < loops; i++)
+    BN_mod_exp (bn_result, bn_base, bn_exp, bn_mod, ctx);
+  uint64_t bn_us = usec_since (&start);
+  if (! same_bn (nbits, result, bn_result)) {
+    printf ("error: wp_exp_mod_montgomery differs from BN_mod_exp\n");
+    ok = 0;
+  }
+  printf ("  b^e mod m (%d bits): wp_exp_mod_montgomery %" PRId64
+          " us, BN_mod_exp %" PRId64 " us\n", nbits,
+          wp_us / loops, bn_us / loops);
+  BN_free (bn_mod);
+  BN_free (bn_base);
+  BN_free (bn_exp);
+  BN_free (bn_result);
+  BN_CTX_free (ctx);
+  return ok;
+}
+#endif /* BENCHMARK_AGAINST_BIGNUMS */
+
 /* test with bigger values -- just test internal consistency */
 static int test_mul_div ()
 {
@@ -2457,6 +2602,14 @@ static int wp_arith_test ()
 
 int main (int argc, char ** argv)
 {
+#ifdef BENCHMARK_AGAINST_BIGNUMS   /* only the benchmark, link with -lcrypto */
+  int ok = 1;
+  int nbits;
+  for (nbits = 1024; nbits <= 4096; nbits *= 2)
+    if (! time_em_bn (nbits))
+      ok = 0;
+  return (ok ? 0 : 1);
+#endif /* BENCHMARK_AGAINST_BIGNUMS */
   if (wp_arith_test ())
     return 0;
   return 1;
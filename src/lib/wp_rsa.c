@@ -11,6 +11,7 @@
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -400,18 +401,24 @@ static int composite_test (int nbits, const uint64_t * potential_prime)
   return 0;    /* possibly prime */
 }
 
+/* the sieve of small primes used by is_prime, computed once since
+ * is_prime may be called from several threads at the same time */
+#define SMALL_PRIMES_LIMIT	262144
+static int sieve_size = SMALL_PRIMES_LIMIT;
+static char sieve [SMALL_PRIMES_LIMIT / 8];
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+static void init_small_primes ()
+{
+  compute_sieve (sieve_size, sieve, NULL, 0);
+}
+
 static int is_prime (int nbits, const uint64_t * n, int iterations)
 {
 #ifdef DEBUG_PRINT
   printf ("is_prime (%s) ", wp_itox (nbits, n));
 #endif /* DEBUG_PRINT */
-  static int sieve_size = 0;
-  static char * sieve = NULL;
-  if ((sieve_size == 0) || (sieve == NULL)) {
-    sieve_size = 262144;
-    sieve = malloc (sieve_size / 8);
-    compute_sieve (sieve_size, sieve, NULL, 0);
-  }
+  pthread_once (&small_primes_once, init_small_primes);
   int i;
   for (i = 2; i < sieve_size; i++) {
 #define USE_MULTIPLE_FOR_SMALL_PRIMES
@@ -491,6 +498,104 @@ static void avoid_being_too_close (int nbits, uint64_t * avoid,
 }
 #endif /* 0 */
 
+/* for larger primes, the odd candidates start, start + 2, start + 4...
+ * are tested by up to PRIME_MAX_THREADS threads, thread i testing
+ * candidates i, i + nthreads, i + 2 * nthreads, and so on.  Each thread
+ * stops at its first prime, or as soon as a prime has been found at a
+ * lower index, so the result is the smallest prime >= start, the same
+ * prime a sequential search finds */
+#define PRIME_MAX_THREADS	16
+#define PRIME_MIN_PARALLEL_BITS	512
+
+struct prime_search {
+  int nbits;
+  const uint64_t * start;
+  int security_level;
+  int nthreads;
+  pthread_mutex_t mutex;
+  long int found;           /* index of the smallest prime found, or -1 */
+  rsa_half prime;
+};
+
+struct prime_search_thread {
+  struct prime_search * search;
+  int index;
+};
+
+static long int prime_found (struct prime_search * s)
+{
+  pthread_mutex_lock (&(s->mutex));
+  long int result = s->found;
+  pthread_mutex_unlock (&(s->mutex));
+  return result;
+}
+
+static void * prime_search_thread (void * arg)
+{
+  struct prime_search_thread * t = (struct prime_search_thread *) arg;
+  struct prime_search * s = t->search;
+  rsa_half candidate;
+  wp_copy (s->nbits, candidate, s->start);
+  wp_add_int (s->nbits, candidate, 2 * t->index);
+  long int index;
+  for (index = t->index; ; index += s->nthreads) {
+    long int found = prime_found (s);
+    if ((found >= 0) && (found < index))
+      break;    /* another thread found a smaller prime */
+    if (is_prime (s->nbits, candidate, s->security_level)) {
+      pthread_mutex_lock (&(s->mutex));
+      if ((s->found < 0) || (index < s->found)) {
+        s->found = index;
+        wp_copy (s->nbits, s->prime, candidate);
+      }
+      pthread_mutex_unlock (&(s->mutex));
+      break;
+    }
+    wp_add_int (s->nbits, candidate, 2 * s->nthreads);
+  }
+  return NULL;
+}
+
+/* result must be odd, and is replaced by the first prime >= result
+ * returns 1, or 0 if the search should be done sequentially instead */
+static int parallel_prime_search (int nbits, uint64_t * result,
+                                  int security_level)
+{
+  if (nbits < PRIME_MIN_PARALLEL_BITS)
+    return 0;
+  long int ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (ncpus <= 1)
+    return 0;
+  struct prime_search s;
+  s.nbits = nbits;
+  s.start = result;
+  s.security_level = security_level;
+  s.nthreads = (ncpus > PRIME_MAX_THREADS) ? PRIME_MAX_THREADS : (int) ncpus;
+  pthread_mutex_init (&(s.mutex), NULL);
+  s.found = -1;
+  pthread_t threads [PRIME_MAX_THREADS];
+  struct prime_search_thread args [PRIME_MAX_THREADS];
+  int started = 0;
+  int i;
+  for (i = 0; i < s.nthreads; i++) {
+    args [i].search = &s;
+    args [i].index = i;
+  }
+  while ((started < s.nthreads) &&
+         (pthread_create (threads + started, NULL, prime_search_thread,
+                          args + started) == 0))
+    started++;
+  /* the threads step by s.nthreads, so any that could not be started
+   * must search here */
+  for (i = started; i < s.nthreads; i++)
+    prime_search_thread (args + i);
+  for (i = 0; i < started; i++)
+    pthread_join (threads [i], NULL);
+  pthread_mutex_destroy (&(s.mutex));
+  wp_copy (nbits, result, s.prime);
+  return 1;
+}
+
 static void set_top_four_bits (int nbits, uint64_t * n, int value)
 {
   uint64_t top = n [0];
@@ -526,8 +631,10 @@ static void generate_prime (int nbits, uint64_t * bits, int init,
 #endif /* DEBUG_PRINT */
   if (wp_is_even (nbits, result))
     wp_add_int (nbits, result, 1);
-  while (! is_prime (nbits, result, security_level))
-    wp_add_int (nbits, result, 2);
+  if (! parallel_prime_search (nbits, result, security_level)) {
+    while (! is_prime (nbits, result, security_level))
+      wp_add_int (nbits, result, 2);
+  }
 /* should we check whether it is a strong prime? Can we do it without
  * factoring?  https://en.wikipedia.org/wiki/Strong_prime
  * we can easily check whether x = 2q + 1 where q is prime, and also
@@ -1103,19 +1210,19 @@ seed [8] & 0xff, seed [9] & 0xff);
     while ((ps < nbytes) && (datab [ps] == 0))
       ps++;
     /* datab [ps] should be a byte with value 1 */
-    if ((ps > nbytes) || (datab [ps] != 1)) {
+    if ((ps >= nbytes) || (datab [ps] != 1)) {
 #ifdef DEBUG_PRINT
       printf ("unpadding PKCS1_OAEP: ps %d/%d, datab [ps] is %02x\n",
-              ps, nbytes, datab [ps] & 0xff);
+              ps, nbytes, ((ps < nbytes) ? (datab [ps] & 0xff) : 0));
 #endif /* DEBUG_PRINT */
       bad_result = 1;
     }
+    if (bad_result)   /* all the checks are done, nothing has been copied */
+      return -1;
     ps++;
     for (i = 0; i < nbytes - ps; i++)
       result [i] = get_byte (nbits, data, ps + i);
     memcpy (result, datab + ps, nbytes - ps);
-    if (bad_result)
-      return -1;
     return (nbytes - ps);
   }
   printf ("unpadding, mode %d not implemented\n", padding);
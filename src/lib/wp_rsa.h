@@ -55,6 +55,18 @@ extern int wp_rsa_read_key_from_file (const char * fname, int * nbits,
 extern int wp_rsa_write_key_to_file (const char * fname,
                                      const wp_rsa_key_pair * key);
 
+/* base 64 decoding and encoding, used for the key files.  b64_decode
+ * ignores characters other than base 64 and '=', and returns the number
+ * of bytes written to result.  data and result may be the same buffer */
+extern int b64_decode (const char * data, int dsize, char * result, int rsize);
+/* the bytes to encode are in buffer [bsize - dsize]..buffer [bsize - 1],
+ * and are replaced by the null-terminated encoding, with a newline every
+ * 64 characters.  Returns the length of the encoding */
+extern int b64_encode (char * buffer, int dsize, int bsize);
+/* b64_decode and b64_encode use vector instructions when available,
+ * unless b64_vectorized (0) is called.  For testing and benchmarking */
+extern void b64_vectorized (int use);
+
 /* uses /dev/random to generate bits of the key
  * nbits should be a power of two <= RSA_MAX_KEY_BITS
  * the security level is the number of primality tests to run
@@ -0,0 +1,666 @@
+/* ad_bench.c: measure the end-to-end throughput of a running allnetd */
+/* command line:
+   ad_bench [-u peers] [-c peers] [-r rate] [-t seconds] [-s size] [-P pid]
+     -u the number of synthetic UDP peers (default 4)
+     -c the number of synthetic TCP peers, connected to atcpd (default 2)
+     -r the total number of packets per second to send (default 1000)
+     -t the number of seconds to send for (default 10)
+     -s the data size of each data message, in bytes (default 200)
+     -P the process ID of allnetd, for measuring CPU time.  By default,
+        the CPU times of all the processes named allnetd are added up
+   allnetd must already be running on this machine.  ad_bench connects
+   to it as a local application, sends from each UDP peer to the allnet
+   port on the loopback interface, and sends from each TCP peer to atcpd
+   using the same framing as atcpd.  Packets are sent at a fixed rate,
+   in turn from the local application and each of the peers, and are a
+   mix of 70% data messages, 15% acks, 10% data requests, and 5% DHT
+   messages.  Each data message carries the time it was sent, so wherever
+   it is received (by the local application, or by a UDP or TCP peer),
+   its latency is recorded for the path it took.
+   At the end, prints the packets sent and received, and for each path,
+   the number of messages, the messages per second, and the 50th, 90th,
+   and 99th percentiles and the maximum of the latency, in microseconds.
+   Then prints allnetd's CPU time per packet sent (Linux only), and how
+   much the counters (see allnet-stats) and the files of the packet
+   cache have grown.
+   allnetd limits the rate at which it forwards packets (see lib/sendq.h),
+   so to measure allnetd itself, the rates in ~/.allnet/ad/rates may be
+   set to 0 while running the benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lib/packet.h"
+#include "lib/mgmt.h"
+#include "lib/util.h"
+#include "lib/app_util.h"
+#include "lib/priority.h"
+#include "lib/configfiles.h"
+
+#define BENCH_LOCAL		0
+#define BENCH_UDP		1
+#define BENCH_TCP		2
+#define BENCH_KINDS		3
+
+static const char * kind_names [BENCH_KINDS] = { "local", "udp", "tcp" };
+
+/* each data message begins with the magic string, the time it was sent
+ * (in ns, from now_ns), and the kind of sender */
+#define BENCH_MAGIC		"adbench"
+#define BENCH_MAGIC_SIZE	8
+#define BENCH_MIN_SIZE		(BENCH_MAGIC_SIZE + 8 + 1)
+
+#define BENCH_MAX_PEERS		64
+#define BENCH_DRAIN_MS		1000	/* time to wait for the last packets */
+
+/* atcpd framing: magic string, 4-byte priority, 4-byte length */
+#define TCP_MAGIC		"MAGICPIE"
+#define TCP_MAGIC_SIZE		8
+#define TCP_HEADER_SIZE		16
+#define TCP_BUFFER_SIZE		(4 * ALLNET_MTU)
+
+struct tcp_peer {
+  int sock;
+  int used;
+  char buffer [TCP_BUFFER_SIZE];
+};
+
+static int local_sock = -1;
+static int udp_socks [BENCH_MAX_PEERS];
+static int num_udp = 0;
+static struct tcp_peer * tcp_peers [BENCH_MAX_PEERS];
+static int num_tcp = 0;
+
+/* latencies in ns, for each path from one kind of sender to another */
+struct latencies {
+  unsigned long long int * ns;
+  int count;
+  int alloc;
+};
+static struct latencies paths [BENCH_KINDS] [BENCH_KINDS];
+
+static unsigned long long int received [BENCH_KINDS];
+static unsigned long long int received_bench [BENCH_KINDS];
+static unsigned long long int sent [BENCH_KINDS];
+static unsigned long long int sent_failed [BENCH_KINDS];
+static unsigned long long int sent_types [ALLNET_TYPE_MGMT + 1];
+
+/* the totals of each counter over all types and classes */
+struct counter_totals {
+  unsigned long long int uptime_ms;
+  unsigned long long int totals [ALLNET_COUNT_COUNTERS];
+};
+static unsigned char counters_request_id [8];
+static int counters_found = 0;
+static struct counter_totals counters_result;
+
+static const char * counter_names [ALLNET_COUNT_COUNTERS] =
+  { "received", "bytes", "forwarded", "duplicate", "invalid", "throttled",
+    "cached" };
+
+static unsigned long long int now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long int) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_ull (const void * a, const void * b)
+{
+  unsigned long long int x = * ((const unsigned long long int *) a);
+  unsigned long long int y = * ((const unsigned long long int *) b);
+  return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+/* sorts the latencies, then prints the summary */
+static void print_times (const char * name, unsigned long long int * ns,
+                         int count, unsigned long long int total_ns)
+{
+  if (count <= 0) {
+    printf ("%-24s %10d\n", name, 0);
+    return;
+  }
+  qsort (ns, count, sizeof (unsigned long long int), compare_ull);
+  double rate = ((total_ns == 0) ? 0.0 : (count * 1.0e9 / total_ns));
+  printf ("%-24s %10d %12.0f %9.2f %9.2f %9.2f %10.2f\n", name, count, rate,
+          ns [count / 2] / 1000.0, ns [(count * 9) / 10] / 1000.0,
+          ns [(count * 99) / 100] / 1000.0, ns [count - 1] / 1000.0);
+}
+
+static void add_latency (int from, int to, unsigned long long int ns)
+{
+  struct latencies * l = &(paths [from] [to]);
+  if (l->count >= l->alloc) {
+    l->alloc = ((l->alloc == 0) ? 1024 : l->alloc * 2);
+    l->ns = realloc (l->ns, l->alloc * sizeof (unsigned long long int));
+    if (l->ns == NULL) {
+      printf ("unable to allocate %d latencies\n", l->alloc);
+      exit (1);
+    }
+  }
+  l->ns [l->count++] = ns;
+}
+
+/* returns 1 and sets the totals if this is the stats reply, else 0 */
+static int counters_reply (const char * message, int msize,
+                           struct counter_totals * result)
+{
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((hp->message_type != ALLNET_TYPE_MGMT) ||
+      (msize < ALLNET_MGMT_HEADER_SIZE (hp->transport) +
+               sizeof (struct allnet_mgmt_stats_reply)))
+    return 0;
+  const struct allnet_mgmt_header * mp =
+    (const struct allnet_mgmt_header *) (message + ALLNET_SIZE (hp->transport));
+  if (mp->mgmt_type != ALLNET_MGMT_STATS_REPLY)
+    return 0;
+  const struct allnet_mgmt_stats_reply * reply =
+    (const struct allnet_mgmt_stats_reply *)
+      (message + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  if (memcmp (reply->request_id, counters_request_id,
+              sizeof (reply->request_id)) != 0)
+    return 0;
+  int counters = reply->num_counters;
+  int num = reply->num_types * reply->num_classes * counters;
+  const unsigned char * counts = ALLNET_STATS_COUNTS (reply);
+  if (msize < (int) (((const char *) counts) - message) + num * 8)
+    return 0;
+  memset (result, 0, sizeof (struct counter_totals));
+  result->uptime_ms = readb64u (reply->uptime_ms);
+  int i;
+  for (i = 0; i < num; i++)
+    if (i % counters < ALLNET_COUNT_COUNTERS)
+      result->totals [i % counters] += readb64u (counts + 8 * i);
+  return 1;
+}
+
+/* records the latency if this is one of our data messages */
+static void handle_packet (int to, const char * message, int msize)
+{
+  if (msize < ALLNET_HEADER_SIZE)
+    return;
+  received [to]++;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((to == BENCH_LOCAL) && (! counters_found) &&
+      (counters_reply (message, msize, &counters_result))) {
+    counters_found = 1;
+    return;
+  }
+  int hsize = ALLNET_SIZE (hp->transport);
+  if ((hp->message_type != ALLNET_TYPE_DATA) ||
+      (msize < hsize + BENCH_MIN_SIZE) ||
+      (memcmp (message + hsize, BENCH_MAGIC, BENCH_MAGIC_SIZE) != 0))
+    return;
+  unsigned long long int sent_ns =
+    readb64u ((const unsigned char *) (message + hsize + 8));
+  int from = (unsigned char) (message [hsize + 16]);
+  unsigned long long int now = now_ns ();
+  if ((from >= BENCH_KINDS) || (sent_ns > now))
+    return;
+  received_bench [to]++;
+  add_latency (from, to, now - sent_ns);
+}
+
+/* reads all the complete frames in the peer's buffer */
+static void tcp_frames (struct tcp_peer * p)
+{
+  int start = 0;
+  while (p->used - start >= TCP_HEADER_SIZE) {
+    if (memcmp (p->buffer + start, TCP_MAGIC, TCP_MAGIC_SIZE) != 0) {
+      start++;  /* like older atcpd, skip anything else, e.g. a hello */
+      continue;
+    }
+    int msize = (int) readb32 (p->buffer + start + TCP_MAGIC_SIZE + 4);
+    if ((msize <= 0) || (msize > ALLNET_MTU)) {
+      start++;
+      continue;
+    }
+    if (p->used - start < TCP_HEADER_SIZE + msize)
+      break;   /* wait for the rest */
+    handle_packet (BENCH_TCP, p->buffer + start + TCP_HEADER_SIZE, msize);
+    start += TCP_HEADER_SIZE + msize;
+  }
+  if (start > 0) {
+    memmove (p->buffer, p->buffer + start, p->used - start);
+    p->used -= start;
+  }
+}
+
+/* waits up to timeout ms for packets, and handles all that are received */
+static void receive_packets (int timeout)
+{
+  struct pollfd pfd [1 + 2 * BENCH_MAX_PEERS];
+  int n = 0;
+  pfd [n].fd = local_sock;
+  pfd [n++].events = POLLIN;
+  int i;
+  for (i = 0; i < num_udp; i++) {
+    pfd [n].fd = udp_socks [i];
+    pfd [n++].events = POLLIN;
+  }
+  for (i = 0; i < num_tcp; i++) {
+    pfd [n].fd = tcp_peers [i]->sock;
+    pfd [n++].events = POLLIN;
+  }
+  poll (pfd, n, timeout);
+  /* local_receive may have buffered messages, so always try it */
+  while (1) {
+    char * message = NULL;
+    unsigned int priority = 0;
+    int r = local_receive (0, &message, &priority);
+    if ((r <= 0) || (message == NULL))
+      break;
+    handle_packet (BENCH_LOCAL, message, r);
+    free (message);
+  }
+  char buffer [ALLNET_MTU];
+  for (i = 0; i < num_udp; i++) {
+    if ((pfd [1 + i].revents & POLLIN) == 0)
+      continue;
+    ssize_t r;
+    while ((r = recv (udp_socks [i], buffer, sizeof (buffer),
+                      MSG_DONTWAIT)) > 0)
+      handle_packet (BENCH_UDP, buffer, (int) r);
+  }
+  for (i = 0; i < num_tcp; i++) {
+    struct tcp_peer * p = tcp_peers [i];
+    if ((pfd [1 + num_udp + i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+      continue;
+    ssize_t r = recv (p->sock, p->buffer + p->used,
+                      sizeof (p->buffer) - p->used, MSG_DONTWAIT);
+    if (r == 0) {
+      printf ("TCP peer %d: atcpd closed the connection\n", i);
+      close (p->sock);
+      tcp_peers [i] = tcp_peers [--num_tcp];
+      free (p);
+      i--;
+      continue;
+    }
+    if (r > 0) {
+      p->used += (int) r;
+      tcp_frames (p);
+      if (p->used >= (int) sizeof (p->buffer))  /* no frame, start over */
+        p->used = 0;
+    }
+  }
+}
+
+/* returns 1 if the counters were received, 0 otherwise */
+static int get_counters (int timeout, struct counter_totals * result)
+{
+  unsigned int data_size = sizeof (struct allnet_mgmt_header) +
+                           sizeof (struct allnet_mgmt_stats_req);
+  unsigned int total = 0;
+  struct allnet_header * hp =
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, 1, ALLNET_SIGTYPE_NONE,
+                        NULL, 0, NULL, 0, NULL, NULL, &total);
+  if (hp == NULL)
+    return 0;
+  hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+  char * buffer = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_STATS_REQ;
+  struct allnet_mgmt_stats_req * req =
+    (struct allnet_mgmt_stats_req *)
+      (buffer + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  random_bytes ((char *) (req->request_id), sizeof (req->request_id));
+  memcpy (counters_request_id, req->request_id, sizeof (counters_request_id));
+  counters_found = 0;
+  int sent_ok = local_send (buffer, total, ALLNET_PRIORITY_LOCAL);
+  allnet_packet_free (buffer);
+  if (! sent_ok)
+    return 0;
+  unsigned long long int finish = allnet_time_ms () + timeout;
+  while ((! counters_found) && (allnet_time_ms () < finish))
+    receive_packets (10);
+  if (counters_found)
+    *result = counters_result;
+  return counters_found;
+}
+
+/* returns the CPU time used by allnetd in ns, or 0 if not available.
+ * if pid is 0, adds up the CPU time of every process named allnetd */
+static unsigned long long int allnetd_cpu_ns (int pid)
+{
+  long ticks = sysconf (_SC_CLK_TCK);
+  if (ticks <= 0)
+    return 0;
+  DIR * dir = opendir ("/proc");
+  if (dir == NULL)
+    return 0;
+  unsigned long long int total = 0;
+  struct dirent * ep;
+  while ((ep = readdir (dir)) != NULL) {
+    if (! isdigit ((unsigned char) (ep->d_name [0])))
+      continue;
+    if ((pid != 0) && (atoi (ep->d_name) != pid))
+      continue;
+    char * fname = strcat3_malloc ("/proc/", ep->d_name, "/stat", "stat");
+    FILE * f = fopen (fname, "r");
+    free (fname);
+    if (f == NULL)
+      continue;
+    char line [1000];
+    int n = (int) fread (line, 1, sizeof (line) - 1, f);
+    fclose (f);
+    if (n <= 0)
+      continue;
+    line [n] = '\0';
+    /* the second field is the name in parentheses, which may have spaces */
+    char * name = strchr (line, '(');
+    char * end = strrchr (line, ')');
+    if ((name == NULL) || (end == NULL) || (end < name))
+      continue;
+    if ((pid == 0) &&
+        ((end - name - 1 != 7) || (strncmp (name + 1, "allnetd", 7) != 0)))
+      continue;
+    /* after the name: state, then 10 more fields before utime and stime */
+    unsigned long long int utime = 0;
+    unsigned long long int stime = 0;
+    if (sscanf (end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                &utime, &stime) == 2)
+      total += (utime + stime) * (1000000000ULL / ticks);
+  }
+  closedir (dir);
+  return total;
+}
+
+/* returns the total size of the files in the packet cache directory */
+static long long int cache_bytes ()
+{
+  char * dname = NULL;
+  if ((config_file_name ("acache", "", &dname, 0) < 0) || (dname == NULL))
+    return 0;
+  long long int total = 0;
+  DIR * dir = opendir (dname);
+  if (dir != NULL) {
+    struct dirent * ep;
+    while ((ep = readdir (dir)) != NULL) {
+      char * fname = strcat3_malloc (dname, "/", ep->d_name, "cache_bytes");
+      struct stat st;
+      if ((stat (fname, &st) == 0) && (S_ISREG (st.st_mode)))
+        total += st.st_size;
+      free (fname);
+    }
+    closedir (dir);
+  }
+  free (dname);
+  return total;
+}
+
+/* returns a new packet of the given type, to be freed with free */
+static char * bench_packet (int type, int from, int dsize, unsigned int * msize)
+{
+  unsigned char source [ADDRESS_SIZE];
+  unsigned char dest [ADDRESS_SIZE];
+  random_bytes ((char *) source, sizeof (source));
+  random_bytes ((char *) dest, sizeof (dest));
+  if (type == ALLNET_TYPE_ACK)
+    dsize = MESSAGE_ID_SIZE * (int) random_int (1, 4);
+  else if (type == ALLNET_TYPE_DATA_REQ)
+    dsize = sizeof (struct allnet_data_request);
+  else if (type == ALLNET_TYPE_MGMT)
+    dsize = sizeof (struct allnet_mgmt_header) +
+            sizeof (struct allnet_mgmt_dht);
+  else if (dsize < BENCH_MIN_SIZE)
+    dsize = BENCH_MIN_SIZE;
+  /* only send data messages beyond the first hop */
+  int max_hops = ((type == ALLNET_TYPE_DATA) ? 3 : 1);
+  struct allnet_header * hp =
+    create_packet (dsize, type, max_hops, ALLNET_SIGTYPE_NONE,
+                   source, 16, dest, 16, NULL, NULL, msize);
+  char * data = ((char *) hp) + ALLNET_SIZE (hp->transport);
+  random_bytes (data, dsize);
+  if (type == ALLNET_TYPE_DATA) {
+    memcpy (data, BENCH_MAGIC, BENCH_MAGIC_SIZE);
+    writeb64u ((unsigned char *) (data + 8), now_ns ());
+    data [16] = (char) from;
+  } else if (type == ALLNET_TYPE_DATA_REQ) {
+    struct allnet_data_request * req = (struct allnet_data_request *) data;
+    memset (req->since, 0, sizeof (req->since));
+    req->dst_bits_power_two = 0;
+    req->src_bits_power_two = 0;
+    req->mid_bits_power_two = 0;
+  } else if (type == ALLNET_TYPE_MGMT) {
+    struct allnet_mgmt_header * mp = (struct allnet_mgmt_header *) data;
+    mp->mgmt_type = ALLNET_MGMT_DHT;
+    struct allnet_mgmt_dht * dht =
+      (struct allnet_mgmt_dht *) (data + sizeof (struct allnet_mgmt_header));
+    memset (dht, 0, sizeof (struct allnet_mgmt_dht));
+    writeb64u (dht->timestamp, allnet_time ());
+  }
+  return (char *) hp;
+}
+
+/* 70% data, 15% acks, 10% data requests, 5% DHT */
+static int bench_type (unsigned long long int n)
+{
+  int i = (int) (n % 20);
+  if (i < 14)
+    return ALLNET_TYPE_DATA;
+  if (i < 17)
+    return ALLNET_TYPE_ACK;
+  if (i < 19)
+    return ALLNET_TYPE_DATA_REQ;
+  return ALLNET_TYPE_MGMT;
+}
+
+/* sends the n'th packet, from the local application or one of the peers */
+static void send_one (unsigned long long int n, int dsize,
+                      struct sockaddr_in * ad_addr)
+{
+  int senders = 1 + num_udp + num_tcp;
+  int index = (int) ((n / 20 + n) % senders);  /* mix the types and senders */
+  int kind = ((index == 0) ? BENCH_LOCAL :
+              ((index <= num_udp) ? BENCH_UDP : BENCH_TCP));
+  int type = bench_type (n);
+  unsigned int msize = 0;
+  char * message = bench_packet (type, kind, dsize, &msize);
+  int ok = 0;
+  if (kind == BENCH_LOCAL) {
+    ok = local_send (message, msize, ALLNET_PRIORITY_LOCAL);
+  } else if (kind == BENCH_UDP) {
+    ssize_t s = sendto (udp_socks [index - 1], message, msize, MSG_DONTWAIT,
+                        (struct sockaddr *) ad_addr, sizeof (*ad_addr));
+    ok = (s == (ssize_t) msize);
+  } else {
+    char header [TCP_HEADER_SIZE];
+    memcpy (header, TCP_MAGIC, TCP_MAGIC_SIZE);
+    writeb32 (header + TCP_MAGIC_SIZE, 0);  /* priority */
+    writeb32 (header + TCP_MAGIC_SIZE + 4, msize);
+    int sock = tcp_peers [index - 1 - num_udp]->sock;
+    ok = ((send (sock, header, sizeof (header), 0) == sizeof (header)) &&
+          (send (sock, message, msize, 0) == (ssize_t) msize));
+  }
+  free (message);
+  if (ok) {
+    sent [kind]++;
+    sent_types [type]++;
+  } else {
+    sent_failed [kind]++;
+  }
+}
+
+static int open_udp_peer ()
+{
+  int sock = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror ("ad_bench UDP socket");
+    return -1;
+  }
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = 0 };
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0) {
+    perror ("ad_bench UDP bind");
+    close (sock);
+    return -1;
+  }
+  return sock;
+}
+
+static struct tcp_peer * open_tcp_peer ()
+{
+  int sock = socket (AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror ("ad_bench TCP socket");
+    return NULL;
+  }
+  struct sockaddr_in sin = { .sin_family = AF_INET };
+  sin.sin_port = htons (ALLNET_PORT);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (connect (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0) {
+    perror ("ad_bench TCP connect");
+    close (sock);
+    return NULL;
+  }
+  int option = 1;
+  setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (option));
+  struct tcp_peer * p = malloc_or_fail (sizeof (struct tcp_peer), "tcp peer");
+  p->sock = sock;
+  p->used = 0;
+  return p;
+}
+
+int main (int argc, char ** argv)
+{
+  int udp = 4;
+  int tcp = 2;
+  int rate = 1000;
+  int seconds = 10;
+  int dsize = 200;
+  int pid = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-u") == 0) && (i + 1 < argc)) {
+      udp = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-c") == 0) && (i + 1 < argc)) {
+      tcp = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-r") == 0) && (i + 1 < argc)) {
+      rate = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-t") == 0) && (i + 1 < argc)) {
+      seconds = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-s") == 0) && (i + 1 < argc)) {
+      dsize = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-P") == 0) && (i + 1 < argc)) {
+      pid = atoi (argv [++i]);
+    } else {
+      printf ("usage: %s [-u peers] [-c peers] [-r rate] [-t seconds] "
+              "[-s size] [-P pid]\n", argv [0]);
+      return 1;
+    }
+  }
+  if ((udp < 0) || (udp > BENCH_MAX_PEERS) ||
+      (tcp < 0) || (tcp > BENCH_MAX_PEERS) || (rate <= 0) || (seconds <= 0) ||
+      (dsize <= 0) || (dsize > ALLNET_MTU - ALLNET_HEADER_SIZE - 64)) {
+    printf ("%s: at most %d peers of each kind, and the rate, time, "
+            "and size must be positive\n", argv [0], BENCH_MAX_PEERS);
+    return 1;
+  }
+  local_sock = connect_to_local (argv [0], argv [0], NULL, 0, 1);
+  if (local_sock < 0) {
+    printf ("%s: allnetd must be running\n", argv [0]);
+    return 1;
+  }
+  for (i = 0; i < udp; i++)
+    if ((udp_socks [num_udp] = open_udp_peer ()) >= 0)
+      num_udp++;
+  for (i = 0; i < tcp; i++)
+    if ((tcp_peers [num_tcp] = open_tcp_peer ()) != NULL)
+      num_tcp++;
+  struct sockaddr_in ad_addr = { .sin_family = AF_INET };
+  ad_addr.sin_port = htons (ALLNET_PORT);
+  ad_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  /* let allnetd notice the new application before we start */
+  receive_packets (200);
+  struct counter_totals first;
+  struct counter_totals last;
+  int have_counters = get_counters (2000, &first);
+  if (! have_counters)
+    printf ("no counters from allnetd, will not print them\n");
+  long long int first_cache = cache_bytes ();
+  unsigned long long int first_cpu = allnetd_cpu_ns (pid);
+  memset (received, 0, sizeof (received));
+  printf ("sending %d packets/second for %ds from 1 local app, "
+          "%d UDP peers, %d TCP peers\n", rate, seconds, num_udp, num_tcp);
+
+  unsigned long long int start = now_ns ();
+  unsigned long long int interval = 1000000000ULL / rate;
+  unsigned long long int finish = start + seconds * 1000000000ULL;
+  unsigned long long int next = start;
+  unsigned long long int n = 0;
+  unsigned long long int now;
+  while ((now = now_ns ()) < finish) {
+    while ((next <= now) && (next < finish)) {
+      send_one (n++, dsize, &ad_addr);
+      next += interval;
+    }
+    int wait = (int) ((next > now) ? ((next - now) / 1000000) : 0);
+    receive_packets (wait);
+  }
+  unsigned long long int send_ns = now_ns () - start;
+  unsigned long long int drain = now_ns () + BENCH_DRAIN_MS * 1000000ULL;
+  while (now_ns () < drain)
+    receive_packets (10);
+  unsigned long long int last_cpu = allnetd_cpu_ns (pid);
+  long long int last_cache = cache_bytes ();
+  if (have_counters && (! get_counters (2000, &last)))
+    have_counters = 0;
+
+  unsigned long long int total_sent = 0;
+  int k, t;
+  for (k = 0; k < BENCH_KINDS; k++)
+    total_sent += sent [k];
+  printf ("sent %llu packets in %.2fs, %.0f/s (data %llu, acks %llu, "
+          "data requests %llu, DHT %llu)\n", total_sent, send_ns / 1.0e9,
+          total_sent * 1.0e9 / send_ns, sent_types [ALLNET_TYPE_DATA],
+          sent_types [ALLNET_TYPE_ACK], sent_types [ALLNET_TYPE_DATA_REQ],
+          sent_types [ALLNET_TYPE_MGMT]);
+  for (k = 0; k < BENCH_KINDS; k++)
+    printf ("  %-5s sent %8llu, failed %6llu, received %8llu (%llu data)\n",
+            kind_names [k], sent [k], sent_failed [k], received [k],
+            received_bench [k]);
+  printf ("%-24s %10s %12s %9s %9s %9s %10s\n", "path (latency in us)",
+          "count", "per second", "p50", "p90", "p99", "max");
+  for (k = 0; k < BENCH_KINDS; k++) {
+    for (t = 0; t < BENCH_KINDS; t++) {
+      if (paths [k] [t].count == 0)
+        continue;
+      char name [100];
+      snprintf (name, sizeof (name), "%s -> %s", kind_names [k],
+                kind_names [t]);
+      print_times (name, paths [k] [t].ns, paths [k] [t].count, send_ns);
+    }
+  }
+  if ((first_cpu > 0) && (last_cpu > first_cpu) && (total_sent > 0))
+    printf ("allnetd CPU %.3fs, %.2fus per packet sent\n",
+            (last_cpu - first_cpu) / 1.0e9,
+            (last_cpu - first_cpu) / 1000.0 / total_sent);
+  else
+    printf ("allnetd CPU time not available\n");
+  if (have_counters) {
+    printf ("allnetd counters over %.2fs:",
+            (last.uptime_ms - first.uptime_ms) / 1000.0);
+    for (i = 0; i < ALLNET_COUNT_COUNTERS; i++)
+      printf (" %s %llu", counter_names [i],
+              last.totals [i] - first.totals [i]);
+    printf ("\n");
+  }
+  printf ("packet cache files grew by %lld bytes, to %lld\n",
+          last_cache - first_cache, last_cache);
+  return 0;
+}
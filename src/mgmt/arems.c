@@ -4,6 +4,12 @@
 /* commands and responses are sent with a per-contact counter (persistently
  * kept in ~/.allnet/contacts/.../arems_counter).  Only new counter values
  * will be executed, older commands are ignored. */
+/* the server runs up to AREMS_WORKERS commands at a time, and sends the
+ * output of each as it is produced, in numbered chunks.  The last chunk
+ * has the exit status.  Chunks are encrypted with the contact's symmetric
+ * key if there is one.  Otherwise chunk 0 carries a new session key,
+ * encrypted and signed with the contact's public key, and the other
+ * chunks are encrypted with the session key. */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,6 +19,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -25,8 +33,9 @@
 #include "lib/keys.h"
 #include "lib/media.h"
 #include "lib/sha.h"
+#include "lib/stream.h"
 
-#define MAX_STRING_LENGTH	450  /* maximum length of command or response */
+#define MAX_STRING_LENGTH	450  /* maximum length of command */
 #define MEDIA_ID	ALLNET_MEDIA_TEXT_PLAIN
 #define APP_ID		"REMS"
 #define COUNTER_SIZE	8
@@ -39,10 +48,34 @@ struct arems_header {
   unsigned char counter     [   COUNTER_SIZE];
 #define MESSAGE_TYPE_COMMAND	1  /* commands we send or receive */
 #define MESSAGE_TYPE_RESPONSE	2  /* responses we send or receive */
-  unsigned char type;       /* 1 for command, 2 for response */
-  unsigned char padding     [7];
+#define MESSAGE_TYPE_SESSION	3  /* session keys for chunked responses */
+  unsigned char type;       /* 1 for command, 2 for response, 3 session */
+#define AREMS_FLAG_CHUNKED	1  /* one of several chunks of a response */
+#define AREMS_FLAG_LAST		2  /* the last chunk of a response */
+#define AREMS_FLAG_SESSION	4  /* chunk 0, has the session key and secret */
+  unsigned char flags;      /* 0 for a response in a single message */
+  unsigned char chunk       [2];   /* output chunks are numbered from 1 */
+  unsigned char padding     [4];
 };
 
+#ifndef AREMS_WORKERS
+#define AREMS_WORKERS		4    /* commands that may run at once */
+#endif /* AREMS_WORKERS */
+#define AREMS_QUEUE_SIZE	16   /* commands waiting for a worker */
+/* room for the headers, the encryption overhead and the exit status */
+#define AREMS_CHUNK_SIZE	(ALLNET_MTU - 512)
+#define AREMS_STATUS_SIZE	100
+#define AREMS_MAX_CHUNKS	256  /* longer output is cut off */
+#define AREMS_FLUSH_MS		200  /* send partial output after this long */
+#ifndef AREMS_MAX_SECONDS
+#define AREMS_MAX_SECONDS	600  /* commands are killed after 10 minutes */
+#endif /* AREMS_MAX_SECONDS */
+#define AREMS_SESSION_SIZE	(ALLNET_STREAM_KEY_SIZE + ALLNET_STREAM_SECRET_SIZE)
+
+/* the workers send while the main thread receives, and the key functions
+ * are not thread-safe, so either one holds this while using keys */
+static pthread_mutex_t keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* returns -1 in case of errors */
 static long long int get_counter (const char * contact, keyset k, int ctype)
 {
@@ -130,84 +163,65 @@ static char * send_ack (struct allnet_header * hp, int msize)
   return result;
 }
 
-static int my_system (const char * command, char * result, int rsize,
-                      const char * contact)
-{
-  int syslog_option = LOG_DAEMON | LOG_WARNING;
-  int pipes [2];
-  if (pipe (pipes) != 0) {
-    perror ("pipe");
-    return 0;
-  }
-  pid_t pid = fork ();
-  if (pid == 0) {
-printf ("executing '%s' from %s\n", command, contact);
-syslog (syslog_option, "executing '%s' from %s\n", command, contact);
-    close (STDIN_FILENO);
-    close (STDOUT_FILENO);
-    close (STDERR_FILENO);
-    close (pipes [0]);
-    dup2 (pipes [1], STDOUT_FILENO);
-    dup2 (pipes [1], STDERR_FILENO);
-    execlp ("/bin/bash", "bash", "-c", command, NULL);
-    perror ("execlp");
-    exit (1);  /* in case of exec errors */
-  }
-  close (pipes [1]);
-  int status = 0;
-  waitpid (pid, &status, 0);
-  int n = 0;
-  int total = 0;
-  int esize = rsize - 1;  /* effective size remaining */
-  while ((total + 1 < rsize) &&
-         ((n = read (pipes [0], result + total, esize)) > 0)) {
-    total += n;
-    esize -= n;
-  }
-  close (pipes [0]);
-  result [total] = '\0';
-  if (total + 1 < rsize)
-    snprintf (result + total, rsize - total, "status %x\n", status);
-printf ("sending response:\n%s", result);
-syslog (syslog_option, "sending response: '%s'\n", result);
-  return strlen (result);
-}
+/* recently received messages, found by the digest of everything after
+ * the header (which changes, e.g. hops, as the message is forwarded) */
+#define RECENTLY_RECEIVED_MESSAGES	1024
+#define RECENTLY_RECEIVED_BUCKETS	1024
+#define RECENT_DIGEST_SIZE		16
+struct recent_message {
+  char digest [RECENT_DIGEST_SIZE];
+  int bucket;   /* -1 for an entry that is not used */
+  int next;     /* the next entry in the same bucket, or -1 */
+};
+static struct recent_message recent_messages [RECENTLY_RECEIVED_MESSAGES];
+static int recent_buckets [RECENTLY_RECEIVED_BUCKETS];
+static int recent_replace = -1;  /* the oldest entry, -1 before init */
+static pthread_mutex_t recent_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* report whether this message was recently received,
  * and if not, add it to the cache */
 static int recently_received (const char * message, int msize)
 {
-  struct message_cache {
-    char message [ALLNET_MTU];
-    int msize;  /* 0 for a message that is not in here */
-  };
-#define RECENTLY_RECEIVED_MESSAGES	50
-  static struct message_cache recent_messages [RECENTLY_RECEIVED_MESSAGES];
-  static int last_message = -1;  /* after init, 0..99 */
-  if ((msize > sizeof (recent_messages [0].message)) ||
-      (msize <= ALLNET_HEADER_SIZE))
+  if ((msize > ALLNET_MTU) || (msize <= ALLNET_HEADER_SIZE))
     return 0;
   const struct allnet_header * hp = (const struct allnet_header *) message;
   int hsize = ALLNET_SIZE (hp->transport);
   if (msize <= hsize)
     return 0;
-  message += hsize;
-  msize -= hsize;
+  char digest [RECENT_DIGEST_SIZE];
+  sha512_bytes (message + hsize, msize - hsize, digest, sizeof (digest));
+  int bucket = (int) (readb32u ((unsigned char *) digest) %
+                      RECENTLY_RECEIVED_BUCKETS);
   int i;
-  if (last_message < 0) {
+  pthread_mutex_lock (&recent_mutex);
+  if (recent_replace < 0) {
     for (i = 0; i < RECENTLY_RECEIVED_MESSAGES; i++)
-      recent_messages [i].msize = 0;
-    last_message = 0;
+      recent_messages [i].bucket = -1;
+    for (i = 0; i < RECENTLY_RECEIVED_BUCKETS; i++)
+      recent_buckets [i] = -1;
+    recent_replace = 0;
   }
-  for (i = 0; i < RECENTLY_RECEIVED_MESSAGES; i++)
-    if ((recent_messages [i].msize > 0) &&
-        (recent_messages [i].msize == msize) &&
-        (memcmp (recent_messages [i].message, message, msize) == 0))
+  for (i = recent_buckets [bucket]; i >= 0; i = recent_messages [i].next) {
+    if (memcmp (recent_messages [i].digest, digest, sizeof (digest)) == 0) {
+      pthread_mutex_unlock (&recent_mutex);
       return 1;
-  /* not found.  Add the message to the cache */
-  last_message = (last_message + 1) % RECENTLY_RECEIVED_MESSAGES;
-  recent_messages [last_message].msize = msize;
-  memcpy (recent_messages [last_message].message, message, msize);
+    }
+  }
+  /* not found.  Replace the oldest entry with this message */
+  struct recent_message * r = recent_messages + recent_replace;
+  if (r->bucket >= 0) {   /* remove from its bucket */
+    int * link = recent_buckets + r->bucket;
+    while ((*link >= 0) && (*link != recent_replace))
+      link = &(recent_messages [*link].next);
+    if (*link == recent_replace)
+      *link = r->next;
+  }
+  memcpy (r->digest, digest, sizeof (digest));
+  r->bucket = bucket;
+  r->next = recent_buckets [bucket];
+  recent_buckets [bucket] = recent_replace;
+  recent_replace = (recent_replace + 1) % RECENTLY_RECEIVED_MESSAGES;
+  pthread_mutex_unlock (&recent_mutex);
   return 0;
 }
 
@@ -305,10 +319,15 @@ static int symmetric_key_encrypt (const char * data, int dsize,
   return esize;
 }
 
+/* if session is not NULL, it is used instead of the contact's
+ * symmetric key.  A chunk with the AREMS_FLAG_SESSION flag is always
+ * sent with public key encryption.
+ * must be called with keys_mutex held */
 static void encrypt_sign_send (const char * data, int dsize, int hops,
                                long long int counter,
                                unsigned long long int expiration,
-                               int message_type,
+                               int message_type, int flags, int chunk,
+                               struct allnet_stream_encryption_state * session,
                                const char * contact, keyset k)
 {
   struct arems_header ah;
@@ -318,15 +337,30 @@ static void encrypt_sign_send (const char * data, int dsize, int hops,
   writeb32u (ah.app_media.media, MEDIA_ID);
   writeb64u (ah.counter, counter);
   ah.type = message_type;
-  char data_with_ah [MAX_STRING_LENGTH + sizeof (ah)];
+  ah.flags = flags;
+  writeb16u (ah.chunk, chunk);
+  char data_with_ah [AREMS_CHUNK_SIZE + sizeof (ah)];
+  if ((dsize < 0) || (dsize > AREMS_CHUNK_SIZE)) {
+    printf ("error: unable to send %d bytes, maximum %d\n", dsize,
+            AREMS_CHUNK_SIZE);
+    return;
+  }
   memcpy (data_with_ah, &ah, sizeof (ah));
   memcpy (data_with_ah + sizeof (ah), data, dsize);
   char ebuf [ALLNET_MTU];
-  int esize = symmetric_key_encrypt (data_with_ah, sizeof (ah) + dsize,
-                                     counter, message_type,
-                                     contact, k, ebuf, sizeof (ebuf));
+  int esize = 0;
   int sigtype = ALLNET_SIGTYPE_NONE; /* the hash provides the authentication */
-  if (esize <= 0) {
+  if (flags & AREMS_FLAG_SESSION)
+    esize = 0;                       /* use public key encryption */
+  else if (session != NULL)
+    esize = allnet_stream_encrypt_buffer (session, data_with_ah,
+                                          sizeof (ah) + dsize,
+                                          ebuf, sizeof (ebuf));
+  else
+    esize = symmetric_key_encrypt (data_with_ah, sizeof (ah) + dsize,
+                                   counter, message_type,
+                                   contact, k, ebuf, sizeof (ebuf));
+  if ((esize <= 0) && ((session == NULL) || (flags & AREMS_FLAG_SESSION))) {
     esize = public_key_encrypt (data_with_ah, sizeof (ah) + dsize,
                                 counter, message_type,
                                 contact, k, ebuf, sizeof (ebuf));
@@ -361,15 +395,30 @@ static void encrypt_sign_send (const char * data, int dsize, int hops,
   local_send (buffer, hsize + esize, ALLNET_PRIORITY_LOCAL);
 }
 
-/* returns 1 if the receive loop should exit, 0 if it should continue
+/* returns RECEIVE_EXIT if the receive loop should exit, RECEIVE_CONTINUE
+ * if it should continue, and RECEIVE_EXTEND to continue and restart the
+ * timeout, e.g. when part of a response has arrived.
  * hops is the number of hops visited by the incoming packet.
  * if the packet has no expiration, expiration is 0 */
+#define RECEIVE_CONTINUE	0
+#define RECEIVE_EXIT		1
+#define RECEIVE_EXTEND		2
 typedef int (* received_packet_handler) (void * state,
                                          const char * data, int dsize, int hops,
                                          long long int counter,
                                          unsigned long long int expiration,
+                                         int flags, int chunk,
                                          const char * contact, keyset k);
 
+/* a client's session with the server for one command, when the contact
+ * has no symmetric key */
+struct arems_session {
+  int valid;
+  const char * contact;
+  keyset k;
+  struct allnet_stream_encryption_state state;
+};
+
 static int receive_timeout (char ** message, unsigned int * priority,
                             int timeout, long long int quitting_time)
 {
@@ -381,9 +430,30 @@ static int receive_timeout (char ** message, unsigned int * priority,
   return result;
 }
 
-/* timeout is in ms, -1 to never time out */
+/* returns the size of the decrypted text, or 0 if it does not decrypt */
+static int session_decrypt (struct arems_session * session,
+                            const char * payload, int psize, char ** text)
+{
+  if ((session == NULL) || (! session->valid))
+    return 0;
+  /* the counter is in each packet, so start each from the initial state */
+  struct allnet_stream_encryption_state state = session->state;
+  int tsize = psize - state.counter_size - state.hash_size;
+  if (tsize <= 0)
+    return 0;
+  char * result = malloc_or_fail (tsize, "arems session_decrypt");
+  if (! allnet_stream_decrypt_buffer (&state, payload, psize, result, tsize)) {
+    free (result);
+    return 0;
+  }
+  *text = result;
+  return tsize;
+}
+
+/* timeout is in ms, -1 to never time out
+ * session may be NULL, and otherwise is also used to decrypt messages */
 static void receive_packet_loop (received_packet_handler handler, void * state,
-                                 int mtype,
+                                 int mtype, struct arems_session * session,
                                  char ** authorized, int nauth, int timeout,
                                  int print_unauth)
 {
@@ -418,10 +488,16 @@ static void receive_packet_loop (received_packet_handler handler, void * state,
     char * payload = message + ALLNET_SIZE (hp->transport);
     int psize = msize - ALLNET_SIZE (hp->transport);
     if (psize > 0) {
+      pthread_mutex_lock (&keys_mutex);
       int tsize = decrypt_verify (hp->sig_algo, payload, psize,
                                   &contact, &k, &text,
                                   (char *) hp->source, hp->src_nbits,
                                   (char *) hp->destination, hp->dst_nbits, 0);
+      if ((tsize <= 8) && (hp->sig_algo == ALLNET_SIGTYPE_NONE) &&
+          ((tsize = session_decrypt (session, payload, psize, &text)) > 8)) {
+        contact = strcpy_malloc (session->contact, "arems session contact");
+        k = session->k;
+      }
 #ifdef DEBUG_RECEIVE
 if (tsize <= 8) printf ("unable to decrypt_verify\n");
 #endif /* DEBUG_RECEIVE */
@@ -435,6 +511,7 @@ if (tsize <= 8) printf ("unable to decrypt_verify\n");
         if (! is_authorized) {
           if (print_unauth)
             printf ("got message from %s, who is not authorized\n", contact);
+          pthread_mutex_unlock (&keys_mutex);
           continue;   /* next packet, please */
         }
         struct arems_header * ahp = (struct arems_header *) text;
@@ -447,15 +524,19 @@ if (tsize <= 8) printf ("unable to decrypt_verify\n");
           printf ("from %s unexpected app %s media %lx, expected %s %x\n",
                   contact, print_app, readb32u (ahp->app_media.media),
                   APP_ID, MEDIA_ID);
+          pthread_mutex_unlock (&keys_mutex);
           continue;   /* next packet, please */
         }
-        if (ahp->type != mtype) {
+        if ((ahp->type != mtype) &&
+            (! ((session != NULL) && (ahp->type == MESSAGE_TYPE_SESSION)))) {
           printf ("got message type %d, expected %d\n", ahp->type, mtype);
+          pthread_mutex_unlock (&keys_mutex);
           continue;   /* next packet, please */
         }
         send_ack (hp, msize);
         if (readb64u (ahp->counter) < 0) {
           printf ("got negative counter %lld\n", readb64u (ahp->counter));
+          pthread_mutex_unlock (&keys_mutex);
           continue;   /* next packet, please */
         }
         char string [ALLNET_MTU + 1];  /* a null-terminated C string */
@@ -466,11 +547,21 @@ if (tsize <= 8) printf ("unable to decrypt_verify\n");
         unsigned long long int expiration = ((ep == NULL) ? 0 : readb64 (ep));
         /* printf ("got %d/%d-byte message '%s' from %s/%d, counter %lld\n",
                 tsize, stsize, string, contact, k, readb64u (ahp->counter)); */
-        if (handler (state, string, strlen (string), hp->hops,
-                     readb64u (ahp->counter), expiration, contact, k))
+        /* the session key is binary, everything else is text */
+        int ssize = ((ahp->flags & AREMS_FLAG_SESSION) ? stsize
+                                                       : strlen (string));
+        int action = handler (state, string, ssize, hp->hops,
+                              readb64u (ahp->counter), expiration,
+                              ahp->flags, readb16u (ahp->chunk), contact, k);
+        pthread_mutex_unlock (&keys_mutex);
+        if (action == RECEIVE_EXIT)
           break;
+        if (action == RECEIVE_EXTEND)
+          quitting_time = allnet_time_ms () + timeout;
         free (text);
         free (contact);
+      } else {
+        pthread_mutex_unlock (&keys_mutex);
       }
     }
   }
@@ -478,11 +569,34 @@ if (tsize <= 8) printf ("unable to decrypt_verify\n");
 
 static int num_tries = 1;
 
-/* *((int *)state) is set to 0 if we got a message */
+struct client_state {
+  int timed_out;     /* set to 0 when we get a response */
+  int printed;       /* output chunks 1..printed have been printed */
+  int last;          /* the number of the last chunk, 0 if not known */
+  char * chunks [AREMS_MAX_CHUNKS + 1];  /* received but not yet printed */
+  struct arems_session * session;
+};
+
+static void print_chunk (struct client_state * cs, const char * contact,
+                         const char * data)
+{
+  if (cs->timed_out) {
+    if (num_tries > 1)
+      printf ("from %s got response on try %d:\n", contact, num_tries);
+    else
+      printf ("from %s got response:\n", contact);
+  }
+  cs->timed_out = 0;
+  printf ("%s", data);
+  fflush (stdout);
+}
+
+/* cs->timed_out is set to 0 if we got a message */
 static int client_handler (void * state,
                            const char * data, int dsize, int hops,
                            long long int counter,
                            unsigned long long int expiration,
+                           int flags, int chunk,
                            const char * contact, keyset k)
 {
   long long int last_counter = get_counter (contact, k, COUNTER_TYPE_LOCAL);
@@ -490,17 +604,43 @@ static int client_handler (void * state,
     printf ("client_handler: received counter %lld, expected %lld\n",
             counter, last_counter);
     printf ("  (response from %s was: %s)\n", contact, data);
-    return 0;  /* continue the loop */
+    return RECEIVE_CONTINUE;
   }
-  int * timed_out = (int *) state;
-  if (num_tries > 1)
-    printf ("from %s got response on try %d:\n%s", contact, num_tries, data);
-  else
-    printf ("from %s got response:\n%s", contact, data);
-  if ((strlen (data) > 0) && (data [strlen (data) - 1] != '\n'))
-    printf (" [output may be truncated]\n");
-  *timed_out = 0;
-  return 1;    /* exit the loop*/
+  struct client_state * cs = (struct client_state *) state;
+  if (! (flags & AREMS_FLAG_CHUNKED)) {   /* the entire response */
+    print_chunk (cs, contact, data);
+    if ((strlen (data) > 0) && (data [strlen (data) - 1] != '\n'))
+      printf (" [output may be truncated]\n");
+    return RECEIVE_EXIT;
+  }
+  if (flags & AREMS_FLAG_SESSION) {
+    struct arems_session * session = cs->session;
+    if ((dsize == AREMS_SESSION_SIZE) && (! session->valid)) {
+      char key [ALLNET_STREAM_KEY_SIZE];
+      char secret [ALLNET_STREAM_SECRET_SIZE];
+      memcpy (key, data, sizeof (key));
+      memcpy (secret, data + sizeof (key), sizeof (secret));
+      allnet_stream_init (&(session->state), key, 0, secret, 0, 8, 32);
+      session->valid = 1;
+    }
+    return RECEIVE_EXTEND;
+  }
+  if ((chunk <= cs->printed) || (chunk > AREMS_MAX_CHUNKS) ||
+      (cs->chunks [chunk] != NULL))
+    return RECEIVE_EXTEND;   /* duplicate or invalid */
+  cs->chunks [chunk] = strcpy_malloc (data, "arems client chunk");
+  if (flags & AREMS_FLAG_LAST)
+    cs->last = chunk;
+  while ((cs->printed < AREMS_MAX_CHUNKS) &&
+         (cs->chunks [cs->printed + 1] != NULL)) {
+    cs->printed++;
+    print_chunk (cs, contact, cs->chunks [cs->printed]);
+    free (cs->chunks [cs->printed]);
+    cs->chunks [cs->printed] = NULL;
+  }
+  if ((cs->last > 0) && (cs->printed >= cs->last))
+    return RECEIVE_EXIT;
+  return RECEIVE_EXTEND;
 }
 
 static int client_rpc (const char * data, int dsize, char * contact)
@@ -520,42 +660,248 @@ static int client_rpc (const char * data, int dsize, char * contact)
     counter = 0;
   save_counter (contact, k [0], counter, COUNTER_TYPE_LOCAL);
   encrypt_sign_send (data, dsize, 10, counter, 0, MESSAGE_TYPE_COMMAND,
-                     contact, k [0]);
+                     0, 0, NULL, contact, k [0]);
+  struct arems_session session = { .valid = 0, .contact = contact, .k = k [0] };
   free (k);
   char * authorized [1] = { contact };
-  int timed_out = 1;   /* if nothing happens, we time out */
-  receive_packet_loop (&client_handler, &timed_out, MESSAGE_TYPE_RESPONSE,
+  struct client_state cs;
+  memset (&cs, 0, sizeof (cs));
+  cs.timed_out = 1;   /* if nothing happens, we time out */
+  cs.session = &session;
+  receive_packet_loop (&client_handler, &cs, MESSAGE_TYPE_RESPONSE, &session,
                        authorized, 1, command_timeout * 1000, 0);
-  if (timed_out) {
+  int i;
+  for (i = 0; i <= AREMS_MAX_CHUNKS; i++)
+    if (cs.chunks [i] != NULL)
+      free (cs.chunks [i]);
+  if (cs.timed_out) {
     printf ("command timed out after %d seconds\n", command_timeout);
     num_tries++;
     return 0;
   }
+  if ((cs.last == 0) || (cs.printed < cs.last))
+    printf (" [response incomplete after chunk %d]\n", cs.printed);
   return 1;
 }
 
+/* a command waiting for, or being run by, a worker */
+struct arems_job {
+  char * command;
+  char * contact;
+  keyset k;
+  int hops;
+  long long int counter;
+  unsigned long long int expiration;
+  struct allnet_stream_encryption_state session;
+  int has_session;
+};
+
+static struct arems_job * job_queue [AREMS_QUEUE_SIZE];
+static int job_first = 0;    /* index of the oldest job in the queue */
+static int job_count = 0;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static void send_chunk (struct arems_job * job, const char * data, int dsize,
+                        int flags, int chunk)
+{
+  /* clients that do not know about sessions ignore the session key */
+  int type = ((flags & AREMS_FLAG_SESSION) ? MESSAGE_TYPE_SESSION
+                                           : MESSAGE_TYPE_RESPONSE);
+  pthread_mutex_lock (&keys_mutex);
+  encrypt_sign_send (data, dsize, job->hops + 2, job->counter, job->expiration,
+                     type, flags | AREMS_FLAG_CHUNKED, chunk,
+                     (job->has_session ? &(job->session) : NULL),
+                     job->contact, job->k);
+  pthread_mutex_unlock (&keys_mutex);
+}
+
+/* without a symmetric key, use public key cryptography only to send a
+ * new session key in chunk 0 */
+static void start_session (struct arems_job * job)
+{
+  char sym_key [ALLNET_STREAM_KEY_SIZE];
+  pthread_mutex_lock (&keys_mutex);
+  int sksize = has_symmetric_key (job->contact, sym_key, sizeof (sym_key));
+  pthread_mutex_unlock (&keys_mutex);
+  if (sksize == ALLNET_STREAM_KEY_SIZE)
+    return;   /* use the symmetric key */
+  char session [AREMS_SESSION_SIZE];
+  allnet_stream_init (&(job->session), session, 1,
+                      session + ALLNET_STREAM_KEY_SIZE, 1, 8, 32);
+  send_chunk (job, session, sizeof (session), AREMS_FLAG_SESSION, 0);
+  job->has_session = 1;
+}
+
+/* runs the command, sending the output as it is produced */
+static void run_command (struct arems_job * job)
+{
+  int syslog_option = LOG_DAEMON | LOG_WARNING;
+  int pipes [2];
+  if (pipe (pipes) != 0) {
+    perror ("pipe");
+    return;
+  }
+  /* print before forking, since other threads may be printing */
+printf ("executing '%s' from %s\n", job->command, job->contact);
+syslog (syslog_option, "executing '%s' from %s\n", job->command, job->contact);
+  fflush (stdout);
+  pid_t pid = fork ();
+  if (pid == 0) {
+    close (STDIN_FILENO);
+    close (STDOUT_FILENO);
+    close (STDERR_FILENO);
+    close (pipes [0]);
+    dup2 (pipes [1], STDOUT_FILENO);
+    dup2 (pipes [1], STDERR_FILENO);
+    execlp ("/bin/bash", "bash", "-c", job->command, NULL);
+    perror ("execlp");
+    exit (1);  /* in case of exec errors */
+  }
+  close (pipes [1]);
+  if (pid < 0) {
+    perror ("fork");
+    close (pipes [0]);
+    return;
+  }
+  start_session (job);
+  char chunk [AREMS_CHUNK_SIZE + 1];
+  int csize = 0;
+  int capacity = AREMS_CHUNK_SIZE - AREMS_STATUS_SIZE;  /* room for status */
+  int index = 1;
+  int killed = 0;
+  unsigned long long int start = allnet_time_ms ();
+  unsigned long long int first_unsent = 0;
+  while (1) {
+    unsigned long long int now = allnet_time_ms ();
+    int wait = AREMS_FLUSH_MS;
+    if ((csize > 0) && (first_unsent + AREMS_FLUSH_MS > now))
+      wait = (int) (first_unsent + AREMS_FLUSH_MS - now);
+    struct pollfd pfd = { .fd = pipes [0], .events = POLLIN, .revents = 0 };
+    int p = poll (&pfd, 1, wait);
+    if ((p < 0) && (errno != EINTR)) {
+      perror ("arems poll");
+      break;
+    }
+    if (p > 0) {
+      ssize_t n = read (pipes [0], chunk + csize, capacity - csize);
+      if (n <= 0)
+        break;   /* end of output, or error */
+      if (csize == 0)
+        first_unsent = allnet_time_ms ();
+      csize += (int) n;
+    }
+    now = allnet_time_ms ();
+    if ((csize >= capacity) ||
+        ((csize > 0) && (now >= first_unsent + AREMS_FLUSH_MS))) {
+      if (index >= AREMS_MAX_CHUNKS) {   /* keep it for the last chunk */
+        kill (pid, SIGKILL);
+        killed = 1;
+        break;
+      }
+      chunk [csize] = '\0';
+      send_chunk (job, chunk, csize, 0, index++);
+      csize = 0;
+    }
+    if (now > start + AREMS_MAX_SECONDS * 1000LL) {
+      kill (pid, SIGKILL);
+      killed = 1;
+      break;
+    }
+  }
+  close (pipes [0]);
+  int status = 0;
+  waitpid (pid, &status, 0);
+  csize += snprintf (chunk + csize, sizeof (chunk) - csize, "%sstatus %x\n",
+                     (killed ? "[output cut off, command killed]\n" : ""),
+                     status);
+  send_chunk (job, chunk, csize, AREMS_FLAG_LAST, index);
+printf ("sent response to '%s' in %d chunks\n", job->command, index);
+syslog (syslog_option, "sent response to '%s' in %d chunks\n", job->command,
+        index);
+}
+
+static void * worker_thread (void * arg)
+{
+  while (1) {
+    pthread_mutex_lock (&job_mutex);
+    while (job_count == 0)
+      pthread_cond_wait (&job_cond, &job_mutex);
+    struct arems_job * job = job_queue [job_first];
+    job_first = (job_first + 1) % AREMS_QUEUE_SIZE;
+    job_count--;
+    pthread_mutex_unlock (&job_mutex);
+    run_command (job);
+    free (job->command);
+    free (job->contact);
+    free (job);
+  }
+  return NULL;
+}
+
+/* returns 1 if the job was queued, 0 if the queue is full */
+static int queue_job (struct arems_job * job)
+{
+  int result = 0;
+  pthread_mutex_lock (&job_mutex);
+  if (job_count < AREMS_QUEUE_SIZE) {
+    job_queue [(job_first + job_count) % AREMS_QUEUE_SIZE] = job;
+    job_count++;
+    pthread_cond_signal (&job_cond);
+    result = 1;
+  }
+  pthread_mutex_unlock (&job_mutex);
+  return result;
+}
+
+/* called with keys_mutex held */
 static int server_handler (void * state, /* ignored for now */
                            const char * data, int dsize, int hops,
                            long long int counter,
                            unsigned long long int expiration,
+                           int flags, int chunk,
                            const char * contact, keyset k)
 {
   static int printed = 0;
   long long int last_counter = get_counter (contact, k, COUNTER_TYPE_REMOTE);
   if ((last_counter < 0) || (counter > last_counter)) {
-    char result [MAX_STRING_LENGTH];
-    int rsize = my_system (data, result, sizeof (result), contact);
     save_counter (contact, k, counter, COUNTER_TYPE_REMOTE);
-    encrypt_sign_send (result, rsize, hops + 2, counter, expiration,
-                       MESSAGE_TYPE_RESPONSE, contact, k);
+    struct arems_job * job = malloc_or_fail (sizeof (struct arems_job),
+                                             "arems job");
+    memset (job, 0, sizeof (struct arems_job));
+    job->command = strcpy_malloc (data, "arems job command");
+    job->contact = strcpy_malloc (contact, "arems job contact");
+    job->k = k;
+    job->hops = hops;
+    job->counter = counter;
+    job->expiration = expiration;
+    if (! queue_job (job)) {
+      const char * busy = "arems: too many commands running, not executed\n";
+      encrypt_sign_send (busy, strlen (busy), hops + 2, counter, expiration,
+                         MESSAGE_TYPE_RESPONSE, 0, 0, NULL, contact, k);
+      free (job->command);
+      free (job->contact);
+      free (job);
+    }
   } else if ((counter <= last_counter) && (printed++ < 5))
     printf ("got duplicate counter %lld, latest %lld\n", counter, last_counter);
-  return 0;     /* continue the loop */
+  return RECEIVE_CONTINUE;
 }
 
 static void server_loop (char ** const authorized, int nauth)
 {
-  receive_packet_loop (&server_handler, NULL, MESSAGE_TYPE_COMMAND,
+  int i;
+  for (i = 0; i < AREMS_WORKERS; i++) {
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, worker_thread, NULL) != 0) {
+      perror ("arems pthread_create");
+      if (i == 0)
+        exit (1);
+      break;   /* run with fewer workers */
+    }
+    pthread_detach (thread);
+  }
+  receive_packet_loop (&server_handler, NULL, MESSAGE_TYPE_COMMAND, NULL,
                        authorized, nauth, -1, 1);
 }
 
@@ -25,47 +25,134 @@
 
 static struct allnet_log * alog = NULL;
 
-static void keyd_send_key (struct bc_key_info * key, const char * return_key,
-                           int rksize, unsigned char * address, int abits,
-                           int hops)
+/* every response with a given key has the same app media header and
+ * public key, so these are computed once for each of our keys.  Only the
+ * addresses, hops, and random pad differ from one response to another */
+struct keyd_response {
+  char * data;     /* app media header and public key, NULL for errors */
+  int dsize;       /* includes the app media header */
+  int klen;        /* the size of the public key, <= dsize - amhsize */
+};
+static struct keyd_response * responses = NULL;
+static int num_responses = 0;
+static struct bc_key_info * responses_keys = NULL;  /* the keys they are for */
+
+static struct keyd_response * keyd_response (struct bc_key_info * keys,
+                                             int nkeys, int index)
 {
+  if ((responses_keys != keys) || (num_responses != nkeys)) {
+    int i;
+    for (i = 0; i < num_responses; i++)
+      if (responses [i].data != NULL)
+        free (responses [i].data);
+    if (responses != NULL)
+      free (responses);
+    responses = malloc_or_fail (nkeys * sizeof (struct keyd_response),
+                                "keyd responses");
+    memset (responses, 0, nkeys * sizeof (struct keyd_response));
+    num_responses = nkeys;
+    responses_keys = keys;
+  }
+  struct keyd_response * r = responses + index;
+  if ((r->data == NULL) && (r->dsize == 0)) {   /* compute it */
+    struct bc_key_info * key = keys + index;
+    unsigned int amhsize = sizeof (struct allnet_app_media_header);
+    int dlen = allnet_rsa_pubkey_size (key->pub_key) + 1;
+    char * data = malloc_or_fail (amhsize + dlen, "keyd_response");
+    memset (data, 0, amhsize + dlen);
+    int klen = allnet_pubkey_to_raw (key->pub_key, data + amhsize, dlen);
+    if ((klen > dlen) || (klen == 0)) {
+      snprintf (alog->b, alog->s, "error in keyd_response: %d, %d\n",
+                klen, dlen);
+      log_print (alog);
+      free (data);
+      r->dsize = -1;   /* do not try again */
+      return NULL;
+    }
+    struct allnet_app_media_header * amhp =
+      (struct allnet_app_media_header *) data;
+    writeb32u (amhp->app, 0x6b657964 /* keyd */ );
+    writeb32u (amhp->media, ALLNET_MEDIA_PUBLIC_KEY);
+    r->data = data;
+    r->dsize = amhsize + dlen;
+    r->klen = klen;
+  }
+  return ((r->data == NULL) ? NULL : r);
+}
+
+static void keyd_send_key (struct bc_key_info * keys, int nkeys, int index,
+                           const char * return_key, int rksize,
+                           unsigned char * address, int abits, int hops)
+{
+  struct bc_key_info * key = keys + index;
 #ifdef DEBUG_PRINT
   printf ("keyd_send_key ((%p, %d), %p)\n", key->pub_key,
           allnet_rsa_pubkey_size (key->pub_key), return_key);
 #endif /* DEBUG_PRINT */
-  int dlen = allnet_rsa_pubkey_size (key->pub_key) + 1;
-  char * data = malloc_or_fail (dlen, "keyd_send_key");
-  int klen = allnet_pubkey_to_raw (key->pub_key, data, dlen);
-  if ((klen > dlen) || (klen == 0)) {
-    snprintf (alog->b, alog->s, "error in keyd_send_key: %d, %d\n", klen, dlen);
-    log_print (alog);
-    free (data);
+  struct keyd_response * r = keyd_response (keys, nkeys, index);
+  if (r == NULL)
     return;
-  }
   int type = ALLNET_TYPE_CLEAR;
   unsigned int amhsize = sizeof (struct allnet_app_media_header);
   unsigned int bytes;
   struct allnet_header * hp =
-    create_packet (dlen + amhsize + KEY_RANDOM_PAD_SIZE, type, hops,
-                   ALLNET_SIGTYPE_NONE, key->address, 16, address, abits,
-                   NULL, NULL, &bytes);
+    create_pool_packet (r->dsize + KEY_RANDOM_PAD_SIZE, type, hops,
+                        ALLNET_SIGTYPE_NONE, key->address, 16, address, abits,
+                        NULL, NULL, &bytes);
   char * adp = ALLNET_DATA_START(hp, hp->transport, (unsigned int) bytes);
-  struct allnet_app_media_header * amhp =
-    (struct allnet_app_media_header *) adp;
-  writeb32u (amhp->app, 0x6b657964 /* keyd */ );
-  writeb32u (amhp->media, ALLNET_MEDIA_PUBLIC_KEY);
+  memcpy (adp, r->data, r->dsize);
   char * dp = adp + amhsize;
-  memcpy (dp, data, dlen);
-  free (data);
 #ifdef DEBUG_PRINT
-  print_buffer (dp, dlen, "keyd_send_key", 12, 1);
+  print_buffer (dp, r->dsize - amhsize, "keyd_send_key", 12, 1);
 #endif /* DEBUG_PRINT */
-  char * r = dp + klen;
-  random_bytes (r, KEY_RANDOM_PAD_SIZE);
+  char * pad = dp + r->klen;
+  random_bytes (pad, KEY_RANDOM_PAD_SIZE);
 
   /* send with relatively low priority */
   char * message = (char *) hp;
   local_send (message, bytes, ALLNET_PRIORITY_DEFAULT);
+  allnet_packet_free (message);
+}
+
+/* the same request often arrives several times in a burst, over
+ * different paths.  A request that matches one answered in the last
+ * KEYD_REPEAT_MS is not answered again */
+#define KEYD_REPEAT_MS		1000
+#define KEYD_RECENT		64
+struct keyd_answered {
+  int index;       /* of the key, -1 if not used */
+  unsigned char address [ADDRESS_SIZE];
+  int abits;
+  unsigned long long int time_ms;
+};
+static struct keyd_answered answered [KEYD_RECENT];
+static int answered_next = -1;   /* -1 until initialized */
+
+/* returns 1 if this was answered recently, otherwise records it, returns 0 */
+static int recently_answered (int index, const unsigned char * address,
+                              int abits)
+{
+  int i;
+  if (answered_next < 0) {
+    for (i = 0; i < KEYD_RECENT; i++)
+      answered [i].index = -1;
+    answered_next = 0;
+  }
+  unsigned long long int now = allnet_time_ms ();
+  for (i = 0; i < KEYD_RECENT; i++) {
+    struct keyd_answered * a = answered + i;
+    if ((a->index == index) && (a->abits == abits) &&
+        (a->time_ms + KEYD_REPEAT_MS > now) &&
+        (matches (a->address, abits, address, abits) > 0))
+      return 1;
+  }
+  struct keyd_answered * a = answered + answered_next;
+  answered_next = (answered_next + 1) % KEYD_RECENT;
+  a->index = index;
+  memcpy (a->address, address, ADDRESS_SIZE);
+  a->abits = abits;
+  a->time_ms = now;
+  return 0;
 }
 
 #ifdef DEBUG_PRINT
@@ -135,13 +222,14 @@ static
               hp->destination [0] & 0xff,
               keys [i].address [0] & 0xff, matching_bits, hp->dst_nbits);
     log_print (alog);
-    if (matching_bits >= hp->dst_nbits) {  /* send the key */
+    if ((matching_bits >= hp->dst_nbits) &&  /* send the key */
+        (! recently_answered (i, hp->source, hp->src_nbits))) {
 #ifdef DEBUG_PRINT
       printf ("keyd sending key %d (%s), kp %p, %zd bytes to %02x.%02x./%d\n",
               i, keys [i].identifier, kp, ksize,
               hp->source [0] & 0xff, hp->source [1] & 0xff, hp->src_nbits);
 #endif /* DEBUG_PRINT */
-      keyd_send_key (keys + i, kp, (int)ksize,
+      keyd_send_key (keys, nkeys, i, kp, (int)ksize,
                      hp->source, hp->src_nbits, hp->hops + 4);
     }
   }
@@ -165,10 +253,9 @@ static int gather_random_and_wait (int bsize, char * buffer, time_t until)
       if ((count < 4) || (count + 4 >= bsize) || ((count % 128) == 127))
         printf ("graw, count %d, bsize %d\n", count, bsize);
 #endif /* DEBUG_PRINT_SPARES */
-      char data [1];
-      ssize_t found = read (fd, data, 1);
-      if (found == 1)
-        buffer [count++] = data [0];
+      ssize_t found = read (fd, buffer + count, bsize - count);
+      if (found > 0)
+        count += (int) found;
       else if (found < 0) {  /* some kind of error */
 perror ("gather_random_and_wait read /dev/random");
         close (fd);
@@ -206,6 +293,9 @@ perror ("gather_random_and_wait read /dev/random");
 #define KEY_GEN_BYTES	(KEY_GEN_BITS / 8)
 #define MIN_SPARES	8  /* below this, generate keys without stopping */
 #define HEALTHY_SPARES	100  /* do not generate more than this */
+#define SPARES_CHECK_SECONDS	60  /* how often to see if spares were used */
+/* only spare keys of KEY_GEN_BITS count toward MIN_SPARES and
+ * HEALTHY_SPARES, since spares of other sizes cannot replace them */
 /* run from astart as a separate process */
 void keyd_generate (char * pname)
 {
@@ -220,7 +310,7 @@ void keyd_generate (char * pname)
 #endif /* ALLNET_USE_FORK */
   /* sleep 10 min, or 100 * the time to generate a key, whichever is longer */
   time_t sleep_time = 60 * 10;  /* 10 minutes, in seconds */
-  int existing_spares = create_spare_key (-1, NULL, 0);
+  int existing_spares = count_spare_keys (KEY_GEN_BITS);
   if (existing_spares < MIN_SPARES)  /* create keys as fast as possible */
     sleep_time = 1;
   char buffer [KEY_GEN_BYTES];
@@ -238,9 +328,16 @@ void keyd_generate (char * pname)
     printf ("gathering %d bytes (have %d) and waiting %ld until %ld\n",
             gather_bytes, bytes_in_buffer, finish - time (NULL), finish);
 #endif /* DEBUG_PRINT_SPARES */
+    /* gather the random bytes now, so they are ready when needed */
     bytes_in_buffer +=
-      gather_random_and_wait (gather_bytes, buffer + bytes_in_buffer, finish);
-    existing_spares = create_spare_key (-1, NULL, 0);
+      gather_random_and_wait (gather_bytes, buffer + bytes_in_buffer, 0);
+    /* wait, but start again early if requests use up the spare keys */
+    while ((time (NULL) < finish) &&
+           (count_spare_keys (KEY_GEN_BITS) >= MIN_SPARES)) {
+      time_t step = time (NULL) + SPARES_CHECK_SECONDS;
+      gather_random_and_wait (0, NULL, ((step < finish) ? step : finish));
+    }
+    existing_spares = count_spare_keys (KEY_GEN_BITS);
     if (existing_spares < min_spares)  /* for now, report how many we have */
       printf ("%ld: %d spare keys, min %d\n",
               start, existing_spares, min_spares);
@@ -248,7 +345,7 @@ void keyd_generate (char * pname)
     printf ("%ld: %d spare keys, min %d\n",
             start, existing_spares, min_spares);
     printf ("gathered %d bytes, done waiting, now %ld (and %d spares)\n",
-            bytes_in_buffer, time (NULL), create_spare_key (-1, NULL, 0));
+            bytes_in_buffer, time (NULL), count_spare_keys (KEY_GEN_BITS));
 #endif /* DEBUG_PRINT_SPARES */
     sleep_time = (60 * 10);  /* sleep for 10 minutes, or 100x key gen time */
     if ((existing_spares < min_spares) && (bytes_in_buffer >= KEY_GEN_BYTES)) {
@@ -268,7 +365,7 @@ void keyd_generate (char * pname)
       printf ("%ld: created, sleep %ld (from %ld)\n", done, sleep_time, delta);
 #endif /* DEBUG_PRINT_SPARES */
     }
-    existing_spares = create_spare_key (-1, NULL, 0);
+    existing_spares = count_spare_keys (KEY_GEN_BITS);
     if (existing_spares < MIN_SPARES)  /* create keys as fast as possible */
       sleep_time = 1;
   }
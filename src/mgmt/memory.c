@@ -0,0 +1,125 @@
+/* memory.c: ask allnetd how much memory each of its subsystems uses */
+/* command line:
+   allnet-memory [-t ms]
+     -t gives the number of milliseconds to wait for the reply
+        (default 2000)
+   for each subsystem, prints the bytes currently used and the most used
+   since allnetd started, then the total and allnetd's memory budget.
+   Only memory counted by the memory accounting in lib/util.h is
+   included, not all the memory allnetd uses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/packet.h"
+#include "lib/mgmt.h"
+#include "lib/util.h"
+#include "lib/app_util.h"
+#include "lib/priority.h"
+
+/* returns 1 and prints the memory use if this is the reply, 0 otherwise */
+static int print_memory_reply (const char * message, int msize,
+                               const unsigned char * request_id)
+{
+  if (msize < ALLNET_HEADER_SIZE)
+    return 0;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((hp->message_type != ALLNET_TYPE_MGMT) ||
+      (msize < ALLNET_MGMT_HEADER_SIZE (hp->transport) +
+               sizeof (struct allnet_mgmt_memory_reply)))
+    return 0;
+  const struct allnet_mgmt_header * mp =
+    (const struct allnet_mgmt_header *) (message + ALLNET_SIZE (hp->transport));
+  if (mp->mgmt_type != ALLNET_MGMT_MEMORY_REPLY)
+    return 0;
+  const struct allnet_mgmt_memory_reply * reply =
+    (const struct allnet_mgmt_memory_reply *)
+      (message + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  if (memcmp (reply->request_id, request_id, sizeof (reply->request_id)) != 0)
+    return 0;
+  int num = reply->num_subsystems;
+  int needed = (int) (((const char *) (reply->subsystems)) - message) +
+               num * sizeof (struct allnet_mgmt_memory_subsystem);
+  if (msize < needed) {
+    printf ("memory reply has %d bytes, needs %d\n", msize, needed);
+    return 0;
+  }
+  printf ("%-15s %14s %14s\n", "subsystem", "bytes", "peak");
+  unsigned long long int total = 0;
+  int i;
+  for (i = 0; i < num; i++) {
+    const struct allnet_mgmt_memory_subsystem * sp = reply->subsystems + i;
+    char name [ALLNET_MEMORY_NAME_SIZE];
+    snprintf (name, sizeof (name), "%s", sp->name);
+    unsigned long long int bytes = readb64u (sp->bytes);
+    total += bytes;
+    printf ("%-15s %14llu %14llu\n", name, bytes, readb64u (sp->peak));
+  }
+  printf ("%-15s %14llu\n", "total", total);
+  unsigned long long int budget = readb64u (reply->budget);
+  if (budget > 0)
+    printf ("%-15s %14llu\n", "budget", budget);
+  else
+    printf ("%-15s %14s\n", "budget", "none");
+  return 1;
+}
+
+int main (int argc, char ** argv)
+{
+  int timeout = 2000;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-t") == 0) && (i + 1 < argc)) {
+      timeout = atoi (argv [++i]);
+    } else {
+      printf ("usage: %s [-t ms]\n", argv [0]);
+      return 1;
+    }
+  }
+  int sock = connect_to_local (argv [0], argv [0], NULL, 1, 1);
+  if (sock < 0)
+    return 1;
+  unsigned int data_size = sizeof (struct allnet_mgmt_header) +
+                           sizeof (struct allnet_mgmt_memory_req);
+  unsigned int total = 0;
+  struct allnet_header * hp =
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, 1, ALLNET_SIGTYPE_NONE,
+                        NULL, 0, NULL, 0, NULL, NULL, &total);
+  if (hp == NULL) {
+    printf ("unable to create memory request\n");
+    return 1;
+  }
+  hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+  char * buffer = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_MEMORY_REQ;
+  struct allnet_mgmt_memory_req * req =
+    (struct allnet_mgmt_memory_req *)
+      (buffer + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  random_bytes ((char *) (req->request_id), sizeof (req->request_id));
+  if (! local_send (buffer, total, ALLNET_PRIORITY_LOCAL)) {
+    printf ("unable to send %d-byte memory request\n", total);
+    allnet_packet_free (buffer);
+    return 1;
+  }
+  unsigned long long int finish = allnet_time_ms () + timeout;
+  unsigned long long int now;
+  int found = 0;
+  while ((! found) && ((now = allnet_time_ms ()) < finish)) {
+    char * received = NULL;
+    unsigned int priority = 0;
+    int r = local_receive ((int) (finish - now), &received, &priority);
+    if ((r <= 0) || (received == NULL))
+      break;
+    found = print_memory_reply (received, r, req->request_id);
+    free (received);
+  }
+  if (! found)
+    printf ("no reply from allnetd within %dms\n", timeout);
+  allnet_packet_free (buffer);
+  return (found) ? 0 : 1;
+}
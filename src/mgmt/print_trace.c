@@ -0,0 +1,156 @@
+/* print_trace.c: decode the packet trace records written by allnetd */
+/* command line:
+   allnet-print-trace [-t type] [-q] [file]
+     -t only prints records for the given message type (may be repeated)
+     -q only prints the summary, not the individual records
+   file defaults to ~/.allnet/log/packets.trace, and may be - for stdin.
+   see allnet_log.h for turning on packet tracing and the record format.
+   for each record, prints the time, process ID, decision, size, header
+   fields, source and destination addresses, and message ID prefix.
+   At the end, prints the number of records for each type and decision.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include "lib/packet.h"
+#include "lib/util.h"
+#include "lib/allnet_log.h"
+
+#define NUM_TYPES	(ALLNET_TYPE_MGMT + 1)
+
+static const char * decision_names [LOG_TRACE_DECISIONS] =
+  { "drop", "local", "out", "all", "invalid" };
+
+static const char * type_names [NUM_TYPES] =
+  { "type0", "data", "ack", "data_req", "key_xchg", "key_req", "clear",
+    "mgmt" };
+
+static void print_hex (const unsigned char * data, int nbits)
+{
+  int nbytes = (nbits + 7) / 8;
+  int i;
+  for (i = 0; i < ADDRESS_SIZE; i++) {
+    if (i < nbytes)
+      printf ("%02x", data [i]);
+    else
+      printf ("..");
+  }
+}
+
+static void print_record (const unsigned char * r)
+{
+  unsigned long long int us = readb64u (r + 8);
+  time_t unix_time =
+    (time_t) (us / ALLNET_US_PER_S + ALLNET_Y2K_SECONDS_IN_UNIX);
+  struct tm tm;
+  localtime_r (&unix_time, &tm);
+  char time_string [100];
+  strftime (time_string, sizeof (time_string), "%Y/%m/%d %H:%M:%S", &tm);
+  int decision = r [1];
+  int type = r [17];
+  printf ("%s.%06llu %5lu %-7s %4d ", time_string, us % ALLNET_US_PER_S,
+          readb32u (r + 4),
+          (decision < LOG_TRACE_DECISIONS) ? decision_names [decision] : "?",
+          readb16u (r + 2));
+  if (type < NUM_TYPES)
+    printf ("%-8s", type_names [type]);
+  else
+    printf ("type%-4d", type);
+  printf (" v%d hops %d/%d sig %d t %02x ", r [16], r [18], r [19], r [22],
+          r [23]);
+  print_hex (r + 24, r [20]);
+  printf (" -> ");
+  print_hex (r + 32, r [21]);
+  printf (" id ");
+  int i;
+  for (i = 40; i < LOG_TRACE_RECORD_SIZE; i++)
+    printf ("%02x", r [i]);
+  printf ("\n");
+}
+
+int main (int argc, char ** argv)
+{
+  unsigned int types = 0;   /* 0 means all types */
+  int quiet = 0;
+  const char * fname = NULL;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-t") == 0) && (i + 1 < argc)) {
+      int type = atoi (argv [++i]);
+      if ((type >= 0) && (type < 32))
+        types |= (1U << type);
+    } else if (strcmp (argv [i], "-q") == 0) {
+      quiet = 1;
+    } else if ((fname == NULL) &&
+               ((argv [i] [0] != '-') || (strcmp (argv [i], "-") == 0))) {
+      fname = argv [i];
+    } else {
+      printf ("usage: %s [-t type] [-q] [file]\n", argv [0]);
+      return 1;
+    }
+  }
+  char default_name [PATH_MAX];
+  if (fname == NULL) {
+    char * home = getenv ("HOME");
+    if (home == NULL)
+      snprintf (default_name, sizeof (default_name),
+                "/tmp/.allnet-log/packets.trace");
+    else
+      snprintf (default_name, sizeof (default_name),
+                "%s/.allnet/log/packets.trace", home);
+    fname = default_name;
+  }
+  FILE * f = stdin;
+  if (strcmp (fname, "-") != 0)
+    f = fopen (fname, "r");
+  if (f == NULL) {
+    perror ("fopen");
+    printf ("unable to open trace file %s\n", fname);
+    return 1;
+  }
+  unsigned long long int counts [NUM_TYPES + 1] [LOG_TRACE_DECISIONS];
+  memset (counts, 0, sizeof (counts));
+  unsigned long long int total = 0;
+  unsigned long long int skipped = 0;
+  unsigned char r [LOG_TRACE_RECORD_SIZE];
+  while (fread (r, 1, sizeof (r), f) == sizeof (r)) {
+    if ((r [0] != LOG_TRACE_FORMAT) || (r [1] >= LOG_TRACE_DECISIONS)) {
+      skipped++;
+      continue;
+    }
+    int type = r [17];
+    if ((types != 0) && ((type >= 32) || ((types & (1U << type)) == 0)))
+      continue;
+    if (! quiet)
+      print_record (r);
+    counts [(type < NUM_TYPES) ? type : NUM_TYPES] [r [1]]++;
+    total++;
+  }
+  if (f != stdin)
+    fclose (f);
+  printf ("%llu records", total);
+  if (skipped > 0)
+    printf (", %llu unknown records skipped", skipped);
+  printf ("\n%-8s", "");
+  int d;
+  for (d = 0; d < LOG_TRACE_DECISIONS; d++)
+    printf (" %10s", decision_names [d]);
+  printf ("\n");
+  int t;
+  for (t = 0; t <= NUM_TYPES; t++) {
+    unsigned long long int sum = 0;
+    for (d = 0; d < LOG_TRACE_DECISIONS; d++)
+      sum += counts [t] [d];
+    if (sum == 0)
+      continue;
+    printf ("%-8s", (t < NUM_TYPES) ? type_names [t] : "other");
+    for (d = 0; d < LOG_TRACE_DECISIONS; d++)
+      printf (" %10llu", counts [t] [d]);
+    printf ("\n");
+  }
+  return 0;
+}
@@ -1,9 +1,17 @@
 /* sniffer.c: show all incoming messages */
+/* with -c n, the messages are not printed, but instead the n most recent
+ * messages that pass the filter are kept in memory, and written in pcap
+ * format to the file given by -w (default allnet.pcap) on SIGUSR1 and
+ * on exit (SIGINT, or after number-of-messages).  -i sec prints the
+ * packet and byte rates and the count of each message type every sec. */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 #include "lib/app_util.h"
 #include "lib/packet.h"
@@ -239,6 +247,243 @@ static void main_loop (int debug, int max, int verify, int unique,
   }
 }
 
+/* capture filter, compiled from the command line options so that each
+ * packet only needs a few comparisons on its header */
+struct capture_filter {
+  int types;                    /* bit mask as for main_loop */
+  uint64_t src;                 /* prefix, left-aligned */
+  unsigned int src_bits;
+  uint64_t dst;
+  unsigned int dst_bits;
+  unsigned int min_hops;
+  unsigned int max_hops;
+  unsigned int min_size;
+  unsigned int max_size;
+};
+
+static uint64_t prefix_mask (unsigned int bits)
+{
+  if (bits == 0)
+    return 0;
+  if (bits >= 64)
+    return ~((uint64_t) 0);
+  return ~((uint64_t) 0) << (64 - bits);
+}
+
+/* an address with fewer bits than the filter matches if the bits it has
+ * match, as for matching_bits */
+static int capture_match (const struct capture_filter * f,
+                          const char * message, unsigned int msize)
+{
+  if ((msize < f->min_size) || (msize > f->max_size) ||
+      (msize < ALLNET_HEADER_SIZE))
+    return 0;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((hp->message_type <= MAX_PACKET_TYPE) &&
+      (! ((1 << hp->message_type) & f->types)))
+    return 0;
+  if ((hp->hops < f->min_hops) || (hp->hops > f->max_hops))
+    return 0;
+  if (f->src_bits > 0) {
+    unsigned int bits = (hp->src_nbits < f->src_bits) ? hp->src_nbits
+                                                      : f->src_bits;
+    if ((readb64u (hp->source) ^ f->src) & prefix_mask (bits))
+      return 0;
+  }
+  if (f->dst_bits > 0) {
+    unsigned int bits = (hp->dst_nbits < f->dst_bits) ? hp->dst_nbits
+                                                      : f->dst_bits;
+    if ((readb64u (hp->destination) ^ f->dst) & prefix_mask (bits))
+      return 0;
+  }
+  return 1;
+}
+
+/* the ring is allocated once, each slot holding one packet */
+struct capture_slot {
+  struct timeval time;
+  unsigned int size;
+  char packet [ALLNET_MTU];
+};
+
+struct capture_ring {
+  struct capture_slot * slots;
+  unsigned int num_slots;
+  unsigned int next;            /* slot for the next packet */
+  unsigned int used;
+};
+
+struct capture_counts {
+  unsigned long long int packets;
+  unsigned long long int bytes;
+  unsigned long long int types [MAX_PACKET_TYPE + 2];  /* last is other */
+  unsigned long long int filtered;
+};
+
+static volatile sig_atomic_t capture_dump_requested = 0;
+static volatile sig_atomic_t capture_exit_requested = 0;
+
+static void capture_signal (int sig)
+{
+  if (sig == SIGUSR1)
+    capture_dump_requested = 1;
+  else
+    capture_exit_requested = 1;
+}
+
+static void pcap_write32 (FILE * f, uint32_t value)
+{
+  fwrite (&value, sizeof (value), 1, f);   /* pcap uses the host order */
+}
+
+/* pcap file format, with the allnet packet as the link layer packet */
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_LINKTYPE_USER0	147
+static void capture_dump (struct capture_ring * ring, const char * fname)
+{
+  FILE * f = fopen (fname, "w");
+  if (f == NULL) {
+    perror ("fopen");
+    printf ("sniffer: unable to write capture file %s\n", fname);
+    return;
+  }
+  uint16_t version [2] = { 2, 4 };
+  pcap_write32 (f, PCAP_MAGIC);
+  fwrite (version, sizeof (version), 1, f);
+  pcap_write32 (f, 0);                  /* GMT offset */
+  pcap_write32 (f, 0);                  /* timestamp accuracy */
+  pcap_write32 (f, ALLNET_MTU);         /* snapshot length */
+  pcap_write32 (f, PCAP_LINKTYPE_USER0);
+  unsigned int first = (ring->next + ring->num_slots - ring->used) %
+                       ring->num_slots;
+  unsigned int i;
+  for (i = 0; i < ring->used; i++) {
+    struct capture_slot * slot = ring->slots + ((first + i) % ring->num_slots);
+    pcap_write32 (f, (uint32_t) slot->time.tv_sec);
+    pcap_write32 (f, (uint32_t) slot->time.tv_usec);
+    pcap_write32 (f, slot->size);
+    pcap_write32 (f, slot->size);
+    fwrite (slot->packet, 1, slot->size, f);
+  }
+  fclose (f);
+  printf ("sniffer: wrote %u packets to %s\n", ring->used, fname);
+}
+#undef PCAP_MAGIC
+#undef PCAP_LINKTYPE_USER0
+
+static const char * capture_type_names [MAX_PACKET_TYPE + 2] =
+  { "type0", "data", "ack", "data_req", "key_xchg", "key_req", "clear",
+    "mgmt", "other" };
+
+static void capture_print (struct capture_counts * now,
+                           struct capture_counts * before,
+                           unsigned long long int us)
+{
+  if (us == 0)
+    us = 1;
+  unsigned long long int packets = now->packets - before->packets;
+  unsigned long long int bytes = now->bytes - before->bytes;
+  char time_string [ALLNET_TIME_STRING_SIZE];
+  allnet_localtime_string (allnet_time (), time_string);
+  printf ("%s %llu packets (%llu pps), %llu bytes (%llu B/s), "
+          "%llu filtered:", hms (time_string), packets,
+          packets * ALLNET_US_PER_S / us, bytes,
+          bytes * ALLNET_US_PER_S / us, now->filtered - before->filtered);
+  int t;
+  for (t = 0; t < MAX_PACKET_TYPE + 2; t++) {
+    unsigned long long int n = now->types [t] - before->types [t];
+    if (n > 0)
+      printf (" %s %llu", capture_type_names [t], n);
+  }
+  printf ("\n");
+  *before = *now;
+}
+
+static void capture_loop (int max, int unique, unsigned int num_slots,
+                          const char * fname, int interval,
+                          struct capture_filter * filter)
+{
+  struct capture_ring ring;
+  ring.num_slots = num_slots;
+  ring.next = 0;
+  ring.used = 0;
+  ring.slots = malloc_or_fail (num_slots * sizeof (struct capture_slot),
+                               "sniffer capture ring");
+  struct capture_counts counts;
+  struct capture_counts printed;
+  memset (&counts, 0, sizeof (counts));
+  memset (&printed, 0, sizeof (printed));
+  struct sigaction siga;
+  memset (&siga, 0, sizeof (siga));
+  siga.sa_handler = &capture_signal;
+  sigemptyset (&(siga.sa_mask));
+  if ((sigaction (SIGUSR1, &siga, NULL) != 0) ||
+      (sigaction (SIGINT, &siga, NULL) != 0) ||
+      (sigaction (SIGTERM, &siga, NULL) != 0))
+    perror ("sigaction");  /* not fatal */
+  unsigned long long int last_print = allnet_time_us ();
+  unsigned long long int interval_us = interval * ALLNET_US_PER_S;
+  while (! capture_exit_requested) {
+    /* check the signal flags and the interval at least once a second */
+    int timeout = 1000;
+    if (interval > 0) {
+      unsigned long long int now = allnet_time_us ();
+      if (now >= last_print + interval_us) {
+        capture_print (&counts, &printed, now - last_print);
+        last_print = now;
+      }
+      unsigned long long int ms = (last_print + interval_us - now) / 1000;
+      if (ms < (unsigned long long int) timeout)
+        timeout = (int) ms + 1;
+    }
+    if (capture_dump_requested) {
+      capture_dump_requested = 0;
+      capture_dump (&ring, fname);
+    }
+    unsigned int pri;
+    char * message;
+    int found = local_receive (timeout, &message, &pri);
+    if (found < 0) {
+      printf ("packet sniffer pipe closed, exiting\n");
+      break;
+    }
+    if (found == 0)
+      continue;
+    if (((! unique) || (! received_before (message, found))) &&
+        (capture_match (filter, message, found))) {
+      struct capture_slot * slot = ring.slots + ring.next;
+      gettimeofday (&(slot->time), NULL);
+      slot->size = (found > ALLNET_MTU) ? ALLNET_MTU : found;
+      memcpy (slot->packet, message, slot->size);
+      ring.next = (ring.next + 1) % ring.num_slots;
+      if (ring.used < ring.num_slots)
+        ring.used++;
+      counts.packets++;
+      counts.bytes += found;
+      int type = ((struct allnet_header *) message)->message_type;
+      counts.types [(type <= MAX_PACKET_TYPE) ? type : MAX_PACKET_TYPE + 1]++;
+      if ((max > 0) && (counts.packets >= (unsigned int) max))
+        capture_exit_requested = 1;
+    } else {
+      counts.filtered++;
+    }
+    free (message);
+  }
+  if (interval > 0)
+    capture_print (&counts, &printed, allnet_time_us () - last_print);
+  capture_dump (&ring, fname);
+  free (ring.slots);
+}
+
+/* parses min-max, or just min */
+static void get_range (const char * arg, unsigned int * min, unsigned int * max)
+{
+  char * end = NULL;
+  *min = (unsigned int) strtoul (arg, &end, 10);
+  if ((end != NULL) && (*end == '-'))
+    *max = (unsigned int) strtoul (end + 1, NULL, 10);
+}
+
 #if 0
 static int debug_switch (int * argc, char ** argv)
 {
@@ -261,7 +506,8 @@ static int debug_switch (int * argc, char ** argv)
 static void usage (const char * command)
 {
   printf ("usage: %s [-v] [-d] [-y [-y]] [-u] [-f] [-t type]* "
-          " [-a destination address] [-s source] [number-of-messages]\n",
+          " [-a destination address] [-s source] [-c n [-w file] [-i sec]"
+          " [-h hops] [-z size]] [number-of-messages]\n",
           command);
   printf ("       -v: verbose, -d: debug, -y: verify, -y -y: verified only\n");
   printf ("       -u: unique only\n");
@@ -269,6 +515,11 @@ static void usage (const char * command)
   printf ("       -a x, -s x: only show messages with source/dest x\n");
   printf ("       -t n: only show messages of type n -- may be repeated\n");
   printf ("       (repeating the SAME type, toggles it)\n");
+  printf ("       -c n: capture the last n messages, do not print them\n");
+  printf ("       -w file: file for the capture (default allnet.pcap)\n");
+  printf ("       -i sec: print capture counters every sec seconds\n");
+  printf ("       -h min[-max], -z min[-max]: only capture messages with\n");
+  printf ("          these hop counts or sizes\n");
   exit (1);
 }
 
@@ -300,8 +551,20 @@ int main (int argc, char ** argv)
   unsigned int dst_bits = 0;
   unsigned int src_bits = 0;
   char * end = NULL;
-  while ((opt = getopt (argc, argv, "vdyufa:s:t:")) != -1) {
+  unsigned int capture = 0;
+  char * capture_file = "allnet.pcap";
+  int interval = 0;
+  struct capture_filter filter;
+  memset (&filter, 0, sizeof (filter));
+  filter.max_hops = 255;
+  filter.max_size = ALLNET_MTU;
+  while ((opt = getopt (argc, argv, "vdyufa:s:t:c:w:i:h:z:")) != -1) {
     switch (opt) {
+    case 'c': capture = (unsigned int) atoi (optarg); break;
+    case 'w': capture_file = optarg; break;
+    case 'i': interval = atoi (optarg); break;
+    case 'h': get_range (optarg, &filter.min_hops, &filter.max_hops); break;
+    case 'z': get_range (optarg, &filter.min_size, &filter.max_size); break;
     case 'd': debug = 1; break;
     case 'v': verbose = 1; break;
     case 'y': verify += 1; break;
@@ -364,6 +627,15 @@ int main (int argc, char ** argv)
   if (argc > optind)
     max = atoi (argv [optind]);
 
+  if (capture > 0) {
+    filter.types = types;
+    filter.src = readb64u (src);
+    filter.src_bits = src_bits;
+    filter.dst = readb64u (dst);
+    filter.dst_bits = dst_bits;
+    capture_loop (max, unique, capture, capture_file, interval, &filter);
+    return 0;
+  }
   main_loop (debug, max, verify, unique, types, subtypes, full_payloads,
              src, src_bits, dst, dst_bits);
   return 0;
@@ -0,0 +1,275 @@
+/* stats.c: ask allnetd for its per-stage timing statistics and its
+ * packet counters, and print them */
+/* command line:
+   allnet-stats [-t ms] [-i seconds]
+     -t gives the number of milliseconds to wait for each reply
+        (default 2000)
+     -i asks twice, the given number of seconds apart, and prints the
+        packet rates per second over that interval rather than the totals
+   for each stage of allnetd's packet handling, prints the number of
+   times measured, and the 50th and 99th percentiles and maximum, in
+   microseconds.  Percentiles are the upper bounds of log2 buckets.
+   Then for each message type and class of socket that has seen any
+   packets, prints the packets received, bytes received, and the packets
+   forwarded, dropped as duplicates, invalid, dropped by rate limits, and
+   cached.  The counters are described in lib/mgmt.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/packet.h"
+#include "lib/mgmt.h"
+#include "lib/util.h"
+#include "lib/app_util.h"
+#include "lib/priority.h"
+
+#define NUM_COUNTS	\
+  (ALLNET_COUNT_TYPES * ALLNET_COUNT_CLASSES * ALLNET_COUNT_COUNTERS)
+
+static const char * type_names [ALLNET_COUNT_TYPES] =
+  { "type0", "data", "ack", "data_req", "key_xchg", "key_req", "clear",
+    "mgmt", "other" };
+
+static const char * class_names [ALLNET_COUNT_CLASSES] =
+  { "local", "ipv4", "ipv6", "bcast", "tcp", "shard" };
+
+static const char * counter_names [ALLNET_COUNT_COUNTERS] =
+  { "received", "bytes", "forwarded", "duplicate", "invalid", "throttled",
+    "cached" };
+
+struct counters {
+  unsigned long long int uptime_ms;
+  unsigned long long int counts [NUM_COUNTS];
+};
+
+/* the upper bound of the bucket holding the given fraction of the count */
+static unsigned long long int percentile (const struct allnet_mgmt_stats_stage
+                                          * sp, unsigned long long int count,
+                                          int percent)
+{
+  unsigned long long int wanted = (count * percent + 99) / 100;
+  unsigned long long int sum = 0;
+  int b;
+  for (b = 0; b < ALLNET_STATS_BUCKETS; b++) {
+    sum += readb64u (sp->buckets [b]);
+    if ((sum >= wanted) && (sum > 0))
+      return ((b == 0) ? 0 : ((1ULL << b) - 1));
+  }
+  return readb64u (sp->max_us);
+}
+
+static void print_stats (const struct allnet_mgmt_stats_reply * reply)
+{
+  int n = reply->num_stages;
+  printf ("%-16s %12s %10s %10s %12s\n", "stage", "count",
+          "p50 (us)", "p99 (us)", "max (us)");
+  int i;
+  for (i = 0; i < n; i++) {
+    const struct allnet_mgmt_stats_stage * sp = reply->stages + i;
+    char name [ALLNET_STATS_NAME_SIZE + 1];
+    memcpy (name, sp->name, ALLNET_STATS_NAME_SIZE);
+    name [ALLNET_STATS_NAME_SIZE] = '\0';
+    unsigned long long int count = readb64u (sp->count);
+    if (count == 0) {
+      printf ("%-16s %12d %10s %10s %12s\n", name, 0, "-", "-", "-");
+      continue;
+    }
+    printf ("%-16s %12llu %10llu %10llu %12llu\n", name, count,
+            percentile (sp, count, 50), percentile (sp, count, 99),
+            readb64u (sp->max_us));
+  }
+}
+
+/* fills in the counters from a stats reply */
+static void get_counts (const struct allnet_mgmt_stats_reply * reply,
+                        struct counters * result)
+{
+  const unsigned char * counts = ALLNET_STATS_COUNTS (reply);
+  int types = reply->num_types;
+  int classes = reply->num_classes;
+  int counters = reply->num_counters;
+  memset (result, 0, sizeof (struct counters));
+  result->uptime_ms = readb64u (reply->uptime_ms);
+  /* only use the counters this version knows about */
+  int t, c, n;
+  for (t = 0; t < types; t++) {
+    /* unknown types are counted in the last type */
+    int rt = ((t < types - 1) && (t < ALLNET_COUNT_TYPES - 1)) ? t
+                                              : ALLNET_COUNT_TYPES - 1;
+    for (c = 0; (c < classes) && (c < ALLNET_COUNT_CLASSES); c++) {
+      for (n = 0; (n < counters) && (n < ALLNET_COUNT_COUNTERS); n++) {
+        int index = (t * classes + c) * counters + n;
+        int rindex = (rt * ALLNET_COUNT_CLASSES + c) * ALLNET_COUNT_COUNTERS
+                   + n;
+        result->counts [rindex] += readb64u (counts + 8 * index);
+      }
+    }
+  }
+}
+
+/* if first is not NULL, prints the rates since first */
+static void print_counters (const struct counters * first,
+                            const struct counters * last)
+{
+  double seconds = 1.0;
+  if (first != NULL) {
+    seconds = (last->uptime_ms - first->uptime_ms) / 1000.0;
+    if (seconds <= 0)
+      seconds = 1.0;
+    printf ("packet rates per second over %.1fs\n", seconds);
+  } else {
+    printf ("packet totals over %llus\n", last->uptime_ms / 1000);
+  }
+  printf ("%-8s %-5s", "type", "class");
+  int n;
+  for (n = 0; n < ALLNET_COUNT_COUNTERS; n++)
+    printf (" %10s", counter_names [n]);
+  printf ("\n");
+  int t, c;
+  for (t = 0; t < ALLNET_COUNT_TYPES; t++) {
+    for (c = 0; c < ALLNET_COUNT_CLASSES; c++) {
+      int base = (t * ALLNET_COUNT_CLASSES + c) * ALLNET_COUNT_COUNTERS;
+      unsigned long long int sum = 0;
+      for (n = 0; n < ALLNET_COUNT_COUNTERS; n++)
+        sum += last->counts [base + n];
+      if (sum == 0)
+        continue;
+      printf ("%-8s %-5s", type_names [t], class_names [c]);
+      for (n = 0; n < ALLNET_COUNT_COUNTERS; n++) {
+        unsigned long long int v = last->counts [base + n];
+        if (first == NULL)
+          printf (" %10llu", v);
+        else
+          printf (" %10.1f", (v - first->counts [base + n]) / seconds);
+      }
+      printf ("\n");
+    }
+  }
+}
+
+static int is_stats_reply (const char * message, int msize,
+                           const unsigned char * request_id)
+{
+  if (msize < ALLNET_HEADER_SIZE)
+    return 0;
+  const struct allnet_header * hp = (const struct allnet_header *) message;
+  if ((hp->message_type != ALLNET_TYPE_MGMT) ||
+      (msize < ALLNET_MGMT_HEADER_SIZE (hp->transport) +
+               sizeof (struct allnet_mgmt_stats_reply)))
+    return 0;
+  const struct allnet_mgmt_header * mp =
+    (const struct allnet_mgmt_header *) (message + ALLNET_SIZE (hp->transport));
+  if (mp->mgmt_type != ALLNET_MGMT_STATS_REPLY)
+    return 0;
+  const struct allnet_mgmt_stats_reply * reply =
+    (const struct allnet_mgmt_stats_reply *)
+      (message + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  if (memcmp (reply->request_id, request_id, sizeof (reply->request_id)) != 0)
+    return 0;
+  int needed = (int) (((const char *) (reply->stages)) - message) +
+               reply->num_stages * (int) sizeof (struct allnet_mgmt_stats_stage)
+               + reply->num_types * reply->num_classes * reply->num_counters * 8;
+  if (msize < needed) {
+    printf ("stats reply has %d bytes, needs %d\n", msize, needed);
+    return 0;
+  }
+  return 1;
+}
+
+/* returns the stats reply message (to be freed), or NULL */
+static char * get_stats (int timeout)
+{
+  unsigned int data_size = sizeof (struct allnet_mgmt_header) +
+                           sizeof (struct allnet_mgmt_stats_req);
+  unsigned int total = 0;
+  struct allnet_header * hp =
+    create_pool_packet (data_size, ALLNET_TYPE_MGMT, 1, ALLNET_SIGTYPE_NONE,
+                        NULL, 0, NULL, 0, NULL, NULL, &total);
+  if (hp == NULL) {
+    printf ("unable to create stats request\n");
+    return NULL;
+  }
+  hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+  char * buffer = (char *) hp;
+  struct allnet_mgmt_header * mp =
+    (struct allnet_mgmt_header *) (buffer + ALLNET_SIZE (hp->transport));
+  mp->mgmt_type = ALLNET_MGMT_STATS_REQ;
+  struct allnet_mgmt_stats_req * req =
+    (struct allnet_mgmt_stats_req *)
+      (buffer + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+  random_bytes ((char *) (req->request_id), sizeof (req->request_id));
+  if (! local_send (buffer, total, ALLNET_PRIORITY_LOCAL)) {
+    printf ("unable to send %d-byte stats request\n", total);
+    allnet_packet_free (buffer);
+    return NULL;
+  }
+  unsigned long long int finish = allnet_time_ms () + timeout;
+  unsigned long long int now;
+  while ((now = allnet_time_ms ()) < finish) {
+    char * received = NULL;
+    unsigned int priority = 0;
+    int r = local_receive ((int) (finish - now), &received, &priority);
+    if ((r <= 0) || (received == NULL))
+      break;
+    if (is_stats_reply (received, r, req->request_id)) {
+      allnet_packet_free (buffer);
+      return received;
+    }
+    free (received);
+  }
+  printf ("no reply from allnetd within %dms\n", timeout);
+  allnet_packet_free (buffer);
+  return NULL;
+}
+
+static const struct allnet_mgmt_stats_reply * stats_reply (const char * msg)
+{
+  const struct allnet_header * hp = (const struct allnet_header *) msg;
+  return (const struct allnet_mgmt_stats_reply *)
+           (msg + ALLNET_MGMT_HEADER_SIZE (hp->transport));
+}
+
+int main (int argc, char ** argv)
+{
+  int timeout = 2000;
+  int interval = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-t") == 0) && (i + 1 < argc)) {
+      timeout = atoi (argv [++i]);
+    } else if ((strcmp (argv [i], "-i") == 0) && (i + 1 < argc)) {
+      interval = atoi (argv [++i]);
+    } else {
+      printf ("usage: %s [-t ms] [-i seconds]\n", argv [0]);
+      return 1;
+    }
+  }
+  int sock = connect_to_local (argv [0], argv [0], NULL, 1, 1);
+  if (sock < 0)
+    return 1;
+  static struct counters first;
+  static struct counters last;
+  char * reply = get_stats (timeout);
+  if (reply == NULL)
+    return 1;
+  get_counts (stats_reply (reply), &first);
+  if (interval > 0) {
+    free (reply);
+    sleep (interval);
+    reply = get_stats (timeout);
+    if (reply == NULL)
+      return 1;
+    get_counts (stats_reply (reply), &last);
+  }
+  print_stats (stats_reply (reply));
+  printf ("\n");
+  if (interval > 0)
+    print_counters (&first, &last);
+  else
+    print_counters (NULL, &first);
+  free (reply);
+  return 0;
+}
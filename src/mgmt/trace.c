@@ -19,6 +19,12 @@
            -h hops gives the maximum number of hops (default 10)
            -l minimum (least) hops (default 0) -- -l 1 to not print self
            -c disallow caching (turn on Do Not Cache flag in trace messages)
+           -p n sends traces in parallel, with up to n waiting for replies,
+              and at the end prints statistics for each destination and hop
+           -o csv or -o json selects the format of the statistics
+              (default csv), and implies -p 64 unless -p is given
+           with -p or -o, -r n sends n traces to each address, and -t sec
+              is how long each trace waits for replies
  */
 
 #include <stdio.h>
@@ -110,6 +116,8 @@ static void trace_usage (char * pname)
   printf ("       -h hops gives the maximum number of hops (default 10)\n");
   printf ("       -l minimum (least) hops, so -l 1 to not print self\n");
   printf ("       -c disallow caching of trace messages\n");
+  printf ("       -p n traces in parallel, up to n outstanding at once\n");
+  printf ("       -o csv|json, format for parallel trace statistics\n");
 }
 
 static int atoi_in_range (char * value, int min, int max, int dflt, char * name)
@@ -142,7 +150,9 @@ int trace_main (int argc, char ** argv)
   int nhops = 10;
   int minhops = 0;
   int caching = 1;
-  char * opt_string = "cfimvh:l:r:t:";
+  int parallel = 0;
+  int format = 0;
+  char * opt_string = "cfimvh:l:o:p:r:t:";
   while ((opt = getopt (argc, argv, opt_string)) != -1) {
     switch (opt) {
     case 'm': match_only = 1; break;
@@ -154,12 +164,31 @@ int trace_main (int argc, char ** argv)
     case 'h': nhops = atoi_in_range (optarg, 1, 255, nhops, "hops"); break;
     case 'l': minhops = atoi_in_range (optarg, 0, nhops, 0, "min hops"); break;
     case 'c': caching = 0; break;
+    case 'p': parallel = atoi_in_range (optarg, 1, 0, 64, "parallel"); break;
+    case 'o':
+      if (strcmp (optarg, "csv") == 0) {
+        format = TRACE_OUTPUT_CSV;
+      } else if (strcmp (optarg, "json") == 0) {
+        format = TRACE_OUTPUT_JSON;
+      } else {
+        trace_usage (argv [0]);
+        exit (1);
+      }
+      break;
     default:
       trace_usage (argv [0]);
       exit (1);
     }
   }
   log_to_output (verbose);
+  if ((format != 0) && (parallel == 0))
+    parallel = 64;
+  if (format == 0)
+    format = TRACE_OUTPUT_CSV;
+  if ((parallel > 0) && (repeat == 0)) {
+    printf ("%s: -f cannot be used with parallel traces\n", argv [0]);
+    return 1;
+  }
 
 #if 0
   /* up to two non-option arguments */
@@ -241,6 +270,14 @@ int trace_main (int argc, char ** argv)
     if (n > 0)
       nhops = n;
   }
+  if (parallel > 0) {
+    if (num_addrs == 0)   /* trace 00/0 */
+      num_addrs = 1;
+    do_trace_parallel (sock, num_addrs, addresses, abits, repeat, parallel,
+                       sleep, nhops, ! no_intermediates, caching, format,
+                       STDOUT_FILENO, alog);
+    return 0;
+  }
   do_trace_loop (sock, num_addrs, addresses, abits, num_x, excluded, xbits,
                  repeat, sleep, minhops, nhops, match_only, no_intermediates,
                  caching, 1, 0, STDOUT_FILENO, 0, alog);
@@ -1,4 +1,7 @@
 /* print the contents of the caches */
+/* allnet-print-caches summary (or json) prints occupancy, age, and token
+ * statistics from a single read-only pass over the files, without
+ * loading the caches, so it may be used on a busy relay */
 
 #include <stdio.h>
 
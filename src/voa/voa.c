@@ -25,6 +25,7 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
 #include <gst/app/gstappsink.h>
+#include <pthread.h>
 #include <signal.h>       /* sigaction, sig_atomic_t */
 #include <stdlib.h>       /* atoi */
 #include <string.h>       /* memcmp, memcpy */
@@ -51,6 +52,15 @@
 static int loss_pct = 0;
 #endif /* SIMULATE_LOSS */
 
+/* largest allnet packet the sender creates by aggregating frames, may be
+ * changed with -m */
+#ifndef VOA_PATH_MTU
+#define VOA_PATH_MTU		1024
+#endif /* VOA_PATH_MTU */
+#define VOA_MAX_FRAMES_PER_PACKET	6
+/* round trip time assumed when not waiting for the stream to be accepted */
+#define VOA_DEFAULT_RTT_MS	200
+
 typedef struct _DecoderData {
   GstElement * voa_source; /* Voice-over-allnet source */
 #ifdef RTP
@@ -85,6 +95,8 @@ typedef struct _VOAData {
   unsigned char dest_address [ADDRESS_SIZE];
   unsigned char stream_id [STREAM_ID_SIZE];
   unsigned long media_type;
+  int frames_per_packet;   /* encoder, for ALLNET_MEDIA_AUDIO_OPUS_FRAMES */
+  int path_mtu;            /* encoder, largest packet to send */
   const char * dest_contact;
   struct allnet_stream_encryption_state enc_state;
   union {
@@ -113,6 +125,9 @@ static void init_data ()
   data.dest_contact = NULL;
   data.my_addr_bits = 0;
   data.dest_addr_bits = 0;
+  data.media_type = ALLNET_MEDIA_AUDIO_OPUS;
+  data.frames_per_packet = 1;
+  data.path_mtu = VOA_PATH_MTU;
   /* set any unused address parts to all zeros */
   memset (data.my_address, 0, ADDRESS_SIZE);
   memset (data.dest_address, 0, ADDRESS_SIZE);
@@ -135,6 +150,10 @@ static int dec_handle_data (const char * buf, int bufsize)
 #endif /* DEBUG */
   if (bufsize == 0)
     return 1;
+#ifdef DEBUG
+  if (buf[0] != 0x08) /* Narrow band 20ms mono VBR opus frame */
+    printf ("voa: unexpected frame header %02x\n", (unsigned char)buf[0]);
+#endif /* DEBUG */
 
   GstBuffer * gstbuf = gst_buffer_new_wrapped (buffer, bufsize);
 
@@ -163,6 +182,260 @@ static int dec_handle_data (const char * buf, int bufsize)
   return 1;
 }
 
+/* the receiver keeps stream packets in a jitter buffer and plays them in
+ * the order of their position in the stream.  A packet that is missing
+ * is waited for as long as the playout delay, which follows the jitter
+ * measured on arriving packets.  After that the packet is counted as
+ * lost and the decoder conceals it.  Either way, playout then continues
+ * with the next packet that did arrive. */
+#ifndef VOA_JITTER_SLOTS
+#define VOA_JITTER_SLOTS	32	/* most packets held at one time */
+#endif /* VOA_JITTER_SLOTS */
+#define VOA_FRAME_MS		20	/* length of each opus frame */
+#define VOA_JITTER_MIN_MS	20	/* shortest allowed playout delay */
+#define VOA_JITTER_MAX_MS	300	/* longest allowed playout delay */
+#define VOA_MAX_CONCEAL_FRAMES	10	/* most frames concealed for one gap */
+#define VOA_STATS_INTERVAL	10	/* seconds between statistics */
+
+/**
+ * Have the decoder conceal missing audio
+ * opusdec treats an empty buffer as a lost frame of the buffer's duration
+ * @param frames number of frames to conceal
+ * @return 1 on success, 0 on error
+ */
+static int dec_conceal (int frames)
+{
+  int i;
+  for (i = 0; i < frames; i++) {
+    GstBuffer * gstbuf = gst_buffer_new ();
+    GST_BUFFER_DURATION (gstbuf) = VOA_FRAME_MS * GST_MSECOND;
+    GstFlowReturn ret;
+    g_signal_emit_by_name (data.dec.voa_source, "push-buffer", gstbuf, &ret);
+    gst_buffer_unref (gstbuf);
+    if (ret != GST_FLOW_OK) {
+      fprintf (stderr, "error inserting concealment into gst pipeline\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct voa_jitter_packet {
+  uint64_t position;                /* stream position of the packet */
+  uint64_t end;                     /* stream position after the packet */
+  unsigned long long int arrival;   /* allnet_time_us () */
+  char * data;                      /* decrypted audio, or NULL if unused */
+  int size;
+};
+
+static struct voa_jitter_buffer {
+  struct voa_jitter_packet packets [VOA_JITTER_SLOTS];
+  int count;                        /* packets in the buffer */
+  int started;                      /* next is valid */
+  uint64_t next;                    /* position of the next packet to play */
+  uint64_t highest;                 /* highest end position received */
+  unsigned long long int last_arrival; /* of the last in-order packet */
+  unsigned long long int jitter_us; /* interarrival jitter, as in RFC 3550 */
+  unsigned long long int delay_us;  /* how long to wait for a missing packet */
+  int frames;                       /* frames in the last packet played */
+  uint64_t packet_units;            /* average stream units in a packet */
+  /* statistics */
+  unsigned long long int received;
+  unsigned long long int played;
+  unsigned long long int lost;
+  unsigned long long int late;
+  unsigned long long int duplicates;
+  unsigned long long int concealed; /* frames */
+  unsigned long long int held_us;   /* total waiting time of played packets */
+  unsigned long long int last_stats;
+} jitter;
+
+static void jitter_init ()
+{
+  memset (&jitter, 0, sizeof (jitter));
+  jitter.delay_us = 3 * VOA_FRAME_MS * 1000;
+  jitter.frames = 1;
+  jitter.last_stats = allnet_time_us ();
+}
+
+/* the number of opus frames in a decrypted packet */
+static int jitter_frames (const char * buf, int bufsize)
+{
+  if (data.media_type != ALLNET_MEDIA_AUDIO_OPUS_FRAMES)
+    return 1;
+  int frames = 0;
+  int offset = 0;
+  while (offset + ALLNET_VOA_FRAME_LENGTH_SIZE <= bufsize) {
+    offset += ALLNET_VOA_FRAME_LENGTH_SIZE + readb16 (buf + offset);
+    frames++;
+  }
+  return (frames > 0) ? frames : 1;
+}
+
+/**
+ * Play one packet from the jitter buffer, which may hold one or more frames
+ * @return 1 on success, 0 on error
+ */
+static int jitter_play (const char * buf, int bufsize)
+{
+  if (data.media_type != ALLNET_MEDIA_AUDIO_OPUS_FRAMES)
+    return dec_handle_data (buf, bufsize);
+  int offset = 0;
+  while (offset + ALLNET_VOA_FRAME_LENGTH_SIZE <= bufsize) {
+    int fsize = readb16 (buf + offset);
+    offset += ALLNET_VOA_FRAME_LENGTH_SIZE;
+    if (offset + fsize > bufsize) {
+      printf ("voa: frame of size %d exceeds packet size %d\n",
+              fsize, bufsize - offset);
+      return 1;
+    }
+    if (!dec_handle_data (buf + offset, fsize))
+      return 0;
+    offset += fsize;
+  }
+  return 1;
+}
+
+static void jitter_print_stats ()
+{
+  unsigned long long int mean_held_ms = 0;
+  if (jitter.played > 0)
+    mean_held_ms = jitter.held_us / jitter.played / 1000;
+  printf ("voa: %llu packets received, %llu played, %llu lost, %llu late, "
+          "%llu duplicate, %llu frames concealed, "
+          "jitter %llums, delay %llums, mean buffering %llums\n",
+          jitter.received, jitter.played, jitter.lost, jitter.late,
+          jitter.duplicates, jitter.concealed, jitter.jitter_us / 1000,
+          jitter.delay_us / 1000, mean_held_ms);
+}
+
+/**
+ * Play all the packets that are ready, in order.  At a gap, waits for the
+ * missing packet until the first packet after it has been held for
+ * jitter.delay_us, or the buffer is full.  If flush is set, plays
+ * everything without waiting.
+ * @return 1 on success, 0 on error
+ */
+static int jitter_release (unsigned long long int now, int flush)
+{
+  while (jitter.count > 0) {
+    int first = -1;
+    int i;
+    for (i = 0; i < VOA_JITTER_SLOTS; i++) {
+      if ((jitter.packets [i].data != NULL) &&
+          ((first < 0) ||
+           (jitter.packets [i].position < jitter.packets [first].position)))
+        first = i;
+    }
+    struct voa_jitter_packet * jp = jitter.packets + first;
+    if (jp->position > jitter.next) {
+      if ((! flush) && (jitter.count < VOA_JITTER_SLOTS) &&
+          (now < jp->arrival + jitter.delay_us))
+        return 1;   /* keep waiting for the missing packet */
+      /* give up on the missing packets and conceal them */
+      uint64_t missing = 1;
+      if (jitter.packet_units > 0)
+        missing = (jp->position - jitter.next + jitter.packet_units / 2) /
+                  jitter.packet_units;
+      if (missing < 1)
+        missing = 1;
+      jitter.lost += missing;
+      uint64_t frames = missing * jitter.frames;
+      if (frames > VOA_MAX_CONCEAL_FRAMES)
+        frames = VOA_MAX_CONCEAL_FRAMES;
+      if (!dec_conceal ((int) frames))
+        return 0;
+      jitter.concealed += frames;
+    }
+    int result = jitter_play (jp->data, jp->size);
+    jitter.played++;
+    jitter.held_us += now - jp->arrival;
+    jitter.frames = jitter_frames (jp->data, jp->size);
+    jitter.next = jp->end;
+    free (jp->data);
+    jp->data = NULL;
+    jitter.count--;
+    if (!result)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Add a decrypted packet to the jitter buffer, and play what is ready.
+ * @param position stream position of the packet
+ * @param end stream position after the packet
+ * @return 1 on success, 0 on error
+ */
+static int jitter_add (uint64_t position, uint64_t end,
+                       const char * buf, int bufsize)
+{
+  unsigned long long int now = allnet_time_us ();
+  jitter.received++;
+  if (! jitter.started) {
+    jitter.started = 1;
+    jitter.next = position;
+    jitter.highest = position;
+    jitter.last_arrival = now;
+  }
+  if (position < jitter.next) {  /* too late, or a duplicate of one played */
+    jitter.late++;
+    return 1;
+  }
+  int i;
+  for (i = 0; i < VOA_JITTER_SLOTS; i++) {
+    if ((jitter.packets [i].data != NULL) &&
+        (jitter.packets [i].position == position)) {
+      jitter.duplicates++;
+      return 1;
+    }
+  }
+  if (end > jitter.highest) {
+    /* interarrival jitter is the variation in the time between packets,
+     * compared to the time between sending them */
+    if (position == jitter.highest) {
+      unsigned long long int expected =
+        jitter_frames (buf, bufsize) * VOA_FRAME_MS * 1000ULL;
+      unsigned long long int delta = now - jitter.last_arrival;
+      unsigned long long int d =
+        (delta > expected) ? (delta - expected) : (expected - delta);
+      jitter.jitter_us = jitter.jitter_us + d / 16 - jitter.jitter_us / 16;
+      jitter.delay_us = VOA_FRAME_MS * 1000ULL + 3 * jitter.jitter_us;
+      if (jitter.delay_us < VOA_JITTER_MIN_MS * 1000ULL)
+        jitter.delay_us = VOA_JITTER_MIN_MS * 1000ULL;
+      if (jitter.delay_us > VOA_JITTER_MAX_MS * 1000ULL)
+        jitter.delay_us = VOA_JITTER_MAX_MS * 1000ULL;
+    }
+    if (jitter.packet_units == 0)
+      jitter.packet_units = end - position;
+    else
+      jitter.packet_units =
+        jitter.packet_units + (end - position) / 8 - jitter.packet_units / 8;
+    jitter.highest = end;
+    jitter.last_arrival = now;
+  }
+  if (jitter.count >= VOA_JITTER_SLOTS)  /* full, play the first packet */
+    if (!jitter_release (now, 0))
+      return 0;
+  for (i = 0; i < VOA_JITTER_SLOTS; i++) {
+    struct voa_jitter_packet * jp = jitter.packets + i;
+    if (jp->data == NULL) {
+      jp->position = position;
+      jp->end = end;
+      jp->arrival = now;
+      jp->data = memcpy_malloc (buf, bufsize, "voa jitter buffer");
+      jp->size = bufsize;
+      jitter.count++;
+      break;
+    }
+  }
+  if (now >= jitter.last_stats + VOA_STATS_INTERVAL * ALLNET_US_PER_S) {
+    jitter_print_stats ();
+    jitter.last_stats = now;
+  }
+  return jitter_release (now, 0);
+}
+
 static void get_key_for_contact (const char * contact,
                                  allnet_rsa_prvkey * prvkey,
                                  allnet_rsa_pubkey * pubkey)
@@ -357,7 +630,8 @@ static int accept_stream (const struct allnet_header * hp,
        mtp < ((const unsigned char *)(&avhhp->media_type + nmt));
        mtp += mtsize) {
     media_type = readb32u (mtp);
-    if (media_type == ALLNET_MEDIA_AUDIO_OPUS)
+    if ((media_type == ALLNET_MEDIA_AUDIO_OPUS_FRAMES) ||
+        (media_type == ALLNET_MEDIA_AUDIO_OPUS))
       goto accept_stream;
   }
   printf ("voa: Unsupported media type requested, can't accept stream\n");
@@ -375,6 +649,7 @@ accept_stream:
   printf ("\n");
 #endif /* DEBUG */
   data.dec.stream_id_set = 1;
+  jitter_init ();
   stream_cipher_init ((char *)avhhp->enc_key, (char *)avhhp->enc_secret, 0);
   memcpy (data.dest_address, hp->source, ADDRESS_SIZE);
   data.dest_addr_bits = hp->src_nbits;
@@ -484,7 +759,8 @@ static int check_voa_reply (const char * payload, int psize)
   }
   /* check for matching media type */
   int mt = readb32u ((const unsigned char *)&avhhp->media_type);
-  if (mt != ALLNET_MEDIA_AUDIO_OPUS) {
+  if ((mt != ALLNET_MEDIA_AUDIO_OPUS_FRAMES) &&
+      (mt != ALLNET_MEDIA_AUDIO_OPUS)) {
     printf ("voa: Unsupported media type requested, can't start streaming\n");
     return 0;
   }
@@ -604,9 +880,12 @@ static int handle_packet (const char * message, int msize, int reply_only,
   int encbufsize = msize - headersizes;
   int bufsize = encbufsize - ALLNET_VOA_HMAC_SIZE - ALLNET_VOA_COUNTER_SIZE;
   char buf [bufsize];
+  uint64_t position =
+    allnet_stream_packet_position (&data.enc_state, payload, encbufsize);
   if (!allnet_stream_decrypt_buffer (&data.enc_state, payload,
                                      encbufsize, buf, sizeof (buf)))
     return -1;
+  uint64_t end = allnet_stream_position (&data.enc_state);
 #if DEBUG > 1
   static int c=0;
   static int s=0;
@@ -619,15 +898,17 @@ static int handle_packet (const char * message, int msize, int reply_only,
     printf ("%02x ", *((const unsigned char *)buf+i));
   printf (".\n");
 #endif /* DEBUG */
-  if (strcmp (buf, ALLNET_VOA_EOS_BUF) == 0) {
+  if ((bufsize == sizeof (ALLNET_VOA_EOS_BUF)) &&
+      (memcmp (buf, ALLNET_VOA_EOS_BUF, bufsize) == 0)) {
+    /* packets still missing will not be played in time, play the rest */
+    jitter_release (allnet_time_us (), 1);
+    jitter_print_stats ();
     term = 1;
     return 1;
   }
-#ifdef DEBUG
-  if (buf[0] != 0x08) /* Narrow band 20ms mono VBR opus frame */
-    printf ("voa: unexpected frame header %02x\n", (unsigned char)buf[0]);
-#endif /* DEBUG */
-  if (!dec_handle_data (buf, bufsize))
+  if (bufsize <= 0)
+    return 0;
+  if (!jitter_add (position, end, buf, bufsize))
     return -1;
   return 1;
 }
@@ -645,7 +926,9 @@ static struct allnet_header * create_voa_hs_packet (const char * key,
                                                     const char * stream_id,
                                                     int * paksize)
 {
-  unsigned int num_media_types = 1;
+  /* in order of preference.  Receivers that do not know about several
+   * frames per packet accept ALLNET_MEDIA_AUDIO_OPUS */
+  unsigned int num_media_types = 2;
   unsigned int amhsize = sizeof (struct allnet_app_media_header);
   unsigned int avhhsize = sizeof (struct allnet_voa_hs_syn_header) +
                           ((num_media_types - 1) * ALLNET_MEDIA_ID_SIZE);
@@ -678,7 +961,9 @@ static struct allnet_header * create_voa_hs_packet (const char * key,
   memcpy (&avhhp->enc_secret, secret, ALLNET_STREAM_SECRET_SIZE);
   memcpy (&avhhp->stream_id, stream_id, STREAM_ID_SIZE);
   writeb16u ((unsigned char *)(&avhhp->num_media_types), num_media_types);
-  writeb32u ((unsigned char *)(&avhhp->media_type + 0), ALLNET_MEDIA_AUDIO_OPUS);
+  writeb32u ((unsigned char *)(&avhhp->media_type + 0),
+             ALLNET_MEDIA_AUDIO_OPUS_FRAMES);
+  writeb32u ((unsigned char *)(&avhhp->media_type + 1), ALLNET_MEDIA_AUDIO_OPUS);
 
   /* encrypt payload */
   char * encbuf;
@@ -801,9 +1086,104 @@ static int send_voa_request (struct allnet_log * alog)
   return 1;
 }
 
+/* the sender computes the keystream for the stream cipher ahead of time,
+ * in a separate thread, so encrypting each packet is just an xor (and
+ * the hmac).  The thread encrypts with its own copy of the stream state,
+ * which stays ahead of data.enc_state by the keystream in the buffer */
+#ifndef VOA_KEYSTREAM_SIZE
+#define VOA_KEYSTREAM_SIZE	16384   /* bytes of keystream computed ahead */
+#endif /* VOA_KEYSTREAM_SIZE */
+#define VOA_KEYSTREAM_CHUNK	1024    /* bytes computed at a time */
+
+static struct voa_keystream {
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;   /* signaled when bytes are added or used */
+  struct allnet_stream_encryption_state state;  /* used by the thread */
+  char bytes [VOA_KEYSTREAM_SIZE];
+  int first;                /* index of the first byte not yet used */
+  int count;                /* number of bytes not yet used */
+  int running;
+  pthread_t thread;
+} keystream = { .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .changed = PTHREAD_COND_INITIALIZER };
+
+static void * keystream_thread (void * arg)
+{
+  char chunk [VOA_KEYSTREAM_CHUNK];
+  pthread_mutex_lock (&keystream.mutex);
+  while (keystream.running) {
+    if (keystream.count + VOA_KEYSTREAM_CHUNK > VOA_KEYSTREAM_SIZE) {
+      pthread_cond_wait (&keystream.changed, &keystream.mutex);
+      continue;
+    }
+    pthread_mutex_unlock (&keystream.mutex);
+    /* only this thread uses keystream.state */
+    allnet_stream_keystream (&keystream.state, chunk, sizeof (chunk));
+    pthread_mutex_lock (&keystream.mutex);
+    int i;
+    for (i = 0; i < VOA_KEYSTREAM_CHUNK; i++)
+      keystream.bytes [(keystream.first + keystream.count + i) %
+                       VOA_KEYSTREAM_SIZE] = chunk [i];
+    keystream.count += VOA_KEYSTREAM_CHUNK;
+    pthread_cond_broadcast (&keystream.changed);
+  }
+  pthread_mutex_unlock (&keystream.mutex);
+  return NULL;
+}
+
+/* start computing keystream for data.enc_state, which must not have been
+ * used for encrypting yet */
+static void keystream_start ()
+{
+  keystream.state = data.enc_state;
+  keystream.first = 0;
+  keystream.count = 0;
+  keystream.running = 1;
+  if (pthread_create (&keystream.thread, NULL, keystream_thread, NULL) != 0) {
+    perror ("voa: pthread_create keystream");
+    keystream.running = 0;
+  }
+}
+
+static void keystream_stop ()
+{
+  if (! keystream.running)
+    return;
+  pthread_mutex_lock (&keystream.mutex);
+  keystream.running = 0;
+  pthread_cond_broadcast (&keystream.changed);
+  pthread_mutex_unlock (&keystream.mutex);
+  pthread_join (keystream.thread, NULL);
+}
+
+/* copy the next size bytes of keystream to result, waiting for the
+ * thread if it has not computed them yet */
+static void keystream_take (char * result, int size)
+{
+  pthread_mutex_lock (&keystream.mutex);
+  while (size > 0) {
+    while (keystream.count == 0)
+      pthread_cond_wait (&keystream.changed, &keystream.mutex);
+    int n = keystream.count;
+    if (n > size)
+      n = size;
+    if (n > VOA_KEYSTREAM_SIZE - keystream.first)  /* up to the wrap */
+      n = VOA_KEYSTREAM_SIZE - keystream.first;
+    memcpy (result, keystream.bytes + keystream.first, n);
+    keystream.first = (keystream.first + n) % VOA_KEYSTREAM_SIZE;
+    keystream.count -= n;
+    result += n;
+    size -= n;
+    pthread_cond_broadcast (&keystream.changed);
+  }
+  pthread_mutex_unlock (&keystream.mutex);
+}
+
 /**
  * Creates a stream packet for an ongoing stream
- * The returned packet must be free'd by caller.
+ * The returned packet is in a static buffer, valid until the next call,
+ * and must not be free'd.  The header is only built for the first packet,
+ * since it is the same for all packets in the stream.
  * @param buf buffer to be sent (will be copied and encrypted)
  * @param buf bufsize size of buf
  * @param stream_id ptr to STREAM_ID_SIZE bytes
@@ -813,18 +1193,29 @@ static struct allnet_header * create_voa_stream_packet (
               const unsigned char * buf, int bufsize,
               const unsigned char * stream_id, int * paksize)
 {
-  unsigned int sigsize = ALLNET_VOA_COUNTER_SIZE + ALLNET_VOA_HMAC_SIZE;
-  int psize = bufsize + sigsize;
-  struct allnet_header * pak = create_packet (psize,
+  static char packet [ALLNET_MTU];
+  static int hsize = 0;
+  if (hsize == 0) {
+    struct allnet_header * hp = init_packet (packet, sizeof (packet),
          ALLNET_TYPE_DATA, data.max_hops, ALLNET_SIGTYPE_NONE,
          data.my_address, data.my_addr_bits,
-         data.dest_address, data.dest_addr_bits,
-         stream_id, NULL /*ack*/, paksize);
-  pak->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+         data.dest_address, data.dest_addr_bits, stream_id, NULL /*ack*/);
+    if (hp == NULL)
+      return NULL;
+    hp->transport |= ALLNET_TRANSPORT_DO_NOT_CACHE;
+    hsize = ALLNET_SIZE_HEADER (hp);
+  }
+  struct allnet_header * pak = (struct allnet_header *) packet;
+  unsigned int sigsize = ALLNET_VOA_COUNTER_SIZE + ALLNET_VOA_HMAC_SIZE;
+  int psize = bufsize + sigsize;
+  if (hsize + psize > (int) sizeof (packet)) {
+    fprintf (stderr, "voa: %d-byte buffer too large for a packet\n", bufsize);
+    return NULL;
+  }
+  *paksize = hsize + psize;
 
   /* fill data */
-  char * payload = (char *)pak + ALLNET_SIZE_HEADER (pak);
-  assert (psize == *paksize - (payload - (char *)pak));
+  char * payload = packet + hsize;
 
 #if DEBUG > 1
   printf ("raw audio (%db):\n", bufsize);
@@ -835,8 +1226,17 @@ static struct allnet_header * create_voa_stream_packet (
 #endif /* DEBUG */
 
   /* encrypt and copy into packet */
-  if (!allnet_stream_encrypt_buffer (&data.enc_state, (const char *)buf, bufsize, payload, psize))
+  if (keystream.running) {
+    char ks [bufsize];
+    keystream_take (ks, bufsize);
+    if (!allnet_stream_encrypt_keystream (&data.enc_state, ks,
+                                          (const char *)buf, bufsize,
+                                          payload, psize))
+      return NULL;
+  } else if (!allnet_stream_encrypt_buffer (&data.enc_state, (const char *)buf,
+                                            bufsize, payload, psize)) {
     return NULL;
+  }
 
 #if DEBUG > 2
   printf ("-\n");
@@ -906,12 +1306,72 @@ static void cb_message (GstBus * bus, GstMessage * msg, VOAData * data)
   }
 }
 
+/**
+ * Choose how many frames to send in each packet.  Each frame after the
+ * first adds VOA_FRAME_MS of delay, but saves the per-packet overhead.
+ * Up to a quarter of the round trip time is spent on this.
+ * @param rtt_us round trip time of the handshake, in microseconds
+ */
+static void set_frames_per_packet (unsigned long long int rtt_us)
+{
+  int frames = 1;
+  if (data.media_type == ALLNET_MEDIA_AUDIO_OPUS_FRAMES)
+    frames = 1 + (int) (rtt_us / 4 / (VOA_FRAME_MS * 1000ULL));
+  if (frames > VOA_MAX_FRAMES_PER_PACKET)
+    frames = VOA_MAX_FRAMES_PER_PACKET;
+  data.frames_per_packet = frames;
+  printf ("voa: round trip time %llums, sending %d frame%s per packet\n",
+          rtt_us / 1000, frames, (frames == 1) ? "" : "s");
+}
+
+/**
+ * Encrypt a buffer and send it as the next stream packet
+ * @return 1 on success, 0 if the packet could not be created
+ */
+static int send_stream_buffer (const unsigned char * buf, int bufsize,
+                               struct allnet_log * alog)
+{
+  int pak_size;
+  struct allnet_header * pak =
+    create_voa_stream_packet (buf, bufsize, data.stream_id, &pak_size);
+  if (pak == NULL)
+    return 0;
+#ifdef SIMULATE_LOSS
+  if (random () % 100 > loss_pct) {
+#endif /* SIMULATE_LOSS */
+  if (!send_pipe_message (data.allnet_socket, (const char *)pak,
+                          pak_size, ALLNET_PRIORITY_DEFAULT_HIGH, alog))
+    fprintf (stderr, "voa: error sending stream packet\n");
+#if DEBUG > 1
+  printf ("voa: size: %d (%d)\n", pak_size, bufsize);
+#endif /* DEBUG */
+#ifdef SIMULATE_LOSS
+#if DEBUG > 1
+  } else {
+    printf ("voa: loss simulation, packet dropped\n");
+#endif /* DEBUG */
+  }
+#endif /* SIMULATE_LOSS */
+  return 1;
+}
+
 /**
  * Main loop for the encoder after the stream has been initialized.
  * Terminates when global term is set. Sets term = -1 on error.
+ * With ALLNET_MEDIA_AUDIO_OPUS_FRAMES, collects up to data.frames_per_packet
+ * frames in each packet, as long as the packet fits in data.path_mtu
  */
 static void enc_main_loop (struct allnet_log * alog)
 {
+  int aggregate = (data.media_type == ALLNET_MEDIA_AUDIO_OPUS_FRAMES);
+  int max_size = data.path_mtu - ALLNET_SIZE (ALLNET_TRANSPORT_STREAM) -
+                 ALLNET_VOA_COUNTER_SIZE - ALLNET_VOA_HMAC_SIZE;
+  if (max_size > ALLNET_MTU)
+    max_size = ALLNET_MTU;
+  unsigned char frames [ALLNET_MTU];
+  int frames_size = 0;
+  int num_frames = 0;
+  keystream_start ();
   gst_element_set_state (data.pipeline, GST_STATE_PLAYING);
   /* poll samples (blocking) */
   GstAppSink * voa_sink = GST_APP_SINK (data.enc.voa_sink);
@@ -929,26 +1389,31 @@ static void enc_main_loop (struct allnet_log * alog)
       GstMapInfo info;
       if (!gst_buffer_map (buffer, &info, GST_MAP_READ))
         printf ("voa: error mapping buffer\n");
-      int pak_size;
-      struct allnet_header * pak = create_voa_stream_packet (info.data, info.size, data.stream_id, &pak_size);
-      if (pak) {
-#ifdef SIMULATE_LOSS
-        if (random () % 100 > loss_pct) {
-#endif /* SIMULATE_LOSS */
-        if (!send_pipe_message (data.allnet_socket, (const char *)pak,
-                                pak_size, ALLNET_PRIORITY_DEFAULT_HIGH, alog))
-          fprintf (stderr, "voa: error sending stream packet\n");
-#if DEBUG > 1
-        printf ("voa: size: %d (%lu)\n", pak_size, info.size);
-#endif /* DEBUG */
-#ifdef SIMULATE_LOSS
-#if DEBUG > 1
-        } else {
-          printf ("voa: loss simulation, packet dropped\n");
-#endif /* DEBUG */
-        }
-#endif /* SIMULATE_LOSS */
+      int ok = 1;
+      int fsize = ALLNET_VOA_FRAME_LENGTH_SIZE + info.size;
+      if (! aggregate) {
+        ok = send_stream_buffer (info.data, info.size, alog);
       } else {
+        /* send what we have if this frame does not fit */
+        if ((num_frames > 0) && (frames_size + fsize > max_size)) {
+          ok = send_stream_buffer (frames, frames_size, alog);
+          frames_size = 0;
+          num_frames = 0;
+        }
+        if (fsize <= (int) sizeof (frames)) {
+          writeb16 ((char *) (frames + frames_size), info.size);
+          memcpy (frames + frames_size + ALLNET_VOA_FRAME_LENGTH_SIZE,
+                  info.data, info.size);
+          frames_size += fsize;
+          num_frames++;
+        }
+        if (ok && (num_frames >= data.frames_per_packet)) {
+          ok = send_stream_buffer (frames, frames_size, alog);
+          frames_size = 0;
+          num_frames = 0;
+        }
+      }
+      if (! ok) {
         fprintf (stderr, "voa: failed to create packet\n");
         term = -1;
       }
@@ -959,6 +1424,8 @@ static void enc_main_loop (struct allnet_log * alog)
       printf ("NULL sample\n");
     }
   }
+  if ((num_frames > 0) && (!send_stream_buffer (frames, frames_size, alog)))
+    fprintf (stderr, "voa: failed to create packet\n");
   unsigned char eosbuf[] = ALLNET_VOA_EOS_BUF;
   int pak_size;
   struct allnet_header * pak = create_voa_stream_packet (eosbuf, sizeof (eosbuf), data.stream_id, &pak_size);
@@ -970,6 +1437,7 @@ static void enc_main_loop (struct allnet_log * alog)
                                  alog)) {
     fprintf (stderr, "voa: error sending EOS packet\n");
   }
+  keystream_stop ();
 }
 
 /**
@@ -1147,6 +1615,8 @@ static int init_audio (int is_encoder)
   /* Wait until error or EOS */
   data.bus = gst_element_get_bus (data.pipeline);
   g_signal_connect (data.bus, "message", G_CALLBACK (cb_message), &data);
+  /* before any streaming thread is started */
+  gst_bus_set_sync_handler (data.bus, sync_message, NULL, NULL);
 
   /* Start playing the pipeline */
   ret = gst_element_set_state (data.pipeline, GST_STATE_PAUSED);
@@ -1159,6 +1629,25 @@ static int init_audio (int is_encoder)
   return 1;
 }
 
+/**
+ * Sync handler on the gstreamer bus, called in the thread that posted the
+ * message.  Each streaming thread posts a stream-status message when it
+ * starts, so that is where its scheduling is set (see
+ * allnet_thread_config in lib/util.h)
+ */
+static GstBusSyncReply sync_message (GstBus * bus, GstMessage * msg,
+                                     gpointer user_data)
+{
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_STREAM_STATUS) {
+    GstStreamStatusType type;
+    GstElement * owner;
+    gst_message_parse_stream_status (msg, &type, &owner);
+    if (type == GST_STREAM_STATUS_TYPE_ENTER)
+      allnet_thread_config ("voa-audio");
+  }
+  return GST_BUS_PASS;
+}
+
 /** Cleanup function for audio system */
 static void cleanup_audio ()
 {
@@ -1187,16 +1676,21 @@ int allnet_global_debugging = 0;
 int main (int argc, char ** argv)
 {
   if (argc == 2 && strcmp (argv [1], "-h") == 0) {
-    printf ("usage: %s [-s [-f file] [-n]] [-c contact] [dest-addr [dest-bits]]\n"
+    printf ("usage: %s [-s [-f file] [-n] [-m bytes]] [-c contact] [dest-addr [dest-bits]]\n"
             "  -c ctc Encrypt stream for contact named \"ctc\".\n"
             "  -s     Send stream. Receives streams when _not_ set.\n"
 #ifdef SIMULATE_LOSS
             "  -l pct Simulate losing pct%% of data.\n"
 #endif /* SIMULATE_LOSS */
             "  -n     Start sending without waiting for stream acceptance.\n"
+            "  -m n   Send packets of at most n bytes (default %d).\n"
             "  -f uri Send pre-recorded audio instead of microphone recording.\n"
-            "         \"uri\" of type \"file:///absolute/path/to/file.ogg\"\n",
-            argv [0]);
+            "         \"uri\" of type \"file:///absolute/path/to/file.ogg\"\n"
+            "  the environment variables ALLNET_SCHED_VOA_AUDIO and\n"
+            "  ALLNET_SCHED_VOA_NET set the scheduling of the audio and\n"
+            "  network threads as [fifo|rr|other][:priority][@cpus],\n"
+            "  e.g. fifo:20@2,3\n",
+            argv [0], VOA_PATH_MTU);
     return 0;
   }
   struct allnet_log * alog = init_log ("voa (voice-over-allnet)");
@@ -1242,6 +1736,14 @@ int main (int argc, char ** argv)
         }
 
 #endif /* SIMULATE_LOSS */
+      } else if (strcmp (argv [a], "-m") == 0) {
+        /* encoder: largest packet to send */
+        if (++a < argc) {
+          data.path_mtu = atoi (argv [a]);
+          if (data.path_mtu > ALLNET_MTU)
+            data.path_mtu = ALLNET_MTU;
+        }
+
       } else if (strcmp (argv [a], "-n") == 0) {
         /* encoder: don't wait for acceptance response */
         nowait = 1;
@@ -1294,24 +1796,30 @@ int main (int argc, char ** argv)
 
   if (!init_audio (is_encoder))
     return 1;
+  /* this thread sends and receives the allnet packets */
+  allnet_thread_config ("voa-net");
 
   if (is_encoder) {
     random_bytes ((char *)data.stream_id, STREAM_ID_SIZE);
     int i = 0;
     if (nowait) {
       /* send stream without waiting for acceptance */
-      if (send_voa_request (alog))
+      if (send_voa_request (alog)) {
+        set_frames_per_packet (VOA_DEFAULT_RTT_MS * 1000ULL);
         enc_main_loop (alog);
+      }
 
     } else {
       /* retry 10x every 2s */
       do {
         printf (".");
         fflush (stdout);
+        unsigned long long int sent = allnet_time_us ();
         if (!send_voa_request (alog))
           break;
         if (voa_receive (p, 2000)) {
           printf ("\n");
+          set_frames_per_packet (allnet_time_us () - sent);
           enc_main_loop (alog);
           break;
         }
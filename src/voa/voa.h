@@ -14,6 +14,9 @@
 #define ALLNET_VOA_HMAC_SIZE 6
 #define ALLNET_VOA_COUNTER_SIZE 2
 #define ALLNET_VOA_NUM_MEDIA_TYPE_SIZE 2
+/* with ALLNET_MEDIA_AUDIO_OPUS_FRAMES, each stream packet holds one or more
+ * opus frames, each preceded by its length in this many bytes (big-endian) */
+#define ALLNET_VOA_FRAME_LENGTH_SIZE 2
 
 /**
  * Struct used when initiating a handshake
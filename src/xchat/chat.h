@@ -91,12 +91,17 @@ struct chat_control_request {
   unsigned char type;                   /* always CHAT_CONTROL_TYPE_REQUEST */
   unsigned char num_singles;
   unsigned char num_ranges;
-  unsigned char padding [5];   /* sent as zeros, ignored on receipt */
+  unsigned char features;      /* CHAT_FEATURE_*, 0 in older versions */
+  unsigned char padding [4];   /* sent as zeros, ignored on receipt */
   unsigned char last_received [COUNTER_SIZE];
   /* counters has COUNTER_SIZE * (num_singles + 2 * num_ranges) bytes */
   unsigned char counters  [0];
 };
 
+/* features supported by the sender of a chat control request */
+/* can receive ALLNET_MEDIA_TEXT_COMPRESSED, see lib/media.h */
+#define CHAT_FEATURE_COMPRESS	1
+
 /* a CHAT_CONTROL_TYPE_REKEY packet initiates or completes a new key exchange.
  * if I send a chat_control_rekey, I may start using the new key(s) once
  * I receive a chat_control_rekey from the other side.
@@ -15,6 +15,7 @@
 #include "lib/priority.h"
 #include "lib/keys.h"
 #include "lib/cipher.h"
+#include "lib/compress.h"
 #include "lib/allnet_log.h"
 #include "lib/app_util.h"
 #include "lib/routing.h"
@@ -22,6 +23,7 @@
 #include "cutil.h"
 #include "message.h"
 #include "store.h"
+#include "retransmit.h"
 
 /* strip most non-alphabetic characters, and convert the rest to uppercase */
 void normalize_secret (char * s)
@@ -125,6 +127,44 @@ int init_chat_descriptor (struct chat_descriptor * cp, const char * contact,
   return 1;
 }
 
+/* texts shorter than this are sent as they are */
+#ifndef CHAT_COMPRESS_MIN_SIZE
+#define CHAT_COMPRESS_MIN_SIZE	100
+#endif /* CHAT_COMPRESS_MIN_SIZE */
+
+/* if the keyset can receive compressed texts and this text compresses
+ * well enough to save at least a few bytes, returns a newly allocated
+ * ALLNET_MEDIA_TEXT_COMPRESSED copy of the data and sets *csize.
+ * Otherwise returns NULL, and the data should be sent as is */
+static char * compress_text (const char * contact, keyset k,
+                             const char * data, unsigned int dsize,
+                             unsigned int * csize)
+{
+  if (dsize < CHAT_DESCRIPTOR_SIZE + CHAT_COMPRESS_MIN_SIZE)
+    return NULL;
+  struct chat_descriptor * cp = (struct chat_descriptor *) data;
+  if ((readb32u (cp->app_media.media) != ALLNET_MEDIA_TEXT_PLAIN) ||
+      ((chat_features (contact, k) & CHAT_FEATURE_COMPRESS) == 0))
+    return NULL;
+  int hsize = CHAT_DESCRIPTOR_SIZE + ALLNET_MEDIA_COMPRESSED_SIZE;
+  int text_size = dsize - CHAT_DESCRIPTOR_SIZE;
+  /* compressed, it must be smaller by at least 1/16 of the text */
+  int max = dsize - hsize - text_size / 16;
+  char * result = malloc_or_fail (dsize, "compress_text");
+  int size = allnet_compress (data + CHAT_DESCRIPTOR_SIZE, text_size,
+                              result + hsize, max);
+  if (size <= 0) {   /* not compressible enough */
+    free (result);
+    return NULL;
+  }
+  memcpy (result, data, CHAT_DESCRIPTOR_SIZE);
+  cp = (struct chat_descriptor *) result;
+  writeb32u (cp->app_media.media, ALLNET_MEDIA_TEXT_COMPRESSED);
+  writeb32 (result + CHAT_DESCRIPTOR_SIZE, text_size);
+  *csize = hsize + size;
+  return result;
+}
+
 /* return 1 if the message was sent, or if the key was invalid (i.e. should
  * try the next key).
  * returns 0 if the encryption or transmission failed, and it would probably
@@ -187,6 +227,14 @@ static int send_to_one (keyset k, char * data, unsigned int dsize,
   if (do_ack && do_save)
     save_outgoing (contact, k, (struct chat_descriptor *) data,
                    data + CHAT_DESCRIPTOR_SIZE, dsize - CHAT_DESCRIPTOR_SIZE);
+  /* saved as plain text, but sent compressed if possible */
+  unsigned int compressed_size = 0;
+  char * compressed = compress_text (contact, k, data, dsize,
+                                     &compressed_size);
+  if (compressed != NULL) {
+    data = compressed;
+    dsize = compressed_size;
+  }
 
   /* encrypt */
   int priv_ksize = 0;
@@ -204,6 +252,7 @@ static int send_to_one (keyset k, char * data, unsigned int dsize,
     encrypted = malloc_or_fail (esize, "cutil.c send_to_one encrypted msg");
     esize = allnet_stream_encrypt_buffer (&sym_state, data, dsize,
                                           encrypted, esize);
+    if (compressed != NULL) free (compressed);
     save_key_state (contact, 1, &sym_state);
     sigtype = ALLNET_SIGTYPE_NONE;  /* the hash provides the authentication */
     sendsize = esize;
@@ -213,9 +262,11 @@ static int send_to_one (keyset k, char * data, unsigned int dsize,
     if ((priv_ksize == 0) || (ksize == 0)) {
       printf ("unable to locate key %d for contact %s (%d, %d)\n",
               k, contact, priv_ksize, ksize);
+      if (compressed != NULL) free (compressed);
       return 1;  /* skip to the next key */
     }
     esize = allnet_encrypt (data, dsize, key, &encrypted);
+    if (compressed != NULL) free (compressed);
     if (esize > 0) {
       /* sign */
       ssize = allnet_sign (encrypted, esize, priv_key, &signature);
@@ -591,8 +642,8 @@ int fill_bits (unsigned char * bitmap, int power_two, int selector)
   if (power_two > 3)
     bsize = 1 << (power_two - 3);
   memset (bitmap, 0, bsize);
-  char ** contacts = NULL;
-  int ncontacts = all_contacts (&contacts);
+  char ** contacts = NULL;   /* borrowed, do not free */
+  int ncontacts = borrow_contacts (&contacts);
   int icontact;
   for (icontact = 0; icontact < ncontacts; icontact++) {
     keyset * keysets = NULL;
@@ -676,8 +727,6 @@ contacts [icontact], keysets [ikeyset]);
     if ((nkeysets > 0) && (keysets != NULL))
       free (keysets);
   }
-  if ((ncontacts > 0) && (contacts != NULL))
-    free (contacts);
   if (selector == FILL_LOCAL_ADDRESS) {  /* add my local trace address */
     unsigned char addr [ADDRESS_SIZE];
     routing_my_address (addr);
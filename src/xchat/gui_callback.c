@@ -176,6 +176,7 @@ if (mlen != 0) printf ("handle_packet returned %d\n", mlen);
         free (desc);
     } else if (mlen == -1) {   /* confirm successful key exchange */
       gui_callback_created (GUI_CALLBACK_CONTACT_CREATED, peer, gui_sock);
+      gui_contacts_changed (gui_sock);
     } else if (mlen == -2) {   /* confirm successful subscription */
       gui_callback_created (GUI_CALLBACK_SUBSCRIPTION_COMPLETE, peer, gui_sock);
     } else if (mlen == -4) {   /* got a trace reply */
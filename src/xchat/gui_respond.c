@@ -12,12 +12,22 @@
 #include <unistd.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #ifdef WINDOWS_ENVIRONMENT
 #include <windows.h>
+struct iovec {     /* not defined on windows, used for gui_send_iov */
+  void * iov_base;
+  size_t iov_len;
+};
+#else /* WINDOWS_ENVIRONMENT */
+#include <sys/uio.h>
+#ifndef IOV_MAX   /* writev limit, 1024 on linux, the BSDs, and macOS */
+#define IOV_MAX		1024
+#endif /* IOV_MAX */
 #endif /* WINDOWS_ENVIRONMENT */
 
 #include "lib/packet.h"
@@ -30,56 +40,139 @@
 #include "cutil.h"
 #include "gui_socket.h"
 
+#ifdef WINDOWS_ENVIRONMENT   /* elsewhere, send_iov uses writev */
 static int send_bytes (int sock, char *buffer, int64_t length)
 {
-  while (length > 0) {   /* inefficient implementation for now */
-    if (write (sock, buffer, 1) != 1) {
+  while (length > 0) {
+    ssize_t sent = write (sock, buffer, length);
+    if ((sent < 0) && (errno == EINTR))
+      continue;
+    if (sent <= 0) {
       perror ("gui.c send_bytes");
       return 0;
     }
-    buffer++;
-    length--;
+    buffer += sent;
+    length -= sent;
   }
   return 1;              /* success */
 }
+#endif /* WINDOWS_ENVIRONMENT */
 
 static int receive_bytes (int sock, char *buffer, int64_t length)
 {
   while (length > 0) {
-    /* get one byte at a time -- for now, inefficient implementation */
-    if (read (sock, buffer, 1) != 1) {
-      if ((errno != ENOENT) &&      /* ENOENT when the socket is closed */
+    ssize_t rcvd = read (sock, buffer, length);
+    if ((rcvd < 0) && (errno == EINTR))
+      continue;
+    if (rcvd <= 0) {
+      if ((rcvd < 0) &&
+          (errno != ENOENT) &&      /* ENOENT when the socket is closed */
           (errno != ECONNRESET)) {  /* or ECONNRESET */
         perror ("gui_respond.c receive_bytes");
         printf ("errno %d on connection %d\n", errno, sock);
       }
       return 0;
     }
-    buffer++;
-    length--;
+    buffer += rcvd;
+    length -= rcvd;
   }
   return 1;              /* success */
 }
 
+/* sends all the bytes in iov, modifying iov.  returns 1 or 0 for failure */
+static int send_iov (int sock, struct iovec * iov, int niov)
+{
+#ifdef WINDOWS_ENVIRONMENT
+  int i;
+  for (i = 0; i < niov; i++)
+    if (! send_bytes (sock, iov [i].iov_base, iov [i].iov_len))
+      return 0;
+#else /* WINDOWS_ENVIRONMENT */
+  while (niov > 0) {
+    ssize_t sent = writev (sock, iov, ((niov > IOV_MAX) ? IOV_MAX : niov));
+    if ((sent < 0) && (errno == EINTR))
+      continue;
+    if (sent <= 0) {
+      perror ("gui.c send_iov");
+      return 0;
+    }
+    while ((niov > 0) && ((size_t) sent >= iov [0].iov_len)) {
+      sent -= iov [0].iov_len;
+      iov++;
+      niov--;
+    }
+    if (sent > 0) {   /* partial write of iov [0] */
+      iov [0].iov_base = ((char *) (iov [0].iov_base)) + sent;
+      iov [0].iov_len -= sent;
+    }
+  }
+#endif /* WINDOWS_ENVIRONMENT */
+  return 1;              /* success */
+}
+
 /* returns 1 for success or 0 for failure */
-/* also called from gui_callback.c, so the mutex is global */
-int gui_send_buffer (int sock, char *buffer, int64_t length)
+/* iov [0] is reserved for the length, and iov is modified */
+static int gui_send_iov (int sock, struct iovec * iov, int niov)
 {
+  int64_t length = 0;
+  int i;
+  for (i = 1; i < niov; i++)
+    length += iov [i].iov_len;
   if (length < 1)
     return 0;
   char length_buf [8];
   writeb64 (length_buf, length);
-  int result = 0;
+  iov [0].iov_base = length_buf;
+  iov [0].iov_len = sizeof (length_buf);
   /* use a mutex to ensure only one message is sent at a time */
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
   pthread_mutex_lock (&mutex);
-  if ((send_bytes (sock, length_buf, 8)) &&
-      (send_bytes (sock, buffer, length)))
-    result = 1;
+  int result = send_iov (sock, iov, niov);
   pthread_mutex_unlock (&mutex);
   return result;
 }
 
+/* returns 1 for success or 0 for failure */
+/* also called from gui_callback.c, so the mutex in gui_send_iov is global */
+int gui_send_buffer (int sock, char *buffer, int64_t length)
+{
+  struct iovec iov [2];
+  iov [1].iov_base = buffer;
+  iov [1].iov_len = length;
+  return gui_send_iov (sock, iov, 2);
+}
+
+/* requests received as GUI_REQUEST_ID are answered with the same id.
+ * each worker thread has its own, found with reply_id_key */
+struct reply_id {
+  int has_id;
+  char id [8];
+};
+static pthread_key_t reply_id_key;
+
+/* like gui_send_iov, but iov [1] is also reserved, for the request ID */
+static int gui_reply_iov (int sock, struct iovec * iov, int niov)
+{
+  char id_header [9];
+  struct reply_id * rid = pthread_getspecific (reply_id_key);
+  if ((rid == NULL) || (! rid->has_id))   /* skip iov [1] */
+    return gui_send_iov (sock, iov + 1, niov - 1);
+  id_header [0] = GUI_REQUEST_ID;
+  memcpy (id_header + 1, rid->id, sizeof (rid->id));
+  iov [1].iov_base = id_header;
+  iov [1].iov_len = sizeof (id_header);
+  return gui_send_iov (sock, iov, niov);
+}
+
+/* reply to the request from the GUI */
+static int gui_reply (int sock, char *buffer, int64_t length)
+{
+  struct iovec iov [3];
+  iov [2].iov_base = buffer;
+  iov [2].iov_len = length;
+  return gui_reply_iov (sock, iov, 3);
+}
+
 static int64_t receive_buffer (int sock, char **buffer)
 {
   char length_buf [8];
@@ -94,122 +187,246 @@ static int64_t receive_buffer (int sock, char **buffer)
   return length;
 }
 
-static size_t size_of_string_array (char ** array, int count)
-{
-  size_t result = 0;
-  int i;
-  for (i = 0; i < count; i++)
-    result += (strlen (array [i]) + 1);
-  return result;
-}
-
-static int copy_string_array (char * dest, size_t dsize,
-                              char ** array, int count)
-{
-  if ((dsize < 1) || (count <= 0))
-    return 0;
-  if (dsize < size_of_string_array (array, count)) /* inefficient but sane */
-    return 0;
-  int i;
-  for (i = 0; i < count; i++) {
-    strcpy (dest, array [i]);
-    dest += strlen (array [i]) + 1;
-  }
-  return 1;
-}
-
 /* if extra is not null, adds esize bytes to the header */
+/* the strings are sent from where they are, without being copied */
 static void gui_send_string_array (int code, char ** array,
                                    int count, char * extra, int esize,
-                                   int sock, const char * caller)
+                                   int sock, int is_reply)
 {
 /* format: code, 64-bit number of strings, extra, null-terminated strings */
 #define STRING_ARRAY_HEADER_SIZE	9
   if (extra == NULL)
     esize = 0;
-  size_t string_alloc = size_of_string_array (array, count);
-  size_t alloc = STRING_ARRAY_HEADER_SIZE + string_alloc + esize;
-  char * reply = malloc_or_fail (alloc, caller);
-  reply [0] = code;
-  writeb64 (reply + 1, count);
-  if (extra != NULL)
-    memcpy (reply + STRING_ARRAY_HEADER_SIZE, extra, esize);
-  int offset = STRING_ARRAY_HEADER_SIZE	+ esize;
-  if ((count > 0) && (string_alloc > 0))
-    copy_string_array (reply + offset, string_alloc, array, count);
-  gui_send_buffer (sock, reply, alloc);
-  free (reply);
+  if (count < 0)
+    count = 0;
+  char header [STRING_ARRAY_HEADER_SIZE];
+  header [0] = code;
+  writeb64 (header + 1, count);
+  int niov = 0;
+  struct iovec * iov =
+    malloc_or_fail ((count + 4) * sizeof (struct iovec),
+                    "gui_send_string_array");
+  niov = 2;    /* length and request ID */
+  iov [niov].iov_base = header;
+  iov [niov++].iov_len = STRING_ARRAY_HEADER_SIZE;
+  if (esize > 0) {
+    iov [niov].iov_base = extra;
+    iov [niov++].iov_len = esize;
+  }
+  int i;
+  for (i = 0; i < count; i++) {
+    iov [niov].iov_base = array [i];
+    iov [niov++].iov_len = strlen (array [i]) + 1;
+  }
+  if (is_reply)
+    gui_reply_iov (sock, iov, niov);
+  else   /* callbacks are never sent with a request ID */
+    gui_send_iov (sock, iov + 1, niov - 1);
+  free (iov);
 #undef STRING_ARRAY_HEADER_SIZE
 }
 
-/* returns new count */
-static int add_unique (char * match, char ** result, int count)
+/* one entry in the list of contacts sent to the GUI */
+struct gui_contact {
+  char * name;
+  int flags;   /* the bitset described under gui_contacts */
+};
+#define GUI_CONTACT_REMOVED	0x80  /* only in deltas */
+
+/* returns 1 if the contact has a symmetric key or a public key from the
+ * peer, 0 otherwise */
+static int contact_has_peer_key (const char * contact)
 {
-  int i;
-  for (i = 0; i < count; i++) {
-    if (strcmp (result [i], match) == 0)
-      return count;
+  if (has_symmetric_key (contact, NULL, 0))
+    return 1;
+  int result = 0;
+  keyset * keys = NULL;
+  int nk = all_keys (contact, &keys);
+  int ik;
+  for (ik = 0; ik < nk; ik++) {
+    allnet_rsa_pubkey k;  /* do not free */
+    if (get_contact_pubkey (keys [ik], &k) > 0)
+      result = 1;
   }
-  result [count] = match;
-  return count + 1;
+  if (keys != NULL)
+    free (keys);
+  return result;
 }
 
-/* send all the contacts to the gui, null-separated */
-static void gui_contacts (int sock)
+static int compare_names (const void * a, const void * b)
+{
+  return strcmp (* (char * const *) a, * (char * const *) b);
+}
+
+/* sets *result to a newly allocated array of all the contacts, sorted by
+ * name and without duplicates, and returns the number of contacts.
+ * the names are copied into the same allocation, so one free is enough */
+static int current_contacts (struct gui_contact ** result)
 {
-/* format: code, 64-bit number of contacts,
- *               1-byte bitset for each contact,
- *               null-terminated list of all contacts
- * the bitset contains one bit each for visible (1), notify (2),
- * save (4), is_group (8) */
   char ** contacts = NULL;
   int nc = all_contacts (&contacts);
   char ** invisibles = NULL;
   int ninv = invisible_contacts (&invisibles);
   char ** incompletes = NULL;
   int ni = incomplete_key_exchanges (&incompletes, NULL, NULL);
-  char ** all = malloc_or_fail (sizeof(char*) * (nc + ni + ninv),
-                                "gui_contacts 1");
-  int na = 0; /* total number of contacts */
+  int total = ((nc > 0) ? nc : 0) + ((ninv > 0) ? ninv : 0) +
+              ((ni > 0) ? ni : 0);
+  char ** all = malloc_or_fail (sizeof (char *) * (total + 1),
+                                "gui current_contacts");
+  int na = 0;
   int i;
   for (i = 0; i < nc; i++)
-    na = add_unique (contacts [i], all, na);
+    all [na++] = contacts [i];
   for (i = 0; i < ninv; i++)
-    na = add_unique (invisibles [i], all, na);
+    all [na++] = invisibles [i];
   for (i = 0; i < ni; i++)
-    na = add_unique (incompletes [i], all, na);
-  /* na has the count of names in the "all" array */
-  char * extra = NULL;
-  if (na > 0) {
-    extra = malloc_or_fail (na, "gui_contacts 2");
-    for (i = 0; i < na; i++) {
-      int byte = 0;
-      if (is_visible (all [i]))
-        byte |= 1;
-      if (contact_file_get (all [i], "no_notify", NULL) < 0)
-        byte |= 2;
-      if (contact_file_get (all [i], "no_saving", NULL) < 0)
-        byte |= 4;
-      if (is_group (all [i]))
-        byte |= 8;
-      extra [i] = byte;
+    all [na++] = incompletes [i];
+  if (na > 1)   /* sort, then remove duplicates in one pass */
+    qsort (all, na, sizeof (char *), compare_names);
+  int nu = 0;
+  size_t name_size = 0;
+  for (i = 0; i < na; i++) {
+    if ((nu == 0) || (strcmp (all [nu - 1], all [i]) != 0)) {
+      all [nu++] = all [i];
+      name_size += strlen (all [i]) + 1;
     }
   }
-  gui_send_string_array (GUI_CONTACTS, all, na, extra, na,
-                         sock, "gui_contacts");
+  size_t size = nu * sizeof (struct gui_contact) + name_size;
+  *result = malloc_or_fail (((size > 0) ? size : 1), "gui current_contacts");
+  char * names = (char *) ((*result) + nu);
+  for (i = 0; i < nu; i++) {
+    int flags = 0;
+    if (is_visible (all [i]))
+      flags |= 1;
+    if (contact_file_get (all [i], "no_notify", NULL) < 0)
+      flags |= 2;
+    if (contact_file_get (all [i], "no_saving", NULL) < 0)
+      flags |= 4;
+    if (is_group (all [i]))
+      flags |= 8;
+    if (contact_has_peer_key (all [i]))
+      flags |= 16;
+    if (contact_file_get (all [i], "exchange", NULL) < 0)
+      flags |= 32;
+    (*result) [i].name = names;
+    (*result) [i].flags = flags;
+    strcpy (names, all [i]);
+    names += strlen (all [i]) + 1;
+  }
+  free (all);
   if (contacts != NULL)
     free (contacts);
   if (invisibles != NULL)
     free (invisibles);
   if (incompletes != NULL)
     free (incompletes);
-  if (all != NULL)
-    free (all);
-  if (extra != NULL)
-    free (extra);
+  return nu;
+}
+
+/* sends count contacts in the format described under gui_contacts */
+static void gui_send_contacts (int code, struct gui_contact * contacts,
+                               int count, int sock, int is_reply)
+{
+  char ** names = malloc_or_fail (sizeof (char *) * (count + 1),
+                                  "gui_send_contacts names");
+  char * flags = malloc_or_fail (count + 1, "gui_send_contacts flags");
+  int i;
+  for (i = 0; i < count; i++) {
+    names [i] = contacts [i].name;
+    flags [i] = contacts [i].flags;
+  }
+  gui_send_string_array (code, names, count, flags, count, sock, is_reply);
+  free (names);
+  free (flags);
+}
+
+/* the contacts as last sent to a GUI that asked for GUI_CONTACTS_DELTA */
+static pthread_mutex_t sent_contacts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int sending_contact_deltas = 0;
+static struct gui_contact * sent_contacts = NULL;
+static int num_sent_contacts = 0;
+
+/* send the GUI the contacts that were added, removed, or changed since
+ * the last time.  If not is_reply, does not send anything if there
+ * are no changes */
+static void gui_send_contacts_delta (int code, int sock, int is_reply)
+{
+  pthread_mutex_lock (&sent_contacts_mutex);
+  if (! sending_contact_deltas) {
+    pthread_mutex_unlock (&sent_contacts_mutex);
+    return;
+  }
+  struct gui_contact * current = NULL;
+  int nc = current_contacts (&current);
+  int max = nc + num_sent_contacts;
+  struct gui_contact * delta =
+    malloc_or_fail (sizeof (struct gui_contact) * (max + 1),
+                    "gui_send_contacts_delta");
+  int nd = 0;
+  int c = 0;
+  int s = 0;
+  while ((c < nc) || (s < num_sent_contacts)) {  /* merge the sorted lists */
+    int cmp = ((c >= nc) ? 1 : ((s >= num_sent_contacts) ? -1 :
+               strcmp (current [c].name, sent_contacts [s].name)));
+    if (cmp < 0) {          /* added */
+      delta [nd++] = current [c++];
+    } else if (cmp > 0) {   /* removed */
+      delta [nd] = sent_contacts [s++];
+      delta [nd++].flags = GUI_CONTACT_REMOVED;
+    } else {                /* the same contact, flags may have changed */
+      if (current [c].flags != sent_contacts [s].flags)
+        delta [nd++] = current [c];
+      c++;
+      s++;
+    }
+  }
+  if ((nd > 0) || (is_reply))
+    gui_send_contacts (code, delta, nd, sock, is_reply);
+  free (delta);
+  if (sent_contacts != NULL)
+    free (sent_contacts);
+  sent_contacts = current;
+  num_sent_contacts = nc;
+  pthread_mutex_unlock (&sent_contacts_mutex);
+}
+
+void gui_contacts_changed (int sock)
+{
+  gui_send_contacts_delta (GUI_CALLBACK_CONTACTS_CHANGED, sock, 0);
+}
+
+/* send all the contacts to the gui, null-separated */
+static void gui_contacts (int sock)
+{
+/* format: code, 64-bit number of contacts,
+ *               1-byte bitset for each contact,
+ *               null-terminated list of all contacts
+ * the bitset contains one bit each for visible (1), notify (2),
+ * save (4), is_group (8), has a peer key (16), and key exchange
+ * complete (32), so the GUI does not have to ask about each contact */
+  struct gui_contact * contacts = NULL;
+  int count = current_contacts (&contacts);
+  gui_send_contacts (GUI_CONTACTS, contacts, count, sock, 1);
+  free (contacts);
+}
+
+/* send all the contacts to the gui, then send any changes to the contacts
+ * as GUI_CALLBACK_CONTACTS_CHANGED, instead of having the gui ask again */
+static void gui_contacts_delta (int sock)
+{
+/* format: the same as gui_contacts, except in a GUI_CALLBACK_CONTACTS_CHANGED
+ * only the contacts that have changed are listed, and the bitset
+ * of a contact that has been deleted or renamed is 0x80 */
+  pthread_mutex_lock (&sent_contacts_mutex);
+  sending_contact_deltas = 1;
+  if (sent_contacts != NULL)
+    free (sent_contacts);
+  sent_contacts = NULL;   /* so the reply has all the contacts */
+  num_sent_contacts = 0;
+  pthread_mutex_unlock (&sent_contacts_mutex);
+  gui_send_contacts_delta (GUI_CONTACTS_DELTA, sock, 1);
 }
 
-/* send all the subscriptions to the gui, null-separated */
 static void gui_subscriptions (int sock)
 {
 /* format: code, 64-bit number of senders, null-terminated contacts */
@@ -220,7 +437,7 @@ static void gui_subscriptions (int sock)
   for (i = 0; i < nb; i++)
     senders [i] = bki [i].identifier;
   gui_send_string_array (GUI_SUBSCRIPTIONS, senders, nb, NULL, 0,
-                         sock, "gui_subscriptions");
+                         sock, 1);
   free (senders);
 }
 
@@ -250,7 +467,7 @@ static void gui_contact_exists (char * message, int64_t length, int sock)
       reply [1] = 1;   /* success */
     free (contact);
   }
-  gui_send_buffer (sock, reply, sizeof (reply));
+  gui_reply (sock, reply, sizeof (reply));
 }
 
 /* send a 1 if a contact exists and is a group, or a 0 otherwise */
@@ -267,7 +484,7 @@ static void gui_contact_is_group (char * message, int64_t length, int sock)
       reply [1] = 1;   /* success */
     free (contact);
   }
-  gui_send_buffer (sock, reply, sizeof (reply));
+  gui_reply (sock, reply, sizeof (reply));
 }
 
 /* send a 1 if a contact exists and has a peer key, or a 0 otherwise */
@@ -280,23 +497,10 @@ static void gui_contact_has_peer_key (char * message, int64_t length, int sock)
   reply [1] = 0;   /* by default, no peer key */
   if (length > 0) {
     char * contact = contact_name_from_buffer (message, length);
-    if (has_symmetric_key (contact, NULL, 0)) {
-      reply [1] = 1;   /* has key */
-    } else {
-      keyset * keys = NULL;
-      int nk = all_keys (contact, &keys);
-      int ik;
-      for (ik = 0; ik < nk; ik++) {
-        allnet_rsa_pubkey k;  /* do not free */
-        if (get_contact_pubkey (keys [ik], &k) > 0)
-          reply [1] = 1;   /* has key */
-      }
-      if (keys != NULL)
-        free (keys);
-    }
+    reply [1] = contact_has_peer_key (contact);
     free (contact);
   }
-  gui_send_buffer (sock, reply, sizeof (reply));
+  gui_reply (sock, reply, sizeof (reply));
 }
 
 /* create a group, sending a 1 or a 0 as response */
@@ -313,7 +517,7 @@ static void gui_create_group (char * message, int64_t length, int sock)
       reply [1] = 1;   /* success */
     free (contact);
   }
-  gui_send_buffer (sock, reply, sizeof (reply));
+  gui_reply (sock, reply, sizeof (reply));
 }
 
 static void gui_members (unsigned int code, char * message, int64_t length,
@@ -327,7 +531,7 @@ static void gui_members (unsigned int code, char * message, int64_t length,
     int count = (recursive ? group_membership_recursive (contact, &members)
                            : group_membership (contact, &members));
     gui_send_string_array (code, members, count, NULL, 0,
-                           gui_sock, "gui_members");
+                           gui_sock, 1);
     free (contact);
     if (members != NULL)
       free (members);
@@ -335,7 +539,7 @@ static void gui_members (unsigned int code, char * message, int64_t length,
     char reply [9];
     reply [0] = code;
     writeb64 (reply + 1, 0);
-    gui_send_buffer (gui_sock, reply, sizeof (reply));
+    gui_reply (gui_sock, reply, sizeof (reply));
   }
 }
 
@@ -350,7 +554,7 @@ static void gui_member_of (unsigned int code, char * message, int64_t length,
     int count = (recursive ? member_of_groups_recursive (contact, &members)
                            : member_of_groups (contact, &members));
     gui_send_string_array (code, members, count, NULL, 0,
-                           gui_sock, "gui_member_of");
+                           gui_sock, 1);
     free (contact);
     if (members != NULL)
       free (members);
@@ -358,7 +562,7 @@ static void gui_member_of (unsigned int code, char * message, int64_t length,
     char reply [9];
     reply [0] = code;
     writeb64 (reply + 1, 0);
-    gui_send_buffer (gui_sock, reply, sizeof (reply));
+    gui_reply (gui_sock, reply, sizeof (reply));
   }
 }
 
@@ -382,7 +586,7 @@ static void gui_rename_contact (char * message, int64_t length, int gui_sock)
                 old, new);
     }
   }
-  gui_send_buffer (gui_sock, reply, sizeof (reply));
+  gui_reply (gui_sock, reply, sizeof (reply));
 }
 
 static void gui_clear_conversation (char * message, int64_t length,
@@ -398,7 +602,7 @@ static void gui_clear_conversation (char * message, int64_t length,
     reply [1] = clear_conversation (contact);
     free (contact);
   }
-  gui_send_buffer (gui_sock, reply, sizeof (reply));
+  gui_reply (gui_sock, reply, sizeof (reply));
 }
 
 static void gui_delete_contact (char * message, int64_t length, int gui_sock)
@@ -414,7 +618,7 @@ static void gui_delete_contact (char * message, int64_t length, int gui_sock)
     reply [1] = delete_contact (contact);  /* this is the one we report */
     free (contact);
   }
-  gui_send_buffer (gui_sock, reply, sizeof (reply));
+  gui_reply (gui_sock, reply, sizeof (reply));
 }
 
 static void gui_variable (char * message, int64_t length, int op, int gui_sock)
@@ -508,7 +712,7 @@ static void gui_variable (char * message, int64_t length, int op, int gui_sock)
                 my_reply [0] = GUI_QUERY_VARIABLE;
                 my_reply [1] = 1;
                 snprintf (my_reply + 2, size - 2, "%s", secret);
-                gui_send_buffer (gui_sock, my_reply, size);
+                gui_reply (gui_sock, my_reply, size);
                 if (s1 != NULL)
                   free (s1);
                 if (s2 != NULL)
@@ -567,7 +771,7 @@ static void gui_variable (char * message, int64_t length, int op, int gui_sock)
     }
     free (contact);
   }
-  gui_send_buffer (gui_sock, reply, sizeof (reply));
+  gui_reply (gui_sock, reply, sizeof (reply));
 }
 
 static void gui_send_result_messages (int code,
@@ -590,18 +794,24 @@ static void gui_send_result_messages (int code,
  */
 #define MESSAGE_ARRAY_HEADER_SIZE	9
 #define MESSAGE_HEADER_SIZE		36
-  size_t message_alloc = 0;
+  /* the message contents are sent from msgs, and only the headers are
+   * built here.  iov [0] and [1] are for the length and request ID */
+  if (count < 0)
+    count = 0;
+  char array_header [MESSAGE_ARRAY_HEADER_SIZE];
+  array_header [0] = code;
+  writeb64 (array_header + 1, count);
+  char * headers = malloc_or_fail (count * MESSAGE_HEADER_SIZE + 1,
+                                   "gui_send_messages headers");
+  memset (headers, 0, count * MESSAGE_HEADER_SIZE + 1);  /* clear all */
+  struct iovec * iov = malloc_or_fail ((count * 2 + 3) * sizeof (struct iovec),
+                                       "gui_send_messages iov");
+  int niov = 2;
+  iov [niov].iov_base = array_header;
+  iov [niov++].iov_len = MESSAGE_ARRAY_HEADER_SIZE;
   int i;
-  for (i = 0; i < count; i++)
-    message_alloc += (MESSAGE_HEADER_SIZE + strlen (msgs [i].message) + 1);
-  size_t alloc = MESSAGE_ARRAY_HEADER_SIZE + message_alloc;
-/* printf ("gui_send_result_messages (%d, %p, %d, %d, %llu) allocating %zd(%zd)\n", code, msgs, count, sock, lr, alloc, message_alloc); */
-  char * reply = malloc_or_fail (alloc, "gui_send_messages");
-  memset (reply, 0, alloc);  /* clear everything */
-  reply [0] = code;
-  writeb64 (reply + 1, count);
-  char * dest = reply + MESSAGE_ARRAY_HEADER_SIZE;
   for (i = 0; i < count; i++) {
+    char * dest = headers + i * MESSAGE_HEADER_SIZE;
     if (msgs [i].msg_type == MSG_TYPE_RCVD)
       dest [0] = 3;
     else if (msgs [i].message_has_been_acked)
@@ -616,18 +826,14 @@ static void gui_send_result_messages (int code,
     writeb16 (dest + 25, msgs [i].tz_min);
     writeb64 (dest + 27, msgs [i].rcvd_ackd_time);
     dest [35] = (lr < msgs [i].rcvd_ackd_time);
-    strcpy (dest + MESSAGE_HEADER_SIZE, msgs [i].message);
-/* if (i + 10 > count) {
-int len = MESSAGE_HEADER_SIZE + strlen (msgs [i].message) + 1;
-char s [1000];
-snprintf (s, sizeof (s), "%d/%d: bytes %zd..%zd of %zd",
-i, count, (dest - reply), ((dest + len - 1) - reply), alloc);
-print_buffer (dest, len, s, 40, 1);
-} */
-    dest += MESSAGE_HEADER_SIZE + strlen (msgs [i].message) + 1;
-  }
-  gui_send_buffer (sock, reply, alloc);
-  free (reply);
+    iov [niov].iov_base = dest;
+    iov [niov++].iov_len = MESSAGE_HEADER_SIZE;
+    iov [niov].iov_base = (char *) (msgs [i].message);
+    iov [niov++].iov_len = strlen (msgs [i].message) + 1;
+  }
+  gui_reply_iov (sock, iov, niov);
+  free (iov);
+  free (headers);
 #undef MESSAGE_HEADER_SIZE
 #undef MESSAGE_ARRAY_HEADER_SIZE
 }
@@ -667,28 +873,49 @@ static void gui_get_messages (char * message, int64_t length, int gui_sock)
     free (contact);
   }
   /* if we didn't reply above, something went wrong.  Send 0 messages */
-  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
-struct send_args_struct {
-  int sock;
-  char * contact;
-  char * message;
-  uint64_t expected_seq;
-};
-
-static void * send_message_thread (void * arg) {
-  struct send_args_struct * a = (struct send_args_struct *) arg;
-  uint64_t result = send_data_message (a->sock, a->contact,
-                                       a->message, strlen (a->message));
-  if (result != a->expected_seq)
-    printf ("error: sent message '%s' to '%s' with sequence %" PRIu64
-            ", expected %" PRIu64 "\n", a->message, a->contact, result,
-            a->expected_seq);
-  free (a->contact);
-  free (a->message);
-  free (a);
-  return NULL;
+static void gui_get_messages_page (char * message, int64_t length,
+                                   int gui_sock)
+{
+/* message format: 64-bit max, 64-bit time, 64-bit sequence number, 1-byte
+ * type (in the format of gui_send_result_messages), contact name (not null
+ * terminated).  Requests up to max messages from before the message with
+ * this time, sequence number and type, most recent first.  A time of zero
+ * requests the most recent messages */
+/* reply format: 1-byte code, 64-bit number of messages, messages each
+ * in the format shown under gui_send_result_messages */
+  char reply_header [9];
+  reply_header [0] = GUI_GET_MESSAGES_PAGE;
+  writeb64 (reply_header + 1, 0);   /* in case of failure */
+  if (length >= 26) {
+    int64_t max = readb64 (message);
+    uint64_t before_time = readb64 (message + 8);
+    uint64_t before_seq = readb64 (message + 16);
+    int before_type = ((message [24] == 3) ? MSG_TYPE_RCVD : MSG_TYPE_SENT);
+    message += 25;
+    length -= 25;
+    char * contact = contact_name_from_buffer (message, length);
+    unsigned long long int latest = last_read_time (contact);
+    struct message_store_info * msgs = NULL;
+    int num_alloc = 0;
+    int num_used = 0;
+    if ((max > 0) && (max <= INT_MAX) && (num_keysets (contact) > 0) &&
+        (list_messages_page (contact, before_time, before_seq, before_type,
+                             (int) max, &msgs, &num_alloc, &num_used))) {
+      gui_send_result_messages (GUI_GET_MESSAGES_PAGE, msgs, num_used,
+                                gui_sock, latest);
+      free_all_messages (msgs, num_used);
+      if (msgs != NULL)
+        free (msgs);
+      free (contact);
+      return;
+    }
+    free (contact);
+  }
+  /* if we didn't reply above, something went wrong.  Send 0 messages */
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
 static void gui_send_message (char * message, int64_t length, int broadcast,
@@ -709,23 +936,27 @@ static void gui_send_message (char * message, int64_t length, int broadcast,
         if (broadcast) {
           printf ("sending broadcast messages not implemented yet\n");
         } else {
-          /* sending takes too long, so do it in a separate thread */
+          /* sending takes a while, so reply before sending.  The mutex
+           * keeps a second message from getting the same sequence number
+           * while the first is being sent */
+          static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+          pthread_mutex_lock (&send_mutex);
           uint64_t expected = highest_seq_any_key (contact, MSG_TYPE_SENT) + 1;
-          size_t size = sizeof (struct send_args_struct);
-          struct send_args_struct * a = malloc_or_fail (size, "gui_send");
-          a->sock = allnet_sock;
-          a->contact = strcpy_malloc (contact, "gui_send_message contact");
-          a->message = strcpy_malloc (to_send, "gui_send_message message");
-          a->expected_seq = expected;
-          pthread_t t;
-          pthread_create (&t, NULL, send_message_thread, a);
-          pthread_detach (t);
           writeb64 (reply_header + 1, expected);
+          gui_reply (gui_sock, reply_header, sizeof (reply_header));
+          uint64_t result = send_data_message (allnet_sock, contact, to_send,
+                                               strlen (to_send));
+          pthread_mutex_unlock (&send_mutex);
+          if (result != expected)
+            printf ("error: sent message '%s' to '%s' with sequence %" PRIu64
+                    ", expected %" PRIu64 "\n", to_send, contact, result,
+                    expected);
+          return;
         }
       }
     }
   }
-  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
 static void gui_init_key_exchange (const char * message, int64_t length,
@@ -768,7 +999,7 @@ static void gui_init_key_exchange (const char * message, int64_t length,
     printf ("gui_init_key_exchange error: length %" PRId64
             ", contact %s (%zd)\n", length, contact, strlen (contact));
   }
-  gui_send_buffer (gui_sock, reply, rsize);
+  gui_reply (gui_sock, reply, rsize);
   if (rsize > rheadersize)
     free (reply);
 }
@@ -786,7 +1017,7 @@ static void gui_subscribe (char * message, int64_t length,
     reply_header [1] = subscribe_broadcast (allnet_sock, ahra);
     free (ahra);
   }
-  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
 static void gui_trace (char * message, int64_t length,
@@ -808,7 +1039,7 @@ static void gui_trace (char * message, int64_t length,
                        reply_header + 1, 1000))
       memset (reply_header + 1, 0, sizeof (reply_header) - 1);
   }
-  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
 static void gui_busy_wait (int gui_sock, int allnet_sock)
@@ -817,16 +1048,20 @@ static void gui_busy_wait (int gui_sock, int allnet_sock)
   do_request_and_resend (allnet_sock); 
   char reply_header [1];
   reply_header [0] = GUI_BUSY_WAIT;
-  gui_send_buffer (gui_sock, reply_header, sizeof (reply_header));
+  gui_reply (gui_sock, reply_header, sizeof (reply_header));
 }
 
 static void interpret_from_gui (char * message, int64_t length,
                                 int gui_sock, int allnet_sock)
 {
+  struct reply_id * rid = pthread_getspecific (reply_id_key);
   switch ((unsigned char) (message [0])) {
   case GUI_CONTACTS:
     gui_contacts (gui_sock);
     break;
+  case GUI_CONTACTS_DELTA:
+    gui_contacts_delta (gui_sock);
+    break;
   case GUI_SUBSCRIPTIONS:
     gui_subscriptions (gui_sock);
     break;
@@ -879,6 +1114,9 @@ static void interpret_from_gui (char * message, int64_t length,
   case GUI_GET_MESSAGES:
     gui_get_messages (message + 1, length - 1, gui_sock);
     break;
+  case GUI_GET_MESSAGES_PAGE:
+    gui_get_messages_page (message + 1, length - 1, gui_sock);
+    break;
   case GUI_SEND_MESSAGE:
     gui_send_message (message + 1, length - 1, 0, gui_sock, allnet_sock);
     break;
@@ -900,10 +1138,126 @@ static void interpret_from_gui (char * message, int64_t length,
     gui_busy_wait (gui_sock, allnet_sock); 
     break;
 
+  case GUI_REQUEST_ID:
+    /* message format: 64-bit request ID, then any other request.
+     * the reply is the code, the same request ID, then the usual reply.
+     * the GUI may send more requests without waiting for the replies */
+    if ((length > 9) && (rid != NULL) && (! rid->has_id)) {
+      rid->has_id = 1;
+      memcpy (rid->id, message + 1, sizeof (rid->id));
+      interpret_from_gui (message + 9, length - 9, gui_sock, allnet_sock);
+      rid->has_id = 0;
+    } else {
+      printf ("GUI request with ID has length %" PRId64 "\n", length);
+    }
+    return;     /* any contact changes were sent for the inner request */
+
   default:
     printf ("command from GUI has unknown code %d\n", message [0]); 
     break;
   }
+  switch ((unsigned char) (message [0])) {
+  case GUI_CREATE_GROUP:        /* these may change the list of contacts */
+  case GUI_RENAME_CONTACT:
+  case GUI_DELETE_CONTACT:
+  case GUI_SET_VARIABLE:
+  case GUI_UNSET_VARIABLE:
+  case GUI_KEY_EXCHANGE:
+    gui_contacts_changed (gui_sock);
+    break;
+  default:
+    break;
+  }
+}
+
+/* requests from the GUI are handled by a fixed pool of worker threads,
+ * so a slow request (a key exchange, loading a long conversation, a
+ * trace, or sending a message) does not hold up the others.  Replies
+ * may be sent in any order, but the GUI waits for each reply unless
+ * it uses GUI_REQUEST_ID.  gui_send_iov keeps replies from interleaving */
+#ifndef GUI_WORKERS
+#define GUI_WORKERS		4
+#endif /* GUI_WORKERS */
+#ifndef GUI_QUEUE_SIZE
+#define GUI_QUEUE_SIZE		64   /* requests waiting for a worker */
+#endif /* GUI_QUEUE_SIZE */
+
+struct gui_request {
+  char * message;
+  int64_t length;
+};
+
+static struct gui_request_queue {
+  struct gui_request items [GUI_QUEUE_SIZE];
+  int first;
+  int count;
+  int gui_sock;
+  int allnet_sock;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} requests = { .first = 0, .count = 0,
+               .mutex = PTHREAD_MUTEX_INITIALIZER,
+               .not_empty = PTHREAD_COND_INITIALIZER,
+               .not_full = PTHREAD_COND_INITIALIZER };
+
+/* blocks while the queue is full */
+static void gui_request_put (char * message, int64_t length)
+{
+  pthread_mutex_lock (&(requests.mutex));
+  while (requests.count >= GUI_QUEUE_SIZE)
+    pthread_cond_wait (&(requests.not_full), &(requests.mutex));
+  int index = (requests.first + requests.count) % GUI_QUEUE_SIZE;
+  requests.items [index].message = message;
+  requests.items [index].length = length;
+  requests.count++;
+  pthread_cond_signal (&(requests.not_empty));
+  pthread_mutex_unlock (&(requests.mutex));
+}
+
+static void gui_request_get (struct gui_request * result)
+{
+  pthread_mutex_lock (&(requests.mutex));
+  while (requests.count <= 0)
+    pthread_cond_wait (&(requests.not_empty), &(requests.mutex));
+  *result = requests.items [requests.first];
+  requests.first = (requests.first + 1) % GUI_QUEUE_SIZE;
+  requests.count--;
+  pthread_cond_signal (&(requests.not_full));
+  pthread_mutex_unlock (&(requests.mutex));
+}
+
+static void * gui_worker_thread (void * arg)
+{
+  struct reply_id rid = { .has_id = 0 };
+  pthread_setspecific (reply_id_key, &rid);
+  while (1) {
+    struct gui_request r;
+    gui_request_get (&r);
+    interpret_from_gui (r.message, r.length, requests.gui_sock,
+                        requests.allnet_sock);
+    free (r.message);
+  }
+  return NULL;
+}
+
+static void start_gui_workers (int gui_sock, int allnet_sock)
+{
+  requests.gui_sock = gui_sock;
+  requests.allnet_sock = allnet_sock;
+  pthread_key_create (&reply_id_key, NULL);
+  int i;
+  for (i = 0; i < GUI_WORKERS; i++) {
+    pthread_t t;
+    if (pthread_create (&t, NULL, gui_worker_thread, NULL) != 0) {
+      perror ("gui_respond pthread_create");
+      printf ("unable to start GUI worker %d\n", i);
+      if (i == 0)
+        stop_chat_and_exit (1);
+      break;
+    }
+    pthread_detach (t);
+  }
 }
 
 void * gui_respond_thread (void * arg)
@@ -915,11 +1269,11 @@ void * gui_respond_thread (void * arg)
 #ifdef DEBUG_PRINT
   printf ("gui_respond_thread (%d, %d) started\n", gui_sock, allnet_sock);
 #endif /* DEBUG_PRINT */
+  start_gui_workers (gui_sock, allnet_sock);
   char * message = NULL;
   int64_t mlen = 0;
   while ((mlen = receive_buffer (gui_sock, &message)) > 0) {
-    interpret_from_gui (message, mlen, gui_sock, allnet_sock);
-    free (message);
+    gui_request_put (message, mlen);  /* the worker frees the message */
     message = NULL;
   }
 #ifdef DEBUG_PRINT
@@ -9,6 +9,7 @@
 #define GUI_CONTACT_EXISTS 			3
 #define GUI_CONTACT_IS_GROUP 			4
 #define GUI_HAS_PEER_KEY 			5
+#define GUI_CONTACTS_DELTA 			6
 
 #define GUI_CREATE_GROUP 			10
 #define GUI_MEMBERS 				11
@@ -35,6 +36,7 @@
 #define GUI_GET_MESSAGES			40
 #define GUI_SEND_MESSAGE			41
 #define GUI_SEND_BROADCAST			42
+#define GUI_GET_MESSAGES_PAGE			43
 
 #define GUI_KEY_EXCHANGE			50
 #define GUI_SUBSCRIBE				51
@@ -42,6 +44,8 @@
 
 #define GUI_BUSY_WAIT				60
 
+#define GUI_REQUEST_ID				80  /* followed by any request */
+
 /* codes sent to the GUI when receiving allnet messages, with no response */
 
 #define GUI_CALLBACK_MESSAGE_RECEIVED		70
@@ -49,6 +53,7 @@
 #define GUI_CALLBACK_CONTACT_CREATED		72
 #define GUI_CALLBACK_SUBSCRIPTION_COMPLETE	73
 #define GUI_CALLBACK_TRACE_RESPONSE		74
+#define GUI_CALLBACK_CONTACTS_CHANGED		75  /* after GUI_CONTACTS_DELTA */
 
 #include <unistd.h>       /* pid_t */
 #include <inttypes.h>     /* int64_t */
@@ -69,6 +74,10 @@ extern void gui_socket_main_loop (int gui_sock, /* gui_callback.c */
  * so should be called by all gui code for sending on the gui socket */
 extern int gui_send_buffer (int sock, char *buffer, int64_t length);
 
+/* if the GUI has asked for GUI_CONTACTS_DELTA, sends it any changes
+ * to the contacts since the last time */
+extern void gui_contacts_changed (int sock);  /* gui_respond.c */
+
 /* exit code should be 0 for normal exit, 1 for error exit */
 extern void stop_chat_and_exit (int exit_code);
 
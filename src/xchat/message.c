@@ -75,38 +75,325 @@ static inline int same_message_id (const char * id1, const char * id2)
  * if not found, return 0
  * if found, and:
  *   if wtype is MSG_TYPE_ACK, return 1
- *   otherwise, return the sequence number of the matching message
+ *   otherwise, return the sequence number of the matching message, and
+ *   set *report_ack_found to whether the message has been acked
  */
 static uint64_t find_ack (const char * contact, keyset k, const char * wanted,
                           int wtype, int * report_ack_found)
 {
   if (report_ack_found != NULL)
     *report_ack_found = 0;
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
   uint64_t seq = 0;
+  if (find_ack_record (contact, k, wtype, wanted, &seq) == MSG_TYPE_DONE)
+    return 0;  /* not found */
+  if (wtype == MSG_TYPE_ACK)  /* seq is not set */
+    return 1;
+  if (report_ack_found != NULL)
+    *report_ack_found =
+      (find_ack_record (contact, k, MSG_TYPE_ACK, wanted, NULL) == MSG_TYPE_ACK);
+  return seq;
+}
+
+/* the unacked messages are tracked in memory.  For each keyset, a
+ * window has one bit for each sequence number from base on, set if the
+ * most recent message sent with that sequence number has not been acked.
+ * For all keysets together, a hash table maps the ack of each message
+ * we sent to its keyset and sequence number, so ack_received need not
+ * search every contact.  Both are loaded from the store when first
+ * used, and again whenever the contacts or keys change, and are kept
+ * up to date by save_outgoing and ack_received */
+struct unacked_window {
+  char * contact;     /* NULL if not in use */
+  uint64_t base;      /* a multiple of 64, no bits below base are set */
+  uint64_t last;      /* highest sequence number sent, 0 if none */
+  int words;          /* number of words in bits */
+  uint64_t * bits;
+};
+
+struct sent_ack {
   char ack [MESSAGE_ID_SIZE];
-  int ack_found = 0;
-  while ((type = prev_message (iter, &seq, NULL, NULL, NULL, ack, NULL, NULL))
-         != MSG_TYPE_DONE) {
-    if ((type == wtype) && (same_message_id (wanted, ack))) {
+  keyset k;           /* -1 if this entry is not in use */
+  int sent;           /* 0 if only the ack has been seen so far */
+  int acked;
+  uint64_t seq;
+};
+
+/* unacked_windows is indexed by keyset */
+static struct unacked_window * unacked_windows = NULL;
+static int num_unacked_windows = 0;
+/* sent_acks is a hash table with a power of two number of entries */
+static struct sent_ack * sent_acks = NULL;
+static unsigned int sent_acks_size = 0;
+static unsigned int sent_acks_used = 0;
+static int unacked_loaded = 0;
+static unsigned long long int unacked_generation = 0;
+/* the functions below must be called with unacked_mutex held */
+static pthread_mutex_t unacked_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct unacked_window * find_window (keyset k)
+{
+  if ((k < 0) || (k >= num_unacked_windows) ||
+      (unacked_windows [k].contact == NULL))
+    return NULL;
+  return unacked_windows + k;
+}
+
+static struct unacked_window * new_window (const char * contact, keyset k)
+{
+  if (k < 0)
+    return NULL;
+  if (k >= num_unacked_windows) {
+    int n = k + 1 + num_unacked_windows;
+    struct unacked_window * w =
+      realloc (unacked_windows, n * sizeof (struct unacked_window));
+    if (w == NULL)
+      return NULL;
+    memset (w + num_unacked_windows, 0,
+            (n - num_unacked_windows) * sizeof (struct unacked_window));
+    unacked_windows = w;
+    num_unacked_windows = n;
+  }
+  struct unacked_window * w = unacked_windows + k;
+  if (w->contact == NULL)
+    w->contact = strcpy_malloc (contact, "message.c new_window");
+  return w;
+}
+
+static int window_is_set (struct unacked_window * w, uint64_t seq)
+{
+  if ((seq < w->base) || (seq >= w->base + 64 * (uint64_t) (w->words)))
+    return 0;
+  uint64_t index = seq - w->base;
+  return ((w->bits [index / 64] >> (index % 64)) & 1);
+}
+
+static void window_set (struct unacked_window * w, uint64_t seq)
+{
+  uint64_t new_base = seq - (seq % 64);
+  if (w->words == 0)
+    w->base = new_base;
+  int below = (new_base < w->base) ? (int) ((w->base - new_base) / 64) : 0;
+  int needed = (int) ((seq - ((below > 0) ? new_base : w->base)) / 64 + 1);
+  if (needed < w->words + below)
+    needed = w->words + below;
+  if (needed > w->words) {
+    int alloc = needed;
+    if (below == 0)   /* growing at the top, leave room for more */
+      alloc = ((needed > 2 * w->words) ? needed : 2 * w->words);
+    uint64_t * bits = realloc (w->bits, alloc * sizeof (uint64_t));
+    if (bits == NULL)
+      return;
+    memmove (bits + below, bits, w->words * sizeof (uint64_t));
+    memset (bits, 0, below * sizeof (uint64_t));
+    memset (bits + below + w->words, 0,
+            (alloc - below - w->words) * sizeof (uint64_t));
+    w->bits = bits;
+    w->words = alloc;
+    if (below > 0)
+      w->base = new_base;
+  }
+  uint64_t index = seq - w->base;
+  w->bits [index / 64] |= (((uint64_t) 1) << (index % 64));
+  if (seq > w->last)
+    w->last = seq;
+}
+
+static void window_clear (struct unacked_window * w, uint64_t seq)
+{
+  if (! window_is_set (w, seq))
+    return;
+  uint64_t index = seq - w->base;
+  w->bits [index / 64] &= ~(((uint64_t) 1) << (index % 64));
+  /* slide the window past any leading words that are now empty */
+  int empty = 0;
+  while ((empty < w->words) && (w->bits [empty] == 0))
+    empty++;
+  if (empty == w->words) {   /* nothing left, start again with the next */
+    free (w->bits);
+    w->bits = NULL;
+    w->words = 0;
+  } else if (empty > 0) {
+    memmove (w->bits, w->bits + empty, (w->words - empty) * sizeof (uint64_t));
+    memset (w->bits + w->words - empty, 0, empty * sizeof (uint64_t));
+    w->base += 64 * (uint64_t) empty;
+  }
+}
+
+static unsigned int sent_ack_hash (const char * ack)
+{
+  /* acks are random, so any of their bits make a good hash */
+  return (unsigned int) readb32 (ack);
+}
+
+static struct sent_ack * find_sent_ack (const char * ack)
+{
+  if (sent_acks_size == 0)
+    return NULL;
+  unsigned int mask = sent_acks_size - 1;
+  unsigned int i = sent_ack_hash (ack) & mask;
+  while (sent_acks [i].k >= 0) {
+    if (same_message_id (sent_acks [i].ack, ack))
+      return sent_acks + i;
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+/* returns the existing or new entry for this ack, or NULL if out of memory */
+static struct sent_ack * add_sent_ack (const char * ack, keyset k)
+{
+  struct sent_ack * found = find_sent_ack (ack);
+  if (found != NULL)
+    return found;
+  if ((sent_acks_used + 1) * 2 > sent_acks_size) { /* keep at most half full */
+    unsigned int new_size = ((sent_acks_size > 0) ? (sent_acks_size * 2) : 256);
+    struct sent_ack * new_acks = malloc (new_size * sizeof (struct sent_ack));
+    if (new_acks == NULL)
+      return NULL;
+    unsigned int i;
+    for (i = 0; i < new_size; i++)
+      new_acks [i].k = -1;
+    for (i = 0; i < sent_acks_size; i++) {
+      if (sent_acks [i].k >= 0) {
+        unsigned int j = sent_ack_hash (sent_acks [i].ack) & (new_size - 1);
+        while (new_acks [j].k >= 0)
+          j = (j + 1) & (new_size - 1);
+        new_acks [j] = sent_acks [i];
+      }
+    }
+    if (sent_acks != NULL)
+      free (sent_acks);
+    sent_acks = new_acks;
+    sent_acks_size = new_size;
+  }
+  unsigned int mask = sent_acks_size - 1;
+  unsigned int i = sent_ack_hash (ack) & mask;
+  while (sent_acks [i].k >= 0)
+    i = (i + 1) & mask;
+  struct sent_ack * result = sent_acks + i;
+  memcpy (result->ack, ack, MESSAGE_ID_SIZE);
+  result->k = k;
+  result->sent = 0;
+  result->acked = 0;
+  result->seq = 0;
+  sent_acks_used++;
+  return result;
+}
+
+static void free_unacked ()
+{
+  int i;
+  for (i = 0; i < num_unacked_windows; i++) {
+    if (unacked_windows [i].contact != NULL)
+      free (unacked_windows [i].contact);
+    if (unacked_windows [i].bits != NULL)
+      free (unacked_windows [i].bits);
+  }
+  if (unacked_windows != NULL)
+    free (unacked_windows);
+  unacked_windows = NULL;
+  num_unacked_windows = 0;
+  if (sent_acks != NULL)
+    free (sent_acks);
+  sent_acks = NULL;
+  sent_acks_size = 0;
+  sent_acks_used = 0;
+}
+
+/* reads the sent messages and acks of one keyset from the store */
+static void load_unacked_keyset (const char * contact, keyset k)
+{
+  struct unacked_window * w = new_window (contact, k);
+  struct msg_iter * iter = start_iter (contact, k);
+  if ((w == NULL) || (iter == NULL)) {
+    if (iter != NULL)
       free_iter (iter);
-      if (wtype == MSG_TYPE_ACK) { /* seq is not set */
-        return 1;
-      } else {
-        if (report_ack_found != NULL)
-          *report_ack_found = ack_found;
-        return seq;
+    return;
+  }
+  /* the iterator goes from the most recent record to the oldest, so
+   * the ack for a message is seen before the message itself.  Only the
+   * most recent message with each sequence number counts, so remember
+   * which sequence numbers have been seen */
+  struct unacked_window seen;
+  memset (&seen, 0, sizeof (seen));
+  int type;
+  uint64_t seq;
+  char ack [MESSAGE_ID_SIZE];
+  while ((type = prev_message (iter, &seq, NULL, NULL, NULL, ack,
+                               NULL, NULL)) != MSG_TYPE_DONE) {
+    if ((type != MSG_TYPE_ACK) && (type != MSG_TYPE_SENT))
+      continue;
+    struct sent_ack * sa = add_sent_ack (ack, k);
+    if (sa == NULL)
+      break;
+    if (type == MSG_TYPE_ACK) {
+      sa->acked = 1;
+    } else if (! sa->sent) {
+      sa->sent = 1;
+      sa->seq = seq;
+      if ((seq > 0) && (! window_is_set (&seen, seq))) {
+        window_set (&seen, seq);
+        if (sa->acked) {
+          if (seq > w->last)
+            w->last = seq;
+        } else {
+          window_set (w, seq);
+        }
       }
-    } else if ((wtype != MSG_TYPE_ACK) && (type == MSG_TYPE_ACK) &&
-               (same_message_id (wanted, ack))) {
-      ack_found = 1;
     }
   }
   free_iter (iter);
-  return 0;  /* not found */
+  if (seen.bits != NULL)
+    free (seen.bits);
+}
+
+/* loads the windows and the acks if they have not been loaded since
+ * the contacts or keys last changed */
+static void load_unacked ()
+{
+  if (unacked_loaded && (unacked_generation == keys_generation ()))
+    return;
+  free_unacked ();
+  unacked_loaded = 1;
+  unacked_generation = keys_generation ();
+  char ** contacts = NULL;   /* borrowed, do not free */
+  int nc = borrow_contacts (&contacts);
+  char ** hidden = NULL;     /* malloc'd, hidden contacts may still send */
+  int nh = invisible_contacts (&hidden);
+  int c;
+  for (c = 0; c < nc + nh; c++) {
+    const char * contact = ((c < nc) ? contacts [c] : hidden [c - nc]);
+    keyset * ksets = NULL;
+    int nk = all_keys (contact, &ksets);
+    int k;
+    for (k = 0; k < nk; k++)
+      load_unacked_keyset (contact, ksets [k]);
+    if ((nk > 0) && (ksets != NULL))
+      free (ksets);
+  }
+  if ((nh > 0) && (hidden != NULL))
+    free (hidden);
+}
+
+/* record a newly sent message */
+static void add_unacked (const char * contact, keyset k, uint64_t seq,
+                         const char * ack)
+{
+  pthread_mutex_lock (&unacked_mutex);
+  load_unacked ();   /* if it loads, it reads this message from the store */
+  struct unacked_window * w = new_window (contact, k);
+  struct sent_ack * sa = add_sent_ack (ack, k);
+  if ((w != NULL) && (sa != NULL) && (! sa->sent)) {
+    sa->sent = 1;
+    sa->seq = seq;
+    if (sa->acked) {
+      if (seq > w->last)
+        w->last = seq;
+    } else {
+      window_set (w, seq);
+    }
+  }
+  pthread_mutex_unlock (&unacked_mutex);
 }
 
 /* putting null characters in files makes it hard for Java to read the file. */
@@ -136,6 +423,7 @@ void save_outgoing (const char * contact, keyset k, struct chat_descriptor * cp,
   eliminate_nulls (text, tsize);
   save_record (contact, k, MSG_TYPE_SENT, readb64u (cp->counter), time, tz,
                allnet_time (), (char *) (cp->message_ack), text, tsize, NULL);
+  add_unacked (contact, k, readb64u (cp->counter), (char *) (cp->message_ack));
 }
 
 /* return the (malloc'd) outgoing message with the given sequence number,
@@ -143,39 +431,21 @@ void save_outgoing (const char * contact, keyset k, struct chat_descriptor * cp,
  * if there is more than one such message, returns the latest.
  * Also fills in the size, time and message_ack -- message_ack must have
  * at least MESSAGE_ID_SIZE bytes */
-extern int get_outgoing_show_debug;
-int get_outgoing_show_debug = 0;
 char * get_outgoing (const char * contact, keyset k, uint64_t seq,
                      int * size, uint64_t * time, char * message_ack)
 {
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)  /* non-existent contact or no messages */
-    return NULL;
-  int type;
-  uint64_t mseq;
   uint64_t mtime;
   int msize;
   int tz;
   char * result = NULL;
-  while ((type = prev_message (iter, &mseq, &mtime, &tz, NULL, message_ack,
-          &result, &msize)) != MSG_TYPE_DONE) {
-if ((get_outgoing_show_debug) && (type == MSG_TYPE_SENT) && (strcmp (contact, "edo-on-celine") == 0))
-printf ("get_outgoing (%" PRIu64 "): type %d, seq %" PRIu64 ", message '%s'\n",
-seq, MSG_TYPE_SENT, mseq, result);
-    if ((type == MSG_TYPE_SENT) && (mseq == seq)) { /* found */
-      if (time != NULL)
-        *time = make_time_tz (mtime, tz);
-      if (size != NULL)
-        *size = msize;
-      free_iter (iter);
-      return result;
-    }
-    if (result != NULL)
-      free (result);   /* not found, try again */
-    result = NULL;
-  }
-  free_iter (iter);
-  return NULL;
+  if (find_seq_record (contact, k, MSG_TYPE_SENT, seq, &mtime, &tz, NULL,
+                       message_ack, &result, &msize) != MSG_TYPE_SENT)
+    return NULL;
+  if (time != NULL)
+    *time = make_time_tz (mtime, tz);
+  if (size != NULL)
+    *size = msize;
+  return result;
 }
 
 /* forward declaration, implemented below */
@@ -215,56 +485,42 @@ void save_incoming (const char * contact, keyset k,
 uint64_t ack_received (const char * message_ack, char ** contact, keyset * kset,
                        int * new_ack)
 {
-  char ** contacts = NULL;
   if (contact != NULL)
     *contact = NULL;
   if (kset != NULL)
     *kset = -1;
   if (new_ack != NULL)
     *new_ack = 0;
-  int nc = all_contacts (&contacts);
-  int c;
-  for (c = 0; c < nc; c++) {
-    keyset * ksets = NULL;
-    int nk = all_keys (contacts [c], &ksets);
-    int k;
-    for (k = 0; k < nk; k++) {
-      int found_ack = 0;
-      uint64_t seq = find_ack (contacts [c], ksets [k], message_ack,
-                               MSG_TYPE_SENT, &found_ack);
-      if (seq > 0) {
-#ifdef VERIFY_20170616_ACK_FINDER
-        uint64_t a =
-          find_ack (contacts [c], ksets [k], message_ack, MSG_TYPE_ACK, NULL);
-        int x = (a != 0);  /* x is the boolean equivalent of a */
-        if (x != found_ack) {
-          printf ("find_ack %d (%ld), found_ack %d for %s, %d\n",
-                  x, a, found_ack, contacts [c], ksets [k]);
-          print_buffer (message_ack, MESSAGE_ID_SIZE, "ack",
-                        MESSAGE_ID_SIZE, 1);
-        }
-#endif /* VERIFY_20170616_ACK_FINDER */
-        if (! found_ack) {
-          save_record (contacts [c], ksets [k], MSG_TYPE_ACK, seq,
-                       0, 0, allnet_time (), message_ack, NULL, 0, NULL);
-          if (new_ack != NULL)
-            *new_ack = 1;
-        }
-        if (contact != NULL)
-          *contact = strcpy_malloc (contacts [c], "ack_received");
-        if (kset != NULL)
-          *kset = ksets [k];
-        free (ksets);
-        free (contacts);
-        return seq;
-      }
-    }
-    if ((nk > 0) && (ksets != NULL))
-      free (ksets);
+  pthread_mutex_lock (&unacked_mutex);
+  load_unacked ();
+  struct sent_ack * sa = find_sent_ack (message_ack);
+  struct unacked_window * w = ((sa == NULL) ? NULL : find_window (sa->k));
+  if ((sa == NULL) || (! sa->sent) || (w == NULL)) {
+    pthread_mutex_unlock (&unacked_mutex);
+    return 0;
   }
-  if ((nc > 0) && (contacts != NULL))
-    free (contacts);
-  return 0;
+  uint64_t seq = sa->seq;
+  keyset k = sa->k;
+  char * peer = strcpy_malloc (w->contact, "ack_received");
+  int is_new = (! sa->acked);
+  if (is_new) {
+    sa->acked = 1;
+    window_clear (w, seq);
+  }
+  pthread_mutex_unlock (&unacked_mutex);
+  if (is_new) {
+    save_record (peer, k, MSG_TYPE_ACK, seq, 0, 0, allnet_time (),
+                 message_ack, NULL, 0, NULL);
+    if (new_ack != NULL)
+      *new_ack = 1;
+  }
+  if (contact != NULL)
+    *contact = peer;
+  else
+    free (peer);
+  if (kset != NULL)
+    *kset = k;
+  return seq;
 }
 
 static uint64_t max_seq (const char * contact, keyset k, int wanted)
@@ -353,220 +609,107 @@ contact, missing_count, singles_used, ranges_used);
   return size;
 }
 
-struct unacked_cache_record {
-  keyset k;
-  int singles;
-  int ranges;
-  char * result;
-};
-
-static struct unacked_cache_record * unacked_cache = NULL;
-static unsigned int unacked_cache_num_entries = 0;
-static pthread_mutex_t unacked_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-/* called with unacked_cache_mutex held */
-static void print_unacked_cache (int return_value, keyset k)
-{
-  printf ("%d unacked cache entries, cache %p",
-          unacked_cache_num_entries, unacked_cache);
-  if (return_value != -1)
-    printf (", k %d, r %d", k, return_value);
-  printf ("\n");
-  if ((unacked_cache_num_entries > 0) && (unacked_cache != NULL)) {
-    int i;
-    for (i = 0; i < unacked_cache_num_entries; i++) {
-      printf ("%d [%d]: %d, %d, %p\n", unacked_cache [i].k, i,
-              unacked_cache [i].singles, unacked_cache [i].ranges,
-              unacked_cache [i].result);
-    }
-  }
-}
-
-static void reset_unacked_cache ()
-{
-  pthread_mutex_lock (&unacked_cache_mutex);
-  print_unacked_cache (-4, -2);
-  if (unacked_cache != NULL) {
-    int i;
-    for (i = 0; i < unacked_cache_num_entries; i++) {
-      if (unacked_cache [i].result != NULL)
-        free (unacked_cache [i].result);
-    }
-    free (unacked_cache);
-  }
-  unacked_cache = NULL;
-  unacked_cache_num_entries = 0;
-  pthread_mutex_unlock (&unacked_cache_mutex);
-printf ("reset unacked cache\n");
-}
-
-static int found_in_unacked_cache (const char * contact, keyset k,
-                                   int * singles, int * ranges, char ** result)
-{
-  *singles = 0;
-  *ranges = 0;
-  *result = NULL;
-  int return_value = 0;
-  pthread_mutex_lock (&unacked_cache_mutex);
-  int i;
-  for (i = 0; i < unacked_cache_num_entries; i++) {
-    if (k == unacked_cache [i].k) {
-      *singles = unacked_cache [i].singles;
-      *ranges = unacked_cache [i].ranges;
-      size_t size = (*singles + 2 * (*ranges)) * COUNTER_SIZE;
-      if ((size > 0) && (unacked_cache [i].result != NULL))
-        *result = memcpy_malloc (unacked_cache [i].result, size,
-                                 "message.c found_in_unacked_cache");
-      return_value = 1;
-      break;
-    }
-  }
-#ifdef DEBUG_PRINT
-  print_unacked_cache (return_value, k);
-#endif /* DEBUG_PRINT */
-  pthread_mutex_unlock (&unacked_cache_mutex);
-  return return_value;
-}
-
-static void add_to_unacked_cache (const char * contact, keyset k,
-                                  int singles, int ranges, const char * result)
-{
-  pthread_mutex_lock (&unacked_cache_mutex);
-  int position = -1;  /* index where we will insert the new entry */
-  int i;
-  for (i = 0; i < unacked_cache_num_entries; i++) {
-    if (unacked_cache [i].k == k) {
-      position = i;
-      if (unacked_cache [i].result != NULL)
-        free (unacked_cache [i].result);
-      unacked_cache [i].result = NULL;
-      break;
-    }
-  }
-  if (position == -1) {
-    for (i = 0; i < unacked_cache_num_entries; i++) {
-      if (unacked_cache [i].k == -1) {  /* free entry */
-        position = i;
-        if (unacked_cache [i].result != NULL)
-          free (unacked_cache [i].result);
-        unacked_cache [i].result = NULL;
-        break;
-      }
-    }
-  }
-  struct unacked_cache_record * old_unacked_cache = NULL;
-  if ((unacked_cache == NULL) || (position == -1)) {
-    /* not found and none free, add a new entry to the end of the cache */
-    old_unacked_cache = unacked_cache;
-    position = unacked_cache_num_entries;
-    unacked_cache_num_entries++;
-    /* realloc works like malloc if unacked_cache is NULL */
-    unacked_cache = realloc (unacked_cache,
-                             sizeof (struct unacked_cache_record) *
-                             unacked_cache_num_entries);
-  }
-  if (unacked_cache == NULL) { /* realloc failed, just discard the cache */
-    unacked_cache = old_unacked_cache;  /* the one that might not be NULL */
-    reset_unacked_cache ();
-  } else {
-    unacked_cache [position].k = k;
-    unacked_cache [position].singles = singles;
-    unacked_cache [position].ranges = ranges;
-    size_t size = (singles + 2 * ranges) * COUNTER_SIZE;
-    if ((size > 0) && (result != NULL))
-      unacked_cache [position].result =
-        memcpy_malloc (result, size, "message.c add_to_unacked_cache");
-    else
-      unacked_cache [position].result = NULL;
-  }
-#ifdef DEBUG_PRINT
-  print_unacked_cache (1, k);
-#endif /* DEBUG_PRINT */
-  pthread_mutex_unlock (&unacked_cache_mutex);
-}
+#define MAX_UNACKED	MAX_MISSING
+#define ONE_WEEK_SECONDS	(60 * 60 * 24 * 7)
 
 /* returns a new (malloc'd) array, or NULL in case of error
  * the new array has (singles + 2 * ranges) * COUNTER_SIZE bytes.
  * the first *singles sequence numbers are individual sequence numbers
  * for which we never received an ack.
  * the next *ranges * 2 sequence numbers are pairs a, b such that we have
- * not received acks for the sequence numbers a <= seq <= b */
+ * not received acks for the sequence numbers a <= seq <= b
+ * at most MAX_UNACKED sequence numbers are returned, most recent first */
 char * get_unacked (const char * contact, keyset k, int * singles, int * ranges)
 {
   *singles = 0;
   *ranges = 0;
-  char * result = NULL;
-  if (found_in_unacked_cache (contact, k, singles, ranges, &result))
-    return result;
-  uint64_t last = max_seq (contact, k, MSG_TYPE_SENT);
-  if (last < 1)
-    return NULL;
-/* the current implementation is quite simple and only returns singles */
-#define MAX_UNACKED	MAX_MISSING
-  result = malloc_or_fail (MAX_UNACKED * COUNTER_SIZE, "get_unacked");
-  int unacked = 0;
-  uint64_t i;
-  unsigned long long int now = allnet_time ();
-  for (i = last; i > 0; i--) {
-    uint64_t mtime = 0;
-    if (! is_acked_one (contact, k, i, &mtime)) {
-      uint64_t age = ((now > mtime) ? (now - mtime) : 0);
-      long long int selected = random_int (0, age);
-#define ONE_WEEK_SECONDS	(60 * 60 * 24 * 7)
-      /* if it's an old message make it less likely we will resend
-       * if the message is less than a week old, always resend */
-      if (selected < ONE_WEEK_SECONDS) {
-         writeb64 (result + unacked * COUNTER_SIZE, i);
-         unacked++;
-         if (unacked >= MAX_UNACKED) {
-           *singles = unacked;
-           add_to_unacked_cache (contact, k, *singles, *ranges, result);
-           return result;
+  /* copy the unacked sequence numbers, to look up their times unlocked */
+  uint64_t * unacked = NULL;
+  int num_unacked = 0;
+  pthread_mutex_lock (&unacked_mutex);
+  load_unacked ();
+  struct unacked_window * w = find_window (k);
+  if ((w != NULL) && (w->words > 0)) {
+    int alloc = 0;
+    int word;
+    for (word = w->words - 1; word >= 0; word--) {
+      uint64_t bits = w->bits [word];
+      int bit;
+      for (bit = 63; (bits != 0) && (bit >= 0); bit--) {
+        if (((bits >> bit) & 1) == 0)
+          continue;
+        if (num_unacked >= alloc) {
+          alloc = alloc * 2 + 64;
+          uint64_t * p = realloc (unacked, alloc * sizeof (uint64_t));
+          if (p == NULL)
+            break;
+          unacked = p;
         }
+        unacked [num_unacked++] = w->base + 64 * word + bit;
       }
     }
   }
-  if (unacked == 0) {   /* everything has been acked for this contact and key */
-    free (result);
-    add_to_unacked_cache (contact, k, *singles, *ranges, NULL);
+  pthread_mutex_unlock (&unacked_mutex);
+  if (num_unacked == 0) {
+    if (unacked != NULL)
+      free (unacked);
     return NULL;
   }
-  *singles = unacked;
-  add_to_unacked_cache (contact, k, *singles, *ranges, result);
+  /* if it's an old message make it less likely we will resend
+   * if the message is less than a week old, always resend */
+  uint64_t selected [MAX_UNACKED];
+  int num_selected = 0;
+  unsigned long long int now = allnet_time ();
+  int i;
+  for (i = 0; (i < num_unacked) && (num_selected < MAX_UNACKED); i++) {
+    uint64_t mtime = 0;
+    if (find_seq_record (contact, k, MSG_TYPE_SENT, unacked [i], &mtime,
+                         NULL, NULL, NULL, NULL, NULL) != MSG_TYPE_SENT)
+      continue;
+    uint64_t age = ((now > mtime) ? (now - mtime) : 0);
+    if (random_int (0, age) < ONE_WEEK_SECONDS)
+      selected [num_selected++] = unacked [i];
+  }
+  free (unacked);
+  if (num_selected == 0)
+    return NULL;
+  /* consecutive sequence numbers are returned as ranges, after the singles */
+  char * result = malloc_or_fail (num_selected * 2 * COUNTER_SIZE,
+                                  "get_unacked");
+  int num_singles = 0;
+  for (i = 0; i < num_selected; i++)
+    if (((i == 0) || (selected [i - 1] != selected [i] + 1)) &&
+        ((i + 1 == num_selected) || (selected [i] != selected [i + 1] + 1)))
+      num_singles++;
+  char * single = result;
+  char * range = result + num_singles * COUNTER_SIZE;
+  i = 0;
+  while (i < num_selected) {
+    int j = i;
+    while ((j + 1 < num_selected) && (selected [j] == selected [j + 1] + 1))
+      j++;
+    if (j == i) {
+      writeb64 (single, selected [i]);
+      single += COUNTER_SIZE;
+      (*singles)++;
+    } else {
+      writeb64 (range, selected [j]);
+      writeb64 (range + COUNTER_SIZE, selected [i]);
+      range += 2 * COUNTER_SIZE;
+      (*ranges)++;
+    }
+    i = j + 1;
+  }
   return result;
 }
 
-/* if there is a cache of unacked messages, reload.
- * call if you send a message to this contact
- * called internally by ack_received if the ack is new */
+/* the unacked messages are kept up to date by save_outgoing and
+ * ack_received, so this only makes sure they have been loaded */
 void reload_unacked_cache (const char * contact, keyset k)
 {
-  pthread_mutex_lock (&unacked_cache_mutex);
-  int i;
-  for (i = 0; i < unacked_cache_num_entries; i++) {
-    if (k == unacked_cache [i].k) {
-      unacked_cache [i].k = -1;  /* disable this entry for now */
-      unacked_cache [i].singles = 0;
-      unacked_cache [i].ranges = 0;
-      if (unacked_cache [i].result != NULL)
-        free (unacked_cache [i].result);
-      unacked_cache [i].result = NULL;
-      break;
-    }
-  }
-#ifdef DEBUG_PRINT
-  print_unacked_cache (2, k);
-#endif /* DEBUG_PRINT */
-  pthread_mutex_unlock (&unacked_cache_mutex);
-  /* now refill the cache entry by calling get_unacked */
-  int singles;
-  int ranges;
-  char * result = get_unacked (contact, k, &singles, &ranges);
-  if (result != NULL)
-    free (result);    /* never used */
-#ifdef DEBUG_PRINT
-  printf ("reloaded unacked cache for %s, %d\n", contact, k);
-#endif /* DEBUG_PRINT */
+  pthread_mutex_lock (&unacked_mutex);
+  load_unacked ();
+  pthread_mutex_unlock (&unacked_mutex);
 }
 
 /* returns 1 if this sequence number has been acked by all the recipients,
@@ -595,179 +738,26 @@ int is_acked (const char * contact, uint64_t seq)
 int is_acked_one (const char * contact, keyset k, uint64_t wanted,
                   uint64_t * timep)
 {
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
+  if ((timep != NULL) &&
+      (find_seq_record (contact, k, MSG_TYPE_SENT, wanted, timep, NULL, NULL,
+                        NULL, NULL, NULL) != MSG_TYPE_SENT))
     return 0;
-  int type;
-  uint64_t seq;
-  char ack [MESSAGE_ID_SIZE];
-  while ((type = prev_message (iter, &seq, timep, NULL, NULL, ack, NULL, NULL))
-         != MSG_TYPE_DONE) {
-    if ((type == MSG_TYPE_SENT) && (seq == wanted)) {
-/* this is the first (most recent) message sent with this sequence number.
- * we simply report whether this one has been acked -- the others are not
- * so important */
-      uint64_t result_seq = find_ack (contact, k, ack, MSG_TYPE_ACK, NULL);
-      free_iter (iter);
-      return (result_seq > 0);
-    }
-  }
-  free_iter (iter);
-  return 0;
-}
-
-/* if add != 0, and not found, it is added to the cache
- * returns 1 if found in the cache, 0 otherwise, and -1 if the cache is
- * for a different contact or keyset and add is 0. */
-static int is_in_cache (const char * contact, keyset k, uint64_t seq, int add)
-{
-#ifdef DEBUG_PRINT
-  if ((add) && (strcmp (contact, "edo-on-maru") == 0))
-    printf ("for %s/%d adding %" PRIu64 "\n", contact, k, seq);
-#endif /* DEBUG_PRINT */
-/* this cache only supports one contact at a time.  That gives reasonable
- * performance at the beginning, when we are loading the list of contacts,
- * but has some cost when we switch contacts */
-  static char * cached_contact = NULL;
-  static keyset cached_k = -1;
-/* a cache entry consists of the first and last sequence number known. */
-  struct cache_entry {
-    uint64_t first;
-    uint64_t last;
-  };
-  static struct cache_entry * cache = NULL;
-  static int cache_used = 0;
-  static int cache_alloc = 0;
-#ifdef DEBUG_PRINT
-  if ((cache_used > 0) && (cached_contact != NULL)) {
-    printf ("contact '%s'/'%s', seq %ju, add %d, used %d, k %d/%d",
-            cached_contact, contact, (uintmax_t) seq, add, cache_used,
-            cached_k, k);
-    int x;
-    for (x = 0; x < cache_used; x++)
-      printf (", %ju..%ju", (uintmax_t) (cache [x].first),
-              (uintmax_t) (cache [x].last));
-    printf ("\n");
-  }
-#endif /* DEBUG_PRINT */
-  if ((cached_contact == NULL) || (strcmp (contact, cached_contact) != 0) ||
-      (k != cached_k)) {  /* not found */
-    if (add) {  /* initialize or reinitialize */
-#ifdef DEBUG_PRINT
-      printf ("adding %s, keyset %d, seq %ju\n", contact, k, (uintmax_t) seq);
-#endif /* DEBUG_PRINT */
-      if (cached_contact != NULL)
-        free (cached_contact);
-      cached_contact = strcpy_malloc (contact, "message.c is_in_cache contact");
-      cached_k = k;
-      if ((cache_alloc < 1) || (cache == NULL)) {
-        cache_alloc = 10;
-        cache = malloc_or_fail (sizeof (struct cache_entry) * cache_alloc,
-                                "message.c is_in_cache");
-      }
-      cache [0].first = seq;
-      cache [0].last = seq;
-      cache_used = 1;
-      return 0;  /* was not in the cache, even though it is now */
-    } else {
-      return -1; /* different contact, do not add */
-    }
-  }
-  int i;
-  for (i = 0; i < cache_used; i++) {
-    if ((seq >= cache [i].first) && (seq <= cache [i].last)) {
-#ifdef DEBUG_PRINT
-      printf ("returning found\n");
-#endif /* DEBUG_PRINT */
-      return 1;
-    }
-  }
-/* not found, will return 0, perhaps after adding */
-  if (add) {
-/* keep the cache in sorted order.
- * Later, here and above we may do binary instead of linear search */
-    int add_at_index = cache_used;  /* add at the end unless add sooner */
-    for (i = 0; i < cache_used; i++) {
-      if ((cache [i].last + 1 == seq) && (i + 1 < cache_used) &&
-          (seq + 1 == cache [i + 1].first)) {  /* merge */
-        cache [i].last = cache [i + 1].last;
-        /* shift down the rest of the array (if any) and decrement cache_used */
-        int j;
-        for (j = i + 1; j + 1 < cache_used; j++)
-          cache [j] = cache [j + 1];
-        cache_used--;
-        return 0;  /* not found */
-      } else if (cache [i].last + 1 == seq) {   /* increase last */
-        cache [i].last = seq;
-        return 0;  /* not found */
-      } else if (seq + 1 == cache [i].first) {  /* decrease first */
-        cache [i].first = seq;
-        return 0;  /* not found */
-      } else if (seq < cache [i].first) {       /* add before this */
-        add_at_index = i;
-        break;
-      }
-    }
-    /* did not find, add at add_at_index */
-    /* adding new enry, reallocate if necessary */
-    struct cache_entry * old_cache = cache;
-    int old_cache_alloc = cache_alloc;
-    if ((cache_alloc < cache_used + 1) || (cache == NULL)) {
-      cache_alloc = 10 + cache_alloc * 2;  /* cache size only grows */
-      /* if cache is null, realloc is the same as malloc */
-      cache = realloc (cache, sizeof (struct cache_entry) * cache_alloc);
-    }
-    if (cache == NULL) {  /* realloc failed, reuse the old cache */
-      printf ("message.c is_in_cache: realloc %zd failed\n",
-              sizeof (struct cache_entry) * cache_alloc);
-      cache = old_cache;
-      cache_alloc = old_cache_alloc;
-      return 0;
-    }
-    /* shift up the rest of the array (if any) and increment cache_used */
-    int j;
-    for (j = cache_used; j > add_at_index - 1; j--)
-      cache [j] = cache [j - 1];
-    cache_used++;
-    /* save the new entry */
-    cache [add_at_index].first = seq;
-    cache [add_at_index].last = seq;
-#ifdef DEBUG_PRINT
-    if (cache_used > 0) {
-      printf (" added '%s' %ju", contact, (uintmax_t)seq);
-    int x;
-    for (x = 0; x < cache_used; x++)
-      printf (", %ju..%ju", (uintmax_t) (cache [x].first),
-              (uintmax_t) (cache [x].last));
-    printf ("\n");
-    }
-#endif /* DEBUG_PRINT */
-  }
-  return 0;  /* not found */
+/* the window only has the most recent message sent with each sequence
+ * number.  we simply report whether this one has been acked -- the others
+ * are not so important */
+  pthread_mutex_lock (&unacked_mutex);
+  load_unacked ();
+  struct unacked_window * w = find_window (k);
+  int result = ((w != NULL) && (wanted > 0) && (wanted <= w->last) &&
+                (! window_is_set (w, wanted)));
+  pthread_mutex_unlock (&unacked_mutex);
+  return result;
 }
 
 /* returns 1 if this sequence number has been received, 0 otherwise */
 int was_received (const char * contact, keyset k, uint64_t wanted)
 {
-  int cached = is_in_cache (contact, k, wanted, 0);
-  if (cached >= 0)   /* cache is authoritative */
-    return cached;
-  /* rebuild the cache */
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
-  uint64_t seq;
-  int found = 0;
-  while ((type = prev_message (iter, &seq, NULL, NULL, NULL, NULL,
-                               NULL, NULL)) != MSG_TYPE_DONE) {
-    if (type == MSG_TYPE_RCVD) {
-      found = found || (seq == wanted);
-      is_in_cache (contact, k, seq, 1);  /* add to cache */
-    }
-  }
-  free_iter (iter);
-  return found;
+  return received_seq (k, wanted);
 }
 
 static char * message_id_cache = NULL;
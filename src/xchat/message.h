@@ -86,9 +86,8 @@ extern int get_missing (const char * contact, keyset k,
  * such that any seq such that a <= seq <= b has no acknowledged */
 extern char * get_unacked (const char * contact, keyset k,
                            int * singles, int * ranges);
-/* if there is a cache of unacked messages, reload.
- * call if you send a message to this contact or
- * if you get a new ack for this contact */
+/* the unacked messages are kept in memory, and updated as messages are
+ * saved and acks received.  This only makes sure they have been loaded */
 extern void reload_unacked_cache (const char * contact, keyset k);
 
 /* returns 1 if this sequence number has been acked by all the recipients,
@@ -4,12 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "lib/packet.h"
 #include "lib/media.h"
 #include "lib/util.h"
 #include "lib/priority.h"
 #include "lib/keys.h"
+#include "lib/sha.h"
 #include "chat.h"
 #include "message.h"
 #include "cutil.h"
@@ -18,6 +20,84 @@
 
 /* #define DEBUG_PRINT */
 
+/* the allnet xchat protocol has two mechanisms for retransmitting:
+ * - pull: a receiver that knows it is lacking some message will
+ *   request them, sending a chat_control_request
+ * - push: a sender with unacked message will retransmit them
+ * both are done when a message from the peer indicates the peer may
+ * be reachable, so a burst of packets from a peer can lead to the same
+ * request being sent several times, and to the same messages being
+ * resent both because they were requested and because they are unacked.
+ * Each message and each distinct request is encrypted and sent at most
+ * once per keyset within RETRANSMIT_COALESCE_SECONDS.  Recent sends are
+ * kept in small tables indexed by a hash of the keyset (and sequence
+ * number), so an older entry may be overwritten, leading at worst to
+ * a duplicate send */
+#ifndef RETRANSMIT_COALESCE_SECONDS
+#define RETRANSMIT_COALESCE_SECONDS	10
+#endif /* RETRANSMIT_COALESCE_SECONDS */
+#define RECENT_RESENDS			1024
+#define RECENT_REQUESTS			256
+#define REQUEST_HASH_SIZE		16
+
+struct recent_resend {
+  keyset k;
+  uint64_t seq;
+  unsigned long long int time;   /* 0 if not used */
+};
+static struct recent_resend recent_resends [RECENT_RESENDS];
+
+struct recent_request {
+  keyset k;
+  char hash [REQUEST_HASH_SIZE];
+  unsigned long long int time;   /* 0 if not used */
+};
+static struct recent_request recent_requests [RECENT_REQUESTS];
+
+static pthread_mutex_t recent_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* returns 1 if this message was resent within RETRANSMIT_COALESCE_SECONDS,
+ * otherwise records that it is being resent now, and returns 0 */
+static int resent_recently (keyset k, uint64_t seq)
+{
+  unsigned long long int now = allnet_time ();
+  unsigned int index =
+    ((((unsigned int) k) * 2654435761U) ^ ((unsigned int) seq)) %
+    RECENT_RESENDS;
+  pthread_mutex_lock (&recent_mutex);
+  struct recent_resend * r = recent_resends + index;
+  int result = ((r->time != 0) && (r->k == k) && (r->seq == seq) &&
+                (now < r->time + RETRANSMIT_COALESCE_SECONDS));
+  if (! result) {
+    r->k = k;
+    r->seq = seq;
+    r->time = now;
+  }
+  pthread_mutex_unlock (&recent_mutex);
+  return result;
+}
+
+/* same as resent_recently, for an entire retransmit request */
+static int requested_recently (keyset k, const char * request, int rsize)
+{
+  char hash [REQUEST_HASH_SIZE];
+  sha512_bytes (request, rsize, hash, sizeof (hash));
+  unsigned long long int now = allnet_time ();
+  unsigned int index = ((unsigned int) k) % RECENT_REQUESTS;
+  pthread_mutex_lock (&recent_mutex);
+  struct recent_request * r = recent_requests + index;
+  int result = ((r->time != 0) && (r->k == k) &&
+                (memcmp (r->hash, hash, sizeof (hash)) == 0) &&
+                (now < r->time + RETRANSMIT_COALESCE_SECONDS));
+  if (! result) {
+    r->k = k;
+    memcpy (r->hash, hash, sizeof (hash));
+    r->time = now;
+  }
+  pthread_mutex_unlock (&recent_mutex);
+  return result;
+}
+
 /* figures out the number of singles and the number of ranges. */
 /* returns a dynamically allocated array (must be free'd) of
  *    (COUNTER_SIZE) bytes * (singles + 2 * ranges);
@@ -82,6 +162,7 @@ static void create_chat_control_request (const char * contact, char * missing,
   ccrp->type = CHAT_CONTROL_TYPE_REQUEST;
   ccrp->num_singles = num_singles;
   ccrp->num_ranges = num_ranges;
+  ccrp->features = CHAT_FEATURE_COMPRESS;
   writeb64u (ccrp->last_received, rcvd_sequence);
   int i;
   unsigned char * ptr = ccrp->counters;
@@ -148,6 +229,8 @@ int send_retransmit_request (const char * contact, keyset k, int sock,
   int size = sizeof (request);
   create_chat_control_request (contact, missing, num_singles, num_ranges,
                                rcvd_sequence, request, &size);
+  if ((size <= 0) || (requested_recently (k, request, size)))
+    return 0;
   int result = send_to_key (request, size, contact, k, sock,
                             hops, priority, expiration, 0, 0);
   return result;
@@ -226,98 +309,15 @@ static uint64_t get_prev (uint64_t last,
   return result;
 }
 
-#define LIMIT_RETRANSMIT_RATE_OFF  /* 2017/03/10: still experimenting, for now
-                                  keep it enabled -- 2018/09/19 turn it off */
-#ifdef LIMIT_RETRANSMIT_RATE
-/* the allnet xchat protocol has two mechanisms for retransmitting:
- * - pull: a receiver that knows it is lacking some message will
- *   request them, sending a chat_control_request
- * - push: a sender with unacked message will retransmit them
- * both are done when a message from the peer indicates the peer may
- * be reachable.
- *
- * This redundancy is good, leading perhaps to greater packet delivery.
- * However, it can also lead to unnecessary (duplicate) packet
- * retransmission, which is not particularly useful.
- *
- * To avoid duplicate retransmission, we remember the last few
- * retransmitted packets, and do not retransmit them again if they
- * were sent within the most recent TIME_BEFORE_RESEND.
- */
-/* #define TIME_BEFORE_RESEND	600    * 600 seconds, 10 min */
-#define TIME_BEFORE_RESEND	27    /* 27 seconds, ~1/2 min */
-#define NUM_RECENTLY_RESENT	100
-struct resend_info {
-  uint64_t seq;
-  char * contact;
-  keyset k;
-  time_t resend_time;
-};
-static struct resend_info recently_resent [NUM_RECENTLY_RESENT];
-static int latest_resent = 0;
-
-static void init_resent ()
-{
-  static int initialized = 0;
-  if (! initialized) {
-    initialized = 1;
-    int i;
-    for (i = 0; i < NUM_RECENTLY_RESENT; i++) {
-      recently_resent [i].seq = 0;
-      recently_resent [i].contact = NULL;
-      recently_resent [i].k = -1;
-    }
-    latest_resent = 0;
-  }
-}
-
-static int was_recently_resent (uint64_t seq, const char * contact, keyset k)
-{
-  int i;
-  for (i = 0; i < NUM_RECENTLY_RESENT; i++) {
-    if ((recently_resent [i].contact != NULL) &&
-        (recently_resent [i].seq == seq) &&
-        (recently_resent [i].k == k) &&
-        (strcmp (recently_resent [i].contact, contact) == 0) &&
-        (allnet_time () <
-         (unsigned long long int) (recently_resent [i].resend_time) +
-                                  TIME_BEFORE_RESEND))
-      return 1;
-  }
-  return 0;
-}
-
-static void record_resend (uint64_t seq, const char * contact, keyset k)
-{
-  latest_resent = (latest_resent + 1) % NUM_RECENTLY_RESENT;
-  if (recently_resent [latest_resent].contact != NULL)
-    free (recently_resent [latest_resent].contact);
-  recently_resent [latest_resent].seq = seq;
-  recently_resent [latest_resent].k = k;
-  recently_resent [latest_resent].contact =
-      strcpy_malloc (contact, "record_resend");
-  recently_resent [latest_resent].resend_time = (time_t) (allnet_time ());
-}
-#endif /* LIMIT_RETRANSMIT_RATE */
-
-static void resend_message (uint64_t seq, const char * contact,
-                            keyset k, int sock,
-                            unsigned int hops, unsigned int priority)
+/* returns 1 if the message was resent, 0 if not found or resent recently */
+static int resend_message (uint64_t seq, const char * contact,
+                           keyset k, int sock,
+                           unsigned int hops, unsigned int priority)
 {
 #ifdef DEBUG_PRINT
   printf ("resending message with sequence %ju to %s/%d\n",
           (uintmax_t)seq, contact, k);
 #endif /* DEBUG_PRINT */
-#ifdef LIMIT_RETRANSMIT_RATE
-  init_resent ();
-  if (was_recently_resent (seq, contact, k)) {
-#ifdef DEBUG_PRINT
-    printf ("recently resent seq %ju %s/%d, not sending again\n",
-            (uintmax_t)seq, contact, k);
-#endif /* DEBUG_PRINT */
-    return;
-  }
-#endif /* LIMIT_RETRANSMIT_RATE */
   int size;
   uint64_t time;
   char message_ack [MESSAGE_ID_SIZE];
@@ -327,15 +327,22 @@ static void resend_message (uint64_t seq, const char * contact,
     printf ("  resend_message %s %d: no outgoing %ju, %p %d\n",
             contact, k, (uintmax_t)seq, text, size);
 #endif /* DEBUG_PRINT */
-    return;
+    if (text != NULL)
+      free (text);
+    return 0;
+  }
+  if (resent_recently (k, seq)) {
+#ifdef DEBUG_PRINT
+    printf ("recently resent seq %ju %s/%d, not sending again\n",
+            (uintmax_t)seq, contact, k);
+#endif /* DEBUG_PRINT */
+    free (text);
+    return 0;
   }
 #ifdef DEBUG_PRINT
   printf ("  resending message with sequence %ju to %s: %s\n",
           (uintmax_t)seq, contact, text);
 #endif /* DEBUG_PRINT */
-#ifdef LIMIT_RETRANSMIT_RATE
-  record_resend (seq, contact, k);
-#endif /* LIMIT_RETRANSMIT_RATE */
   char * message = malloc_or_fail (size + CHAT_DESCRIPTOR_SIZE, "resend_msg");
   memset (message, 0, CHAT_DESCRIPTOR_SIZE);
   struct chat_descriptor * cdp = (struct chat_descriptor *) message;
@@ -364,6 +371,7 @@ static void resend_message (uint64_t seq, const char * contact,
 #endif /* DEBUG_PRINT */
   free (text);
   free (message);
+  return 1;
 }
 
 /* resends the messages requested by the retransmit message */
@@ -472,6 +480,7 @@ int resend_unacked (const char * contact, keyset k, int sock,
 
   int max_send = 8;
   int send_count = 0;
+  int sent = 0;       /* not counting messages that were resent recently */
   char * p = unacked;
   int i;
   for (i = 0; (i < singles) && (send_count < max_send); i++) {
@@ -480,7 +489,7 @@ int resend_unacked (const char * contact, keyset k, int sock,
     printf ("seq %ju at %p\n", (uintmax_t)seq, p);
 #endif /* DEBUG_PRINT */
     p += sizeof (uint64_t);
-    resend_message (seq, contact, k, sock, hops, priority);
+    sent += resend_message (seq, contact, k, sock, hops, priority);
     send_count++;
   }
   for (i = 0; (i < ranges) && (send_count < max_send); i++) {
@@ -489,13 +498,41 @@ int resend_unacked (const char * contact, keyset k, int sock,
     uint64_t finish = readb64 (p);
     p += COUNTER_SIZE;
     while ((send_count < max_send) && (start <= finish)) {
-      resend_message (start, contact, k, sock, hops, priority);
+      sent += resend_message (start, contact, k, sock, hops, priority);
       start++;
       send_count++;
     }
   }
   free (unacked);
-  return send_count;
+  return sent;
+}
+
+/* the features are saved in the xchat directory of the keyset, as the
+ * number in decimal */
+void save_chat_features (const char * contact, keyset k,
+                         const char * msg, int msize)
+{
+  struct chat_control_request * ccrp = (struct chat_control_request *) msg;
+  if ((msize < (int) (sizeof (struct chat_control_request))) ||
+      (ccrp->type != CHAT_CONTROL_TYPE_REQUEST))
+    return;
+  int features = ccrp->features;
+  if (features == chat_features (contact, k))
+    return;
+  char content [20];
+  snprintf (content, sizeof (content), "%d\n", features);
+  xchat_file_write (contact, k, "features", content, (int) strlen (content));
+}
+
+int chat_features (const char * contact, keyset k)
+{
+  char * content = NULL;
+  if ((xchat_file_get (contact, k, "features", &content) <= 0) ||
+      (content == NULL))
+    return 0;
+  int features = atoi (content);
+  free (content);
+  return features;
 }
 
 /* retransmit any requested messages */
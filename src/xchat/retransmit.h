@@ -7,13 +7,15 @@
 #include "lib/keys.h"
 
 /* sends a chat_control message to request retransmission.
- * returns 1 for success, 0 in case of error or if there is nothing to send */
+ * returns 1 for success, 0 in case of error or if there is nothing to send,
+ * including if the same request was sent to this keyset a few seconds ago */
 extern int send_retransmit_request (const char * contact, keyset k, int sock,
                                     int hops, int priority,
                                     const char * expiration);
 
 /* resends up to max unacked messages */
-/* returns the number of messages sent, or 0 */
+/* returns the number of messages sent, or 0.  Messages that were resent
+ * to this keyset in the last few seconds are not sent again */
 extern int resend_unacked (const char * contact, keyset k, int sock, int hops,
                            int priority, int max);
 
@@ -21,4 +23,11 @@ extern int resend_unacked (const char * contact, keyset k, int sock, int hops,
 extern void do_chat_control (const char * contact, keyset k,
                              char * msg, int msize, int sock, int hops);
 
+/* records the features (CHAT_FEATURE_*) in a chat control request */
+extern void save_chat_features (const char * contact, keyset k,
+                                const char * msg, int msize);
+
+/* returns the features last received from this keyset, 0 if none */
+extern int chat_features (const char * contact, keyset k);
+
 #endif /* RETRANSMIT_H */
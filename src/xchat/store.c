@@ -38,6 +38,8 @@ struct msg_iter {
   char * contact;         /* dynamically allocated */
   keyset k;
   int is_in_memory;
+  int use_records;        /* if not in memory, read the binary log */
+  int record_pos;         /* the next record returned is before this one */
   /* used in case the data is not already in memory */
   char * dirname;         /* dynamically allocated */
   char * current_fname;   /* dynamically allocated */
@@ -54,57 +56,231 @@ struct msg_iter {
 /* note, messages in the message cache are in reverse order, i.e. the
  * most recent first and the oldest last */
 struct message_cache_record {
-  char * contact;  /* dynamically allocated, but never freed */
+  char * contact;  /* dynamically allocated, NULL if this entry is free */
   struct message_store_info * msgs;
   int num_alloc;
   int num_used;
+  int loaded;            /* 1 once msgs has been read from the files */
+  size_t bytes;          /* used by msgs and its messages */
+  uint64_t last_use;     /* for replacing the least recently used */
+  int users;             /* calls and iterators using this entry */
+  pthread_mutex_t mutex; /* held while reading or changing msgs */
 };
 
-#define MESSAGE_CACHE_NUM_CONTACTS	10000
+/* the messages of the most recently used contacts are kept in memory, up
+ * to MESSAGE_CACHE_MAX_BYTES in all.  Entries are evicted least recently
+ * used first, except the most recently used entry and entries in use */
+#ifndef MESSAGE_CACHE_NUM_CONTACTS
+#define MESSAGE_CACHE_NUM_CONTACTS	1024
+#endif /* MESSAGE_CACHE_NUM_CONTACTS */
+#ifndef MESSAGE_CACHE_MAX_BYTES
+#define MESSAGE_CACHE_MAX_BYTES		(64 * 1024 * 1024)
+#endif /* MESSAGE_CACHE_MAX_BYTES */
 static struct message_cache_record message_cache [MESSAGE_CACHE_NUM_CONTACTS];
-static int message_cache_count = 0;
-/* this mutex should be acquired each time before accessing message_cache
- * or message_cache_count, and released at the end of any related set
- * of accesses */
+static size_t message_cache_bytes = 0;
+static uint64_t message_cache_clock = 0;
+/* this mutex should be acquired each time before finding, adding, or
+ * evicting entries of message_cache, or changing their contact, bytes,
+ * last_use or users.  No other mutex (in particular, no entry mutex)
+ * may be acquired while holding it, except the mutex of an entry with
+ * no users, which no thread can be holding */
 static pthread_mutex_t message_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t message_cache_once = PTHREAD_ONCE_INIT;
+
+/* used in init_message_cache, but declared lower down */
+static void shrink_message_cache (long long int excess);
+
+static void init_message_cache (void)
+{
+  int i;
+  for (i = 0; i < MESSAGE_CACHE_NUM_CONTACTS; i++)
+    pthread_mutex_init (&(message_cache [i].mutex), NULL);
+  allnet_memory_register_shrink (ALLNET_MEMORY_STORE, shrink_message_cache);
+}
 
 /* returns -1 if not found */
 /* must be called with the mutex held */
 static int find_message_cache_record (const char * contact)
 {
   int i;
-  for (i = 0; i < message_cache_count; i++)
-    if (strcmp (contact, message_cache [i].contact) == 0)
+  for (i = 0; i < MESSAGE_CACHE_NUM_CONTACTS; i++)
+    if ((message_cache [i].contact != NULL) &&
+        (strcmp (contact, message_cache [i].contact) == 0))
       return i;
   return -1;
 }
 
-/* returns -1 if unable to add, the record index otherwise */
+/* must be called with the entry's mutex held, or with no users */
+static size_t message_cache_size (struct message_cache_record * cache)
+{
+  size_t result = cache->num_alloc * sizeof (struct message_store_info);
+  int i;
+  for (i = 0; i < cache->num_used; i++)
+    if (cache->msgs [i].message != NULL)
+      result += cache->msgs [i].msize + 1;
+  return result;
+}
+
+/* must be called with the mutex held, and the entry must have no users */
+static void free_message_cache_record (struct message_cache_record * cache)
+{
+  if (cache->msgs != NULL) {
+    free_all_messages (cache->msgs, cache->num_used);
+    free (cache->msgs);
+  }
+  if (cache->contact != NULL)
+    free (cache->contact);
+  message_cache_bytes -= cache->bytes;
+  allnet_memory_account (ALLNET_MEMORY_STORE, - (long long int) cache->bytes);
+  cache->contact = NULL;
+  cache->msgs = NULL;
+  cache->num_alloc = 0;
+  cache->num_used = 0;
+  cache->loaded = 0;
+  cache->bytes = 0;
+}
+
+/* returns the least recently used entry that may be evicted, or NULL.
+ * must be called with the mutex held */
+static struct message_cache_record * oldest_message_cache_record ()
+{
+  struct message_cache_record * result = NULL;
+  int i;
+  for (i = 0; i < MESSAGE_CACHE_NUM_CONTACTS; i++) {
+    struct message_cache_record * cache = message_cache + i;
+    if ((cache->contact != NULL) && (cache->users == 0) &&
+        (cache->last_use != message_cache_clock) &&   /* not most recent */
+        ((result == NULL) || (cache->last_use < result->last_use)))
+      result = cache;
+  }
+  return result;
+}
+
+/* evicts entries until at most limit bytes are cached, or all
+ * remaining entries are in use.  Must be called with the mutex held */
+static void evict_message_cache_to (size_t limit)
+{
+  while (message_cache_bytes > limit) {
+    struct message_cache_record * oldest = oldest_message_cache_record ();
+    if (oldest == NULL)   /* all in use */
+      return;
+    free_message_cache_record (oldest);
+  }
+}
+
 /* must be called with the mutex held */
-static int add_message_cache_record (const char * contact,
-                                     struct message_store_info * msgs,
-                                     int num_alloc,
-                                     int num_used)
+static void evict_message_cache ()
+{
+  evict_message_cache_to (MESSAGE_CACHE_MAX_BYTES);
+}
+
+/* called by the memory accounting when the process is over its memory
+ * budget: evicts enough entries, if possible, to free excess bytes */
+static void shrink_message_cache (long long int excess)
 {
-  if (message_cache_count >= MESSAGE_CACHE_NUM_CONTACTS) {
-    printf ("unable to add to message cache record for %s\n", contact);
+  pthread_mutex_lock (&message_cache_mutex);
+  size_t limit = 0;
+  if (message_cache_bytes > (size_t) excess)
+    limit = message_cache_bytes - (size_t) excess;
+  evict_message_cache_to (limit);
+  pthread_mutex_unlock (&message_cache_mutex);
+}
+
+/* returns a free entry, evicting one if necessary, or -1 if all are
+ * in use.  Must be called with the mutex held */
+static int new_message_cache_record ()
+{
+  int i;
+  for (i = 0; i < MESSAGE_CACHE_NUM_CONTACTS; i++)
+    if (message_cache [i].contact == NULL)
+      return i;
+  struct message_cache_record * oldest = oldest_message_cache_record ();
+  if (oldest == NULL)
     return -1;
-  }
+  free_message_cache_record (oldest);
+  return (int) (oldest - message_cache);
+}
+
+/* used in acquire_message_cache, but declared lower down */
+static void release_message_cache (int index, int locked, int changed);
+static int list_all_messages_from_file (const char * contact,
+                                        struct message_store_info ** msgs,
+                                        int * num_alloc, int * num_used);
+
+/* returns the index of the entry for contact, with its mutex held and
+ * counted as a user, or -1 if not available.  If load and the contact
+ * is not yet cached, reads its messages from the files.  The caller
+ * must call release_message_cache when done */
+static int acquire_message_cache (const char * contact, int load)
+{
+  pthread_once (&message_cache_once, init_message_cache);
+  pthread_mutex_lock (&message_cache_mutex);
   int index = find_message_cache_record (contact);
-  if (index == -1) {   /* not found, add new */
-    index = message_cache_count;
-    message_cache_count++;
-    message_cache [index].contact =
-      strcpy_malloc (contact, "add_message_cache_record");
-  } else if (message_cache [index].msgs != NULL) {
-    free (message_cache [index].msgs);
-  }
-  message_cache [index].msgs = msgs;
-  message_cache [index].num_alloc = num_alloc;
-  message_cache [index].num_used = num_used;
+  int new_entry = 0;
+  if ((index < 0) && (load)) {
+    index = new_message_cache_record ();
+    new_entry = (index >= 0);
+  }
+  if (index < 0) {
+    pthread_mutex_unlock (&message_cache_mutex);
+    return -1;
+  }
+  struct message_cache_record * cache = message_cache + index;
+  if (new_entry) {   /* no users, so nobody else has the entry mutex */
+    cache->contact = strcpy_malloc (contact, "acquire_message_cache");
+    pthread_mutex_lock (&(cache->mutex));
+  }
+  cache->users++;
+  cache->last_use = ++message_cache_clock;
+  pthread_mutex_unlock (&message_cache_mutex);
+  if (new_entry) {
+    cache->loaded =
+      list_all_messages_from_file (contact, &(cache->msgs),
+                                   &(cache->num_alloc), &(cache->num_used));
+    size_t bytes = (cache->loaded) ? message_cache_size (cache) : 0;
+    pthread_mutex_lock (&message_cache_mutex);
+    message_cache_bytes += bytes;
+    allnet_memory_account (ALLNET_MEMORY_STORE, (long long int) bytes);
+    cache->bytes = bytes;
+    evict_message_cache ();
+    pthread_mutex_unlock (&message_cache_mutex);
+  } else {
+    pthread_mutex_lock (&(cache->mutex));
+  }
+  if (! cache->loaded) {   /* unable to read the files */
+    release_message_cache (index, 1, 0);
+    return -1;
+  }
   return index;
 }
 
+/* the caller stops using the entry.  If locked, unlocks its mutex first.
+ * if changed, the messages were changed while locked */
+static void release_message_cache (int index, int locked, int changed)
+{
+  struct message_cache_record * cache = message_cache + index;
+  size_t bytes = (changed) ? message_cache_size (cache) : 0;
+  if (locked)
+    pthread_mutex_unlock (&(cache->mutex));
+  pthread_mutex_lock (&message_cache_mutex);
+  if (changed) {
+    message_cache_bytes = message_cache_bytes - cache->bytes + bytes;
+    allnet_memory_account (ALLNET_MEMORY_STORE, ((long long int) bytes) -
+                                                ((long long int) cache->bytes));
+    cache->bytes = bytes;
+  }
+  cache->users--;
+  if ((cache->users == 0) && (! cache->loaded))
+    free_message_cache_record (cache);
+  else if (changed)
+    evict_message_cache ();
+  pthread_mutex_unlock (&message_cache_mutex);
+}
+
+/* returns the number of records in the binary log for k, or -1 if
+ * not available.  Defined below */
+static int record_count (keyset k);
+
 /* returns 1 for success, 0 otherwise */
 static int start_iter_from_file (const char * contact, keyset k,
                                  struct msg_iter * result)
@@ -115,6 +291,8 @@ static int start_iter_from_file (const char * contact, keyset k,
   result->contact = strcpy_malloc (contact, "start_iter contact");
   result->k = k;
   result->is_in_memory = 0;
+  result->record_pos = record_count (k);
+  result->use_records = (result->record_pos >= 0);
   result->dirname = string_replace_once (directory, "contacts", "xchat", 1);
   result->current_fname = NULL;
   result->current_file = NULL;
@@ -124,62 +302,36 @@ static int start_iter_from_file (const char * contact, keyset k,
   return 1;
 }
 
-/* used in start_iter, but declared lower down */
-static int list_all_messages_from_file (const char * contact,
-                                        struct message_store_info ** msgs,
-                                        int * num_alloc, int * num_used);
-
 struct msg_iter * start_iter (const char * contact, keyset k)
 {
   if ((contact == NULL) || (k < 0))
     return NULL;
-  pthread_mutex_lock (&message_cache_mutex);
-  int index = find_message_cache_record (contact);
-  struct msg_iter file_iter;
-  if ((index < 0) &&  /* not already cached, get data from files */
-      (message_cache_count < MESSAGE_CACHE_NUM_CONTACTS)) {
-    struct message_store_info * msgs = NULL;
-    int num_used = 0;
-    int num_alloc = 0;
-    int success =
-      list_all_messages_from_file (contact, &msgs, &num_alloc, &num_used);
-    if (success) {
-      index = add_message_cache_record (contact, msgs, num_alloc, num_used);
-      if (index < 0) { /* unable to cache */
-        if ((msgs != NULL) && (num_used > 0))
-          free_all_messages (msgs, num_used);
-        if (! start_iter_from_file (contact, k, &file_iter)) {
-          pthread_mutex_unlock (&message_cache_mutex);
-          return NULL;   /* unable to cache, unable to find file */
-        }
-      }
-    } else {   /* unable to list messages, probably unable to find file */
-      pthread_mutex_unlock (&message_cache_mutex);
-      return NULL;
-    }
-  }
-  /* this code handles messages in cache, whether found or added */
   struct msg_iter * result = malloc_or_fail (sizeof (struct msg_iter),
                                              "start_iter struct");
+  /* the iterator remains a user of the cache entry until free_iter */
+  int index = acquire_message_cache (contact, 1);
+  if (index < 0) {   /* unable to cache, use file */
+    if (! start_iter_from_file (contact, k, result)) {
+      free (result);
+      return NULL;   /* unable to cache, unable to find file */
+    }
+    return result;
+  }
+  pthread_mutex_unlock (&(message_cache [index].mutex));
   result->contact = strcpy_malloc (contact, "start_iter contact");
   result->k = k;
-  if (index >= 0) {
-    result->is_in_memory = 1;
-    result->message_cache_index = index;
-    result->last_message_index = -1;
-    result->ack_returned = 0;
-    /* set the other values to reasonable defaults */
-    result->dirname = NULL;
-    result->current_fname = NULL;
-    result->current_file = NULL;
-    result->current_size = 0;
-    result->current_pos = 0;
-  } else { /* unable to cache, use file */
-    /* *result = file_iter -- file_iter is only initialized if
-          (message_cache_count < MESSAGE_CACHE_NUM_CONTACTS) */
-    start_iter_from_file(contact, k, result);
-  }
-  pthread_mutex_unlock (&message_cache_mutex);
+  result->is_in_memory = 1;
+  result->use_records = 0;
+  result->record_pos = 0;
+  result->message_cache_index = index;
+  result->last_message_index = -1;
+  result->ack_returned = 0;
+  /* set the other values to reasonable defaults */
+  result->dirname = NULL;
+  result->current_fname = NULL;
+  result->current_file = NULL;
+  result->current_size = 0;
+  result->current_pos = 0;
   return result;
 }
 
@@ -518,7 +670,939 @@ static void set_result (
   if (msizep != NULL) *msizep = (int)msize;
 }
 
-/* must be called with the mutex held */
+/* reads the previous record from the text files */
+static int prev_message_from_text (struct msg_iter * iter, uint64_t * seq,
+                                   uint64_t * time, int * tz_min,
+                                   uint64_t * rcvd_time, char * message_ack,
+                                   char ** message, int * msize)
+{
+  char * record = find_prev_record (iter);
+  if (record == NULL)  /* finished */
+    return MSG_TYPE_DONE;
+  int result = parse_record (record, seq, time, tz_min, rcvd_time,
+                             message_ack, message, msize);
+  if ((message == NULL) || (*message != record))
+    free (record);
+  return result;
+}
+
+static char * get_xchat_dir (keyset k)
+{
+  char * contact_dir = key_dir (k);
+  if (contact_dir == NULL)
+    return NULL;
+  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
+  free (contact_dir);
+  return xchat_dir;
+}
+
+/* ===================  binary record log and index  ==================== */
+/* the text files are kept so other programs and older versions can read
+ * them, but finding a record in them means scanning backwards through
+ * all the text.  So each keyset directory also has an append-only binary
+ * log of the same records, RECORD_LOG_NAME, and an index with one
+ * fixed-size entry per record, RECORD_INDEX_NAME.  In memory the index
+ * is also sorted by sequence number and by ack, so those lookups take
+ * O(log n).
+ * The text files remain authoritative.  The index header has the total
+ * size of the text files and the size of the log, and if either does not
+ * match, the log and index are rebuilt from the text files.  The log
+ * holds exactly what can be read back from the text files, so rebuilding
+ * gives the same records. */
+
+#define RECORD_LOG_NAME		"records.log"
+#define RECORD_INDEX_NAME	"records.idx"
+#define RECORD_MAGIC		"xchat records 1\n"
+#define RECORD_MAGIC_SIZE	16
+/* index header: magic, total size of the text files, size of the log */
+#define RECORD_HEADER_SIZE	(RECORD_MAGIC_SIZE + 8 + 8)
+/* log record: type, tz, seq, time, rcvd time, message size, ack, message */
+#define RECORD_LOG_HEADER_SIZE	(4 + 4 + 8 + 8 + 8 + 4 + MESSAGE_ID_SIZE)
+/* index entry: log offset, seq, time, type, message size, ack */
+#define RECORD_ENTRY_SIZE	(8 + 8 + 8 + 4 + 4 + MESSAGE_ID_SIZE)
+
+struct record_entry {
+  uint64_t offset;     /* of the record in the log */
+  uint64_t seq;
+  uint64_t time;
+  int type;
+  int msize;
+  char ack [MESSAGE_ID_SIZE];
+};
+
+struct seq_key {       /* only for sent and received messages */
+  uint64_t seq;
+  int type;
+  int pos;             /* in entries */
+};
+
+struct ack_key {
+  char ack [MESSAGE_ID_SIZE];
+  int pos;             /* in entries */
+};
+
+struct time_key {      /* only for sent and received messages */
+  uint64_t time;
+  uint64_t seq;
+  int type;
+  int pos;             /* in entries */
+};
+
+struct record_index {
+  keyset k;
+  char * dir;          /* NULL if this cache entry is not in use */
+  char * index_path;
+  int log_fd;          /* for reading records, -1 if not open */
+  int64_t index_size;  /* of the index file when read, -1 to read again */
+  int count;
+  int alloc;
+  struct record_entry * entries;  /* in the order saved */
+  int nseq;
+  struct seq_key * by_seq;        /* sorted by type, seq, then pos */
+  struct ack_key * by_ack;        /* sorted by ack, then pos */
+  struct time_key * by_time;      /* nseq keys sorted by time, seq, type, pos */
+};
+
+#define RECORD_CACHE_SIZE	64
+static struct record_index record_cache [RECORD_CACHE_SIZE];
+static int record_cache_next = 0;    /* round-robin replacement */
+/* held while using record_cache.  If the mutex of a message_cache entry
+ * is also needed, it must be acquired first */
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_seq_key (const void * a, const void * b)
+{
+  const struct seq_key * x = (const struct seq_key *) a;
+  const struct seq_key * y = (const struct seq_key *) b;
+  if (x->type != y->type)
+    return (x->type < y->type) ? -1 : 1;
+  if (x->seq != y->seq)
+    return (x->seq < y->seq) ? -1 : 1;
+  return (x->pos < y->pos) ? -1 : ((x->pos > y->pos) ? 1 : 0);
+}
+
+static int compare_ack_key (const void * a, const void * b)
+{
+  const struct ack_key * x = (const struct ack_key *) a;
+  const struct ack_key * y = (const struct ack_key *) b;
+  int c = memcmp (x->ack, y->ack, MESSAGE_ID_SIZE);
+  if (c != 0)
+    return c;
+  return (x->pos < y->pos) ? -1 : ((x->pos > y->pos) ? 1 : 0);
+}
+
+static int compare_time_key (const void * a, const void * b)
+{
+  const struct time_key * x = (const struct time_key *) a;
+  const struct time_key * y = (const struct time_key *) b;
+  if (x->time != y->time)
+    return (x->time < y->time) ? -1 : 1;
+  if (x->seq != y->seq)
+    return (x->seq < y->seq) ? -1 : 1;
+  if (x->type != y->type)
+    return (x->type < y->type) ? -1 : 1;
+  return (x->pos < y->pos) ? -1 : ((x->pos > y->pos) ? 1 : 0);
+}
+
+/* the index of the first element of the n keys not less than probe */
+static int lower_bound (const void * keys, int n, size_t size,
+                        const void * probe,
+                        int (* compare) (const void *, const void *))
+{
+  int low = 0;
+  int high = n;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (compare (((const char *) keys) + middle * size, probe) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/* the most recently saved entry of this type and sequence number, or -1 */
+static int find_seq_entry (struct record_index * ri, int type, uint64_t seq)
+{
+  struct seq_key probe = { seq, type, ri->count };
+  int i = lower_bound (ri->by_seq, ri->nseq, sizeof (struct seq_key),
+                       &probe, compare_seq_key) - 1;
+  if ((i >= 0) && (ri->by_seq [i].type == type) && (ri->by_seq [i].seq == seq))
+    return ri->by_seq [i].pos;
+  return -1;
+}
+
+/* the entry of this type with the highest sequence number and, among
+ * those, the latest time (the most recently saved if several), or -1 */
+static int highest_seq_entry (struct record_index * ri, int type)
+{
+  struct seq_key probe = { UINT64_MAX, type, ri->count };
+  int i = lower_bound (ri->by_seq, ri->nseq, sizeof (struct seq_key),
+                       &probe, compare_seq_key) - 1;
+  if ((i < 0) || (ri->by_seq [i].type != type))
+    return -1;
+  int result = ri->by_seq [i].pos;
+  while ((--i >= 0) && (ri->by_seq [i].type == type) &&
+         (ri->by_seq [i].seq == ri->entries [result].seq))
+    if (ri->entries [ri->by_seq [i].pos].time > ri->entries [result].time)
+      result = ri->by_seq [i].pos;
+  return result;
+}
+
+/* the most recently saved entry of this type with this ack, or -1 */
+static int find_ack_entry (struct record_index * ri, int type,
+                           const char * ack)
+{
+  struct ack_key probe;
+  memcpy (probe.ack, ack, MESSAGE_ID_SIZE);
+  probe.pos = ri->count;
+  int i = lower_bound (ri->by_ack, ri->count, sizeof (struct ack_key),
+                       &probe, compare_ack_key) - 1;
+  for ( ; (i >= 0) &&
+          (memcmp (ri->by_ack [i].ack, ack, MESSAGE_ID_SIZE) == 0); i--)
+    if (ri->entries [ri->by_ack [i].pos].type == type)
+      return ri->by_ack [i].pos;
+  return -1;
+}
+
+static void grow_records (struct record_index * ri, int needed)
+{
+  if (needed <= ri->alloc)
+    return;
+  int alloc = ri->alloc * 2 + 100;
+  if (alloc < needed)
+    alloc = needed;
+  struct record_entry * entries =
+    malloc_or_fail (alloc * sizeof (struct record_entry), "grow_records");
+  struct seq_key * by_seq =
+    malloc_or_fail (alloc * sizeof (struct seq_key), "grow_records seq");
+  struct ack_key * by_ack =
+    malloc_or_fail (alloc * sizeof (struct ack_key), "grow_records ack");
+  struct time_key * by_time =
+    malloc_or_fail (alloc * sizeof (struct time_key), "grow_records time");
+  if (ri->entries != NULL) {
+    memcpy (entries, ri->entries, ri->count * sizeof (struct record_entry));
+    memcpy (by_seq, ri->by_seq, ri->nseq * sizeof (struct seq_key));
+    memcpy (by_ack, ri->by_ack, ri->count * sizeof (struct ack_key));
+    memcpy (by_time, ri->by_time, ri->nseq * sizeof (struct time_key));
+    free (ri->entries);
+    free (ri->by_seq);
+    free (ri->by_ack);
+    free (ri->by_time);
+  }
+  ri->entries = entries;
+  ri->by_seq = by_seq;
+  ri->by_ack = by_ack;
+  ri->by_time = by_time;
+  ri->alloc = alloc;
+}
+
+/* adds an entry saved after all the others */
+static void add_record_entry (struct record_index * ri,
+                              const struct record_entry * entry)
+{
+  grow_records (ri, ri->count + 1);
+  int pos = ri->count;
+  ri->entries [pos] = *entry;
+  if ((entry->type == MSG_TYPE_SENT) || (entry->type == MSG_TYPE_RCVD)) {
+    struct seq_key key = { entry->seq, entry->type, pos };
+    int i = lower_bound (ri->by_seq, ri->nseq, sizeof (struct seq_key),
+                         &key, compare_seq_key);
+    memmove (ri->by_seq + i + 1, ri->by_seq + i,
+             (ri->nseq - i) * sizeof (struct seq_key));
+    ri->by_seq [i] = key;
+    /* usually the latest, so the memmoves are short */
+    struct time_key tkey = { entry->time, entry->seq, entry->type, pos };
+    i = lower_bound (ri->by_time, ri->nseq, sizeof (struct time_key),
+                     &tkey, compare_time_key);
+    memmove (ri->by_time + i + 1, ri->by_time + i,
+             (ri->nseq - i) * sizeof (struct time_key));
+    ri->by_time [i] = tkey;
+    ri->nseq++;
+  }
+  struct ack_key key;
+  memcpy (key.ack, entry->ack, MESSAGE_ID_SIZE);
+  key.pos = pos;
+  int i = lower_bound (ri->by_ack, ri->count, sizeof (struct ack_key),
+                       &key, compare_ack_key);
+  memmove (ri->by_ack + i + 1, ri->by_ack + i,
+           (ri->count - i) * sizeof (struct ack_key));
+  ri->by_ack [i] = key;
+  ri->count++;
+}
+
+static void encode_entry (char * p, const struct record_entry * entry)
+{
+  writeb64 (p, entry->offset);
+  writeb64 (p + 8, entry->seq);
+  writeb64 (p + 16, entry->time);
+  writeb32 (p + 24, entry->type);
+  writeb32 (p + 28, entry->msize);
+  memcpy (p + 32, entry->ack, MESSAGE_ID_SIZE);
+}
+
+static void decode_entry (const char * p, struct record_entry * entry)
+{
+  entry->offset = readb64 (p);
+  entry->seq = readb64 (p + 8);
+  entry->time = readb64 (p + 16);
+  entry->type = (int) readb32 (p + 24);
+  entry->msize = (int) readb32 (p + 28);
+  memcpy (entry->ack, p + 32, MESSAGE_ID_SIZE);
+}
+
+/* fills in the log record header and the corresponding index entry */
+static void encode_record (char * p, struct record_entry * entry,
+                           uint64_t offset, int type, uint64_t seq,
+                           uint64_t time, int tz_min, uint64_t rcvd_time,
+                           const char * ack, int msize)
+{
+  writeb32 (p, type);
+  writeb32 (p + 4, (unsigned long int) tz_min);
+  writeb64 (p + 8, seq);
+  writeb64 (p + 16, time);
+  writeb64 (p + 24, rcvd_time);
+  writeb32 (p + 32, msize);
+  memcpy (p + 36, ack, MESSAGE_ID_SIZE);
+  entry->offset = offset;
+  entry->seq = seq;
+  entry->time = time;
+  entry->type = type;
+  entry->msize = msize;
+  memcpy (entry->ack, ack, MESSAGE_ID_SIZE);
+}
+
+/* returns 1 if all was written, 0 otherwise */
+static int write_all_at (int fd, const char * data, size_t size, off_t offset)
+{
+  while (size > 0) {
+    ssize_t w = pwrite (fd, data, size, offset);
+    if (w <= 0) {
+      perror ("store.c pwrite");
+      return 0;
+    }
+    data += w;
+    size -= w;
+    offset += w;
+  }
+  return 1;
+}
+
+static int read_record_header (int fd, int64_t * text, int64_t * log)
+{
+  char buffer [RECORD_HEADER_SIZE];
+  if ((pread (fd, buffer, sizeof (buffer), 0) != sizeof (buffer)) ||
+      (memcmp (buffer, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0))
+    return 0;
+  *text = (int64_t) readb64 (buffer + RECORD_MAGIC_SIZE);
+  *log = (int64_t) readb64 (buffer + RECORD_MAGIC_SIZE + 8);
+  return 1;
+}
+
+static int write_record_header (int fd, int64_t text, int64_t log)
+{
+  char buffer [RECORD_HEADER_SIZE];
+  memcpy (buffer, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+  writeb64 (buffer + RECORD_MAGIC_SIZE, text);
+  writeb64 (buffer + RECORD_MAGIC_SIZE + 8, log);
+  return write_all_at (fd, buffer, sizeof (buffer), 0);
+}
+
+/* total size of the dated text files in dir, or -1 if dir cannot be read */
+static int64_t text_bytes (const char * dir)
+{
+  DIR * d = opendir (dir);
+  if (d == NULL)
+    return -1;
+  int64_t result = 0;
+  struct dirent * dep;
+  while ((dep = readdir (d)) != NULL) {
+    if (end_ndigits (dep->d_name, DATE_LEN, ".txt")) {
+      char * path = strcat3_malloc (dir, "/", dep->d_name, "text_bytes");
+      struct stat st;
+      if ((stat (path, &st) == 0) && (S_ISREG (st.st_mode)))
+        result += st.st_size;
+      free (path);
+    }
+  }
+  closedir (d);
+  return result;
+}
+
+/* the part of the message that can be read back from the text files,
+ * which drop a final newline and end at a null character */
+static int text_message_size (const char * message, int msize)
+{
+  int result = 0;
+  while ((result < msize) && (message [result] != '\0'))
+    result++;
+  if ((result > 0) && (message [result - 1] == '\n'))
+    result--;
+  return result;
+}
+
+/* used in rebuild_records, but declared lower down */
+void free_unallocated_iter (struct msg_iter * iter);
+
+/* initializes iter to read the text files in dir */
+static void init_text_iter (const char * dir, keyset k,
+                            struct msg_iter * iter)
+{
+  iter->contact = NULL;
+  iter->k = k;
+  iter->is_in_memory = 0;
+  iter->use_records = 0;
+  iter->record_pos = 0;
+  iter->dirname = strcpy_malloc (dir, "init_text_iter");
+  iter->current_fname = NULL;
+  iter->current_file = NULL;
+  iter->current_size = 0;
+  iter->current_pos = 0;
+}
+
+struct text_record {
+  int type;
+  uint64_t seq;
+  uint64_t time;
+  int tz_min;
+  uint64_t rcvd_time;
+  char ack [MESSAGE_ID_SIZE];
+  char * message;
+  int msize;
+};
+
+/* rewrites the log and the index from the text files, which have
+ * text bytes.  Must be called with the index file locked.
+ * returns 1 for success, 0 for errors */
+static int rebuild_records (const char * dir, keyset k, int64_t text,
+                            int index_fd, int log_fd)
+{
+  struct text_record * records = NULL;
+  int count = 0;
+  int alloc = 0;
+  size_t log_size = 0;
+  struct msg_iter iter;
+  init_text_iter (dir, k, &iter);
+  while (1) {
+    if (count >= alloc) {
+      alloc = alloc * 2 + 100;
+      struct text_record * n =
+        malloc_or_fail (alloc * sizeof (struct text_record), "rebuild_records");
+      if (records != NULL) {
+        memcpy (n, records, count * sizeof (struct text_record));
+        free (records);
+      }
+      records = n;
+    }
+    struct text_record * r = records + count;
+    r->tz_min = 0;
+    r->rcvd_time = 0;
+    r->message = NULL;
+    r->msize = 0;
+    r->type = prev_message_from_text (&iter, &(r->seq), &(r->time),
+                                      &(r->tz_min), &(r->rcvd_time), r->ack,
+                                      &(r->message), &(r->msize));
+    if (r->type == MSG_TYPE_DONE)
+      break;
+    log_size += RECORD_LOG_HEADER_SIZE + r->msize;
+    count++;
+  }
+  iter.k = k;   /* find_prev_file invalidated it, but it has memory to free */
+  free_unallocated_iter (&iter);
+  /* the text iterator returns the most recent first */
+  char * log = malloc_or_fail (log_size + 1, "rebuild_records log");
+  size_t index_size = RECORD_HEADER_SIZE + count * RECORD_ENTRY_SIZE;
+  char * index = malloc_or_fail (index_size, "rebuild_records index");
+  memcpy (index, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+  writeb64 (index + RECORD_MAGIC_SIZE, text);
+  writeb64 (index + RECORD_MAGIC_SIZE + 8, log_size);
+  size_t offset = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    struct text_record * r = records + (count - 1 - i);
+    struct record_entry entry;
+    encode_record (log + offset, &entry, offset, r->type, r->seq, r->time,
+                   r->tz_min, r->rcvd_time, r->ack, r->msize);
+    if (r->message != NULL)
+      memcpy (log + offset + RECORD_LOG_HEADER_SIZE, r->message, r->msize);
+    encode_entry (index + RECORD_HEADER_SIZE + i * RECORD_ENTRY_SIZE, &entry);
+    offset += RECORD_LOG_HEADER_SIZE + r->msize;
+    if (r->message != NULL)
+      free (r->message);
+  }
+  if (records != NULL)
+    free (records);
+  int result = ((ftruncate (log_fd, 0) == 0) &&
+                (write_all_at (log_fd, log, log_size, 0)) &&
+                (ftruncate (index_fd, 0) == 0) &&
+                (write_all_at (index_fd, index, index_size, 0)));
+  free (log);
+  free (index);
+  return result;
+}
+
+/* opens and locks the index and opens the log, rebuilding both if they
+ * do not match the text files.  text_added is the number of bytes the
+ * caller has just added to the text files.  Returns 1 and sets the fds
+ * if successful (the caller must unlock and close them), 0 otherwise.
+ * When returning 1, also sets *text to the size of the text files, and
+ * *rebuilt to 1 if the log and index were rebuilt, 0 otherwise */
+static int open_records (const char * dir, keyset k, int64_t text_added,
+                         int * index_fd, int * log_fd,
+                         int64_t * text, int * rebuilt)
+{
+  char * index_path = strcat3_malloc (dir, "/", RECORD_INDEX_NAME,
+                                      "open_records index");
+  char * log_path = strcat3_malloc (dir, "/", RECORD_LOG_NAME,
+                                    "open_records log");
+  *index_fd = open (index_path, O_RDWR | O_CREAT, 0600);
+  *log_fd = open (log_path, O_RDWR | O_CREAT, 0600);
+  free (index_path);
+  free (log_path);
+  if ((*index_fd < 0) || (*log_fd < 0)) {
+    if (*index_fd >= 0)
+      close (*index_fd);
+    if (*log_fd >= 0)
+      close (*log_fd);
+    return 0;
+  }
+  flock (*index_fd, LOCK_EX);
+  *text = text_bytes (dir);
+  *rebuilt = 0;
+  int64_t header_text;
+  int64_t header_log;
+  struct stat ist;
+  struct stat lst;
+  if ((*text >= 0) && (fstat (*index_fd, &ist) == 0) &&
+      (fstat (*log_fd, &lst) == 0) &&
+      (read_record_header (*index_fd, &header_text, &header_log)) &&
+      (header_text + text_added == *text) && (header_log == lst.st_size) &&
+      ((ist.st_size - RECORD_HEADER_SIZE) % RECORD_ENTRY_SIZE == 0))
+    return 1;
+  if ((*text >= 0) && (rebuild_records (dir, k, *text, *index_fd, *log_fd))) {
+    *rebuilt = 1;
+    return 1;
+  }
+  flock (*index_fd, LOCK_UN);
+  close (*index_fd);
+  close (*log_fd);
+  return 0;
+}
+
+static void clear_records (struct record_index * ri)
+{
+  if (ri->dir != NULL)
+    free (ri->dir);
+  if (ri->index_path != NULL)
+    free (ri->index_path);
+  if (ri->log_fd >= 0)
+    close (ri->log_fd);
+  if (ri->entries != NULL) {
+    free (ri->entries);
+    free (ri->by_seq);
+    free (ri->by_ack);
+    free (ri->by_time);
+  }
+  memset (ri, 0, sizeof (struct record_index));
+  ri->log_fd = -1;
+  ri->index_size = -1;
+}
+
+/* reads the index from the file.  Must be called with record_mutex held
+ * returns 1 for success, 0 for failure */
+static int load_records (struct record_index * ri)
+{
+  create_dir (ri->dir, 0);
+  int index_fd;
+  int log_fd;
+  int64_t text;
+  int rebuilt;
+  if (! open_records (ri->dir, ri->k, 0, &index_fd, &log_fd, &text, &rebuilt))
+    return 0;
+  struct stat st;
+  char * buffer = NULL;
+  int count = 0;
+  if (fstat (index_fd, &st) == 0) {
+    count = (int) ((st.st_size - RECORD_HEADER_SIZE) / RECORD_ENTRY_SIZE);
+    size_t size = count * RECORD_ENTRY_SIZE;
+    buffer = malloc_or_fail (size + 1, "load_records");
+    if (pread (index_fd, buffer, size, RECORD_HEADER_SIZE) != (ssize_t) size) {
+      free (buffer);
+      buffer = NULL;
+    }
+  }
+  flock (index_fd, LOCK_UN);
+  close (index_fd);
+  if (buffer == NULL) {
+    close (log_fd);
+    return 0;
+  }
+  if (ri->log_fd >= 0)
+    close (ri->log_fd);
+  ri->log_fd = log_fd;
+  ri->index_size = st.st_size;
+  grow_records (ri, count);
+  ri->count = count;
+  ri->nseq = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    struct record_entry * entry = ri->entries + i;
+    decode_entry (buffer + i * RECORD_ENTRY_SIZE, entry);
+    if ((entry->type == MSG_TYPE_SENT) || (entry->type == MSG_TYPE_RCVD)) {
+      struct seq_key key = { entry->seq, entry->type, i };
+      struct time_key tkey = { entry->time, entry->seq, entry->type, i };
+      ri->by_time [ri->nseq] = tkey;
+      ri->by_seq [ri->nseq++] = key;
+    }
+    memcpy (ri->by_ack [i].ack, entry->ack, MESSAGE_ID_SIZE);
+    ri->by_ack [i].pos = i;
+  }
+  free (buffer);
+  qsort (ri->by_seq, ri->nseq, sizeof (struct seq_key), compare_seq_key);
+  qsort (ri->by_ack, ri->count, sizeof (struct ack_key), compare_ack_key);
+  qsort (ri->by_time, ri->nseq, sizeof (struct time_key), compare_time_key);
+  return 1;
+}
+
+/* must be called with record_mutex held.  Returns NULL if not cached */
+static struct record_index * find_records (keyset k)
+{
+  int i;
+  for (i = 0; i < RECORD_CACHE_SIZE; i++)
+    if ((record_cache [i].dir != NULL) && (record_cache [i].k == k))
+      return record_cache + i;
+  return NULL;
+}
+
+/* returns the records for k, reading the index if it is not cached or
+ * (if check) has changed since it was read, or NULL if not available.
+ * Must be called with record_mutex held */
+static struct record_index * get_records (keyset k, int check)
+{
+  struct record_index * ri = find_records (k);
+  if (ri == NULL) {
+    char * dir = get_xchat_dir (k);
+    if (dir == NULL)
+      return NULL;
+    ri = record_cache + record_cache_next;
+    record_cache_next = (record_cache_next + 1) % RECORD_CACHE_SIZE;
+    if (ri->dir == NULL)   /* never used, initialize */
+      ri->log_fd = -1;
+    clear_records (ri);
+    ri->k = k;
+    ri->dir = dir;
+    ri->index_path = strcat3_malloc (dir, "/", RECORD_INDEX_NAME,
+                                     "get_records");
+  } else if ((check) && (ri->index_size >= 0)) {
+    struct stat st;
+    if ((stat (ri->index_path, &st) != 0) || (st.st_size != ri->index_size))
+      ri->index_size = -1;   /* saved by another process, read again */
+  }
+  if ((ri->index_size < 0) && (! load_records (ri)))
+    return NULL;
+  return ri;
+}
+
+/* the cached records for k (if any) will be read again before use */
+static void forget_records (keyset k)
+{
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = find_records (k);
+  if (ri != NULL)
+    ri->index_size = -1;
+  pthread_mutex_unlock (&record_mutex);
+}
+
+/* adds a record to the log and index, after save_record has added
+ * text_added bytes for it to the text files */
+static void append_record (keyset k, int type, uint64_t seq, uint64_t time,
+                           int tz_min, uint64_t rcvd_time, const char * ack,
+                           const char * message, int msize, int64_t text_added)
+{
+  if (type == MSG_TYPE_ACK) {  /* the text files only have the ack */
+    seq = 0;
+    time = 0;
+    tz_min = 0;
+    rcvd_time = 0;
+    msize = 0;
+  } else {
+    msize = text_message_size (message, msize);
+  }
+  char * dir = get_xchat_dir (k);
+  if (dir == NULL)
+    return;
+  pthread_mutex_lock (&record_mutex);
+  int index_fd;
+  int log_fd;
+  int64_t text;
+  int rebuilt;
+  struct stat ist;
+  struct stat lst;
+  memset (&ist, 0, sizeof (ist));
+  struct record_entry entry;
+  int appended = 0;
+  if (open_records (dir, k, text_added, &index_fd, &log_fd, &text, &rebuilt)) {
+    if ((! rebuilt) && (fstat (index_fd, &ist) == 0) &&
+        (fstat (log_fd, &lst) == 0)) {
+      int size = RECORD_LOG_HEADER_SIZE + msize;
+      char * buffer = malloc_or_fail (size, "append_record");
+      char index [RECORD_ENTRY_SIZE];
+      encode_record (buffer, &entry, lst.st_size, type, seq, time, tz_min,
+                     rcvd_time, ack, msize);
+      memcpy (buffer + RECORD_LOG_HEADER_SIZE, message, msize);
+      encode_entry (index, &entry);
+      appended = ((write_all_at (log_fd, buffer, size, lst.st_size)) &&
+                  (write_all_at (index_fd, index, RECORD_ENTRY_SIZE,
+                                 ist.st_size)) &&
+                  (write_record_header (index_fd, text, lst.st_size + size)));
+      free (buffer);
+      if (! appended)  /* make sure it is rebuilt next time */
+        write_record_header (index_fd, -1, -1);
+    }
+    flock (index_fd, LOCK_UN);
+    close (index_fd);
+    close (log_fd);
+  }
+  struct record_index * ri = find_records (k);
+  if ((ri != NULL) && (appended) && (ri->index_size == ist.st_size)) {
+    add_record_entry (ri, &entry);
+    ri->index_size += RECORD_ENTRY_SIZE;
+  } else if (ri != NULL) {
+    ri->index_size = -1;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  free (dir);
+}
+
+/* reads the record at pos.  Must be called with record_mutex held */
+static int read_record (struct record_index * ri, int pos,
+                        uint64_t * seq, uint64_t * time, int * tz_min,
+                        uint64_t * rcvd_time, char * message_ack,
+                        char ** message, int * msize)
+{
+  struct record_entry * entry = ri->entries + pos;
+  int is_ack = (entry->type == MSG_TYPE_ACK);
+  int tz = 0;
+  uint64_t rcvd = entry->time;
+  char * text = NULL;
+  if ((tz_min != NULL) || (rcvd_time != NULL) || (message != NULL)) {
+    int size = RECORD_LOG_HEADER_SIZE + ((message != NULL) ? entry->msize : 0);
+    char * buffer = malloc_or_fail (size + 1, "read_record");
+    if (pread (ri->log_fd, buffer, size, entry->offset) != (ssize_t) size) {
+      free (buffer);
+      ri->index_size = -1;   /* the log has changed, read it again */
+      return MSG_TYPE_DONE;
+    }
+    tz = (int32_t) readb32 (buffer + 4);
+    rcvd = readb64 (buffer + 24);
+    if ((message != NULL) && (! is_ack)) {
+      memmove (buffer, buffer + RECORD_LOG_HEADER_SIZE, entry->msize);
+      buffer [entry->msize] = '\0';
+      text = buffer;
+    } else {
+      free (buffer);
+    }
+  }
+  if (seq != NULL) *seq = entry->seq;
+  if (time != NULL) *time = entry->time;
+  if (tz_min != NULL) *tz_min = tz;
+  if ((rcvd_time != NULL) && (! is_ack)) *rcvd_time = rcvd;
+  if (message_ack != NULL)
+    memcpy (message_ack, entry->ack, MESSAGE_ID_SIZE);
+  if (message != NULL) *message = text;
+  if (msize != NULL) *msize = (is_ack ? 0 : entry->msize);
+  return entry->type;
+}
+
+static int record_count (keyset k)
+{
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  int result = ((ri == NULL) ? -1 : ri->count);
+  pthread_mutex_unlock (&record_mutex);
+  return result;
+}
+
+static int prev_message_from_records (struct msg_iter * iter, uint64_t * seq,
+                                      uint64_t * time, int * tz_min,
+                                      uint64_t * rcvd_time, char * message_ack,
+                                      char ** message, int * msize)
+{
+  int result = MSG_TYPE_DONE;
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (iter->k, 0);
+  if ((ri != NULL) && (iter->record_pos > 0) &&
+      (iter->record_pos <= ri->count)) {
+    iter->record_pos--;
+    result = read_record (ri, iter->record_pos, seq, time, tz_min, rcvd_time,
+                          message_ack, message, msize);
+  }
+  pthread_mutex_unlock (&record_mutex);
+  return result;
+}
+
+/* ==============  ranges of received sequence numbers  ================= */
+/* was_received, get_missing and missing_before ask which sequence numbers
+ * have been received from a keyset.  For each of the most recently used
+ * keysets the answer is kept as sorted, disjoint, non-adjacent ranges, so
+ * a contact with n messages usually needs only a few ranges.  The ranges
+ * are built from the records the first time they are needed, and
+ * save_record adds each message received after that */
+
+struct seq_range {
+  uint64_t first;
+  uint64_t last;
+};
+
+struct received_ranges {
+  int in_use;          /* 0 if this cache entry is free */
+  keyset k;
+  uint64_t last_use;   /* for replacing the least recently used */
+  int used;
+  int alloc;
+  struct seq_range * ranges;
+};
+
+#define RECEIVED_CACHE_SIZE	32
+static struct received_ranges received_cache [RECEIVED_CACHE_SIZE];
+static uint64_t received_clock = 0;
+/* held while using received_cache.  If record_mutex is also needed,
+ * it must be acquired after this one */
+static pthread_mutex_t received_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the index of the first range with last >= seq, or rr->used if none */
+static int find_range (struct received_ranges * rr, uint64_t seq)
+{
+  int low = 0;
+  int high = rr->used;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (rr->ranges [middle].last < seq)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+static void add_received (struct received_ranges * rr, uint64_t seq)
+{
+  if (seq == UINT64_MAX)   /* so seq + 1 cannot overflow */
+    return;
+  /* the first range that seq is in or extends */
+  int i = find_range (rr, (seq > 0) ? (seq - 1) : 0);
+  if ((i < rr->used) && (rr->ranges [i].first <= seq + 1)) {
+    if (rr->ranges [i].first > seq)
+      rr->ranges [i].first = seq;
+    if (rr->ranges [i].last < seq)
+      rr->ranges [i].last = seq;
+    if ((i + 1 < rr->used) &&
+        (rr->ranges [i].last + 1 >= rr->ranges [i + 1].first)) {
+      rr->ranges [i].last = rr->ranges [i + 1].last;   /* merge */
+      memmove (rr->ranges + i + 1, rr->ranges + i + 2,
+               (rr->used - (i + 2)) * sizeof (struct seq_range));
+      rr->used--;
+    }
+    return;
+  }
+  if (rr->used >= rr->alloc) {
+    rr->alloc = rr->alloc * 2 + 10;
+    struct seq_range * n =
+      malloc_or_fail (rr->alloc * sizeof (struct seq_range), "add_received");
+    if (rr->ranges != NULL) {
+      memcpy (n, rr->ranges, rr->used * sizeof (struct seq_range));
+      free (rr->ranges);
+    }
+    rr->ranges = n;
+  }
+  memmove (rr->ranges + i + 1, rr->ranges + i,
+           (rr->used - i) * sizeof (struct seq_range));
+  rr->ranges [i].first = seq;
+  rr->ranges [i].last = seq;
+  rr->used++;
+}
+
+/* adds all the received sequence numbers from the records of k */
+static void build_received (struct received_ranges * rr, keyset k)
+{
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {
+    int i;
+    for (i = 0; i < ri->nseq; i++)   /* already sorted by type and seq */
+      if (ri->by_seq [i].type == MSG_TYPE_RCVD)
+        add_received (rr, ri->by_seq [i].seq);
+    pthread_mutex_unlock (&record_mutex);
+    return;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, read the text files */
+  char * dir = get_xchat_dir (k);
+  if (dir == NULL)
+    return;
+  struct msg_iter iter;
+  init_text_iter (dir, k, &iter);
+  free (dir);
+  int type;
+  uint64_t seq;
+  while ((type = prev_message_from_text (&iter, &seq, NULL, NULL, NULL, NULL,
+                                         NULL, NULL)) != MSG_TYPE_DONE)
+    if (type == MSG_TYPE_RCVD)
+      add_received (rr, seq);
+  iter.k = k;   /* find_prev_file invalidated it, but it has memory to free */
+  free_unallocated_iter (&iter);
+}
+
+/* returns the ranges for k, building them if necessary, or NULL if
+ * build is 0 and they are not cached.  Must be called with
+ * received_mutex held */
+static struct received_ranges * get_received (keyset k, int build)
+{
+  struct received_ranges * oldest = received_cache;
+  int i;
+  for (i = 0; i < RECEIVED_CACHE_SIZE; i++) {
+    struct received_ranges * rr = received_cache + i;
+    if ((rr->in_use) && (rr->k == k)) {
+      rr->last_use = ++received_clock;
+      return rr;
+    }
+    if ((! rr->in_use) ||
+        ((oldest->in_use) && (rr->last_use < oldest->last_use)))
+      oldest = rr;
+  }
+  if (! build)
+    return NULL;
+  oldest->in_use = 1;
+  oldest->k = k;
+  oldest->last_use = ++received_clock;
+  oldest->used = 0;
+  build_received (oldest, k);
+  return oldest;
+}
+
+/* the cached ranges for k (if any) will be built again before use */
+static void forget_received (keyset k)
+{
+  pthread_mutex_lock (&received_mutex);
+  struct received_ranges * rr = get_received (k, 0);
+  if (rr != NULL)
+    rr->in_use = 0;
+  pthread_mutex_unlock (&received_mutex);
+}
+
+/* returns 1 if a message with this sequence number has been received
+ * with this keyset, 0 otherwise */
+int received_seq (keyset k, uint64_t seq)
+{
+  pthread_mutex_lock (&received_mutex);
+  struct received_ranges * rr = get_received (k, 1);
+  int i = find_range (rr, seq);
+  int result = ((i < rr->used) && (rr->ranges [i].first <= seq));
+  pthread_mutex_unlock (&received_mutex);
+  return result;
+}
+
+/* must be called with the mutex of the iterator's cache entry held */
 static int prev_message_in_memory
   (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
    int * tz_min, uint64_t * rcvd_time, char * message_ack,
@@ -526,7 +1610,7 @@ static int prev_message_in_memory
 {
   int index = iter->message_cache_index;
   int pos = iter->last_message_index;
-  if ((index < 0) || (index >= message_cache_count)) /* invalid iterator */
+  if ((index < 0) || (index >= MESSAGE_CACHE_NUM_CONTACTS)) /* invalid */
     return MSG_TYPE_DONE;
   if (pos >= message_cache [index].num_used)    /* iterator completed */
     return MSG_TYPE_DONE;
@@ -580,20 +1664,19 @@ int prev_message (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
   if (iter->k < 0)  /* invalid */
     return MSG_TYPE_DONE;
   if (iter->is_in_memory) {
-    pthread_mutex_lock (&message_cache_mutex);
+    pthread_mutex_t * mutex =
+      &(message_cache [iter->message_cache_index].mutex);
+    pthread_mutex_lock (mutex);
     int r = prev_message_in_memory (iter, seq, time, tz_min, rcvd_time,
                                     message_ack, message, msize);
-    pthread_mutex_unlock (&message_cache_mutex);
+    pthread_mutex_unlock (mutex);
     return r;
   }
-  char * record = find_prev_record (iter);
-  if (record == NULL)  /* finished */
-    return MSG_TYPE_DONE;
-  int result = parse_record (record, seq, time, tz_min, rcvd_time,
-                             message_ack, message, msize);
-  if ((message == NULL) || (*message != record))
-    free (record);
-  return result;
+  if (iter->use_records)
+    return prev_message_from_records (iter, seq, time, tz_min, rcvd_time,
+                                      message_ack, message, msize);
+  return prev_message_from_text (iter, seq, time, tz_min, rcvd_time,
+                                 message_ack, message, msize);
 }
 
 void free_unallocated_iter (struct msg_iter * iter)
@@ -602,7 +1685,9 @@ void free_unallocated_iter (struct msg_iter * iter)
     return;
   if (iter->contact != NULL)
     free (iter->contact);
-  if (! iter->is_in_memory) {
+  if (iter->is_in_memory) {
+    release_message_cache (iter->message_cache_index, 0, 0);
+  } else {
     if (iter->dirname != NULL)
       free (iter->dirname);
     if (iter->current_fname != NULL)
@@ -613,6 +1698,8 @@ void free_unallocated_iter (struct msg_iter * iter)
   iter->contact = NULL;
   iter->k = -1;            /* invalidate */
   iter->is_in_memory = 0;
+  iter->use_records = 0;
+  iter->record_pos = 0;
   iter->dirname = NULL;
   iter->current_fname = NULL;
   iter->current_file = NULL;
@@ -637,7 +1724,24 @@ int most_recent_record (const char * contact, keyset k, int type_wanted,
                         uint64_t * rcvd_time,
                         char * message_ack, char ** message, int * msize)
 {
-  /* easy implementation, just calling the iterator.  Later perhaps optimize */
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {
+    int type = MSG_TYPE_DONE;
+    int pos;
+    for (pos = ri->count - 1; pos >= 0; pos--) {
+      if ((type_wanted == MSG_TYPE_ANY) ||
+          (ri->entries [pos].type == type_wanted)) {
+        type = read_record (ri, pos, seq, time, tz_min, rcvd_time,
+                            message_ack, message, msize);
+        break;
+      }
+    }
+    pthread_mutex_unlock (&record_mutex);
+    return type;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, use the iterator */
   struct msg_iter * iter = start_iter (contact, k);
   if (iter == NULL)
     return MSG_TYPE_DONE;
@@ -657,6 +1761,32 @@ int highest_seq_record (const char * contact, keyset k, int type_wanted,
                         uint64_t * rcvd_time,
                         char * message_ack, char ** message, int * msize)
 {
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {
+    int pos = -1;
+    if ((type_wanted == MSG_TYPE_SENT) || (type_wanted == MSG_TYPE_ANY))
+      pos = highest_seq_entry (ri, MSG_TYPE_SENT);
+    if ((type_wanted == MSG_TYPE_RCVD) || (type_wanted == MSG_TYPE_ANY)) {
+      int rcvd = highest_seq_entry (ri, MSG_TYPE_RCVD);
+      if ((rcvd >= 0) &&
+          ((pos < 0) || (ri->entries [rcvd].seq > ri->entries [pos].seq) ||
+           ((ri->entries [rcvd].seq == ri->entries [pos].seq) &&
+            (ri->entries [rcvd].time > ri->entries [pos].time))))
+        pos = rcvd;
+    }
+    int type = MSG_TYPE_DONE;
+    if (pos >= 0) {
+      type = ri->entries [pos].type;
+      if (ri->entries [pos].seq > 0)   /* only report positive seqs */
+        read_record (ri, pos, seq, time, tz_min, rcvd_time, message_ack,
+                     message, msize);
+    }
+    pthread_mutex_unlock (&record_mutex);
+    return type;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, use the iterator */
   struct msg_iter * iter = start_iter (contact, k);
   if (iter == NULL)
     return MSG_TYPE_DONE;
@@ -726,14 +1856,87 @@ int highest_seq_record (const char * contact, keyset k, int type_wanted,
   return max_type;
 }
 
-static char * get_xchat_dir (keyset k)
+/* returns type_wanted (MSG_TYPE_SENT or MSG_TYPE_RCVD) and fills in the
+ * other results if there is a message of that type with this sequence
+ * number (the most recently saved, if several), MSG_TYPE_DONE otherwise */
+int find_seq_record (const char * contact, keyset k, int type_wanted,
+                     uint64_t seq, uint64_t * time, int * tz_min,
+                     uint64_t * rcvd_time, char * message_ack,
+                     char ** message, int * msize)
 {
-  char * contact_dir = key_dir (k);
-  if (contact_dir == NULL)
-    return NULL;
-  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
-  free (contact_dir);
-  return xchat_dir;
+  if ((type_wanted != MSG_TYPE_SENT) && (type_wanted != MSG_TYPE_RCVD))
+    return MSG_TYPE_DONE;
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {
+    int type = MSG_TYPE_DONE;
+    int pos = find_seq_entry (ri, type_wanted, seq);
+    if (pos >= 0)
+      type = read_record (ri, pos, NULL, time, tz_min, rcvd_time,
+                          message_ack, message, msize);
+    pthread_mutex_unlock (&record_mutex);
+    return type;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, use the iterator */
+  struct msg_iter * iter = start_iter (contact, k);
+  if (iter == NULL)
+    return MSG_TYPE_DONE;
+  int type;
+  uint64_t this_seq = 0;
+  while ((type = prev_message (iter, &this_seq, time, tz_min, rcvd_time,
+                               message_ack, message, msize))
+         != MSG_TYPE_DONE) {
+    if ((type == type_wanted) && (this_seq == seq))
+      break;
+    if ((message != NULL) && (*message != NULL)) {
+      free (*message);
+      *message = NULL;
+    }
+  }
+  free_iter (iter);
+  return type;
+}
+
+/* returns type_wanted (MSG_TYPE_SENT, MSG_TYPE_RCVD, or MSG_TYPE_ACK) if
+ * there is a record of that type with this message_ack, MSG_TYPE_DONE
+ * otherwise.  If found and seq is not NULL, sets *seq to the sequence
+ * number of the most recently saved such record (always 0 for acks) */
+int find_ack_record (const char * contact, keyset k, int type_wanted,
+                     const char * message_ack, uint64_t * seq)
+{
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {
+    int type = MSG_TYPE_DONE;
+    int pos = find_ack_entry (ri, type_wanted, message_ack);
+    if (pos >= 0) {
+      type = type_wanted;
+      if (seq != NULL)
+        *seq = ri->entries [pos].seq;
+    }
+    pthread_mutex_unlock (&record_mutex);
+    return type;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, use the iterator */
+  struct msg_iter * iter = start_iter (contact, k);
+  if (iter == NULL)
+    return MSG_TYPE_DONE;
+  int type;
+  uint64_t this_seq = 0;
+  char ack [MESSAGE_ID_SIZE];
+  while ((type = prev_message (iter, &this_seq, NULL, NULL, NULL, ack,
+                               NULL, NULL)) != MSG_TYPE_DONE) {
+    if ((type == type_wanted) &&
+        (memcmp (ack, message_ack, MESSAGE_ID_SIZE) == 0)) {
+      if (seq != NULL)
+        *seq = this_seq;
+      break;
+    }
+  }
+  free_iter (iter);
+  return type;
 }
 
 static char * get_xchat_path (keyset k, const char * fname)
@@ -746,6 +1949,200 @@ static char * get_xchat_path (keyset k, const char * fname)
   return path;
 }
 
+/* the log and index only duplicate the text files, and are rebuilt
+ * from them, so the conversation size does not include them */
+static int is_record_file (const char * fname)
+{
+  return ((strcmp (fname, RECORD_LOG_NAME) == 0) ||
+          (strcmp (fname, RECORD_INDEX_NAME) == 0));
+}
+
+/* conversation_size and reduce_conversation need the size and age of
+ * every file in the xchat directories of a contact.  These are read
+ * once per keyset, then kept up to date as the store writes or removes
+ * each file, so neither needs to read and stat the whole directory */
+struct xchat_file {
+  char * name;
+  int64_t bytes;      /* storage used */
+  uint64_t mtime;
+};
+
+struct xchat_files {
+  keyset k;
+  char * dir;          /* NULL if this cache entry is not in use */
+  int64_t total;       /* bytes in files and in other directory entries */
+  int first;           /* files before first have been removed */
+  int count;
+  int alloc;
+  struct xchat_file * files;  /* regular files, oldest first */
+};
+
+#define FILES_CACHE_SIZE	64
+static struct xchat_files files_cache [FILES_CACHE_SIZE];
+static int files_cache_next = 0;    /* round-robin replacement */
+/* held while using files_cache */
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t stat_storage_size (const struct stat * st)
+{
+  return st->st_blocks * 512;
+}
+
+static void clear_files (struct xchat_files * xf)
+{
+  int i;
+  for (i = xf->first; i < xf->count; i++)
+    free (xf->files [i].name);
+  if (xf->files != NULL)
+    free (xf->files);
+  if (xf->dir != NULL)
+    free (xf->dir);
+  memset (xf, 0, sizeof (struct xchat_files));
+}
+
+/* must be called with files_mutex held.  Returns NULL if not cached */
+static struct xchat_files * find_files (keyset k)
+{
+  int i;
+  for (i = 0; i < FILES_CACHE_SIZE; i++)
+    if ((files_cache [i].dir != NULL) && (files_cache [i].k == k))
+      return files_cache + i;
+  return NULL;
+}
+
+/* removes the named file, if present.  Must be called with files_mutex held */
+static void remove_file_entry (struct xchat_files * xf, const char * name)
+{
+  int i;
+  for (i = xf->first; i < xf->count; i++) {
+    if (strcmp (xf->files [i].name, name) == 0) {
+      xf->total -= xf->files [i].bytes;
+      free (xf->files [i].name);
+      if (i == xf->first) {
+        xf->first++;
+      } else {
+        memmove (xf->files + i, xf->files + i + 1,
+                 (xf->count - i - 1) * sizeof (struct xchat_file));
+        xf->count--;
+      }
+      return;
+    }
+  }
+}
+
+/* adds the file, keeping the files sorted by time.  Files are usually
+ * added as they are written, so the place is found from the end.
+ * Must be called with files_mutex held */
+static void add_file_entry (struct xchat_files * xf, const char * name,
+                            const struct stat * st)
+{
+  if (xf->first > 0) {   /* reuse the space of the files removed */
+    memmove (xf->files, xf->files + xf->first,
+             (xf->count - xf->first) * sizeof (struct xchat_file));
+    xf->count -= xf->first;
+    xf->first = 0;
+  }
+  if (xf->count >= xf->alloc) {
+    int alloc = xf->alloc * 2 + 16;
+    struct xchat_file * files =
+      realloc (xf->files, alloc * sizeof (struct xchat_file));
+    if (files == NULL)
+      return;
+    xf->files = files;
+    xf->alloc = alloc;
+  }
+  uint64_t mtime = st->st_mtime;
+  int pos = xf->count;
+  while ((pos > 0) && (xf->files [pos - 1].mtime > mtime))
+    pos--;
+  memmove (xf->files + pos + 1, xf->files + pos,
+           (xf->count - pos) * sizeof (struct xchat_file));
+  xf->files [pos].name = strcpy_malloc (name, "add_file_entry");
+  xf->files [pos].bytes = stat_storage_size (st);
+  xf->files [pos].mtime = mtime;
+  xf->count++;
+  xf->total += xf->files [pos].bytes;
+}
+
+/* returns the files for k, reading the directory if it is not cached,
+ * or NULL if the directory cannot be read.
+ * Must be called with files_mutex held */
+static struct xchat_files * get_files (keyset k)
+{
+  struct xchat_files * xf = find_files (k);
+  if (xf != NULL)
+    return xf;
+  char * xchat_dir = get_xchat_dir (k);
+  if (xchat_dir == NULL)
+    return NULL;
+  DIR * dir = opendir (xchat_dir);
+  if (dir == NULL) {
+#ifdef DEBUG_PRINT
+    perror ("get_files opendir");
+    printf ("unable to open directory %s\n", xchat_dir);
+#endif /* DEBUG_PRINT */
+    free (xchat_dir);
+    return NULL;
+  }
+  xf = files_cache + files_cache_next;
+  files_cache_next = (files_cache_next + 1) % FILES_CACHE_SIZE;
+  clear_files (xf);
+  xf->k = k;
+  xf->dir = xchat_dir;
+  struct dirent * dep;
+  while ((dep = readdir (dir)) != NULL) {
+    /* do not count the parent directory */
+    if ((is_record_file (dep->d_name)) || (strcmp (dep->d_name, "..") == 0))
+      continue;
+    char * path = strcat3_malloc (xchat_dir, "/", dep->d_name, "get_files");
+    struct stat st;
+    if (stat (path, &st) != 0) {
+      perror ("get_files stat");
+      printf ("store.c get_files unable to stat '%s'\n", path);
+    } else if (S_ISREG (st.st_mode)) {
+      add_file_entry (xf, dep->d_name, &st);
+    } else {
+      xf->total += stat_storage_size (&st);
+    }
+    free (path);
+  }
+  closedir (dir);
+  return xf;
+}
+
+/* called after the store writes or removes the file in the xchat
+ * directory for k.  If st is NULL, stats the file */
+static void file_changed (keyset k, const char * name, const struct stat * st)
+{
+  if (is_record_file (name))
+    return;
+  pthread_mutex_lock (&files_mutex);
+  struct xchat_files * xf = find_files (k);
+  if (xf != NULL) {  /* otherwise, read from the directory when needed */
+    remove_file_entry (xf, name);
+    struct stat local_st;
+    if (st == NULL) {
+      char * path = strcat3_malloc (xf->dir, "/", name, "file_changed");
+      if (stat (path, &local_st) == 0)
+        st = &local_st;
+      free (path);
+    }
+    if ((st != NULL) && (S_ISREG (st->st_mode)))
+      add_file_entry (xf, name, st);
+  }
+  pthread_mutex_unlock (&files_mutex);
+}
+
+/* the cached files for k (if any) will be read again when needed */
+static void forget_files (keyset k)
+{
+  pthread_mutex_lock (&files_mutex);
+  struct xchat_files * xf = find_files (k);
+  if (xf != NULL)
+    clear_files (xf);
+  pthread_mutex_unlock (&files_mutex);
+}
+
 static uint64_t read_int_from_file (const char * contact, keyset k,
                                     const char * fname)
 {
@@ -753,7 +2150,7 @@ static uint64_t read_int_from_file (const char * contact, keyset k,
   if (path == NULL)
     return 0;
   char * contents = NULL;                   /* must be free'd */
-  int csize = read_file_malloc (path, &contents, 0);
+  int csize = read_file_cached (path, &contents);
   free (path);
   if ((csize <= 0) || (contents == NULL))
     return 0;
@@ -772,7 +2169,9 @@ static void save_int_to_file (const char * contact, keyset k,
   char buffer [] = "18446744073709551616\n";  /* 2^64 */
   snprintf (buffer, sizeof (buffer), "%" PRIu64 "\n", value);
   write_file (path, buffer, (int)strlen (buffer), 1);
+  forget_cached_file (path);
   free (path);
+  file_changed (k, fname, NULL);
 }
 
 #ifdef IMPLEMENTING_SEQ_CACHING
@@ -960,20 +2359,21 @@ static void missing_before_loop (const struct message_store_info * msgs,
 int missing_before (const char * contact, keyset k, uint64_t seq,
                     uint64_t * missing_before)
 {
-  int result = 0;
   if (missing_before == NULL)
-    return result;
+    return 0;
   *missing_before = 0;
-  pthread_mutex_lock (&message_cache_mutex);
-  int index = find_message_cache_record (contact);
-  if (index >= 0) {
-    missing_before_loop (message_cache [index].msgs,
-                         message_cache [index].num_used, k, seq,
-                         missing_before);
-    result = 1;
-  }
-  pthread_mutex_unlock (&message_cache_mutex);
-  return result;
+  uint64_t prev_seq = 0; /* the first sequence number should be 1 */
+  pthread_mutex_lock (&received_mutex);
+  struct received_ranges * rr = get_received (k, 1);
+  int i = find_range (rr, seq);   /* the first range ending at or after seq */
+  if ((i < rr->used) && (rr->ranges [i].first < seq))
+    prev_seq = seq - 1;
+  else if (i > 0)
+    prev_seq = rr->ranges [i - 1].last;
+  pthread_mutex_unlock (&received_mutex);
+  if (prev_seq + 1 < seq)
+    *missing_before = seq - (prev_seq + 1);
+  return 1;
 }
 
 /* fix the prev_missing of each received message.  quadratic loop */
@@ -1044,6 +2444,25 @@ static void ack_all_messages (struct message_store_info * msgs, int num_used,
     /* no messages to ack, nothing to do */
     return;
   }
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (k, 1);
+  if (ri != NULL) {   /* look up the ack of each sent message */
+    int i;
+    for (i = 0; i < num_used; i++) {
+      if ((msgs [i].msg_type == MSG_TYPE_SENT) &&
+          (! msgs [i].message_has_been_acked)) {
+        int pos = find_ack_entry (ri, MSG_TYPE_ACK, msgs [i].ack);
+        if (pos >= 0) {
+          msgs [i].rcvd_ackd_time = ri->entries [pos].time;
+          msgs [i].message_has_been_acked = 1;
+        }
+      }
+    }
+    pthread_mutex_unlock (&record_mutex);
+    return;
+  }
+  pthread_mutex_unlock (&record_mutex);
+  /* no binary log, use the iterator */
   struct msg_iter iter;
   if (! start_iter_from_file (contact, k, &iter)) {
     printf ("error: ack_all_messages unable to create iter for %s/%d\n",
@@ -1061,33 +2480,48 @@ static void ack_all_messages (struct message_store_info * msgs, int num_used,
   free_unallocated_iter (&iter);
 }
 
-static void store_save_string_len (int fd, char * string, int mlen)
+/* each record is assembled in a store_buffer, then written with one write,
+ * so concurrent readers never see part of a record and a record costs a
+ * single system call */
+struct store_buffer {
+  char * data;   /* initially a local buffer, malloc'd if it grows */
+  int used;
+  int alloc;
+  int on_heap;
+};
+
+static void store_save_string_len (struct store_buffer * b,
+                                   const char * string, int mlen)
 {
-  if (write (fd, string, mlen) != mlen) {
-    perror ("write/len");
-    printf ("unable to write '%s' to file (%d)\n", string, mlen);
-    exit (1);
-  }
+  if (b->used + mlen > b->alloc) {
+    int alloc = b->alloc * 2 + mlen;
+    char * data = malloc_or_fail (alloc, "store_save_string_len");
+    memcpy (data, b->data, b->used);
+    if (b->on_heap)
+      free (b->data);
+    b->data = data;
+    b->alloc = alloc;
+    b->on_heap = 1;
+  }
+  memcpy (b->data + b->used, string, mlen);
+  b->used += mlen;
 }
 
-static void store_save_string (int fd, char * string)
+static void store_save_string (struct store_buffer * b, const char * string)
 {
-  if (write (fd, string, strlen (string)) != (int) (strlen (string))) {
-    perror ("write");
-    printf ("unable to write '%s' to file\n", string);
-    exit (1);
-  }
+  store_save_string_len (b, string, (int) (strlen (string)));
 }
 
-static void store_save_64 (int fd, uint64_t value)
+static void store_save_64 (struct store_buffer * b, uint64_t value)
 {
   /* 2^64 < 10^20, so 30 bytes are more than needed for the digits */
   char buffer [30];
   snprintf (buffer, sizeof (buffer), "%ju", (uintmax_t)value);
-  store_save_string (fd, buffer);
+  store_save_string (b, buffer);
 }
 
-static void store_save_message (int fd, const char * message, int mlen)
+static void store_save_message (struct store_buffer * b,
+                                const char * message, int mlen)
 {
   int num_indents = 1;  /* have to insert a blank before the message */
   int i;
@@ -1108,21 +2542,21 @@ static void store_save_message (int fd, const char * message, int mlen)
   }
   buffer [to++] = '\n';
   buffer [to] = '\0';
-  store_save_string_len (fd, buffer, to);
+  store_save_string_len (b, buffer, to);
   free (buffer);
 }
 
-static void store_save_message_type (int fd, int type)
+static void store_save_message_type (struct store_buffer * b, int type)
 {
   switch (type) {
   case MSG_TYPE_RCVD:
-    store_save_string (fd, "rcvd id:");
+    store_save_string (b, "rcvd id:");
     break;
   case MSG_TYPE_SENT:
-    store_save_string (fd, "sent id:");
+    store_save_string (b, "sent id:");
     break;
   case MSG_TYPE_ACK:
-    store_save_string (fd, "got ack:");
+    store_save_string (b, "got ack:");
     break;
   default:
     printf ("unknown message type %d\n", type);
@@ -1130,37 +2564,140 @@ static void store_save_message_type (int fd, int type)
   }
 }
 
-static void store_save_message_id (int fd, const char * id)
+static void store_save_message_id (struct store_buffer * b, const char * id)
 {
-  store_save_string (fd, " ");
+  store_save_string (b, " ");
   char buffer [MESSAGE_ID_SIZE * 2 + 1];
   int i;
   for (i = 0; i < MESSAGE_ID_SIZE; i++)
     snprintf (buffer + 2 * i, sizeof (buffer) - 2 * i, "%02x", (id [i]) & 0xff);
-  store_save_string (fd, buffer);
+  store_save_string (b, buffer);
 }
 
-static void store_save_message_seq_time (int fd, uint64_t seq,
+static void store_save_message_seq_time (struct store_buffer * b, uint64_t seq,
                                          uint64_t time, int tz, uint64_t rcvd)
 {
-  store_save_string (fd, "sequence ");
-  store_save_64 (fd, seq);
-  store_save_string (fd, ", time ");
+  store_save_string (b, "sequence ");
+  store_save_64 (b, seq);
+  store_save_string (b, ", time ");
   char time_buf [ALLNET_TIME_STRING_SIZE];
   allnet_time_string (time, time_buf);
-  store_save_string (fd, time_buf);
-  store_save_string (fd, " (");
-  store_save_64 (fd, time);
+  store_save_string (b, time_buf);
+  store_save_string (b, " (");
+  store_save_64 (b, time);
   if (tz < 0) {
-    store_save_string (fd, " -");
+    store_save_string (b, " -");
     tz = -tz;
   } else {
-    store_save_string (fd, " +");
+    store_save_string (b, " +");
+  }
+  store_save_64 (b, tz);
+  store_save_string (b, ")/");
+  store_save_64 (b, rcvd);
+  store_save_string (b, "\n");
+}
+
+/* write the whole buffer, retrying after partial writes */
+static void store_write_buffer (int fd, struct store_buffer * b)
+{
+  int done = 0;
+  while (done < b->used) {
+    ssize_t w = write (fd, b->data + done, b->used - done);
+    if (w <= 0) {
+      perror ("write");
+      printf ("unable to write %d bytes to file (%d written)\n",
+              b->used, done);
+      exit (1);
+    }
+    done += (int) w;
+  }
+}
+
+/* with STORE_DURABILITY_GROUP, the file last written is synced once
+ * STORE_GROUP_COMMIT_RECORDS records have been written to it, or once
+ * STORE_GROUP_COMMIT_SECONDS have passed since the first unsynced record,
+ * or when a different file is written.  The check is made when saving
+ * a record, so the last group may stay unsynced until the next save, or
+ * until store_sync is called */
+#ifndef STORE_DURABILITY
+#define STORE_DURABILITY		STORE_DURABILITY_WRITE
+#endif /* STORE_DURABILITY */
+#ifndef STORE_GROUP_COMMIT_RECORDS
+#define STORE_GROUP_COMMIT_RECORDS	16
+#endif /* STORE_GROUP_COMMIT_RECORDS */
+#ifndef STORE_GROUP_COMMIT_SECONDS
+#define STORE_GROUP_COMMIT_SECONDS	2
+#endif /* STORE_GROUP_COMMIT_SECONDS */
+static int store_durability = STORE_DURABILITY;
+static char * unsynced_path = NULL;  /* dynamically allocated */
+static int unsynced_records = 0;
+static time_t unsynced_since = 0;
+static pthread_mutex_t durability_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void sync_fd (int fd)
+{
+  if (fsync (fd) != 0)  /* fdatasync is not available everywhere */
+    perror ("fsync");
+}
+
+/* must be called with durability_mutex held */
+static void sync_unsynced ()
+{
+  if (unsynced_path != NULL) {
+    int fd = open (unsynced_path, O_WRONLY);
+    if (fd >= 0) {  /* syncing the file through any descriptor is enough */
+      sync_fd (fd);
+      close (fd);
+    }
+    free (unsynced_path);
+  }
+  unsynced_path = NULL;
+  unsynced_records = 0;
+}
+
+/* called after a record has been written to fd, with the file locked */
+static void commit_record (int fd, const char * path)
+{
+  pthread_mutex_lock (&durability_mutex);
+  if (store_durability == STORE_DURABILITY_SYNC) {
+    sync_fd (fd);
+  } else if (store_durability == STORE_DURABILITY_GROUP) {
+    time_t now = time (NULL);
+    if ((unsynced_path != NULL) && (strcmp (unsynced_path, path) != 0))
+      sync_unsynced ();
+    if (unsynced_path == NULL) {
+      unsynced_path = strcpy_malloc (path, "commit_record");
+      unsynced_since = now;
+    }
+    unsynced_records++;
+    if ((unsynced_records >= STORE_GROUP_COMMIT_RECORDS) ||
+        (now >= unsynced_since + STORE_GROUP_COMMIT_SECONDS)) {
+      sync_fd (fd);
+      free (unsynced_path);
+      unsynced_path = NULL;
+      unsynced_records = 0;
+    }
   }
-  store_save_64 (fd, tz);
-  store_save_string (fd, ")/");
-  store_save_64 (fd, rcvd);
-  store_save_string (fd, "\n");
+  pthread_mutex_unlock (&durability_mutex);
+}
+
+void set_store_durability (int level)
+{
+  pthread_mutex_lock (&durability_mutex);
+  sync_unsynced ();
+  if ((level == STORE_DURABILITY_WRITE) || (level == STORE_DURABILITY_GROUP) ||
+      (level == STORE_DURABILITY_SYNC))
+    store_durability = level;
+  else
+    printf ("set_store_durability: unknown level %d\n", level);
+  pthread_mutex_unlock (&durability_mutex);
+}
+
+void store_sync (void)
+{
+  pthread_mutex_lock (&durability_mutex);
+  sync_unsynced ();
+  pthread_mutex_unlock (&durability_mutex);
 }
 
 /* add an individual message, modifying msgs, num_alloc or num_used as needed
@@ -1230,6 +2767,9 @@ printf ("p->msize %d != strlen (p->message) %d, %d\n",
 
 /* saves the record.  If type is MSG_TYPE_RCVD, also fills in 
  * prev_missing (if not null) */
+/* held while updating last_sent and last_received */
+static pthread_mutex_t last_seq_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void save_record (const char * contact, keyset k, int type, uint64_t seq,
                   uint64_t t, int tz_min, uint64_t rcvd_time,
                   const char * message_ack, const char * message, int msize,
@@ -1239,9 +2779,10 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
   if ((type != MSG_TYPE_RCVD) && (type != MSG_TYPE_SENT) &&
       (type != MSG_TYPE_ACK))
     return;
-  struct msg_iter iter;
-  if (! start_iter_from_file (contact, k, &iter))
+  char * dir = get_xchat_dir (k);
+  if (dir == NULL)
     return;
+  create_dir (dir, 0);
   time_t now;
   time (&now);
   struct tm * tm = gmtime (&now);
@@ -1250,8 +2791,8 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
   char fname [DATE_LEN + EXTENSION_LENGTH + 1];
   snprintf (fname, sizeof (fname), "%04d%02d%02d%s", tm->tm_year + 1900,
             tm->tm_mon + 1, tm->tm_mday, EXTENSION);
-  char * path = strcat3_malloc (iter.dirname, "/", fname, "save_record");
-  free_unallocated_iter (&iter);
+  char * path = strcat3_malloc (dir, "/", fname, "save_record");
+  free (dir);
   int fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0600);
   if (fd < 0) {
     perror ("open");
@@ -1262,24 +2803,44 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
  
   flock (fd, LOCK_EX);  /* exclusive write, otherwise multiple writers
                          * make a mess of the file */
-  store_save_message_type (fd, type);
-  store_save_message_id (fd, message_ack);
+  struct stat st;
+  int64_t text_start = (fstat (fd, &st) == 0) ? st.st_size : -1;
+  char local [1024];
+  struct store_buffer b = { local, 0, sizeof (local), 0 };
+  store_save_message_type (&b, type);
+  store_save_message_id (&b, message_ack);
   char id [MESSAGE_ID_SIZE];
   sha512_bytes (message_ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
-  store_save_message_id (fd, id);
-  store_save_string (fd, "\n");
+  store_save_message_id (&b, id);
+  store_save_string (&b, "\n");
 
   if (type != MSG_TYPE_ACK) {
-    store_save_message_seq_time (fd, seq, t, tz_min, rcvd_time);
-    store_save_message (fd, message, msize);
-  }
+    store_save_message_seq_time (&b, seq, t, tz_min, rcvd_time);
+    store_save_message (&b, message, msize);
+  }
+  store_write_buffer (fd, &b);
+  if (b.on_heap)
+    free (b.data);
+  commit_record (fd, path);
+  int have_st = (fstat (fd, &st) == 0);
+  int64_t text_added = have_st ? st.st_size - text_start : -1;
   flock (fd, LOCK_UN);  /* remove the file lock */
 
   close (fd);
   free (path);
+  file_changed (k, fname, (have_st ? &st : NULL));
+  if (text_start >= 0)  /* otherwise the log is rebuilt when next used */
+    append_record (k, type, seq, t, tz_min, rcvd_time, message_ack,
+                   message, msize, text_added);
+  if (type == MSG_TYPE_RCVD) {
+    pthread_mutex_lock (&received_mutex);
+    struct received_ranges * rr = get_received (k, 0);
+    if (rr != NULL)   /* otherwise it is read from the records when needed */
+      add_received (rr, seq);
+    pthread_mutex_unlock (&received_mutex);
+  }
   /* now save it internally, if we are caching this contact's data */
-  pthread_mutex_lock (&message_cache_mutex);
-  int index = find_message_cache_record (contact);
+  int index = acquire_message_cache (contact, 0);
   if (index >= 0) {
     if ((type == MSG_TYPE_SENT) || (type == MSG_TYPE_RCVD)) {
       add_message (&(message_cache [index].msgs),
@@ -1299,8 +2860,10 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
       ack_one_message (message_cache [index].msgs,
                        message_cache [index].num_used, message_ack, rcvd_time);
     }
+    release_message_cache (index, 1, 1);
   }
   /* save the sequence number if it is a new maximum */
+  pthread_mutex_lock (&last_seq_mutex);
   if (type == MSG_TYPE_SENT) {
     uint64_t max_seq = read_int_from_file (contact, k, "last_sent");
     if (max_seq < seq)
@@ -1310,7 +2873,7 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
     if (max_seq < seq)
       save_int_to_file (contact, k, "last_received", seq);
   }
-  pthread_mutex_unlock (&message_cache_mutex);
+  pthread_mutex_unlock (&last_seq_mutex);
 }
 
 #ifdef DEBUG_PRINT
@@ -1381,7 +2944,6 @@ static void add_all_messages (struct message_store_info ** msgs,
   free_unallocated_iter (&iter);
 }
 
-/* must be called with message_cache_mutex held */
 static int
   list_all_messages_from_file (const char * contact,
                                struct message_store_info ** msgs,
@@ -1420,10 +2982,9 @@ int list_all_messages (const char * contact,
       (num_alloc == NULL) || (num_used == NULL))
     return 0;
   *num_used = 0;
-  pthread_mutex_lock (&message_cache_mutex);
-  int index = find_message_cache_record (contact);
+  int index = acquire_message_cache (contact, 1);
   int result = 0;
-  if (index >= 0) {   /* it is in memory, use the iterator */
+  if (index >= 0) {   /* it is in memory, copy it */
     struct message_cache_record * cache = message_cache + index;
     size_t size = cache->num_used * sizeof (struct message_store_info);
     if (cache->num_used > *num_alloc) {  /* reallocate */
@@ -1440,10 +3001,10 @@ int list_all_messages (const char * contact,
         (*msgs) [i].message = strcpy_malloc (cache->msgs [i].message,
                                              "list_all_messages");
     result = 1;
-  } else {   /* not (yet) in memory */
+    release_message_cache (index, 1, 0);
+  } else {   /* unable to cache */
     result = list_all_messages_from_file (contact, msgs, num_alloc, num_used);
   }
-  pthread_mutex_unlock (&message_cache_mutex);
   return result;
 }
 
@@ -1460,19 +3021,183 @@ void free_all_messages (struct message_store_info * msgs, int num_used)
   }
 }
 
-static int64_t file_storage_size (const char * fname)
+/* a message that may be listed by list_messages_page */
+struct page_key {
+  struct time_key key;
+  keyset k;
+};
+
+/* most recent first */
+static int compare_page_key (const void * a, const void * b)
 {
-  struct stat st;
-  int result = stat (fname, &st);
-  if (result != 0) {
-    perror ("file_size stat");
-    printf ("store.c file_size unable to stat '%s'\n", fname);
-    return -1;
+  const struct page_key * x = (const struct page_key *) a;
+  const struct page_key * y = (const struct page_key *) b;
+  int c = compare_time_key (&(y->key), &(x->key));
+  if (c != 0)
+    return c;
+  return (x->k < y->k) ? -1 : ((x->k > y->k) ? 1 : 0);
+}
+
+/* most recent first, in the same order as compare_page_key */
+static int compare_message_info (const void * a, const void * b)
+{
+  const struct message_store_info * x = (const struct message_store_info *) a;
+  const struct message_store_info * y = (const struct message_store_info *) b;
+  if (x->time != y->time)
+    return (x->time > y->time) ? -1 : 1;
+  if (x->seq != y->seq)
+    return (x->seq > y->seq) ? -1 : 1;
+  if (x->msg_type != y->msg_type)
+    return (x->msg_type > y->msg_type) ? -1 : 1;
+  return (x->keyset < y->keyset) ? -1 : ((x->keyset > y->keyset) ? 1 : 0);
+}
+
+/* make sure *msgs has room for count messages, as in list_all_messages */
+static void page_space (struct message_store_info ** msgs, int * num_alloc,
+                        int count)
+{
+  if (count > *num_alloc) {
+    if (*msgs != NULL)
+      free (*msgs);
+    *msgs = malloc_or_fail (count * sizeof (struct message_store_info),
+                            "list_messages_page");
+    *num_alloc = count;
+  }
+}
+
+/* used when a keyset has no record index: selects the page from the
+ * complete list of messages */
+static int list_messages_page_from_all (const char * contact,
+                                        const struct time_key * before,
+                                        int count,
+                                        struct message_store_info ** msgs,
+                                        int * num_alloc, int * num_used)
+{
+  struct message_store_info * all = NULL;
+  int all_alloc = 0;
+  int all_used = 0;
+  if (! list_all_messages (contact, &all, &all_alloc, &all_used))
+    return 0;
+  qsort (all, all_used, sizeof (struct message_store_info),
+         compare_message_info);
+  page_space (msgs, num_alloc, count);
+  int i;
+  for (i = 0; i < all_used; i++) {
+    struct time_key key = { all [i].time, all [i].seq, all [i].msg_type, 0 };
+    if ((*num_used < count) && (compare_time_key (&key, before) < 0))
+      (*msgs) [(*num_used)++] = all [i];   /* the message now belongs here */
+    else
+      free_all_messages (all + i, 1);
+  }
+  free (all);
+  return 1;
+}
+
+/* reads the selected message into info, returns 1 if it is still there */
+static int read_page_message (struct page_key * pk,
+                              struct message_store_info * info)
+{
+  int result = 0;
+  pthread_mutex_lock (&record_mutex);
+  struct record_index * ri = get_records (pk->k, 0);
+  int pos = pk->key.pos;
+  if ((ri != NULL) && (pos < ri->count) &&
+      (ri->entries [pos].time == pk->key.time) &&
+      (ri->entries [pos].seq == pk->key.seq) &&
+      (ri->entries [pos].type == pk->key.type)) {
+    memset (info, 0, sizeof (struct message_store_info));
+    char * message = NULL;
+    int msize = 0;
+    info->keyset = pk->k;
+    info->msg_type = read_record (ri, pos, &(info->seq), &(info->time),
+                                  &(info->tz_min), &(info->rcvd_ackd_time),
+                                  info->ack, &message, &msize);
+    if (info->msg_type == pk->key.type) {
+      if (info->msg_type == MSG_TYPE_SENT) {
+        int ack_pos = find_ack_entry (ri, MSG_TYPE_ACK, info->ack);
+        if (ack_pos >= 0) {
+          info->rcvd_ackd_time = ri->entries [ack_pos].time;
+          info->message_has_been_acked = 1;
+        }
+      }
+      if ((message != NULL) && (msize == 0)) {
+        free (message);
+        message = "";
+      }
+      info->message = ((message != NULL) ? message : "");
+      info->msize = ((message != NULL) ? msize : 0);
+      result = 1;
+    } else if (message != NULL) {
+      free (message);
+    }
   }
-  size_t len = strlen (fname);
-  if ((len > 3) && (strcmp ("/..", fname + (len - 3)) == 0))
-    return 0;  /* do not count parent directory */
-  return st.st_blocks * 512;
+  pthread_mutex_unlock (&record_mutex);
+  return result;
+}
+
+int list_messages_page (const char * contact, uint64_t before_time,
+                        uint64_t before_seq, int before_type, int count,
+                        struct message_store_info ** msgs,
+                        int * num_alloc, int * num_used)
+{
+  if ((contact == NULL) || (msgs == NULL) ||
+      (num_alloc == NULL) || (num_used == NULL) || (count <= 0))
+    return 0;
+  *num_used = 0;
+  keyset * k = NULL;
+  int nk = all_keys (contact, &k);
+  if (nk <= 0)  /* no such contact, or this contact has no keys */
+    return 0;
+  struct time_key before = { before_time, before_seq, before_type, 0 };
+  if (before_time == 0) {
+    before.time = UINT64_MAX;
+    before.seq = UINT64_MAX;
+    before.type = MSG_TYPE_SENT + 1;   /* greater than any listed type */
+  }
+  /* first find the page using only the index, then read its messages */
+  struct page_key * keys =
+    malloc_or_fail (nk * count * sizeof (struct page_key),
+                    "list_messages_page keys");
+  int nkeys = 0;
+  int ik;
+  pthread_mutex_lock (&record_mutex);
+  for (ik = 0; ik < nk; ik++) {
+    struct record_index * ri = get_records (k [ik], 1);
+    if (ri == NULL)
+      break;
+    int i = lower_bound (ri->by_time, ri->nseq, sizeof (struct time_key),
+                         &before, compare_time_key);
+    int n;
+    for (n = 0; (n < count) && (--i >= 0); n++) {
+      keys [nkeys].key = ri->by_time [i];
+      keys [nkeys].k = k [ik];
+      nkeys++;
+    }
+  }
+  pthread_mutex_unlock (&record_mutex);
+  if (ik < nk) {   /* no index for some keyset */
+    free (keys);
+    free (k);
+    return list_messages_page_from_all (contact, &before, count,
+                                        msgs, num_alloc, num_used);
+  }
+  free (k);
+  qsort (keys, nkeys, sizeof (struct page_key), compare_page_key);
+  if (nkeys > count)
+    nkeys = count;
+  page_space (msgs, num_alloc, nkeys);
+  int i;
+  for (i = 0; i < nkeys; i++) {
+    struct message_store_info * info = (*msgs) + *num_used;
+    if (read_page_message (keys + i, info)) {
+      if (info->msg_type == MSG_TYPE_RCVD)
+        missing_before (contact, info->keyset, info->seq,
+                        &(info->prev_missing));
+      (*num_used)++;
+    }
+  }
+  free (keys);
+  return 1;
 }
 
 /* returns a system time that can be compared,
@@ -1512,81 +3237,21 @@ int64_t conversation_size (const char * contact)
   int success = 0;
   int i;
   int64_t result = 0;
+  pthread_mutex_lock (&files_mutex);
   for (i = 0; i < n; i++) {
-    char * contacts_dir = key_dir (k [i]);
-    if (contacts_dir == NULL) {
-      printf ("no key_dir for contact %s, key [%d] %d\n", contact, i, k [i]);
-      continue;              /* try the next key */
+    struct xchat_files * xf = get_files (k [i]);
+    if (xf != NULL) {   /* found something, count it */
+      result += xf->total;
+      success = 1;
     }
-    char * xchat_dir =
-      string_replace_once (contacts_dir, "contacts", "xchat", 1);
-    free (contacts_dir);
-    DIR * dir = opendir (xchat_dir);
-    if (dir == NULL) {
-#ifdef DEBUG_PRINT
-      perror ("conversation_size opendir");
-      printf ("unable to open directory %s\n", xchat_dir);
-#endif /* DEBUG_PRINT */
-      free (xchat_dir);
-      continue;              /* try the next key */
-    }
-    struct dirent * dep;
-    while ((dep = readdir (dir)) != NULL) {
-      char * path =
-        strcat3_malloc (xchat_dir, "/", dep->d_name, "conversation_size");
-      int64_t new_result = file_storage_size (path);
-      free (path);
-      if (new_result > 0)
-        result += new_result;
-      if (new_result >= 0)   /* found something, count it */
-        success = 1;
-    }
-    closedir (dir);
-    free (xchat_dir);
   }
-  if (k != NULL)
-    free (k);
+  pthread_mutex_unlock (&files_mutex);
+  free (k);
   if (success)
     return result;
   return -1;
 }
 
-static char * oldest_nonempty_file (const char * contact)
-{
-  keyset * k = NULL;
-  int n = all_keys (contact, &k);
-  int i;
-  char * oldest_fname = NULL;
-  uint64_t oldest_time = 0;
-  for (i = 0; i < n; i++) {
-    char * xchat_dir = get_xchat_dir (k [i]);
-    if (xchat_dir == NULL)
-      continue;
-    DIR * dir = opendir (xchat_dir);
-    if (dir != NULL) {
-      struct dirent * de;
-      while ((de = readdir (dir)) != NULL)
-      {
-        char * fname = strcat3_malloc (xchat_dir, "/", de->d_name,
-                                       "oldest_nonemtpy_file");
-        
-        uint64_t ftime = file_mod_time (fname, 1);
-        if ((ftime != 0) && ((oldest_time == 0) || (oldest_time > ftime))) {
-          oldest_time = ftime;
-          if (oldest_fname != NULL)  /* malloc'd, must be free'd */
-            free (oldest_fname);
-          oldest_fname = fname;
-        } else {
-          free (fname);
-        }
-      }
-      closedir (dir);
-    }
-    free (xchat_dir);
-  }
-  return oldest_fname;
-}
-
 /* remove older files one by one until the remaining conversation size
  * is less than or equal to max_size
  * returns 1 for success, 0 for failure. */
@@ -1595,23 +3260,67 @@ int reduce_conversation (const char * contact, uint64_t max_size_u)
   int64_t max_size = (int64_t) max_size_u;
   if (contact == NULL)
     return 0;
-  while (conversation_size (contact) > max_size) {
-    char * fname = oldest_nonempty_file (contact);
-    if (fname == NULL) {
+  keyset * k = NULL;
+  int n = all_keys (contact, &k);
+  if (n <= 0) {
+    if (k != NULL)
+      free (k);
+    return 1;  /* no conversation, nothing to remove */
+  }
+  int result = 1;
+  int removed = 0;
+  pthread_mutex_lock (&files_mutex);
+  while (1) {
+    int64_t size = 0;
+    int oldest_index = -1;
+    uint64_t oldest_time = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+      struct xchat_files * xf = get_files (k [i]);
+      if (xf == NULL)
+        continue;
+      size += xf->total;
+      if ((xf->first < xf->count) &&
+          ((oldest_index < 0) || (oldest_time > xf->files [xf->first].mtime))) {
+        oldest_index = i;
+        oldest_time = xf->files [xf->first].mtime;
+      }
+    }
+    if (size <= max_size)
+      break;
+    struct xchat_files * oldest =
+      ((oldest_index < 0) ? NULL : get_files (k [oldest_index]));
+    if ((oldest == NULL) || (oldest->first >= oldest->count)) {
     /* could be an error, but more likely, no files left and
        max_size > size of the empty dir */
-      printf ("oldest_nonempty is NULL, %" PRId64 " remain\n",
-              conversation_size (contact));
-      return 1;      /* success of some kind or other */
+      printf ("oldest_nonempty is NULL, %" PRId64 " remain\n", size);
+      break;         /* success of some kind or other */
     }
+    char * name = strcpy_malloc (oldest->files [oldest->first].name,
+                                 "reduce_conversation");
+    char * fname = strcat3_malloc (oldest->dir, "/", name,
+                                   "reduce_conversation");
     if (unlink (fname) != 0) {
       perror ("unlink");
       printf ("unable to remove %s\n", fname);
-      return 0;   /* if we continue, we are in an infinite loop */
+      result = 0;   /* if we continue, we are in an infinite loop */
+    } else {
+      remove_file_entry (oldest, name);
+      removed = 1;
     }
     free (fname);
+    free (name);
+    if (result == 0)
+      break;
+  }
+  pthread_mutex_unlock (&files_mutex);
+  int i;
+  for (i = 0; (removed) && (i < n); i++) {   /* rebuilt from the remaining text */
+    forget_records (k [i]);
+    forget_received (k [i]);
   }
-  return 1;  /* success */
+  free (k);
+  return result;
 }
 
 /* returns 1 for success, 0 for failure. */
@@ -1628,7 +3337,11 @@ int delete_conversation (const char * contact)
     char * xchat_dir = get_xchat_dir (k [i]);
     rmdir_and_all_files (xchat_dir);
     free (xchat_dir);
+    forget_records (k [i]);
+    forget_received (k [i]);
+    forget_files (k [i]);
   }
+  free (k);
   return 1;
 }
 
@@ -1645,8 +3358,14 @@ int clear_conversation (const char * contact)
   for (i = 0; i < n; i++) {
     char * xchat_dir = get_xchat_dir (k [i]);
     rmdir_matching (xchat_dir, ".txt");
+    rmdir_matching (xchat_dir, RECORD_LOG_NAME);
+    rmdir_matching (xchat_dir, RECORD_INDEX_NAME);
     free (xchat_dir);
+    forget_records (k [i]);
+    forget_received (k [i]);
+    forget_files (k [i]);
   }
+  free (k);
   return 1;
 }
 
@@ -1681,6 +3400,7 @@ int xchat_file_write (const char * contact, keyset k,
     return 0;
   write_file (path, content, clength, 0);
   free (path);
+  file_changed (k, fname, NULL);
   return 1;
 }
 
@@ -1710,6 +3430,7 @@ int xchat_file_delete (const char * contact, keyset k,
     return 0;
   int result = (unlink (path) == 0);
   free (path);
+  file_changed (k, fname, NULL);
   return result;
 }
 
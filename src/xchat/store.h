@@ -58,6 +58,21 @@ extern int most_recent_record (const char * contact, keyset k, int type_wanted,
                                uint64_t * rcvd_time, char * message_ack,
                                char ** message, int * msize);
 
+/* returns type_wanted (MSG_TYPE_SENT or MSG_TYPE_RCVD) if there is a message
+ * of that type with the given sequence number, and fills in the results
+ * from the most recently saved such message.  Otherwise MSG_TYPE_DONE */
+extern int find_seq_record (const char * contact, keyset k, int type_wanted,
+                            uint64_t seq, uint64_t * time, int * tz_min,
+                            uint64_t * rcvd_time, char * message_ack,
+                            char ** message, int * msize);
+
+/* returns type_wanted (MSG_TYPE_SENT, MSG_TYPE_RCVD, or MSG_TYPE_ACK) if
+ * there is a record of that type with the given message_ack, and if so
+ * and seq is not NULL, sets it to the record's sequence number (0 for acks).
+ * Otherwise returns MSG_TYPE_DONE */
+extern int find_ack_record (const char * contact, keyset k, int type_wanted,
+                            const char * message_ack, uint64_t * seq);
+
 /* saves the record.  If type is MSG_TYPE_RCVD, also fills in 
  * prev_missing (if not null) */
 extern void save_record (const char * contact, keyset k, int type,
@@ -66,6 +81,23 @@ extern void save_record (const char * contact, keyset k, int type,
                          const char * message, int msize,
                          uint64_t * prev_missing);
 
+/* how hard save_record works to get records to the disk:
+ * STORE_DURABILITY_WRITE writes each record to the file (the default),
+ *   leaving it to the operating system to flush it to the disk
+ * STORE_DURABILITY_GROUP also syncs the file after every few records,
+ *   or when a few seconds have passed since the first unsynced record
+ * STORE_DURABILITY_SYNC syncs the file after every record */
+#define STORE_DURABILITY_WRITE	0
+#define STORE_DURABILITY_GROUP	1
+#define STORE_DURABILITY_SYNC	2
+extern void set_store_durability (int level);
+/* sync any records not yet synced under STORE_DURABILITY_GROUP */
+extern void store_sync (void);
+
+/* returns 1 if a message with this sequence number has been received
+ * with this keyset, 0 otherwise */
+extern int received_seq (keyset k, uint64_t seq);
+
 /* to be called with the sequence number of a received message.
  * returns 1 and fills in the results if successful, or returns 0 otherwise */
 extern int missing_before (const char * contact, keyset k, uint64_t seq,
@@ -103,6 +135,20 @@ extern int list_all_messages (const char * contact,
 /* frees the message storage pointed to by each message entry */
 extern void free_all_messages (struct message_store_info * msgs, int num_used);
 
+/* like list_all_messages, but only lists (at most) count messages, the most
+ * recent of those that come before the given message.  Messages are listed
+ * most recent first by time, then sequence number, then type (a sent
+ * message is listed before a received message with the same time and
+ * sequence number).
+ * To list the most recent messages, before_time should be 0.  To list the
+ * next page, pass the time, seq, and msg_type of the last message listed.
+ * Uses the index of each keyset, so does not read the whole conversation.
+ * return 1 if successful, 0 if not */
+extern int list_messages_page (const char * contact, uint64_t before_time,
+                               uint64_t before_seq, int before_type,
+                               int count, struct message_store_info ** msgs,
+                               int * num_alloc, int * num_used);
+
 #if 0   /* deleted 2019/10/05 -- nobody seems to use it, and it is hard to use it right */
 /* add an individual message, modifying msgs, num_alloc or num_used as needed
  * 0 <= position <= *num_used
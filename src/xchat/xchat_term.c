@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
 #include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
@@ -52,145 +53,231 @@
 static const char * prompt = XCHAT_TERM_HELP_MESSAGE "<no contact>";
 static int interrupted = 0;
 
-static void print_to_output (const char * string)
+/* output is collected in a term_output and written to the terminal with
+ * a single write, which on a slow console is much faster than many
+ * small writes.  Anything printed with printf is flushed first */
+struct term_output {
+  char * buf;
+  size_t used;
+  size_t alloc;
+};
+
+static void output_add (struct term_output * out, const char * format, ...)
+{
+  while (1) {
+    va_list ap;
+    va_start (ap, format);
+    size_t room = out->alloc - out->used;
+    int n = vsnprintf (((out->buf == NULL) ? NULL : out->buf + out->used),
+                       room, format, ap);
+    va_end (ap);
+    if (n < 0)
+      return;
+    if ((size_t) n < room) {
+      out->used += n;
+      return;
+    }
+    size_t new_alloc = ((out->alloc == 0) ? 4096 : out->alloc * 2);
+    while (new_alloc <= out->used + n)
+      new_alloc *= 2;
+    char * new = malloc_or_fail (new_alloc, "xt output_add");
+    if (out->buf != NULL) {
+      memcpy (new, out->buf, out->used);
+      free (out->buf);
+    }
+    out->buf = new;
+    out->alloc = new_alloc;
+  }
+}
+
+static void output_free (struct term_output * out)
+{
+  if (out->buf != NULL)
+    free (out->buf);
+  out->buf = NULL;
+  out->used = 0;
+  out->alloc = 0;
+}
+
+/* writes string, if any, then the prompt if with_prompt */
+static void write_output (const char * string, int with_prompt)
 {
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
   pthread_mutex_lock (&mutex);  /* only one thread at a time may print */
-  int add_newline = ((string == NULL) || (strlen (string) == 0) ||
-                     ((strlen (string) > 0) &&
-                      (string [strlen (string) - 1] != '\n')));
+  struct term_output out = { NULL, 0, 0 };
+  size_t len = ((string == NULL) ? 0 : strlen (string));
   if (string != NULL)
-    printf ("%s%s", string, ((add_newline) ? "\n" : "")); 
-  if (strlen (prompt) > 0) /* print the prompt, with a colon */
-    printf ("%s: ", prompt);
+    output_add (&out, "%s", string);
+  if ((with_prompt) && ((len == 0) || (string [len - 1] != '\n')))
+    output_add (&out, "\n");
+  if ((with_prompt) && (strlen (prompt) > 0)) /* the prompt, with a colon */
+    output_add (&out, "%s: ", prompt);
   fflush (stdout);
+  size_t off = 0;
+  while (off < out.used) {
+    ssize_t w = write (STDOUT_FILENO, out.buf + off, out.used - off);
+    if (w <= 0)
+      break;
+    off += w;
+  }
+  output_free (&out);
   pthread_mutex_unlock (&mutex);
 }
 
+static void print_to_output (const char * string)
+{
+  write_output (string, 1);
+}
+
 #define MESSAGE_BUF_SIZE	(1000)
 #define PRINT_BUF_SIZE		(ALLNET_MTU + MESSAGE_BUF_SIZE)
 
+/* after each packet, the receive thread handles up to this many more
+ * packets that are already waiting, then prints everything at once */
+#define XT_RECEIVE_BATCH	100
+
 struct receive_thread_args {
   int sock;
   int print_duplicates;
 };
 
+struct receive_state {
+  char * old_contact;
+  keyset old_kset;
+  int need_prompt;   /* something was added that should end with the prompt */
+};
+
 /* variables to keep track of trace messages */
 static char expecting_trace [MESSAGE_ID_SIZE];  /* trace we are looking for */
 static int trace_count = 0;  /* changes every time we start a new trace */
 static unsigned long long int trace_start_time = 0;
 
-static void * receive_thread (void * arg)
+static void receive_one (struct receive_thread_args * a, char * packet,
+                         int found, unsigned int pri,
+                         struct receive_state * state,
+                         struct term_output * out)
 {
-  struct receive_thread_args a = *((struct receive_thread_args *) arg);
-  char * old_contact = NULL;
-  keyset old_kset = -1;
-  while (1) {
-    char * packet;
-    unsigned int pri;
-    int found = local_receive (1000, &packet, &pri);
-    if (found < 0) {
-      printf ("xt pipe closed, thread exiting\n");
-      exit (1);
+  /* it's good to call handle_packet even if we didn't get a packet */
+  int verified = 0, duplicate = -1, broadcast = -2;
+  uint64_t seq = 0;
+  uint64_t prev_missing = 0;
+  char * peer = NULL;
+  keyset kset = 0;
+  char * desc = NULL;
+  char * message = NULL;
+  struct allnet_ack_info acks;
+  acks.num_acks = 0;
+  struct allnet_mgmt_trace_reply * trace = NULL;
+  int mlen = handle_packet (a->sock, packet, found, pri, &peer, &kset,
+                            &message, &desc, &verified, &seq, NULL,
+                            &prev_missing,
+                            &duplicate, &broadcast, &acks, &trace);
+  if (mlen > 0) {
+    /* time_t rtime = time (NULL); */
+    char * ver_mess = "";
+    if (! verified)
+      ver_mess = " (not verified)";
+    char p_mess [1000] = "";
+    if (prev_missing > 0)
+      snprintf (p_mess, sizeof (p_mess),
+                " (%" PRIu64 " missing)", prev_missing);
+    char * dup_mess = "";
+    if (duplicate)
+      dup_mess = "duplicate ";
+    char * bc_mess = "";
+    if (broadcast) {
+      bc_mess = "broadcast ";
+      dup_mess = "";
+      p_mess [0] = '\0';
+      desc = "";
     }
-    /* it's good to call handle_packet even if we didn't get a packet */
-    int verified = 0, duplicate = -1, broadcast = -2;
-    uint64_t seq = 0;
-    uint64_t prev_missing = 0;
-    char * peer = NULL;
-    keyset kset = 0;
-    char * desc = NULL;
-    char * message = NULL;
-    struct allnet_ack_info acks;
-    acks.num_acks = 0;
-    struct allnet_mgmt_trace_reply * trace = NULL;
-    int mlen = handle_packet (a.sock, packet, found, pri, &peer, &kset,
-                              &message, &desc, &verified, &seq, NULL,
-                              &prev_missing,
-                              &duplicate, &broadcast, &acks, &trace);
-    if (mlen > 0) {
-      /* time_t rtime = time (NULL); */
-      char * ver_mess = "";
-      if (! verified)
-        ver_mess = " (not verified)";
-      char p_mess [1000] = "";
-      if (prev_missing > 0)
-        snprintf (p_mess, sizeof (p_mess),
-                  " (%" PRIu64 " missing)", prev_missing);
-      char * dup_mess = "";
-      if (duplicate)
-        dup_mess = "duplicate ";
-      char * bc_mess = "";
-      if (broadcast) {
-        bc_mess = "broadcast ";
-        dup_mess = "";
-        p_mess [0] = '\0';
-        desc = "";
-      }
-      if ((! duplicate) || (a.print_duplicates)) {
-        char string [PRINT_BUF_SIZE];
-        if (strcmp (prompt, peer) != 0) {
-          snprintf (string, sizeof (string),
-                    "from '%s'%s got %s%s%s%s\n  %s\n",
+    if ((! duplicate) || (a->print_duplicates)) {
+      if (strcmp (prompt, peer) != 0) {
+        output_add (out, "from '%s'%s got %s%s%s%s\n  %s\n",
                     peer, ver_mess, dup_mess, p_mess, bc_mess, desc, message);
-          if ((! broadcast) && (! interrupted)) {
-            printf ("(conversation interrupted, switching to no contact)\n");
-            prompt = "<no contact>";
-            interrupted = 1;
-          }
-        } else {
-          snprintf (string, sizeof (string),
-                    "got %s%s%s%s\n  %s\n",
-                    dup_mess, p_mess, bc_mess, desc, message);
+        if ((! broadcast) && (! interrupted)) {
+          output_add (out,
+                      "(conversation interrupted, switching to no contact)\n");
+          prompt = "<no contact>";
+          interrupted = 1;
         }
-        print_to_output (string);
-      }
-      if ((! broadcast) &&
-          ((old_contact == NULL) ||
-           (strcmp (old_contact, peer) != 0) || (old_kset != kset))) {
-        request_and_resend (a.sock, peer, kset, 1);
-        if (old_contact != NULL)
-          free (old_contact);
-        old_contact = peer;
-        old_kset = kset;
-      } else {  /* same peer */
-        free (peer);
+      } else {
+        output_add (out, "got %s%s%s%s\n  %s\n",
+                    dup_mess, p_mess, bc_mess, desc, message);
       }
-      free (message);
-      if (! broadcast)
-        free (desc);
-    } else if (mlen < 0) {
-      char string [PRINT_BUF_SIZE] = "";
-      if (mlen == -1)        /* confirm successful key exchange */
-        snprintf (string, sizeof (string), "from '%s' got key\n", peer);
-      else if (mlen == -2)   /* confirm successful subscription */
-        snprintf (string, sizeof (string), "subscription %s complete\n", peer);
-      else if ((mlen == -4)  /* got a trace reply */
+      state->need_prompt = 1;
+    }
+    if ((! broadcast) &&
+        ((state->old_contact == NULL) ||
+         (strcmp (state->old_contact, peer) != 0) ||
+         (state->old_kset != kset))) {
+      request_and_resend (a->sock, peer, kset, 1);
+      if (state->old_contact != NULL)
+        free (state->old_contact);
+      state->old_contact = peer;
+      state->old_kset = kset;
+    } else {  /* same peer */
+      free (peer);
+    }
+    free (message);
+    if (! broadcast)
+      free (desc);
+  } else if (mlen < 0) {
+    if (mlen == -1) {        /* confirm successful key exchange */
+      output_add (out, "from '%s' got key\n", peer);
+      state->need_prompt = 1;
+    } else if (mlen == -2) { /* confirm successful subscription */
+      output_add (out, "subscription %s complete\n", peer);
+      state->need_prompt = 1;
+    } else if ((mlen == -4)  /* got a trace reply */
                && (trace != NULL)
                && (memcmp (trace->trace_id, expecting_trace,
                            MESSAGE_ID_SIZE) == 0)) {
-        trace_to_string (string, sizeof (string), trace,
-                         trace_count, trace_start_time);
-        printf ("%s", string);
-        string [0] = '\0';   /* do not call print_to_output */
-      }
-      if (strlen (string) > 0)
-        print_to_output (string);
+      char string [PRINT_BUF_SIZE];  /* printed without the prompt */
+      trace_to_string (string, sizeof (string), trace,
+                       trace_count, trace_start_time);
+      output_add (out, "%s", string);
     }
-    if (acks.num_acks > 0) {
-      int i;
-      for (i = 0; i < acks.num_acks; i++) {
-        char string [PRINT_BUF_SIZE];
-        if (strcmp (prompt, acks.peers [i]) != 0)
-          snprintf (string, sizeof (string),
-                    "from '%s' got ack for seq %" PRIu64 "\n", acks.peers [i],
-                    acks.acks [i]);
-        else
-          snprintf (string, sizeof (string),
-                    "got ack for seq %" PRIu64 "\n", acks.acks [i]);
-        print_to_output (string);
+  }
+  int i;
+  for (i = 0; i < acks.num_acks; i++) {
+    if (strcmp (prompt, acks.peers [i]) != 0)
+      output_add (out, "from '%s' got ack for seq %" PRIu64 "\n",
+                  acks.peers [i], acks.acks [i]);
+    else
+      output_add (out, "got ack for seq %" PRIu64 "\n", acks.acks [i]);
+    state->need_prompt = 1;
+  }
+}
+
+/* handles the packet it receives and any others already waiting,
+ * then updates the screen once */
+static void * receive_thread (void * arg)
+{
+  struct receive_thread_args a = *((struct receive_thread_args *) arg);
+  struct receive_state state = { NULL, -1, 0 };
+  struct term_output out = { NULL, 0, 0 };
+  while (1) {
+    char * packet;
+    unsigned int pri;
+    int found = local_receive (1000, &packet, &pri);
+    int count = 0;
+    while (1) {
+      if (found < 0) {
+        printf ("xt pipe closed, thread exiting\n");
+        exit (1);
       }
+      receive_one (&a, packet, found, pri, &state, &out);
+      if ((found == 0) || (++count > XT_RECEIVE_BATCH))
+        break;
+      found = local_receive (0, &packet, &pri);
+      if (found == 0)   /* nothing more is waiting */
+        break;
     }
+    if (out.used > 0)
+      write_output (out.buf, state.need_prompt);
+    out.used = 0;
+    state.need_prompt = 0;
   }
 }
 
@@ -268,9 +355,14 @@ static void print_n_messages (const char * peer, const char * arg, int def)
   struct message_store_info * msgs = NULL;
   int num_alloc = 0;
   int num_used = 0;
-  list_all_messages (peer, &msgs, &num_alloc, &num_used);
-  if (num_used <= 0) {
+  /* only reads the messages that are printed */
+  if ((peer == NULL) ||
+      (! list_messages_page (peer, 0, 0, 0, max_messages,
+                             &msgs, &num_alloc, &num_used)) ||
+      (num_used <= 0)) {
     free_all_messages (msgs, num_used);
+    if (msgs != NULL)
+      free (msgs);
     print_to_output ("");
     return;
   }
@@ -347,6 +439,7 @@ printf ("received_ackd_time is %d, time is %d\n",
     }
   }
   free_all_messages (msgs, num_used);
+  free (msgs);
   print_to_output (string);
   free (string);
 }
@@ -400,15 +493,19 @@ static void print_peers (int only_with_new_messages)
 {
   char ** contacts = NULL;
   int n = all_contacts (&contacts);
+  struct term_output out = { NULL, 0, 0 };
   int i;
   for (i = 0; i < n; i++) {
     int num_new = num_new_messages (contacts [i]);
     if (num_new > 0)
-      printf ("%3d: %s: %d new message%s\n", i + 1, contacts [i], num_new,
-              (num_new != 1) ? "s" : "");
+      output_add (&out, "%3d: %s: %d new message%s\n", i + 1, contacts [i],
+                  num_new, (num_new != 1) ? "s" : "");
     else if (! only_with_new_messages)
-      printf ("%3d: %s\n", i + 1, contacts [i]);
+      output_add (&out, "%3d: %s\n", i + 1, contacts [i]);
   }
+  if (out.used > 0)
+    write_output (out.buf, 0);
+  output_free (&out);
   if (contacts != NULL)
     free (contacts);
 }
@@ -1,5 +1,8 @@
 /* xchats.c: send xchat messages */
 /* parameters are: name of contact and message */
+/* or -b contact-name [window [file]], to send each line of the file
+ * (default stdin) as a message over the same connection, with at most
+ * window (default 16) messages sent but not yet acked */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +45,239 @@ static void add_time (struct timeval * time, unsigned int ms)
   time->tv_usec = time->tv_usec % 1000000;
 }
 
+/* the largest text that can be sent to a contact with these keys */
+static int max_text_size (keyset * keys, int nkeys)
+{
+  int max_key = 0;
+  int i;
+  for (i = 0; i < nkeys; i++) {
+    allnet_rsa_prvkey key;
+    int ksize = get_my_privkey (keys [i], &key);
+    if (ksize > max_key)
+      max_key = ksize;
+  }
+  return ALLNET_MTU - CHAT_DESCRIPTOR_SIZE -
+         ALLNET_SIZE (ALLNET_TRANSPORT_ACK_REQ) -
+         max_key; /* the maximum size of a signature */
+}
+
+#define STREAM_DEFAULT_WINDOW	16
+
+/* a message sent in streaming mode and not yet acked */
+struct stream_sent {
+  uint64_t seq;
+  unsigned long long int sent_us;
+};
+
+/* receives for up to timeout ms, or until something is acked.  Each ack
+ * from contact for one of the num_pending messages removes it from
+ * pending and adds its latency (in microseconds) to latencies.
+ * returns the number acked, or -1 if the connection to ad was closed */
+static int stream_receive (int sock, const char * contact, int timeout,
+                           struct stream_sent * pending, int * num_pending,
+                           unsigned long long int * latencies,
+                           int * num_latencies)
+{
+  char * packet;
+  unsigned int pri;
+  int found = local_receive (timeout, &packet, &pri);
+  if (found < 0)
+    return -1;
+  int verified = 0, duplicate = -1, broadcast = -2;
+  uint64_t rcvd_seq = 0;
+  char * desc = NULL;
+  char * message = NULL;
+  char * peer = NULL;
+  struct allnet_ack_info acks;
+  acks.num_acks = 0;
+  keyset kset = -1;
+  int mlen = handle_packet (sock, packet, found, pri, &peer, &kset,
+                            &message, &desc, &verified, &rcvd_seq, NULL,
+                            NULL, &duplicate, &broadcast, &acks, NULL);
+  if (mlen > 0) {
+    free (peer);
+    free (message);
+    if (! broadcast)
+      free (desc);
+  }
+  unsigned long long int now = allnet_time_us ();
+  int result = 0;
+  int i;
+  for (i = 0; i < acks.num_acks; i++) {
+    if (strcmp (contact, acks.peers [i]) == 0) {
+      int p;
+      for (p = 0; p < *num_pending; p++) {
+        if (pending [p].seq == acks.acks [i]) {
+          latencies [(*num_latencies)++] = now - pending [p].sent_us;
+          pending [p] = pending [--(*num_pending)];
+          result++;
+          break;
+        }
+      }
+    }
+    free (acks.peers [i]);
+  }
+  return result;
+}
+
+/* drops the pending messages sent before the given time, returns the
+ * number dropped */
+static int stream_expire (struct stream_sent * pending, int * num_pending,
+                          unsigned long long int sent_before)
+{
+  int result = 0;
+  int p = 0;
+  while (p < *num_pending) {
+    if (pending [p].sent_us < sent_before) {
+      pending [p] = pending [--(*num_pending)];
+      result++;
+    } else {
+      p++;
+    }
+  }
+  return result;
+}
+
+static int compare_latencies (const void * a, const void * b)
+{
+  unsigned long long int la = * ((const unsigned long long int *) a);
+  unsigned long long int lb = * ((const unsigned long long int *) b);
+  return ((la < lb) ? -1 : ((la > lb) ? 1 : 0));
+}
+
+static void print_latency (const char * desc, unsigned long long int us)
+{
+  printf (" %s %llu.%03llums", desc, us / 1000, us % 1000);
+}
+
+/* sends each non-empty line of in as a message to contact, with at most
+ * window messages in flight.  A message not acked within wait_time ms is
+ * counted as lost.  Prints the ack latencies at the end.
+ * returns 0 if every message was sent and acked, 1 otherwise */
+static int stream_messages (int sock, const char * contact, FILE * in,
+                            int window, unsigned int wait_time)
+{
+  keyset * keys = NULL;
+  int nkeys = all_keys (contact, &keys);
+  if (nkeys <= 0) {
+    if (nkeys == 0)
+      printf ("error: no keys for contact '%s'\n", contact);
+    else
+      printf ("error: contact '%s' does not exist\n", contact);
+    return 1;
+  }
+  int max_size = max_text_size (keys, nkeys);
+  free (keys);
+  struct stream_sent * pending =
+    malloc_or_fail (window * sizeof (struct stream_sent), "xchats pending");
+  int num_pending = 0;
+  int max_latencies = 1024;
+  unsigned long long int * latencies =
+    malloc_or_fail (max_latencies * sizeof (unsigned long long int),
+                    "xchats latencies");
+  int num_latencies = 0;
+  int sent = 0;
+  int errors = 0;
+  int lost = 0;
+  unsigned long long int start = allnet_time_us ();
+  char * line = NULL;
+  size_t line_alloc = 0;
+  ssize_t len = 0;
+  int closed = 0;
+  while ((! closed) && ((len = getline (&line, &line_alloc, in)) >= 0)) {
+    while ((len > 0) && ((line [len - 1] == '\n') || (line [len - 1] == '\r')))
+      line [--len] = '\0';
+    if (len == 0)
+      continue;
+    if (len >= max_size) {
+      printf ("skipping %zd-character line, at most %d may be sent\n",
+              len, max_size - 1);
+      errors++;
+      continue;
+    }
+    while ((! closed) && (num_pending >= window)) {  /* wait for an ack */
+      unsigned long long int deadline = pending [0].sent_us;
+      int p;
+      for (p = 1; p < num_pending; p++)
+        if (pending [p].sent_us < deadline)
+          deadline = pending [p].sent_us;
+      deadline += wait_time * 1000ULL;
+      unsigned long long int now = allnet_time_us ();
+      if (now >= deadline) {
+        lost += stream_expire (pending, &num_pending, now - wait_time * 1000ULL);
+        continue;
+      }
+      int timeout = (int) ((deadline - now + 999) / 1000);
+      closed = (stream_receive (sock, contact, timeout, pending, &num_pending,
+                                latencies, &num_latencies) < 0);
+    }
+    if (closed)
+      break;
+    uint64_t seq = send_data_message (sock, contact, line, (int) len);
+    if (seq == 0) {
+      printf ("error sending message %d\n", sent + errors + 1);
+      errors++;
+      continue;
+    }
+    pending [num_pending].seq = seq;
+    pending [num_pending].sent_us = allnet_time_us ();
+    num_pending++;
+    sent++;
+    if (sent + 1 > max_latencies) {   /* room for every ack */
+      max_latencies *= 2;
+      latencies = realloc (latencies,
+                           max_latencies * sizeof (unsigned long long int));
+      if (latencies == NULL) {
+        printf ("xchats: unable to realloc %d latencies\n", max_latencies);
+        exit (1);
+      }
+    }
+    /* handle any acks that have already arrived, without waiting */
+    while ((! closed) &&
+           (stream_receive (sock, contact, 0, pending, &num_pending,
+                            latencies, &num_latencies) > 0))
+      ;
+  }
+  free (line);
+  /* wait for the acks of the messages still in flight */
+  unsigned long long int finish = allnet_time_us () + wait_time * 1000ULL;
+  unsigned long long int now;
+  while ((! closed) && (num_pending > 0) &&
+         ((now = allnet_time_us ()) < finish)) {
+    int timeout = (int) ((finish - now + 999) / 1000);
+    closed = (stream_receive (sock, contact, timeout, pending, &num_pending,
+                              latencies, &num_latencies) < 0);
+  }
+  if (closed)
+    printf ("xchats pipe closed\n");
+  lost += num_pending;
+  unsigned long long int elapsed = allnet_time_us () - start;
+  printf ("sent %d messages in %llu.%03llus, %d acked, %d not acked",
+          sent, elapsed / 1000000, (elapsed / 1000) % 1000, num_latencies,
+          lost);
+  if (errors > 0)
+    printf (", %d not sent", errors);
+  printf ("\n");
+  if (num_latencies > 0) {
+    qsort (latencies, num_latencies, sizeof (unsigned long long int),
+           compare_latencies);
+    unsigned long long int total = 0;
+    int i;
+    for (i = 0; i < num_latencies; i++)
+      total += latencies [i];
+    printf ("ack latency:");
+    print_latency ("min", latencies [0]);
+    print_latency ("median", latencies [num_latencies / 2]);
+    print_latency ("mean", total / num_latencies);
+    print_latency ("95%", latencies [(num_latencies * 95) / 100]);
+    print_latency ("max", latencies [num_latencies - 1]);
+    printf ("\n");
+  }
+  free (pending);
+  free (latencies);
+  return (((errors == 0) && (lost == 0) && (! closed)) ? 0 : 1);
+}
+
 int main (int argc, char ** argv)
 {
   log_to_output (get_option ('v', &argc, argv));
@@ -49,8 +285,43 @@ int main (int argc, char ** argv)
     printf ("usage: %s contact-name [message]\n", argv [0]);
     printf ("   or: %s -k contact-name [hops [secret]] (hops defaults to 1)\n",
             argv [0]);
+    printf ("   or: %s -b contact-name [window [file]] (window defaults to %d)\n",
+            argv [0], STREAM_DEFAULT_WINDOW);
     return 1;
   }
+  if (strcmp (argv [1], "-b") == 0) {   /* send each line as a message */
+    if ((argc < 3) || (argc > 5)) {
+      printf ("usage: %s -b contact-name [window [file]]\n", argv [0]);
+      return 1;
+    }
+    int window = STREAM_DEFAULT_WINDOW;
+    if (argc >= 4) {
+      char * end;
+      int n = strtol (argv [3], &end, 10);
+      if ((end == argv [3]) || (n <= 0)) {
+        printf ("%s: window must be a positive number, not %s\n",
+                argv [0], argv [3]);
+        return 1;
+      }
+      window = n;
+    }
+    FILE * in = stdin;
+    if ((argc >= 5) && (strcmp (argv [4], "-") != 0)) {
+      in = fopen (argv [4], "r");
+      if (in == NULL) {
+        perror ("xchats fopen");
+        printf ("%s: unable to open %s\n", argv [0], argv [4]);
+        return 1;
+      }
+    }
+    int sock = xchat_init (argv [0], NULL);
+    if (sock < 0)
+      return 1;
+    int result = stream_messages (sock, argv [2], in, window, 5000);
+    if (in != stdin)
+      fclose (in);
+    return result;
+  }
 
   int sock = xchat_init (argv [0], NULL);
   if (sock < 0)
@@ -105,17 +376,8 @@ int main (int argc, char ** argv)
     keyset * keys = NULL;
     int nkeys = all_keys (contact, &keys);
     if (nkeys > 0) {
-      int max_key = 0;
-      for (i = 0; i < nkeys; i++) {
-        allnet_rsa_prvkey key;
-        int ksize = get_my_privkey (keys [i], &key);
-        if (ksize > max_key)
-          max_key = ksize;
-      }
       static char text [ALLNET_MTU] = "";
-      int size = sizeof (text) - CHAT_DESCRIPTOR_SIZE -
-                 ALLNET_SIZE (ALLNET_TRANSPORT_ACK_REQ) -
-                 max_key; /* the maximum size of a signature */
+      int size = max_text_size (keys, nkeys);
       char * p = text;
       int printed = 0;
       for (i = 2; i < argc; i++) {
@@ -22,6 +22,7 @@
 #include "lib/app_util.h"
 #include "lib/priority.h"
 #include "lib/cipher.h"
+#include "lib/compress.h"
 #include "lib/priority.h"
 #include "lib/allnet_log.h"
 #include "lib/sha.h"
@@ -32,6 +33,7 @@
 #include "lib/dcache.h"
 #include "lib/routing.h"
 #include "lib/configfiles.h"
+#include "lib/probes.h"
 
 /* #define DEBUG_PRINT */
 #define HAVE_REQUEST_THREAD   /* run a thread to request data */
@@ -90,7 +92,8 @@ static int send_data_request (int sock, int priority, char * start)
     sizeof (struct allnet_data_request) + BITMAP_BYTES * 2;
   int hops = random_hop_count ();
   struct allnet_header * hp =
-    create_packet (adr_size, ALLNET_TYPE_DATA_REQ, hops, ALLNET_SIGTYPE_NONE,
+    create_pool_packet (adr_size, ALLNET_TYPE_DATA_REQ, hops,
+                        ALLNET_SIGTYPE_NONE,
                    NULL, 0, NULL, 0, NULL, NULL, &size);
   hp->transport = ALLNET_TRANSPORT_DO_NOT_CACHE;
   struct allnet_data_request * adr =
@@ -133,7 +136,7 @@ static int send_data_request (int sock, int priority, char * start)
   print_packet (((const char *) hp), size, "sending data request", 1);
 #endif /* DEBUG_PRINT */
   int r = local_send ((char *) (hp), size, priority);
-  free (hp);
+  allnet_packet_free (hp);
   if (! r) {
     snprintf (alog->b, alog->s, "unable to request data on %d\n", sock);
     log_print (alog);
@@ -240,42 +243,170 @@ void xchat_end (int sock)
 #endif /* HAVE_REQUEST_THREAD */
 }
 
-/* 1 ID hash for each of the data messages and the acks, and
- * one for the acks of the data messages (which is hashed on the message ID,
- * not the ack) */
-#define ID_HASH_COUNT	    16384  /* *MESSAGE_ID_SIZE = 256K bytes each */
-#define ID_HASH_COUNT_BITS  14     /* log_2(ID_HASH_COUNT) */
+/* the IDs of the data messages (with the ack of each message) and the
+ * IDs of the acks are cached so duplicates are not decrypted again.
+ * Each cache is set-associative: an ID can only be in one set of
+ * ID_HASH_WAYS entries, chosen by its first bits.  A new ID replaces an
+ * empty or expired entry of its set, or else the least recently seen */
+#ifndef ID_HASH_COUNT
+#define ID_HASH_COUNT	    16384  /* default number of entries in each cache */
+#endif /* ID_HASH_COUNT */
+#define ID_HASH_WAYS	    8      /* entries per set */
+#ifndef ID_HASH_SECONDS
+#define ID_HASH_SECONDS	    (24 * 60 * 60)  /* default expiration, 1 day */
+#endif /* ID_HASH_SECONDS */
+
+struct id_hash_entry {
+  unsigned char id [MESSAGE_ID_SIZE];
+  unsigned char value [MESSAGE_ID_SIZE];  /* for message IDs, the ack */
+  time_t time;                            /* 0 if the entry is empty */
+};
+
+struct id_hash {
+  struct id_hash_entry * entries;   /* NULL until first used */
+  unsigned int num_sets;            /* a power of two */
+  int set_bits;                     /* log_2 (num_sets) */
+  struct xchat_id_cache_stats stats;
+};
 
 #define MESSAGE_ID_HASH_INDEX	0
-#define  MESSAGE_ID_ACK_INDEX	1   /* not actually a hash */
-#define      ACK_ID_HASH_INDEX	2
-/* C initializes static data to 0, which is good */
-static unsigned char id_hashes [3] [ID_HASH_COUNT] [MESSAGE_ID_SIZE];
+#define      ACK_ID_HASH_INDEX	1
+static struct id_hash id_hashes [2];
+static int id_hash_count = ID_HASH_COUNT;
+static int id_hash_seconds = ID_HASH_SECONDS;
+static pthread_mutex_t id_hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void xchat_id_cache_size (int count, int seconds)
+{
+  pthread_mutex_lock (&id_hash_mutex);
+  if (count > 0)
+    id_hash_count = count;
+  if (seconds > 0)
+    id_hash_seconds = seconds;
+  int i;
+  for (i = 0; i < 2; i++) {   /* reallocated with the new size when used */
+    if (id_hashes [i].entries != NULL)
+      free_tagged (id_hashes [i].entries);
+    id_hashes [i].entries = NULL;
+  }
+  pthread_mutex_unlock (&id_hash_mutex);
+}
+
+void xchat_id_cache_stats (int acks, struct xchat_id_cache_stats * stats)
+{
+  pthread_mutex_lock (&id_hash_mutex);
+  *stats = id_hashes [acks ? ACK_ID_HASH_INDEX : MESSAGE_ID_HASH_INDEX].stats;
+  pthread_mutex_unlock (&id_hash_mutex);
+}
 
-static int idhash_index (const unsigned char * id)
+/* returns the first entry of the set for id, allocating the cache if
+ * needed.  Must be called with id_hash_mutex held */
+static struct id_hash_entry * idhash_set (int hash_index,
+                                          const unsigned char * id)
 {
-  uint32_t index = ((uint32_t) readb32u (id)) >> (32 - ID_HASH_COUNT_BITS);
-  return (int)index;
+  struct id_hash * hash = id_hashes + hash_index;
+  if (hash->entries == NULL) {
+    hash->set_bits = 0;
+    while ((hash->set_bits < 30) &&
+           ((2 << hash->set_bits) * ID_HASH_WAYS <= id_hash_count))
+      hash->set_bits++;
+    hash->num_sets = 1 << hash->set_bits;
+    size_t size = hash->num_sets * ID_HASH_WAYS * sizeof (struct id_hash_entry);
+    hash->entries = malloc_tagged (size, ALLNET_MEMORY_XCHAT,
+                                   "xcommon idhash_set");
+    memset (hash->entries, 0, size);
+  }
+  uint32_t index = 0;
+  if (hash->set_bits > 0)  /* IDs are random, so the first bits will do */
+    index = ((uint32_t) readb32u (id)) >> (32 - hash->set_bits);
+  return hash->entries + index * ID_HASH_WAYS;
 }
 
-/* returns 1 if already found in hash.
+/* returns the entry for id, or NULL if not found or expired.
+ * Must be called with id_hash_mutex held */
+static struct id_hash_entry * idhash_find (int hash_index,
+                                           const unsigned char * id,
+                                           time_t now)
+{
+  struct id_hash_entry * set = idhash_set (hash_index, id);
+  int i;
+  for (i = 0; i < ID_HASH_WAYS; i++)
+    if ((set [i].time != 0) && (set [i].time + id_hash_seconds > now) &&
+        (memcmp (set [i].id, id, MESSAGE_ID_SIZE) == 0))
+      return set + i;
+  return NULL;
+}
+
+/* adds id to the cache, or updates it if it is already there.
+ * Must be called with id_hash_mutex held */
+static struct id_hash_entry * idhash_add (int hash_index,
+                                          const unsigned char * id,
+                                          time_t now)
+{
+  struct id_hash_entry * entry = idhash_find (hash_index, id, now);
+  if (entry == NULL) {
+    struct id_hash_entry * set = idhash_set (hash_index, id);
+    entry = set;
+    int i;
+    for (i = 0; i < ID_HASH_WAYS; i++) {
+      if ((set [i].time == 0) || (set [i].time + id_hash_seconds <= now)) {
+        entry = set + i;    /* empty or expired */
+        break;
+      }
+      if (set [i].time < entry->time)
+        entry = set + i;
+    }
+    if (i >= ID_HASH_WAYS)
+      id_hashes [hash_index].stats.evictions++;
+    memcpy (entry->id, id, MESSAGE_ID_SIZE);
+    memset (entry->value, 0, MESSAGE_ID_SIZE);
+  }
+  entry->time = now;
+  return entry;
+}
+
+/* returns 1 if already found in hash, and if so and value is not NULL,
+ * copies the value saved with the id.
  * if not found, returns 0.
  * ID must be at least MESSAGE_ID_SIZE */
-static int idhash_check (int hash_index, const unsigned char * id)
+static int idhash_check (int hash_index, const unsigned char * id,
+                         unsigned char * value)
 {
-  int index = idhash_index (id);
-  if (memcmp (id_hashes [hash_index] [index], id, MESSAGE_ID_SIZE) == 0)
-    return 1;
-  return 0;
+  pthread_mutex_lock (&id_hash_mutex);
+  struct id_hash_entry * entry = idhash_find (hash_index, id, time (NULL));
+  if (entry == NULL) {
+    id_hashes [hash_index].stats.misses++;
+  } else {
+    id_hashes [hash_index].stats.hits++;
+    if (value != NULL)
+      memcpy (value, entry->value, MESSAGE_ID_SIZE);
+  }
+  pthread_mutex_unlock (&id_hash_mutex);
+  return (entry != NULL);
 }
 
 static int idhash_check_and_add (int hash_index, const unsigned char * id)
 {
-  int index = idhash_index (id);
-  if (memcmp (id_hashes [hash_index] [index], id, MESSAGE_ID_SIZE) == 0)
-    return 1;
-  memcpy (id_hashes [hash_index] [index], id, MESSAGE_ID_SIZE);
-  return 0;
+  pthread_mutex_lock (&id_hash_mutex);
+  time_t now = time (NULL);
+  int found = (idhash_find (hash_index, id, now) != NULL);
+  if (found)
+    id_hashes [hash_index].stats.hits++;
+  else
+    id_hashes [hash_index].stats.misses++;
+  idhash_add (hash_index, id, now);
+  pthread_mutex_unlock (&id_hash_mutex);
+  return found;
+}
+
+/* saves id with the given value */
+static void idhash_save (int hash_index, const unsigned char * id,
+                        const unsigned char * value)
+{
+  pthread_mutex_lock (&id_hash_mutex);
+  struct id_hash_entry * entry = idhash_add (hash_index, id, time (NULL));
+  memcpy (entry->value, value, MESSAGE_ID_SIZE);
+  pthread_mutex_unlock (&id_hash_mutex);
 }
 
 #ifdef TRACK_RECENTLY_SENT_ACKS   /* no longer seems useful */
@@ -330,72 +461,220 @@ static void send_ack (int sock, struct allnet_header * hp,
     request_and_resend (sock, contact, kset, 1);
 }
 
-/* fill in the next contact and keyset,
- * and if not NULL, the total number of keysets for all individual contacts
- * return 1 if returning a valid contact and keyset, 0 otherwise */
-static int next_keyset (char ** contact_p, keyset * k_p, int * total_keysets_p)
-{
-  static char * * contacts = NULL;
-  static int num_contacts = 0;
-  static keyset * keysets = NULL;
-  static int num_current_keysets = 0;
-  static int total_keysets = 0;
-  static int current_contact = 0;
-  static int current_keyset = 0;
-  *contact_p = NULL;
-  *k_p = -1;
-  if (total_keysets_p != NULL)
-    *total_keysets_p = total_keysets;
-  if ((num_contacts > 0) && (current_contact < num_contacts) &&
-      (num_current_keysets > 0) && (keysets != NULL) &&
-      (current_keyset < num_current_keysets)) {
-    /* note: this branch not usually taken, it is not common for
-     * an individual contact to have more than one keyset.
-     * We usually fall through to the next case. */
-    *contact_p = contacts [current_contact];
-    *k_p = keysets [current_keyset];
-    current_keyset++;   /* refer to the next keyset, if any */
-    return 1;           /* success */
-  } /* else: these keyset(s) are finished, try the next contact(s) */
-  if (keysets != NULL)
-    free (keysets);
-  /* get the next contact with keys, or if necessary, restart the list */
-  int do_twice;
-  int next_contact = current_contact + 1;
-  for (do_twice = 0; do_twice < 2; do_twice++) {
-    while (next_contact < num_contacts) {
-      num_current_keysets = all_keys (contacts [next_contact], &keysets);
-      if (num_current_keysets > 0) {  /* found */
-        current_contact = next_contact;
-        current_keyset = 1;  /* the next keyset, if any */
-        *contact_p = contacts [current_contact];
-        *k_p = keysets [0];  /* return the current keyset */
-        return 1;            /* success */
-      }
-      next_contact++;
+/* do_request_and_resend keeps, for each keyset of each individual contact,
+ * the time at which to next request its missing messages and resend its
+ * unacked messages.  The deadlines are kept in a heap ordered by time,
+ * so each call only looks at the keysets that are due.  Each time a
+ * keyset is handled, it waits twice as long before the next time, up
+ * to RESEND_BACKOFF_MAX.  Sending a message to the contact, or hearing
+ * from it, brings it back to RESEND_BACKOFF_MIN */
+#ifndef RESEND_BACKOFF_MIN
+#define RESEND_BACKOFF_MIN	60	/* seconds */
+#endif /* RESEND_BACKOFF_MIN */
+#ifndef RESEND_BACKOFF_MAX
+#define RESEND_BACKOFF_MAX	(4 * 3600)	/* seconds -- 4 hours */
+#endif /* RESEND_BACKOFF_MAX */
+/* when request_and_resend says it is too soon, try again after this long */
+#define RESEND_TOO_SOON		30	/* seconds */
+
+struct resend_deadline {
+  unsigned long long int due;      /* allnet seconds */
+  unsigned long long int backoff;  /* seconds */
+  keyset k;
+  char * contact;                  /* malloc'd */
+  int seen;                        /* used by resend_update */
+};
+
+static struct resend_deadline * resend_heap = NULL;
+static int resend_count = 0;
+static int resend_alloc = 0;
+/* the position of each keyset in the heap, -1 if not in the heap */
+static int * resend_position = NULL;
+static int resend_num_positions = 0;
+static int resend_initialized = 0;
+static unsigned long long int resend_generation = 0;
+/* the functions that access the heap must be called with resend_mutex held */
+static pthread_mutex_t resend_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int resend_find (keyset k)
+{
+  if ((k < 0) || (k >= resend_num_positions))
+    return -1;
+  return resend_position [k];
+}
+
+static void resend_place (int pos, const struct resend_deadline * d)
+{
+  resend_heap [pos] = *d;
+  resend_position [d->k] = pos;
+}
+
+static void resend_sift_up (int pos)
+{
+  struct resend_deadline d = resend_heap [pos];
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (resend_heap [parent].due <= d.due)
+      break;
+    resend_place (pos, resend_heap + parent);
+    pos = parent;
+  }
+  resend_place (pos, &d);
+}
+
+static void resend_sift_down (int pos)
+{
+  struct resend_deadline d = resend_heap [pos];
+  while (2 * pos + 1 < resend_count) {
+    int child = 2 * pos + 1;
+    if ((child + 1 < resend_count) &&
+        (resend_heap [child + 1].due < resend_heap [child].due))
+      child++;
+    if (d.due <= resend_heap [child].due)
+      break;
+    resend_place (pos, resend_heap + child);
+    pos = child;
+  }
+  resend_place (pos, &d);
+}
+
+/* after changing the deadline at pos, move it to where it belongs */
+static void resend_fix (int pos)
+{
+  if ((pos > 0) && (resend_heap [pos].due < resend_heap [(pos - 1) / 2].due))
+    resend_sift_up (pos);
+  else
+    resend_sift_down (pos);
+}
+
+static void resend_remove (int pos)
+{
+  resend_position [resend_heap [pos].k] = -1;
+  free (resend_heap [pos].contact);
+  resend_count--;
+  if (pos < resend_count) {
+    resend_place (pos, resend_heap + resend_count);
+    resend_fix (pos);
+  }
+}
+
+/* adds the keyset to the heap, due at the given time.  If it is already
+ * in the heap, only moves the deadline if due is earlier.  If reset,
+ * also goes back to the minimum backoff */
+static void resend_add (const char * contact, keyset k,
+                        unsigned long long int due, int reset)
+{
+  if (k < 0)
+    return;
+  int pos = resend_find (k);
+  if ((pos >= 0) && (strcmp (resend_heap [pos].contact, contact) != 0)) {
+    resend_remove (pos);  /* the keyset now belongs to a different contact */
+    pos = -1;
+  }
+  if (pos >= 0) {
+    struct resend_deadline * d = resend_heap + pos;
+    d->seen = 1;
+    if (reset)
+      d->backoff = RESEND_BACKOFF_MIN;
+    if (due < d->due) {
+      d->due = due;
+      resend_sift_up (pos);
     }
-    if (do_twice == 0) {   /* first time around, reset the list of contacts */
-      if (contacts != NULL)
-        free (contacts);
-      num_contacts = all_individual_contacts (&contacts);
-      next_contact = 0;     /* restart the while loop from the beginning */
-      current_contact = num_contacts;  /* if success, set in the while loop */
-      total_keysets = 0;    /* recompute the total keysets, may have changed */
-      int c;
-      for (c = 0; c < num_contacts; c++) {
-        int nk = num_keysets (contacts [c]);
-        total_keysets += ((nk > 0) ? nk : 0);
-      }
-      if (total_keysets_p != NULL)
-        *total_keysets_p = total_keysets;
+    return;
+  }
+  if (k >= resend_num_positions) {
+    int n = k + 1 + resend_num_positions;
+    int * p = realloc (resend_position, n * sizeof (int));
+    if (p == NULL)
+      return;
+    int i;
+    for (i = resend_num_positions; i < n; i++)
+      p [i] = -1;
+    resend_position = p;
+    resend_num_positions = n;
+  }
+  if (resend_count >= resend_alloc) {
+    int n = resend_alloc * 2 + 16;
+    struct resend_deadline * h =
+      realloc (resend_heap, n * sizeof (struct resend_deadline));
+    if (h == NULL)
+      return;
+    resend_heap = h;
+    resend_alloc = n;
+  }
+  struct resend_deadline * d = resend_heap + resend_count;
+  d->due = due;
+  d->backoff = RESEND_BACKOFF_MIN;
+  d->k = k;
+  d->contact = strcpy_malloc (contact, "resend_add");
+  d->seen = 1;
+  resend_position [k] = resend_count;
+  resend_count++;
+  resend_sift_up (resend_count - 1);
+}
+
+/* if the contacts or keys have changed, adds any new keysets with
+ * deadlines spread over the next RESEND_BACKOFF_MIN seconds, and
+ * removes any keysets that no longer exist */
+static void resend_update (unsigned long long int now)
+{
+  if (resend_initialized && (resend_generation == keys_generation ()))
+    return;
+  resend_initialized = 1;
+  resend_generation = keys_generation ();
+  int i;
+  for (i = 0; i < resend_count; i++)
+    resend_heap [i].seen = 0;
+  char ** contacts = NULL;   /* borrowed, do not free */
+  int nc = borrow_individual_contacts (&contacts);
+  int ic;
+  for (ic = 0; ic < nc; ic++) {
+    keyset * keysets = NULL;
+    int nk = all_keys (contacts [ic], &keysets);
+    int ik;
+    for (ik = 0; ik < nk; ik++) {
+      int pos = resend_find (keysets [ik]);
+      if ((pos >= 0) && (strcmp (resend_heap [pos].contact, contacts [ic]) == 0))
+        resend_heap [pos].seen = 1;
+      else
+        resend_add (contacts [ic], keysets [ik],
+                    now + random_int (0, RESEND_BACKOFF_MIN), 0);
+    }
+    if (keysets != NULL)
+      free (keysets);
+  }
+  /* drop the keysets that were not seen, then restore the heap order */
+  int kept = 0;
+  for (i = 0; i < resend_count; i++) {
+    if (resend_heap [i].seen) {
+      resend_place (kept++, resend_heap + i);
+    } else {
+      resend_position [resend_heap [i].k] = -1;
+      free (resend_heap [i].contact);
     }
   }
-  return 0;    /* nothing to return */
+  resend_count = kept;
+  for (i = resend_count / 2 - 1; i >= 0; i--)
+    resend_sift_down (i);
+}
+
+/* called when we send to or hear from the contact: resend to this
+ * keyset within RESEND_BACKOFF_MIN seconds, and reset its backoff */
+static void schedule_resend (const char * contact, keyset k)
+{
+  pthread_mutex_lock (&resend_mutex);
+  resend_add (contact, k, allnet_time () + RESEND_BACKOFF_MIN, 1);
+  pthread_mutex_unlock (&resend_mutex);
 }
 
+static int resend_keyset (int sock, const char * contact, keyset kset,
+                          int eagerly, int due);
+static unsigned long long int resend_pending_keys (int sock,
+                                                   unsigned long long int now);
+
 /* call every once in a while, e.g. every 1-10s, to poke all our
  * contacts and get any outstanding messages. */
-/* each time it is called, queries a different contact or keyset */
+/* each time it is called, handles the keysets whose deadlines have passed */
 void do_request_and_resend (int sock)
 {
   static unsigned long long int last_time = 0;
@@ -403,15 +682,24 @@ void do_request_and_resend (int sock)
   if (last_time == now)  /* allow at most one call per second */
     return;
   last_time = now;
-  char * contact = NULL;
-  keyset k = 0;
-  int num_loops = 0;
-  if (! next_keyset (&contact, &k, &num_loops))
-    return;   /* nothing to do */
-  int i;      /* at most, try once for every keyset of every contact */
-  for (i = 0; i < num_loops; i++) {
-    int r = request_and_resend (sock, contact, k, 0);
-/* request_and_resend returns 1 if sent, -1 if it is too soon,
+  /* resend pending keys when the earliest of them is due, or when
+   * a key exchange may have been started or completed */
+  static unsigned long long int next_key_resend = 0;
+  static unsigned long long int key_generation = 0;
+  if ((next_key_resend <= now) || (key_generation != keys_generation ())) {
+    key_generation = keys_generation ();
+    next_key_resend = resend_pending_keys (sock, now);
+  }
+  pthread_mutex_lock (&resend_mutex);
+  resend_update (now);
+  int loops = resend_count;   /* at most, try once for every keyset */
+  while ((loops-- > 0) && (resend_count > 0) && (resend_heap [0].due <= now)) {
+    keyset k = resend_heap [0].k;
+    char * contact = strcpy_malloc (resend_heap [0].contact,
+                                    "do_request_and_resend");
+    pthread_mutex_unlock (&resend_mutex);
+    int r = resend_keyset (sock, contact, k, 0, 1);
+/* resend_keyset returns 1 or 2 if sent, -1 if it is too soon,
  * 0 for nothing missing for this contact and keyset */
 #ifdef DEBUG_PRINT
     if (r >= 0) { /* tried to send */
@@ -421,15 +709,30 @@ void do_request_and_resend (int sock)
       memset (start_string, 0, sizeof (start_string));
       memcpy (start_string, now_string, sizeof (start_string) - 1);
       printf ("%s: request_and_resend %d for %s/%d(%d)\n",
-              start_string, r, contact, k, num_loops);
+              start_string, r, contact, k, resend_count);
     }
 #endif /* DEBUG_PRINT */
-    if (r != 0) /* r == 1 means sent, we are done */
-      return;   /* r == -1 means too soon, stop trying for now */
+    pthread_mutex_lock (&resend_mutex);
+    int pos = resend_find (k);
+    if ((pos >= 0) && (strcmp (resend_heap [pos].contact, contact) == 0) &&
+        (resend_heap [pos].due <= now)) {   /* not rescheduled meanwhile */
+      struct resend_deadline * d = resend_heap + pos;
+      if (r < 0) {
+        d->due = now + RESEND_TOO_SOON;
+      } else {
+        d->due = now + d->backoff;
+        d->backoff *= 2;
+        if (d->backoff > RESEND_BACKOFF_MAX)
+          d->backoff = RESEND_BACKOFF_MAX;
+      }
+      resend_fix (pos);
+    }
+    free (contact);
+    if (r != 0) /* r > 0 means sent, we are done */
+      break;    /* r == -1 means too soon, stop trying for now */
                 /* r == 0 means nothing to send for this contact/keyset */
-    if (! next_keyset (&contact, &k, NULL))
-      return;   /* nothing to do */
   }
+  pthread_mutex_unlock (&resend_mutex);
 }
 
 static void handle_ack (int sock, char * packet, unsigned int psize,
@@ -485,9 +788,18 @@ static void handle_ack (int sock, char * packet, unsigned int psize,
     acks->num_acks = ack_count;
 }
 
+/* the cache only keeps a digest of each contact and message, so
+ * memory use does not depend on the size of the messages */
+#define CACHE_DIGEST_SIZE	MESSAGE_ID_SIZE
+
 static int cache_match (void * s1, void * s2)
 {
-  return (strcmp (s1, s2) == 0);
+  return (memcmp (s1, s2, CACHE_DIGEST_SIZE) == 0);
+}
+
+static unsigned int cache_hash (void * data)
+{
+  return (unsigned int) readb32 ((char *) data);
 }
 
 /* returns 0 for a new message, 1 for a message that was already cached */
@@ -496,28 +808,271 @@ static int cache_message (const char * data, unsigned int dsize,
 {
   static void * cache = NULL;
   if (cache == NULL)
-    cache = cache_init (300, free, "xcommon.c cache_message");
-  size_t len = strlen (data) + strlen (contact) + 3;
-  char * copy = malloc_or_fail (len, "xcommon.c cache_message");
-  snprintf (copy, len, "%s:%s\n", contact, data);
-  void * found = cache_get_match (cache, cache_match, copy);
+    cache = cache_init_hashed (300, free, cache_hash,
+                               "xcommon.c cache_message");
+  /* digest of the contact, a null character, and the digest of the data */
+  size_t clen = strlen (contact) + 1;
+  size_t len = clen + CACHE_DIGEST_SIZE;
+  char * buffer = malloc_or_fail (len, "xcommon.c cache_message");
+  memcpy (buffer, contact, clen);
+  sha512_bytes (data, dsize, buffer + clen, CACHE_DIGEST_SIZE);
+  char * digest = malloc_or_fail (CACHE_DIGEST_SIZE, "xcommon.c cache_digest");
+  sha512_bytes (buffer, (int) len, digest, CACHE_DIGEST_SIZE);
+  free (buffer);
+  void * found = cache_get_hashed (cache, cache_hash (digest),
+                                   cache_match, digest);
   if (found == NULL) {   /* not found */
-    cache_add (cache, copy);
+    cache_add (cache, digest);
     return 0;
   } else {               /* already in the cache */
-    free (copy);
+    free (digest);
     return 1;
   }
 }
 
+/* hash chains authenticating time announcements, see lib/media.h.
+ * The signature on the anchor of each chain is only verified once;
+ * after that, each tick takes a few hashes to verify */
+#define TIME_CHAINS		16
+#define TIME_CHAIN_MAX_TICKS	100000	/* limits the hashing for one tick */
+static struct time_chain {
+  char * contact;                       /* NULL if the entry is unused */
+  unsigned char address [ADDRESS_SIZE];
+  struct allnet_time_chain_anchor anchor;   /* as received */
+  uint64_t start;
+  uint32_t interval;
+  uint32_t count;
+  uint32_t index;                       /* highest tick verified so far */
+  char key [ALLNET_TIME_CHAIN_KEY_SIZE];  /* k[index] */
+} time_chains [TIME_CHAINS];
+static int time_chain_replace = 0;      /* when all entries are used */
+static pthread_mutex_t time_chain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* data and dsize include the app media header and the signature.
+ * always returns 0, since there is nothing to display */
+static int handle_time_anchor (struct allnet_header * hp, char * data,
+                               unsigned int dsize)
+{
+  unsigned int amhsize = sizeof (struct allnet_app_media_header);
+  unsigned int asize = sizeof (struct allnet_time_chain_anchor);
+  if (dsize < amhsize + asize + 2)
+    return 0;
+  unsigned int ssize = readb16 (data + (dsize - 2));
+  if (amhsize + asize + ssize + 2 != dsize)
+    return 0;
+  struct allnet_time_chain_anchor * ap =
+    (struct allnet_time_chain_anchor *) (data + amhsize);
+  uint32_t interval = readb32u (ap->interval);
+  uint32_t count = readb32u (ap->count);
+  if ((interval == 0) || (count == 0) || (count > TIME_CHAIN_MAX_TICKS))
+    return 0;
+  int i;
+  pthread_mutex_lock (&time_chain_mutex);
+  for (i = 0; i < TIME_CHAINS; i++) {   /* already verified? */
+    if ((time_chains [i].contact != NULL) &&
+        (matches (time_chains [i].address, ADDRESS_BITS,
+                  hp->source, hp->src_nbits) > 0) &&
+        (memcmp (&(time_chains [i].anchor), ap, asize) == 0)) {
+      pthread_mutex_unlock (&time_chain_mutex);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock (&time_chain_mutex);
+  struct bc_key_info * keys;
+  int nkeys = get_other_keys (&keys);
+  int nmatching = get_other_keys_matching (hp->source, hp->src_nbits, NULL, 0);
+  int k = nkeys;
+  if (nmatching > 0) {
+    int * matching = malloc_or_fail (nmatching * sizeof (int),
+                                     "handle_time_anchor keys");
+    get_other_keys_matching (hp->source, hp->src_nbits, matching, nmatching);
+    int m;
+    for (m = 0; m < nmatching; m++) {
+      if (allnet_verify (data, amhsize + asize, data + amhsize + asize, ssize,
+                         keys [matching [m]].pub_key)) {
+        k = matching [m];
+        break;
+      }
+    }
+    free (matching);
+  }
+  if (k >= nkeys) {
+#ifdef DEBUG_PRINT
+    printf ("unable to verify time chain anchor\n");
+#endif /* DEBUG_PRINT */
+    return 0;
+  }
+  uint64_t start = readb64u (ap->start);
+  pthread_mutex_lock (&time_chain_mutex);
+  /* a newer chain from the same key replaces the older one */
+  int found = -1;
+  for (i = 0; i < TIME_CHAINS; i++) {
+    if ((time_chains [i].contact != NULL) &&
+        (strcmp (time_chains [i].contact, keys [k].identifier) == 0)) {
+      found = i;
+      break;
+    }
+    if ((found < 0) && (time_chains [i].contact == NULL))
+      found = i;
+  }
+  if (found < 0) {
+    found = time_chain_replace;
+    time_chain_replace = (time_chain_replace + 1) % TIME_CHAINS;
+  }
+  struct time_chain * tc = time_chains + found;
+  if ((tc->contact == NULL) || (tc->start < start)) {
+    if (tc->contact != NULL)
+      free (tc->contact);
+    tc->contact = strcpy_malloc (keys [k].identifier, "time chain contact");
+    memcpy (tc->address, keys [k].address, ADDRESS_SIZE);
+    tc->anchor = *ap;
+    tc->start = start;
+    tc->interval = interval;
+    tc->count = count;
+    tc->index = 0;
+    memcpy (tc->key, ap->key, ALLNET_TIME_CHAIN_KEY_SIZE);
+  }
+  pthread_mutex_unlock (&time_chain_mutex);
+  return 0;
+}
+
+/* a tick is valid if hashing its key leads to a key already verified.
+ * returns the size of the message if verified, and 0 otherwise */
+static int handle_time_tick (struct allnet_header * hp, char * data,
+                             unsigned int dsize,
+                             char ** contact, char ** message,
+                             int * verified, int * duplicate, int * broadcast)
+{
+  unsigned int amhsize = sizeof (struct allnet_app_media_header);
+  unsigned int tsize = sizeof (struct allnet_time_chain_tick);
+  if (dsize < amhsize + ALLNET_TIME_SIZE + tsize + 1)
+    return 0;
+  struct allnet_time_chain_tick * tp =
+    (struct allnet_time_chain_tick *) (data + (dsize - tsize));
+  uint64_t time = readb64 (data + (dsize - tsize - ALLNET_TIME_SIZE));
+  char * text = data + amhsize;
+  int text_size = strnlen (text, dsize - amhsize - ALLNET_TIME_SIZE - tsize);
+  uint32_t index = readb32u (tp->index);
+  int dup = 0;
+  char * found = NULL;
+  int i;
+  pthread_mutex_lock (&time_chain_mutex);
+  for (i = 0; (found == NULL) && (i < TIME_CHAINS); i++) {
+    struct time_chain * tc = time_chains + i;
+    if ((tc->contact == NULL) || (index < 1) || (index > tc->count) ||
+        (matches (tc->address, ADDRESS_BITS, hp->source, hp->src_nbits) <= 0) ||
+        (tc->start + ((uint64_t) index) * tc->interval != time))
+      continue;
+    /* hash from k[index] down to the closest key we know */
+    uint32_t known = tc->index;
+    const char * known_key = tc->key;
+    if (index < known) {   /* a late tick can be checked against k[0] */
+      known = 0;
+      known_key = (const char *) (tc->anchor.key);
+    }
+    char key [ALLNET_TIME_CHAIN_KEY_SIZE];
+    memcpy (key, tp->key, sizeof (key));
+    uint32_t k;
+    for (k = index; k > known; k--)
+      sha512_bytes (key, sizeof (key), key, sizeof (key));
+    if (memcmp (key, known_key, sizeof (key)) != 0)
+      continue;
+    dup = (index == tc->index);
+    if (index > tc->index) {
+      tc->index = index;
+      memcpy (tc->key, tp->key, sizeof (key));
+    }
+    found = strcpy_malloc (tc->contact, "time tick contact");
+  }
+  pthread_mutex_unlock (&time_chain_mutex);
+  if (found == NULL) {
+#ifdef DEBUG_PRINT
+    printf ("unable to verify time tick %" PRIu32 "\n", index);
+#endif /* DEBUG_PRINT */
+    return 0;
+  }
+  *contact = found;
+  *message = malloc_or_fail (text_size + 1, "handle_time_tick message");
+  memcpy (*message, text, text_size);
+  (*message) [text_size] = '\0';
+  *broadcast = 1;
+  *verified = 1;
+  *duplicate = cache_message (*message, text_size, *contact) || dup;
+  return text_size;
+}
+
+/* the same broadcast often arrives more than once, e.g. over different
+ * paths.  This remembers which key verified each recent broadcast, so
+ * the signature is only checked the first time.  The digest covers the
+ * entire signed message, including the signature */
+#define BC_VERIFIED_CACHE_SIZE	64
+#define BC_VERIFIED_DIGEST_SIZE	32
+struct bc_verified_entry {
+  char digest [BC_VERIFIED_DIGEST_SIZE];
+  char * identifier;    /* NULL if not used */
+};
+static struct bc_verified_entry bc_verified [BC_VERIFIED_CACHE_SIZE];
+static int bc_verified_next = 0;
+static pthread_mutex_t bc_verified_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* returns the position in candidates of the key that verified this
+ * digest, or -1.  A key that is no longer a candidate (e.g. has been
+ * unsubscribed) does not count */
+static int bc_verified_lookup (const char * digest, struct bc_key_info * keys,
+                               const int * candidates, int ncandidates)
+{
+  int result = -1;
+  pthread_mutex_lock (&bc_verified_mutex);
+  int i;
+  for (i = 0; (result < 0) && (i < BC_VERIFIED_CACHE_SIZE); i++) {
+    struct bc_verified_entry * e = bc_verified + i;
+    if ((e->identifier != NULL) &&
+        (memcmp (e->digest, digest, BC_VERIFIED_DIGEST_SIZE) == 0)) {
+      int c;
+      for (c = 0; c < ncandidates; c++) {
+        if (strcmp (keys [candidates [c]].identifier, e->identifier) == 0) {
+          result = c;
+          break;
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock (&bc_verified_mutex);
+  return result;
+}
+
+static void bc_verified_save (const char * digest, const char * identifier)
+{
+  pthread_mutex_lock (&bc_verified_mutex);
+  struct bc_verified_entry * e = bc_verified + bc_verified_next;
+  bc_verified_next = (bc_verified_next + 1) % BC_VERIFIED_CACHE_SIZE;
+  if (e->identifier != NULL)
+    free (e->identifier);
+  memcpy (e->digest, digest, BC_VERIFIED_DIGEST_SIZE);
+  e->identifier = strcpy_malloc (identifier, "bc_verified_save");
+  pthread_mutex_unlock (&bc_verified_mutex);
+}
+
 static int handle_clear (struct allnet_header * hp, char * data,
                          unsigned int dsize,
                          char ** contact, char ** message,
                          int * verified, int * duplicate, int * broadcast)
 {
+  if ((dsize >= sizeof (struct allnet_app_media_header)) &&
+      (readb32u (((struct allnet_app_media_header *) data)->media) ==
+       ALLNET_MEDIA_TIME_CHAIN_TICK))   /* not signed, uses the hash chain */
+    return handle_time_tick (hp, data, dsize, contact, message,
+                             verified, duplicate, broadcast);
   if (hp->sig_algo == ALLNET_SIGTYPE_NONE) {
 #ifdef DEBUG_PRINT
     printf ("ignoring unsigned clear packet of size %d\n", dsize);
+#endif /* DEBUG_PRINT */
+    return 0;
+  }
+  int nmatching = get_other_keys_matching (hp->source, hp->src_nbits, NULL, 0);
+  if (nmatching <= 0) {
+#ifdef DEBUG_PRINT
+    printf ("ignoring clear packet from unsubscribed source\n");
 #endif /* DEBUG_PRINT */
     return 0;
   }
@@ -527,6 +1082,8 @@ static int handle_clear (struct allnet_header * hp, char * data,
   uint32_t media = 0;
   if (dsize >= sizeof (struct allnet_app_media_header) + 2)
     media = (uint32_t)readb32u (amhp->media);
+  if (media == ALLNET_MEDIA_TIME_CHAIN_ANCHOR)
+    return handle_time_anchor (hp, data, dsize);
   if ((media != ALLNET_MEDIA_TEXT_PLAIN) &&
       (media != ALLNET_MEDIA_TIME_TEXT_BIN)) {
 #ifdef DEBUG_PRINT
@@ -549,16 +1106,40 @@ static int handle_clear (struct allnet_header * hp, char * data,
   printf ("data size %d, text %d + sig %d\n", dsize, text_size, ssize);
 #endif /* DEBUG_PRINT */
   struct bc_key_info * keys;
-  int nkeys = get_other_keys (&keys);
+  get_other_keys (&keys);
   int i;
 #ifdef DEBUG_PRINT
   print_buffer (verif, dsize - ssize, "verifying BC message", dsize, 1);
 #endif /* DEBUG_PRINT */
-  for (i = 0; i < nkeys; i++) {
-    if ((matches ((unsigned char *) (keys [i].address), ADDRESS_BITS,
-                  hp->source, hp->src_nbits) > 0) &&
-        (allnet_verify (verif, dsize - ssize, sig, ssize - 2,
-                        keys [i].pub_key))) {
+  /* verify all the keys that match the source at once */
+  int * request_key = malloc_or_fail (nmatching * sizeof (int),
+                                      "handle_clear keys");
+  int nrequests = get_other_keys_matching (hp->source, hp->src_nbits,
+                                           request_key, nmatching);
+  if (nrequests > nmatching)   /* keys changed, should not happen */
+    nrequests = nmatching;
+  struct allnet_verify_request * requests =
+    malloc_or_fail (nmatching * sizeof (struct allnet_verify_request),
+                    "handle_clear requests");
+  char digest [BC_VERIFIED_DIGEST_SIZE];
+  sha512_bytes (verif, dsize, digest, sizeof (digest));
+  int cached = bc_verified_lookup (digest, keys, request_key, nrequests);
+  int r;
+  for (r = 0; r < nrequests; r++) {
+    struct allnet_verify_request request =
+      { .text = verif, .tsize = dsize - ssize, .sig = sig, .ssize = ssize - 2,
+        .key = keys [request_key [r]].pub_key, .verified = (r == cached) };
+    requests [r] = request;
+  }
+  if ((cached < 0) && (nrequests > 0))
+    allnet_verify_batch (requests, nrequests);
+  for (r = 0; r < nrequests; r++) {
+    i = request_key [r];
+    if (requests [r].verified) {
+      free (requests);
+      free (request_key);
+      if (cached < 0)
+        bc_verified_save (digest, keys [i].identifier);
       *contact = strcpy_malloc (keys [i].identifier,
                                 "handle_message broadcast contact");
       *message = malloc_or_fail (text_size + 1, "handle_clear message");
@@ -581,18 +1162,47 @@ static int handle_clear (struct allnet_header * hp, char * data,
               matches (keys [i].address, ADDRESS_BITS,
                        hp->source, hp->src_nbits));
       printf ("verify (%d/%d: %p/%d, %p/%d %d) == %d\n",
-              i, nkeys, data, dsize - ssize, sig, ssize - 2, i,
+              r, nrequests, data, dsize - ssize, sig, ssize - 2, i,
               allnet_verify (verif, dsize - ssize, sig, ssize - 2,
                              keys [i].pub_key));
     }
 #endif /* DEBUG_PRINT */
   }
+  free (requests);
+  free (request_key);
 #ifdef DEBUG_PRINT
   printf ("unable to verify bc message\n");
 #endif /* DEBUG_PRINT */
   return 0;   /* did not match */
 }
 
+/* returns a newly allocated copy of the chat message with the text
+ * decompressed and the media set to ALLNET_MEDIA_TEXT_PLAIN, and sets
+ * *new_size to its size.  Returns NULL if the text cannot be decompressed */
+static char * decompress_text (const char * text, int tsize, int * new_size)
+{
+  int hsize = CHAT_DESCRIPTOR_SIZE + ALLNET_MEDIA_COMPRESSED_SIZE;
+  if (tsize <= hsize)
+    return NULL;
+  unsigned long int size = readb32 (text + CHAT_DESCRIPTOR_SIZE);
+  if ((size <= 0) || (size > ALLNET_MTU))
+    return NULL;
+  char * result = malloc_or_fail (CHAT_DESCRIPTOR_SIZE + size,
+                                  "decompress_text");
+  if (allnet_decompress (text + hsize, tsize - hsize,
+                         result + CHAT_DESCRIPTOR_SIZE, (int) size) !=
+      (int) size) {
+    printf ("unable to decompress %d-byte chat message\n", tsize);
+    free (result);
+    return NULL;
+  }
+  memcpy (result, text, CHAT_DESCRIPTOR_SIZE);
+  struct chat_descriptor * cdp = (struct chat_descriptor *) result;
+  writeb32u (cdp->app_media.media, ALLNET_MEDIA_TEXT_PLAIN);
+  *new_size = CHAT_DESCRIPTOR_SIZE + (int) size;
+  return result;
+}
+
 static int handle_data (int sock, struct allnet_header * hp, unsigned int psize,
                         char * data, unsigned int dsize,
                         char ** contact, keyset * kset,
@@ -604,10 +1214,8 @@ static int handle_data (int sock, struct allnet_header * hp, unsigned int psize,
   char message_ack [MESSAGE_ID_SIZE];
 /* relatively quick check to see if we may have gotten this message before */
   if ((hp->transport & ALLNET_TRANSPORT_ACK_REQ) && (message_id != NULL) &&
-      (idhash_check (MESSAGE_ID_HASH_INDEX, (unsigned char *) message_id))) {
-    int index = idhash_index ((unsigned char *)message_id);
-    memcpy (message_ack, id_hashes [MESSAGE_ID_ACK_INDEX] [index],
-            MESSAGE_ID_SIZE);
+      (idhash_check (MESSAGE_ID_HASH_INDEX, (unsigned char *) message_id,
+                     (unsigned char *) message_ack))) {
 #ifdef DEBUG_PRINT
     print_buffer (message_ack, MESSAGE_ID_SIZE,
                   "xcommon handle_data sending quick ack",
@@ -710,11 +1318,8 @@ printf ("got %d-byte packet from contact %s\n", tsize, *contact);
 
   /* save in the hash */
   if ((hp->transport & ALLNET_TRANSPORT_ACK_REQ) && (message_id != NULL)) {
-    int index = idhash_index ((unsigned char *) message_id);
-    memcpy (id_hashes [MESSAGE_ID_HASH_INDEX] [index],
-            message_id, MESSAGE_ID_SIZE);
-    memcpy (id_hashes [MESSAGE_ID_ACK_INDEX] [index],
-            cdp->message_ack, MESSAGE_ID_SIZE);
+    idhash_save (MESSAGE_ID_HASH_INDEX, (unsigned char *) message_id,
+                 cdp->message_ack);
   }
 
   unsigned long int app = readb32u (cdp->app_media.app);
@@ -749,6 +1354,7 @@ printf ("got chat control message %s, but media %ld != %d\n",
 #ifdef DEBUG_PRINT
       printf ("got chat control message from %s, responding\n", *contact);
 #endif /* DEBUG_PRINT */
+      save_chat_features (*contact, *kset, text, tsize);
       static long long int last_sent = 0;  /* only do once every 10s */
       if ((last_sent == 0) || (allnet_time () > last_sent + 10)) {
         do_chat_control (*contact, *kset, text, tsize, sock, hops + 4);
@@ -778,6 +1384,16 @@ printf ("control packet, not saving, media %lx\n", media);
     return 0;
   }
 
+  if (media == ALLNET_MEDIA_TEXT_COMPRESSED) {
+    /* from here on, the same as if it had been sent as plain text */
+    char * plain = decompress_text (text, tsize, &tsize);
+    free (text);
+    if (plain == NULL)
+      return 0;
+    text = plain;
+    cdp = (struct chat_descriptor *) text;
+    media = ALLNET_MEDIA_TEXT_PLAIN;
+  }
   if ((media != ALLNET_MEDIA_TEXT_PLAIN) &&
       (media != ALLNET_MEDIA_PUBLIC_KEY)) {
 #ifdef DEBUG_PRINT
@@ -941,8 +1557,9 @@ static int send_key (int sock, const char * contact, keyset kset,
 
   unsigned int size;
   struct allnet_header * hp =
-    create_packet (dsize, ALLNET_TYPE_KEY_XCHG, max_hops, ALLNET_SIGTYPE_NONE,
-                   address, abits, NULL, 0, NULL, NULL, &size);
+    create_pool_packet (dsize, ALLNET_TYPE_KEY_XCHG, max_hops,
+                        ALLNET_SIGTYPE_NONE, address, abits, NULL, 0,
+                        NULL, NULL, &size);
   char * message = (char *) hp;
 
   char * data = message + ALLNET_SIZE (hp->transport);
@@ -964,7 +1581,7 @@ static int send_key (int sock, const char * contact, keyset kset,
   printf ("sending key of size %d\n", size);
 #endif /* DEBUG_PRINT */
   int r = local_send (message, size, ALLNET_PRIORITY_LOCAL);
-  free (message);
+  allnet_packet_free (message);
   if (! r) {
     printf ("unable to send %d-byte key exchange packet to %s\n",
             size, contact);
@@ -1442,14 +2059,15 @@ static int too_much_time (int message_type, unsigned int priority,
  * if it is a trace reply, fills in trace_reply if not null (must be free'd),
  * and returns -4
  */
-int handle_packet (int sock, char * packet, unsigned int psize,
-                   unsigned int priority,
-                   char ** contact, keyset * kset,
-                   char ** message, char ** desc, int * verified,
-                   uint64_t * seq, time_t * sent, uint64_t * prev_missing,
-                   int * duplicate, int * broadcast,
-                   struct allnet_ack_info * acks,
-                   struct allnet_mgmt_trace_reply ** trace_reply)
+static int handle_packet_one (int sock, char * packet, unsigned int psize,
+                              unsigned int priority,
+                              char ** contact, keyset * kset,
+                              char ** message, char ** desc, int * verified,
+                              uint64_t * seq, time_t * sent,
+                              uint64_t * prev_missing,
+                              int * duplicate, int * broadcast,
+                              struct allnet_ack_info * acks,
+                              struct allnet_mgmt_trace_reply ** trace_reply)
 {
   if (acks != NULL)
     acks->num_acks = 0;
@@ -1529,6 +2147,24 @@ int handle_packet (int sock, char * packet, unsigned int psize,
   return result;
 }
 
+int handle_packet (int sock, char * packet, unsigned int psize,
+                   unsigned int priority,
+                   char ** contact, keyset * kset,
+                   char ** message, char ** desc, int * verified,
+                   uint64_t * seq, time_t * sent, uint64_t * prev_missing,
+                   int * duplicate, int * broadcast,
+                   struct allnet_ack_info * acks,
+                   struct allnet_mgmt_trace_reply ** trace_reply)
+{
+  ALLNET_PROBE2 (xchat_packet_start, packet, psize);
+  int result = handle_packet_one (sock, packet, psize, priority, contact, kset,
+                                  message, desc, verified, seq, sent,
+                                  prev_missing, duplicate, broadcast,
+                                  acks, trace_reply);
+  ALLNET_PROBE2 (xchat_packet_done, psize, result);
+  return result;
+}
+
 /* send this message and save it in the xchat log. */
 /* returns the sequence number of this message, or 0 for errors */
 uint64_t send_data_message (int sock, const char * peer,
@@ -1555,8 +2191,10 @@ uint64_t send_data_message (int sock, const char * peer,
   int i;
   keyset * ks = NULL;
   int nks = all_keys (peer, &ks);
-  for (i = 0; i < nks; i++)
+  for (i = 0; i < nks; i++) {
     reload_unacked_cache (peer, ks [i]);
+    schedule_resend (peer, ks [i]);
+  }
   if (ks != NULL)
     free (ks);
 #ifdef DEBUG_PRINT
@@ -1570,8 +2208,10 @@ uint64_t send_data_message (int sock, const char * peer,
 /* resend any pending keys: at most once a minute, with the time increasing
  * in proportion to 1% of the time since the key was created */
 /* if not found, adds it to the list to be sent */
-/* returns 1 to resend, 0 to not resend */
-static int time_to_resend_key (keyset k, unsigned long long int now)
+/* returns 1 to resend, 0 to not resend.  Either way, lowers *next to
+ * the time at which the key should next be resent, if that is earlier */
+static int time_to_resend_key (keyset k, unsigned long long int now,
+                               unsigned long long int * next)
 {
   struct key_info {
     keyset k;
@@ -1592,12 +2232,14 @@ static int time_to_resend_key (keyset k, unsigned long long int now)
         (now - info [i].created_time) : DENOMINATOR;
       /* send at most once a minute, and at most every 1% of the
        * time since creation */
-      if (now > info [i].sent_time + (60 + alive / DENOMINATOR)) {
+      int resend = (now > info [i].sent_time + (60 + alive / DENOMINATOR));
+      if (resend)
         info [i].sent_time = now;
-        return 1;
-      } else {  /* found, but too soon to send */
-        return 0;
-      }
+      unsigned long long int due =
+        info [i].sent_time + (60 + alive / DENOMINATOR) + 1;
+      if (due < *next)
+        *next = due;
+      return resend;
 #undef DENOMINATOR
     }
   }  /* not found, add */
@@ -1623,11 +2265,18 @@ static int time_to_resend_key (keyset k, unsigned long long int now)
     }
     num_info++;
   }
+  if (now + 61 < *next)
+    *next = now + 61;
   return 1;  /* saved or not, send the key */
 }
 
-static void resend_pending_keys (int sock, unsigned long long int now)
+/* returns the time at which resend_pending_keys should next be called,
+ * when the first pending key is due.  New key exchanges change the
+ * keys_generation, so do_request_and_resend also calls it then */
+static unsigned long long int resend_pending_keys (int sock,
+                                                   unsigned long long int now)
 {
+  unsigned long long int next = now + RESEND_BACKOFF_MAX;
   char ** contacts = NULL;
   keyset * keys = NULL;
   int * status = NULL;
@@ -1637,7 +2286,7 @@ static void resend_pending_keys (int sock, unsigned long long int now)
     keyset k = keys [ic];
     /* we can only resend if there is an exchange file */
     if (((status [ic] & KEYS_INCOMPLETE_HAS_EXCHANGE_FILE) != 0) &&
-        (time_to_resend_key (k, now))) {
+        (time_to_resend_key (k, now, &next))) {
       char * content = NULL;
       incomplete_exchange_file (contacts [ic], k, &content, NULL);
       if (content != NULL) {
@@ -1663,6 +2312,7 @@ static void resend_pending_keys (int sock, unsigned long long int now)
     free (keys);
   if (status != NULL)
     free (status);
+  return next;
 }
 
 /* expiration must be at least ALLNET_TIME_SIZE, 8 bytes */
@@ -1687,11 +2337,10 @@ static void compute_expiration (char * expiration,
  *    1 if it sent a retransmit request
  *    2 if it sent one or more unacked packets, but no retransmit request
  */
-/* eagerly should be set when there is some chance that our peer is online,
- * i.e. when we've received a message or an ack from the peer.  In this
- * case, we retransmit and request data right away, independently of the
- * time since the last request */
-int request_and_resend (int sock, char * contact, keyset kset, int eagerly)
+/* due is set when do_request_and_resend finds that this keyset's
+ * deadline has passed, and allows resending unacked messages */
+static int resend_keyset (int sock, const char * contact, keyset kset,
+                          int eagerly, int due)
 {
   static unsigned long long int last_successful_call = 0;
   unsigned long long int now = allnet_time ();
@@ -1741,85 +2390,65 @@ int request_and_resend (int sock, char * contact, keyset kset, int eagerly)
                                  SLEEP_INCREASE_DENOMINATOR);
     }
   }
-  /* resend any unacked messages, but less than once per minute (or eagerly) */
-  static unsigned long long int last_resend = 0;
-  if (eagerly || (last_resend + 60 <= now)) {  /* ru_ means resend-unacked */
-    const char * ru_contact = contact;  /* don't change contact and kset */
-    keyset ru_kset = kset;              /* ru is for Resend Unacked */
-    int count = 1;
-    char ** contacts = NULL;
-    int send_to_all = (last_resend == 0);    /* first time, send to all */
-    if (send_to_all)
-      count = all_individual_contacts (&contacts);
-    int ic;
-    for (ic = 0; ic < count; ic++) {  /* only loops once, unless send_to_all */
-      if ((send_to_all) && (contacts != NULL))
-        ru_contact = contacts [ic];
-      keyset * kp = NULL;
-      int nk = 1;
-      if (send_to_all)
-        nk = all_keys (ru_contact, &kp);
-      int ik;
-      for (ik = 0; ik < nk; ik++) {  /* only loops once, unless send_to_all */
-        if ((send_to_all) && (kp != NULL))
-          ru_kset = kp [ik];
-        uint64_t sent_time;
-        uint64_t rcvd_time;
-        int msg_type_s = most_recent_record (ru_contact, ru_kset, MSG_TYPE_SENT,
-                                             NULL, &sent_time, NULL, NULL,
-                                             NULL, NULL, NULL);
-        int msg_type_r = most_recent_record (ru_contact, ru_kset, MSG_TYPE_RCVD,
-                                             NULL, NULL, NULL, &rcvd_time,
-                                             NULL, NULL, NULL);
-        if ((msg_type_s == MSG_TYPE_DONE) && (msg_type_r == MSG_TYPE_DONE))
-          continue;   /* next key, next contact, or done */
-        if (msg_type_s == MSG_TYPE_DONE) 
-          sent_time = rcvd_time;
-        else if (msg_type_r == MSG_TYPE_DONE) 
-          rcvd_time = sent_time;
-        long long int delta = ((sent_time > rcvd_time) ?
-                               now - sent_time : now - rcvd_time);
-        /* heuristic: the longer it's been since we've communicated with
-         * this contact, the less likely we should be to resend any unacked.
-         * we'd like to send with 10% probability if the contact hasn't been
-         * heard from in 10 days, 1% for 100 days, .1% for 1000 days, etc
-         * we represent 100% as 10^6, 10% as 10^5, etc.  If the time has
-         * been less than a day (86400 seconds), we always send */
-	long long int prob_millionths = 1000000;
-        unsigned long long int this_random = 0;  /* always send */
-        if (delta > 86400) {  /* more than 1 day, send with probability */
-	  prob_millionths = 86400000000LL / delta + 1;
-          this_random = random_int (0, 1000000);
-        }
-        if (prob_millionths > this_random) {
+  /* resend any unacked messages when this keyset is due (or eagerly) */
+  if (eagerly || due) {
+    uint64_t sent_time;
+    uint64_t rcvd_time;
+    int msg_type_s = most_recent_record (contact, kset, MSG_TYPE_SENT,
+                                         NULL, &sent_time, NULL, NULL,
+                                         NULL, NULL, NULL);
+    int msg_type_r = most_recent_record (contact, kset, MSG_TYPE_RCVD,
+                                         NULL, NULL, NULL, &rcvd_time,
+                                         NULL, NULL, NULL);
+    if ((msg_type_s != MSG_TYPE_DONE) || (msg_type_r != MSG_TYPE_DONE)) {
+      if (msg_type_s == MSG_TYPE_DONE) 
+        sent_time = rcvd_time;
+      else if (msg_type_r == MSG_TYPE_DONE) 
+        rcvd_time = sent_time;
+      long long int delta = ((sent_time > rcvd_time) ?
+                             now - sent_time : now - rcvd_time);
+      /* heuristic: the longer it's been since we've communicated with
+       * this contact, the less likely we should be to resend any unacked.
+       * we'd like to send with 10% probability if the contact hasn't been
+       * heard from in 10 days, 1% for 100 days, .1% for 1000 days, etc
+       * we represent 100% as 10^6, 10% as 10^5, etc.  If the time has
+       * been less than a day (86400 seconds), we always send */
+      long long int prob_millionths = 1000000;
+      unsigned long long int this_random = 0;  /* always send */
+      if (delta > 86400) {  /* more than 1 day, send with probability */
+        prob_millionths = 86400000000LL / delta + 1;
+        this_random = random_int (0, 1000000);
+      }
+      if (prob_millionths > this_random) {
 #ifdef DEBUG_PRINT
-          printf ("resending unacked to contact %s\n", ru_contact);
+        printf ("resending unacked to contact %s\n", contact);
 #endif /* DEBUG_PRINT */
-          if (resend_unacked (ru_contact, ru_kset, sock, hops,
-                              ALLNET_PRIORITY_LOCAL_LOW, 10) > 0) {
-            last_resend = now;
-            last_successful_call = now;
-            if (result != 1)
-              result = 2;
-          }
+        if (resend_unacked (contact, kset, sock, hops,
+                            ALLNET_PRIORITY_LOCAL_LOW, 10) > 0) {
+          last_successful_call = now;
+          if (result != 1)
+            result = 2;
         }
       }
-      if (kp != NULL)
-        free (kp);
     }
-    if (contacts != NULL)
-      free (contacts);
-  }
-  /* resend pending keys, not more (and usually less) than once per minute */
-  /* ignore eagerly, since it doesn't apply to incomplete key exchanges */
-  static unsigned long long int last_key_resend = 0;
-  if (last_key_resend + 60 <= now) {
-    resend_pending_keys (sock, now);
-    last_key_resend = now;
   }
   return result;
 }
 
+/* eagerly should be set when there is some chance that our peer is online,
+ * i.e. when we've received a message or an ack from the peer.  In this
+ * case, we retransmit and request data right away, independently of the
+ * time since the last request, and do_request_and_resend will check
+ * this keyset again within RESEND_BACKOFF_MIN seconds.  Otherwise,
+ * unacked messages are only resent by do_request_and_resend */
+int request_and_resend (int sock, char * contact, keyset kset, int eagerly)
+{
+  int result = resend_keyset (sock, contact, kset, eagerly, 0);
+  if (eagerly)
+    schedule_resend (contact, kset);
+  return result;
+}
+
 /* create the contact and key, and send
  * the public key followed by
  *   the hmac of the public key using the secret as the key for the hmac.
@@ -1931,8 +2560,9 @@ static int send_key_request (int sock, const char * phrase)
   unsigned int dsize = EMPTY_FINGERPRINT_SIZE + KEY_RANDOM_PAD_SIZE;
   unsigned int psize = 0;
   struct allnet_header * hp =
-    create_packet (dsize, ALLNET_TYPE_KEY_REQ, 10, ALLNET_SIGTYPE_NONE,
-                   source, ADDRESS_BITS, destination, 8, NULL, NULL, &psize);
+    create_pool_packet (dsize, ALLNET_TYPE_KEY_REQ, 10, ALLNET_SIGTYPE_NONE,
+                        source, ADDRESS_BITS, destination, 8, NULL, NULL,
+                        &psize);
   
   if (hp == NULL) {
     printf ("send_key_request: unable to create packet of size %d/%d\n",
@@ -1943,6 +2573,7 @@ static int send_key_request (int sock, const char * phrase)
   if (psize != hsize + dsize) {
     printf ("send_key_request error: psize %d != %d = %d + %d\n", psize,
             hsize + dsize, hsize, dsize);
+    allnet_packet_free (hp);
     return 0;
   }
   char * packet = (char *) hp;
@@ -1957,6 +2588,7 @@ static int send_key_request (int sock, const char * phrase)
   printf ("sending %d-byte key request\n", psize);
 #endif /* DEBUG_PRINT */
   int res = local_send (packet, psize, ALLNET_PRIORITY_LOCAL);
+  allnet_packet_free (packet);
   if (! res) {
     printf ("unable to send key request message\n");
     return 0;
@@ -17,6 +17,21 @@ extern int xchat_init (const char * program_name, const char * path);
 /* optional... */
 extern void xchat_end (int sock);
 
+/* xchat remembers the IDs of recently received data messages and acks,
+ * so duplicates are recognized without decrypting them again.  By
+ * default up to 16384 of each are remembered for up to a day.
+ * xchat_id_cache_size changes these (values <= 0 keep the current
+ * setting), and also forgets the IDs remembered so far */
+extern void xchat_id_cache_size (int count, int seconds);
+
+struct xchat_id_cache_stats {
+  uint64_t hits;       /* IDs found, i.e. duplicates */
+  uint64_t misses;     /* IDs not found */
+  uint64_t evictions;  /* IDs forgotten before expiring, to make room */
+};
+/* the counts for data message IDs if acks is 0, otherwise for acks */
+extern void xchat_id_cache_stats (int acks, struct xchat_id_cache_stats * s);
+
 /* only returns new acks, discarding acks received previously */
 struct allnet_ack_info {
   int num_acks;        /* num acks received */
@@ -80,23 +95,27 @@ extern int key_received_before (int sock, char ** peer, keyset * kset);
 extern int parse_exchange_file (const char * contact, int * nhops,
                                 char ** s1, char ** s2);
 
-/* if there is anyting unacked, resends it.  If any sequence number is known
- * to be missing, requests it */
+/* if any sequence number is known to be missing, requests it.
+ * If eagerly, also resends anything unacked */
 /* returns:
  *    -1 if it is too soon to request again
  *    0 if it it did not send a retransmit request for this contact/key
  *      (e.g. if nothing is known to be missing)
  *    1 if it sent a retransmit request
+ *    2 if it sent one or more unacked packets, but no retransmit request
  */
 /* eagerly should be set when there is some chance that our peer is online,
  * i.e. when we've received a message or an ack from the peer.  In this
  * case, we retransmit and request data right away, independently of the
- * time since the last request */
+ * time since the last request, and do_request_and_resend will check
+ * this contact and keyset again soon */
 extern int request_and_resend (int sock, char * peer, keyset kset, int eagerly);
 
 /* call every once in a while, e.g. every 1-10s, to poke all our
  * contacts and get any outstanding messages. */
-/* each time it is called, queries a different contact or keyset */
+/* each time it is called, handles only the keysets that are due.  Each
+ * keyset waits twice as long after each time it is handled, until
+ * request_and_resend is called eagerly or a message is sent to it */
 extern void do_request_and_resend (int sock);
 
 /* create the contact and key, and send
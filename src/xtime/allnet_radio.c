@@ -93,11 +93,22 @@ static int handle_packet (char * message, int msize, int * rcvd, int debug)
   struct bc_key_info * keys;
   int nkeys = get_other_keys (&keys);
   if ((nkeys > 0) && (ssize > 0) && (sig != NULL)) {
+    struct allnet_verify_request * requests =
+      malloc_or_fail (nkeys * sizeof (struct allnet_verify_request),
+                      "allnet_radio requests");
     int i;
     for (i = 0; i < nkeys; i++) {
-      if (allnet_verify (verif, vsize, sig, ssize, keys [i].pub_key))
+      struct allnet_verify_request request =
+        { .text = verif, .tsize = vsize, .sig = sig, .ssize = ssize,
+          .key = keys [i].pub_key, .verified = 0 };
+      requests [i] = request;
+    }
+    allnet_verify_batch (requests, nkeys);
+    for (i = 0; i < nkeys; i++) {
+      if (requests [i].verified)
         from = keys [i].identifier;
     }
+    free (requests);
   }
   if (strcmp (from, "unknown sender") == 0)
     printf ("got %d other keys, none matched %d %p\n", nkeys, ssize, sig);
@@ -3,6 +3,9 @@
 /* the second argument determines how many hops the messages are sent */
 /* if no argument is specified, the default is 10 hops */
 /* the third argument is the time interval, default 1 hour */
+/* with -c, announcements are authenticated with a hash chain (described
+ * in lib/media.h), and only the anchor of each chain is signed.  This saves
+ * a signature per announcement, and receivers only verify the anchor */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,8 +22,20 @@
 #include "lib/priority.h"
 #include "lib/cipher.h"
 #include "lib/keys.h"
+#include "lib/sha.h"
 #include "lib/allnet_log.h"
 
+#define XTIME_CHAIN_LENGTH	168	/* ticks per chain, a week of hours */
+#define XTIME_ANCHOR_REPEAT	6	/* resend the anchor every few ticks */
+
+static struct xtime_chain {
+  char keys [XTIME_CHAIN_LENGTH + 1] [ALLNET_TIME_CHAIN_KEY_SIZE];
+  time_t start;                 /* allnet time of tick 0 */
+  time_t interval;
+  char anchor [ALLNET_MTU];     /* the signed anchor packet */
+  int anchor_size;              /* 0 before the first chain is made */
+} chain;
+
 static void wait_until (time_t end_time)
 {
   /* compute how long to wait for */
@@ -115,12 +130,15 @@ static int time_to_buf (time_t t, char * dp, int n)
   return TIMESTAMP_SIZE;
 }
 
-/* returns -1 for errors, otherwise the size of the announcement */
+/* returns -1 for errors, otherwise the size of the announcement
+ * if tick is not NULL, the announcement is sent as a hash chain tick
+ * instead of being signed */
 static int make_announcement (char * buffer, int n,
                               time_t send, time_t expiration, int hops,
                               allnet_rsa_prvkey key,
                               unsigned char * source, int sbits,
                               unsigned char * dest, int dbits,
+                              const struct allnet_time_chain_tick * tick,
                               struct allnet_log * log)
 {
   int hsize = ALLNET_SIZE (ALLNET_TRANSPORT_EXPIRATION);
@@ -156,8 +174,13 @@ static int make_announcement (char * buffer, int n,
   int ssize = 0;
   int dsize = time_to_buf (send, dp, TIMESTAMP_SIZE);
   char * sig;
-  ssize = allnet_sign (dp, TIMESTAMP_SIZE, key, &sig);
-  if (ssize > 0) {
+  if (tick != NULL) {   /* authenticated by the hash chain */
+    struct allnet_app_media_header * amhp =
+      (struct allnet_app_media_header *) dp;
+    writeb32u (amhp->media, ALLNET_MEDIA_TIME_CHAIN_TICK);
+    memcpy (dp + dsize, tick, sizeof (struct allnet_time_chain_tick));
+    dsize += sizeof (struct allnet_time_chain_tick);
+  } else if ((ssize = allnet_sign (dp, TIMESTAMP_SIZE, key, &sig)) > 0) {
     int size = hsize + TIMESTAMP_SIZE + ssize + 2;
     if (size > n) {
       printf ("error, buffer size %d, wanted %d, not adding sig\n", n, size);
@@ -180,10 +203,73 @@ static int make_announcement (char * buffer, int n,
   return hsize + dsize + ssize;
 }
 
-static void announce (time_t interval, int hops, allnet_rsa_prvkey key,
+/* make a new hash chain whose tick 0 is at the given allnet time, and
+ * sign its anchor.  returns 1 for success, 0 for failure */
+static int new_chain (time_t start, time_t interval, int hops,
+                      allnet_rsa_prvkey key,
                       unsigned char * source, int sbits,
                       unsigned char * dest, int dbits,
                       struct allnet_log * log)
+{
+  random_bytes (chain.keys [XTIME_CHAIN_LENGTH], ALLNET_TIME_CHAIN_KEY_SIZE);
+  int i;
+  for (i = XTIME_CHAIN_LENGTH - 1; i >= 0; i--)
+    sha512_bytes (chain.keys [i + 1], ALLNET_TIME_CHAIN_KEY_SIZE,
+                  chain.keys [i], ALLNET_TIME_CHAIN_KEY_SIZE);
+  chain.start = start;
+  chain.interval = interval;
+  chain.anchor_size = 0;
+
+  char * buffer = chain.anchor;
+  int n = sizeof (chain.anchor);
+  memset (buffer, 0, n);
+  struct allnet_header * hp =
+    init_packet (buffer, n, ALLNET_TYPE_CLEAR, hops, ALLNET_SIGTYPE_RSA_PKCS1,
+                 source, sbits, dest, dbits, NULL, NULL);
+  if (hp == NULL)
+    return 0;
+  hp->transport |= ALLNET_TRANSPORT_EXPIRATION;
+  int hsize = ALLNET_SIZE (hp->transport);
+  char * dp = buffer + hsize;
+  struct allnet_app_media_header * amhp = (struct allnet_app_media_header *) dp;
+  writeb32u (amhp->app, 0x7874696d /* xtim */ );
+  writeb32u (amhp->media, ALLNET_MEDIA_TIME_CHAIN_ANCHOR);
+  struct allnet_time_chain_anchor * ap = (struct allnet_time_chain_anchor *)
+    (dp + sizeof (struct allnet_app_media_header));
+  writeb64u (ap->start, start);
+  writeb32u (ap->interval, interval);
+  writeb32u (ap->count, XTIME_CHAIN_LENGTH);
+  memcpy (ap->key, chain.keys [0], ALLNET_TIME_CHAIN_KEY_SIZE);
+  int dsize = sizeof (struct allnet_app_media_header) +
+              sizeof (struct allnet_time_chain_anchor);
+  char * sig;
+  int ssize = allnet_sign (dp, dsize, key, &sig);
+  if (ssize <= 0) {
+    snprintf (log->b, log->s, "error: unable to sign hash chain anchor\n");
+    log_print (log);
+    return 0;
+  }
+  if (hsize + dsize + ssize + 2 > n) {
+    printf ("error, buffer size %d, wanted %d for anchor\n", n,
+            hsize + dsize + ssize + 2);
+    free (sig);
+    return 0;
+  }
+  memcpy (dp + dsize, sig, ssize);
+  writeb16 (dp + dsize + ssize, ssize);
+  free (sig);
+  char * e = ALLNET_EXPIRATION(hp, hp->transport, (unsigned int) n);
+  if (e != NULL)
+    binary_time_to_buf (start + (XTIME_CHAIN_LENGTH + 1) * interval,
+                        e, ALLNET_TIME_SIZE);
+  chain.anchor_size = hsize + dsize + ssize + 2;
+  return 1;
+}
+
+static void announce (time_t interval, int hops, allnet_rsa_prvkey key,
+                      unsigned char * source, int sbits,
+                      unsigned char * dest, int dbits, int use_chain,
+                      struct allnet_log * log)
 {
   static int called_before = 0;
   struct timeval now;
@@ -195,11 +281,35 @@ static void announce (time_t interval, int hops, allnet_rsa_prvkey key,
   static char buffer [ALLNET_MTU];
   memset (buffer, 0, sizeof (buffer));
 
+  struct allnet_time_chain_tick tick;
+  int index = 0;
+  if (use_chain) {
+    time_t t = announce_time - ALLNET_Y2K_SECONDS_IN_UNIX;
+    if ((chain.anchor_size > 0) && (chain.interval == interval) &&
+        (t > chain.start))
+      index = (t - chain.start) / interval;
+    /* start a new chain when this one is used up, or if we skipped
+     * to a time that is not a tick of this chain */
+    if ((index < 1) || (index > XTIME_CHAIN_LENGTH) ||
+        (chain.start + index * interval != t)) {
+      if (! new_chain (t - interval, interval, hops, key,
+                       source, sbits, dest, dbits, log)) {
+        printf ("unable to create hash chain\n");
+        exit (1);
+      }
+      /* so receivers can check the first tick as soon as it arrives */
+      local_send (chain.anchor, chain.anchor_size, ALLNET_PRIORITY_LOCAL);
+      index = 1;
+    }
+    writeb32u (tick.index, index);
+    memcpy (tick.key, chain.keys [index], ALLNET_TIME_CHAIN_KEY_SIZE);
+  }
   int blen = make_announcement (buffer, sizeof (buffer),
                                 announce_time - ALLNET_Y2K_SECONDS_IN_UNIX,
                                 announce_time + interval -
                                   ALLNET_Y2K_SECONDS_IN_UNIX,
-                                hops, key, source, sbits, dest, dbits, log);
+                                hops, key, source, sbits, dest, dbits,
+                                (use_chain ? &tick : NULL), log);
   if (blen <= 0) {
     printf ("unknown error: make_announcement returned %d\n", blen);
     snprintf (log->b, log->s,
@@ -212,6 +322,9 @@ static void announce (time_t interval, int hops, allnet_rsa_prvkey key,
 
   /* send with fairly high priority, since the message is time-sensitive */
   local_send (buffer, blen, ALLNET_PRIORITY_LOCAL);
+  /* for receivers that missed the earlier copies */
+  if (use_chain && (index % XTIME_ANCHOR_REPEAT == 0))
+    local_send (chain.anchor, chain.anchor_size, ALLNET_PRIORITY_LOCAL);
 
   struct timeval tv;
   gettimeofday (&tv, NULL);
@@ -233,6 +346,7 @@ int main (int argc, char ** argv)
 {
   struct allnet_log * log = init_log ("xtime");
   log_to_output (get_option ('v', &argc, argv));
+  int use_chain = get_option ('c', &argc, argv);
   int hops = 10;
   if (argc < 2) {
     printf ("%s: needs at least a signing address\n", argv [0]);
@@ -256,5 +370,6 @@ int main (int argc, char ** argv)
 
   while (1)
     announce (interval, hops, key->prv_key,
-              key->address, ADDRESS_BITS, key->address, ADDRESS_BITS, log);
+              key->address, ADDRESS_BITS, key->address, ADDRESS_BITS,
+              use_chain, log);
 }